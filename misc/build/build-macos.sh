@@ -40,7 +40,7 @@ cmake -B build \
 
 cmake --build build -j `sysctl -n hw.logicalcpu` --target install
 cd build
-ctest --output-on-failure
+ctest -LE perf --output-on-failure
 cd ..
 
 ./misc/build/macos/bundle.sh
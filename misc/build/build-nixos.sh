@@ -14,5 +14,5 @@ cmake -B build -G Ninja \
 cmake --build build --target install
 
 cd build
-ctest --output-on-failure
+ctest -LE perf --output-on-failure
 cd ..
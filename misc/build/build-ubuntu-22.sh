@@ -38,5 +38,5 @@ cmake -B build \
 
 cmake --build build -j $(nproc) --target install
 cd build
-ctest --output-on-failure
+ctest -LE perf --output-on-failure
 cd ..
@@ -3,8 +3,23 @@
 
 #include "xpano/cli/args.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+
 #include <catch2/catch_test_macros.hpp>
 
+#include "xpano/cli/batch.h"
+#include "xpano/cli/jobs.h"
+#include "xpano/cli/stream.h"
+#include "xpano/cli/watch.h"
+#include "xpano/utils/path.h"
+
 #include "tests/utils.h"
 
 TEST_CASE("Args parse empty") {
@@ -43,6 +58,15 @@ TEST_CASE("Args parse gui") {
   REQUIRE(args->input_paths[1] == "input2.jpg");
   REQUIRE(!args->output_path);
   REQUIRE(args->run_gui == true);
+  REQUIRE(args->warm_up);
+}
+
+TEST_CASE("Args parse no warm up") {
+  auto test_args = xpano::tests::Args("xpano", "--gui", "--no-warm-up");
+
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(!args->warm_up);
 }
 
 TEST_CASE("Args parse help") {
@@ -103,3 +127,583 @@ TEST_CASE("Args parse gui and output incompatible") {
   auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
   REQUIRE(!args);
 }
+
+TEST_CASE("Args parse seam finder") {
+  auto test_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                      "--output=output.jpg",
+                                      "--seam-finder=voronoi");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->seam_finder == xpano::algorithm::SeamFinderType::kVoronoi);
+}
+
+TEST_CASE("Args parse max memory") {
+  auto test_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                      "--output=output.jpg",
+                                      "--max-memory-mb=4096");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->max_memory_mb == 4096);
+}
+
+TEST_CASE("Args parse device resident") {
+  auto test_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                      "--output=output.jpg",
+                                      "--device-resident");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->device_resident);
+}
+
+TEST_CASE("Args parse modern formats") {
+  auto test_args = xpano::tests::Args(
+      "xpano", "input1.jpg", "input2.jpg", "--output=output.JXL",
+      "--encoder-quality=100", "--encoder-effort=3");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->encoder_quality == 100);
+  REQUIRE(args->encoder_effort == 3);
+
+  for (const auto* output : {"--output=output.avif", "--output=output.webp"}) {
+    auto format_args =
+        xpano::tests::Args("xpano", "input1.jpg", "input2.jpg", output);
+    CHECK(xpano::cli::ParseArgs(format_args.GetArgc(), format_args.GetArgv()));
+  }
+
+  auto invalid_effort = xpano::tests::Args(
+      "xpano", "input1.jpg", "--output=output.webp", "--encoder-effort=0");
+  REQUIRE(!xpano::cli::ParseArgs(invalid_effort.GetArgc(),
+                                 invalid_effort.GetArgv()));
+  auto invalid_quality = xpano::tests::Args(
+      "xpano", "input1.jpg", "--output=output.avif", "--encoder-quality=101");
+  REQUIRE(!xpano::cli::ParseArgs(invalid_quality.GetArgc(),
+                                 invalid_quality.GetArgv()));
+}
+
+TEST_CASE("Args parse resources") {
+  auto test_args =
+      xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                         "--output=output.jpg", "--threads=8", "--cpus=0-3,8");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->threads == 8);
+  REQUIRE(args->cpus == std::vector{0, 1, 2, 3, 8});
+
+  auto too_few_threads = xpano::tests::Args(
+      "xpano", "input1.jpg", "--output=output.jpg", "--threads=1");
+  REQUIRE(!xpano::cli::ParseArgs(too_few_threads.GetArgc(),
+                                 too_few_threads.GetArgv()));
+
+  auto invalid_cpus = xpano::tests::Args("xpano", "input1.jpg",
+                                         "--output=output.jpg", "--cpus=3-1");
+  REQUIRE(
+      !xpano::cli::ParseArgs(invalid_cpus.GetArgc(), invalid_cpus.GetArgv()));
+}
+
+TEST_CASE("Args parse adaptive neighborhood") {
+  auto test_args =
+      xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                         "--output=output.jpg", "--adaptive-neighborhood");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->adaptive_neighborhood);
+}
+
+TEST_CASE("Args parse coarse to fine") {
+  auto test_args =
+      xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                         "--output=output.jpg", "--coarse-to-fine");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->coarse_to_fine);
+}
+
+TEST_CASE("Args parse lens") {
+  auto test_args = xpano::tests::Args(
+      "xpano", "input1.jpg", "input2.jpg", "--output=output.jpg",
+      "--lens=-0.1,0.02", "--lens-profile=Canon EF 16-35mm:-0.2,0.05");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->lens_profiles.size() == 2);
+  CHECK(args->lens_profiles[0] ==
+        xpano::algorithm::LensProfile{.k1 = -0.1f, .k2 = 0.02f});
+  CHECK(args->lens_profiles[1] ==
+        xpano::algorithm::LensProfile{
+            .model = "Canon EF 16-35mm", .k1 = -0.2f, .k2 = 0.05f});
+}
+
+TEST_CASE("Args parse invalid lens") {
+  auto test_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                      "--output=output.jpg", "--lens=-0.1");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  CHECK(!args);
+
+  auto large_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                       "--output=output.jpg", "--lens=5,0");
+  CHECK(!xpano::cli::ParseArgs(large_args.GetArgc(), large_args.GetArgv()));
+
+  auto no_model_args =
+      xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                         "--output=output.jpg", "--lens-profile=:0.1,0");
+  CHECK(!xpano::cli::ParseArgs(no_model_args.GetArgc(),
+                               no_model_args.GetArgv()));
+}
+
+TEST_CASE("Args parse grid") {
+  auto test_args = xpano::tests::Args(
+      "xpano", "input1.jpg", "input2.jpg", "--output=output.jpg",
+      "--grid=8x3", "--grid-order=columns", "--grid-diagonals");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->grid);
+  REQUIRE(args->grid->cols == 8);
+  REQUIRE(args->grid->rows == 3);
+  REQUIRE(args->grid_order == xpano::algorithm::GridOrder::kColumns);
+  REQUIRE(args->grid_diagonals);
+
+  auto invalid_grid = xpano::tests::Args("xpano", "input1.jpg",
+                                         "--output=output.jpg", "--grid=8");
+  REQUIRE(
+      !xpano::cli::ParseArgs(invalid_grid.GetArgc(), invalid_grid.GetArgv()));
+
+  auto missing_grid = xpano::tests::Args(
+      "xpano", "input1.jpg", "--output=output.jpg", "--matching-type=grid");
+  REQUIRE(
+      !xpano::cli::ParseArgs(missing_grid.GetArgc(), missing_grid.GetArgv()));
+
+  auto other_type = xpano::tests::Args("xpano", "input1.jpg",
+                                       "--output=output.jpg", "--grid=2x2",
+                                       "--matching-type=single");
+  REQUIRE(!xpano::cli::ParseArgs(other_type.GetArgc(), other_type.GetArgv()));
+}
+
+TEST_CASE("Args parse tiled") {
+  auto test_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                      "--output=output.tif", "--tiled");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->tiled);
+}
+
+TEST_CASE("Args parse tiff overviews") {
+  auto test_args =
+      xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                         "--output=output.tif", "--tiled", "--tiff-overviews");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->tiff_overviews);
+
+  auto untiled_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                         "--output=output.tif",
+                                         "--tiff-overviews");
+  REQUIRE(!xpano::cli::ParseArgs(untiled_args.GetArgc(),
+                                 untiled_args.GetArgv()));
+}
+
+TEST_CASE("Args parse shard") {
+  auto test_args = xpano::tests::Args(
+      "xpano", "input1.jpg", "input2.jpg", "--output=output.tif", "--tiled",
+      "--checkpoint-dir=checkpoints", "--shard=2/3");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->shard);
+  CHECK(args->shard->index == 1);
+  CHECK(args->shard->count == 3);
+
+  auto invalid_args = xpano::tests::Args(
+      "xpano", "input1.jpg", "--output=output.tif", "--tiled",
+      "--checkpoint-dir=checkpoints", "--shard=4/3");
+  CHECK(!xpano::cli::ParseArgs(invalid_args.GetArgc(),
+                               invalid_args.GetArgv()));
+
+  auto untiled_args =
+      xpano::tests::Args("xpano", "input1.jpg", "--output=output.tif",
+                         "--checkpoint-dir=checkpoints", "--shard=1/3");
+  CHECK(!xpano::cli::ParseArgs(untiled_args.GetArgc(),
+                               untiled_args.GetArgv()));
+}
+
+TEST_CASE("Args parse tiled needs tiff output") {
+  auto test_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                      "--output=output.jpg", "--tiled");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(!args);
+}
+
+TEST_CASE("Args parse feature") {
+  auto test_args =
+      xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                         "--output=output.jpg", "--feature=orb",
+                         "--num-features=1000");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->feature == xpano::algorithm::FeatureType::kOrb);
+  REQUIRE(args->num_features == 1000);
+}
+
+TEST_CASE("Args parse num features out of range") {
+  auto test_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                      "--output=output.jpg",
+                                      "--num-features=10");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(!args);
+}
+
+TEST_CASE("Args parse all panos") {
+  auto test_args =
+      xpano::tests::Args("xpano", "input1.jpg", "input2.jpg", "--all-panos");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->all_panos);
+
+  auto output_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                        "--all-panos", "--output=output.jpg");
+  REQUIRE(!xpano::cli::ParseArgs(output_args.GetArgc(),
+                                 output_args.GetArgv()));
+}
+
+TEST_CASE("Args parse trace") {
+  auto test_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                      "--trace=trace.json");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->trace_path == std::filesystem::path("trace.json"));
+}
+
+TEST_CASE("Args parse report") {
+  auto test_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                      "--report=report.json");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->report_path == std::filesystem::path("report.json"));
+
+  auto gui_args = xpano::tests::Args("xpano", "input1.jpg", "--gui",
+                                     "--report=report.json");
+  REQUIRE(!xpano::cli::ParseArgs(gui_args.GetArgc(), gui_args.GetArgv()));
+}
+
+TEST_CASE("Args parse checkpoint dir") {
+  auto test_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                      "--checkpoint-dir=checkpoints");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->checkpoint_dir == std::filesystem::path("checkpoints"));
+
+  auto preview_args = xpano::tests::Args("xpano", "input1.jpg", "--no-full-res",
+                                         "--checkpoint-dir=checkpoints");
+  REQUIRE(!xpano::cli::ParseArgs(preview_args.GetArgc(),
+                                 preview_args.GetArgv()));
+}
+
+TEST_CASE("Args parse spill dir") {
+  auto test_args = xpano::tests::Args("xpano", "input1.jpg", "input2.jpg",
+                                      "--spill-dir=scratch");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  REQUIRE(args->spill_dir == std::filesystem::path("scratch"));
+
+  auto gui_args =
+      xpano::tests::Args("xpano", "--gui", "--spill-dir=scratch");
+  REQUIRE(!xpano::cli::ParseArgs(gui_args.GetArgc(), gui_args.GetArgv()));
+}
+
+TEST_CASE("Args parse watch") {
+  const std::filesystem::path dir = "watch_test_dir";
+  std::filesystem::create_directory(dir);
+
+  auto test_args = xpano::tests::Args("xpano", "--watch=watch_test_dir",
+                                      "--quiet-period=30");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  CHECK(args->watch_dir == dir);
+  CHECK(args->quiet_period_s == 30);
+
+  auto input_args =
+      xpano::tests::Args("xpano", "input1.jpg", "--watch=watch_test_dir");
+  CHECK(!xpano::cli::ParseArgs(input_args.GetArgc(), input_args.GetArgv()));
+
+  auto missing_args = xpano::tests::Args("xpano", "--watch=missing_dir");
+  CHECK(!xpano::cli::ParseArgs(missing_args.GetArgc(),
+                               missing_args.GetArgv()));
+
+  auto quiet_args = xpano::tests::Args("xpano", "--quiet-period=30");
+  CHECK(!xpano::cli::ParseArgs(quiet_args.GetArgc(), quiet_args.GetArgv()));
+
+  std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Args parse jobs") {
+  const std::filesystem::path jobs_path = "jobs_test.json";
+  std::ofstream(jobs_path) << "[]";
+
+  auto test_args =
+      xpano::tests::Args("xpano", "--jobs=jobs_test.json", "--all-panos");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  CHECK(args->jobs_path == jobs_path);
+
+  auto output_args = xpano::tests::Args("xpano", "--jobs=jobs_test.json",
+                                        "--output=output.jpg");
+  CHECK(!xpano::cli::ParseArgs(output_args.GetArgc(), output_args.GetArgv()));
+
+  auto missing_args = xpano::tests::Args("xpano", "--jobs=missing.json");
+  CHECK(!xpano::cli::ParseArgs(missing_args.GetArgc(),
+                               missing_args.GetArgv()));
+
+  std::filesystem::remove(jobs_path);
+}
+
+TEST_CASE("Args parse stdin") {
+  auto test_args = xpano::tests::Args("xpano", "--stdin", "--output=-");
+  auto args = xpano::cli::ParseArgs(test_args.GetArgc(), test_args.GetArgv());
+  REQUIRE(args);
+  CHECK(args->read_stdin);
+  REQUIRE(args->output_path);
+  CHECK(xpano::cli::IsStdout(*args->output_path));
+
+  auto png_args = xpano::tests::Args("xpano", "--stdin", "--output=-.png");
+  CHECK(xpano::cli::ParseArgs(png_args.GetArgc(), png_args.GetArgv()));
+  CHECK(!xpano::cli::IsStdout("out/-.png"));
+
+  auto input_args = xpano::tests::Args("xpano", "input1.jpg", "--stdin");
+  CHECK(!xpano::cli::ParseArgs(input_args.GetArgc(), input_args.GetArgv()));
+
+  auto tiled_args =
+      xpano::tests::Args("xpano", "--stdin", "--output=-.tif", "--tiled");
+  CHECK(!xpano::cli::ParseArgs(tiled_args.GetArgc(), tiled_args.GetArgv()));
+
+  auto format_args = xpano::tests::Args("xpano", "--stdin", "--output=-.txt");
+  CHECK(!xpano::cli::ParseArgs(format_args.GetArgc(), format_args.GetArgv()));
+}
+
+namespace {
+
+std::string Frame(const std::string& bytes) {
+  std::string frame(8, '\0');
+  for (int i = 0; i < 8; i++) {
+    frame[i] = static_cast<char>((std::uint64_t{bytes.size()} >> (8 * i)) &
+                                 0xff);
+  }
+  return frame + bytes;
+}
+
+std::string TarEntry(const std::string& name, const std::string& bytes) {
+  std::string header(512, '\0');
+  std::copy(name.begin(), name.end(), header.begin());
+  char size[12];
+  std::snprintf(size, sizeof(size), "%011o",
+                static_cast<unsigned>(bytes.size()));
+  std::copy(size, size + 11, header.begin() + 124);
+  header[156] = '0';
+  const std::string magic = "ustar";
+  std::copy(magic.begin(), magic.end(), header.begin() + 257);
+  return header + bytes + std::string((512 - bytes.size() % 512) % 512, '\0');
+}
+
+}  // namespace
+
+TEST_CASE("Streamed files") {
+  std::istringstream frames(Frame("\xff\xd8jpeg") + Frame("\x89PNG") +
+                            Frame(""));
+  auto files = xpano::cli::ReadStreamedFiles(&frames);
+  REQUIRE(files);
+  REQUIRE(files->size() == 3);
+  CHECK((*files)[0].name == "stdin_1.jpg");
+  CHECK((*files)[0].bytes.size() == 6);
+  CHECK((*files)[1].name == "stdin_2.png");
+  CHECK((*files)[2].bytes.empty());
+
+  std::istringstream tar(TarEntry("a.jpg", "jpeg") +
+                         TarEntry("notes.txt", "notes") +
+                         TarEntry("b.png", std::string(600, 'p')) +
+                         std::string(1024, '\0'));
+  files = xpano::cli::ReadStreamedFiles(&tar);
+  REQUIRE(files);
+  REQUIRE(files->size() == 2);
+  CHECK((*files)[0].name == "a.jpg");
+  CHECK((*files)[0].bytes.size() == 4);
+  CHECK((*files)[1].name == "b.png");
+  CHECK((*files)[1].bytes.size() == 600);
+
+  std::istringstream empty;
+  files = xpano::cli::ReadStreamedFiles(&empty);
+  REQUIRE(files);
+  CHECK(files->empty());
+
+  std::istringstream truncated(Frame("jpeg").substr(0, 10));
+  CHECK(!xpano::cli::ReadStreamedFiles(&truncated));
+}
+
+TEST_CASE("Watched folder") {
+  const auto dir = xpano::tests::TmpPath();
+  std::filesystem::create_directory(dir);
+  std::ofstream(dir / "a.jpg") << "a";
+  std::ofstream(dir / "notes.txt") << "notes";
+
+  xpano::cli::WatchedFolder folder(dir);
+  folder.Ignore(dir / "a_pano.jpg");
+  // Seen for the first time
+  CHECK(folder.Poll().empty());
+  std::ofstream(dir / "a_pano.jpg") << "pano";
+  std::ofstream(dir / "b.jpg") << "b";
+  CHECK(folder.Poll() == std::vector{dir / "a.jpg"});
+  // Still being written
+  std::ofstream(dir / "b.jpg", std::ios::app) << "b";
+  CHECK(folder.Poll().empty());
+  CHECK(folder.Poll() == std::vector{dir / "b.jpg"});
+  CHECK(folder.Poll().empty());
+
+  std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Jobs file") {
+  const auto dir = xpano::tests::TmpPath();
+  std::filesystem::create_directories(dir / "shoot1");
+  std::ofstream(dir / "shoot1" / "img10.jpg") << "10";
+  std::ofstream(dir / "shoot1" / "img2.jpg") << "2";
+  std::ofstream(dir / "shoot1" / "notes.txt") << "notes";
+  std::ofstream(dir / "a.jpg") << "a";
+
+  auto jobs = xpano::cli::ParseJobs(
+      R"([ "shoot1",
+           {"inputs": ["a.jpg", "b.txt"], "output": "out/\u0061.tif"},
+           {"output": "c.jpg", "inputs": "shoot1"} ])",
+      dir);
+  REQUIRE(jobs);
+  REQUIRE(jobs->size() == 3);
+  CHECK((*jobs)[0].input_paths ==
+        std::vector{dir / "shoot1" / "img2.jpg", dir / "shoot1" / "img10.jpg"});
+  CHECK(!(*jobs)[0].output_path);
+  CHECK((*jobs)[1].input_paths == std::vector{dir / "a.jpg"});
+  CHECK((*jobs)[1].output_path == dir / "out" / "a.tif");
+  CHECK((*jobs)[2].input_paths.size() == 2);
+
+  CHECK(xpano::cli::ParseJobs("[]", dir)->empty());
+  CHECK(!xpano::cli::ParseJobs(R"(["shoot1",])", dir));
+  CHECK(!xpano::cli::ParseJobs(R"([{"input": "shoot1"}])", dir));
+  CHECK(!xpano::cli::ParseJobs(R"(["shoot1"] [])", dir));
+  // No supported images or output
+  CHECK(!xpano::cli::ParseJobs(R"(["missing"])", dir));
+  CHECK(!xpano::cli::ParseJobs(R"([{"inputs": "a.jpg", "output": "a.txt"}])",
+                               dir));
+
+  std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Job queue") {
+  xpano::cli::JobQueue queue(4, 2);
+  CHECK(queue.NextLoad() == 0);
+  // One job loading at a time
+  CHECK(!queue.NextLoad());
+  queue.Loaded(0, 2);
+  CHECK(queue.NextLoad() == 1);
+  queue.Loaded(1, 1);
+  // Two loaded jobs waiting
+  CHECK(!queue.NextLoad());
+  queue.Started(1);
+  CHECK(queue.NextLoad() == 2);
+  // Without panos, doesn't wait
+  queue.Loaded(2, 0);
+  CHECK(queue.NextLoad() == 3);
+  CHECK(!queue.AllLoaded());
+  queue.Loaded(3, 1);
+  CHECK(queue.AllLoaded());
+  CHECK(!queue.NextLoad());
+}
+
+TEST_CASE("Natural path order") {
+  using xpano::utils::path::NaturalLess;
+  CHECK(NaturalLess("img2.jpg", "img10.jpg"));
+  CHECK_FALSE(NaturalLess("img10.jpg", "img2.jpg"));
+  CHECK(NaturalLess("IMG_0009.jpg", "img_10.jpg"));
+  CHECK(NaturalLess("a.jpg", "B.jpg"));
+  CHECK(NaturalLess("img1.jpg", "img01.jpg") !=
+        NaturalLess("img01.jpg", "img1.jpg"));
+
+  const auto dir = xpano::tests::TmpPath();
+  std::filesystem::create_directory(dir);
+  std::ofstream(dir / "img10.jpg") << "10";
+  std::ofstream(dir / "img2.jpg") << "2";
+  std::ofstream(dir / "img1.png") << "1";
+  std::ofstream(dir / "notes.txt") << "notes";
+  std::filesystem::create_directory(dir / "sub.jpg");
+
+  CHECK(xpano::utils::path::ListSupported(dir) ==
+        std::vector{dir / "img1.png", dir / "img2.jpg", dir / "img10.jpg"});
+
+  std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Quiet panos") {
+  using namespace std::chrono_literals;
+  using Paths = std::vector<std::filesystem::path>;
+  const auto start = xpano::cli::QuietPanos::Clock::now();
+  xpano::cli::QuietPanos panos(10s);
+
+  panos.Update({Paths{"a.jpg", "b.jpg"}}, start);
+  CHECK(panos.Ready(start + 5s).empty());
+  CHECK(panos.Ready(start + 10s) == std::vector{0});
+  panos.MarkStitched(0);
+  CHECK(panos.Ready(start + 11s).empty());
+
+  // The stitched pano got another image, the other one is new
+  panos.Update({Paths{"c.jpg", "d.jpg"}, Paths{"a.jpg", "b.jpg", "e.jpg"}},
+               start + 12s);
+  CHECK(panos.Ready(start + 20s).empty());
+  CHECK(panos.Ready(start + 22s) == std::vector{0, 1});
+
+  // Unchanged panos keep their state
+  panos.MarkStitched(1);
+  panos.Update({Paths{"c.jpg", "d.jpg"}, Paths{"a.jpg", "b.jpg", "e.jpg"}},
+               start + 30s);
+  CHECK(panos.Ready(start + 30s) == std::vector{0});
+}
+
+TEST_CASE("Batch scheduler") {
+  SECTION("cpu limit") {
+    xpano::cli::BatchScheduler scheduler({100, 100, 100}, 2, 0);
+    CHECK(scheduler.Next() == 0);
+    CHECK(scheduler.Next() == 1);
+    CHECK(!scheduler.Next());
+    scheduler.Finish(0);
+    CHECK(scheduler.Next() == 2);
+    CHECK(!scheduler.Next());
+    scheduler.Finish(1);
+    scheduler.Finish(2);
+    CHECK(scheduler.Done());
+  }
+
+  SECTION("memory limit") {
+    xpano::cli::BatchScheduler scheduler({300, 600, 200, 2000}, 4, 1000);
+    CHECK(scheduler.Next() == 0);
+    CHECK(scheduler.Next() == 1);
+    // In order, waits for the memory
+    CHECK(!scheduler.Next());
+    CHECK(scheduler.NumRunning() == 2);
+    scheduler.Finish(1);
+    CHECK(scheduler.Next() == 2);
+    // Over the whole budget, runs alone
+    CHECK(!scheduler.Next());
+    scheduler.Finish(0);
+    CHECK(!scheduler.Next());
+    scheduler.Finish(2);
+    CHECK(scheduler.Next() == 3);
+    CHECK(!scheduler.Done());
+    scheduler.Finish(3);
+    CHECK(scheduler.Done());
+  }
+
+  SECTION("added later") {
+    xpano::cli::BatchScheduler scheduler({}, 2, 0);
+    CHECK(scheduler.Done());
+    CHECK(scheduler.Add(100) == 0);
+    CHECK(!scheduler.Done());
+    CHECK(scheduler.Next() == 0);
+    CHECK(!scheduler.Next());
+    CHECK(scheduler.Add(100) == 1);
+    CHECK(scheduler.Next() == 1);
+    scheduler.Finish(0);
+    scheduler.Finish(1);
+    CHECK(scheduler.Done());
+  }
+}
@@ -3,16 +3,49 @@
 
 #include "xpano/algorithm/auto_crop.h"
 
+#include <algorithm>
+
 #include <catch2/catch_test_macros.hpp>
 #include <opencv2/core.hpp>
 #include <opencv2/imgcodecs.hpp>
 
+#include "xpano/algorithm/rle_mask.h"
+#include "xpano/utils/rect.h"
 #include "xpano/utils/vec.h"
 
 using xpano::algorithm::crop::FindLargestCrop;
+using xpano::algorithm::RleMask;
 using xpano::algorithm::crop::kMaskValueOn;
 using xpano::utils::Point2i;
 
+namespace {
+
+// Brute force over all rectangles, the expected area
+int LargestCropArea(const cv::Mat& mask) {
+  int largest = 0;
+  for (int top = 0; top < mask.rows; top++) {
+    for (int left = 0; left < mask.cols; left++) {
+      for (int bottom = top + 1; bottom <= mask.rows; bottom++) {
+        for (int right = left + 1; right <= mask.cols; right++) {
+          const auto rect = cv::Rect(left, top, right - left, bottom - top);
+          if (cv::countNonZero(mask(rect) == kMaskValueOn) == rect.area()) {
+            largest = std::max(largest, rect.area());
+          }
+        }
+      }
+    }
+  }
+  return largest;
+}
+
+bool IsFullySet(const cv::Mat& mask, const xpano::utils::RectPPi& crop) {
+  const auto rect = cv::Rect(cv::Point(crop.start[0], crop.start[1]),
+                             cv::Point(crop.end[0], crop.end[1]));
+  return cv::countNonZero(mask(rect) == kMaskValueOn) == rect.area();
+}
+
+}  // namespace
+
 // NOLINTBEGIN(readability-magic-numbers)
 
 TEST_CASE("Auto crop empty mask") {
@@ -151,12 +184,93 @@ TEST_CASE("Auto crop complex case II") {
   CHECK(result->end == Point2i{6, 6});
 }
 
+TEST_CASE("Auto crop random masks") {
+  cv::RNG rng(42);
+  for (int i = 0; i < 50; i++) {
+    const int rows = rng.uniform(1, 12);
+    const int cols = rng.uniform(1, 20);
+    cv::Mat noise(rows, cols, CV_8U);
+    rng.fill(noise, cv::RNG::UNIFORM, 0, 100);
+    // Mostly set masks, so that the largest crops are non-trivial
+    const cv::Mat mask = (noise > 15) & kMaskValueOn;
+
+    auto result = FindLargestCrop(mask);
+    const int expected = LargestCropArea(mask);
+    if (expected == 0) {
+      CHECK(!result.has_value());
+      continue;
+    }
+    REQUIRE(result.has_value());
+    CHECK(xpano::utils::Area(*result) == expected);
+    CHECK(IsFullySet(mask, *result));
+  }
+}
+
+TEST_CASE("Auto crop wide mask") {
+  // Wider than the vectorized part, with a hole in the scalar tail
+  cv::Mat mask(4, 19, CV_8U, cv::Scalar(kMaskValueOn));
+  mask.at<unsigned char>(0, 17) = 0;
+  auto result = FindLargestCrop(mask);
+  REQUIRE(result.has_value());
+  CHECK(result->start == Point2i{0, 0});
+  CHECK(result->end == Point2i{17, 4});
+}
+
+TEST_CASE("Run-length encoded mask") {
+  cv::Mat mask(3, 10, CV_8U, cv::Scalar(0));
+  mask.row(0).colRange(2, 5) = kMaskValueOn;
+  mask.row(0).colRange(7, 10) = kMaskValueOn;
+  mask.row(2) = kMaskValueOn;
+
+  const RleMask encoded(mask);
+  CHECK(encoded.Size() == mask.size());
+  CHECK(encoded.CountSet() == 16);
+  CHECK(encoded.Row(0).size() == 2);
+  CHECK(encoded.Row(0)[0] == RleMask::Run{2, 5});
+  CHECK(encoded.Row(0)[1] == RleMask::Run{7, 10});
+  CHECK(encoded.Row(1).empty());
+  CHECK(encoded.Row(2).size() == 1);
+  CHECK(encoded.Row(2)[0] == RleMask::Run{0, 10});
+  CHECK(encoded.Bytes() < mask.total());
+
+  CHECK(cv::countNonZero(encoded.Decode() != mask) == 0);
+  cv::Mat unset;
+  cv::bitwise_not(mask, unset);
+  CHECK(cv::countNonZero(encoded.DecodeUnset() != unset) == 0);
+}
+
+TEST_CASE("Auto crop run-length encoded mask") {
+  CHECK(!FindLargestCrop(RleMask{}).has_value());
+
+  cv::RNG rng(7);
+  for (int i = 0; i < 50; i++) {
+    cv::Mat noise(rng.uniform(1, 12), rng.uniform(1, 20), CV_8U);
+    rng.fill(noise, cv::RNG::UNIFORM, 0, 100);
+    const cv::Mat mask = (noise > 15) & kMaskValueOn;
+
+    auto dense = FindLargestCrop(mask);
+    auto encoded = FindLargestCrop(RleMask(mask));
+    REQUIRE(dense.has_value() == encoded.has_value());
+    if (dense) {
+      CHECK(dense->start == encoded->start);
+      CHECK(dense->end == encoded->end);
+    }
+  }
+}
+
 TEST_CASE("Real life example") {
   auto mask = cv::imread("mask.png", cv::IMREAD_UNCHANGED);
   auto result = FindLargestCrop(mask);
   REQUIRE(result.has_value());
-  CHECK(result->start == Point2i{67, 659});
-  CHECK(result->end == Point2i{5985, 2950});
+  CHECK(IsFullySet(mask, *result));
+  // At least the crop found by the former approximate solution
+  CHECK(xpano::utils::Area(*result) >= (5985 - 67) * (2950 - 659));
+
+  // Any non-zero pixel is set in the encoded mask
+  auto encoded = FindLargestCrop(RleMask(mask == kMaskValueOn));
+  REQUIRE(encoded.has_value());
+  CHECK(encoded->start == result->start);
+  CHECK(encoded->end == result->end);
 }
 
 // NOLINTEND(readability-magic-numbers)
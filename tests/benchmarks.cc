@@ -0,0 +1,333 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Benchmarks of the hot paths, not run by ctest. Run e.g.
+//   XpanoBench --benchmark-samples 10
+// from the build directory, the inputs are tests/data and larger images
+// generated from them. Threads and seeds are fixed, see Setup().
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <filesystem>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <catch2/benchmark/catch_benchmark.hpp>
+#include <catch2/catch_test_macros.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/stitching/detail/blenders.hpp>
+
+#include "tests/dataset.h"
+#include "tests/utils.h"
+#include "xpano/algorithm/algorithm.h"
+#include "xpano/algorithm/auto_crop.h"
+#include "xpano/algorithm/blenders.h"
+#include "xpano/algorithm/image.h"
+#include "xpano/algorithm/rle_mask.h"
+#include "xpano/constants.h"
+#include "xpano/pipeline/stitcher_pipeline.h"
+#include "xpano/utils/threadpool.h"
+
+namespace {
+
+using xpano::algorithm::Image;
+
+constexpr auto kReturnFuture = xpano::pipeline::RunTraits::kReturnFuture;
+using Pipeline = xpano::pipeline::StitcherPipeline<kReturnFuture>;
+
+constexpr int kThreads = 4;
+constexpr unsigned kSeed = 42;
+
+const std::vector<std::filesystem::path> kInputs = {
+    "data/image00.jpg", "data/image01.jpg", "data/image02.jpg",
+    "data/image03.jpg", "data/image04.jpg", "data/image05.jpg",
+    "data/image06.jpg", "data/image07.jpg", "data/image08.jpg",
+    "data/image09.jpg",
+};
+
+void Setup() {
+  cv::setNumThreads(kThreads);
+  cv::setRNGSeed(static_cast<int>(kSeed));
+}
+
+std::unique_ptr<Pipeline> MakePipeline() {
+  return std::make_unique<Pipeline>(xpano::pipeline::StitcherPipelineOptions{
+      .pool = std::make_shared<xpano::utils::mt::Threadpool>(kThreads)});
+}
+
+const xpano::pipeline::StitcherData& LoadedData() {
+  static const auto kData = []() {
+    auto pipeline = MakePipeline();
+    return pipeline->RunLoading(kInputs, {}, {}).future.get();
+  }();
+  return kData;
+}
+
+std::vector<cv::Mat> PanoPreviews(int pano_id) {
+  const auto& data = LoadedData();
+  std::vector<cv::Mat> images;
+  for (const int image_id : data.panos[pano_id].ids) {
+    images.push_back(data.images[image_id].GetPreview());
+  }
+  return images;
+}
+
+// Random match graph of num_images with chains of overlapping images and
+// random_matches spurious pairs below the threshold, e.g. from retrieval.
+// Released matches, as kept by large image sets, see ReleaseInliers.
+std::vector<xpano::algorithm::Match> SyntheticMatches(int num_images,
+                                                      int random_matches) {
+  std::mt19937 generator(kSeed);
+  std::uniform_int_distribution<int> image(0, num_images - 1);
+  std::uniform_int_distribution<int> strong(kDefaultMatchThreshold, 500);
+  std::uniform_int_distribution<int> weak(0, kDefaultMatchThreshold - 1);
+
+  auto released = [](int id1, int id2, int num_inliers) {
+    return xpano::algorithm::Match{
+        .id1 = id1,
+        .id2 = id2,
+        .avg_shift = 0.5f,
+        .summary = xpano::algorithm::MatchSummary{.num_inliers = num_inliers}};
+  };
+
+  std::vector<xpano::algorithm::Match> matches;
+  matches.reserve(static_cast<std::size_t>(num_images + random_matches));
+  for (int i = 0; i + 1 < num_images; i++) {
+    const bool chain_break = i % 8 == 7;
+    matches.push_back(
+        released(i, i + 1, chain_break ? weak(generator) : strong(generator)));
+  }
+  for (int i = 0; i < random_matches; i++) {
+    const int id1 = image(generator);
+    const int id2 = image(generator);
+    if (id1 != id2) {
+      matches.push_back(
+          released(std::min(id1, id2), std::max(id1, id2), weak(generator)));
+    }
+  }
+  return matches;
+}
+
+// Wavy pano outline, like a warped sequence of images
+cv::Mat SyntheticMask(cv::Size size) {
+  const int num_waves = 8;
+  const int steps = 256;
+  std::vector<cv::Point> outline;
+  for (int i = 0; i <= steps; i++) {
+    const double x = size.width * i / static_cast<double>(steps);
+    const double wave = std::sin(x / size.width * num_waves * CV_PI);
+    outline.emplace_back(static_cast<int>(x),
+                         static_cast<int>(size.height * (0.1 + 0.05 * wave)));
+  }
+  for (int i = steps; i >= 0; i--) {
+    const double x = size.width * i / static_cast<double>(steps);
+    const double wave = std::cos(x / size.width * num_waves * CV_PI);
+    outline.emplace_back(static_cast<int>(x),
+                         static_cast<int>(size.height * (0.9 + 0.05 * wave)));
+  }
+  cv::Mat mask = cv::Mat::zeros(size, CV_8U);
+  cv::fillPoly(mask, std::vector<std::vector<cv::Point>>{outline},
+               xpano::algorithm::crop::kMaskValueOn);
+  return mask;
+}
+
+struct WarpedInput {
+  cv::Mat image;
+  cv::Mat mask;
+  cv::Point corner;
+};
+
+// Horizontally overlapping random images, as after warping
+std::vector<WarpedInput> SyntheticWarped(int num_images, cv::Size size) {
+  cv::RNG rng(kSeed);
+  std::vector<WarpedInput> inputs;
+  for (int i = 0; i < num_images; i++) {
+    cv::Mat image(size, CV_8UC3);
+    rng.fill(image, cv::RNG::UNIFORM, 0, 255);
+    cv::GaussianBlur(image, image, {0, 0}, 4.0);
+    inputs.push_back({.image = image,
+                      .mask = cv::Mat(size, CV_8U, cv::Scalar(255)),
+                      .corner = {i * size.width * 2 / 3, 0}});
+  }
+  return inputs;
+}
+
+cv::Rect Roi(const std::vector<WarpedInput>& inputs) {
+  cv::Rect roi;
+  for (const auto& input : inputs) {
+    roi |= cv::Rect(input.corner, input.image.size());
+  }
+  return roi;
+}
+
+cv::Mat Blend(cv::detail::Blender* blender,
+              const std::vector<WarpedInput>& inputs) {
+  blender->prepare(Roi(inputs));
+  for (const auto& input : inputs) {
+    blender->feed(input.image, input.mask, input.corner);
+  }
+  cv::UMat result;
+  cv::UMat result_mask;
+  blender->blend(result, result_mask);
+  return result.getMat(cv::ACCESS_READ).clone();
+}
+
+}  // namespace
+
+TEST_CASE("Image loading", "[!benchmark]") {
+  Setup();
+  // 4x the test image side, ~16x the pixels
+  const auto large_path = xpano::tests::TmpPath().replace_extension("jpg");
+  cv::Mat large;
+  cv::resize(cv::imread(kInputs[0].string()), large, {}, 4.0, 4.0,
+             cv::INTER_CUBIC);
+  REQUIRE(cv::imwrite(large_path.string(), large));
+
+  for (const int preview_longer_side : {512, 1024, 2048}) {
+    const auto size = std::to_string(preview_longer_side);
+    BENCHMARK("Image::Load " + size) {
+      Image image(kInputs[0]);
+      image.Load({.preview_longer_side = preview_longer_side});
+      return image.NumKeypoints();
+    };
+    BENCHMARK("Image::Load large input " + size) {
+      Image image(large_path);
+      image.Load({.preview_longer_side = preview_longer_side});
+      return image.NumKeypoints();
+    };
+  }
+  std::filesystem::remove(large_path);
+}
+
+TEST_CASE("Matching", "[!benchmark]") {
+  Setup();
+  const auto& images = LoadedData().images;
+  BENCHMARK("MatchImages") {
+    return xpano::algorithm::MatchImages(0, 1, images[0], images[1], {})
+        .matches.size();
+  };
+
+  for (const int num_images : {100, 1000, 10000, 100000}) {
+    const auto matches = SyntheticMatches(num_images, num_images);
+    BENCHMARK("FindPanos " + std::to_string(num_images)) {
+      return xpano::algorithm::FindPanos(matches, kDefaultMatchThreshold,
+                                         kDefaultShiftInPano)
+          .size();
+    };
+  }
+
+  // Retrieval based matching of an archive, 10 pairs per image
+  const auto archive_matches = SyntheticMatches(100000, 1000000);
+  BENCHMARK("FindPanos 100000 images, 1M matches") {
+    return xpano::algorithm::FindPanos(archive_matches, kDefaultMatchThreshold,
+                                       kDefaultShiftInPano)
+        .size();
+  };
+}
+
+TEST_CASE("Scaling", "[!benchmark]") {
+  Setup();
+  namespace dataset = xpano::tests::dataset;
+  const cv::Mat source = cv::imread(kInputs[0].string());
+  for (const int count : {16, 64, 256}) {
+    const dataset::Options options = {.count = count,
+                                      .rows = count / 16,
+                                      .view_size = {800, 600},
+                                      .overlap = 0.4f};
+    const auto dir = xpano::tests::TmpPath();
+    REQUIRE(dataset::Write(dir, dataset::Generate(source, options), options));
+    const auto paths = dataset::ImagePaths(dir, count);
+
+    auto pipeline = MakePipeline();
+    BENCHMARK("RunLoading " + std::to_string(count) + " views") {
+      return pipeline->RunLoading(paths, {}, {}).future.get().panos.size();
+    };
+    std::filesystem::remove_all(dir);
+  }
+}
+
+TEST_CASE("Auto crop", "[!benchmark]") {
+  Setup();
+  for (const cv::Size size : {cv::Size(4000, 2000), cv::Size(16000, 6000)}) {
+    const auto name = std::to_string(size.width) + "x" +
+                      std::to_string(size.height);
+    const cv::Mat mask = SyntheticMask(size);
+    const xpano::algorithm::RleMask rle_mask(mask);
+    BENCHMARK("FindLargestCrop " + name) {
+      return xpano::algorithm::crop::FindLargestCrop(mask);
+    };
+    BENCHMARK("FindLargestCrop RLE " + name) {
+      return xpano::algorithm::crop::FindLargestCrop(rle_mask);
+    };
+  }
+}
+
+TEST_CASE("Blenders", "[!benchmark]") {
+  Setup();
+  namespace blenders = xpano::algorithm::blenders;
+  const auto inputs = SyntheticWarped(6, {1500, 1000});
+
+  BENCHMARK("Blend MultiBandOpenCV") {
+    blenders::MultiBandOpenCV blender;
+    return Blend(&blender, inputs);
+  };
+  BENCHMARK("Blend FeatherOpenCV") {
+    blenders::FeatherOpenCV blender;
+    return Blend(&blender, inputs);
+  };
+  BENCHMARK("Blend SeamOnly") {
+    blenders::SeamOnly blender;
+    return Blend(&blender, inputs);
+  };
+  if (blenders::MultiblendEnabled()) {
+    xpano::utils::mt::Threadpool threads(kThreads);
+    BENCHMARK("Blend Multiblend") {
+      blenders::Multiblend blender(&threads);
+      return Blend(&blender, inputs);
+    };
+  }
+}
+
+TEST_CASE("Compositing", "[!benchmark]") {
+  Setup();
+  const auto images = PanoPreviews(0);
+  const auto first = xpano::algorithm::Stitch(images, {}, {}, {});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(first.status));
+
+  BENCHMARK("Stitch") {
+    return xpano::algorithm::Stitch(images, {}, {}, {}).pano;
+  };
+  // Only ComposePanorama runs with the cameras known
+  BENCHMARK("ComposePanorama") {
+    return xpano::algorithm::Stitch(images, first.cameras, {}, {}).pano;
+  };
+  xpano::utils::mt::Threadpool threads(kThreads);
+  BENCHMARK("ComposePanorama parallel") {
+    return xpano::algorithm::Stitch(images, first.cameras, {},
+                                    {.threads_for_compose = &threads})
+        .pano;
+  };
+}
+
+TEST_CASE("Export", "[!benchmark]") {
+  Setup();
+  const auto images = PanoPreviews(0);
+  const auto stitched = xpano::algorithm::Stitch(images, {}, {}, {});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(stitched.status));
+
+  auto pipeline = MakePipeline();
+  for (const std::string extension : {"jpg", "png", "tif"}) {
+    const auto path = xpano::tests::TmpPath().replace_extension(extension);
+    BENCHMARK("RunExportPipeline " + extension) {
+      return pipeline->RunExport(stitched.pano, {.export_path = path})
+          .future.get()
+          .export_path;
+    };
+    std::filesystem::remove(path);
+  }
+}
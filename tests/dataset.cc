@@ -0,0 +1,287 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "tests/dataset.h"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <optional>
+#include <random>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/stitching/detail/warpers.hpp>
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+
+namespace xpano::tests::dataset {
+
+namespace {
+
+constexpr int kJpegQuality = 95;
+
+float ToRadians(float degrees) {
+  return degrees * static_cast<float>(CV_PI) / 180.0f;
+}
+
+int NumCols(const Options& options) {
+  return (options.count + options.rows - 1) / options.rows;
+}
+
+const char* Name(Mode mode) {
+  return mode == Mode::kCrop ? "crop" : "render";
+}
+
+const char* Name(Order order) {
+  switch (order) {
+    case Order::kSequential:
+      return "sequential";
+    case Order::kReversed:
+      return "reversed";
+    case Order::kShuffled:
+      return "shuffled";
+  }
+  return "";
+}
+
+std::vector<View> Crops(const cv::Mat& source, const Options& options) {
+  const int cols = NumCols(options);
+  const int step_x = std::max(
+      1, static_cast<int>(std::lround(options.view_size.width *
+                                      (1.0f - options.overlap))));
+  const int step_y = std::max(
+      1, static_cast<int>(std::lround(options.view_size.height *
+                                      (1.0f - options.overlap))));
+  const cv::Size canvas(options.view_size.width + (cols - 1) * step_x,
+                        options.view_size.height + (options.rows - 1) * step_y);
+
+  // Canvas pixels per source pixel, covering the whole canvas
+  double scale =
+      std::max(static_cast<double>(canvas.width) / source.cols,
+               static_cast<double>(canvas.height) / source.rows);
+  cv::Mat scaled = source;
+  if (scale < 1.0) {
+    cv::resize(source, scaled, {}, scale, scale, cv::INTER_AREA);
+    scale = std::max(static_cast<double>(canvas.width) / scaled.cols,
+                     static_cast<double>(canvas.height) / scaled.rows);
+  }
+
+  std::vector<View> views;
+  for (int i = 0; i < options.count; i++) {
+    View view = {.row = i / cols, .col = i % cols};
+    view.crop = cv::Rect(view.col * step_x, view.row * step_y,
+                         options.view_size.width, options.view_size.height);
+    // Canvas -> source
+    const cv::Matx23d to_source(1.0 / scale, 0.0, view.crop.x / scale, 0.0,
+                                1.0 / scale, view.crop.y / scale);
+    cv::warpAffine(scaled, view.image, to_source, options.view_size,
+                   cv::INTER_LINEAR | cv::WARP_INVERSE_MAP,
+                   cv::BORDER_REFLECT);
+    views.push_back(std::move(view));
+  }
+  return views;
+}
+
+cv::Mat Rotation(float yaw, float pitch) {
+  const cv::Matx33f rotate_y(std::cos(yaw), 0.0f, std::sin(yaw), 0.0f, 1.0f,
+                             0.0f, -std::sin(yaw), 0.0f, std::cos(yaw));
+  const cv::Matx33f rotate_x(1.0f, 0.0f, 0.0f, 0.0f, std::cos(pitch),
+                             -std::sin(pitch), 0.0f, std::sin(pitch),
+                             std::cos(pitch));
+  return cv::Mat(rotate_y * rotate_x, true);
+}
+
+std::vector<View> Renders(const cv::Mat& source, const Options& options) {
+  const int cols = NumCols(options);
+  const cv::Size size = options.view_size;
+  const float fov = ToRadians(options.fov_deg);
+  const float focal = 0.5f * static_cast<float>(size.width) /
+                      std::tan(0.5f * fov);
+  const float vertical_fov =
+      2.0f * std::atan(0.5f * static_cast<float>(size.height) / focal);
+  const float yaw_step = fov * (1.0f - options.overlap);
+  const float pitch_step = vertical_fov * (1.0f - options.overlap);
+
+  // The source is the whole sphere, u in [-pi, pi] * scale, v in [0, pi]
+  const auto scale =
+      static_cast<float>(source.cols / (2.0 * CV_PI));
+  const float v_to_row =
+      static_cast<float>(source.rows) / (static_cast<float>(CV_PI) * scale);
+
+  std::vector<View> views;
+  for (int i = 0; i < options.count; i++) {
+    View view = {.row = i / cols, .col = i % cols};
+    const float yaw =
+        (static_cast<float>(view.col) - 0.5f * static_cast<float>(cols - 1)) *
+        yaw_step;
+    const float pitch = (static_cast<float>(view.row) -
+                         0.5f * static_cast<float>(options.rows - 1)) *
+                        pitch_step;
+    view.camera.focal = focal;
+    view.camera.aspect = 1.0;
+    view.camera.ppx = 0.5 * size.width;
+    view.camera.ppy = 0.5 * size.height;
+    view.camera.R = Rotation(yaw, pitch);
+    view.camera.t = cv::Mat::zeros(3, 1, CV_64F);
+
+    cv::Mat intrinsics;
+    view.camera.K().convertTo(intrinsics, CV_32F);
+    cv::detail::SphericalProjector projector;
+    projector.scale = scale;
+    projector.setCameraParams(intrinsics, view.camera.R,
+                              cv::Mat::zeros(3, 1, CV_32F));
+
+    cv::Mat map_x(size, CV_32F);
+    cv::Mat map_y(size, CV_32F);
+    for (int y = 0; y < size.height; y++) {
+      for (int x = 0; x < size.width; x++) {
+        float u;
+        float v;
+        projector.mapForward(static_cast<float>(x), static_cast<float>(y), u,
+                             v);
+        map_x.at<float>(y, x) = u + 0.5f * static_cast<float>(source.cols);
+        map_y.at<float>(y, x) = v * v_to_row;
+      }
+    }
+    cv::remap(source, view.image, map_x, map_y, cv::INTER_LINEAR,
+              cv::BORDER_WRAP);
+    views.push_back(std::move(view));
+  }
+  return views;
+}
+
+std::vector<int> OutputOrder(const Options& options) {
+  std::vector<int> order(options.count);
+  std::iota(order.begin(), order.end(), 0);
+  if (options.order == Order::kReversed) {
+    std::reverse(order.begin(), order.end());
+  } else if (options.order == Order::kShuffled) {
+    std::mt19937 generator(options.seed);
+    std::shuffle(order.begin(), order.end(), generator);
+  }
+  return order;
+}
+
+std::string GroundTruth(const View& view, const Options& options) {
+  if (options.mode == Mode::kCrop) {
+    return fmt::format("\"crop\": [{}, {}, {}, {}]", view.crop.x, view.crop.y,
+                       view.crop.width, view.crop.height);
+  }
+  const cv::Matx33f rotation = view.camera.R;
+  std::string rotation_values;
+  for (int i = 0; i < 9; i++) {
+    rotation_values += fmt::format("{}{:.7f}", i > 0 ? ", " : "",
+                                   rotation.val[i]);
+  }
+  return fmt::format(
+      "\"focal\": {:.4f}, \"ppx\": {:.1f}, \"ppy\": {:.1f}, \"R\": [{}]",
+      view.camera.focal, view.camera.ppx, view.camera.ppy, rotation_values);
+}
+
+}  // namespace
+
+std::optional<Mode> ParseMode(const std::string& mode) {
+  for (const auto value : {Mode::kCrop, Mode::kRender}) {
+    if (mode == Name(value)) {
+      return value;
+    }
+  }
+  return {};
+}
+
+std::optional<Order> ParseOrder(const std::string& order) {
+  for (const auto value :
+       {Order::kSequential, Order::kReversed, Order::kShuffled}) {
+    if (order == Name(value)) {
+      return value;
+    }
+  }
+  return {};
+}
+
+std::vector<View> Generate(const cv::Mat& source, const Options& options) {
+  if (source.empty() || options.count <= 0 || options.rows <= 0 ||
+      options.rows > options.count || options.view_size.empty() ||
+      options.overlap < 0.0f || options.overlap >= 1.0f ||
+      options.fov_deg <= 0.0f || options.fov_deg >= 180.0f) {
+    spdlog::error("Invalid dataset options");
+    return {};
+  }
+
+  auto views = options.mode == Mode::kCrop ? Crops(source, options)
+                                           : Renders(source, options);
+  std::vector<View> ordered;
+  ordered.reserve(views.size());
+  for (const int index : OutputOrder(options)) {
+    ordered.push_back(std::move(views[index]));
+  }
+  return ordered;
+}
+
+bool Write(const std::filesystem::path& dir, const std::vector<View>& views,
+           const Options& options) {
+  std::error_code error;
+  std::filesystem::create_directories(dir, error);
+  if (error) {
+    spdlog::error("Failed to create {}: {}", dir.string(), error.message());
+    return false;
+  }
+
+  const auto paths = ImagePaths(dir, static_cast<int>(views.size()));
+  std::string view_entries;
+  for (int i = 0; i < views.size(); i++) {
+    if (!cv::imwrite(paths[i].string(), views[i].image,
+                     {cv::IMWRITE_JPEG_QUALITY, kJpegQuality})) {
+      spdlog::error("Failed to write {}", paths[i].string());
+      return false;
+    }
+    view_entries += fmt::format(
+        "{}    {{\"file\": \"{}\", \"row\": {}, \"col\": {}, {}}}",
+        i > 0 ? ",\n" : "", paths[i].filename().string(), views[i].row,
+        views[i].col, GroundTruth(views[i], options));
+  }
+
+  const auto json_path = dir / "ground_truth.json";
+  std::ofstream stream(json_path, std::ios::trunc);
+  stream << fmt::format(
+      "{{\n"
+      "  \"mode\": \"{}\",\n"
+      "  \"count\": {},\n"
+      "  \"rows\": {},\n"
+      "  \"view_width\": {},\n"
+      "  \"view_height\": {},\n"
+      "  \"overlap\": {},\n"
+      "  \"order\": \"{}\",\n"
+      "  \"seed\": {},\n"
+      "  \"fov_deg\": {},\n"
+      "  \"views\": [\n{}\n  ]\n"
+      "}}\n",
+      Name(options.mode), options.count, options.rows,
+      options.view_size.width, options.view_size.height, options.overlap,
+      Name(options.order), options.seed, options.fov_deg, view_entries);
+  stream.close();
+  if (!stream) {
+    spdlog::error("Failed to write {}", json_path.string());
+    return false;
+  }
+  return true;
+}
+
+std::vector<std::filesystem::path> ImagePaths(const std::filesystem::path& dir,
+                                              int count) {
+  std::vector<std::filesystem::path> paths;
+  paths.reserve(count);
+  for (int i = 0; i < count; i++) {
+    paths.push_back(dir / fmt::format("image{:03}.jpg", i));
+  }
+  return paths;
+}
+
+}  // namespace xpano::tests::dataset
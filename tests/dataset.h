@@ -0,0 +1,70 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/stitching/detail/camera.hpp>
+
+namespace xpano::tests::dataset {
+
+// Synthetic overlapping views of a source image with a known ground truth,
+// for scaling benchmarks and accuracy checks:
+//  - kCrop: axis aligned crops of the source stretched over a virtual canvas
+//    fitting the grid of views, the ground truth is the crop in the canvas.
+//    Only the views are resampled, the canvas is never allocated, so it can
+//    be gigapixels large. The detail is limited by the source resolution.
+//  - kRender: perspective views of the source taken as an equirectangular
+//    sphere, rendered through the spherical projector of the stitcher. The
+//    ground truth is the camera (K, R), yaw step by column, pitch by row.
+enum class Mode : std::uint8_t { kCrop, kRender };
+
+// Order of the output files, the grid is filled row by row
+enum class Order : std::uint8_t { kSequential, kReversed, kShuffled };
+
+struct Options {
+  Mode mode = Mode::kCrop;
+  int count = 8;
+  // Views in a grid of rows x ceil(count / rows)
+  int rows = 1;
+  cv::Size view_size = {640, 480};
+  // Fraction of a view shared with its neighbour
+  float overlap = 0.5f;
+  Order order = Order::kSequential;
+  // Of the shuffled order
+  unsigned seed = 0;
+  // Horizontal field of view of kRender
+  float fov_deg = 60.0f;
+};
+
+struct View {
+  cv::Mat image;
+  int row;
+  int col;
+  // kCrop: the view in the canvas
+  cv::Rect crop;
+  // kRender: the camera of the view, R as in cv::detail::CameraParams
+  cv::detail::CameraParams camera;
+};
+
+[[nodiscard]] std::optional<Mode> ParseMode(const std::string& mode);
+[[nodiscard]] std::optional<Order> ParseOrder(const std::string& order);
+
+// The views in the output order, empty if the options are invalid
+std::vector<View> Generate(const cv::Mat& source, const Options& options);
+
+// <dir>/image<NNN>.jpg in the output order and <dir>/ground_truth.json
+bool Write(const std::filesystem::path& dir, const std::vector<View>& views,
+           const Options& options);
+
+// Paths written by Write()
+std::vector<std::filesystem::path> ImagePaths(const std::filesystem::path& dir,
+                                              int count);
+
+}  // namespace xpano::tests::dataset
@@ -25,3 +25,18 @@ TEST_CASE("DisjointSet Union/Find") {
   CHECK(set.Find(0) == set.Find(1));
   CHECK(set.Find(1) == set.Find(2));
 }
+
+TEST_CASE("DisjointSet preallocated") {
+  auto set = DisjointSet(4);
+  CHECK(set.Find(3) == 3);
+
+  // Grows past the preallocated size
+  for (int i = 0; i + 1 < 1000; i++) {
+    set.Union(i, i + 1);
+  }
+  const int root = set.Find(999);
+  for (int i = 0; i < 1000; i++) {
+    CHECK(set.Find(i) == root);
+  }
+  CHECK(set.Find(1000) == 1000);
+}
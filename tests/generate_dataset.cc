@@ -0,0 +1,169 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Writes a synthetic dataset, see tests/dataset.h, e.g.
+//   GenerateDataset --source=pano.jpg --output=out --count=500 --rows=5
+//     --size=2000x1500 --overlap=0.3 --mode=crop --order=shuffled --seed=1
+
+#include <charconv>
+#include <cstddef>
+#include <optional>
+#include <string>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <spdlog/spdlog.h>
+
+#include "tests/dataset.h"
+
+namespace {
+
+using xpano::tests::dataset::Options;
+
+const std::string kSourceFlag = "--source=";
+const std::string kOutputFlag = "--output=";
+const std::string kModeFlag = "--mode=";
+const std::string kCountFlag = "--count=";
+const std::string kRowsFlag = "--rows=";
+const std::string kSizeFlag = "--size=";
+const std::string kOverlapFlag = "--overlap=";
+const std::string kOrderFlag = "--order=";
+const std::string kSeedFlag = "--seed=";
+const std::string kFovFlag = "--fov=";
+
+std::optional<int> ParseInt(const std::string& str) {
+  int value;
+  auto result = std::from_chars(str.data(), str.data() + str.size(), value);
+  if (result.ec == std::errc() && result.ptr == str.data() + str.size()) {
+    return value;
+  }
+  return std::nullopt;
+}
+
+std::optional<float> ParseFloat(const std::string& str) {
+  try {
+    size_t pos;
+    float value = std::stof(str, &pos);
+    if (pos == str.size()) {
+      return value;
+    }
+  } catch (...) {
+  }
+  return std::nullopt;
+}
+
+std::optional<cv::Size> ParseSize(const std::string& str) {
+  const auto separator = str.find('x');
+  if (separator == std::string::npos) {
+    return {};
+  }
+  auto width = ParseInt(str.substr(0, separator));
+  auto height = ParseInt(str.substr(separator + 1));
+  if (!width || !height) {
+    return {};
+  }
+  return cv::Size(*width, *height);
+}
+
+struct Args {
+  std::string source;
+  std::string output;
+  Options options;
+};
+
+// Sets the value if the flag matches, false on an invalid value
+template <typename TValue, typename TParse>
+bool ParseFlag(const std::string& arg, const std::string& flag,
+               TParse parse, TValue* value, bool* matched) {
+  if (!arg.starts_with(flag)) {
+    return true;
+  }
+  *matched = true;
+  auto parsed = parse(arg.substr(flag.size()));
+  if (!parsed) {
+    spdlog::error("Invalid value: {}", arg);
+    return false;
+  }
+  *value = *parsed;
+  return true;
+}
+
+std::optional<Args> ParseArgs(int argc, char** argv) {
+  Args args;
+  auto& options = args.options;
+  auto text = [](const std::string& str) { return std::optional(str); };
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    bool matched = false;
+    const bool valid =
+        ParseFlag(arg, kSourceFlag, text, &args.source, &matched) &&
+        ParseFlag(arg, kOutputFlag, text, &args.output, &matched) &&
+        ParseFlag(arg, kModeFlag, xpano::tests::dataset::ParseMode,
+                  &options.mode, &matched) &&
+        ParseFlag(arg, kCountFlag, ParseInt, &options.count,
+                  &matched) &&
+        ParseFlag(arg, kRowsFlag, ParseInt, &options.rows,
+                  &matched) &&
+        ParseFlag(arg, kSizeFlag, ParseSize, &options.view_size, &matched) &&
+        ParseFlag(arg, kOverlapFlag, ParseFloat, &options.overlap,
+                  &matched) &&
+        ParseFlag(arg, kOrderFlag, xpano::tests::dataset::ParseOrder,
+                  &options.order, &matched) &&
+        ParseFlag(arg, kSeedFlag, ParseInt, &options.seed,
+                  &matched) &&
+        ParseFlag(arg, kFovFlag, ParseFloat, &options.fov_deg,
+                  &matched);
+    if (!valid) {
+      return {};
+    }
+    if (!matched) {
+      spdlog::error("Unknown argument: {}", arg);
+      return {};
+    }
+  }
+  if (args.source.empty() || args.output.empty()) {
+    spdlog::error("--source and --output are required");
+    return {};
+  }
+  return args;
+}
+
+void PrintHelp() {
+  spdlog::info("Usage: GenerateDataset --source=<image> --output=<dir> "
+               "[options]");
+  spdlog::info("  --mode=crop|render       Crops of the source or views of "
+               "it as a sphere (default: crop)");
+  spdlog::info("  --count=<N>              Number of views (default: 8)");
+  spdlog::info("  --rows=<N>               Rows of the grid of views "
+               "(default: 1)");
+  spdlog::info("  --size=<W>x<H>           View resolution (default: "
+               "640x480)");
+  spdlog::info("  --overlap=<0-1>          Overlap of the neighbours "
+               "(default: 0.5)");
+  spdlog::info("  --order=sequential|reversed|shuffled");
+  spdlog::info("  --seed=<N>               Seed of the shuffled order");
+  spdlog::info("  --fov=<degrees>          Horizontal field of view of "
+               "render (default: 60)");
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  auto args = ParseArgs(argc, argv);
+  if (!args) {
+    PrintHelp();
+    return 1;
+  }
+  const cv::Mat source = cv::imread(args->source);
+  if (source.empty()) {
+    spdlog::error("Failed to read {}", args->source);
+    return 1;
+  }
+  const auto views = xpano::tests::dataset::Generate(source, args->options);
+  if (views.empty() ||
+      !xpano::tests::dataset::Write(args->output, views, args->options)) {
+    return 1;
+  }
+  spdlog::info("Written {} views to {}", views.size(), args->output);
+  return 0;
+}
@@ -0,0 +1,138 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/jpeg.h"
+
+#include <cstddef>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+#ifdef XPANO_WITH_EXIV2
+#include <exiv2/exiv2.hpp>
+#endif
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include "xpano/constants.h"
+#include "xpano/utils/exiv2.h"
+#include "xpano/utils/threadpool.h"
+
+TEST_CASE("JPEG header size") {
+  for (const auto& input : {"data/image05.jpg", "data/image10.jpg"}) {
+    auto header_size = xpano::utils::jpeg::ReadSize(input);
+    auto full_size = cv::imread(input).size();
+    REQUIRE(header_size.has_value());
+    CHECK((*header_size)[0] == full_size.width);
+    CHECK((*header_size)[1] == full_size.height);
+  }
+
+  CHECK_FALSE(xpano::utils::jpeg::ReadSize("data/mask.png").has_value());
+  CHECK_FALSE(xpano::utils::jpeg::ReadSize("data/missing.jpg").has_value());
+}
+
+TEST_CASE("JPEG metadata position") {
+  namespace jpeg = xpano::utils::jpeg;
+  const cv::Mat image(64, 64, CV_8UC3, cv::Scalar(10, 20, 30));
+  std::vector<unsigned char> encoded;
+  REQUIRE(cv::imencode(".jpg", image, encoded));
+
+  // SOI + the 16 byte JFIF segment with its marker
+  auto position = jpeg::MetadataPosition(encoded);
+  REQUIRE(position.has_value());
+  CHECK(*position == 20);
+  CHECK(encoded[*position] == 0xFF);
+  CHECK(encoded[*position + 1] != 0xE0);
+
+  const std::vector<unsigned char> png = {0x89, 'P', 'N', 'G'};
+  CHECK_FALSE(jpeg::MetadataPosition(png).has_value());
+
+#ifdef XPANO_WITH_EXIV2
+  auto segment = xpano::utils::exiv2::CreateExifSegment(
+      {"data/image06.jpg"}, {image.cols, image.rows});
+  REQUIRE(segment.has_value());
+  encoded.insert(encoded.begin() + static_cast<std::ptrdiff_t>(*position),
+                 segment->begin(), segment->end());
+
+  auto read_img = Exiv2::ImageFactory::open(encoded.data(), encoded.size());
+  read_img->readMetadata();
+  auto exif = read_img->exifData();
+  CHECK(exif["Exif.Image.Software"].toString().starts_with("Xpano"));
+  CHECK(exif["Exif.Photo.PixelXDimension"].toUint32() == image.cols);
+  CHECK(cv::imdecode(encoded, cv::IMREAD_COLOR).size() == image.size());
+#endif
+}
+
+TEST_CASE("Striped JPEG encoding") {
+  namespace jpeg = xpano::utils::jpeg;
+  cv::Mat image(1500, 1201, CV_8UC3);
+  for (int row = 0; row < image.rows; row++) {
+    for (int col = 0; col < image.cols; col++) {
+      image.at<cv::Vec3b>(row, col) = {static_cast<uchar>(row % 256),
+                                       static_cast<uchar>(col % 256),
+                                       static_cast<uchar>((row + col) % 256)};
+    }
+  }
+  const std::vector<int> params = {cv::IMWRITE_JPEG_QUALITY, 95};
+
+  xpano::utils::mt::Threadpool pool(4);
+  auto parallel = jpeg::EncodeStriped(image, params, &pool);
+  REQUIRE(parallel.has_value());
+
+  auto header_size = jpeg::ReadSize(*parallel);
+  REQUIRE(header_size.has_value());
+  CHECK((*header_size)[0] == image.cols);
+  CHECK((*header_size)[1] == image.rows);
+
+  auto decoded = cv::imdecode(*parallel, cv::IMREAD_COLOR);
+  REQUIRE(decoded.size() == image.size());
+  CHECK(cv::norm(decoded, image, cv::NORM_L1) / image.total() < 10.0);
+
+  // The stripe borders decode the same as a single pass encoding
+  std::vector<unsigned char> reference;
+  cv::imencode(".jpg", image, reference, params);
+  cv::Mat reference_decoded = cv::imdecode(reference, cv::IMREAD_COLOR);
+  CHECK(cv::norm(decoded, reference_decoded, cv::NORM_INF) <= 2.0);
+
+  CHECK_FALSE(jpeg::EncodeStriped(image, {cv::IMWRITE_JPEG_OPTIMIZE, 1}, &pool)
+                  .has_value());
+  CHECK_FALSE(
+      jpeg::EncodeStriped(image, {cv::IMWRITE_JPEG_PROGRESSIVE, 1}, &pool)
+          .has_value());
+}
+
+TEST_CASE("Striped JPEG decoding") {
+  namespace jpeg = xpano::utils::jpeg;
+  cv::Mat image(1500, 1201, CV_8UC3);
+  for (int row = 0; row < image.rows; row++) {
+    for (int col = 0; col < image.cols; col++) {
+      image.at<cv::Vec3b>(row, col) = {static_cast<uchar>(row % 256),
+                                       static_cast<uchar>(col % 256),
+                                       static_cast<uchar>((row + col) % 256)};
+    }
+  }
+
+  std::vector<unsigned char> encoded;
+  REQUIRE(cv::imencode(".jpg", image, encoded,
+                       {cv::IMWRITE_JPEG_QUALITY, 95,
+                        cv::IMWRITE_JPEG_RST_INTERVAL, 10}));
+  const cv::Mat reference = cv::imdecode(encoded, cv::IMREAD_COLOR);
+  const cv::Mat striped = jpeg::DecodeStriped(encoded);
+  REQUIRE(striped.size() == image.size());
+  CHECK(cv::norm(striped, reference, cv::NORM_L1) / image.total() < 1.0);
+  CHECK(jpeg::ReadOrientation(encoded) == xpano::kExifDefaultOrientation);
+
+  xpano::utils::mt::Threadpool pool(4);
+  auto parallel =
+      jpeg::EncodeStriped(image, {cv::IMWRITE_JPEG_QUALITY, 95}, &pool);
+  REQUIRE(parallel.has_value());
+  const cv::Mat round_trip = jpeg::DecodeStriped(*parallel);
+  REQUIRE(round_trip.size() == image.size());
+  CHECK(cv::norm(round_trip, cv::imdecode(*parallel, cv::IMREAD_COLOR),
+                 cv::NORM_L1) /
+            image.total() <
+        1.0);
+
+  // Without restart markers
+  REQUIRE(cv::imencode(".jpg", image, encoded));
+  CHECK(jpeg::DecodeStriped(encoded).empty());
+}
@@ -0,0 +1,100 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/bf_matcher.h"
+
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/matchers/catch_matchers_floating_point.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+
+#include "xpano/algorithm/descriptor_index.h"
+
+using Catch::Matchers::WithinRel;
+
+TEST_CASE("Descriptor index") {
+  const int num_descriptors = 500;
+  const int descriptor_size = 128;
+  cv::Mat descriptors(num_descriptors, descriptor_size, CV_32F);
+  cv::randu(descriptors, 0.0f, 255.0f);
+
+  const xpano::algorithm::DescriptorIndex index(descriptors);
+  auto matches = index.KnnMatch(descriptors, 2);
+
+  REQUIRE(matches.size() == num_descriptors);
+  for (int i = 0; i < num_descriptors; i++) {
+    REQUIRE(matches[i].size() == 2);
+    CHECK(matches[i][0].queryIdx == i);
+    CHECK(matches[i][0].trainIdx == i);
+    CHECK(matches[i][0].distance == 0.0f);
+    CHECK(matches[i][1].distance > 0.0f);
+  }
+
+  // Less train descriptors than neighbors
+  const xpano::algorithm::DescriptorIndex small_index(descriptors.row(0));
+  auto small_matches = small_index.KnnMatch(descriptors.rowRange(0, 2), 2);
+  REQUIRE(small_matches.size() == 2);
+  CHECK(small_matches[0].size() == 1);
+}
+
+TEST_CASE("Brute force matcher") {
+  const int num_descriptors = 300;
+  const int descriptor_size = 128;
+  cv::Mat train(num_descriptors, descriptor_size, CV_32F);
+  cv::randu(train, 0.0f, 255.0f);
+  cv::Mat noise(num_descriptors, descriptor_size, CV_32F);
+  cv::randu(noise, -1.0f, 1.0f);
+  const cv::Mat query = train + noise;
+
+  // Same results as the OpenCV brute force matcher + ratio test
+  const float max_ratio = 0.8f;
+  auto expected = [&](const cv::Mat& lhs, const cv::Mat& rhs, int norm) {
+    std::vector<std::vector<cv::DMatch>> knn_matches;
+    cv::BFMatcher(norm).knnMatch(lhs, rhs, knn_matches, 2);
+    std::vector<cv::DMatch> matches;
+    for (const auto& match : knn_matches) {
+      if (match[0].distance < max_ratio * match[1].distance) {
+        matches.push_back(match[0]);
+      }
+    }
+    return matches;
+  };
+  auto check = [](const std::vector<cv::DMatch>& matches,
+                  const std::vector<cv::DMatch>& expected_matches) {
+    REQUIRE(matches.size() == expected_matches.size());
+    for (int i = 0; i < matches.size(); i++) {
+      CHECK(matches[i].queryIdx == expected_matches[i].queryIdx);
+      CHECK(matches[i].trainIdx == expected_matches[i].trainIdx);
+      CHECK_THAT(matches[i].distance,
+                 WithinRel(expected_matches[i].distance, 1e-4f));
+    }
+  };
+
+  SECTION("float") {
+    auto matches =
+        xpano::algorithm::bf_matcher::MatchL2(query, train, max_ratio);
+    REQUIRE(matches.size() == num_descriptors);
+    check(matches, expected(query, train, cv::NORM_L2));
+  }
+
+  SECTION("uint8") {
+    cv::Mat query8;
+    cv::Mat train8;
+    query.convertTo(query8, CV_8U);
+    train.convertTo(train8, CV_8U);
+    check(xpano::algorithm::bf_matcher::MatchL2(query8, train8, max_ratio),
+          expected(query8, train8, cv::NORM_L2));
+  }
+
+  SECTION("hamming") {
+    cv::Mat binary_train(num_descriptors, 32, CV_8U);  // ORB descriptor size
+    cv::randu(binary_train, 0, 256);
+    cv::Mat binary_query = binary_train.clone();
+    binary_query.col(0) ^= 1;
+    check(xpano::algorithm::bf_matcher::MatchHamming(binary_query,
+                                                      binary_train, max_ratio),
+          expected(binary_query, binary_train, cv::NORM_HAMMING));
+  }
+}
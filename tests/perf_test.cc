@@ -0,0 +1,164 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+// Performance gate of a fixed end-to-end scenario, registered in CTest with
+// the "perf" label. The stage timings come from the trace spans, see
+// utils::trace. Environment:
+//  - XPANO_PERF_BASELINE: baseline file, default perf_baseline.txt
+//  - XPANO_PERF_TOLERANCE: fails above baseline * tolerance, default 1.5
+//  - XPANO_PERF_WARN: warns above baseline * warn, default 1.15
+//  - XPANO_PERF_RECORD: writes the measured values as a new baseline
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+#include <spdlog/fmt/fmt.h>
+
+#include "tests/utils.h"
+#include "xpano/constants.h"
+#include "xpano/pipeline/stitcher_pipeline.h"
+#include "xpano/utils/process.h"
+#include "xpano/utils/trace.h"
+
+namespace {
+
+constexpr auto kReturnFuture = xpano::pipeline::RunTraits::kReturnFuture;
+
+const std::vector<std::filesystem::path> kInputs = {
+    "data/image00.jpg", "data/image01.jpg", "data/image02.jpg",
+    "data/image03.jpg", "data/image04.jpg", "data/image05.jpg",
+    "data/image06.jpg", "data/image07.jpg", "data/image08.jpg",
+    "data/image09.jpg",
+};
+
+constexpr int kRuns = 3;
+// Timings below this are in the noise
+constexpr double kSlackMs = 20.0;
+const std::string kPeakMemoryKey = "Peak memory MB";
+
+using Values = std::map<std::string, double>;
+
+double EnvOr(const char* name, double fallback) {
+  const char* value = std::getenv(name);
+  if (value == nullptr) {
+    return fallback;
+  }
+  try {
+    return std::stod(value);
+  } catch (...) {
+    return fallback;
+  }
+}
+
+// "<key> = <value>" lines, # comments
+Values ReadBaseline(const std::filesystem::path& path) {
+  Values values;
+  std::ifstream stream(path);
+  std::string line;
+  while (std::getline(stream, line)) {
+    const auto separator = line.rfind('=');
+    if (line.empty() || line[0] == '#' || separator == std::string::npos) {
+      continue;
+    }
+    auto key = line.substr(0, separator);
+    key.erase(key.find_last_not_of(' ') + 1);
+    try {
+      values[key] = std::stod(line.substr(separator + 1));
+    } catch (...) {
+      WARN("Invalid baseline line: " << line);
+    }
+  }
+  return values;
+}
+
+void WriteBaseline(const std::filesystem::path& path, const Values& values) {
+  std::ofstream stream(path, std::ios::trunc);
+  stream << "# Recorded by PerfTest\n";
+  for (const auto& [key, value] : values) {
+    stream << fmt::format("{} = {:.1f}\n", key, value);
+  }
+}
+
+// Wall time of each stage in ms
+Values RunScenario() {
+  xpano::utils::trace::Start();
+  {
+    const auto export_path =
+        xpano::tests::TmpPath().replace_extension("jpg");
+    xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+    auto data = stitcher.RunLoading(kInputs, {}, {}).future.get();
+    REQUIRE(data.panos.size() == 2);
+    auto result =
+        stitcher
+            .RunStitching(data, {.pano_id = 0,
+                                 .full_res = true,
+                                 .export_path = export_path})
+            .future.get();
+    REQUIRE(result.export_path.has_value());
+    std::filesystem::remove(export_path);
+  }
+  xpano::utils::trace::Stop();
+
+  Values values;
+  for (const auto& stage : xpano::utils::trace::Totals()) {
+    values[stage.name] = static_cast<double>(stage.wall_us) / 1000.0;
+  }
+  return values;
+}
+
+}  // namespace
+
+TEST_CASE("Performance baseline") {
+  const std::filesystem::path baseline_path =
+      std::getenv("XPANO_PERF_BASELINE") != nullptr
+          ? std::getenv("XPANO_PERF_BASELINE")
+          : "perf_baseline.txt";
+  const double tolerance = EnvOr("XPANO_PERF_TOLERANCE", 1.5);
+  const double warn = EnvOr("XPANO_PERF_WARN", 1.15);
+
+  // Best of the runs, the first one also warms up the caches of the OS
+  Values measured;
+  for (int run = 0; run < kRuns; run++) {
+    for (const auto& [stage, time_ms] : RunScenario()) {
+      auto [entry, inserted] = measured.try_emplace(stage, time_ms);
+      if (!inserted) {
+        entry->second = std::min(entry->second, time_ms);
+      }
+    }
+  }
+  if (auto peak = xpano::utils::process::PeakRssBytes(); peak) {
+    measured[kPeakMemoryKey] = static_cast<double>(*peak) / kMegabyte;
+  }
+
+  if (const char* record_path = std::getenv("XPANO_PERF_RECORD")) {
+    WriteBaseline(record_path, measured);
+  }
+
+  const auto baseline = ReadBaseline(baseline_path);
+  // A missing or empty baseline would pass whatever was measured
+  INFO("Baseline: " << baseline_path.string());
+  REQUIRE(!baseline.empty());
+  for (const auto& [key, value] : measured) {
+    auto expected = baseline.find(key);
+    if (expected == baseline.end()) {
+      WARN(fmt::format("{}: {:.1f}, not in the baseline", key, value));
+      continue;
+    }
+    const double slack = key == kPeakMemoryKey ? 0.0 : kSlackMs;
+    const double ratio = (value - slack) / expected->second;
+    INFO(fmt::format("{}: {:.1f}, baseline {:.1f}", key, value,
+                     expected->second));
+    CHECK(ratio <= tolerance);
+    if (ratio > warn && ratio <= tolerance) {
+      WARN(fmt::format("{} regressed by {:.0f}%", key, (ratio - 1.0) * 100));
+    }
+  }
+}
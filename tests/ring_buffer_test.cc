@@ -0,0 +1,71 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/ring_buffer.h"
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+
+using xpano::utils::RingBuffer;
+
+TEST_CASE("RingBuffer push/pop") {
+  RingBuffer<std::string, 4> buffer;
+  CHECK(!buffer.TryPop());
+
+  CHECK(buffer.TryPush("a"));
+  CHECK(buffer.TryPush("b"));
+  CHECK(*buffer.TryPop() == "a");
+  CHECK(*buffer.TryPop() == "b");
+  CHECK(!buffer.TryPop());
+}
+
+TEST_CASE("RingBuffer full") {
+  RingBuffer<int, 4> buffer;
+  for (int i = 0; i < 4; i++) {
+    CHECK(buffer.TryPush(i));
+  }
+  CHECK(!buffer.TryPush(4));
+
+  CHECK(*buffer.TryPop() == 0);
+  CHECK(buffer.TryPush(4));
+  for (int i = 1; i < 5; i++) {
+    CHECK(*buffer.TryPop() == i);
+  }
+  CHECK(!buffer.TryPop());
+}
+
+TEST_CASE("RingBuffer many producers") {
+  const int num_producers = 4;
+  const int per_producer = 10000;
+  RingBuffer<int, 64> buffer;
+
+  std::vector<std::thread> producers;
+  for (int producer = 0; producer < num_producers; producer++) {
+    producers.emplace_back([&buffer, producer]() {
+      for (int i = 0; i < per_producer; i++) {
+        while (!buffer.TryPush(producer * per_producer + i)) {
+          std::this_thread::yield();
+        }
+      }
+    });
+  }
+
+  // Every value once, in order per producer
+  std::vector<int> next(num_producers, 0);
+  int received = 0;
+  while (received < num_producers * per_producer) {
+    if (auto value = buffer.TryPop(); value) {
+      const int producer = *value / per_producer;
+      CHECK(*value % per_producer == next[producer]);
+      next[producer]++;
+      received++;
+    }
+  }
+  for (auto& producer : producers) {
+    producer.join();
+  }
+  CHECK(!buffer.TryPop());
+}
@@ -5,11 +5,17 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
 #include <future>
 #include <iterator>
+#include <memory>
+#include <numeric>
 #include <optional>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <utility>
@@ -23,20 +29,51 @@
 #include <catch2/matchers/catch_matchers_vector.hpp>
 
 #include "xpano/algorithm/algorithm.h"
+#include "xpano/algorithm/blenders.h"
+#include "xpano/algorithm/capture.h"
+#include "xpano/algorithm/lens.h"
+#include "xpano/algorithm/preview_store.h"
+#include "xpano/algorithm/progress.h"
+#include "xpano/algorithm/reproject.h"
 #include "xpano/pipeline/options.h"
+#include "xpano/pipeline/shards.h"
+#include "xpano/utils/parallel_for.h"
+#include "xpano/utils/task_graph.h"
+#include "xpano/utils/threadpool.h"
 #include "xpano/utils/vec.h"
 
 #ifdef XPANO_WITH_EXIV2
 #include <exiv2/exiv2.hpp>
 #endif
+#include <opencv2/calib3d.hpp>
 #include <opencv2/core.hpp>
+#include <opencv2/core/ocl.hpp>
+#include <opencv2/features2d.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
+#ifdef XPANO_WITH_VIDEO
+#include <opencv2/videoio.hpp>
+#endif
 
+#include "tests/dataset.h"
 #include "tests/utils.h"
+#include "xpano/algorithm/blenders.h"
+#include "xpano/algorithm/buffer_pool.h"
+#include "xpano/algorithm/bundle_adjusters.h"
+#include "xpano/algorithm/exposure_compensators.h"
+#include "xpano/algorithm/grid.h"
 #include "xpano/algorithm/options.h"
+#include "xpano/algorithm/seam_finders.h"
 #include "xpano/algorithm/stitcher.h"
+#include "xpano/algorithm/video.h"
+#include "xpano/algorithm/warpers.h"
 #include "xpano/constants.h"
+#include "xpano/core.h"
+#include "xpano/pipeline/checkpoint.h"
+#include "xpano/pipeline/project.h"
+#include "xpano/utils/encoders.h"
+#include "xpano/utils/exiv2.h"
+#include "xpano/utils/memory.h"
 #include "xpano/utils/opencv.h"
 #include "xpano/utils/rect.h"
 #include "xpano/utils/vec_opencv.h"
@@ -159,6 +196,949 @@ TEST_CASE("Stitcher pipeline defaults [extra results]") {
   CHECK(stitch_result1.cameras->cameras.size() == 3);
 }
 
+TEST_CASE("Stitcher pipeline reused matches") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  auto loading_task = stitcher.RunLoading(kInputs, {}, {});
+  auto result = loading_task.future.get();
+  REQUIRE(result.panos.size() == 2);
+
+  const float eps = 0.02;
+
+  for (const bool reuse_matches : {true, false}) {
+    auto stitching_task = stitcher.RunStitching(
+        result,
+        {.pano_id = 0, .stitch_algorithm = {.reuse_matches = reuse_matches}});
+    auto stitch_result = stitching_task.future.get();
+    auto progress = stitching_task.progress->Report();
+    CHECK(progress.tasks_done == progress.num_tasks);
+
+    REQUIRE(stitch_result.pano.has_value());
+    CHECK_THAT(stitch_result.pano->rows, WithinRel(804, eps));
+    CHECK_THAT(stitch_result.pano->cols, WithinRel(2145, eps));
+    REQUIRE(stitch_result.cameras.has_value());
+    CHECK(stitch_result.cameras->cameras.size() == 5);
+  }
+}
+
+TEST_CASE("Find panos") {
+  auto match = [](int id1, int id2, int num_inliers) {
+    return xpano::algorithm::Match{
+        .id1 = id1,
+        .id2 = id2,
+        .avg_shift = 1.0f,
+        .summary = xpano::algorithm::MatchSummary{.num_inliers = num_inliers}};
+  };
+  // Ids out of order, a gap and a weak match joining the panos
+  const std::vector<xpano::algorithm::Match> matches = {
+      match(7, 9, 100), match(0, 3, 100), match(3, 9, 10),
+      match(2, 3, 100), match(6, 7, 100)};
+
+  auto panos = xpano::algorithm::FindPanos(matches, 70, 0.0f);
+  REQUIRE(panos.size() == 2);
+  CHECK(panos[0].ids == std::vector<int>{0, 2, 3});
+  CHECK(panos[1].ids == std::vector<int>{6, 7, 9});
+
+  CHECK(xpano::algorithm::FindPanos(matches, 200, 0.0f).empty());
+}
+
+TEST_CASE("Pano stream") {
+  auto match = [](int id1, int id2, int num_inliers) {
+    return xpano::algorithm::Match{
+        .id1 = id1,
+        .id2 = id2,
+        .avg_shift = 1.0f,
+        .summary = xpano::algorithm::MatchSummary{.num_inliers = num_inliers}};
+  };
+  // Two neighbors of each image, weak matches between the panos
+  const std::vector<xpano::algorithm::Match> matches = {
+      match(0, 1, 100), match(0, 2, 100), match(1, 2, 100),
+      match(1, 3, 10),  match(2, 3, 10),  match(2, 4, 10),
+      match(3, 4, 100), match(3, 5, 100), match(4, 5, 100)};
+  std::vector<std::pair<int, int>> pairs;
+  for (const auto &pair_match : matches) {
+    pairs.emplace_back(pair_match.id1, pair_match.id2);
+  }
+
+  xpano::algorithm::PanoStream stream(6, pairs, 70, 0.0f);
+  std::vector<std::vector<xpano::algorithm::Pano>> emitted;
+  for (int pair_id = 0; pair_id < static_cast<int>(matches.size());
+       pair_id++) {
+    emitted.push_back(stream.Add(pair_id, matches[pair_id]));
+  }
+
+  // Final once the last pair touching image 2 is matched
+  for (int pair_id = 0; pair_id < 5; pair_id++) {
+    CHECK(emitted[pair_id].empty());
+  }
+  REQUIRE(emitted[5].size() == 1);
+  CHECK(emitted[5][0].ids == std::vector<int>{0, 1, 2});
+  CHECK(stream.PairsOf(emitted[5][0]) == std::vector<int>{0, 1, 2});
+  CHECK(emitted[6].empty());
+  CHECK(emitted[7].empty());
+  REQUIRE(emitted[8].size() == 1);
+  CHECK(emitted[8][0].ids == std::vector<int>{3, 4, 5});
+
+  auto panos = xpano::algorithm::FindPanos(matches, 70, 0.0f);
+  REQUIRE(panos.size() == 2);
+  CHECK(panos[0].ids == emitted[5][0].ids);
+  CHECK(panos[1].ids == emitted[8][0].ids);
+}
+
+TEST_CASE("Parallel compositing") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(result.panos.size() == 2);
+
+  std::vector<cv::Mat> images;
+  for (const int img_id : result.panos[0].ids) {
+    images.push_back(result.images[img_id].GetPreview());
+  }
+
+  auto sequential = xpano::algorithm::Stitch(images, {}, {}, {});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(sequential.status));
+
+  xpano::utils::mt::Threadpool pool(4);
+  auto parallel = xpano::algorithm::Stitch(images, sequential.cameras, {},
+                                           {.threads_for_compose = &pool});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(parallel.status));
+
+  REQUIRE(parallel.pano.size() == sequential.pano.size());
+  cv::Mat diff;
+  cv::absdiff(parallel.pano, sequential.pano, diff);
+  CHECK(cv::countNonZero(diff.reshape(1)) == 0);
+}
+
+TEST_CASE("Device resident compositing") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(result.panos.size() == 2);
+
+  std::vector<cv::Mat> images;
+  for (const int img_id : result.panos[0].ids) {
+    images.push_back(result.images[img_id].GetPreview());
+  }
+
+  xpano::algorithm::StitchUserOptions user_options{
+      .blending_method = xpano::algorithm::BlendingMethod::kOpenCV};
+  auto host = xpano::algorithm::Stitch(images, {}, user_options, {});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(host.status));
+
+  user_options.device_resident = true;
+  const auto before = xpano::utils::memory::Transfers();
+  auto device = xpano::algorithm::Stitch(images, host.cameras, user_options,
+                                         {.display_longer_side = 512});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(device.status));
+  const auto after = xpano::utils::memory::Transfers();
+
+  // The device rounds the weighted levels, the host truncates them
+  REQUIRE(device.pano.size() == host.pano.size());
+  cv::Mat diff;
+  cv::absdiff(device.pano, host.pano, diff);
+  double max_diff = 0.0;
+  cv::minMaxLoc(diff.reshape(1), nullptr, &max_diff);
+  CHECK(max_diff <= 8.0);
+
+  if (cv::ocl::useOpenCL()) {
+    REQUIRE(!device.display.empty());
+    CHECK(std::max(device.display.cols, device.display.rows) == 512);
+    CHECK(after.downloads - before.downloads == 2);
+    CHECK(after.download_bytes - before.download_bytes ==
+          static_cast<std::int64_t>(device.pano.total() *
+                                        device.pano.elemSize() +
+                                    device.display.total() *
+                                        device.display.elemSize()));
+  } else {
+    CHECK(device.display.empty());
+    CHECK(after.downloads == before.downloads);
+  }
+}
+
+TEST_CASE("Streamed full resolution compositing") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(result.panos.size() == 2);
+
+  // The previews stand in for the full resolution images
+  std::vector<cv::Mat> images;
+  std::vector<cv::Mat> low_res;
+  std::vector<cv::Size> sizes;
+  for (const int img_id : result.panos[0].ids) {
+    images.push_back(result.images[img_id].GetPreview());
+    sizes.push_back(images.back().size());
+    cv::Mat half;
+    cv::resize(images.back(), half, cv::Size(), 0.5, 0.5, cv::INTER_AREA);
+    low_res.push_back(half);
+  }
+
+  auto preloaded = xpano::algorithm::Stitch(images, {}, {}, {});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(preloaded.status));
+
+  std::atomic<int> loads = 0;
+  const xpano::algorithm::stitcher::FullResSource source = {
+      .sizes = sizes,
+      .load =
+          [&images, &loads](int i) {
+            loads++;
+            return images[i];
+          },
+  };
+  xpano::utils::mt::Threadpool pool(4);
+  auto streamed = xpano::algorithm::Stitch(
+      low_res, preloaded.cameras, {},
+      {.threads_for_compose = &pool, .full_res_source = &source});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(streamed.status));
+
+  CHECK(streamed.pano.size() == preloaded.pano.size());
+  CHECK(loads > 0);
+  CHECK(loads <= static_cast<int>(images.size()));
+}
+
+TEST_CASE("Memory budget") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(result.panos.size() == 2);
+
+  std::vector<cv::Mat> images;
+  double input_bytes = 0.0;
+  for (const int img_id : result.panos[0].ids) {
+    images.push_back(result.images[img_id].GetPreview());
+    input_bytes += 3.0 * images.back().total();
+  }
+
+  auto unlimited = xpano::algorithm::Stitch(images, {}, {}, {});
+  REQUIRE(unlimited.status == xpano::algorithm::stitcher::Status::kSuccess);
+
+  // The inputs alone don't fit
+  auto too_small = xpano::algorithm::Stitch(
+      images, unlimited.cameras, {.max_memory_mb = 1}, {});
+  CHECK(too_small.status ==
+        xpano::algorithm::stitcher::Status::kErrMemoryBudget);
+
+  // The inputs fit, the blender needs at least 18 bytes per pano pixel
+  const double mb = 1024.0 * 1024.0;
+  const double pano_px = static_cast<double>(unlimited.pano.total());
+  const int budget_mb = static_cast<int>((input_bytes + pano_px * 4.0) / mb);
+  auto capped = xpano::algorithm::Stitch(images, unlimited.cameras,
+                                         {.max_memory_mb = budget_mb}, {});
+  REQUIRE(capped.status ==
+          xpano::algorithm::stitcher::Status::kSuccessResolutionCapped);
+  CHECK(capped.pano.total() < unlimited.pano.total());
+}
+
+TEST_CASE("Stitch session reuse") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(result.panos.size() == 2);
+
+  std::vector<cv::Mat> images;
+  for (const int img_id : result.panos[0].ids) {
+    images.push_back(result.images[img_id].GetPreview());
+  }
+
+  auto first = xpano::algorithm::Stitch(images, {}, {}, {});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(first.status));
+  REQUIRE(first.session);
+  REQUIRE(first.session->compose);
+  REQUIRE(first.session->compose->warp_maps);
+  for (size_t i = 0; i < first.cameras->component.size(); ++i) {
+    CHECK(first.session->compose->warp_maps->Get(i).has_value());
+  }
+
+  // Same inputs, the seams, gains and warp maps are reused
+  auto again = xpano::algorithm::Stitch(images, first.cameras, {},
+                                        {.session = first.session});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(again.status));
+  CHECK(again.session->compose == first.session->compose);
+  REQUIRE(again.session->buffer_pool);
+  CHECK(again.session->buffer_pool == first.session->buffer_pool);
+  CHECK(again.session->buffer_pool->GetStats().reuses > 0);
+  REQUIRE(again.pano.size() == first.pano.size());
+  cv::Mat diff;
+  cv::absdiff(again.pano, first.pano, diff);
+  CHECK(cv::countNonZero(diff.reshape(1)) == 0);
+
+  // Only the blender changed
+  auto reblended = xpano::algorithm::Stitch(
+      images, first.cameras,
+      {.blending_method = xpano::algorithm::BlendingMethod::kOpenCV},
+      {.session = first.session});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(reblended.status));
+  CHECK(reblended.session->compose == first.session->compose);
+
+  // Different projection
+  auto reprojected = xpano::algorithm::Stitch(
+      images, first.cameras,
+      {.projection = {.type = xpano::algorithm::ProjectionType::kCylindrical}},
+      {.session = first.session});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(reprojected.status));
+  CHECK(reprojected.session->compose != first.session->compose);
+
+  // Rotated cameras
+  cv::Mat rotation;
+  cv::Rodrigues(cv::Vec3f(0.0f, 0.1f, 0.0f), rotation);
+  auto rotated = xpano::algorithm::Stitch(
+      images, xpano::algorithm::Rotate(first.cameras, rotation), {},
+      {.session = first.session});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(rotated.status));
+  CHECK(rotated.session->compose != first.session->compose);
+}
+
+TEST_CASE("Stitch reuses the preview seams") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(result.panos.size() == 2);
+
+  std::vector<cv::Mat> images;
+  std::vector<cv::Mat> small_images;
+  for (const int img_id : result.panos[0].ids) {
+    images.push_back(result.images[img_id].GetPreview());
+    cv::Mat small;
+    cv::resize(images.back(), small, {}, 0.5, 0.5, cv::INTER_AREA);
+    small_images.push_back(small);
+  }
+
+  auto preview = xpano::algorithm::Stitch(small_images, {}, {},
+                                          {.preview = true});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(preview.status));
+  REQUIRE(preview.session->compose);
+  const auto& preview_seams = preview.session->compose->seams;
+
+  auto estimated = xpano::algorithm::Stitch(images, preview.cameras, {},
+                                            {.session = preview.session});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(estimated.status));
+  CHECK(estimated.session->compose->seams[0].u != preview_seams[0].u);
+
+  auto reused = xpano::algorithm::Stitch(images, preview.cameras,
+                                         {.reuse_preview_seams = true},
+                                         {.session = preview.session});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(reused.status));
+  CHECK(reused.session->compose != preview.session->compose);
+  CHECK(reused.session->compose->seams[0].u == preview_seams[0].u);
+  CHECK(reused.pano.size() == estimated.pano.size());
+}
+
+TEST_CASE("Seam refinement") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(result.panos.size() == 2);
+
+  std::vector<cv::Mat> images;
+  for (const int img_id : result.panos[0].ids) {
+    images.push_back(result.images[img_id].GetPreview());
+  }
+
+  const xpano::algorithm::StitchUserOptions user_options = {
+      .seam_finder = xpano::algorithm::SeamFinderType::kGraphCut};
+  auto coarse =
+      xpano::algorithm::Stitch(images, {}, user_options, {.preview = true});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(coarse.status));
+  auto refined =
+      xpano::algorithm::Stitch(images, coarse.cameras, user_options, {});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(refined.status));
+
+  const auto& coarse_seams = coarse.session->compose->seams;
+  const auto& refined_seams = refined.session->compose->seams;
+  REQUIRE(coarse_seams.size() == refined_seams.size());
+  for (size_t i = 0; i < coarse_seams.size(); ++i) {
+    // 0.1 MPx -> the whole ~0.75 MPx preview
+    CHECK(refined_seams[i].cols > 2 * coarse_seams[i].cols);
+    // The seams move only within a narrow band
+    cv::Mat downscaled;
+    cv::resize(refined_seams[i], downscaled, coarse_seams[i].size(), 0, 0,
+               cv::INTER_NEAREST);
+    cv::Mat diff;
+    cv::compare(downscaled, coarse_seams[i], diff, cv::CMP_NE);
+    CHECK(cv::countNonZero(diff) <
+          0.05 * cv::countNonZero(coarse_seams[i]));
+  }
+}
+
+TEST_CASE("Buffer pool") {
+  xpano::algorithm::BufferPool pool;
+  {
+    auto buffer = pool.Acquire({100, 50}, CV_8UC3);
+    CHECK(buffer.size() == cv::Size(100, 50));
+    CHECK(buffer.type() == CV_8UC3);
+    CHECK(buffer.isContinuous());
+  }
+  CHECK(pool.GetStats().allocations == 1);
+
+  // Free again, a smaller size of the same bucket reuses it
+  auto reused = pool.Acquire({90, 50}, CV_8UC3);
+  CHECK(pool.GetStats().allocations == 1);
+  CHECK(pool.GetStats().reuses == 1);
+
+  // Still referenced, a new buffer is needed
+  auto other = pool.Acquire({90, 50}, CV_8UC3);
+  CHECK(pool.GetStats().allocations == 2);
+  CHECK(other.u != reused.u);
+
+  // Different type
+  auto mask = pool.Acquire({90, 50}, CV_8U);
+  CHECK(pool.GetStats().allocations == 3);
+
+  const size_t held = pool.GetStats().bytes;
+  reused.release();
+  other.release();
+  pool.Trim(0);
+  CHECK(pool.GetStats().bytes < held);
+  CHECK(pool.GetStats().bytes > 0);  // the mask is still in use
+}
+
+TEST_CASE("Sparse bundle adjustment") {
+  namespace stitcher = xpano::algorithm::stitcher;
+  xpano::pipeline::StitcherPipeline<kReturnFuture> pipeline;
+  auto result = pipeline.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(result.panos.size() == 2);
+
+  std::vector<cv::Mat> images;
+  for (const int img_id : result.panos[0].ids) {
+    images.push_back(result.images[img_id].GetPreview());
+  }
+
+  auto dense = stitcher::Stitcher::Create();
+  REQUIRE(dense->EstimateTransform(images) == stitcher::Status::kSuccess);
+
+  auto sparse = stitcher::Stitcher::Create();
+  sparse->SetBundleAdjuster(
+      cv::makePtr<xpano::algorithm::bundle_adjusters::SparseRay>());
+  REQUIRE(sparse->EstimateTransform(images) == stitcher::Status::kSuccess);
+
+  // Same minimum of the same error
+  REQUIRE(sparse->Component() == dense->Component());
+  const auto dense_cameras = dense->Cameras();
+  const auto sparse_cameras = sparse->Cameras();
+  for (size_t i = 0; i < dense_cameras.size(); ++i) {
+    CHECK_THAT(sparse_cameras[i].focal,
+               WithinRel(dense_cameras[i].focal, 0.01));
+    CHECK(cv::norm(sparse_cameras[i].R, dense_cameras[i].R, cv::NORM_INF) <
+          0.01);
+  }
+
+  // Warm start from the refined cameras
+  auto warm = stitcher::Stitcher::Create();
+  warm->SetBundleAdjuster(
+      cv::makePtr<xpano::algorithm::bundle_adjusters::SparseRay>());
+  std::vector<std::optional<cv::detail::CameraParams>> initial_cameras(
+      images.size());
+  for (size_t i = 0; i < sparse_cameras.size(); ++i) {
+    initial_cameras[sparse->Component()[i]] = sparse_cameras[i];
+  }
+  warm->SetInitialCameras(initial_cameras);
+  REQUIRE(warm->EstimateTransform(images) == stitcher::Status::kSuccess);
+  const auto warm_cameras = warm->Cameras();
+  for (size_t i = 0; i < sparse_cameras.size(); ++i) {
+    CHECK_THAT(warm_cameras[i].focal,
+               WithinRel(sparse_cameras[i].focal, 0.01));
+  }
+}
+
+TEST_CASE("Warm start after a pano edit") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> pipeline;
+  auto result = pipeline.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(result.panos.size() == 2);
+  const auto& ids = result.panos[0].ids;
+  REQUIRE(ids.size() > 2);
+
+  std::vector<cv::Mat> images;
+  for (const int img_id : ids) {
+    images.push_back(result.images[img_id].GetPreview());
+  }
+  auto fresh = xpano::algorithm::Stitch(images, {}, {}, {});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(fresh.status));
+
+  // The last image was added to a pano stitched without it
+  const std::vector<int> old_ids(ids.begin(), ids.end() - 1);
+  const std::vector<cv::Mat> old_images(images.begin(), images.end() - 1);
+  auto old = xpano::algorithm::Stitch(old_images, {}, {}, {});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(old.status));
+
+  const auto initial_cameras = xpano::algorithm::KeepCameras(
+      xpano::algorithm::PerImageCameras(*old.cameras,
+                                        static_cast<int>(old_ids.size())),
+      old_ids, ids);
+  REQUIRE(initial_cameras.size() == ids.size());
+  CHECK(!initial_cameras.back().has_value());
+  CHECK(std::count_if(initial_cameras.begin(), initial_cameras.end(),
+                      [](const auto& camera) { return camera.has_value(); }) ==
+        static_cast<std::ptrdiff_t>(old.cameras->component.size()));
+
+  auto warm = xpano::algorithm::Stitch(images, {}, {},
+                                       {.initial_cameras = &initial_cameras});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(warm.status));
+  const float eps = 0.05f;
+  CHECK_THAT(warm.pano.rows, WithinRel(fresh.pano.rows, eps));
+  CHECK_THAT(warm.pano.cols, WithinRel(fresh.pano.cols, eps));
+
+  // Nothing kept
+  CHECK(xpano::algorithm::KeepCameras(initial_cameras, ids, {100, 101})
+            .empty());
+}
+
+TEST_CASE("Seam finders") {
+  using xpano::algorithm::ResolveSeamFinder;
+  using xpano::algorithm::SeamFinderType;
+  CHECK(ResolveSeamFinder(SeamFinderType::kAuto, /*preview=*/true) ==
+        SeamFinderType::kDpColor);
+  CHECK(ResolveSeamFinder(SeamFinderType::kAuto, /*preview=*/false) ==
+        SeamFinderType::kGraphCut);
+  CHECK(ResolveSeamFinder(SeamFinderType::kVoronoi, /*preview=*/false) ==
+        SeamFinderType::kVoronoi);
+
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(result.panos.size() == 2);
+
+  std::vector<cv::Mat> images;
+  for (const int img_id : result.panos[0].ids) {
+    images.push_back(result.images[img_id].GetPreview());
+  }
+
+  auto graph_cut = xpano::algorithm::Stitch(images, {}, {}, {});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(graph_cut.status));
+  CHECK(graph_cut.session->seam_finder == SeamFinderType::kGraphCut);
+
+  for (auto seam_finder :
+       {SeamFinderType::kVoronoi, SeamFinderType::kDpColor}) {
+    auto pano = xpano::algorithm::Stitch(images, graph_cut.cameras,
+                                         {.seam_finder = seam_finder},
+                                         {.session = graph_cut.session});
+    REQUIRE(xpano::algorithm::stitcher::IsSuccess(pano.status));
+    CHECK(pano.pano.size() == graph_cut.pano.size());
+    // The seams differ, the session can't be reused
+    CHECK(pano.session->seam_finder == seam_finder);
+    CHECK(pano.session->compose != graph_cut.session->compose);
+  }
+}
+
+TEST_CASE("Preview blenders") {
+  using xpano::algorithm::BlendingMethod;
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(result.panos.size() == 2);
+
+  std::vector<cv::Mat> images;
+  for (const int img_id : result.panos[0].ids) {
+    images.push_back(result.images[img_id].GetPreview());
+  }
+
+  auto multi_band = xpano::algorithm::Stitch(
+      images, {}, {.blending_method = BlendingMethod::kOpenCV}, {});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(multi_band.status));
+
+  for (auto blending_method :
+       {BlendingMethod::kFeather, BlendingMethod::kSeamOnly}) {
+    auto pano = xpano::algorithm::Stitch(
+        images, multi_band.cameras,
+        {.blending_method = BlendingMethod::kOpenCV,
+         .preview_blending_method = blending_method},
+        {.return_pano_mask = true, .preview = true});
+    REQUIRE(xpano::algorithm::stitcher::IsSuccess(pano.status));
+    CHECK(pano.pano.size() == multi_band.pano.size());
+    CHECK(pano.pano.type() == CV_8UC3);
+    CHECK(pano.mask.CountSet() > 0);
+  }
+}
+
+TEST_CASE("Crop-aware composition") {
+  using xpano::algorithm::BlendingMethod;
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(result.panos.size() == 2);
+
+  std::vector<cv::Mat> images;
+  for (const int img_id : result.panos[1].ids) {
+    images.push_back(result.images[img_id].GetPreview());
+  }
+
+  // Seam only blending doesn't depend on the mask borders
+  const xpano::algorithm::StitchUserOptions user_options = {
+      .preview_blending_method = BlendingMethod::kSeamOnly};
+  auto full = xpano::algorithm::Stitch(images, {}, user_options,
+                                       {.return_pano_mask = true,
+                                        .preview = true});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(full.status));
+
+  const auto crop = xpano::utils::Rect(xpano::utils::Ratio2f{0.3f, 0.2f},
+                                       xpano::utils::Ratio2f{0.9f, 0.7f});
+  xpano::utils::mt::Threadpool pool(4);
+  for (auto *threads : {static_cast<xpano::utils::mt::Threadpool *>(nullptr),
+                        &pool}) {
+    auto cropped = xpano::algorithm::Stitch(
+        images, full.cameras, user_options,
+        {.return_pano_mask = true,
+         .threads_for_compose = threads,
+         .preview = true,
+         .compose_crop = crop});
+    REQUIRE(xpano::algorithm::stitcher::IsSuccess(cropped.status));
+
+    const auto rect = xpano::utils::GetCvRect(full.pano, crop);
+    REQUIRE(cropped.pano.size() == rect.size());
+    REQUIRE(cropped.mask.Size() == rect.size());
+
+    cv::Mat diff;
+    cv::absdiff(cropped.pano, full.pano(rect), diff);
+    CHECK(cv::mean(diff)[0] < 1.0);
+    cv::Mat mask_diff;
+    cv::absdiff(cropped.mask.Decode(), full.mask.Decode()(rect), mask_diff);
+    CHECK(cv::countNonZero(mask_diff) < rect.area() / 100);
+  }
+}
+
+TEST_CASE("Reprojection") {
+  using xpano::algorithm::ProjectionType;
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(result.panos.size() == 2);
+
+  std::vector<cv::Mat> images;
+  for (const int img_id : result.panos[1].ids) {
+    images.push_back(result.images[img_id].GetPreview());
+  }
+
+  // Portrait projections can't be reprojected
+  const xpano::algorithm::StitchUserOptions user_options = {
+      .projection = {.type = ProjectionType::kSpherical},
+      .wave_correction = xpano::algorithm::WaveCorrectionType::kHorizontal};
+  auto full = xpano::algorithm::Stitch(images, {}, user_options,
+                                       {.return_pano_mask = true,
+                                        .preview = true});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(full.status));
+  CHECK(xpano::algorithm::ComposedProjection(full.cameras) ==
+        ProjectionType::kSpherical);
+
+  // Without a rotation the pano is remapped onto itself
+  const int longer_side = std::max(full.pano.cols, full.pano.rows);
+  auto identity = xpano::algorithm::Reproject(
+      full.pano, full.cameras, {.max_longer_side = longer_side});
+  REQUIRE(identity);
+  REQUIRE(identity->size() == full.pano.size());
+  cv::Mat diff;
+  cv::absdiff(*identity, full.pano, diff);
+  const cv::Mat full_mask = full.mask.Decode();
+  CHECK(cv::mean(diff, full_mask)[0] < 2.0);
+
+  // Rotating there and back again keeps the pano where both cover it
+  cv::Mat rotation;
+  cv::Rodrigues(cv::Vec3f(0.0f, 0.05f, 0.0f), rotation);
+  auto rotated = xpano::algorithm::Reproject(
+      full.pano, full.cameras,
+      {.rotation_matrix = rotation, .max_longer_side = longer_side});
+  REQUIRE(rotated);
+  REQUIRE(rotated->size() == full.pano.size());
+  auto rotated_cameras = xpano::algorithm::Rotate(full.cameras, rotation);
+  auto back = xpano::algorithm::Reproject(
+      *rotated, rotated_cameras,
+      {.rotation_matrix = rotation.t(), .max_longer_side = longer_side});
+  REQUIRE(back);
+  cv::Mat back_gray;
+  cv::cvtColor(*back, back_gray, cv::COLOR_BGR2GRAY);
+  cv::Mat covered = full_mask & (back_gray > 0);
+  REQUIRE(cv::countNonZero(covered) > full.pano.rows * full.pano.cols / 2);
+  cv::absdiff(*back, full.pano, diff);
+  CHECK(cv::mean(diff, covered)[0] < 10.0);
+
+  // Switching the projection changes the pano ROI, closed-forms only
+  auto cylindrical = xpano::algorithm::Reproject(
+      full.pano, full.cameras, {.projection = ProjectionType::kCylindrical});
+  REQUIRE(cylindrical);
+  CHECK(std::max(cylindrical->cols, cylindrical->rows) <=
+        xpano::kReprojectionLongerSide);
+  CHECK_FALSE(xpano::algorithm::Reproject(
+      full.pano, full.cameras, {.projection = ProjectionType::kFisheye}));
+}
+
+TEST_CASE("Tiled inpainting") {
+  cv::Mat pano(1300, 1500, CV_8UC3);
+  for (int row = 0; row < pano.rows; row++) {
+    for (int col = 0; col < pano.cols; col++) {
+      pano.at<cv::Vec3b>(row, col) = {static_cast<uchar>(50 + row % 200),
+                                      static_cast<uchar>(50 + col % 200),
+                                      static_cast<uchar>(100)};
+    }
+  }
+  // A sliver along the border and a corner far from any known pixel
+  cv::Mat mask(pano.size(), CV_8U, cv::Scalar(0));
+  mask.colRange(0, 20) = 255;
+  mask(cv::Rect(800, 600, 700, 700)) = 255;
+  pano.setTo(cv::Scalar::all(0), mask);
+
+  auto sequential = xpano::algorithm::Inpaint(pano, mask, {}, nullptr);
+  xpano::utils::mt::Threadpool pool(4);
+  auto parallel = xpano::algorithm::Inpaint(pano, mask, {}, &pool);
+
+  REQUIRE(sequential.size() == pano.size());
+  cv::Mat diff;
+  cv::absdiff(sequential, parallel, diff);
+  CHECK(cv::countNonZero(diff.reshape(1)) == 0);
+
+  // Known pixels are kept, all the others are filled
+  cv::absdiff(sequential, pano, diff);
+  cv::Mat known;
+  cv::bitwise_not(mask, known);
+  CHECK(cv::mean(diff, known) == cv::Scalar::all(0));
+  cv::Mat gray;
+  cv::cvtColor(sequential, gray, cv::COLOR_BGR2GRAY);
+  CHECK(cv::countNonZero(gray) == pano.rows * pano.cols);
+}
+
+TEST_CASE("Fast warpers") {
+  namespace stitcher = xpano::algorithm::stitcher;
+  const float scale = 500.0f;
+  const cv::Size src_size(640, 480);
+  const cv::Mat K = (cv::Mat_<float>(3, 3) << scale, 0, 320, 0, scale, 240, 0,
+                     0, 1);
+  cv::Mat R;
+  cv::Rodrigues(cv::Vec3f(0.1f, 0.2f, 0.05f), R);
+
+  const std::vector<std::pair<cv::Ptr<cv::WarperCreator>,
+                              cv::Ptr<cv::WarperCreator>>>
+      warpers = {
+          {cv::makePtr<cv::PlaneWarper>(),
+           cv::makePtr<stitcher::FastPlaneWarper>()},
+          {cv::makePtr<cv::CylindricalWarper>(),
+           cv::makePtr<stitcher::FastCylindricalWarper>()},
+          {cv::makePtr<cv::SphericalWarper>(),
+           cv::makePtr<stitcher::FastSphericalWarper>()},
+          {cv::makePtr<cv::MercatorWarper>(),
+           cv::makePtr<stitcher::FastMercatorWarper>()},
+      };
+
+  for (const auto& [reference_creator, fast_creator] : warpers) {
+    cv::Mat reference_xmap;
+    cv::Mat reference_ymap;
+    auto reference_roi = reference_creator->create(scale)->buildMaps(
+        src_size, K, R, reference_xmap, reference_ymap);
+
+    cv::Mat fast_xmap;
+    cv::Mat fast_ymap;
+    auto fast_roi = fast_creator->create(scale)->buildMaps(
+        src_size, K, R, fast_xmap, fast_ymap);
+
+    REQUIRE(fast_roi == reference_roi);
+    REQUIRE(fast_xmap.size() == reference_xmap.size());
+    CHECK(cv::norm(fast_xmap, reference_xmap, cv::NORM_INF) < 1e-2);
+    CHECK(cv::norm(fast_ymap, reference_ymap, cv::NORM_INF) < 1e-2);
+  }
+}
+
+TEST_CASE("Multi-band blender") {
+  const std::vector<cv::Point> corners = {{0, 0}, {150, 20}, {60, 110}};
+  std::vector<cv::Mat> images;
+  std::vector<cv::Mat> masks;
+  for (size_t i = 0; i < corners.size(); ++i) {
+    cv::Mat image = cv::imread(kInputs[i].string());
+    REQUIRE(!image.empty());
+    cv::resize(image, image, cv::Size(200, 150));
+    images.push_back(image);
+    masks.emplace_back(image.size(), CV_8U, cv::Scalar::all(255));
+  }
+  const cv::Rect roi = cv::detail::resultRoi(
+      corners, std::vector<cv::Size>(corners.size(), images[0].size()));
+
+  cv::detail::MultiBandBlender reference_blender(false);
+  reference_blender.prepare(roi);
+  for (size_t i = 0; i < corners.size(); ++i) {
+    cv::Mat image_s;
+    images[i].convertTo(image_s, CV_16S);
+    reference_blender.feed(image_s, masks[i], corners[i]);
+  }
+  cv::Mat reference;
+  cv::Mat reference_mask;
+  reference_blender.blend(reference, reference_mask);
+  reference.convertTo(reference, CV_8U);
+
+  xpano::algorithm::BufferPool pool;
+  xpano::algorithm::blenders::MultiBandOpenCV blender(&pool);
+  blender.prepare(roi);
+  for (size_t i = 0; i < corners.size(); ++i) {
+    blender.feed(images[i], masks[i], corners[i]);
+  }
+  cv::Mat result;
+  cv::Mat result_mask;
+  blender.blend(result, result_mask);
+
+  REQUIRE(result.size() == reference.size());
+  CHECK(result.type() == CV_8UC3);
+  CHECK(cv::norm(result_mask, reference_mask, cv::NORM_INF) == 0);
+  // Only the rounding of the 8-bit pyramid levels differs
+  cv::Mat diff;
+  cv::absdiff(result, reference, diff);
+  CHECK(cv::mean(diff)[0] < 1.0);
+  CHECK(cv::norm(diff, cv::NORM_INF) <= 8);
+}
+
+TEST_CASE("Parallel graph cut seams") {
+  const std::vector<cv::Point> corners = {
+      {0, 0}, {120, 0}, {60, 80}, {180, 80}, {240, 10}};
+  std::vector<cv::UMat> images;
+  std::vector<cv::UMat> masks;
+  for (size_t i = 0; i < corners.size(); ++i) {
+    cv::Mat image = cv::imread(kInputs[i].string());
+    REQUIRE(!image.empty());
+    cv::resize(image, image, cv::Size(200, 150));
+    cv::UMat image_float;
+    image.convertTo(image_float, CV_32F);
+    images.push_back(image_float);
+    masks.emplace_back(image.size(), CV_8U, cv::Scalar::all(255));
+  }
+
+  auto serial_masks = masks;
+  for (auto& mask : serial_masks) {
+    mask = mask.clone();
+  }
+  cv::detail::GraphCutSeamFinder(cv::detail::GraphCutSeamFinderBase::COST_COLOR)
+      .find(images, corners, serial_masks);
+
+  xpano::utils::mt::Threadpool pool(4);
+  auto parallel_masks = masks;
+  for (auto& mask : parallel_masks) {
+    mask = mask.clone();
+  }
+  xpano::algorithm::seam_finders::ParallelGraphCut(&pool).find(
+      images, corners, parallel_masks);
+
+  for (size_t i = 0; i < masks.size(); ++i) {
+    cv::Mat diff;
+    cv::absdiff(serial_masks[i], parallel_masks[i], diff);
+    CHECK(cv::countNonZero(diff) == 0);
+    // The seams cut something
+    CHECK(cv::countNonZero(serial_masks[i]) <
+          static_cast<int>(masks[i].total()));
+  }
+}
+
+TEST_CASE("Parallel exposure compensation") {
+  const std::vector<cv::Point> corners = {
+      {0, 0}, {120, 0}, {60, 80}, {180, 80}, {240, 10}};
+  std::vector<cv::UMat> images;
+  std::vector<cv::UMat> masks;
+  for (size_t i = 0; i < corners.size(); ++i) {
+    cv::Mat image = cv::imread(kInputs[i].string());
+    REQUIRE(!image.empty());
+    cv::resize(image, image, cv::Size(200, 150));
+    images.push_back(image.getUMat(cv::ACCESS_READ).clone());
+    masks.emplace_back(image.size(), CV_8U, cv::Scalar::all(255));
+  }
+
+  auto gain_maps = [&](cv::detail::ExposureCompensator* compensator) {
+    compensator->feed(corners, images, masks);
+    std::vector<cv::Mat> maps;
+    compensator->getMatGains(maps);
+    return maps;
+  };
+  cv::detail::BlocksGainCompensator opencv_compensator;
+  const auto expected = gain_maps(&opencv_compensator);
+
+  xpano::utils::mt::Threadpool pool(4);
+  xpano::algorithm::exposure_compensators::ParallelBlocksGain
+      parallel_compensator(&pool);
+  const auto parallel = gain_maps(&parallel_compensator);
+  xpano::algorithm::exposure_compensators::ParallelBlocksGain
+      serial_compensator(nullptr);
+  const auto serial = gain_maps(&serial_compensator);
+
+  REQUIRE(parallel.size() == expected.size());
+  REQUIRE(serial.size() == expected.size());
+  for (size_t i = 0; i < expected.size(); ++i) {
+    REQUIRE(parallel[i].size() == expected[i].size());
+    CHECK(cv::norm(parallel[i], expected[i], cv::NORM_INF) < 1e-2);
+    CHECK(cv::norm(parallel[i], serial[i], cv::NORM_INF) == 0.0);
+  }
+}
+
+TEST_CASE("Parallel exposure compensation of a darker image") {
+  cv::Mat source = cv::imread(kInputs[0].string());
+  REQUIRE(!source.empty());
+  cv::resize(source, source, cv::Size(300, 150));
+  cv::Mat first = source(cv::Rect(0, 0, 200, 150)).clone();
+  cv::Mat second;
+  source(cv::Rect(100, 0, 200, 150)).convertTo(second, -1, 0.8);
+  const std::vector<cv::Point> corners = {{0, 0}, {100, 0}};
+  const cv::Rect overlap(100, 0, 100, 150);
+
+  auto brightness_ratio = [&](const cv::Mat& image1, const cv::Mat& image2) {
+    const auto mean1 = cv::mean(image1(overlap - corners[0]));
+    const auto mean2 = cv::mean(image2(overlap - corners[1]));
+    return (mean2[0] + mean2[1] + mean2[2]) / (mean1[0] + mean1[1] + mean1[2]);
+  };
+  const double ratio_before = brightness_ratio(first, second);
+  CHECK_THAT(ratio_before, WithinAbs(0.8, 0.01));
+
+  xpano::utils::mt::Threadpool pool(2);
+  for (const bool channel_wise : {false, true}) {
+    xpano::algorithm::exposure_compensators::ParallelBlocksGain compensator(
+        &pool, channel_wise);
+    std::vector<cv::UMat> images = {first.getUMat(cv::ACCESS_READ).clone(),
+                                    second.getUMat(cv::ACCESS_READ).clone()};
+    std::vector<cv::UMat> masks(
+        2, cv::UMat(first.size(), CV_8U, cv::Scalar::all(255)));
+    compensator.feed(corners, images, masks);
+    for (int i = 0; i < 2; ++i) {
+      compensator.apply(i, corners[i], images[i], masks[i]);
+    }
+    const double ratio_after = brightness_ratio(
+        images[0].getMat(cv::ACCESS_READ), images[1].getMat(cv::ACCESS_READ));
+    // Only partially, the gains are pulled towards 1
+    CHECK(ratio_after > ratio_before + 0.05);
+    CHECK(ratio_after < 1.0);
+  }
+}
+
+TEST_CASE("Tiled compositing") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(result.panos.size() == 2);
+
+  std::vector<cv::Mat> images;
+  for (const int img_id : result.panos[0].ids) {
+    images.push_back(result.images[img_id].GetPreview());
+  }
+
+  const xpano::algorithm::StitchUserOptions user_options = {
+      .blending_method = xpano::algorithm::BlendingMethod::kOpenCV};
+  auto in_memory = xpano::algorithm::Stitch(images, {}, user_options,
+                                            {.return_pano_mask = true});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(in_memory.status));
+
+  cv::Mat pano;
+  cv::Mat pano_mask;
+  int num_tiles = 0;
+  const xpano::algorithm::stitcher::TiledOutput output = {
+      .tile_size = 256,
+      .open =
+          [&](cv::Size size) {
+            pano.create(size, CV_8UC3);
+            pano_mask.create(size, CV_8U);
+            return true;
+          },
+      .write =
+          [&](cv::Point tile_tl, const cv::Mat& image, const cv::Mat& mask) {
+            const cv::Rect tile(tile_tl, image.size());
+            image.copyTo(pano(tile));
+            mask.copyTo(pano_mask(tile));
+            num_tiles++;
+            return true;
+          },
+  };
+  auto tiled = xpano::algorithm::Stitch(
+      images, in_memory.cameras, user_options, {.tiled_output = &output});
+  REQUIRE(xpano::algorithm::stitcher::IsSuccess(tiled.status));
+  CHECK(tiled.pano.empty());
+  CHECK(num_tiles > 1);
+
+  REQUIRE(pano.size() == in_memory.pano.size());
+  cv::Mat diff;
+  cv::absdiff(pano, in_memory.pano, diff);
+  // The blending bands are cut off at the tile margins
+  CHECK(cv::mean(diff)[0] < 1.0);
+
+  cv::Mat mask_diff;
+  cv::absdiff(pano_mask, in_memory.mask.Decode(), mask_diff);
+  CHECK(cv::countNonZero(mask_diff) < pano_mask.rows * pano_mask.cols / 100);
+}
+
 const std::vector<std::filesystem::path> kInputsFirstPano = {
     "data/image01.jpg", "data/image02.jpg", "data/image03.jpg",
     "data/image04.jpg", "data/image05.jpg"};
@@ -281,122 +1261,919 @@ TEST_CASE("Stitcher pipeline no matching") {
   auto progress = loading_task.progress->Report();
   CHECK(progress.tasks_done == progress.num_tasks);
 
-  CHECK(result.images.size() == 10);
-  CHECK(result.matches.empty());
-  REQUIRE(result.panos.empty());
+  CHECK(result.images.size() == 10);
+  CHECK(result.matches.empty());
+  REQUIRE(result.panos.empty());
+
+  for (const auto& image : result.images) {
+    REQUIRE(image.GetKeypoints().empty());
+    REQUIRE(image.GetDescriptors().empty());
+  }
+}
+
+const std::vector<std::filesystem::path> kShuffledInputs = {
+    "data/image01.jpg",  // Pano 1
+    "data/image06.jpg",  // 2
+    "data/image02.jpg",  // Pano 1
+    "data/image07.jpg",  // 2
+    "data/image03.jpg",  // Pano 1
+    "data/image00.jpg",
+    "data/image08.jpg",  // 2
+    "data/image04.jpg",  // Pano 1
+    "data/image09.jpg",
+    "data/image05.jpg",  // Pano 1
+};
+
+TEST_CASE("Stitcher pipeline custom matching neighborhood") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  auto loading_task =
+      stitcher.RunLoading(kShuffledInputs, {}, {.neighborhood_search_size = 3});
+  auto result = loading_task.future.get();
+  auto progress = loading_task.progress->Report();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  CHECK(result.images.size() == 10);
+  CHECK(result.matches.size() == 24);
+  REQUIRE(result.panos.size() == 2);
+  REQUIRE_THAT(result.panos[0].ids, Equals<int>({0, 2, 4, 7, 9}));
+  REQUIRE_THAT(result.panos[1].ids, Equals<int>({1, 3, 6}));
+}
+
+TEST_CASE("Stitcher pipeline adaptive neighborhood") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  auto loading_task = stitcher.RunLoading(
+      kShuffledInputs, {},
+      {.neighborhood_search_size = 3, .adaptive_neighborhood = true});
+  auto result = loading_task.future.get();
+  auto progress = loading_task.progress->Report();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  CHECK(result.images.size() == 10);
+  CHECK(result.matches.size() < 24);  // less than the fixed neighborhood
+  REQUIRE(result.panos.size() == 2);
+  REQUIRE_THAT(result.panos[0].ids, Equals<int>({0, 2, 4, 7, 9}));
+  REQUIRE_THAT(result.panos[1].ids, Equals<int>({1, 3, 6}));
+}
+
+TEST_CASE("Stitcher pipeline retrieval") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  // The shuffled panos are found even without looking at the neighbors
+  auto loading_task = stitcher.RunLoading(
+      kShuffledInputs, {},
+      {.neighborhood_search_size = 0,
+       .use_retrieval = true,
+       .retrieval_candidates = 5});
+  auto result = loading_task.future.get();
+  auto progress = loading_task.progress->Report();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  CHECK(result.images.size() == 10);
+  CHECK(result.matches.size() < 45);  // less than all pairs
+  REQUIRE(result.panos.size() == 2);
+  REQUIRE_THAT(result.panos[0].ids, Equals<int>({0, 2, 4, 7, 9}));
+  REQUIRE_THAT(result.panos[1].ids, Equals<int>({1, 3, 6}));
+}
+
+// NOLINTBEGIN(readability-magic-numbers)
+
+TEST_CASE("Stitcher pipeline appending") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  const std::vector<std::filesystem::path> first_inputs(kInputs.begin(),
+                                                        kInputs.begin() + 7);
+  const std::vector<std::filesystem::path> new_inputs(kInputs.begin() + 7,
+                                                      kInputs.end());
+
+  auto loading_task = stitcher.RunLoading(first_inputs, {}, {});
+  auto result = loading_task.future.get();
+  REQUIRE(result.images.size() == 7);
+  REQUIRE(result.panos.size() == 1);
+  REQUIRE_THAT(result.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  result.panos[0].exported = true;
+
+  auto appending_task = stitcher.RunAppending(result, new_inputs, {}, {});
+  auto appended = appending_task.future.get();
+  auto progress = appending_task.progress->Report();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  REQUIRE(appended.images.size() == 10);
+  for (int i = 0; i < 10; i++) {
+    CHECK(appended.images[i].GetPath() == kInputs[i]);
+  }
+  CHECK(appended.matches.size() == 17);
+  REQUIRE(appended.panos.size() == 2);
+  REQUIRE_THAT(appended.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  REQUIRE_THAT(appended.panos[1].ids, Equals<int>({6, 7, 8}));
+  CHECK(appended.panos[0].exported);
+  CHECK_FALSE(appended.panos[1].exported);
+}
+
+TEST_CASE("Stitcher pipeline regrouping") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(result.panos.size() == 2);
+  result.panos[0].exported = true;
+
+  // The same options give the same matches
+  auto regrouped = stitcher.RunRegrouping(result, {}).future.get();
+  REQUIRE(regrouped.matches.size() == result.matches.size());
+  for (size_t i = 0; i < result.matches.size(); i++) {
+    CHECK(regrouped.matches[i].matches.size() ==
+          result.matches[i].matches.size());
+  }
+  REQUIRE(regrouped.panos.size() == 2);
+  CHECK(regrouped.panos[0].exported);
+
+  auto split =
+      stitcher.RunRegrouping(result, {.match_threshold = 100000}).future.get();
+  CHECK(split.panos.empty());
+
+  // A stricter ratio test keeps fewer matches, back to the original after
+  auto strict =
+      stitcher.RunRegrouping(result, {.match_conf = xpano::kMaxMatchConf})
+          .future.get();
+  int num_strict = 0;
+  int num_original = 0;
+  for (size_t i = 0; i < result.matches.size(); i++) {
+    num_strict += static_cast<int>(strict.matches[i].matches.size());
+    num_original += static_cast<int>(result.matches[i].matches.size());
+  }
+  CHECK(num_strict < num_original);
+  auto restored = stitcher.RunRegrouping(strict, {}).future.get();
+  for (size_t i = 0; i < result.matches.size(); i++) {
+    CHECK(restored.matches[i].matches.size() ==
+          result.matches[i].matches.size());
+  }
+  REQUIRE(restored.panos.size() == 2);
+  REQUIRE_THAT(restored.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  REQUIRE_THAT(restored.panos[1].ids, Equals<int>({6, 7, 8}));
+}
+
+TEST_CASE("Stitcher pipeline homography methods") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  for (const auto homography : xpano::algorithm::kHomographyMethods) {
+    auto loading_task =
+        stitcher.RunLoading(kInputs, {}, {.homography = homography});
+    auto result = loading_task.future.get();
+    auto progress = loading_task.progress->Report();
+    CHECK(progress.tasks_done == progress.num_tasks);
+
+    CHECK(result.images.size() == 10);
+    CHECK(result.matches.size() == 17);
+    REQUIRE(result.panos.size() == 2);
+    CHECK_THAT(result.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+    CHECK_THAT(result.panos[1].ids, Equals<int>({6, 7, 8}));
+  }
+}
+
+TEST_CASE("Stitcher pipeline larger neighborhood size") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  auto loading_task = stitcher.RunLoading(
+      {"data/image01.jpg", "data/image02.jpg", "data/image03.jpg"}, {},
+      {.neighborhood_search_size = 10});
+
+  auto result = loading_task.future.get();
+  auto progress = loading_task.progress->Report();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  REQUIRE(result.images.size() == 3);
+  REQUIRE(result.matches.size() == 3);  // [0 + 1], [0 + 2], [1 + 2]
+}
+
+// NOLINTEND(readability-magic-numbers)
+
+TEST_CASE("Stitcher pipeline single image") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  auto loading_task = stitcher.RunLoading({"data/image01.jpg"}, {}, {});
+  auto result = loading_task.future.get();
+  auto progress = loading_task.progress->Report();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  REQUIRE(result.images.size() == 1);
+  REQUIRE(result.matches.empty());
+}
+
+TEST_CASE("Stitcher pipeline no images") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  auto loading_task = stitcher.RunLoading({}, {}, {});
+  auto result = loading_task.future.get();
+  auto progress = loading_task.progress->Report();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  REQUIRE(result.images.empty());
+  REQUIRE(result.matches.empty());
+}
+
+TEST_CASE("Stitcher pipeline in-memory images") {
+  std::vector<xpano::algorithm::Image> inputs;
+  for (std::size_t i = 0; i < kInputs.size(); i++) {
+    inputs.emplace_back(
+        "stdin_" + std::to_string(i + 1) + ".jpg",
+        std::make_shared<const std::vector<unsigned char>>(
+            xpano::algorithm::ReadFileBytes(kInputs[i])));
+  }
+
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto from_files = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  auto in_memory = stitcher.RunLoadingImages(inputs, {}, {}).future.get();
+
+  REQUIRE(in_memory.images.size() == from_files.images.size());
+  CHECK(in_memory.images[0].IsInMemory());
+  CHECK(in_memory.images[0].GetPath() == "stdin_1.jpg");
+  CHECK(in_memory.matches.size() == from_files.matches.size());
+  REQUIRE(in_memory.panos.size() == from_files.panos.size());
+
+  // Decoded from the buffer, the file name doesn't exist
+  auto full_res = in_memory.images[0].GetFullRes();
+  CHECK(full_res.size() == from_files.images[0].GetFullRes().size());
+
+  auto stitched =
+      stitcher.RunStitching(in_memory, {.pano_id = 0, .full_res = true})
+          .future.get();
+  CHECK(stitched.pano);
+}
+
+TEST_CASE("Stitcher pipeline early panos") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher(
+      {.stream_panos = true});
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  auto early = stitcher.PopEarlyPanos();
+  CHECK(stitcher.PopEarlyPanos().empty());
+
+  // Every pano is complete by the last match at the latest
+  REQUIRE(early.size() == result.panos.size());
+  for (const auto &data : early) {
+    REQUIRE(data.panos.size() == 1);
+    const auto &ids = data.panos[0].ids;
+    CHECK(std::any_of(result.panos.begin(), result.panos.end(),
+                      [&ids](const auto &pano) { return pano.ids == ids; }));
+    CHECK(data.images.size() == result.images.size());
+    CHECK(!data.matches.empty());
+    for (const auto &match : data.matches) {
+      CHECK(std::binary_search(ids.begin(), ids.end(), match.id1));
+      CHECK(std::binary_search(ids.begin(), ids.end(), match.id2));
+    }
+  }
+
+  auto stitched =
+      stitcher.RunStitching(early[0], {.pano_id = 0}).future.get();
+  CHECK(stitched.pano);
+}
+
+TEST_CASE("Stitcher pipeline loading options") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  const int preview_size = 512;
+  const int allowed_margin = 1.0;
+
+  auto loading_task =
+      stitcher.RunLoading({"data/image05.jpg", "data/image06.jpg"},
+                          {.preview_longer_side = preview_size}, {});
+  auto result = loading_task.future.get();
+  auto progress = loading_task.progress->Report();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  REQUIRE(result.images.size() == 2);
+
+  auto landscape_full = result.images[0].GetFullRes();
+  auto landscape_full_size = landscape_full.size();
+  auto landscape_preview = result.images[0].GetPreview();
+  auto landscape_preview_size = landscape_preview.size();
+
+  CHECK(landscape_preview_size.width == preview_size);
+  CHECK_THAT(landscape_preview_size.height,
+             WithinAbs(preview_size / landscape_full_size.aspectRatio(),
+                       allowed_margin));
+
+  auto portrait_full = result.images[1].GetFullRes();
+  auto portrait_full_size = portrait_full.size();
+  auto portrait_preview = result.images[1].GetPreview();
+  auto portrait_preview_size = portrait_preview.size();
+
+  CHECK(portrait_preview_size.height == preview_size);
+  CHECK_THAT(portrait_preview_size.width,
+             WithinAbs(preview_size * portrait_full_size.aspectRatio(),
+                       allowed_margin));
+}
+
+TEST_CASE("Stitcher pipeline detection size") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  const int preview_size = 2048;
+  const int detection_size = 512;
+  auto result = stitcher
+                    .RunLoading(kInputs,
+                                {.preview_longer_side = preview_size,
+                                 .detection_longer_side = detection_size},
+                                {})
+                    .future.get();
+
+  REQUIRE(result.images.size() == 10);
+  REQUIRE(result.panos.size() == 2);
+  REQUIRE_THAT(result.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  REQUIRE_THAT(result.panos[1].ids, Equals<int>({6, 7, 8}));
+
+  for (const auto& image : result.images) {
+    const auto preview = image.GetPreview();
+    CHECK(image.GetPreviewLongerSide() > detection_size);
+    REQUIRE(image.NumKeypoints() > 0);
+    // Keypoints span the whole preview, not just the detection image
+    float max_x = 0.0f;
+    float max_y = 0.0f;
+    for (const auto& keypoint : image.GetKeypoints()) {
+      max_x = std::max(max_x, keypoint.pt.x);
+      max_y = std::max(max_y, keypoint.pt.y);
+    }
+    CHECK(max_x < static_cast<float>(preview.cols));
+    CHECK(max_y < static_cast<float>(preview.rows));
+    CHECK(std::max(max_x, max_y) > static_cast<float>(detection_size));
+  }
+}
+
+TEST_CASE("Stitcher pipeline released inliers") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  auto kept = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  auto released =
+      stitcher.RunLoading(kInputs, {}, {.release_inliers = true}).future.get();
+
+  REQUIRE(released.matches.size() == kept.matches.size());
+  REQUIRE(released.panos.size() == 2);
+  REQUIRE_THAT(released.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  REQUIRE_THAT(released.panos[1].ids, Equals<int>({6, 7, 8}));
+  for (size_t i = 0; i < kept.matches.size(); i++) {
+    const auto& match = released.matches[i];
+    CHECK(match.matches.empty());
+    CHECK(match.homography.empty());
+    CHECK(!match.candidates);
+    if (!kept.matches[i].matches.empty()) {
+      // Estimated once by the matching, moved to the summary
+      CHECK(!kept.matches[i].homography.empty());
+      CHECK(cv::norm(kept.matches[i].homography, match.summary->homography,
+                     cv::NORM_INF) < 1e-6);
+    }
+    CHECK(xpano::algorithm::NumInliers(match) ==
+          xpano::algorithm::NumInliers(kept.matches[i]));
+  }
+
+  // Restored from the kept homography
+  const auto& pano_match = *std::find_if(
+      released.matches.begin(), released.matches.end(),
+      [](const auto& match) { return match.id1 == 1 && match.id2 == 2; });
+  auto restored = xpano::algorithm::RestoreInliers(
+      pano_match, released.images[1], released.images[2]);
+  CHECK(restored.id1 == 1);
+  CHECK(restored.id2 == 2);
+  CHECK(!restored.homography.empty());
+  CHECK_THAT(static_cast<double>(restored.matches.size()),
+             WithinRel(static_cast<double>(
+                           xpano::algorithm::NumInliers(pano_match)),
+                       0.2));
+
+  auto stitched = stitcher.RunStitching(released, {.pano_id = 0}).future.get();
+  CHECK(stitched.pano.has_value());
+}
+
+TEST_CASE("Stitcher pipeline coarse to fine") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  auto loading_task = stitcher.RunLoading(
+      kInputs, {.detection_longer_side = 512},
+      {.coarse_to_fine = true, .fine_longer_side = 2048});
+  auto result = loading_task.future.get();
+  auto progress = loading_task.progress->Report();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  REQUIRE(result.images.size() == 10);
+  REQUIRE(result.panos.size() == 2);
+  REQUIRE_THAT(result.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  REQUIRE_THAT(result.panos[1].ids, Equals<int>({6, 7, 8}));
+
+  // The refined matches index the keypoints detected at the fine size
+  for (const auto& match : result.matches) {
+    for (const auto& dmatch : match.matches) {
+      REQUIRE(dmatch.queryIdx < result.images[match.id1].NumKeypoints());
+      REQUIRE(dmatch.trainIdx < result.images[match.id2].NumKeypoints());
+    }
+  }
+
+  auto stitch_result =
+      stitcher.RunStitching(result, {.pano_id = 0}).future.get();
+  CHECK(stitch_result.pano.has_value());
+}
+
+TEST_CASE("Stitcher pipeline compact features") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  auto compact_result =
+      stitcher.RunLoading(kInputs, {.compact_features = true}, {}).future.get();
+
+  REQUIRE(compact_result.images.size() == result.images.size());
+  for (int i = 0; i < result.images.size(); i++) {
+    const auto& image = result.images[i];
+    const auto& compact_image = compact_result.images[i];
+    CHECK(compact_image.GetDescriptors().depth() == CV_8U);
+    REQUIRE(compact_image.NumKeypoints() == image.NumKeypoints());
+    for (int k = 0; k < image.NumKeypoints(); k++) {
+      CHECK(compact_image.GetKeypointPosition(k) ==
+            image.GetKeypointPosition(k));
+    }
+  }
+
+  // Compact descriptors are lossless
+  REQUIRE(compact_result.matches.size() == result.matches.size());
+  for (int i = 0; i < result.matches.size(); i++) {
+    CHECK(compact_result.matches[i].matches.size() ==
+          result.matches[i].matches.size());
+  }
+  REQUIRE(compact_result.panos.size() == 2);
+  CHECK_THAT(compact_result.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  CHECK_THAT(compact_result.panos[1].ids, Equals<int>({6, 7, 8}));
+}
+
+TEST_CASE("Stitcher pipeline compressed previews") {
+  const std::size_t budget = 8 * xpano::kMegabyte;
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher(
+      {.decoded_preview_cache_bytes = budget});
+
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  auto compressed_result =
+      stitcher.RunLoading(kInputs, {.compress_previews = true}, {})
+          .future.get();
+
+  REQUIRE(compressed_result.images.size() == result.images.size());
+  for (int i = 0; i < result.images.size(); i++) {
+    const auto& image = result.images[i];
+    const auto& compressed_image = compressed_result.images[i];
+    CHECK(compressed_image.IsPreviewCompressed());
+    CHECK(compressed_image.GetPreviewSize() == image.GetPreviewSize());
+    CHECK(compressed_image.GetPreviewBytes() < image.GetPreviewBytes());
+    CHECK(compressed_image.GetPreview().size() == image.GetPreviewSize());
+    CHECK(compressed_image.NumKeypoints() == image.NumKeypoints());
+  }
+  CHECK(xpano::algorithm::GetDecodedPreviewStats().bytes_used <= budget);
+
+  REQUIRE(compressed_result.panos.size() == 2);
+  CHECK_THAT(compressed_result.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  CHECK_THAT(compressed_result.panos[1].ids, Equals<int>({6, 7, 8}));
+
+  auto stitch_result =
+      stitcher.RunStitching(compressed_result, {.pano_id = 0}).future.get();
+  CHECK(stitch_result.pano.has_value());
+}
+
+TEST_CASE("Stitcher pipeline lens correction") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  const xpano::algorithm::LensOptions lens = {
+      .undistort = true,
+      .profiles = {{.model = "No such camera", .k1 = 0.5f},
+                   {.k1 = -0.02f, .k2 = 0.005f}}};
+  auto result = stitcher.RunLoading(kInputs, {.lens = lens}, {}).future.get();
+
+  REQUIRE(result.images.size() == 10);
+  for (const auto& image : result.images) {
+    REQUIRE(image.GetLensProfile().has_value());
+    CHECK(image.GetLensProfile()->k1 == -0.02f);
+  }
+  REQUIRE(result.panos.size() == 2);
+  CHECK_THAT(result.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  CHECK_THAT(result.panos[1].ids, Equals<int>({6, 7, 8}));
+
+  auto stitch_result =
+      stitcher.RunStitching(result, {.pano_id = 0, .full_res = true})
+          .future.get();
+  CHECK(stitch_result.pano.has_value());
+}
+
+TEST_CASE("Lens undistortion") {
+  cv::Mat image(cv::Size(101, 61), CV_8UC3, cv::Scalar(0, 0, 0));
+  image.at<cv::Vec3b>(30, 50) = cv::Vec3b(255, 255, 255);
+
+  const xpano::algorithm::LensProfile profile{.k1 = -0.2f};
+  auto undistorted = xpano::algorithm::lens::Undistort(image, profile);
+  REQUIRE(undistorted.size() == image.size());
+  // The center stays in place
+  CHECK(undistorted.at<cv::Vec3b>(30, 50) == cv::Vec3b(255, 255, 255));
+  // Barrel distortion: the corners come from within the image
+  CHECK(undistorted.at<cv::Vec3b>(0, 0) == cv::Vec3b(0, 0, 0));
+
+  auto again = xpano::algorithm::lens::Undistort(image, profile);
+  CHECK(cv::norm(again, undistorted, cv::NORM_INF) == 0.0);
+}
+
+TEST_CASE("Stitcher pipeline OpenCL detector") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+
+  // Falls back to the CPU path on machines without an OpenCL device
+  auto result =
+      stitcher
+          .RunLoading(kInputs,
+                      {.feature = xpano::algorithm::FeatureType::kOrb,
+                       .detector_backend =
+                           xpano::algorithm::DetectorBackend::kOpenCL},
+                      {})
+          .future.get();
 
+  REQUIRE(result.images.size() == 10);
   for (const auto& image : result.images) {
-    REQUIRE(image.GetKeypoints().empty());
-    REQUIRE(image.GetDescriptors().empty());
+    CHECK(image.NumKeypoints() > 0);
+    CHECK(image.GetDescriptors().rows == image.NumKeypoints());
+    CHECK(image.GetDescriptors().depth() == CV_8U);
   }
+  CHECK(!result.panos.empty());
+
+  // SIFT has no OpenCL detector, the option runs the CPU path
+  auto sift =
+      stitcher
+          .RunLoading(kInputs,
+                      {.detector_backend =
+                           xpano::algorithm::DetectorBackend::kOpenCL},
+                      {})
+          .future.get();
+  REQUIRE(sift.panos.size() == 2);
+  CHECK_THAT(sift.panos[0].ids, Equals<int>({1, 2, 3, 4, 5}));
+  CHECK_THAT(sift.panos[1].ids, Equals<int>({6, 7, 8}));
 }
 
-const std::vector<std::filesystem::path> kShuffledInputs = {
-    "data/image01.jpg",  // Pano 1
-    "data/image06.jpg",  // 2
-    "data/image02.jpg",  // Pano 1
-    "data/image07.jpg",  // 2
-    "data/image03.jpg",  // Pano 1
-    "data/image00.jpg",
-    "data/image08.jpg",  // 2
-    "data/image04.jpg",  // Pano 1
-    "data/image09.jpg",
-    "data/image05.jpg",  // Pano 1
-};
-
-TEST_CASE("Stitcher pipeline custom matching neighborhood") {
+TEST_CASE("Stitcher pipeline binary features") {
+  const int num_features = 2000;
   xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
 
-  auto loading_task =
-      stitcher.RunLoading(kShuffledInputs, {}, {.neighborhood_search_size = 3});
-  auto result = loading_task.future.get();
-  auto progress = loading_task.progress->Report();
-  CHECK(progress.tasks_done == progress.num_tasks);
-
-  CHECK(result.images.size() == 10);
-  CHECK(result.matches.size() == 24);
-  REQUIRE(result.panos.size() == 2);
-  REQUIRE_THAT(result.panos[0].ids, Equals<int>({0, 2, 4, 7, 9}));
-  REQUIRE_THAT(result.panos[1].ids, Equals<int>({1, 3, 6}));
+  for (auto feature : {xpano::algorithm::FeatureType::kOrb,
+                       xpano::algorithm::FeatureType::kAkaze}) {
+    auto result =
+        stitcher
+            .RunLoading(kInputs,
+                        {.feature = feature, .num_features = num_features}, {})
+            .future.get();
+
+    REQUIRE(result.images.size() == 10);
+    for (const auto& image : result.images) {
+      CHECK(image.NumKeypoints() > 0);
+      CHECK(image.NumKeypoints() <= num_features);
+      CHECK(image.GetDescriptors().depth() == CV_8U);
+    }
+    CHECK(!result.matches.empty());
+    CHECK(!result.panos.empty());
+  }
 }
 
-// NOLINTBEGIN(readability-magic-numbers)
-
-TEST_CASE("Stitcher pipeline larger neighborhood size") {
+TEST_CASE("Stitcher pipeline embedded previews") {
   xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
 
+  // Falls back to decoding the main image if there is no usable preview
   auto loading_task = stitcher.RunLoading(
-      {"data/image01.jpg", "data/image02.jpg", "data/image03.jpg"}, {},
-      {.neighborhood_search_size = 10});
-
+      kInputsFirstPano, {.use_embedded_previews = true}, {});
   auto result = loading_task.future.get();
   auto progress = loading_task.progress->Report();
   CHECK(progress.tasks_done == progress.num_tasks);
 
-  REQUIRE(result.images.size() == 3);
-  REQUIRE(result.matches.size() == 3);  // [0 + 1], [0 + 2], [1 + 2]
+  REQUIRE(result.images.size() == 5);
+  for (const auto& image : result.images) {
+    CHECK(image.GetPreviewLongerSide() == xpano::kDefaultPreviewLongerSide);
+  }
+  REQUIRE(result.panos.size() == 1);
+  CHECK_THAT(result.panos[0].ids, Equals<int>({0, 1, 2, 3, 4}));
 }
 
-// NOLINTEND(readability-magic-numbers)
+TEST_CASE("Modern encoders") {
+  namespace encoders = xpano::utils::encoders;
+  using encoders::Format;
+  CHECK(encoders::FormatOf("pano.JXL") == Format::kJxl);
+  CHECK(encoders::FormatOf("dir/pano.avif") == Format::kAvif);
+  CHECK(encoders::FormatOf("pano.webp") == Format::kWebp);
+  CHECK_FALSE(encoders::FormatOf("pano.jpg").has_value());
+
+  cv::Mat image(300, 401, CV_8UC3);
+  cv::randu(image, 0, 256);
+  xpano::utils::mt::Threadpool pool(4);
+  // Magic bytes, the AVIF brand follows the box size
+  const std::vector<std::pair<Format, std::vector<unsigned char>>> formats =
+      {{Format::kJxl, {0xff, 0x0a}},
+       {Format::kAvif, {'f', 't', 'y', 'p'}},
+       {Format::kWebp, {'R', 'I', 'F', 'F'}}};
+  for (const auto &[format, magic] : formats) {
+    for (const int quality : {75, xpano::kMaxEncoderQuality}) {
+      auto encoded = encoders::Encode(
+          image, format, {.quality = quality, .effort = 1}, &pool);
+      REQUIRE(encoded.has_value() == encoders::Enabled(format));
+      if (!encoded) {
+        continue;
+      }
+      const std::size_t offset = format == Format::kAvif ? 4 : 0;
+      REQUIRE(encoded->size() > offset + magic.size());
+      CHECK(std::equal(magic.begin(), magic.end(),
+                       encoded->begin() +
+                           static_cast<std::ptrdiff_t>(offset)));
+    }
+  }
+}
 
-TEST_CASE("Stitcher pipeline single image") {
-  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+TEST_CASE("Options invalidated stages") {
+  using xpano::pipeline::FirstInvalidStage;
+  using xpano::pipeline::StitchStage;
+  const xpano::pipeline::Options before;
+  auto after = before;
+  CHECK_FALSE(FirstInvalidStage(before, after).has_value());
+
+  after.preview.speculative_stitching = !before.preview.speculative_stitching;
+  after.matching.match_threshold++;
+  CHECK_FALSE(FirstInvalidStage(before, after).has_value());
+
+  after.compression.jpeg_quality--;
+  CHECK(FirstInvalidStage(before, after) == StitchStage::kExport);
+  after.stitch.preview_blending_method =
+      xpano::algorithm::BlendingMethod::kOpenCV;
+  CHECK(FirstInvalidStage(before, after) == StitchStage::kComposition);
+  after.stitch.projection.type = xpano::algorithm::ProjectionType::kPerspective;
+  CHECK(FirstInvalidStage(before, after) == StitchStage::kSeams);
+  after.stitch.wave_correction = xpano::algorithm::WaveCorrectionType::kOff;
+  CHECK(FirstInvalidStage(before, after) == StitchStage::kCameras);
+  after.stitch.reuse_matches = !before.stitch.reuse_matches;
+  CHECK(FirstInvalidStage(before, after) == StitchStage::kFeatures);
+}
 
-  auto loading_task = stitcher.RunLoading({"data/image01.jpg"}, {}, {});
-  auto result = loading_task.future.get();
-  auto progress = loading_task.progress->Report();
-  CHECK(progress.tasks_done == progress.num_tasks);
+TEST_CASE("Matching mask") {
+  const int threshold = 10;
+  auto make_match = [](int id1, int id2, int num_matches) {
+    return xpano::algorithm::Match{
+        id1, id2, std::vector<cv::DMatch>(num_matches)};
+  };
+  // Chain 3 - 4 - 5 - 6, the pair 3 - 5 is below the threshold and the pair
+  // 6 - 7 is outside of the pano
+  const std::vector<int> ids = {3, 4, 5, 6};
+  const std::vector<xpano::algorithm::Match> matches = {
+      make_match(3, 4, 20), make_match(4, 5, 20), make_match(5, 6, 20),
+      make_match(3, 5, 5), make_match(6, 7, 20)};
+
+  auto mask = xpano::algorithm::MatchingMask(ids, matches, threshold, false);
+  REQUIRE(mask.rows == 4);
+  REQUIRE(mask.cols == 4);
+  CHECK(cv::countNonZero(mask) == 6);
+  CHECK(mask.at<uchar>(0, 1) != 0);
+  CHECK(mask.at<uchar>(1, 0) != 0);
+  CHECK(mask.at<uchar>(0, 2) == 0);
+
+  auto expanded =
+      xpano::algorithm::MatchingMask(ids, matches, threshold, true);
+  CHECK(cv::countNonZero(expanded) == 10);
+  CHECK(expanded.at<uchar>(0, 2) != 0);
+  CHECK(expanded.at<uchar>(0, 3) == 0);
+  CHECK(expanded.at<uchar>(0, 0) == 0);
+
+  // Disconnected pano, match all pairs
+  auto disconnected = xpano::algorithm::MatchingMask(
+      ids, {make_match(3, 4, 20), make_match(5, 6, 20)}, threshold, true);
+  CHECK(disconnected.empty());
+}
 
-  REQUIRE(result.images.size() == 1);
-  REQUIRE(result.matches.empty());
+TEST_CASE("Capture filter") {
+  using xpano::utils::exiv2::CaptureInfo;
+  using xpano::utils::exiv2::GpsPosition;
+  const GpsPosition here = {50.0, 14.0};
+  // ~1.1 km to the north
+  const GpsPosition there = {50.01, 14.0};
+  CHECK_THAT(xpano::algorithm::GpsDistance(here, there),
+             WithinRel(1112.0, 0.01));
+
+  const std::vector<CaptureInfo> infos = {
+      {.time = 1000, .position = here}, {.time = 1030, .position = here},
+      {.time = 1055},                   {.time = 2000, .position = here},
+      {.time = 2010, .position = there}, {}};
+  const xpano::algorithm::CaptureFilter filter(infos, 60, 100.0);
+  CHECK(filter.NumTimeGroups() == 2);
+
+  // The chain 1000 - 1030 - 1055 stays together
+  CHECK(filter.Compatible(0, 1));
+  CHECK(filter.Compatible(0, 2));
+  // Time gap
+  CHECK_FALSE(filter.Compatible(2, 3));
+  // Distance
+  CHECK_FALSE(filter.Compatible(3, 4));
+  // No metadata
+  for (int i = 0; i < 5; i++) {
+    CHECK(filter.Compatible(i, 5));
+  }
 }
 
-TEST_CASE("Stitcher pipeline no images") {
-  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+TEST_CASE("Capture grid") {
+  using xpano::algorithm::GridOptions;
+  using xpano::algorithm::GridOrder;
+  using Pairs = std::vector<std::pair<int, int>>;
+  // 0 1 2
+  // 5 4 3
+  const GridOptions grid = {.rows = 2, .cols = 3};
+  CHECK(xpano::algorithm::GridCell(grid, 2) == cv::Point(2, 0));
+  CHECK(xpano::algorithm::GridCell(grid, 3) == cv::Point(2, 1));
+  CHECK(xpano::algorithm::GridCell(grid, 5) == cv::Point(0, 1));
+  CHECK(xpano::algorithm::GridCell({.rows = 2, .cols = 3,
+                                    .order = GridOrder::kColumns},
+                                   3) == cv::Point(1, 1));
+
+  CHECK(xpano::algorithm::GridPairs(grid, 6, 0) ==
+        Pairs{{0, 1}, {0, 5}, {1, 2}, {1, 4}, {2, 3}, {3, 4}, {4, 5}});
+  // Only the pairs with a new image
+  CHECK(xpano::algorithm::GridPairs(grid, 6, 4) ==
+        Pairs{{0, 5}, {1, 4}, {3, 4}, {4, 5}});
+  // Incomplete last row
+  CHECK(xpano::algorithm::GridPairs(grid, 5, 0) ==
+        Pairs{{0, 1}, {1, 2}, {1, 4}, {2, 3}, {3, 4}});
+
+  auto diagonals = grid;
+  diagonals.diagonals = true;
+  CHECK(xpano::algorithm::GridPairs(diagonals, 6, 0).size() == 11);
+
+  auto mask = xpano::algorithm::GridMatchingMask(grid, {0, 1, 2});
+  REQUIRE(mask.size() == cv::Size(3, 3));
+  CHECK(cv::countNonZero(mask) == 4);
+  CHECK(mask.at<uchar>(0, 1) == 1);
+  CHECK(mask.at<uchar>(1, 0) == 1);
+  CHECK(mask.at<uchar>(0, 2) == 0);
+  CHECK(mask.at<uchar>(1, 1) == 0);
+}
 
-  auto loading_task = stitcher.RunLoading({}, {}, {});
-  auto result = loading_task.future.get();
-  auto progress = loading_task.progress->Report();
-  CHECK(progress.tasks_done == progress.num_tasks);
+TEST_CASE("Match connectivity") {
+  const auto match = [](int id1, int id2, int num_matches) {
+    return xpano::algorithm::Match{
+        .id1 = id1,
+        .id2 = id2,
+        .matches = std::vector<cv::DMatch>(num_matches),
+        .avg_shift = 0.1f};
+  };
+  xpano::algorithm::MatchConnectivity connectivity(10, 0.0f, 20);
+  connectivity.Add(match(0, 1, 30));
+  connectivity.Add(match(1, 2, 12));
+  connectivity.Add(match(2, 3, 5));
+
+  // Connected
+  CHECK_FALSE(connectivity.Needs(0, 2));
+  // Both strongly matched
+  connectivity.Add(match(4, 5, 25));
+  CHECK_FALSE(connectivity.Needs(1, 4));
+  // 2 and 3 are weak
+  CHECK(connectivity.Needs(2, 4));
+  CHECK(connectivity.Needs(3, 5));
+  CHECK(connectivity.Needs(0, 6));
+
+  // Below min_shift, doesn't count
+  xpano::algorithm::MatchConnectivity shifted(10, 0.5f, 20);
+  shifted.Add(match(0, 1, 30));
+  CHECK(shifted.Needs(0, 1));
+}
 
-  REQUIRE(result.images.empty());
-  REQUIRE(result.matches.empty());
+TEST_CASE("Difference hash") {
+  auto image = cv::imread("data/image01.jpg");
+  REQUIRE_FALSE(image.empty());
+  cv::Mat smaller;
+  cv::resize(image, smaller, cv::Size(), 0.5, 0.5, cv::INTER_AREA);
+  cv::Mat brighter;
+  image.convertTo(brighter, -1, 1.0, 10.0);
+  auto other = cv::imread("data/image08.jpg");
+  REQUIRE_FALSE(other.empty());
+
+  const auto hash = xpano::algorithm::DifferenceHash(image);
+  using xpano::algorithm::HashDistance;
+  CHECK(HashDistance(hash, xpano::algorithm::DifferenceHash(smaller)) <=
+        xpano::kDefaultDuplicateHashDistance);
+  CHECK(HashDistance(hash, xpano::algorithm::DifferenceHash(brighter)) <=
+        xpano::kDefaultDuplicateHashDistance);
+  CHECK(HashDistance(hash, xpano::algorithm::DifferenceHash(other)) >
+        xpano::kDefaultDuplicateHashDistance);
 }
 
-TEST_CASE("Stitcher pipeline loading options") {
+// Pans to the right by 10 % of the frame
+std::vector<cv::Mat> PanFrames(const cv::Mat& image) {
+  const int width = image.cols / 2;
+  const int step = width / 10;
+  std::vector<cv::Mat> frames;
+  for (int i = 0; i * step + width <= image.cols; i++) {
+    frames.push_back(image(cv::Rect(i * step, 0, width, image.rows)));
+  }
+  return frames;
+}
+
+TEST_CASE("Keyframe selector") {
+  auto image = cv::imread("data/image01.jpg");
+  REQUIRE_FALSE(image.empty());
+  const auto frames = PanFrames(image);
+  REQUIRE(frames.size() == 11);
+
+  xpano::algorithm::video::KeyframeSelector selector({.min_overlap = 0.75f});
+  std::vector<int> keyframes;
+  for (int i = 0; i < static_cast<int>(frames.size()); i++) {
+    if (selector.Push(frames[i])) {
+      keyframes.push_back(i);
+    }
+  }
+  CHECK(keyframes == std::vector{0, 3, 6, 9});
+}
+
+#ifdef XPANO_WITH_VIDEO
+TEST_CASE("Stitcher pipeline video keyframes") {
+  auto image = cv::imread("data/image01.jpg");
+  REQUIRE_FALSE(image.empty());
+  const auto frames = PanFrames(image);
+  const auto video_path = xpano::tests::TmpPath().replace_extension("avi");
+  {
+    cv::VideoWriter writer(video_path.string(),
+                           cv::VideoWriter::fourcc('M', 'J', 'P', 'G'), 10.0,
+                           frames[0].size());
+    REQUIRE(writer.isOpened());
+    for (const auto& frame : frames) {
+      writer.write(frame.clone());
+    }
+  }
+
   xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto result =
+      stitcher.RunLoading({video_path}, {.keyframe_overlap = 0.75f}, {})
+          .future.get();
+  std::filesystem::remove(video_path);
+
+  // Only the keyframes, no near-duplicates
+  REQUIRE(result.images.size() > 1);
+  CHECK(result.images.size() < frames.size());
+  CHECK(result.images[0].GetVideoFrame() == 0);
+  CHECK(result.images[0].GetKey() != result.images[1].GetKey());
+  CHECK(result.panos.size() == 1);
+  CHECK(result.images[1].GetFullRes().size() == frames[0].size());
+}
+#endif
 
-  const int preview_size = 512;
-  const int allowed_margin = 1.0;
+TEST_CASE("Stitcher pipeline skip duplicates") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  const std::vector<std::filesystem::path> inputs = {
+      "data/image01.jpg", "data/image01.jpg", "data/image02.jpg"};
 
   auto loading_task =
-      stitcher.RunLoading({"data/image05.jpg", "data/image06.jpg"},
-                          {.preview_longer_side = preview_size}, {});
+      stitcher.RunLoading(inputs, {}, {.skip_duplicates = true});
   auto result = loading_task.future.get();
   auto progress = loading_task.progress->Report();
   CHECK(progress.tasks_done == progress.num_tasks);
 
-  REQUIRE(result.images.size() == 2);
+  REQUIRE(result.images.size() == 3);
+  REQUIRE(result.images[0].GetPerceptualHash().has_value());
+  CHECK(result.images[0].GetPerceptualHash() ==
+        result.images[1].GetPerceptualHash());
+  // Only the pairs with image02
+  CHECK(result.matches.size() == 2);
+  for (const auto &match : result.matches) {
+    CHECK(match.id2 == 2);
+  }
+}
 
-  auto landscape_full = result.images[0].GetFullRes();
-  auto landscape_full_size = landscape_full.size();
-  auto landscape_preview = result.images[0].GetPreview();
-  auto landscape_preview_size = landscape_preview.size();
+TEST_CASE("Stitcher pipeline indexed matching") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
 
-  CHECK(landscape_preview_size.width == preview_size);
-  CHECK_THAT(landscape_preview_size.height,
-             WithinAbs(preview_size / landscape_full_size.aspectRatio(),
-                       allowed_margin));
+  for (const auto& image : result.images) {
+    CHECK(image.GetDescriptorIndex() != nullptr);
+  }
 
-  auto portrait_full = result.images[1].GetFullRes();
-  auto portrait_full_size = portrait_full.size();
-  auto portrait_preview = result.images[1].GetPreview();
-  auto portrait_preview_size = portrait_preview.size();
+  // Prebuilt index and a fresh matcher agree
+  auto copy_without_index = [](const xpano::algorithm::Image& image) {
+    return xpano::algorithm::Image(image.GetPath(), image.GetPreview(),
+                                   image.GetThumbnail(), image.GetKeypoints(),
+                                   image.GetDescriptors(), image.IsRaw());
+  };
+  auto left = copy_without_index(result.images[1]);
+  auto right = copy_without_index(result.images[2]);
+  REQUIRE(right.GetDescriptorIndex() == nullptr);
+
+  auto indexed = xpano::algorithm::MatchImages(1, 2, result.images[1],
+                                               result.images[2], {});
+  auto fresh = xpano::algorithm::MatchImages(1, 2, left, right, {});
+  REQUIRE(!fresh.matches.empty());
+  CHECK_THAT(static_cast<double>(indexed.matches.size()),
+             WithinRel(static_cast<double>(fresh.matches.size()), 0.1));
+}
 
-  CHECK(portrait_preview_size.height == preview_size);
-  CHECK_THAT(portrait_preview_size.width,
-             WithinAbs(preview_size * portrait_full_size.aspectRatio(),
-                       allowed_margin));
+TEST_CASE("Image copies share data") {
+  xpano::algorithm::Image image("data/image01.jpg");
+  image.Load({.preview_longer_side = xpano::kDefaultPreviewLongerSide});
+  image.BuildDescriptorIndex();
+  REQUIRE(image.IsLoaded());
+
+  const auto copy = image;  // NOLINT(performance-unnecessary-copy-*)
+  CHECK(copy.GetPreview().data == image.GetPreview().data);
+  CHECK(copy.GetDescriptors().data == image.GetDescriptors().data);
+  CHECK(copy.GetDescriptorIndex() == image.GetDescriptorIndex());
+  CHECK(copy.NumKeypoints() == image.NumKeypoints());
+
+  image.Compact();
+  CHECK(copy.GetDescriptors().depth() == CV_32F);
+  CHECK(image.GetDescriptors().depth() == CV_8U);
+  CHECK(copy.NumKeypoints() == image.NumKeypoints());
 }
 
 const std::vector<std::filesystem::path> kVerticalPanoInputs = {
@@ -431,6 +2208,70 @@ TEST_CASE("Stitcher pipeline vertical pano") {
   CHECK_THAT(pano0->cols, WithinRel(1030, eps));
 }
 
+TEST_CASE("Synthetic dataset") {
+  namespace dataset = xpano::tests::dataset;
+  const cv::Mat source = cv::imread("data/image00.jpg");
+  REQUIRE(!source.empty());
+
+  SECTION("crops") {
+    const dataset::Options options = {.count = 4,
+                                      .view_size = {640, 480},
+                                      .overlap = 0.5f,
+                                      .order = dataset::Order::kReversed};
+    const auto views = dataset::Generate(source, options);
+    REQUIRE(views.size() == 4);
+    for (int i = 0; i < views.size(); i++) {
+      CHECK(views[i].image.size() == cv::Size(640, 480));
+      CHECK(views[i].col == 3 - i);
+      CHECK(views[i].crop == cv::Rect(320 * (3 - i), 0, 640, 480));
+    }
+
+    const auto dir = xpano::tests::TmpPath();
+    REQUIRE(dataset::Write(dir, views, options));
+    CHECK(std::filesystem::exists(dir / "ground_truth.json"));
+
+    xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+    auto result =
+        stitcher.RunLoading(dataset::ImagePaths(dir, 4), {}, {}).future.get();
+    REQUIRE(result.images.size() == 4);
+    REQUIRE(result.panos.size() == 1);
+    auto ids = result.panos[0].ids;
+    std::sort(ids.begin(), ids.end());
+    CHECK_THAT(ids, Equals<int>({0, 1, 2, 3}));
+    std::filesystem::remove_all(dir);
+  }
+
+  SECTION("renders") {
+    const dataset::Options options = {.mode = dataset::Mode::kRender,
+                                      .count = 6,
+                                      .rows = 2,
+                                      .view_size = {320, 240},
+                                      .overlap = 0.5f,
+                                      .order = dataset::Order::kShuffled,
+                                      .seed = 1,
+                                      .fov_deg = 60.0f};
+    const auto views = dataset::Generate(source, options);
+    REQUIRE(views.size() == 6);
+
+    const float eps = 1e-4;
+    for (const auto &view : views) {
+      CHECK(view.image.size() == cv::Size(320, 240));
+      CHECK_THAT(view.camera.ppx, WithinAbs(160.0, eps));
+      const cv::Mat rotation = view.camera.R;
+      const cv::Mat identity = rotation * rotation.t();
+      CHECK(cv::norm(identity, cv::Mat::eye(3, 3, CV_32F)) < eps);
+    }
+    // Same seed, same order
+    const auto again = dataset::Generate(source, options);
+    for (int i = 0; i < views.size(); i++) {
+      CHECK(views[i].row == again[i].row);
+      CHECK(views[i].col == again[i].col);
+    }
+  }
+
+  CHECK(dataset::Generate(source, {.overlap = 1.0f}).empty());
+}
+
 const std::vector<std::filesystem::path> kInputsWithExifMetadata = {
     "data/image06.jpg",
     "data/image07.jpg",
@@ -453,6 +2294,8 @@ TEST_CASE("Export [extra results]") {
   CHECK(stitch_result.auto_crop.has_value());
   CHECK(stitch_result.mask.has_value());
   CHECK(stitch_result.export_path.has_value());
+  // Matches the result to the pano once the panos changed
+  CHECK(stitch_result.ids == data.panos[0].ids);
   REQUIRE(stitch_result.cameras.has_value());
   CHECK(stitch_result.cameras->cameras.size() == 3);
 
@@ -488,8 +2331,10 @@ TEST_CASE("Export with crop") {
   CHECK_THAT(image.rows, WithinRel(488, eps));
   CHECK_THAT(image.cols, WithinRel(334, eps));
 
-  auto cv_rect = xpano::utils::GetCvRect(*stitch_result.pano, crop);
-  auto pano_cropped = (*stitch_result.pano)(cv_rect);
+  // Only the crop is composed
+  CHECK(stitch_result.cropped);
+  CHECK(!stitch_result.auto_crop.has_value());
+  const auto &pano_cropped = *stitch_result.pano;
 
   REQUIRE(pano_cropped.rows == image.rows);
   REQUIRE(pano_cropped.cols == image.cols);
@@ -607,6 +2452,10 @@ TEST_CASE("TIFF inputs") {
   auto preview1 = result.images[1].GetPreview();
   CHECK(preview0.depth() == CV_8U);
   CHECK(preview1.depth() == CV_8U);
+
+  auto full_res1 = result.images[1].GetFullRes();
+  CHECK(full_res1.depth() == CV_8U);
+  CHECK(full_res1.size() == result.images[0].GetFullRes().size());
 }
 
 const std::filesystem::path kMalformedInput = "data/malformed.jpg";
@@ -656,6 +2505,29 @@ TEST_CASE("Stitcher pipeline OpenCV blender") {
   CHECK_THAT(pano1->rows, WithinRel(976, eps));
   CHECK_THAT(pano1->cols, WithinRel(1335, eps));
 }
+
+TEST_CASE("Multiblend cancellation") {
+  const int size = 64;
+  xpano::utils::mt::Threadpool pool(2);
+  xpano::algorithm::ProgressMonitor progress;
+
+  auto blend = [&]() {
+    xpano::algorithm::blenders::Multiblend blender(&pool, &progress);
+    blender.prepare(cv::Rect(0, 0, size, size));
+    const cv::Mat image(size, size, CV_8UC3, cv::Scalar::all(128));
+    const cv::Mat mask(size, size, CV_8U, cv::Scalar(255));
+    blender.feed(image, mask, {0, 0});
+    cv::UMat pano;
+    cv::UMat pano_mask;
+    blender.blend(pano, pano_mask);
+    return pano;
+  };
+
+  CHECK(blend().size() == cv::Size(size, size));
+
+  progress.Cancel();
+  CHECK(blend().empty());
+}
 #endif
 
 constexpr int kMaxIterations = 1000;
@@ -673,6 +2545,172 @@ auto WaitForTask(xpano::pipeline::StitcherPipeline<>* stitcher,
   return {};
 }
 
+#if XPANO_OPENCV_HAS_PARALLEL_BACKEND
+TEST_CASE("Pool parallel for") {
+  auto pool = std::make_shared<xpano::utils::mt::Threadpool>(4);
+  xpano::utils::mt::PoolParallelFor backend(pool);
+  CHECK(backend.getNumThreads() == 4);
+
+  const int num_tasks = 100;
+  auto count = [](int start, int end, void *data) {
+    auto *counts = static_cast<std::vector<std::atomic_int> *>(data);
+    for (int task = start; task < end; task++) {
+      (*counts)[task]++;
+    }
+  };
+
+  std::vector<std::atomic_int> counts(num_tasks);
+  backend.parallel_for(num_tasks, count, &counts);
+  CHECK(std::all_of(counts.begin(), counts.end(),
+                    [](const auto &value) { return value == 1; }));
+
+  // Nested in the tasks of a busy pool, the callers run the loops alone
+  std::vector<std::vector<std::atomic_int>> nested_counts(8);
+  xpano::utils::mt::MultiFuture<void> loops;
+  for (auto &nested : nested_counts) {
+    nested = std::vector<std::atomic_int>(num_tasks);
+    loops.push_back(pool->submit([&backend, &nested, count]() {
+      backend.parallel_for(num_tasks, count, &nested);
+    }));
+  }
+  loops.wait();
+  for (const auto &nested : nested_counts) {
+    CHECK(std::all_of(nested.begin(), nested.end(),
+                      [](const auto &value) { return value == 1; }));
+  }
+
+  backend.setNumThreads(0);
+  CHECK(backend.getNumThreads() == 1);
+}
+#endif
+
+TEST_CASE("Task graph") {
+  xpano::utils::mt::Threadpool pool(2);
+  std::atomic_bool cancelled = false;
+  auto make_graph = [&cancelled]() {
+    return std::make_shared<xpano::utils::mt::TaskGraph<int>>(
+        -1, [&cancelled]() { return cancelled.load(); });
+  };
+
+  SECTION("stages") {
+    auto graph = make_graph();
+    auto future = graph->GetFuture();
+    graph->Run(&pool, [graph = graph.get(), &pool]() {
+      graph->ForEach<int>(
+          &pool, 10, [](int i) { return i * i; },
+          [graph](const std::vector<int> &squares) {
+            graph->SetResult(
+                std::accumulate(squares.begin(), squares.end(), 0));
+          });
+    });
+    graph.reset();
+    CHECK(future.get() == 285);
+  }
+
+  SECTION("error") {
+    auto graph = make_graph();
+    auto future = graph->GetFuture();
+    graph->ForEach<int>(
+        &pool, 3,
+        [](int i) {
+          if (i == 1) {
+            throw std::runtime_error("failed");
+          }
+          return i;
+        },
+        [graph = graph.get()](const std::vector<int> & /*values*/) {
+          graph->SetResult(0);
+        });
+    graph.reset();
+    CHECK_THROWS_AS(future.get(), std::runtime_error);
+  }
+
+  SECTION("cancelled") {
+    auto graph = make_graph();
+    auto future = graph->GetFuture();
+    cancelled = true;
+    graph->ForEach<int>(
+        &pool, 3, [](int i) { return i; },
+        [graph = graph.get()](const std::vector<int> & /*values*/) {
+          graph->SetResult(0);
+        });
+    graph.reset();
+    CHECK(future.get() == -1);
+  }
+
+  SECTION("purged") {
+    pool.pause();
+    auto graph = make_graph();
+    auto future = graph->GetFuture();
+    graph->Run(&pool, [graph = graph.get()]() { graph->SetResult(0); });
+    graph.reset();
+    pool.purge();
+    pool.unpause();
+    CHECK(future.get() == -1);
+  }
+}
+
+TEST_CASE("Stitcher pipeline single thread") {
+  // The stages don't wait for each other, a single thread is enough
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher(
+      {.pool = std::make_shared<xpano::utils::mt::Threadpool>(1)});
+  auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  CHECK(result.images.size() == 10);
+  CHECK(result.panos.size() == 2);
+
+  auto stitch_result =
+      stitcher.RunStitching(result, {.pano_id = 1, .full_res = true})
+          .future.get();
+  CHECK(stitch_result.pano.has_value());
+}
+
+TEST_CASE("Stitcher pipeline task done callback") {
+  std::atomic_int num_calls = 0;
+  {
+    xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher(
+        {.on_task_done = [&num_calls]() { num_calls++; }});
+    auto result = stitcher.RunLoading(kInputs, {}, {}).future.get();
+    CHECK(result.images.size() == 10);
+  }
+  // Each thumbnail and the loading itself
+  CHECK(num_calls == 11);
+}
+
+TEST_CASE("Progress monitor wait") {
+  xpano::algorithm::ProgressMonitor progress;
+  std::atomic_bool ready = false;
+  std::thread notifier([&progress, &ready]() {
+    ready = true;
+    progress.Notify();
+  });
+  CHECK(progress.WaitUntil([&ready]() { return ready.load(); }));
+  notifier.join();
+
+  std::thread canceller([&progress]() { progress.Cancel(); });
+  CHECK_FALSE(progress.WaitUntil([]() { return false; }));
+  canceller.join();
+}
+
+TEST_CASE("Stitcher pipeline cancellation token") {
+  auto pool = std::make_shared<xpano::utils::mt::Threadpool>(2);
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher({.pool = pool});
+  auto loading_task = stitcher.RunLoading(kInputs, {}, {});
+
+  // Work of others on the same pool
+  std::atomic_int num_done = 0;
+  xpano::utils::mt::MultiFuture<void> others;
+  for (int i = 0; i < 20; i++) {
+    others.push_back(pool->submit([&num_done]() { num_done++; }));
+  }
+
+  loading_task.progress->Cancel();
+  stitcher.Cancel();
+  auto result = loading_task.future.get();
+  others.wait();
+  CHECK(num_done == 20);
+  CHECK(result.images.empty());
+}
+
 TEST_CASE("Stitcher pipeline polling") {
   xpano::pipeline::StitcherPipeline<> stitcher;
 
@@ -719,6 +2757,216 @@ TEST_CASE("Stitcher pipeline polling") {
   CHECK_THAT(pano1->cols, WithinRel(1335, eps));
 }
 
+TEST_CASE("Stitcher pipeline background export") {
+  const std::filesystem::path tmp_path =
+      xpano::tests::TmpPath().replace_extension("jpg");
+
+  xpano::pipeline::StitcherPipeline<kReturnFuture> loader;
+  auto data = loader.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(data.panos.size() == 2);
+
+  xpano::pipeline::StitcherPipeline<> stitcher;
+  stitcher.RunStitching(data, {.pano_id = 0, .export_path = tmp_path});
+  auto exports = stitcher.GetExportProgress();
+  REQUIRE(exports.size() == 1);
+  CHECK(exports[0].pano_id == 0);
+
+  // Showing another pano doesn't cancel the export
+  stitcher.RunStitching(data, {.pano_id = 1});
+  std::optional<xpano::pipeline::StitchingResult> exported;
+  std::optional<xpano::pipeline::StitchingResult> shown;
+  for (int i = 0; i < 2; i++) {
+    auto task = WaitForTask(&stitcher);
+    REQUIRE(task.has_value());
+    CHECK(!task->progress->IsCancelled());
+    REQUIRE(
+        std::holds_alternative<std::future<xpano::pipeline::StitchingResult>>(
+            task->future));
+    auto result = std::get<std::future<xpano::pipeline::StitchingResult>>(
+                      std::move(task->future))
+                      .get();
+    (result.export_path ? exported : shown) = std::move(result);
+  }
+  CHECK(stitcher.GetExportProgress().empty());
+
+  REQUIRE(exported.has_value());
+  CHECK(exported->pano_id == 0);
+  CHECK(exported->pano.has_value());
+  REQUIRE(shown.has_value());
+  CHECK(shown->pano_id == 1);
+  CHECK(shown->pano.has_value());
+
+  REQUIRE(std::filesystem::exists(tmp_path));
+  std::filesystem::remove(tmp_path);
+}
+
+TEST_CASE("Stitcher pipeline progressive preview") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> loader;
+  auto data = loader.RunLoading(kInputs, {}, {}).future.get();
+  auto preview = loader.RunStitching(data, {.pano_id = 1}).future.get();
+  REQUIRE(preview.pano.has_value());
+  REQUIRE(preview.cameras.has_value());
+  data.panos[1].cameras = preview.cameras;
+
+  xpano::pipeline::StitcherPipeline<> stitcher;
+  stitcher.RunStitching(data, {.pano_id = 1, .progressive = true});
+
+  auto get_result = [](auto task) {
+    REQUIRE(task.has_value());
+    REQUIRE(
+        std::holds_alternative<std::future<xpano::pipeline::StitchingResult>>(
+            task->future));
+    return std::get<std::future<xpano::pipeline::StitchingResult>>(
+               std::move(task->future))
+        .get();
+  };
+
+  auto coarse = get_result(WaitForTask(&stitcher));
+  CHECK(coarse.coarse);
+  CHECK(coarse.pano_id == 1);
+  REQUIRE(coarse.pano.has_value());
+  CHECK(!coarse.cameras.has_value());
+  CHECK(std::max(coarse.pano->cols, coarse.pano->rows) <
+        std::max(preview.pano->cols, preview.pano->rows) / 2);
+
+  auto refined = get_result(WaitForTask(&stitcher));
+  CHECK(!refined.coarse);
+  REQUIRE(refined.pano.has_value());
+  CHECK(refined.pano->size() == preview.pano->size());
+}
+
+TEST_CASE("Stitcher pipeline speculative stitching") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto data = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(data.panos.size() == 2);
+
+  const float eps = 0.02;
+  stitcher.RunSpeculativeStitching(data, {0, 1}, {}).get();
+
+  auto task = stitcher.RunStitching(data, {.pano_id = 1});
+  CHECK(task.future.wait_for(std::chrono::seconds(0)) ==
+        std::future_status::ready);
+  auto speculative = task.future.get();
+  CHECK(speculative.pano_id == 1);
+  CHECK(speculative.cameras.has_value());
+  REQUIRE(speculative.pano.has_value());
+  CHECK_THAT(speculative.pano->rows, WithinRel(976, eps));
+  CHECK_THAT(speculative.pano->cols, WithinRel(1335, eps));
+
+  // Keyed by its cameras once shown
+  auto stitched = stitcher.RunStitching(data, {.pano_id = 1}).future.get();
+  REQUIRE(stitched.pano.has_value());
+  CHECK(stitched.pano->size() == speculative.pano->size());
+
+  // Different options don't match, loading drops the results
+  stitcher.RunSpeculativeStitching(data, {0}, {}).get();
+  auto other_options = xpano::pipeline::StitchAlgorithmOptions{};
+  other_options.wave_correction = xpano::algorithm::WaveCorrectionType::kOff;
+  auto other = stitcher.RunStitching(
+      data, {.pano_id = 0, .stitch_algorithm = other_options});
+  CHECK(other.future.get().pano.has_value());
+
+  data = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  auto reloaded = stitcher.RunStitching(data, {.pano_id = 0});
+  CHECK(reloaded.future.wait_for(std::chrono::seconds(0)) !=
+        std::future_status::ready);
+  CHECK(reloaded.future.get().pano.has_value());
+}
+
+TEST_CASE("Stitcher pipeline pano thumbnails") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto data = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(data.panos.size() == 2);
+
+  stitcher.RunPanoThumbnails(data, {1, 0}, {}).get();
+  auto thumbnails = stitcher.PopPanoThumbnails();
+  CHECK(stitcher.PopPanoThumbnails().empty());
+  REQUIRE(thumbnails.size() == 2);
+  CHECK(thumbnails[0].pano_id == 1);
+  CHECK(thumbnails[1].pano_id == 0);
+  for (const auto &thumbnail : thumbnails) {
+    CHECK(thumbnail.ids == data.panos[thumbnail.pano_id].ids);
+    CHECK(thumbnail.cameras.has_value());
+    REQUIRE(!thumbnail.thumbnail.empty());
+    CHECK(thumbnail.thumbnail.rows < 2 * xpano::kPanoThumbnailImageSide);
+  }
+
+  // The first stitch reuses the cameras
+  data.panos[1].cameras = thumbnails[0].cameras;
+  auto stitched = stitcher.RunStitching(data, {.pano_id = 1}).future.get();
+  REQUIRE(stitched.pano.has_value());
+  CHECK(stitched.cameras->cameras.size() ==
+        thumbnails[0].cameras->cameras.size());
+
+  // Only composed with the cameras, loading cancels the rest
+  stitcher.RunPanoThumbnails(data, {1}, {}).get();
+  thumbnails = stitcher.PopPanoThumbnails();
+  REQUIRE(thumbnails.size() == 1);
+  CHECK(!thumbnails[0].cameras.has_value());
+  CHECK(!thumbnails[0].thumbnail.empty());
+
+  auto cancelled = stitcher.RunPanoThumbnails(data, {0, 1}, {});
+  data = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  cancelled.get();
+  CHECK(stitcher.PopPanoThumbnails().size() < 2);
+}
+
+TEST_CASE("Stitcher pipeline preview cache") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto data = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(data.panos.size() == 2);
+
+  auto first = stitcher.RunStitching(data, {.pano_id = 1}).future.get();
+  REQUIRE(first.pano.has_value());
+  REQUIRE(first.cameras.has_value());
+  data.panos[1].cameras = first.cameras;
+
+  auto is_ready = [](const auto &future) {
+    return future.wait_for(std::chrono::seconds(0)) ==
+           std::future_status::ready;
+  };
+
+  auto again = stitcher.RunStitching(data, {.pano_id = 1});
+  CHECK(is_ready(again.future));
+  auto cached = again.future.get();
+  REQUIRE(cached.pano.has_value());
+  CHECK(cached.pano->data == first.pano->data);
+  CHECK(cached.mask.has_value());
+  CHECK(cached.auto_crop.has_value());
+  const auto stats = stitcher.GetPreviewCacheStats();
+  CHECK(stats.hits == 1);
+  CHECK(stats.misses == 1);
+  CHECK(stats.bytes_used > 0);
+
+  // Full resolution is never cached
+  auto full_res =
+      stitcher.RunStitching(data, {.pano_id = 1, .full_res = true});
+  CHECK(!is_ready(full_res.future));
+  full_res.future.get();
+
+  // Other cameras or options
+  cv::Mat rotation;
+  cv::Rodrigues(cv::Vec3f(0.0f, 0.1f, 0.0f), rotation);
+  auto rotated = data;
+  rotated.panos[1].cameras = xpano::algorithm::Rotate(*first.cameras, rotation);
+  auto rotated_task = stitcher.RunStitching(rotated, {.pano_id = 1});
+  CHECK(!is_ready(rotated_task.future));
+  rotated_task.future.get();
+
+  auto options = xpano::pipeline::StitchAlgorithmOptions{};
+  options.projection.type = xpano::algorithm::ProjectionType::kCylindrical;
+  auto other = stitcher.RunStitching(
+      data, {.pano_id = 1, .stitch_algorithm = options});
+  CHECK(!is_ready(other.future));
+  other.future.get();
+
+  CHECK(is_ready(stitcher.RunStitching(data, {.pano_id = 1}).future));
+  stitcher.ClearPreviewCache();
+  auto cleared = stitcher.RunStitching(data, {.pano_id = 1});
+  CHECK(!is_ready(cleared.future));
+  CHECK(cleared.future.get().pano.has_value());
+}
+
 const std::vector<std::filesystem::path> kInputsWithStack = {
     "data/image01.jpg",  // Minimal shift
     "data/image05.jpg",  // between images
@@ -751,4 +2999,428 @@ TEST_CASE("Stitcher pipeline stack detection") {
   CHECK_THAT(result.panos[0].ids, Equals<int>({2, 3}));
 }
 
+TEST_CASE("Stitcher pipeline feature cache") {
+  const auto cache_dir = xpano::tests::TmpPath();
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher(
+      {.feature_cache_dir = cache_dir});
+
+  auto loading_task0 = stitcher.RunLoading(kInputsFirstPano, {}, {});
+  auto result0 = loading_task0.future.get();
+  REQUIRE(result0.images.size() == 5);
+  CHECK(std::distance(std::filesystem::directory_iterator(cache_dir),
+                      std::filesystem::directory_iterator{}) == 5);
+  auto stats = stitcher.GetFeatureCacheStats();
+  REQUIRE(stats);
+  CHECK(stats->hits == 0);
+  CHECK(stats->misses == 5);
+
+  auto loading_task1 = stitcher.RunLoading(kInputsFirstPano, {}, {});
+  auto result1 = loading_task1.future.get();
+  auto progress = loading_task1.progress->Report();
+  CHECK(progress.tasks_done == progress.num_tasks);
+
+  REQUIRE(result1.images.size() == 5);
+  for (int i = 0; i < result0.images.size(); i++) {
+    const auto& fresh = result0.images[i];
+    const auto& cached = result1.images[i];
+    CHECK(fresh.GetPath() == cached.GetPath());
+    CHECK(fresh.GetKeypoints().size() == cached.GetKeypoints().size());
+    CHECK(cv::norm(fresh.GetDescriptors(), cached.GetDescriptors()) == 0.0);
+    CHECK(cv::norm(fresh.GetPreview(), cached.GetPreview()) == 0.0);
+    CHECK(cv::norm(fresh.GetThumbnail(), cached.GetThumbnail()) == 0.0);
+  }
+  CHECK(result0.matches.size() == result1.matches.size());
+  REQUIRE(result1.panos.size() == 1);
+  CHECK_THAT(result1.panos[0].ids, Equals(result0.panos[0].ids));
+  stats = stitcher.GetFeatureCacheStats();
+  CHECK(stats->hits == 5);
+  CHECK(stats->misses == 5);
+
+  // different preview size -> different cache entries
+  auto loading_task2 =
+      stitcher.RunLoading(kInputsFirstPano, {.preview_longer_side = 512}, {});
+  auto result2 = loading_task2.future.get();
+  REQUIRE(result2.images.size() == 5);
+  CHECK(result2.images[0].GetPreviewLongerSide() == 512);
+  CHECK(std::distance(std::filesystem::directory_iterator(cache_dir),
+                      std::filesystem::directory_iterator{}) == 10);
+
+  std::filesystem::remove_all(cache_dir);
+}
+
+TEST_CASE("Stitcher pipeline full resolution cache") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto loading_task = stitcher.RunLoading(kInputs, {}, {});
+  auto data = loading_task.future.get();
+  REQUIRE(data.panos.size() == 2);
+  const int num_images = static_cast<int>(data.panos[1].ids.size());
+
+  auto stitch_result0 =
+      stitcher.RunStitching(data, {.pano_id = 1, .full_res = true})
+          .future.get();
+  auto stats = stitcher.GetFullResCacheStats();
+  CHECK(stats.hits == 0);
+  CHECK(stats.misses == num_images);
+  CHECK(stats.bytes_used > 0);
+
+  auto stitch_result1 =
+      stitcher.RunStitching(data, {.pano_id = 1, .full_res = true})
+          .future.get();
+  stats = stitcher.GetFullResCacheStats();
+  CHECK(stats.hits == num_images);
+  CHECK(stats.misses == num_images);
+
+  REQUIRE(stitch_result0.pano.has_value());
+  REQUIRE(stitch_result1.pano.has_value());
+  CHECK(stitch_result0.pano->size() == stitch_result1.pano->size());
+}
+
+TEST_CASE("Stitcher pipeline full resolution cache edited file") {
+  const auto dir = xpano::tests::TmpPath();
+  std::filesystem::create_directories(dir);
+  std::vector<std::filesystem::path> inputs;
+  for (const auto& input : kInputs) {
+    inputs.push_back(dir / input.filename());
+    std::filesystem::copy_file(input, inputs.back());
+  }
+
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto data = stitcher.RunLoading(inputs, {}, {}).future.get();
+  REQUIRE(data.panos.size() == 2);
+  const int num_images = static_cast<int>(data.panos[1].ids.size());
+
+  stitcher.RunStitching(data, {.pano_id = 1, .full_res = true}).future.get();
+  auto stats = stitcher.GetFullResCacheStats();
+  CHECK(stats.misses == num_images);
+
+  // The file is edited on disk, its cached frame is stale
+  const auto edited = data.images[data.panos[1].ids[0]].GetPath();
+  std::filesystem::last_write_time(
+      edited,
+      std::filesystem::last_write_time(edited) + std::chrono::seconds(10));
+
+  stitcher.RunStitching(data, {.pano_id = 1, .full_res = true}).future.get();
+  stats = stitcher.GetFullResCacheStats();
+  CHECK(stats.hits == num_images - 1);
+  CHECK(stats.misses == num_images + 1);
+
+  std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Stitcher pipeline full resolution cache budget") {
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher(
+      {.full_res_cache_bytes = 0});
+  auto loading_task = stitcher.RunLoading(kInputs, {}, {});
+  auto data = loading_task.future.get();
+  REQUIRE(data.panos.size() == 2);
+  const int num_images = static_cast<int>(data.panos[1].ids.size());
+
+  for (int i = 0; i < 2; i++) {
+    auto stitch_result =
+        stitcher.RunStitching(data, {.pano_id = 1, .full_res = true})
+            .future.get();
+    CHECK(stitch_result.pano.has_value());
+  }
+  auto stats = stitcher.GetFullResCacheStats();
+  CHECK(stats.hits == 0);
+  CHECK(stats.misses == 2 * num_images);
+  CHECK(stats.bytes_used == 0);
+}
+
+TEST_CASE("Stitcher pipeline mapped full resolution frames") {
+  const auto mapped_dir = xpano::tests::TmpPath();
+  {
+    xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher(
+        {.mapped_frames_dir = mapped_dir, .full_res_cache_bytes = 0});
+    auto data = stitcher.RunLoading(kInputs, {}, {}).future.get();
+    REQUIRE(data.panos.size() == 2);
+    const int num_images = static_cast<int>(data.panos[1].ids.size());
+
+    auto decoded =
+        stitcher.RunStitching(data, {.pano_id = 1, .full_res = true})
+            .future.get();
+    auto stats = stitcher.GetFullResCacheStats();
+    CHECK(stats.mapped_hits == 0);
+    CHECK(stats.misses == num_images);
+
+    // Nothing fits the memory budget, the frames are mapped
+    auto mapped =
+        stitcher.RunStitching(data, {.pano_id = 1, .full_res = true})
+            .future.get();
+    stats = stitcher.GetFullResCacheStats();
+    CHECK(stats.hits == 0);
+    CHECK(stats.mapped_hits == num_images);
+    CHECK(stats.misses == num_images);
+
+    REQUIRE(decoded.pano.has_value());
+    REQUIRE(mapped.pano.has_value());
+    CHECK(cv::norm(*decoded.pano, *mapped.pano, cv::NORM_INF) == 0.0);
+  }
+  // Removed with the session
+  CHECK(std::filesystem::is_empty(mapped_dir));
+  std::filesystem::remove_all(mapped_dir);
+}
+
+TEST_CASE("Stitcher pipeline project") {
+  const auto path = xpano::tests::TmpPath().replace_extension("xpano");
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto data = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(data.panos.size() == 2);
+  auto stitch_result =
+      stitcher.RunStitching(data, {.pano_id = 1}).future.get();
+  REQUIRE(stitch_result.cameras.has_value());
+  data.panos[1].cameras = stitch_result.cameras;
+  data.panos[1].crop = xpano::utils::Rect(xpano::utils::Ratio2f{0.1f, 0.2f},
+                                          xpano::utils::Ratio2f{0.8f, 0.9f});
+
+  auto options = xpano::pipeline::Options{};
+  options.matching.match_threshold = kDefaultMatchThreshold + 1;
+  REQUIRE(xpano::pipeline::SaveProject(path, data, options));
+
+  auto stored_options = xpano::pipeline::LoadProjectOptions(path);
+  REQUIRE(stored_options.has_value());
+  CHECK(stored_options->matching.match_threshold == kDefaultMatchThreshold + 1);
+
+  xpano::algorithm::ProgressMonitor progress;
+  auto project = xpano::pipeline::LoadProject(path, &progress);
+  REQUIRE(project.has_value());
+  CHECK(project->changed_images.empty());
+  CHECK(project->options.has_value());
+  CHECK(progress.Report().tasks_done == data.images.size());
+
+  const auto& loaded = project->data;
+  REQUIRE(loaded.images.size() == data.images.size());
+  for (int i = 0; i < data.images.size(); i++) {
+    CHECK(loaded.images[i].GetPath() == data.images[i].GetPath());
+    CHECK(loaded.images[i].NumKeypoints() == data.images[i].NumKeypoints());
+    CHECK(loaded.images[i].GetPreview().size() ==
+          data.images[i].GetPreview().size());
+  }
+  REQUIRE(loaded.matches.size() == data.matches.size());
+  for (int i = 0; i < data.matches.size(); i++) {
+    CHECK(loaded.matches[i].id1 == data.matches[i].id1);
+    CHECK(loaded.matches[i].id2 == data.matches[i].id2);
+    CHECK(loaded.matches[i].matches.size() == data.matches[i].matches.size());
+  }
+  REQUIRE(loaded.panos.size() == data.panos.size());
+  CHECK(loaded.panos[0].ids == data.panos[0].ids);
+  CHECK(loaded.panos[1].ids == data.panos[1].ids);
+  CHECK(!loaded.panos[0].cameras.has_value());
+  REQUIRE(loaded.panos[1].crop.has_value());
+  CHECK(loaded.panos[1].crop->start[0] == 0.1f);
+  CHECK(loaded.panos[1].crop->end[1] == 0.9f);
+  REQUIRE(loaded.panos[1].cameras.has_value());
+  const auto& cameras = loaded.panos[1].cameras->cameras;
+  REQUIRE(cameras.size() == stitch_result.cameras->cameras.size());
+  for (int i = 0; i < cameras.size(); i++) {
+    const auto& expected = stitch_result.cameras->cameras[i];
+    CHECK(cameras[i].focal == expected.focal);
+    CHECK(cv::norm(cameras[i].R, expected.R, cv::NORM_INF) == 0.0);
+  }
+
+  // Stitches with the stored cameras
+  auto reopened = stitcher.RunOpenProject(path).future.get();
+  REQUIRE(reopened.images.size() == data.images.size());
+  auto restitched =
+      stitcher.RunStitching(reopened, {.pano_id = 1}).future.get();
+  CHECK(restitched.pano.has_value());
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("Stitcher pipeline checkpoints") {
+  const auto checkpoint_dir = xpano::tests::TmpPath();
+  const auto export_path =
+      xpano::tests::TmpPath().replace_extension("jpg");
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher(
+      {.checkpoint_dir = checkpoint_dir});
+  auto data = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(data.panos.size() == 2);
+
+  auto count_files = [&checkpoint_dir]() {
+    if (!std::filesystem::exists(checkpoint_dir)) {
+      return 0;
+    }
+    int count = 0;
+    for (const auto &entry :
+         std::filesystem::recursive_directory_iterator(checkpoint_dir)) {
+      count += entry.is_regular_file() ? 1 : 0;
+    }
+    return count;
+  };
+
+  // The export fails, the cameras, seams and composed pano are kept
+  auto failed =
+      stitcher
+          .RunStitching(data, {.pano_id = 1,
+                               .full_res = true,
+                               .export_path = export_path.parent_path() /
+                                              "missing" / "pano.jpg"})
+          .future.get();
+  REQUIRE(failed.pano.has_value());
+  CHECK(!failed.export_path.has_value());
+  CHECK(count_files() == 3);
+
+  // Only exported again
+  auto resumed =
+      stitcher
+          .RunStitching(data, {.pano_id = 1,
+                               .full_res = true,
+                               .export_path = export_path})
+          .future.get();
+  CHECK(resumed.status == failed.status);
+  REQUIRE(resumed.pano.has_value());
+  CHECK(resumed.pano->size() == failed.pano->size());
+  CHECK(cv::norm(*resumed.pano, *failed.pano, cv::NORM_INF) == 0.0);
+  CHECK(resumed.mask->Size() == failed.mask->Size());
+  CHECK(resumed.cameras.has_value());
+  CHECK(resumed.export_path == export_path);
+  CHECK(count_files() == 0);
+
+  std::filesystem::remove_all(checkpoint_dir);
+  std::filesystem::remove(export_path);
+}
+
+TEST_CASE("Stitcher pipeline sharded tiled export") {
+  const auto checkpoint_dir = xpano::tests::TmpPath();
+  const auto export_path = xpano::tests::TmpPath().replace_extension("tif");
+  const auto single_path = xpano::tests::TmpPath().replace_extension("tif");
+
+  // One pipeline per shard, as in separate processes
+  xpano::pipeline::StitcherPipeline<kReturnFuture> first(
+      {.checkpoint_dir = checkpoint_dir});
+  xpano::pipeline::StitcherPipeline<kReturnFuture> second(
+      {.checkpoint_dir = checkpoint_dir});
+  auto data = first.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(data.panos.size() == 2);
+
+  auto shard_options = [&export_path](int index) {
+    return xpano::pipeline::StitchingOptions{
+        .pano_id = 1,
+        .full_res = true,
+        .export_path = export_path,
+        .tiled_export = true,
+        .shard = xpano::pipeline::ShardOptions{.index = index, .count = 2}};
+  };
+  // Waits for the seams of the first shard
+  auto second_task = second.RunStitching(data, shard_options(1));
+  auto first_task = first.RunStitching(data, shard_options(0));
+  auto second_result = second_task.future.get();
+  auto first_result = first_task.future.get();
+  CHECK(second_result.export_path ==
+        xpano::pipeline::ShardDir(export_path));
+  CHECK(first_result.export_path == export_path);
+  CHECK(!std::filesystem::exists(xpano::pipeline::ShardDir(export_path)));
+  CHECK(!std::filesystem::exists(checkpoint_dir) ||
+        std::filesystem::is_empty(checkpoint_dir));
+
+  auto single = first
+                    .RunStitching(data, {.pano_id = 1,
+                                         .full_res = true,
+                                         .export_path = single_path,
+                                         .tiled_export = true})
+                    .future.get();
+  REQUIRE(single.export_path == single_path);
+
+  auto sharded_pano = cv::imread(export_path.string(), cv::IMREAD_UNCHANGED);
+  auto single_pano = cv::imread(single_path.string(), cv::IMREAD_UNCHANGED);
+  REQUIRE(!sharded_pano.empty());
+  REQUIRE(sharded_pano.size() == single_pano.size());
+  cv::Mat diff;
+  cv::absdiff(sharded_pano, single_pano, diff);
+  CHECK(cv::countNonZero(diff.reshape(1) > 2) <
+        sharded_pano.total() * 4 / 100);
+
+  std::filesystem::remove_all(checkpoint_dir);
+  std::filesystem::remove(export_path);
+  std::filesystem::remove(single_path);
+}
+
+TEST_CASE("Stitcher pipeline stalled shards") {
+  const auto dir = xpano::tests::TmpPath();
+  const cv::Size pano_size(64, 32);
+  xpano::algorithm::ProgressMonitor progress;
+  const xpano::pipeline::ShardWait wait = {
+      .poll_interval = std::chrono::milliseconds(10),
+      .stall_timeout = std::chrono::milliseconds(200)};
+
+  xpano::pipeline::ShardWriter first(dir, {.index = 0, .count = 2});
+  REQUIRE(first.Open(pano_size));
+  REQUIRE(first.Close());
+  // The second shard never completes
+  CHECK(!xpano::pipeline::WaitForShards(dir, 2, &progress, wait));
+
+  xpano::pipeline::ShardWriter second(dir, {.index = 1, .count = 2});
+  REQUIRE(second.Open(pano_size));
+  REQUIRE(second.Close());
+  auto done = xpano::pipeline::WaitForShards(dir, 2, &progress, wait);
+  REQUIRE(done.has_value());
+  CHECK(*done == pano_size);
+
+  std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Stitcher pipeline stalled first shard") {
+  const auto checkpoint_dir = xpano::tests::TmpPath();
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher;
+  auto data = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(!data.panos.empty());
+
+  const xpano::pipeline::StitchingOptions options = {
+      .pano_id = 0,
+      .full_res = true,
+      .tiled_export = true,
+      .shard = xpano::pipeline::ShardOptions{.index = 1, .count = 2}};
+  const xpano::pipeline::Checkpoint checkpoint(checkpoint_dir, data.panos[0],
+                                               data.images, options);
+  xpano::algorithm::ProgressMonitor progress;
+  // The first shard never saves its seams
+  CHECK(!xpano::pipeline::WaitForFirstShard(
+      checkpoint, &progress,
+      {.poll_interval = std::chrono::milliseconds(10),
+       .stall_timeout = std::chrono::milliseconds(200)}));
+
+  std::filesystem::remove_all(checkpoint_dir);
+}
+
+#ifdef XPANO_WITH_MULTIBLEND
+TEST_CASE("Stitcher pipeline spilled warped images") {
+  const auto spill_dir = xpano::tests::TmpPath();
+  xpano::pipeline::StitcherPipeline<kReturnFuture> stitcher(
+      {.spill_dir = spill_dir, .spill_threshold_bytes = 0});
+  auto data = stitcher.RunLoading(kInputs, {}, {}).future.get();
+  REQUIRE(data.panos.size() == 2);
+
+  auto spilled =
+      stitcher.RunStitching(data, {.pano_id = 1, .full_res = true})
+          .future.get();
+  xpano::pipeline::StitcherPipeline<kReturnFuture> in_memory;
+  auto expected =
+      in_memory.RunStitching(data, {.pano_id = 1, .full_res = true})
+          .future.get();
+
+  REQUIRE(spilled.pano.has_value());
+  REQUIRE(expected.pano.has_value());
+  CHECK(spilled.pano->size() == expected.pano->size());
+  CHECK(cv::norm(*spilled.pano, *expected.pano, cv::NORM_INF) == 0.0);
+  // The scratch files are gone once blended
+  CHECK(std::filesystem::is_empty(spill_dir));
+
+  std::filesystem::remove_all(spill_dir);
+}
+#endif
+
+TEST_CASE("Core pipeline reused across jobs") {
+  xpano::Pipeline pipeline({.pool = xpano::utils::mt::SharedPool()});
+  for (int job = 0; job < 2; job++) {
+    auto data = pipeline.RunLoading(kInputs, {}, {}).future.get();
+    REQUIRE(data.panos.size() == 2);
+    auto result =
+        pipeline.RunStitching(data, {.pano_id = 0, .full_res = true})
+            .future.get();
+    REQUIRE(result.pano.has_value());
+  }
+  auto stats = pipeline.GetFullResCacheStats();
+  CHECK(stats.hits > 0);
+}
+
 // NOLINTEND(readability-function-cognitive-complexity)
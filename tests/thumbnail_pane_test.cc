@@ -0,0 +1,171 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/gui/panels/thumbnail_pane.h"
+
+#include <filesystem>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+#include <catch2/matchers/catch_matchers_vector.hpp>
+#include <imgui.h>
+#include <opencv2/core.hpp>
+
+#include "xpano/algorithm/image.h"
+#include "xpano/constants.h"
+#include "xpano/gui/backends/base.h"
+#include "xpano/utils/vec.h"
+
+using Catch::Matchers::Equals;
+using xpano::gui::backends::TexDeleter;
+using xpano::gui::backends::Texture;
+
+namespace {
+
+// Records the thumbnail uploads, each thumbnail is filled with its own value
+class FakeBackend : public xpano::gui::backends::Base {
+ public:
+  struct Upload {
+    int texture;
+    xpano::utils::Point2i offset;
+    int value;
+  };
+
+  Texture CreateTexture(xpano::utils::Vec2i /*size*/) override {
+    return Texture(new int{num_textures_++}, TexDeleter(this));
+  }
+  Texture CreateStreamingTexture(xpano::utils::Vec2i size) override {
+    return CreateTexture(size);
+  }
+  void UpdateTexture(ImTextureID /*tex*/, cv::Mat /*image*/) override {}
+  void UpdateTextureRegion(ImTextureID tex, xpano::utils::Point2i offset,
+                           cv::Mat image) override {
+    uploads.push_back({*static_cast<int *>(tex), offset,
+                       static_cast<int>(image.at<cv::Vec3b>(0, 0)[0])});
+  }
+  void DestroyTexture(ImTextureID tex) override {
+    delete static_cast<int *>(tex);
+  }
+  void WakeUp() override {}
+
+  std::vector<int> UploadedValues() const {
+    std::vector<int> values;
+    for (const auto &upload : uploads) {
+      values.push_back(upload.value);
+    }
+    return values;
+  }
+
+  bool UploadedToDistinctSlots() const {
+    std::set<std::pair<int, std::pair<int, int>>> slots;
+    for (const auto &upload : uploads) {
+      slots.insert({upload.texture, {upload.offset[0], upload.offset[1]}});
+    }
+    return slots.size() == uploads.size();
+  }
+
+  std::vector<Upload> uploads;
+
+ private:
+  int num_textures_ = 0;
+};
+
+class ScopedImGuiContext {
+ public:
+  ScopedImGuiContext() {
+    ImGui::CreateContext();
+    auto &io = ImGui::GetIO();
+    io.IniFilename = nullptr;
+    io.DisplaySize = ImVec2(1920.0f, 1080.0f);
+    unsigned char *pixels = nullptr;
+    int width = 0;
+    int height = 0;
+    io.Fonts->GetTexDataAsRGBA32(&pixels, &width, &height);
+  }
+  ScopedImGuiContext(const ScopedImGuiContext &) = delete;
+  ScopedImGuiContext &operator=(const ScopedImGuiContext &) = delete;
+  ScopedImGuiContext(ScopedImGuiContext &&) = delete;
+  ScopedImGuiContext &operator=(ScopedImGuiContext &&) = delete;
+  ~ScopedImGuiContext() { ImGui::DestroyContext(); }
+};
+
+cv::Mat Thumbnail(int value) {
+  return {xpano::kThumbnailSize, xpano::kThumbnailSize, CV_8UC3,
+          cv::Scalar::all(value)};
+}
+
+std::vector<xpano::algorithm::Image> Images(int first, int num_images) {
+  std::vector<xpano::algorithm::Image> images;
+  for (int i = first; i < first + num_images; i++) {
+    images.emplace_back(std::filesystem::path(std::to_string(i) + ".jpg"),
+                        Thumbnail(i), Thumbnail(i),
+                        std::vector<cv::KeyPoint>{}, cv::Mat{}, false);
+  }
+  return images;
+}
+
+std::vector<std::filesystem::path> Paths(
+    const std::vector<xpano::algorithm::Image> &images) {
+  std::vector<std::filesystem::path> paths;
+  for (const auto &image : images) {
+    paths.push_back(image.GetPath());
+  }
+  return paths;
+}
+
+// Uploads the pending thumbnails of the images in order
+void DrawTooltip(const xpano::gui::ThumbnailPane &pane,
+                 const std::vector<int> &ids) {
+  ImGui::NewFrame();
+  pane.ThumbnailTooltip(ids);
+  ImGui::EndFrame();
+}
+
+}  // namespace
+
+TEST_CASE("ThumbnailPane load") {
+  const ScopedImGuiContext context;
+  FakeBackend backend;
+  xpano::gui::ThumbnailPane pane(&backend);
+
+  auto images = Images(0, 3);
+  pane.BeginLoading(Paths(images));
+  CHECK(!pane.Loaded());
+  pane.AddThumbnail(1, images[1].GetThumbnail(), images[1].GetAspect());
+  pane.Load(images);
+  REQUIRE(pane.Loaded());
+
+  DrawTooltip(pane, {0, 1, 2});
+  CHECK_THAT(backend.UploadedValues(), Equals<int>({0, 1, 2}));
+  CHECK(backend.UploadedToDistinctSlots());
+}
+
+TEST_CASE("ThumbnailPane load and append") {
+  const ScopedImGuiContext context;
+  FakeBackend backend;
+  xpano::gui::ThumbnailPane pane(&backend);
+
+  auto images = Images(0, 3);
+  pane.BeginLoading(Paths(images));
+  pane.Load(images);
+  DrawTooltip(pane, {0, 1, 2});
+  backend.uploads.clear();
+
+  auto appended = Images(3, 2);
+  pane.BeginAppending(images, Paths(appended));
+  // The loaded images stay interactive while appending
+  CHECK(pane.Loaded());
+  // Progressively added, kept by Load
+  pane.AddThumbnail(1, Thumbnail(100), appended[1].GetAspect());
+
+  images.insert(images.end(), appended.begin(), appended.end());
+  pane.Load(images);
+  REQUIRE(pane.Loaded());
+
+  DrawTooltip(pane, {0, 1, 2, 3, 4});
+  CHECK_THAT(backend.UploadedValues(), Equals<int>({0, 1, 2, 3, 100}));
+  CHECK(backend.UploadedToDistinctSlots());
+}
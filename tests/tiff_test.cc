@@ -0,0 +1,235 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/tiff.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+#include <catch2/catch_test_macros.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "xpano/utils/deep_zoom.h"
+#include "xpano/utils/threadpool.h"
+
+TEST_CASE("Tiled TIFF writer") {
+  const std::filesystem::path path = "tiled.tif";
+  const cv::Size size(40, 20);
+  const int tile_size = 16;
+
+  cv::Mat image(size, CV_8UC3);
+  cv::randu(image, 0, 255);
+  cv::Mat mask = cv::Mat::zeros(size, CV_8U);
+  mask(cv::Rect(0, 0, 30, 20)).setTo(255);
+
+  xpano::utils::tiff::TiledWriter writer(path, size, tile_size);
+  REQUIRE(writer.IsOpen());
+  // Any order is fine
+  for (int y = size.height / tile_size * tile_size; y >= 0; y -= tile_size) {
+    for (int x = 0; x < size.width; x += tile_size) {
+      const cv::Rect tile = cv::Rect(x, y, tile_size, tile_size) &
+                            cv::Rect(cv::Point(), size);
+      REQUIRE(writer.WriteTile(tile.tl(), image(tile), mask(tile)));
+    }
+  }
+  REQUIRE(writer.Close());
+
+  auto loaded = cv::imread(path.string(), cv::IMREAD_UNCHANGED);
+  REQUIRE(loaded.size() == size);
+  REQUIRE(loaded.type() == CV_8UC4);
+
+  std::vector<cv::Mat> channels;
+  cv::split(loaded, channels);
+  cv::Mat loaded_image;
+  cv::merge(std::vector<cv::Mat>{channels[0], channels[1], channels[2]},
+            loaded_image);
+  cv::Mat diff;
+  cv::absdiff(loaded_image, image, diff);
+  CHECK(cv::countNonZero(diff.reshape(1)) == 0);
+  cv::absdiff(channels[3], mask, diff);
+  CHECK(cv::countNonZero(diff) == 0);
+
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("Tiled TIFF writer overviews") {
+  const std::filesystem::path path = "tiled_overviews.tif";
+  const cv::Size size(70, 40);
+  const int tile_size = 16;
+
+  cv::Mat image(size, CV_8UC3);
+  cv::randu(image, 0, 255);
+  const cv::Mat mask(size, CV_8U, cv::Scalar(255));
+
+  xpano::utils::tiff::TiledWriter writer(path, size, tile_size,
+                                         /*overviews=*/true);
+  REQUIRE(writer.IsOpen());
+  for (int x = 0; x < size.width; x += tile_size) {
+    for (int y = 0; y < size.height; y += tile_size) {
+      const cv::Rect tile = cv::Rect(x, y, tile_size, tile_size) &
+                            cv::Rect(cv::Point(), size);
+      REQUIRE(writer.WriteTile(tile.tl(), image(tile), mask(tile)));
+    }
+  }
+  REQUIRE(writer.Close());
+
+  std::vector<cv::Mat> levels;
+  REQUIRE(cv::imreadmulti(path.string(), levels, cv::IMREAD_UNCHANGED));
+  // Halved until a single tile: 70x40 -> 35x20 -> 18x10 -> 9x5
+  REQUIRE(levels.size() == 4);
+  CHECK(levels[0].size() == size);
+  CHECK(levels[1].size() == cv::Size(35, 20));
+  CHECK(levels[2].size() == cv::Size(18, 10));
+  CHECK(levels[3].size() == cv::Size(9, 5));
+
+  cv::Mat expected;
+  cv::cvtColor(image, expected, cv::COLOR_BGR2BGRA);
+  cv::resize(expected, expected, levels[1].size(), 0.0, 0.0, cv::INTER_AREA);
+  cv::Mat diff;
+  cv::absdiff(levels[1], expected, diff);
+  // Rounding in the per tile resize
+  double max_diff = 0.0;
+  cv::minMaxLoc(diff.reshape(1), nullptr, &max_diff);
+  CHECK(max_diff <= 1.0);
+
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("TIFF reader overviews") {
+  const std::filesystem::path path = "read_overviews.tif";
+  const cv::Size size(70, 40);
+  const int tile_size = 16;
+
+  cv::Mat image(size, CV_8UC3);
+  cv::randu(image, 0, 255);
+  const cv::Mat mask(size, CV_8U, cv::Scalar(255));
+
+  xpano::utils::tiff::TiledWriter writer(path, size, tile_size,
+                                         /*overviews=*/true);
+  REQUIRE(writer.IsOpen());
+  for (int x = 0; x < size.width; x += tile_size) {
+    for (int y = 0; y < size.height; y += tile_size) {
+      const cv::Rect tile = cv::Rect(x, y, tile_size, tile_size) &
+                            cv::Rect(cv::Point(), size);
+      REQUIRE(writer.WriteTile(tile.tl(), image(tile), mask(tile)));
+    }
+  }
+  REQUIRE(writer.Close());
+
+  auto reader = xpano::utils::tiff::Reader::Open(path);
+  REQUIRE(reader);
+  const auto& pages = reader->Pages();
+  REQUIRE(pages.size() == 4);
+  CHECK(pages[0].size == size);
+  CHECK(!pages[0].reduced_resolution);
+  CHECK(pages[1].size == cv::Size(35, 20));
+  CHECK(pages[1].reduced_resolution);
+  CHECK(pages[3].size == cv::Size(9, 5));
+  CHECK(std::all_of(pages.begin(), pages.end(),
+                    [](const auto& page) { return page.supported; }));
+
+  CHECK(xpano::utils::tiff::PickPage(pages, 0) == 0);
+  CHECK(xpano::utils::tiff::PickPage(pages, 30) == 1);
+  CHECK(xpano::utils::tiff::PickPage(pages, 10) == 2);
+  CHECK(xpano::utils::tiff::PickPage(pages, 100) == 0);
+
+  // Spans several tiles
+  const cv::Rect roi(10, 5, 40, 30);
+  const cv::Mat region = reader->ReadRegion(0, roi);
+  REQUIRE(region.type() == CV_8UC3);
+  REQUIRE(region.size() == roi.size());
+  CHECK(cv::norm(region, image(roi), cv::NORM_INF) == 0.0);
+  CHECK(cv::norm(reader->Read(0), image, cv::NORM_INF) == 0.0);
+  CHECK(reader->Read(1).size() == pages[1].size);
+
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("TIFF reader strips") {
+  const std::filesystem::path path = "read_strips.tif";
+  cv::Mat image(37, 23, CV_16UC3);
+  cv::randu(image, 0, 65535);
+  REQUIRE(cv::imwrite(path.string(), image,
+                      {cv::IMWRITE_TIFF_COMPRESSION, 1}));
+
+  auto reader = xpano::utils::tiff::Reader::Open(path);
+  REQUIRE(reader);
+  REQUIRE(reader->Pages().size() == 1);
+  REQUIRE(reader->Pages()[0].supported);
+  const cv::Mat read = reader->Read(0);
+  REQUIRE(read.type() == CV_16UC3);
+  CHECK(cv::norm(read, image, cv::NORM_INF) == 0.0);
+
+  const cv::Rect roi(3, 11, 17, 20);
+  CHECK(cv::norm(reader->ReadRegion(0, roi), image(roi), cv::NORM_INF) == 0.0);
+
+  std::filesystem::remove(path);
+}
+
+TEST_CASE("Deep Zoom pyramid writer") {
+  const std::filesystem::path path = "pyramid.dzi";
+  const std::filesystem::path files_dir = "pyramid_files";
+  const cv::Size size(150, 90);
+  const int block_size = 64;
+  const int tile_size = 32;
+
+  cv::Mat image(size, CV_8UC3);
+  for (int row = 0; row < image.rows; row++) {
+    for (int col = 0; col < image.cols; col++) {
+      image.at<cv::Vec3b>(row, col) = {static_cast<uchar>(row),
+                                       static_cast<uchar>(col),
+                                       static_cast<uchar>(100)};
+    }
+  }
+  const cv::Mat mask(size, CV_8U, cv::Scalar(255));
+
+  xpano::utils::mt::Threadpool pool(4);
+  {
+    xpano::utils::deep_zoom::PyramidWriter writer(
+        path, size, block_size, tile_size, {cv::IMWRITE_JPEG_QUALITY, 95},
+        &pool);
+    REQUIRE(writer.IsOpen());
+    for (int y = 0; y < size.height; y += block_size) {
+      for (int x = size.width / block_size * block_size; x >= 0;
+           x -= block_size) {
+        const cv::Rect block = cv::Rect(x, y, block_size, block_size) &
+                               cv::Rect(cv::Point(), size);
+        REQUIRE(writer.WriteTile(block.tl(), image(block), mask(block)));
+      }
+    }
+    REQUIRE(writer.Close());
+  }
+  CHECK(std::filesystem::exists(path));
+
+  // 150x90 -> 75x45 -> ... -> 1x1, 9 levels
+  CHECK(cv::imread((files_dir / "0" / "0_0.jpg").string()).size() ==
+        cv::Size(1, 1));
+  CHECK(cv::imread((files_dir / "8" / "4_2.jpg").string()).size() ==
+        cv::Size(22, 26));
+  CHECK_FALSE(std::filesystem::exists(files_dir / "9"));
+
+  // Level 7 is the image halved
+  const cv::Size half_size(75, 45);
+  cv::Mat level(half_size, CV_8UC3);
+  for (int y = 0; y < half_size.height; y += tile_size) {
+    for (int x = 0; x < half_size.width; x += tile_size) {
+      const auto tile_name = std::to_string(x / tile_size) + "_" +
+                             std::to_string(y / tile_size) + ".jpg";
+      auto tile = cv::imread((files_dir / "7" / tile_name).string());
+      const cv::Rect tile_rect = cv::Rect(x, y, tile_size, tile_size) &
+                                 cv::Rect(cv::Point(), half_size);
+      REQUIRE(tile.size() == tile_rect.size());
+      tile.copyTo(level(tile_rect));
+    }
+  }
+  cv::Mat expected;
+  cv::resize(image, expected, half_size, 0.0, 0.0, cv::INTER_AREA);
+  CHECK(cv::norm(level, expected, cv::NORM_L1) / level.total() < 10.0);
+
+  std::filesystem::remove(path);
+  std::filesystem::remove_all(files_dir);
+}
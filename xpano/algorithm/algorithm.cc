@@ -5,29 +5,43 @@
 #include "xpano/algorithm/algorithm.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
 #include <iterator>
+#include <limits>
+#include <memory>
 #include <numeric>
 #include <optional>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
-#include <unordered_set>
 #include <utility>
 #include <vector>
 
 #include <opencv2/calib3d.hpp>
 #include <opencv2/core.hpp>
+#include <opencv2/core/ocl.hpp>
 #include <opencv2/features2d.hpp>
+#include <opencv2/imgproc.hpp>
 #include <opencv2/photo.hpp>
 #include <opencv2/stitching.hpp>
+#include <spdlog/spdlog.h>
 
 #include "xpano/algorithm/auto_crop.h"
+#include "xpano/algorithm/bf_matcher.h"
 #include "xpano/algorithm/blenders.h"
+#include "xpano/algorithm/bundle_adjusters.h"
+#include "xpano/algorithm/exposure_compensators.h"
 #include "xpano/algorithm/image.h"
 #include "xpano/algorithm/options.h"
+#include "xpano/algorithm/seam_finders.h"
 #include "xpano/algorithm/stitcher.h"
 #include "xpano/algorithm/warpers.h"
 #include "xpano/utils/disjoint_set.h"
+#include "xpano/utils/memory.h"
+#include "xpano/utils/opencv.h"
 #include "xpano/utils/rect.h"
 #include "xpano/utils/threadpool.h"
 #include "xpano/utils/vec.h"
@@ -35,22 +49,20 @@
 namespace xpano::algorithm {
 
 namespace {
-void InsertInOrder(int value, std::vector<int>* vec) {
-  auto iter = std::lower_bound(vec->begin(), vec->end(), value);
-  vec->insert(iter, value);
-}
+
+constexpr double kHomographyReprojThreshold = 3.0;
 
 cv::Ptr<cv::WarperCreator> PickWarper(ProjectionOptions options) {
   cv::Ptr<cv::WarperCreator> warper_creator;
   switch (options.type) {
     case ProjectionType::kPerspective:
-      warper_creator = cv::makePtr<cv::PlaneWarper>();
+      warper_creator = cv::makePtr<stitcher::FastPlaneWarper>();
       break;
     case ProjectionType::kCylindrical:
-      warper_creator = cv::makePtr<cv::CylindricalWarper>();
+      warper_creator = cv::makePtr<stitcher::FastCylindricalWarper>();
       break;
     case ProjectionType::kSpherical:
-      warper_creator = cv::makePtr<cv::SphericalWarper>();
+      warper_creator = cv::makePtr<stitcher::FastSphericalWarper>();
       break;
     case ProjectionType::kFisheye:
       warper_creator = cv::makePtr<cv::FisheyeWarper>();
@@ -67,7 +79,7 @@ cv::Ptr<cv::WarperCreator> PickWarper(ProjectionOptions options) {
           cv::makePtr<cv::PaniniWarper>(options.a_param, options.b_param);
       break;
     case ProjectionType::kMercator:
-      warper_creator = cv::makePtr<cv::MercatorWarper>();
+      warper_creator = cv::makePtr<stitcher::FastMercatorWarper>();
       break;
     case ProjectionType::kTransverseMercator:
       warper_creator = cv::makePtr<cv::TransverseMercatorWarper>();
@@ -110,6 +122,8 @@ cv::Ptr<cv::FeatureDetector> PickFeaturesFinder(FeatureType feature) {
       return cv::SIFT::create();
     case FeatureType::kOrb:
       return cv::ORB::create();
+    case FeatureType::kAkaze:
+      return cv::AKAZE::create();
     default:
       return nullptr;
   }
@@ -129,82 +143,234 @@ cv::detail::WaveCorrectKind PickWaveCorrectKind(
   }
 }
 
-cv::Ptr<cv::detail::Blender> PickBlender(BlendingMethod blending_method,
-                                         utils::mt::Threadpool* threadpool) {
+cv::Ptr<cv::detail::Blender> PickBlender(
+    BlendingMethod blending_method, utils::mt::Threadpool* threadpool,
+    ProgressMonitor* progress_monitor, BufferPool* buffer_pool,
+    const std::optional<SpillOptions>& spill, bool on_device) {
   switch (blending_method) {
     case BlendingMethod::kOpenCV: {
-      return cv::makePtr<blenders::MultiBandOpenCV>();
+      return cv::makePtr<blenders::MultiBandOpenCV>(buffer_pool, on_device);
     }
     case BlendingMethod::kMultiblend: {
+      // Multiblend runs on the host
+      if (on_device) {
+        return cv::makePtr<blenders::MultiBandOpenCV>(buffer_pool, on_device);
+      }
       if constexpr (blenders::MultiblendEnabled()) {
-        return cv::makePtr<blenders::Multiblend>(threadpool);
+        return cv::makePtr<blenders::Multiblend>(threadpool, progress_monitor,
+                                                 spill);
       }
       throw std::runtime_error(
           "Multiblend is not supported in this build of xpano");
     }
+    case BlendingMethod::kFeather: {
+      return cv::makePtr<blenders::FeatherOpenCV>(buffer_pool);
+    }
+    case BlendingMethod::kSeamOnly: {
+      return cv::makePtr<blenders::SeamOnly>(buffer_pool);
+    }
     default:
       return nullptr;
   }
 }
 
-}  // namespace
-
-Match MatchImages(int img1_id, int img2_id, const Image& img1,
-                  const Image& img2, float match_conf) {
-  if (img1.GetKeypoints().empty() || img2.GetKeypoints().empty()) {
+// Downscaled on the device, empty if the pano already fits
+cv::Mat DisplayCopy(const cv::UMat& pano, int longer_side) {
+  const int pano_longer_side = std::max(pano.cols, pano.rows);
+  if (longer_side <= 0 || pano_longer_side <= longer_side) {
     return {};
   }
+  const double scale = static_cast<double>(longer_side) / pano_longer_side;
+  cv::UMat display;
+  cv::resize(pano, display, cv::Size(), scale, scale, cv::INTER_AREA);
+  return utils::opencv::Download(display);
+}
 
-  // KNN MATCH, K = 2
-  const cv::FlannBasedMatcher matcher;
+cv::Ptr<cv::detail::SeamFinder> PickSeamFinder(
+    SeamFinderType seam_finder_type, utils::mt::Threadpool* threadpool) {
+  switch (seam_finder_type) {
+    case SeamFinderType::kVoronoi:
+      return cv::makePtr<cv::detail::VoronoiSeamFinder>();
+    case SeamFinderType::kDpColor:
+      return cv::makePtr<cv::detail::DpSeamFinder>(
+          cv::detail::DpSeamFinder::COLOR);
+    default:
+      return cv::makePtr<seam_finders::ParallelGraphCut>(threadpool);
+  }
+}
+
+// FLANN kd-trees need floats, compact descriptors are converted on the fly
+cv::Mat FloatDescriptors(const Image& image) {
+  auto descriptors = image.GetDescriptors();
+  if (descriptors.depth() == CV_32F) {
+    return descriptors;
+  }
+  cv::Mat float_descriptors;
+  descriptors.convertTo(float_descriptors, CV_32F);
+  return float_descriptors;
+}
+
+std::vector<std::vector<cv::DMatch>> KnnMatch(const Image& img1,
+                                              const Image& img2,
+                                              FeatureType feature) {
   std::vector<std::vector<cv::DMatch>> matches;
-  matcher.knnMatch(img1.GetDescriptors(), img2.GetDescriptors(), matches, 2);
+  if (HasBinaryDescriptors(feature)) {
+    const cv::BFMatcher matcher(cv::NORM_HAMMING);
+    matcher.knnMatch(img1.GetDescriptors(), img2.GetDescriptors(), matches, 2);
+  } else if (auto index = img2.GetDescriptorIndex(); index) {
+    matches = index->KnnMatch(FloatDescriptors(img1), 2);
+  } else {
+    const cv::FlannBasedMatcher matcher;
+    matcher.knnMatch(FloatDescriptors(img1), FloatDescriptors(img2), matches,
+                     2);
+  }
+  return matches;
+}
 
-  // FILTER BY FIRST/SECOND RATIO
-  std::vector<cv::DMatch> good_matches;
+MatchCandidates Candidates(const std::vector<std::vector<cv::DMatch>>& matches,
+                           float match_conf) {
+  MatchCandidates candidates{.match_conf = match_conf};
   for (const auto& match : matches) {
-    if (match[0].distance < (1.0f - match_conf) * match[1].distance) {
-      good_matches.push_back(match[0]);
+    if (match.size() < 2) {
+      continue;
     }
+    candidates.nearest.push_back(match[0]);
+    candidates.second_distances.push_back(match[1].distance);
   }
+  return candidates;
+}
 
-  if (good_matches.size() < 4) {
+bool PassesRatioTest(const MatchCandidates& candidates, int index,
+                     float max_ratio) {
+  return candidates.nearest[index].distance <
+         max_ratio * candidates.second_distances[index];
+}
+
+// Indices of the candidates passing
+std::vector<int> RatioTest(const MatchCandidates& candidates,
+                           float max_ratio) {
+  std::vector<int> good;
+  const int num_candidates = static_cast<int>(candidates.nearest.size());
+  for (int i = 0; i < num_candidates; i++) {
+    if (PassesRatioTest(candidates, i, max_ratio)) {
+      good.push_back(i);
+    }
+  }
+  return good;
+}
+
+std::vector<cv::DMatch> Nearest(const MatchCandidates& candidates,
+                                const std::vector<int>& indices) {
+  std::vector<cv::DMatch> matches;
+  matches.reserve(indices.size());
+  for (const int index : indices) {
+    matches.push_back(candidates.nearest[index]);
+  }
+  return matches;
+}
+
+// The ratio test is done inside the kernels
+std::vector<cv::DMatch> BruteForceMatch(const Image& img1, const Image& img2,
+                                        FeatureType feature, float max_ratio) {
+  if (HasBinaryDescriptors(feature)) {
+    return bf_matcher::MatchHamming(img1.GetDescriptors(),
+                                    img2.GetDescriptors(), max_ratio);
+  }
+  auto descriptors1 = img1.GetDescriptors();
+  auto descriptors2 = img2.GetDescriptors();
+  if (descriptors1.type() != descriptors2.type()) {
+    descriptors1 = FloatDescriptors(img1);
+    descriptors2 = FloatDescriptors(img2);
+  }
+  return bf_matcher::MatchL2(descriptors1, descriptors2, max_ratio);
+}
+
+int HomographyFlag(HomographyMethod method) {
+  switch (method) {
+    case HomographyMethod::kUsacFast:
+      return cv::USAC_FAST;
+    case HomographyMethod::kUsacMagsac:
+      return cv::USAC_MAGSAC;
+    default:
+      return cv::RANSAC;
+  }
+}
+
+struct MatchPoints {
+  std::vector<cv::Point2f> src;
+  std::vector<cv::Point2f> dst;
+};
+
+MatchPoints Points(const std::vector<cv::DMatch>& matches, const Image& img1,
+                   const Image& img2) {
+  const int num_matches = static_cast<int>(matches.size());
+  MatchPoints points{.src = std::vector<cv::Point2f>(num_matches),
+                     .dst = std::vector<cv::Point2f>(num_matches)};
+  for (int i = 0; i < num_matches; i++) {
+    points.src[i] = img1.GetKeypointPosition(matches[i].queryIdx);
+    points.dst[i] = img2.GetKeypointPosition(matches[i].trainIdx);
+  }
+  return points;
+}
+
+// Same layout as from cv::detail::BestOf2NearestMatcher
+std::optional<cv::detail::MatchesInfo> ToMatchesInfo(const Match& match,
+                                                     const Image& img1,
+                                                     const Image& img2) {
+  const int num_matches = static_cast<int>(match.matches.size());
+  if (num_matches < 4) {
     return {};
   }
 
-  // ESTIMATE HOMOGRAPHY
-  const int num_good_matches = static_cast<int>(good_matches.size());
-  cv::Mat src_points(1, num_good_matches, CV_32FC2);
-  cv::Mat dst_points(1, num_good_matches, CV_32FC2);
-  cv::Mat dst_points_proj;
-  int idx = 0;
-  for (const cv::DMatch& match : good_matches) {
-    src_points.at<cv::Vec2f>(0, idx) = img1.GetKeypoints()[match.queryIdx].pt;
-    dst_points.at<cv::Vec2f>(0, idx) = img2.GetKeypoints()[match.trainIdx].pt;
-    idx++;
-  }
-  const cv::Mat h_mat =
-      cv::findHomography(src_points, dst_points, cv::RANSAC, 3);
-  if (h_mat.empty()) {
+  // The matches are the inliers of the homography estimated by the matching.
+  // Without the homography, a least squares fit of the inliers.
+  cv::detail::MatchesInfo info;
+  info.matches = match.matches;
+  info.H = match.homography.clone();
+  if (info.H.empty()) {
+    const auto points = Points(match.matches, img1, img2);
+    info.H = cv::findHomography(points.src, points.dst, 0);
+  }
+  if (info.H.empty()) {
     return {};
   }
-  perspectiveTransform(src_points, dst_points_proj, h_mat);
+  info.inliers_mask.assign(num_matches, 1);
+  info.num_inliers = num_matches;
+  // The matches are the inliers of MatchImages, OpenCV's check for too
+  // close images (confidence > 3) doesn't apply, see FindPanos instead
+  info.confidence =
+      info.num_inliers / (8 + 0.3 * static_cast<double>(num_matches));
+  return info;
+}
+
+cv::detail::MatchesInfo Reverse(const cv::detail::MatchesInfo& info) {
+  auto reversed = info;
+  std::swap(reversed.src_img_idx, reversed.dst_img_idx);
+  reversed.H = info.H.inv();
+  for (auto& match : reversed.matches) {
+    std::swap(match.queryIdx, match.trainIdx);
+  }
+  return reversed;
+}
 
-  // FILTER OUTLIERS
+// The matches passing the inliers mask, the shift is relative to the larger
+// preview
+Match InlierMatch(int img1_id, int img2_id, const Image& img1,
+                  const Image& img2, const std::vector<cv::DMatch>& matches,
+                  const MatchPoints& points,
+                  const std::vector<uchar>& inliers_mask) {
   std::vector<cv::DMatch> inliers;
   double total_shift = 0.0f;
-
-  for (int i = 0; i < good_matches.size(); i++) {
-    const cv::Vec2f proj_diff =
-        dst_points.at<cv::Vec2f>(0, i) - dst_points_proj.at<cv::Vec2f>(0, i);
-    if (norm(proj_diff) < 3) {
-      inliers.push_back(good_matches[i]);
-
-      const cv::Vec2f diff =
-          dst_points.at<cv::Vec2f>(0, i) - src_points.at<cv::Vec2f>(0, i);
-      total_shift += norm(diff);
+  const int num_matches = static_cast<int>(matches.size());
+  for (int i = 0; i < num_matches; i++) {
+    if (inliers_mask[i] != 0) {
+      inliers.push_back(matches[i]);
+      total_shift += cv::norm(points.dst[i] - points.src[i]);
     }
   }
+  if (inliers.empty()) {
+    return {};
+  }
 
   const int max_size =
       std::max(img1.GetPreviewLongerSide(), img2.GetPreviewLongerSide());
@@ -213,43 +379,553 @@ Match MatchImages(int img1_id, int img2_id, const Image& img1,
   return {img1_id, img2_id, inliers, avg_shift};
 }
 
+// Keypoint ids of an image bucketed by their position, see GuidedMatch
+class KeypointGrid {
+ public:
+  KeypointGrid(const Image& image, float cell_size)
+      : cell_size_(cell_size),
+        cols_(static_cast<int>(
+                  static_cast<float>(image.GetPreviewSize().width) /
+                  cell_size) +
+              1),
+        rows_(static_cast<int>(
+                  static_cast<float>(image.GetPreviewSize().height) /
+                  cell_size) +
+              1),
+        cells_(cols_ * rows_) {
+    const int num_keypoints = image.NumKeypoints();
+    for (int i = 0; i < num_keypoints; i++) {
+      const auto [col, row] = Cell(image.GetKeypointPosition(i));
+      if (col >= 0 && col < cols_ && row >= 0 && row < rows_) {
+        cells_[row * cols_ + col].push_back(i);
+      }
+    }
+  }
+
+  // The keypoints of the cells around the point, a superset of the ones
+  // within cell_size of it
+  template <typename TFunc>
+  void ForEachNear(const cv::Point2f& point, TFunc func) const {
+    const auto [center_col, center_row] = Cell(point);
+    for (int row = std::max(center_row - 1, 0);
+         row <= std::min(center_row + 1, rows_ - 1); row++) {
+      for (int col = std::max(center_col - 1, 0);
+           col <= std::min(center_col + 1, cols_ - 1); col++) {
+        for (const int keypoint_id : cells_[row * cols_ + col]) {
+          func(keypoint_id);
+        }
+      }
+    }
+  }
+
+ private:
+  [[nodiscard]] std::pair<int, int> Cell(const cv::Point2f& point) const {
+    return {static_cast<int>(std::floor(point.x / cell_size_)),
+            static_cast<int>(std::floor(point.y / cell_size_))};
+  }
+
+  float cell_size_;
+  int cols_;
+  int rows_;
+  std::vector<std::vector<int>> cells_;
+};
+
+std::vector<cv::Point2f> PreviewCorners(const Image& image) {
+  const auto size = image.GetPreviewSize();
+  const auto width = static_cast<float>(size.width);
+  const auto height = static_cast<float>(size.height);
+  return {{0.0f, 0.0f}, {width, 0.0f}, {width, height}, {0.0f, height}};
+}
+
+}  // namespace
+
+Match MatchImages(int img1_id, int img2_id, const Image& img1,
+                  const Image& img2, const MatchOptions& options) {
+  if (img1.NumKeypoints() == 0 || img2.NumKeypoints() == 0) {
+    return {};
+  }
+
+  // KNN MATCH, K = 2 + FILTER BY FIRST/SECOND RATIO
+  const float max_ratio = 1.0f - options.match_conf;
+  std::shared_ptr<MatchCandidates> candidates;
+  std::vector<int> good;
+  std::vector<cv::DMatch> good_matches;
+  if (options.matcher == MatcherType::kBruteForce) {
+    good_matches = BruteForceMatch(img1, img2, options.feature, max_ratio);
+  } else {
+    candidates = std::make_shared<MatchCandidates>(Candidates(
+        KnnMatch(img1, img2, options.feature), options.match_conf));
+    good = RatioTest(*candidates, max_ratio);
+    good_matches = Nearest(*candidates, good);
+  }
+
+  if (good_matches.size() < 4) {
+    return {};
+  }
+
+  // ESTIMATE HOMOGRAPHY
+  const auto points = Points(good_matches, img1, img2);
+  std::vector<uchar> inliers_mask;
+  const cv::Mat h_mat = cv::findHomography(
+      points.src, points.dst, HomographyFlag(options.homography),
+      kHomographyReprojThreshold, inliers_mask);
+  if (h_mat.empty()) {
+    return {};
+  }
+
+  // FILTER OUTLIERS, the mask comes directly from the estimator
+  auto match = InlierMatch(img1_id, img2_id, img1, img2, good_matches, points,
+                           inliers_mask);
+  match.homography = h_mat;
+  if (candidates && !match.matches.empty()) {
+    candidates->inliers.assign(candidates->nearest.size(), 0);
+    for (size_t i = 0; i < good.size(); i++) {
+      candidates->inliers[good[i]] = inliers_mask[i];
+    }
+    candidates->homography = h_mat;
+    match.candidates = std::move(candidates);
+  }
+  return match;
+}
+
+Match Rematch(const Match& match, const Image& img1, const Image& img2,
+              float match_conf) {
+  if (!match.candidates) {
+    return match;
+  }
+  // Kept even without matches, a later call may bring them back
+  Match rematched{
+      .id1 = match.id1, .id2 = match.id2, .candidates = match.candidates};
+  const auto& candidates = *match.candidates;
+  const auto good = RatioTest(candidates, 1.0f - match_conf);
+  if (good.size() < 4) {
+    return rematched;
+  }
+
+  const auto good_matches = Nearest(candidates, good);
+  const auto points = Points(good_matches, img1, img2);
+  std::vector<cv::Point2f> projected;
+  cv::perspectiveTransform(points.src, projected, candidates.homography);
+  std::vector<uchar> inliers_mask(good.size());
+  for (size_t i = 0; i < good.size(); i++) {
+    const bool tested =
+        PassesRatioTest(candidates, good[i], 1.0f - candidates.match_conf);
+    inliers_mask[i] = tested ? candidates.inliers[good[i]]
+                             : static_cast<uchar>(
+                                   cv::norm(projected[i] - points.dst[i]) <=
+                                   kHomographyReprojThreshold);
+  }
+  auto inliers = InlierMatch(match.id1, match.id2, img1, img2, good_matches,
+                             points, inliers_mask);
+  rematched.matches = std::move(inliers.matches);
+  rematched.avg_shift = inliers.avg_shift;
+  rematched.homography = candidates.homography;
+  return rematched;
+}
+
+cv::Mat MatchHomography(const Match& match, const Image& img1,
+                        const Image& img2) {
+  if (match.summary) {
+    return match.summary->homography;
+  }
+  if (match.matches.size() < 4) {
+    return {};
+  }
+  if (!match.homography.empty()) {
+    return match.homography;
+  }
+  if (match.candidates && !match.candidates->homography.empty()) {
+    return match.candidates->homography;
+  }
+  const auto points = Points(match.matches, img1, img2);
+  return cv::findHomography(points.src, points.dst, cv::RANSAC,
+                            kHomographyReprojThreshold);
+}
+
+cv::Mat OverlapRegion(const Image& img1, const Image& img2,
+                      const cv::Mat& homography) {
+  cv::Mat region = cv::Mat::zeros(img2.GetPreviewSize(), CV_8U);
+  if (homography.empty()) {
+    return region;
+  }
+  std::vector<cv::Point2f> corners;
+  cv::perspectiveTransform(PreviewCorners(img1), corners, homography);
+  std::vector<cv::Point> polygon(corners.begin(), corners.end());
+  cv::fillPoly(region, std::vector{polygon}, cv::Scalar(255));
+  return region;
+}
+
+Match GuidedMatch(int img1_id, int img2_id, const Image& img1,
+                  const Image& img2, const cv::Mat& homography,
+                  const MatchOptions& options) {
+  if (img1.NumKeypoints() == 0 || img2.NumKeypoints() == 0 ||
+      homography.empty()) {
+    return {};
+  }
+
+  const float radius =
+      kGuidedMatchRadius * static_cast<float>(std::max(
+                               img1.GetPreviewLongerSide(),
+                               img2.GetPreviewLongerSide()));
+  const KeypointGrid grid(img2, radius);
+
+  const int num_keypoints = img1.NumKeypoints();
+  std::vector<cv::Point2f> positions(num_keypoints);
+  for (int i = 0; i < num_keypoints; i++) {
+    positions[i] = img1.GetKeypointPosition(i);
+  }
+  std::vector<cv::Point2f> predicted;
+  cv::perspectiveTransform(positions, predicted, homography);
+
+  const bool binary = HasBinaryDescriptors(options.feature);
+  const int norm_type = binary ? cv::NORM_HAMMING : cv::NORM_L2;
+  const cv::Mat descriptors1 =
+      binary ? img1.GetDescriptors() : FloatDescriptors(img1);
+  const cv::Mat descriptors2 =
+      binary ? img2.GetDescriptors() : FloatDescriptors(img2);
+
+  // RATIO TEST among the keypoints near the predicted position, a single
+  // candidate is left to the homography
+  const float max_ratio = 1.0f - options.match_conf;
+  const cv::Size size2 = img2.GetPreviewSize();
+  const cv::Rect2f search_area(
+      -radius, -radius, static_cast<float>(size2.width) + 2.0f * radius,
+      static_cast<float>(size2.height) + 2.0f * radius);
+  std::vector<cv::DMatch> good_matches;
+  for (int i = 0; i < num_keypoints; i++) {
+    // Also skips the non-finite predictions
+    if (!search_area.contains(predicted[i])) {
+      continue;
+    }
+    cv::DMatch best(i, -1, std::numeric_limits<float>::max());
+    float second_distance = std::numeric_limits<float>::max();
+    grid.ForEachNear(predicted[i], [&](int keypoint_id) {
+      if (cv::norm(img2.GetKeypointPosition(keypoint_id) - predicted[i]) >
+          radius) {
+        return;
+      }
+      const auto distance = static_cast<float>(
+          cv::norm(descriptors1.row(i), descriptors2.row(keypoint_id),
+                   norm_type));
+      if (distance < best.distance) {
+        second_distance = best.distance;
+        best.trainIdx = keypoint_id;
+        best.distance = distance;
+      } else if (distance < second_distance) {
+        second_distance = distance;
+      }
+    });
+    if (best.trainIdx >= 0 && best.distance < max_ratio * second_distance) {
+      good_matches.push_back(best);
+    }
+  }
+
+  if (good_matches.size() < 4) {
+    return {};
+  }
+
+  const auto points = Points(good_matches, img1, img2);
+  std::vector<uchar> inliers_mask;
+  const cv::Mat h_mat = cv::findHomography(
+      points.src, points.dst, HomographyFlag(options.homography),
+      kHomographyReprojThreshold, inliers_mask);
+  if (h_mat.empty()) {
+    return {};
+  }
+  auto match = InlierMatch(img1_id, img2_id, img1, img2, good_matches, points,
+                           inliers_mask);
+  match.homography = h_mat;
+  return match;
+}
+
+int NumInliers(const Match& match) {
+  return match.summary ? match.summary->num_inliers
+                       : static_cast<int>(match.matches.size());
+}
+
+void ReleaseInliers(Match* match, const Image& img1, const Image& img2,
+                    const MatchOptions& options) {
+  if (match->summary) {
+    return;
+  }
+  match->summary = {.num_inliers = NumInliers(*match),
+                    .homography = MatchHomography(*match, img1, img2),
+                    .options = options};
+  match->matches = {};
+  match->homography = cv::Mat{};
+  match->candidates.reset();
+}
+
+Match RestoreInliers(const Match& match, const Image& img1,
+                     const Image& img2) {
+  if (!match.summary) {
+    return match;
+  }
+  auto restored =
+      GuidedMatch(match.id1, match.id2, img1, img2, match.summary->homography,
+                  match.summary->options);
+  restored.id1 = match.id1;
+  restored.id2 = match.id2;
+  return restored;
+}
+
 std::vector<Pano> FindPanos(const std::vector<Match>& matches,
                             int match_threshold, float min_shift) {
-  auto pano_ds = utils::DisjointSet();
+  auto passes = [&](const Match& match) {
+    return NumInliers(match) >= match_threshold &&
+           match.avg_shift >= min_shift;
+  };
 
-  std::unordered_set<int> images_in_panos;
+  int num_ids = 0;
   for (const auto& match : matches) {
-    if (match.matches.size() >= match_threshold &&
-        match.avg_shift >= min_shift) {
+    if (passes(match)) {
+      num_ids = std::max({num_ids, match.id1 + 1, match.id2 + 1});
+    }
+  }
+  if (num_ids == 0) {
+    return {};
+  }
+
+  // Flat arrays indexed by the image ids, the ids are dense
+  auto pano_ds = utils::DisjointSet(num_ids);
+  std::vector<char> in_pano(num_ids, 0);
+  for (const auto& match : matches) {
+    if (passes(match)) {
       pano_ds.Union(match.id1, match.id2);
-      images_in_panos.insert(match.id1);
-      images_in_panos.insert(match.id2);
+      in_pano[match.id1] = 1;
+      in_pano[match.id2] = 1;
     }
   }
 
-  if (images_in_panos.empty()) {
-    return {};
+  // Counting sort by the pano, the panos are numbered by their first image
+  // and the ids come out in order
+  std::vector<int> pano_of_root(num_ids, -1);
+  std::vector<int> pano_of_image(num_ids, -1);
+  std::vector<int> pano_sizes;
+  for (int image_id = 0; image_id < num_ids; image_id++) {
+    if (in_pano[image_id] == 0) {
+      continue;
+    }
+    int& pano_id = pano_of_root[pano_ds.Find(image_id)];
+    if (pano_id < 0) {
+      pano_id = static_cast<int>(pano_sizes.size());
+      pano_sizes.push_back(0);
+    }
+    pano_of_image[image_id] = pano_id;
+    pano_sizes[pano_id]++;
   }
 
-  std::unordered_map<int, Pano> pano_map;
-  for (auto image_id : images_in_panos) {
-    const int root = pano_ds.Find(image_id);
-    if (auto pano = pano_map.find(root); pano != pano_map.end()) {
-      InsertInOrder(image_id, &pano->second.ids);
-    } else {
-      pano_map.emplace(root, Pano{.ids = {image_id}});
+  std::vector<Pano> result(pano_sizes.size());
+  for (std::size_t i = 0; i < result.size(); i++) {
+    result[i].ids.reserve(static_cast<std::size_t>(pano_sizes[i]));
+  }
+  for (int image_id = 0; image_id < num_ids; image_id++) {
+    if (const int pano_id = pano_of_image[image_id]; pano_id >= 0) {
+      result[pano_id].ids.push_back(image_id);
+    }
+  }
+  return result;
+}
+
+PanoStream::PanoStream(int num_images,
+                       const std::vector<std::pair<int, int>>& pairs,
+                       int match_threshold, float min_shift)
+    : pairs_(pairs),
+      match_threshold_(match_threshold),
+      min_shift_(min_shift),
+      connected_(num_images),
+      pending_(num_images, 0),
+      members_(num_images),
+      pairs_of_image_(num_images) {
+  for (int image_id = 0; image_id < num_images; image_id++) {
+    members_[image_id].push_back(image_id);
+  }
+  for (int pair_id = 0; pair_id < static_cast<int>(pairs_.size());
+       pair_id++) {
+    for (const int image_id : {pairs_[pair_id].first, pairs_[pair_id].second}) {
+      pending_[image_id]++;
+      pairs_of_image_[image_id].push_back(pair_id);
+    }
+  }
+}
+
+std::vector<Pano> PanoStream::Add(int pair_id, const Match& match) {
+  const auto [id1, id2] = pairs_[pair_id];
+  int root1 = connected_.Find(id1);
+  int root2 = connected_.Find(id2);
+  pending_[root1]--;
+  pending_[root2]--;
+
+  std::vector<Pano> panos;
+  if (root1 != root2 && NumInliers(match) >= match_threshold_ &&
+      match.avg_shift >= min_shift_) {
+    connected_.Union(root1, root2);
+    const int root = connected_.Find(root1);
+    const int other = root == root1 ? root2 : root1;
+    pending_[root] += pending_[other];
+    // Smaller into larger
+    if (members_[root].size() < members_[other].size()) {
+      std::swap(members_[root], members_[other]);
+    }
+    members_[root].insert(members_[root].end(), members_[other].begin(),
+                          members_[other].end());
+    members_[other] = {};
+    Emit(root, &panos);
+    return panos;
+  }
+  Emit(root1, &panos);
+  if (root2 != root1) {
+    Emit(root2, &panos);
+  }
+  return panos;
+}
+
+void PanoStream::Emit(int root, std::vector<Pano>* panos) {
+  if (pending_[root] != 0 || members_[root].size() < 2) {
+    return;
+  }
+  auto& pano = panos->emplace_back();
+  pano.ids = std::exchange(members_[root], {});
+  std::sort(pano.ids.begin(), pano.ids.end());
+}
+
+std::vector<int> PanoStream::PairsOf(const Pano& pano) const {
+  std::vector<int> result;
+  for (const int image_id : pano.ids) {
+    for (const int pair_id : pairs_of_image_[image_id]) {
+      const auto [id1, id2] = pairs_[pair_id];
+      const int other = id1 == image_id ? id2 : id1;
+      if (other > image_id &&
+          std::binary_search(pano.ids.begin(), pano.ids.end(), other)) {
+        result.push_back(pair_id);
+      }
+    }
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+MatchConnectivity::MatchConnectivity(int match_threshold, float min_shift,
+                                     int strong_threshold)
+    : match_threshold_(match_threshold),
+      min_shift_(min_shift),
+      strong_threshold_(strong_threshold) {}
+
+void MatchConnectivity::Add(const Match& match) {
+  if (match.avg_shift < min_shift_) {
+    return;
+  }
+  const int num_matches = NumInliers(match);
+  for (const int id : {match.id1, match.id2}) {
+    auto& best = best_[id];
+    best = std::max(best, num_matches);
+  }
+  if (num_matches >= match_threshold_) {
+    connected_.Union(match.id1, match.id2);
+  }
+}
+
+bool MatchConnectivity::Needs(int id1, int id2) {
+  return (Weak(id1) || Weak(id2)) &&
+         connected_.Find(id1) != connected_.Find(id2);
+}
+
+bool MatchConnectivity::Weak(int id) const {
+  auto best = best_.find(id);
+  return best == best_.end() || best->second < strong_threshold_;
+}
+
+std::optional<StitchFeatures> PrepareStitchFeatures(
+    const std::vector<int>& ids, const std::vector<Image>& images,
+    const std::vector<Match>& matches) {
+  const int num_images = static_cast<int>(ids.size());
+  StitchFeatures result;
+  result.features.resize(num_images);
+  std::unordered_map<int, int> pano_index;
+  for (int i = 0; i < num_images; i++) {
+    const auto& image = images[ids[i]];
+    if (image.NumKeypoints() == 0) {
+      return {};
     }
+    auto& features = result.features[i];
+    features.img_idx = i;
+    features.img_size = image.GetPreviewSize();
+    features.keypoints = image.GetKeypoints();
+    pano_index[ids[i]] = i;
   }
 
-  std::vector<Pano> result;
-  std::transform(pano_map.begin(), pano_map.end(), std::back_inserter(result),
-                 [](const auto& pano) { return pano.second; });
-  std::sort(result.begin(), result.end(), [](const Pano& lhs, const Pano& rhs) {
-    return lhs.ids[0] < rhs.ids[0];
-  });
+  result.pairwise_matches.resize(num_images * num_images);
+  for (const auto& match : matches) {
+    auto index1 = pano_index.find(match.id1);
+    auto index2 = pano_index.find(match.id2);
+    if (index1 == pano_index.end() || index2 == pano_index.end()) {
+      continue;
+    }
+    const auto& img1 = images[match.id1];
+    const auto& img2 = images[match.id2];
+    auto info =
+        match.summary
+            ? ToMatchesInfo(RestoreInliers(match, img1, img2), img1, img2)
+            : ToMatchesInfo(match, img1, img2);
+    if (!info) {
+      continue;
+    }
+    const int i = index1->second;
+    const int j = index2->second;
+    info->src_img_idx = i;
+    info->dst_img_idx = j;
+    result.pairwise_matches[j * num_images + i] = Reverse(*info);
+    result.pairwise_matches[i * num_images + j] = *std::move(info);
+  }
   return result;
 }
 
+cv::Mat MatchingMask(const std::vector<int>& ids,
+                     const std::vector<Match>& matches, int match_threshold,
+                     bool expand_one_hop) {
+  const int num_images = static_cast<int>(ids.size());
+  std::unordered_map<int, int> pano_index;
+  for (int i = 0; i < num_images; i++) {
+    pano_index[ids[i]] = i;
+  }
+
+  cv::Mat mask = cv::Mat::zeros(num_images, num_images, CV_8U);
+  auto pano_ds = utils::DisjointSet(num_images);
+  for (const auto& match : matches) {
+    auto index1 = pano_index.find(match.id1);
+    auto index2 = pano_index.find(match.id2);
+    if (index1 == pano_index.end() || index2 == pano_index.end() ||
+        NumInliers(match) < match_threshold) {
+      continue;
+    }
+    mask.at<uchar>(index1->second, index2->second) = 1;
+    mask.at<uchar>(index2->second, index1->second) = 1;
+    pano_ds.Union(index1->second, index2->second);
+  }
+
+  for (int i = 1; i < num_images; i++) {
+    if (pano_ds.Find(i) != pano_ds.Find(0)) {
+      return {};
+    }
+  }
+
+  if (expand_one_hop) {
+    // Boolean mask * mask: pairs with a common neighbor
+    cv::Mat mask_float;
+    mask.convertTo(mask_float, CV_32F);
+    cv::Mat two_hops = mask_float * mask_float;
+    mask.setTo(1, two_hops > 0);
+  }
+  mask.diag().setTo(0);
+  return mask;
+}
+
+bool CanReuseCameras(const std::optional<Cameras>& cameras,
+                     const StitchUserOptions& user_options) {
+  return cameras &&
+         cameras->wave_correction_user == user_options.wave_correction;
+}
+
 StitchResult Stitch(const std::vector<cv::Mat>& images,
                     const std::optional<Cameras>& cameras,
                     StitchUserOptions user_options, StitchOptions options) {
@@ -257,44 +933,186 @@ StitchResult Stitch(const std::vector<cv::Mat>& images,
   stitcher->SetWarper(PickWarper(user_options.projection));
   stitcher->SetPortraitWarper(PickWarperPortrait(user_options.projection));
   stitcher->SetFeaturesFinder(PickFeaturesFinder(user_options.feature));
+  if (options.threads_for_features != nullptr) {
+    stitcher->SetFeatureThreads(
+        options.threads_for_features,
+        [feature = user_options.feature]() {
+          return PickFeaturesFinder(feature);
+        });
+  }
   stitcher->SetFeaturesMatcher(cv::makePtr<cv::detail::BestOf2NearestMatcher>(
       false, user_options.match_conf));
   stitcher->SetWaveCorrection(user_options.wave_correction !=
                               WaveCorrectionType::kOff);
   stitcher->SetMaxPanoMpx(user_options.max_pano_mpx);
+  stitcher->SetMaxMemoryMb(user_options.max_memory_mb);
   if (stitcher->WaveCorrection()) {
     stitcher->SetWaveCorrectKind(
         PickWaveCorrectKind(user_options.wave_correction));
   }
-  stitcher->SetBlender(PickBlender(user_options.blending_method,
-                                   options.threads_for_multiblend));
+  const auto blending_method = options.preview
+                                   ? user_options.preview_blending_method
+                                   : user_options.blending_method;
+  // Reused even if the rest of the session isn't
+  if (options.session && options.session->buffer_pool) {
+    stitcher->SetBufferPool(options.session->buffer_pool);
+  }
+  const auto buffer_pool = stitcher->GetBufferPool();
+  const bool device_resident =
+      user_options.device_resident && cv::ocl::useOpenCL();
+  stitcher->SetBlender(PickBlender(
+      blending_method, options.threads_for_multiblend,
+      options.progress_monitor, buffer_pool.get(), options.multiblend_spill,
+      device_resident));
+  const auto seam_finder =
+      ResolveSeamFinder(user_options.seam_finder, options.preview);
+  stitcher->SetSeamFinder(
+      PickSeamFinder(seam_finder, options.threads_for_seams));
+  if (!options.preview) {
+    stitcher->SetSeamRefinementResol(kSeamRefinementMpx);
+  }
+  stitcher->SetExposureCompensator(
+      cv::makePtr<exposure_compensators::ParallelBlocksGain>(
+          options.threads_for_seams, user_options.exposure_per_channel));
   stitcher->SetProgressMonitor(options.progress_monitor);
+  if (options.threads_for_compose != nullptr) {
+    stitcher->SetComposeThreads(
+        options.threads_for_compose,
+        std::min(static_cast<int>(
+                     options.threads_for_compose->get_thread_count()),
+                 kMaxWarpedImagesInFlight));
+  }
+  if (!options.matching_mask.empty()) {
+    stitcher->SetMatchingMask(options.matching_mask.getUMat(cv::ACCESS_READ));
+  }
 
-  cv::Mat pano;
-  stitcher::Status status;
+  if (options.full_res_source != nullptr) {
+    stitcher->SetFullResSource(*options.full_res_source);
+  }
+
+  if (const auto& crop = options.compose_crop) {
+    stitcher->SetComposeCrop({crop->start[0], crop->start[1],
+                              crop->end[0] - crop->start[0],
+                              crop->end[1] - crop->start[1]});
+  }
 
-  if (cameras &&
-      cameras->wave_correction_user == user_options.wave_correction) {
+  if (options.tiled_output != nullptr) {
+    // Multiblend needs all the images at once
+    stitcher->SetBlender(
+        cv::makePtr<blenders::MultiBandOpenCV>(buffer_pool.get()));
+  }
+
+  if (static_cast<int>(images.size()) >= kSparseBundleAdjustmentMinImages) {
+    stitcher->SetBundleAdjuster(cv::makePtr<bundle_adjusters::SparseRay>());
+  }
+
+  stitcher::Status status;
+  if (CanReuseCameras(cameras, user_options)) {
     stitcher->SetWaveCorrectKind(cameras->wave_correction_auto);
-    stitcher->SetTransform(images, cameras->cameras, cameras->component);
-    status = stitcher->ComposePanorama(pano);
+    status =
+        stitcher->SetTransform(images, cameras->cameras, cameras->component);
   } else {
-    status = stitcher->Stitch(images, pano);
+    if (options.initial_cameras != nullptr) {
+      stitcher->SetInitialCameras(*options.initial_cameras);
+    } else if (cameras) {
+      // Not usable as they are, still a good start for the adjustment
+      stitcher->SetInitialCameras(
+          PerImageCameras(*cameras, static_cast<int>(images.size())));
+    }
+    if (options.grid_cells != nullptr) {
+      stitcher->SetGridCells(*options.grid_cells);
+    }
+    status = (options.features != nullptr)
+                 ? stitcher->EstimateTransform(
+                       images, options.features->features,
+                       options.features->pairwise_matches)
+                 : stitcher->EstimateTransform(images);
+    if (IsSuccess(status) && options.on_cameras) {
+      options.on_cameras(Cameras{stitcher->Cameras(), stitcher->Component(),
+                                 user_options.wave_correction,
+                                 stitcher->WaveCorrectKind(), {}});
+    }
+  }
+
+  if (options.cameras_only) {
+    if (!IsSuccess(status)) {
+      return {status, {}, {}};
+    }
+    return {status,
+            {},
+            {},
+            Cameras{stitcher->Cameras(), stitcher->Component(),
+                    user_options.wave_correction, stitcher->WaveCorrectKind(),
+                    {}}};
+  }
+
+  if (options.on_session) {
+    stitcher->SetComposeCacheCallback(
+        [&](std::shared_ptr<const stitcher::ComposeCache> cache) {
+          options.on_session({user_options.projection,
+                              stitcher->WaveCorrectKind(), seam_finder,
+                              std::move(cache), nullptr,
+                              user_options.exposure_per_channel});
+        });
+  }
+
+  if (const auto& session = options.session;
+      session && session->projection == user_options.projection &&
+      session->wave_correct_kind == stitcher->WaveCorrectKind() &&
+      session->exposure_per_channel == user_options.exposure_per_channel) {
+    if (session->seam_finder == seam_finder) {
+      stitcher->SetComposeCache(session->compose);
+    }
+    // Even if the preview seams come from a faster seam finder
+    if (user_options.reuse_preview_seams && !options.preview) {
+      stitcher->SetSeamSource(session->compose);
+    }
+  }
+
+  cv::Mat pano;
+  cv::Mat display;
+  if (IsSuccess(status)) {
+    if (options.tiled_output != nullptr) {
+      status = stitcher->ComposePanoramaTiled(*options.tiled_output);
+    } else if (device_resident) {
+      cv::UMat device_pano;
+      status = stitcher->ComposePanorama(device_pano);
+      if (IsSuccess(status)) {
+        display = DisplayCopy(device_pano, options.display_longer_side);
+        pano = utils::opencv::Download(device_pano);
+      }
+    } else {
+      status = stitcher->ComposePanorama(pano);
+    }
   }
 
   if (!IsSuccess(status)) {
     return {status, {}, {}};
   }
 
-  cv::Mat mask;
-  if (options.return_pano_mask) {
-    stitcher->ResultMask().copyTo(mask);
+  // Encoded straight from the blender output, without a dense copy
+  RleMask mask;
+  if (options.return_pano_mask && options.tiled_output == nullptr) {
+    const cv::UMat result_mask = stitcher->ResultMask();
+    utils::memory::CountTransfer(
+        utils::memory::Transfer::kDownload,
+        static_cast<std::int64_t>(result_mask.total()));
+    mask = RleMask(result_mask.getMat(cv::ACCESS_READ));
   }
 
   auto result_cameras = Cameras{
       stitcher->Cameras(), stitcher->Component(), user_options.wave_correction,
       stitcher->WaveCorrectKind(), stitcher->GetWarpHelper()};
-  return {status, pano, mask, std::move(result_cameras)};
+  auto session = std::make_shared<const StitchSession>(
+      StitchSession{user_options.projection, stitcher->WaveCorrectKind(),
+                    seam_finder, stitcher->GetComposeCache(), buffer_pool,
+                    user_options.exposure_per_channel});
+  return {status,
+          pano,
+          mask,
+          std::move(result_cameras),
+          std::move(session),
+          display};
 }
 
 int StitchTasksCount(int num_images, bool cameras_precomputed) {
@@ -327,28 +1145,109 @@ std::string ToString(stitcher::Status& status) {
       return "ERR_HOMOGRAPHY_EST_FAIL";
     case stitcher::Status::kErrCameraParamsAdjustFail:
       return "ERR_CAMERA_PARAMS_ADJUST_FAIL";
+    case stitcher::Status::kErrOutputFailed:
+      return "ERR_OUTPUT_FAILED";
+    case stitcher::Status::kErrMemoryBudget:
+      return "ERR_MEMORY_BUDGET";
     default:
       return "ERR_UNKNOWN";
   }
 }
 
-std::optional<utils::RectRRf> FindLargestCrop(const cv::Mat& mask) {
+std::optional<utils::RectRRf> FindLargestCrop(const RleMask& mask) {
   std::optional<utils::RectPPi> largest_rect = crop::FindLargestCrop(mask);
   if (!largest_rect) {
     return {};
   }
-  auto image_end = utils::Point2i{mask.cols, mask.rows};
+  auto image_end = utils::Point2i{mask.Cols(), mask.Rows()};
   return Rect(largest_rect->start / image_end, largest_rect->end / image_end);
 }
 
 cv::Mat Inpaint(const cv::Mat& pano, const cv::Mat& mask,
-                InpaintingOptions options) {
-  cv::Mat result;
+                InpaintingOptions options, utils::mt::Threadpool* threads) {
   int method = cv::INPAINT_TELEA;
   if (options.method == InpaintingMethod::kNavierStokes) {
     method = cv::INPAINT_NS;
   }
-  cv::inpaint(pano, mask, result, options.radius, method);
+
+  // The pixels to fill are usually thin slivers along the pano borders
+  const cv::Rect pano_rect({0, 0}, pano.size());
+  std::vector<cv::Rect> tiles;
+  for (int y = 0; y < pano.rows; y += kInpaintingTileSize) {
+    for (int x = 0; x < pano.cols; x += kInpaintingTileSize) {
+      const auto tile =
+          cv::Rect(x, y, kInpaintingTileSize, kInpaintingTileSize) & pano_rect;
+      if (cv::countNonZero(mask(tile)) > 0) {
+        tiles.push_back(tile);
+      }
+    }
+  }
+
+  cv::Mat result = pano.clone();
+  if (tiles.empty()) {
+    return result;
+  }
+
+  const int padding =
+      kInpaintingTilePadding + static_cast<int>(std::ceil(options.radius));
+  auto padded = [&pano_rect, padding](const cv::Rect& tile) {
+    return cv::Rect(tile.x - padding, tile.y - padding,
+                    tile.width + 2 * padding, tile.height + 2 * padding) &
+           pano_rect;
+  };
+  auto is_unknown = [&mask](const cv::Rect& rect) {
+    return cv::countNonZero(mask(rect)) == rect.area();
+  };
+
+  cv::Mat coarse;
+  double coarse_scale = 1.0;
+  if (std::any_of(tiles.begin(), tiles.end(), [&](const cv::Rect& tile) {
+        return is_unknown(padded(tile));
+      })) {
+    coarse_scale =
+        std::min(1.0, static_cast<double>(kInpaintingCoarseLongerSide) /
+                          std::max(pano.cols, pano.rows));
+    cv::Mat coarse_pano;
+    cv::Mat coarse_mask;
+    cv::resize(pano, coarse_pano, {}, coarse_scale, coarse_scale,
+               cv::INTER_AREA);
+    cv::resize(mask, coarse_mask, coarse_pano.size(), 0, 0, cv::INTER_AREA);
+    // Partially known pixels are filled as well
+    cv::inpaint(coarse_pano, coarse_mask > 0, coarse, options.radius, method);
+  }
+
+  auto inpaint_tile = [&](const cv::Rect& tile) {
+    const auto padded_tile = padded(tile);
+    cv::Mat filled;
+    if (is_unknown(padded_tile)) {
+      const cv::Matx23d coarse_to_tile = {coarse_scale, 0.0,
+                                          tile.x * coarse_scale, 0.0,
+                                          coarse_scale, tile.y * coarse_scale};
+      cv::warpAffine(coarse, filled, coarse_to_tile, tile.size(),
+                     cv::INTER_LINEAR | cv::WARP_INVERSE_MAP,
+                     cv::BORDER_REPLICATE);
+    } else {
+      cv::Mat inpainted;
+      cv::inpaint(pano(padded_tile), mask(padded_tile), inpainted,
+                  options.radius, method);
+      filled = inpainted(tile - padded_tile.tl());
+    }
+    filled.copyTo(result(tile), mask(tile));
+  };
+
+  if (threads == nullptr || threads->get_thread_count() <= 1) {
+    std::for_each(tiles.begin(), tiles.end(), inpaint_tile);
+    return result;
+  }
+
+  utils::mt::MultiFuture<void> tiles_future;
+  for (const auto& tile : tiles) {
+    tiles_future.push_back(
+        threads->submit([&inpaint_tile, &tile]() { inpaint_tile(tile); }));
+  }
+  // The tasks reference the locals, wait for all of them first
+  tiles_future.wait();
+  tiles_future.get();
   return result;
 }
 
@@ -368,4 +1267,89 @@ Cameras Rotate(const Cameras& cameras, const cv::Mat& rotation_matrix) {
   return rotated;
 }
 
+Cameras DownscaleCameras(const Cameras& cameras, double scale) {
+  Cameras downscaled = cameras;
+  const double work_scale = cameras.warp_helper.work_scale > 0.0
+                                ? cameras.warp_helper.work_scale
+                                : 1.0;
+  const double camera_scale = scale / work_scale;
+  for (auto& camera : downscaled.cameras) {
+    camera.focal *= camera_scale;
+    camera.ppx *= camera_scale;
+    camera.ppy *= camera_scale;
+  }
+  downscaled.warp_helper.work_scale = 1.0;
+  return downscaled;
+}
+
+std::vector<std::optional<cv::detail::CameraParams>> PerImageCameras(
+    const Cameras& cameras, int num_images) {
+  std::vector<std::optional<cv::detail::CameraParams>> result(num_images);
+  for (size_t i = 0; i < cameras.component.size(); ++i) {
+    if (const int img_idx = cameras.component[i]; img_idx < num_images) {
+      result[img_idx] = cameras.cameras[i];
+    }
+  }
+  return result;
+}
+
+std::vector<std::optional<cv::detail::CameraParams>> KeepCameras(
+    const std::vector<std::optional<cv::detail::CameraParams>>& cameras,
+    const std::vector<int>& old_ids, const std::vector<int>& new_ids) {
+  std::vector<std::optional<cv::detail::CameraParams>> result(new_ids.size());
+  bool any_kept = false;
+  for (size_t i = 0; i < new_ids.size(); ++i) {
+    auto iter = std::find(old_ids.begin(), old_ids.end(), new_ids[i]);
+    if (const auto old_idx = std::distance(old_ids.begin(), iter);
+        old_idx < static_cast<std::ptrdiff_t>(cameras.size())) {
+      result[i] = cameras[old_idx];
+      any_kept = any_kept || result[i].has_value();
+    }
+  }
+  return any_kept ? result
+                  : std::vector<std::optional<cv::detail::CameraParams>>{};
+}
+
+void WarmUp() {
+  if (!cv::ocl::useOpenCL()) {
+    return;
+  }
+
+  // Two overlapping crops of a smooth random texture, the cameras rotated by
+  // half of the field of view
+  const int size = kWarmUpImageSize;
+  cv::Mat texture(size, 2 * size, CV_8UC3);
+  cv::randu(texture, cv::Scalar::all(0), cv::Scalar::all(255));
+  cv::GaussianBlur(texture, texture, {0, 0}, 3.0);
+  const std::vector<cv::Mat> images = {
+      texture(cv::Rect{0, 0, size, size}).clone(),
+      texture(cv::Rect{size / 2, 0, size, size}).clone()};
+
+  std::vector<cv::detail::CameraParams> cameras(2);
+  for (int i = 0; i < 2; i++) {
+    auto& camera = cameras[i];
+    camera.focal = size;
+    camera.ppx = size / 2.0;
+    camera.ppy = size / 2.0;
+    const cv::Vec3d rotation = {0.0, std::atan(0.5) * i, 0.0};
+    cv::Rodrigues(rotation, camera.R);
+    camera.R.convertTo(camera.R, CV_32F);
+  }
+
+  const auto user_options = StitchUserOptions{
+      .wave_correction = WaveCorrectionType::kOff,
+      .blending_method = BlendingMethod::kOpenCV,
+  };
+  const auto synthetic_cameras = Cameras{
+      .cameras = cameras,
+      .component = {0, 1},
+      .wave_correction_user = user_options.wave_correction,
+      .wave_correction_auto = cv::detail::WAVE_CORRECT_HORIZ,
+  };
+  auto result = Stitch(images, synthetic_cameras, user_options, {});
+  if (!IsSuccess(result.status)) {
+    spdlog::warn("OpenCL warm-up failed: {}", ToString(result.status));
+  }
+}
+
 }  // namespace xpano::algorithm
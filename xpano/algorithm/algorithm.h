@@ -4,17 +4,26 @@
 
 #pragma once
 
+#include <functional>
+#include <memory>
 #include <optional>
 #include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <opencv2/core.hpp>
 #include <opencv2/stitching.hpp>
 
+#include "xpano/algorithm/buffer_pool.h"
 #include "xpano/algorithm/image.h"
 #include "xpano/algorithm/options.h"
 #include "xpano/algorithm/progress.h"
+#include "xpano/algorithm/rle_mask.h"
+#include "xpano/algorithm/spill_store.h"
 #include "xpano/algorithm/stitcher.h"
+#include "xpano/constants.h"
+#include "xpano/utils/disjoint_set.h"
 #include "xpano/utils/rect.h"
 #include "xpano/utils/threadpool.h"
 
@@ -28,6 +37,18 @@ struct Cameras {
   stitcher::WarpHelper warp_helper;
 };
 
+// Reusable parts of the last composition of a pano, recomposing with a
+// different blender or output skips the seam and exposure estimation
+struct StitchSession {
+  ProjectionOptions projection;
+  cv::detail::WaveCorrectKind wave_correct_kind;
+  SeamFinderType seam_finder;
+  std::shared_ptr<const stitcher::ComposeCache> compose;
+  std::shared_ptr<BufferPool> buffer_pool;
+  // The exposure gains of the compose cache are per channel
+  bool exposure_per_channel = false;
+};
+
 struct Pano {
   std::vector<int> ids;
   bool exported = false;
@@ -35,6 +56,39 @@ struct Pano {
   std::optional<utils::RectRRf> auto_crop;
   std::optional<Cameras> cameras;
   std::optional<Cameras> backup_cameras;
+  std::shared_ptr<const StitchSession> session;
+  // Cameras of the images kept after adding / removing images, indexed as
+  // ids, empty once the cameras of the edited pano are estimated
+  std::vector<std::optional<cv::detail::CameraParams>> initial_cameras;
+};
+
+// What MatchImages needs to redo its ratio test and inlier filter with
+// another match_conf, see Rematch
+struct MatchCandidates {
+  // Of the ratio test the inliers come from
+  float match_conf;
+  // The nearest neighbor of each descriptor, the second one by its distance
+  std::vector<cv::DMatch> nearest;
+  std::vector<float> second_distances;
+  // Of the homography, for the candidates which passed the ratio test
+  std::vector<uchar> inliers;
+  cv::Mat homography;
+};
+
+struct MatchOptions {
+  float match_conf = kDefaultMatchConf;
+  // The descriptors are compared with the metric of the feature type
+  FeatureType feature = FeatureType::kSift;
+  MatcherType matcher = MatcherType::kFlann;
+  HomographyMethod homography = HomographyMethod::kRansac;
+};
+
+// What ReleaseInliers keeps of a match, enough for RestoreInliers
+struct MatchSummary {
+  int num_inliers = 0;
+  // From img1 to img2, empty with less than 4 inliers
+  cv::Mat homography;
+  MatchOptions options;
 };
 
 struct Match {
@@ -42,29 +96,202 @@ struct Match {
   int id2;
   std::vector<cv::DMatch> matches;
   float avg_shift = 0.0f;
+  // From img1 to img2, estimated along with the inliers. Empty for the
+  // matches restored from projects, moved to the summary by ReleaseInliers.
+  cv::Mat homography;
+  // Kept by MatchImages with the kNN matchers, not saved in projects
+  std::shared_ptr<const MatchCandidates> candidates;
+  // Set once the matches and the candidates are released
+  std::optional<MatchSummary> summary;
 };
 
+// Also of the released matches
+int NumInliers(const Match& match);
+
+// Keeps only the summary of the match, the inlier matches and the candidates
+// make up most of the memory of large image sets
+void ReleaseInliers(Match* match, const Image& img1, const Image& img2,
+                    const MatchOptions& options);
+
+// The inliers of a released match found again by GuidedMatch with the kept
+// homography, other matches are returned as is
+Match RestoreInliers(const Match& match, const Image& img1,
+                     const Image& img2);
+
 Pano SinglePano(int size);
 
 Match MatchImages(int img1_id, int img2_id, const Image& img1,
-                  const Image& img2, float match_conf);
+                  const Image& img2, const MatchOptions& options);
+
+// The match with another match_conf in a fraction of the MatchImages time:
+// the kept candidates pass the ratio test again, the inliers are the kept
+// ones, or the ones fitting the kept homography for the candidates which
+// didn't pass the original ratio test. A match without candidates is
+// returned as is.
+Match Rematch(const Match& match, const Image& img1, const Image& img2,
+              float match_conf);
+
+// Coarse to fine, the homography from img1 to img2 of the match: the kept one
+// or estimated from the matches, empty with less than 4 matches
+cv::Mat MatchHomography(const Match& match, const Image& img1,
+                        const Image& img2);
+
+// CV_8U mask of the preview of img2 covered by img1 under the homography from
+// img1 to img2, see Image::DetectInRegion
+cv::Mat OverlapRegion(const Image& img1, const Image& img2,
+                      const cv::Mat& homography);
+
+// Matches the keypoints of img1 only to the keypoints of img2 within
+// kGuidedMatchRadius of where the homography from img1 to img2 predicts them.
+// Then the ratio test and the inliers of a new homography as in MatchImages.
+Match GuidedMatch(int img1_id, int img2_id, const Image& img1,
+                  const Image& img2, const cv::Mat& homography,
+                  const MatchOptions& options);
 
 std::vector<Pano> FindPanos(const std::vector<Match>& matches,
                             int match_threshold, float min_shift);
 
+// FindPanos while the pairs are still being matched, fed the matches in any
+// order. A pano is final once every pair touching its images is matched, no
+// later match can join another image to it. With the neighbor pairs of
+// sequential captures, that's soon after the matching moves past its last
+// image plus the search window.
+class PanoStream {
+ public:
+  PanoStream(int num_images, const std::vector<std::pair<int, int>>& pairs,
+             int match_threshold, float min_shift);
+
+  // The match of pairs[pair_id], returns the panos it made final, with their
+  // ids as in FindPanos
+  std::vector<Pano> Add(int pair_id, const Match& match);
+
+  // Ids of the pairs between the images of a final pano
+  [[nodiscard]] std::vector<int> PairsOf(const Pano& pano) const;
+
+ private:
+  // Only the ones over a single image, as in FindPanos
+  void Emit(int root, std::vector<Pano>* panos);
+
+  std::vector<std::pair<int, int>> pairs_;
+  int match_threshold_;
+  float min_shift_;
+  utils::DisjointSet connected_;
+  // Unmatched pairs touching the images, per component root
+  std::vector<int> pending_;
+  // Images of the component, per root
+  std::vector<std::vector<int>> members_;
+  std::vector<std::vector<int>> pairs_of_image_;
+};
+
+// The images connected by the matches so far, as in FindPanos. Decides which
+// pairs further apart in the input order are still worth matching: the ones
+// not connected yet, with an image without a strong match, i.e. one with at
+// least strong_threshold matches.
+class MatchConnectivity {
+ public:
+  MatchConnectivity(int match_threshold, float min_shift,
+                    int strong_threshold);
+
+  void Add(const Match& match);
+
+  [[nodiscard]] bool Needs(int id1, int id2);
+
+ private:
+  [[nodiscard]] bool Weak(int id) const;
+
+  int match_threshold_;
+  float min_shift_;
+  int strong_threshold_;
+  utils::DisjointSet connected_;
+  // Most matches of a pair passing min_shift, per image
+  std::unordered_map<int, int> best_;
+};
+
 struct StitchResult {
   stitcher::Status status;
   cv::Mat pano;
-  cv::Mat mask;
+  RleMask mask;
   Cameras cameras;
+  std::shared_ptr<const StitchSession> session;
+  // Downscaled on the device for the display with device_resident, empty
+  // otherwise or if the pano fits, see StitchOptions::display_longer_side
+  cv::Mat display;
 };
 
+// Features and matches of the loading pipeline in preview coordinates, the
+// stitcher rescales them instead of detecting and matching the features again
+struct StitchFeatures {
+  std::vector<cv::detail::ImageFeatures> features;
+  std::vector<cv::detail::MatchesInfo> pairwise_matches;
+};
+
+// Returns nothing if some of the images have no keypoints. The released
+// matches are restored, see RestoreInliers.
+std::optional<StitchFeatures> PrepareStitchFeatures(
+    const std::vector<int>& ids, const std::vector<Image>& images,
+    const std::vector<Match>& matches);
+
+// Pairs of the pano images matched by the stitcher, CV_8U num_images^2 mask:
+//  - The pairs with at least match_threshold matches, optionally expanded by
+//    one hop in the match graph.
+//  - Empty, i.e. match all pairs, if the pairs don't connect all the images.
+cv::Mat MatchingMask(const std::vector<int>& ids,
+                     const std::vector<Match>& matches, int match_threshold,
+                     bool expand_one_hop);
+
 struct StitchOptions {
   bool return_pano_mask = false;
   utils::mt::Threadpool* threads_for_multiblend = nullptr;
+  // Moves the images fed to multiblend to disk, see blenders::Multiblend
+  std::optional<SpillOptions> multiblend_spill;
+  // Warps the images concurrently, see Stitcher::SetComposeThreads
+  utils::mt::Threadpool* threads_for_compose = nullptr;
+  // Finds the features of the images concurrently, when they aren't reused,
+  // see Stitcher::SetFeatureThreads
+  utils::mt::Threadpool* threads_for_features = nullptr;
+  // Solves the independent graph cut pairs and measures the exposure
+  // overlaps concurrently
+  utils::mt::Threadpool* threads_for_seams = nullptr;
   ProgressMonitor* progress_monitor = nullptr;
+  // Used only when the cameras have to be estimated, see CanReuseCameras
+  const StitchFeatures* features = nullptr;
+  // Used when matching the features inside the stitcher, see MatchingMask
+  cv::Mat matching_mask;
+  // Streams the pano to the output instead of returning it, the result pano
+  // and mask are empty, see Stitcher::ComposePanoramaTiled
+  const stitcher::TiledOutput* tiled_output = nullptr;
+  // Used if the projection matches, the other inputs are checked by the
+  // stitcher, see Stitcher::SetComposeCache
+  std::shared_ptr<const StitchSession> session;
+  // Interactive preview, see SeamFinderType::kAuto
+  bool preview = false;
+  // Size of StitchResult::display, 0 for none
+  int display_longer_side = 0;
+  // The images are low resolution copies then, the full resolution images
+  // are loaded one by one during compositing, see Stitcher::SetFullResSource
+  const stitcher::FullResSource* full_res_source = nullptr;
+  // Starting point when the cameras have to be estimated, indexed as the
+  // images, see Stitcher::SetInitialCameras
+  const std::vector<std::optional<cv::detail::CameraParams>>* initial_cameras =
+      nullptr;
+  // Capture grid cells indexed as the images, the starting point when there
+  // are no initial cameras, see Stitcher::SetGridCells
+  const std::vector<cv::Point>* grid_cells = nullptr;
+  // Only the crop of the pano is composed and returned, not used with
+  // tiled_output, see Stitcher::SetComposeCrop
+  std::optional<utils::RectRRf> compose_crop;
+  // Called once the cameras are estimated and once the pano size, exposure
+  // gains and seams are, before compositing, e.g. to checkpoint them. Not
+  // called for reused cameras or a reused session.
+  std::function<void(const Cameras&)> on_cameras;
+  std::function<void(const StitchSession&)> on_session;
+  // Returns right after the cameras, without composing the pano
+  bool cameras_only = false;
 };
 
+bool CanReuseCameras(const std::optional<Cameras>& cameras,
+                     const StitchUserOptions& user_options);
+
 StitchResult Stitch(const std::vector<cv::Mat>& images,
                     const std::optional<Cameras>& cameras,
                     StitchUserOptions user_options, StitchOptions options);
@@ -73,11 +300,35 @@ int StitchTasksCount(int num_images, bool cameras_precomputed);
 
 std::string ToString(stitcher::Status& status);
 
-std::optional<utils::RectRRf> FindLargestCrop(const cv::Mat& mask);
+std::optional<utils::RectRRf> FindLargestCrop(const RleMask& mask);
 
+// Fills the non-zero pixels of the mask.
+//  - Only the tiles with pixels to fill are inpainted, padded with their
+//    neighbourhood, in parallel when threads are given.
+//  - Tiles without any known pixel around them are filled from a low
+//    resolution inpainting of the whole pano.
 cv::Mat Inpaint(const cv::Mat& pano, const cv::Mat& mask,
-                InpaintingOptions options);
+                InpaintingOptions options, utils::mt::Threadpool* threads);
 
 Cameras Rotate(const Cameras& cameras, const cv::Mat& rotation_matrix);
 
+// Cameras of the same images resized by the scale. The resized images have
+// to be below the registration resolution, they are registered as they are.
+Cameras DownscaleCameras(const Cameras& cameras, double scale);
+
+// Cameras per pano image, empty for the images outside of the component
+std::vector<std::optional<cv::detail::CameraParams>> PerImageCameras(
+    const Cameras& cameras, int num_images);
+
+// Cameras of the images present in both old_ids and new_ids, indexed as
+// new_ids
+std::vector<std::optional<cv::detail::CameraParams>> KeepCameras(
+    const std::vector<std::optional<cv::detail::CameraParams>>& cameras,
+    const std::vector<int>& old_ids, const std::vector<int>& new_ids);
+
+// Stitches two small synthetic images, so that OpenCV compiles the OpenCL
+// kernels of the compositing before the first real pano. Does nothing if
+// OpenCL isn't used, meant to run in the background at startup.
+void WarmUp();
+
 }  // namespace xpano::algorithm
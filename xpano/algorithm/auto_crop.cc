@@ -4,142 +4,185 @@
 #include "xpano/algorithm/auto_crop.h"
 
 #include <algorithm>
+#include <cstdint>
 #include <optional>
+#include <span>
+#include <tuple>
 #include <vector>
 
 #include <opencv2/core.hpp>
+#include <simde/x86/avx2.h>
 
-#include "xpano/constants.h"
+#include "xpano/algorithm/rle_mask.h"
 #include "xpano/utils/rect.h"
 #include "xpano/utils/vec.h"
 
 namespace xpano::algorithm::crop {
 
 namespace {
-struct Line {
-  int start;
-  int end;
-};
-
-bool IsLineValid(const Line& line) { return line.start < line.end; }
 
-int Length(const Line& line) { return line.end - line.start; }
+constexpr int kLanes = 8;
 
-bool IsSet(unsigned char value) { return value == kMaskValueOn; }
+struct Candidate {
+  std::int64_t area = 0;
+  utils::RectPPi rect = {};
+};
 
-std::optional<Line> FindLongestLineInColumn(cv::Mat column) {
-  std::optional<Line> current_line;
-  std::optional<Line> longest_line;
+// Total order, so that the result doesn't depend on the row blocks
+bool IsBetter(const Candidate& lhs, const Candidate& rhs) {
+  return std::make_tuple(lhs.area, -lhs.rect.end[1], -lhs.rect.start[0],
+                         -lhs.rect.start[1]) >
+         std::make_tuple(rhs.area, -rhs.rect.end[1], -rhs.rect.start[0],
+                         -rhs.rect.start[1]);
+}
 
-  if (IsSet(column.at<unsigned char>(0, 0))) {
-    current_line = Line{0, 1};
+// Number of set pixels directly above and including the row, per column
+void UpdateHeights(const unsigned char* row, int cols, int* heights) {
+  const auto set = simde_mm256_set1_epi32(kMaskValueOn);
+  const auto one = simde_mm256_set1_epi32(1);
+  int col = 0;
+  for (; col + kLanes <= cols; col += kLanes) {
+    auto values = simde_mm256_cvtepu8_epi32(
+        simde_mm_loadl_epi64(reinterpret_cast<const simde__m128i*>(row + col)));
+    auto* dst = reinterpret_cast<simde__m256i*>(heights + col);
+    auto incremented = simde_mm256_add_epi32(simde_mm256_loadu_si256(dst), one);
+    simde_mm256_storeu_si256(
+        dst, simde_mm256_and_si256(incremented,
+                                   simde_mm256_cmpeq_epi32(values, set)));
   }
+  for (; col < cols; col++) {
+    heights[col] = row[col] == kMaskValueOn ? heights[col] + 1 : 0;
+  }
+}
 
-  for (int i = 1; i < column.rows; i++) {
-    auto prev = IsSet(column.at<unsigned char>(i - 1, 0));
-    auto current = IsSet(column.at<unsigned char>(i, 0));
-
-    if (!prev && current) {
-      current_line = Line{i, i + 1};
-    }
-
-    if (prev && current) {
-      current_line->end = i + 1;
-    }
-
-    if (prev && !current) {
-      if (!longest_line || Length(*current_line) > Length(*longest_line)) {
-        longest_line = current_line;
-      }
-      current_line.reset();
-    }
+// Same for a run-length encoded row, the mask pixels aren't touched
+void UpdateHeights(std::span<const RleMask::Run> runs, int cols,
+                   int* heights) {
+  int col = 0;
+  for (const auto& run : runs) {
+    std::fill(heights + col, heights + run.start, 0);
+    std::for_each(heights + run.start, heights + run.end,
+                  [](int& height) { height++; });
+    col = run.end;
   }
+  std::fill(heights + col, heights + cols, 0);
+}
 
-  if (IsSet(column.at<unsigned char>(column.rows - 1, 0))) {
-    if (!longest_line || Length(*current_line) > Length(*longest_line)) {
-      longest_line = current_line;
+// Largest rectangle under the histogram of heights, with the bottom edge at
+// the row
+void FindLargestRect(const std::vector<int>& heights, int row,
+                     std::vector<int>* stack, Candidate* best) {
+  const int cols = static_cast<int>(heights.size());
+  stack->clear();
+  for (int col = 0; col <= cols; col++) {
+    const int height = col < cols ? heights[col] : 0;
+    while (!stack->empty() && heights[stack->back()] >= height) {
+      const int top_height = heights[stack->back()];
+      stack->pop_back();
+      const int left = stack->empty() ? 0 : stack->back() + 1;
+      const Candidate candidate = {
+          .area = static_cast<std::int64_t>(top_height) * (col - left),
+          .rect = {{left, row + 1 - top_height}, {col, row + 1}}};
+      if (candidate.area > 0 && IsBetter(candidate, *best)) {
+        *best = candidate;
+      }
     }
+    stack->push_back(col);
   }
-
-  return longest_line;
 }
 
-std::optional<utils::RectPPi> FindLargestCrop(const std::vector<Line>& lines,
-                                              const Line& invalid_line,
-                                              int seed) {
-  if (!IsLineValid(lines[seed])) {
+// Exact solution, https://stackoverflow.com/questions/2478447
+//  - Every row is the bottom edge of a histogram of the set pixels above it,
+//    the largest rectangle under a histogram is found with a stack.
+//  - Rows are split into blocks processed in parallel, the first pass finds
+//    the heights each block starts with.
+template <typename TMask>
+std::optional<utils::RectPPi> FindLargestCropImpl(const TMask& mask) {
+  if (mask.empty()) {
     return {};
   }
-  auto current_rect =
-      utils::RectPPi{{seed, lines[seed].start}, {seed + 1, lines[seed].end}};
-  auto largest_rect = current_rect;
-
-  if (lines.size() == 1) {
-    return largest_rect;
+  const int num_blocks = std::clamp(cv::getNumThreads(), 1, mask.rows);
+  auto block_start = [&mask, num_blocks](int block) {
+    return block * mask.rows / num_blocks;
+  };
+
+  // Heights at the last row of each block, counted from the block start
+  std::vector<std::vector<int>> block_heights(num_blocks,
+                                              std::vector<int>(mask.cols));
+  cv::parallel_for_(cv::Range(0, num_blocks), [&](const cv::Range& blocks) {
+    for (int block = blocks.start; block < blocks.end; block++) {
+      for (int row = block_start(block); row < block_start(block + 1); row++) {
+        UpdateHeights(mask.Row(row), mask.cols, block_heights[block].data());
+      }
+    }
+  });
+
+  // Heights at the row before each block
+  std::vector<std::vector<int>> start_heights(num_blocks,
+                                              std::vector<int>(mask.cols));
+  for (int block = 1; block < num_blocks; block++) {
+    const int rows = block_start(block) - block_start(block - 1);
+    for (int col = 0; col < mask.cols; col++) {
+      const int height = block_heights[block - 1][col];
+      start_heights[block][col] =
+          height == rows ? start_heights[block - 1][col] + rows : height;
+    }
   }
 
-  int left = seed - 1;
-  int right = seed + static_cast<int>(lines.size() % 2);
-  auto left_line = lines[left];
-  auto right_line = lines[right];
-
-  while (IsLineValid(left_line) || IsLineValid(right_line)) {
-    auto left_rect = utils::RectPPi{
-        {left, std::max(left_line.start, current_rect.start[1])},
-        {current_rect.end[0], std::min(left_line.end, current_rect.end[1])}};
-
-    auto right_rect = utils::RectPPi{
-        {current_rect.start[0],
-         std::max(right_line.start, current_rect.start[1])},
-        {right + 1, std::min(right_line.end, current_rect.end[1])}};
-
-    if (utils::Area(left_rect) > utils::Area(right_rect)) {
-      current_rect = left_rect;
-      left_line = (left == 0) ? invalid_line : lines[--left];
-    } else {
-      current_rect = right_rect;
-      right_line = (right == lines.size() - 1) ? invalid_line : lines[++right];
+  std::vector<Candidate> best(num_blocks);
+  cv::parallel_for_(cv::Range(0, num_blocks), [&](const cv::Range& blocks) {
+    std::vector<int> stack;
+    stack.reserve(mask.cols + 1);
+    for (int block = blocks.start; block < blocks.end; block++) {
+      auto& heights = start_heights[block];
+      for (int row = block_start(block); row < block_start(block + 1); row++) {
+        UpdateHeights(mask.Row(row), mask.cols, heights.data());
+        FindLargestRect(heights, row, &stack, &best[block]);
+      }
     }
+  });
 
-    if (utils::Area(current_rect) >= utils::Area(largest_rect)) {
-      largest_rect = current_rect;
-    }
+  auto largest = std::max_element(
+      best.begin(), best.end(), [](const Candidate& lhs, const Candidate& rhs) {
+        return IsBetter(rhs, lhs);
+      });
+  if (largest->area == 0) {
+    return {};
   }
-
-  return largest_rect;
+  return largest->rect;
 }
 
-}  // namespace
+// The dense and encoded masks behind the same interface
+struct DenseRows {
+  const cv::Mat& mask;
+  int rows;
+  int cols;
 
-// Approximage solution only.
-// Full solution would be https://stackoverflow.com/questions/2478447
-// This algorithm starts in multiple sampled locations and expands
-// the rectangles in the direction with the larger area.
-std::optional<utils::RectPPi> FindLargestCrop(const cv::Mat& mask) {
-  if (mask.empty()) {
-    return {};
-  }
-  const Line invalid_line = {mask.rows, 0};
-  std::vector<Line> lines(mask.cols);
-  for (int i = 0; i < mask.cols; i++) {
-    auto longest_line = FindLongestLineInColumn(mask.col(i));
-    lines[i] = longest_line.value_or(invalid_line);
+  [[nodiscard]] bool empty() const { return mask.empty(); }
+  [[nodiscard]] const unsigned char* Row(int row) const {
+    return mask.ptr<unsigned char>(row);
   }
+};
 
-  std::optional<utils::RectPPi> largest_rect;
-
-  const int num_samples = 1 + mask.cols / kAutoCropSamplingDistance;
-  for (int i = 0; i < num_samples; i++) {
-    const int start = (i + 1) * mask.cols / (num_samples + 1);
-    auto current_rect = FindLargestCrop(lines, invalid_line, start);
+struct EncodedRows {
+  const RleMask& mask;
+  int rows;
+  int cols;
 
-    if (current_rect && (!largest_rect || utils::Area(*current_rect) >=
-                                              utils::Area(*largest_rect))) {
-      largest_rect = current_rect;
-    }
+  [[nodiscard]] bool empty() const { return mask.Empty(); }
+  [[nodiscard]] std::span<const RleMask::Run> Row(int row) const {
+    return mask.Row(row);
   }
+};
+
+}  // namespace
+
+std::optional<utils::RectPPi> FindLargestCrop(const cv::Mat& mask) {
+  return FindLargestCropImpl(DenseRows{mask, mask.rows, mask.cols});
+}
 
-  return largest_rect;
+std::optional<utils::RectPPi> FindLargestCrop(const RleMask& mask) {
+  return FindLargestCropImpl(EncodedRows{mask, mask.Rows(), mask.Cols()});
 }
 
 }  // namespace xpano::algorithm::crop
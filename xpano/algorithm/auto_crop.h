@@ -7,6 +7,7 @@
 
 #include <opencv2/core.hpp>
 
+#include "xpano/algorithm/rle_mask.h"
 #include "xpano/utils/rect.h"
 
 namespace xpano::algorithm::crop {
@@ -14,5 +15,7 @@ namespace xpano::algorithm::crop {
 constexpr unsigned char kMaskValueOn = 0xFF;
 
 std::optional<utils::RectPPi> FindLargestCrop(const cv::Mat& mask);
+// Any set pixel of the run-length encoded mask counts as on
+std::optional<utils::RectPPi> FindLargestCrop(const RleMask& mask);
 
 }  // namespace xpano::algorithm::crop
@@ -0,0 +1,163 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/bf_matcher.h"
+
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <simde/x86/avx2.h>
+
+namespace xpano::algorithm::bf_matcher {
+
+namespace {
+
+// 32-bit lanes of a 256-bit register, bytes widened to 16 lanes of int16
+constexpr int kLanes32 = 8;
+constexpr int kBytesPerStep = 16;
+
+// simde maps these to AVX2 / NEON / SSE depending on the target
+float L2SqrFloat(const float* lhs, const float* rhs, int size) {
+  simde__m256 sum = simde_mm256_setzero_ps();
+  int i = 0;
+  for (; i + kLanes32 <= size; i += kLanes32) {
+    const simde__m256 diff = simde_mm256_sub_ps(simde_mm256_loadu_ps(lhs + i),
+                                                simde_mm256_loadu_ps(rhs + i));
+    sum = simde_mm256_add_ps(sum, simde_mm256_mul_ps(diff, diff));
+  }
+  std::array<float, kLanes32> lanes{};
+  simde_mm256_storeu_ps(lanes.data(), sum);
+  float result = std::accumulate(lanes.begin(), lanes.end(), 0.0f);
+  for (; i < size; i++) {
+    const float diff = lhs[i] - rhs[i];
+    result += diff * diff;
+  }
+  return result;
+}
+
+// Squares of byte differences fit into int16 pairs summed to int32
+float L2SqrByte(const std::uint8_t* lhs, const std::uint8_t* rhs, int size) {
+  simde__m256i sum = simde_mm256_setzero_si256();
+  int i = 0;
+  for (; i + kBytesPerStep <= size; i += kBytesPerStep) {
+    const simde__m256i lhs16 = simde_mm256_cvtepu8_epi16(
+        simde_mm_loadu_si128(reinterpret_cast<const simde__m128i*>(lhs + i)));
+    const simde__m256i rhs16 = simde_mm256_cvtepu8_epi16(
+        simde_mm_loadu_si128(reinterpret_cast<const simde__m128i*>(rhs + i)));
+    const simde__m256i diff = simde_mm256_sub_epi16(lhs16, rhs16);
+    sum = simde_mm256_add_epi32(sum, simde_mm256_madd_epi16(diff, diff));
+  }
+  std::array<std::int32_t, kLanes32> lanes{};
+  simde_mm256_storeu_si256(reinterpret_cast<simde__m256i*>(lanes.data()), sum);
+  std::int64_t result = std::accumulate(lanes.begin(), lanes.end(),
+                                        static_cast<std::int64_t>(0));
+  for (; i < size; i++) {
+    const int diff = static_cast<int>(lhs[i]) - static_cast<int>(rhs[i]);
+    result += diff * diff;
+  }
+  return static_cast<float>(result);
+}
+
+int Hamming(const std::uint8_t* lhs, const std::uint8_t* rhs, int size) {
+  int result = 0;
+  int i = 0;
+  for (; i + 8 <= size; i += 8) {
+    std::uint64_t lhs64 = 0;
+    std::uint64_t rhs64 = 0;
+    std::memcpy(&lhs64, lhs + i, sizeof(lhs64));
+    std::memcpy(&rhs64, rhs + i, sizeof(rhs64));
+    result += std::popcount(lhs64 ^ rhs64);
+  }
+  for (; i < size; i++) {
+    result += std::popcount(static_cast<std::uint8_t>(lhs[i] ^ rhs[i]));
+  }
+  return result;
+}
+
+struct Nearest {
+  float best = std::numeric_limits<float>::max();
+  float second = std::numeric_limits<float>::max();
+  int best_idx = -1;
+
+  void Update(float distance, int idx) {
+    if (distance < best) {
+      second = best;
+      best = distance;
+      best_idx = idx;
+    } else if (distance < second) {
+      second = distance;
+    }
+  }
+};
+
+template <typename TDistance>
+std::vector<cv::DMatch> Match(const cv::Mat& query, const cv::Mat& train,
+                              float max_ratio, TDistance distance,
+                              bool squared) {
+  std::vector<cv::DMatch> matches;
+  if (train.rows < 2 || query.cols != train.cols) {
+    return matches;
+  }
+  // Squared distances keep the order, the ratio is squared accordingly
+  const float ratio = squared ? max_ratio * max_ratio : max_ratio;
+  for (int query_idx = 0; query_idx < query.rows; query_idx++) {
+    Nearest nearest;
+    for (int train_idx = 0; train_idx < train.rows; train_idx++) {
+      nearest.Update(distance(query_idx, train_idx), train_idx);
+    }
+    if (nearest.best < ratio * nearest.second) {
+      matches.emplace_back(
+          query_idx, nearest.best_idx, 0,
+          squared ? std::sqrt(nearest.best) : nearest.best);
+    }
+  }
+  return matches;
+}
+
+}  // namespace
+
+std::vector<cv::DMatch> MatchL2(const cv::Mat& query, const cv::Mat& train,
+                                float max_ratio) {
+  CV_Assert(query.type() == train.type());
+  const int size = query.cols;
+  if (query.depth() == CV_8U) {
+    return Match(
+        query, train, max_ratio,
+        [&](int query_idx, int train_idx) {
+          return L2SqrByte(query.ptr<std::uint8_t>(query_idx),
+                           train.ptr<std::uint8_t>(train_idx), size);
+        },
+        true);
+  }
+  CV_Assert(query.depth() == CV_32F);
+  return Match(
+      query, train, max_ratio,
+      [&](int query_idx, int train_idx) {
+        return L2SqrFloat(query.ptr<float>(query_idx),
+                          train.ptr<float>(train_idx), size);
+      },
+      true);
+}
+
+std::vector<cv::DMatch> MatchHamming(const cv::Mat& query,
+                                     const cv::Mat& train, float max_ratio) {
+  CV_Assert(query.depth() == CV_8U && train.depth() == CV_8U);
+  const int size = query.cols;
+  return Match(
+      query, train, max_ratio,
+      [&](int query_idx, int train_idx) {
+        return static_cast<float>(Hamming(query.ptr<std::uint8_t>(query_idx),
+                                          train.ptr<std::uint8_t>(train_idx),
+                                          size));
+      },
+      false);
+}
+
+}  // namespace xpano::algorithm::bf_matcher
@@ -0,0 +1,25 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace xpano::algorithm::bf_matcher {
+
+// Exhaustive 2-NN search fused with the first / second ratio test.
+//  - Returns only the matches which pass the test, with
+//    best < max_ratio * second_best.
+//  - The per query candidate lists are never materialized.
+
+// Float or uint8 (compact SIFT) descriptors, both matrices of the same type
+std::vector<cv::DMatch> MatchL2(const cv::Mat& query, const cv::Mat& train,
+                                float max_ratio);
+
+// Binary descriptors (ORB, AKAZE)
+std::vector<cv::DMatch> MatchHamming(const cv::Mat& query,
+                                     const cv::Mat& train, float max_ratio);
+
+}  // namespace xpano::algorithm::bf_matcher
@@ -3,21 +3,39 @@
 
 #include "xpano/algorithm/blenders.h"
 
+#include <algorithm>
 #include <array>
+#include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <cstring>
+#include <limits>
+#include <memory>
 #include <stdexcept>
+#include <utility>
 #include <vector>
 
+#include <opencv2/core.hpp>
+#include <opencv2/core/ocl.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/stitching/detail/blenders.hpp>
+#include <simde/x86/ssse3.h>
+#include <spdlog/spdlog.h>
+
 #ifdef XPANO_WITH_MULTIBLEND
 #include <mb/image.h>
 #include <mb/multiblend.h>
 #endif
 
+#include "xpano/algorithm/spill_store.h"
+#include "xpano/utils/memory.h"
+
 namespace xpano::algorithm::blenders {
 
 namespace {
 constexpr int kChannelDepth = 8;
+constexpr double kBytesPerMb = 1024.0 * 1024.0;
 constexpr uint32_t kFlagBit = 0x80000000u;
 constexpr uint32_t kWithoutFlag = 0x7fffffffu;
 constexpr uint8_t kMaskOn = 0xffu;
@@ -33,17 +51,16 @@ void SafeMemset(uint8_t *ptr, uint8_t value, size_t num, const uint8_t *end) {
   std::memset(ptr, value, num);
 }
 
-// Convert from Multiblend's Flex format to OpenCV's UMat.
+// Convert from Multiblend's Flex format to an OpenCV mask, mask has to be
+// preallocated with the size of the flex.
 // Flex is a RLE format, leftmost bit is the mask flag, the rest is the length.
 template <typename TFlexType>
-cv::Mat ToMat(TFlexType &flex) {
-  auto mask = cv::Mat(flex.height_, flex.width_, CV_8U);
-
+void ToMask(TFlexType &flex, cv::Mat *mask) {
   flex.Start();
 
-  for (int y = 0; y < mask.rows; y++) {
-    auto *ptr = mask.ptr<uint8_t>(y);
-    auto *end = ptr + mask.cols;
+  for (int y = 0; y < mask->rows; y++) {
+    auto *ptr = mask->ptr<uint8_t>(y);
+    auto *end = ptr + mask->cols;
 
     while (ptr < end) {
       auto length_with_flag = flex.SafeReadForwards32();
@@ -57,63 +74,258 @@ cv::Mat ToMat(TFlexType &flex) {
       }
     }
   }
+}
 
-  return mask;
+// The interleaving kernels move 16 pixels per step with byte shuffles, simde
+// maps them to SSSE3 / NEON depending on the target
+constexpr int kPixelsPerStep = 16;
+// A shuffle index with the high bit set writes a zero
+constexpr std::int8_t kShuffleZero = -128;
+
+using ShuffleIndices = std::array<std::int8_t, kPixelsPerStep>;
+
+simde__m128i Load(const std::uint8_t *ptr) {
+  return simde_mm_loadu_si128(reinterpret_cast<const simde__m128i *>(ptr));
 }
 
-template <typename TChannelType>
-cv::UMat ToUMat(const std::array<TChannelType, 3> &mb_channels, int width,
-                int height) {
-  auto blue = cv::Mat(height, width, CV_8UC1, mb_channels[0].get());
-  auto green = cv::Mat(height, width, CV_8UC1, mb_channels[1].get());
-  auto red = cv::Mat(height, width, CV_8UC1, mb_channels[2].get());
+simde__m128i Load(const ShuffleIndices &indices) {
+  return simde_mm_loadu_si128(
+      reinterpret_cast<const simde__m128i *>(indices.data()));
+}
 
-  const std::vector<cv::UMat> channels{blue.getUMat(cv::ACCESS_READ),
-                                       green.getUMat(cv::ACCESS_READ),
-                                       red.getUMat(cv::ACCESS_READ)};
-  cv::UMat pano;
-  cv::merge(channels, pano);
-  return pano;
+void Store(std::uint8_t *ptr, simde__m128i value) {
+  simde_mm_storeu_si128(reinterpret_cast<simde__m128i *>(ptr), value);
 }
 
-std::vector<uint8_t> ToVector(const cv::Mat &img) {
-  CV_Assert(img.type() == CV_8UC4 || img.type() == CV_8UC3);
+// Planar -> BGR: byte i of the 16 byte chunk c of the output comes from the
+// plane (16 * c + i) % 3, one table per chunk and plane
+constexpr std::array<ShuffleIndices, 9> InterleaveIndices() {
+  std::array<ShuffleIndices, 9> indices{};
+  for (int chunk = 0; chunk < 3; chunk++) {
+    for (int plane = 0; plane < 3; plane++) {
+      for (int i = 0; i < kPixelsPerStep; i++) {
+        const int byte = chunk * kPixelsPerStep + i;
+        indices[chunk * 3 + plane][i] =
+            byte % 3 == plane ? static_cast<std::int8_t>(byte / 3)
+                              : kShuffleZero;
+      }
+    }
+  }
+  return indices;
+}
 
-  std::vector<uint8_t> result(img.total() * img.elemSize());
+void InterleaveRow(const std::array<const std::uint8_t *, 3> &planes,
+                   int width, std::uint8_t *dst) {
+  // The loads of the tables are hoisted out of the loop by the compiler
+  static constexpr auto kIndices = InterleaveIndices();
+  int x = 0;
+  for (; x + kPixelsPerStep <= width; x += kPixelsPerStep) {
+    const simde__m128i blue = Load(planes[0] + x);
+    const simde__m128i green = Load(planes[1] + x);
+    const simde__m128i red = Load(planes[2] + x);
+    for (int chunk = 0; chunk < 3; chunk++) {
+      const auto *indices = &kIndices[chunk * 3];
+      const simde__m128i blue_green =
+          simde_mm_or_si128(simde_mm_shuffle_epi8(blue, Load(indices[0])),
+                            simde_mm_shuffle_epi8(green, Load(indices[1])));
+      Store(dst + 3 * x + chunk * kPixelsPerStep,
+            simde_mm_or_si128(blue_green,
+                              simde_mm_shuffle_epi8(red, Load(indices[2]))));
+    }
+  }
+  for (; x < width; x++) {
+    dst[3 * x] = planes[0][x];
+    dst[3 * x + 1] = planes[1][x];
+    dst[3 * x + 2] = planes[2][x];
+  }
+}
 
-  if (img.isContinuous()) {
-    std::memcpy(result.data(), img.data, result.size());
-    return result;
+// BGR + mask -> BGRA: the 16 pixels of a step are written as 4 groups of 4,
+// each group shuffled from its own 16 byte load of the BGR row. The last load
+// starts 4 bytes early to stay within the 48 bytes of the step.
+constexpr std::array<int, 4> kBgrLoadOffsets = {0, 12, 24, 32};
+
+constexpr std::array<ShuffleIndices, 4> BgraColorIndices() {
+  std::array<ShuffleIndices, 4> indices{};
+  for (int group = 0; group < 4; group++) {
+    for (int i = 0; i < kPixelsPerStep; i++) {
+      const int pixel = group * 4 + i / 4;
+      const int channel = i % 4;
+      indices[group][i] =
+          channel < 3 ? static_cast<std::int8_t>(3 * pixel + channel -
+                                                 kBgrLoadOffsets[group])
+                      : kShuffleZero;
+    }
   }
+  return indices;
+}
 
-  uint8_t *result_data = result.data();
-  auto row_size = img.cols * img.elemSize();
-  for (int y = 0; y < img.rows; ++y, result_data += row_size) {
-    const auto *src_row = img.ptr<uint8_t>(y);
-    std::memcpy(result_data, src_row, row_size);
+constexpr std::array<ShuffleIndices, 4> BgraAlphaIndices() {
+  std::array<ShuffleIndices, 4> indices{};
+  for (int group = 0; group < 4; group++) {
+    for (int i = 0; i < kPixelsPerStep; i++) {
+      indices[group][i] = i % 4 == 3
+                              ? static_cast<std::int8_t>(group * 4 + i / 4)
+                              : kShuffleZero;
+    }
+  }
+  return indices;
+}
+
+void ToBgraRow(const std::uint8_t *src, const std::uint8_t *mask, int width,
+               std::uint8_t *dst) {
+  static constexpr auto kColorIndices = BgraColorIndices();
+  static constexpr auto kAlphaIndices = BgraAlphaIndices();
+  const simde__m128i zero = simde_mm_setzero_si128();
+
+  int x = 0;
+  for (; x + kPixelsPerStep <= width; x += kPixelsPerStep) {
+    // kMaskOn where the mask is nonzero
+    const simde__m128i alpha =
+        simde_mm_cmpeq_epi8(simde_mm_cmpeq_epi8(Load(mask + x), zero), zero);
+    const auto *bgr = src + 3 * x;
+    for (int group = 0; group < 4; group++) {
+      const simde__m128i color = simde_mm_shuffle_epi8(
+          Load(bgr + kBgrLoadOffsets[group]), Load(kColorIndices[group]));
+      Store(dst + 4 * x + group * kPixelsPerStep,
+            simde_mm_or_si128(color, simde_mm_shuffle_epi8(
+                                         alpha, Load(kAlphaIndices[group]))));
+    }
+  }
+  for (; x < width; x++) {
+    dst[4 * x] = src[3 * x];
+    dst[4 * x + 1] = src[3 * x + 1];
+    dst[4 * x + 2] = src[3 * x + 2];
+    dst[4 * x + 3] = (mask[x] != 0) ? kMaskOn : kMaskOff;
   }
-  return result;
 }
 
+// Interleaves the planar output straight into pano, parallel over the rows
+template <typename TChannelType>
+void ToPano(const std::array<TChannelType, 3> &mb_channels, int width,
+            int height, cv::UMat *pano) {
+  pano->create(height, width, CV_8UC3);
+  cv::Mat out = pano->getMat(cv::ACCESS_WRITE);
+  cv::parallel_for_(cv::Range(0, height), [&](const cv::Range &range) {
+    for (int y = range.start; y < range.end; ++y) {
+      const auto offset = static_cast<size_t>(y) * width;
+      auto plane = [&mb_channels, offset](int channel) {
+        return static_cast<const uint8_t *>(mb_channels[channel].get()) +
+               offset;
+      };
+      InterleaveRow({plane(0), plane(1), plane(2)}, width,
+                    out.ptr<uint8_t>(y));
+    }
+  });
+}
+
+// BGR + mask -> BGRA in a single pass, written directly into the buffer
+// handed over to multiblend. Multiblend only works with the mask as binary,
+// any nonzero mask value becomes opaque to prevent artifacts where the mask
+// is not 0 or 255.
 // NOLINTNEXTLINE(bugprone-easily-swappable-parameters)
-cv::UMat Merge(cv::InputArray input_img, cv::InputArray input_mask) {
-  std::vector<cv::UMat> channels;
-  cv::split(input_img.getUMat(), channels);
+std::vector<uint8_t> ToBgra(const cv::Mat &img, const cv::Mat &mask) {
+  CV_Assert(img.type() == CV_8UC3 && mask.type() == CV_8U &&
+            img.size() == mask.size());
+
+  std::vector<uint8_t> result(img.total() * 4);
+  const auto row_size = static_cast<size_t>(img.cols) * 4;
+  cv::parallel_for_(cv::Range(0, img.rows), [&](const cv::Range &range) {
+    for (int y = range.start; y < range.end; ++y) {
+      ToBgraRow(img.ptr<uint8_t>(y), mask.ptr<uint8_t>(y), img.cols,
+                result.data() + y * row_size);
+    }
+  });
+  return result;
+}
+
+constexpr int kMultiBandNumBands = 5;
+constexpr float kWeightEps = 1e-5f;
+
+int AlignUp(int value, int alignment) {
+  return value + (alignment - value % alignment) % alignment;
+}
+
+int AlignDown(int value, int alignment_bits) {
+  return (value >> alignment_bits) << alignment_bits;
+}
 
-  cv::UMat mask;
-  // Multiblend only works with the mask as binary, this conversion prevents
-  // artifacts where the mask is not 0 or 255.
-  cv::compare(input_mask, 0, mask, cv::CMP_NE);
-  channels.push_back(mask);
+// Same rounding as cv::detail::MultiBandBlender
+void AccumulateRow(const cv::Point3_<int16_t> *src, const float *weights,
+                   int width, cv::Point3_<int16_t> *dst, float *dst_weights) {
+  for (int x = 0; x < width; ++x) {
+    dst[x].x = static_cast<int16_t>(
+        dst[x].x + static_cast<int16_t>(src[x].x * weights[x]));
+    dst[x].y = static_cast<int16_t>(
+        dst[x].y + static_cast<int16_t>(src[x].y * weights[x]));
+    dst[x].z = static_cast<int16_t>(
+        dst[x].z + static_cast<int16_t>(src[x].z * weights[x]));
+    dst_weights[x] += weights[x];
+  }
+}
+
+// A CV_16SC3 level and its CV_32F weights
+std::int64_t LevelBytes(cv::Size size) {
+  return static_cast<std::int64_t>(size.area()) *
+         static_cast<std::int64_t>(3 * sizeof(int16_t) + sizeof(float));
+}
+
+// Maps the levels to the host, counted as transfers if they are on a device
+void AccumulateOnHost(const cv::UMat &src, const cv::UMat &weights,
+                      const cv::UMat &dst, const cv::UMat &dst_weights) {
+  utils::memory::CountTransfer(utils::memory::Transfer::kDownload,
+                               2 * LevelBytes(dst.size()));
+  utils::memory::CountTransfer(utils::memory::Transfer::kUpload,
+                               LevelBytes(dst.size()));
+  const cv::Mat src_host = src.getMat(cv::ACCESS_READ);
+  const cv::Mat weights_host = weights.getMat(cv::ACCESS_READ);
+  cv::Mat dst_host = dst.getMat(cv::ACCESS_RW);
+  cv::Mat dst_weights_host = dst_weights.getMat(cv::ACCESS_RW);
+  cv::parallel_for_(cv::Range(0, dst_host.rows), [&](const cv::Range &range) {
+    for (int y = range.start; y < range.end; ++y) {
+      AccumulateRow(src_host.ptr<cv::Point3_<int16_t>>(y),
+                    weights_host.ptr<float>(y), dst_host.cols,
+                    dst_host.ptr<cv::Point3_<int16_t>>(y),
+                    dst_weights_host.ptr<float>(y));
+    }
+  });
+}
 
-  cv::UMat input_with_alpha;
-  cv::merge(channels, input_with_alpha);
-  return input_with_alpha;
+// AccumulateRow with OpenCL kernels, the weighted level is rounded
+void AccumulateOnDevice(const cv::UMat &src, const cv::UMat &weights,
+                        cv::UMat dst, cv::UMat dst_weights) {
+  cv::UMat weights3;
+  cv::merge(std::vector<cv::UMat>(3, weights), weights3);
+  cv::UMat weighted;
+  cv::multiply(src, weights3, weighted, 1.0, CV_16S);
+  cv::add(dst, weighted, dst);
+  cv::add(dst_weights, weights, dst_weights);
+}
+
+// The OpenCV blenders need CV_16S input
+cv::UMat ToShort(cv::InputArray img, BufferPool *buffer_pool) {
+  cv::UMat img_s;
+  if (buffer_pool != nullptr) {
+    img_s = buffer_pool->Acquire(img.size(),
+                                 CV_MAKETYPE(CV_16S, img.channels()));
+  }
+  img.getUMat().convertTo(img_s, CV_16S);
+  return img_s;
 }
 
 }  // namespace
 
-void Multiblend::prepare(cv::Rect dst_roi) { dst_roi_ = dst_roi; }
+void Multiblend::prepare(cv::Rect dst_roi) {
+  dst_roi_ = dst_roi;
+#ifdef XPANO_WITH_MULTIBLEND
+  images_.clear();
+#endif
+  // Nothing is spilled without the options
+  spill_store_ = std::make_unique<SpillStore>(
+      spill_ ? *spill_
+             : SpillOptions{.threshold_bytes =
+                                std::numeric_limits<std::size_t>::max()});
+}
 
 // Note: better work with UMat whenever possible to get a speedup from OpenCL,
 // the inputs and outputs are already expected to be UMats in the Stitcher code.
@@ -123,16 +335,24 @@ void Multiblend::feed(cv::InputArray input_img, cv::InputArray input_mask,
   CV_Assert(input_img.type() == CV_8UC3);
   CV_Assert(input_mask.type() == CV_8U);
 
-  auto input_umat = Merge(input_img, input_mask);
-
-  images_.emplace_back(multiblend::io::InMemoryImage{
-      .tiff_width = input_umat.cols,
-      .tiff_height = input_umat.rows,
+  // getMat doesn't copy host memory, the store takes ownership of the BGRA
+  // buffer. Multiblend runs on the host, device images are downloaded.
+  if (input_img.isUMat()) {
+    utils::memory::CountTransfer(
+        utils::memory::Transfer::kDownload,
+        static_cast<std::int64_t>(input_img.total() * input_img.elemSize() +
+                                  input_mask.total() *
+                                      input_mask.elemSize()));
+  }
+  const cv::Mat img = input_img.getMat();
+  spill_store_->Put(ToBgra(img, input_mask.getMat()));
+  images_.push_back(multiblend::io::InMemoryImage{
+      .tiff_width = img.cols,
+      .tiff_height = img.rows,
       .bpp = kChannelDepth,
-      .spp = static_cast<uint16_t>(input_umat.channels()),
+      .spp = 4,
       .xpos_add = top_left.x,
-      .ypos_add = top_left.y,
-      .data = ToVector(input_umat.getMat(cv::ACCESS_READ))});
+      .ypos_add = top_left.y});
 #else
   throw(std::runtime_error("Multiblend support not compiled in"));
 #endif
@@ -142,14 +362,48 @@ void Multiblend::feed(cv::InputArray input_img, cv::InputArray input_mask,
 void Multiblend::blend(cv::InputOutputArray dst,
                        cv::InputOutputArray dst_mask) {
 #ifdef XPANO_WITH_MULTIBLEND
+  if (const auto spilled = spill_store_->SpilledBytes(); spilled > 0) {
+    spdlog::info("Reading back {:.0f} MB of spilled warped images",
+                 static_cast<double>(spilled) / kBytesPerMb);
+  }
+  // Checked between the read back images and around the blending, the
+  // levels within multiblend run to completion
+  auto cancelled = [this]() {
+    return progress_monitor_ != nullptr && progress_monitor_->IsCancelled();
+  };
+
+  std::vector<multiblend::io::Image> images;
+  images.reserve(images_.size());
+  for (int i = 0; i < static_cast<int>(images_.size()); i++) {
+    if (cancelled()) {
+      break;
+    }
+    images_[i].data = spill_store_->Take(i);
+    images.emplace_back(std::move(images_[i]));
+  }
+  images_.clear();
+  spill_store_.reset();
+  // The stitcher checks the cancellation after blending
+  if (cancelled()) {
+    return;
+  }
+
   auto result = multiblend::Multiblend(
-      images_,
+      images,
       {.output_type = multiblend::io::ImageType::MB_IN_MEMORY,
        .output_bpp = kChannelDepth},
       multiblend::mt::ThreadpoolPtr{threadpool_});
+  images.clear();
+  if (cancelled()) {
+    return;
+  }
 
-  dst_ = ToUMat(result.output_channels, result.width, result.height);
-  ToMat(result.full_mask).copyTo(dst_mask_);
+  ToPano(result.output_channels, result.width, result.height, &dst_);
+  dst_mask_.create(result.height, result.width, CV_8U);
+  {
+    cv::Mat mask = dst_mask_.getMat(cv::ACCESS_WRITE);
+    ToMask(result.full_mask, &mask);
+  }
 
   Blender::blend(dst, dst_mask);
 #else
@@ -157,19 +411,176 @@ void Multiblend::blend(cv::InputOutputArray dst,
 #endif
 }
 
+void MultiBandOpenCV::prepare(cv::Rect dst_roi) {
+  dst_roi_final_ = dst_roi;
+
+  // No more bands than the pano size allows
+  const double max_len = std::max(dst_roi.width, dst_roi.height);
+  num_bands_ = std::min(kMultiBandNumBands,
+                        static_cast<int>(std::ceil(std::log2(max_len))));
+
+  // Sizes divisible by 2^num_bands, the levels then scale exactly by 2
+  const int alignment = 1 << num_bands_;
+  dst_roi.width = AlignUp(dst_roi.width, alignment);
+  dst_roi.height = AlignUp(dst_roi.height, alignment);
+
+  Blender::prepare(dst_roi);
+
+  dst_pyr_laplace_.resize(num_bands_ + 1);
+  dst_pyr_laplace_[0] = dst_;
+  dst_band_weights_.resize(num_bands_ + 1);
+  dst_band_weights_[0].create(dst_roi.size(), CV_32F);
+  dst_band_weights_[0].setTo(0);
+  for (int i = 1; i <= num_bands_; ++i) {
+    const cv::Size size((dst_pyr_laplace_[i - 1].cols + 1) / 2,
+                        (dst_pyr_laplace_[i - 1].rows + 1) / 2);
+    dst_pyr_laplace_[i].create(size, CV_16SC3);
+    dst_pyr_laplace_[i].setTo(cv::Scalar::all(0));
+    dst_band_weights_[i].create(size, CV_32F);
+    dst_band_weights_[i].setTo(0);
+  }
+}
+
 // NOLINTNEXTLINE(bugprone-easily-swappable-parameters): OpenCV API
 void MultiBandOpenCV::feed(cv::InputArray img, cv::InputArray mask,
                            cv::Point top_left) {
-  cv::UMat img_s;
-  img.getUMat().convertTo(img_s, CV_16S);
-  cv::detail::MultiBandBlender::feed(img_s, mask, top_left);
+  CV_Assert(img.type() == CV_8UC3 || img.type() == CV_16SC3);
+  CV_Assert(mask.type() == CV_8U);
+  const cv::Size img_size = img.size();
+
+  // Keep only the image with a small border, aligned to 2^num_bands
+  const int alignment = 1 << num_bands_;
+  const int gap = 3 * alignment;
+  cv::Point tl_new(std::max(dst_roi_.x, top_left.x - gap),
+                   std::max(dst_roi_.y, top_left.y - gap));
+  cv::Point br_new(
+      std::min(dst_roi_.br().x, top_left.x + img_size.width + gap),
+      std::min(dst_roi_.br().y, top_left.y + img_size.height + gap));
+  tl_new.x = dst_roi_.x + AlignDown(tl_new.x - dst_roi_.x, num_bands_);
+  tl_new.y = dst_roi_.y + AlignDown(tl_new.y - dst_roi_.y, num_bands_);
+  br_new.x = tl_new.x + AlignUp(br_new.x - tl_new.x, alignment);
+  br_new.y = tl_new.y + AlignUp(br_new.y - tl_new.y, alignment);
+  const cv::Point overflow(std::max(br_new.x - dst_roi_.br().x, 0),
+                           std::max(br_new.y - dst_roi_.br().y, 0));
+  tl_new -= overflow;
+  br_new -= overflow;
+
+  const int top = top_left.y - tl_new.y;
+  const int left = top_left.x - tl_new.x;
+  const int bottom = br_new.y - top_left.y - img_size.height;
+  const int right = br_new.x - top_left.x - img_size.width;
+  const cv::Size bordered_size(br_new.x - tl_new.x, br_new.y - tl_new.y);
+
+  // The Laplacian pyramid is built straight from the 8-bit image, the
+  // levels are CV_16S
+  cv::UMat img_with_border = Acquire(bordered_size, img.type());
+  cv::copyMakeBorder(img, img_with_border, top, bottom, left, right,
+                     cv::BORDER_REFLECT);
+  std::vector<cv::UMat> src_pyr_laplace;
+  cv::detail::createLaplacePyr(img_with_border, num_bands_, src_pyr_laplace);
+  img_with_border.release();
+
+  cv::UMat weight_map = Acquire(img_size, CV_32F);
+  mask.getUMat().convertTo(weight_map, CV_32F, 1.0 / 255.0);
+  std::vector<cv::UMat> weight_pyr_gauss(num_bands_ + 1);
+  weight_pyr_gauss[0] = Acquire(bordered_size, CV_32F);
+  cv::copyMakeBorder(weight_map, weight_pyr_gauss[0], top, bottom, left,
+                     right, cv::BORDER_CONSTANT);
+  weight_map.release();
+  for (int i = 0; i < num_bands_; ++i) {
+    cv::pyrDown(weight_pyr_gauss[i], weight_pyr_gauss[i + 1]);
+  }
+
+  // Add the weighted levels to the pano pyramid
+  cv::Rect level_rect(tl_new - dst_roi_.tl(), bordered_size);
+  const bool on_device = on_device_ && cv::ocl::useOpenCL();
+  for (int i = 0; i <= num_bands_; ++i) {
+    const cv::UMat dst = dst_pyr_laplace_[i](level_rect);
+    const cv::UMat dst_weights = dst_band_weights_[i](level_rect);
+    if (on_device) {
+      AccumulateOnDevice(src_pyr_laplace[i], weight_pyr_gauss[i], dst,
+                         dst_weights);
+    } else {
+      AccumulateOnHost(src_pyr_laplace[i], weight_pyr_gauss[i], dst,
+                       dst_weights);
+    }
+    level_rect = cv::Rect(level_rect.x / 2, level_rect.y / 2,
+                          level_rect.br().x / 2 - level_rect.x / 2,
+                          level_rect.br().y / 2 - level_rect.y / 2);
+  }
 }
 
 // NOLINTNEXTLINE(bugprone-easily-swappable-parameters): OpenCV API
 void MultiBandOpenCV::blend(cv::InputOutputArray dst,
                             cv::InputOutputArray dst_mask) {
+  for (int i = 0; i <= num_bands_; ++i) {
+    cv::detail::normalizeUsingWeightMap(dst_band_weights_[i],
+                                        dst_pyr_laplace_[i]);
+  }
+
+  // Restore all but the base level in place
+  for (int i = num_bands_ - 1; i > 0; --i) {
+    cv::UMat upsampled;
+    cv::pyrUp(dst_pyr_laplace_[i + 1], upsampled, dst_pyr_laplace_[i].size());
+    cv::add(upsampled, dst_pyr_laplace_[i], dst_pyr_laplace_[i]);
+  }
+
+  const cv::Rect dst_rect(cv::Point(), dst_roi_final_.size());
+  cv::compare(dst_band_weights_[0](dst_rect), kWeightEps, dst_mask_,
+              cv::CMP_GT);
+
+  // The base level is restored straight to 8 bits, only under the mask
+  cv::UMat result(dst_rect.size(), CV_8UC3, cv::Scalar::all(0));
+  if (num_bands_ > 0) {
+    cv::UMat upsampled;
+    cv::pyrUp(dst_pyr_laplace_[1], upsampled, dst_pyr_laplace_[0].size());
+    cv::add(upsampled(dst_rect), dst_pyr_laplace_[0](dst_rect), result,
+            dst_mask_, CV_8U);
+  } else {
+    cv::UMat converted;
+    dst_pyr_laplace_[0](dst_rect).convertTo(converted, CV_8U);
+    converted.copyTo(result, dst_mask_);
+  }
+  dst_pyr_laplace_.clear();
+  dst_band_weights_.clear();
+  dst_.release();
+
+  dst.assign(result);
+  dst_mask.assign(dst_mask_);
+  dst_mask_.release();
+}
+
+cv::UMat MultiBandOpenCV::Acquire(cv::Size size, int type) const {
+  return buffer_pool_ != nullptr ? buffer_pool_->Acquire(size, type)
+                                 : cv::UMat(size, type);
+}
+
+// NOLINTNEXTLINE(bugprone-easily-swappable-parameters): OpenCV API
+void FeatherOpenCV::feed(cv::InputArray img, cv::InputArray mask,
+                         cv::Point top_left) {
+  const cv::UMat img_s = ToShort(img, buffer_pool_);
+  cv::detail::FeatherBlender::feed(img_s, mask, top_left);
+}
+
+// NOLINTNEXTLINE(bugprone-easily-swappable-parameters): OpenCV API
+void FeatherOpenCV::blend(cv::InputOutputArray dst,
+                          cv::InputOutputArray dst_mask) {
+  cv::UMat result;
+  cv::detail::FeatherBlender::blend(result, dst_mask);
+  result.convertTo(dst, CV_8U);
+}
+
+// NOLINTNEXTLINE(bugprone-easily-swappable-parameters): OpenCV API
+void SeamOnly::feed(cv::InputArray img, cv::InputArray mask,
+                    cv::Point top_left) {
+  const cv::UMat img_s = ToShort(img, buffer_pool_);
+  cv::detail::Blender::feed(img_s, mask, top_left);
+}
+
+// NOLINTNEXTLINE(bugprone-easily-swappable-parameters): OpenCV API
+void SeamOnly::blend(cv::InputOutputArray dst, cv::InputOutputArray dst_mask) {
   cv::UMat result;
-  cv::detail::MultiBandBlender::blend(result, dst_mask);
+  cv::detail::Blender::blend(result, dst_mask);
   result.convertTo(dst, CV_8U);
 }
 
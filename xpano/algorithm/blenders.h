@@ -1,6 +1,11 @@
 // SPDX-FileCopyrightText: 2023 Tomas Krupka
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <utility>
 #include <vector>
 
 #ifdef XPANO_WITH_MULTIBLEND
@@ -10,6 +15,9 @@
 #include <opencv2/core.hpp>
 #include <opencv2/stitching.hpp>
 
+#include "xpano/algorithm/buffer_pool.h"
+#include "xpano/algorithm/progress.h"
+#include "xpano/algorithm/spill_store.h"
 #include "xpano/utils/threadpool.h"
 
 namespace xpano::algorithm::blenders {
@@ -22,10 +30,21 @@ constexpr bool MultiblendEnabled() {
 #endif
 }
 
+// The blending runs on the calling thread with the subtasks on the threadpool.
+// With progress_monitor set, blend()
+// returns without a result once cancelled, checked between the images read
+// back for multiblend and before and after the blending itself.
+// With spill set, the fed images over its threshold wait for blend() in
+// scratch files instead of memory. Multiblend needs all of them in memory, they
+// are read back when blending starts.
 class Multiblend : public cv::detail::Blender {
  public:
-  explicit Multiblend(utils::mt::Threadpool* threadpool)
-      : threadpool_(threadpool) {}
+  explicit Multiblend(utils::mt::Threadpool* threadpool,
+                      ProgressMonitor* progress_monitor = nullptr,
+                      std::optional<SpillOptions> spill = {})
+      : threadpool_(threadpool),
+        progress_monitor_(progress_monitor),
+        spill_(std::move(spill)) {}
   void prepare(cv::Rect dst_roi) override;
   void feed(cv::InputArray img, cv::InputArray mask,
             cv::Point top_left) override;
@@ -33,20 +52,72 @@ class Multiblend : public cv::detail::Blender {
 
  private:
 #ifdef XPANO_WITH_MULTIBLEND
-  std::vector<multiblend::io::Image> images_;
+  // Without the pixels, those are in spill_store_ under the same index
+  std::vector<multiblend::io::InMemoryImage> images_;
 #endif
   utils::mt::Threadpool* threadpool_;
+  ProgressMonitor* progress_monitor_;
+  std::optional<SpillOptions> spill_;
+  std::unique_ptr<SpillStore> spill_store_;
+};
+
+// Same algorithm as cv::detail::MultiBandBlender with 5 bands and float
+// weights, without the full size conversions around it: the pyramids are
+// built straight from the CV_8UC3 input and the base level is restored
+// directly to the CV_8UC3 output. The per image temporaries come from
+// buffer_pool if set.
+//
+// on_device accumulates the levels on the OpenCL device instead of mapping
+// them to the host. The weighted levels are rounded instead of truncated, the
+// bands may differ by 1 from the host path.
+class MultiBandOpenCV : public cv::detail::Blender {
+ public:
+  explicit MultiBandOpenCV(BufferPool* buffer_pool = nullptr,
+                           bool on_device = false)
+      : buffer_pool_(buffer_pool), on_device_(on_device) {}
+
+  void prepare(cv::Rect dst_roi) override;
+  void feed(cv::InputArray img, cv::InputArray mask,
+            cv::Point top_left) override;
+  void blend(cv::InputOutputArray dst, cv::InputOutputArray dst_mask) override;
+
+ private:
+  [[nodiscard]] cv::UMat Acquire(cv::Size size, int type) const;
+
+  BufferPool* buffer_pool_;
+  bool on_device_;
+  int num_bands_ = 0;
+  cv::Rect dst_roi_final_;
+  std::vector<cv::UMat> dst_pyr_laplace_;
+  std::vector<cv::UMat> dst_band_weights_;
+};
+
+// Single pass weighted average, no pyramids, meant for quick previews
+class FeatherOpenCV : public cv::detail::FeatherBlender {
+ public:
+  explicit FeatherOpenCV(BufferPool* buffer_pool = nullptr)
+      : buffer_pool_(buffer_pool) {}
+
+  void feed(cv::InputArray img, cv::InputArray mask,
+            cv::Point top_left) override;
+  void blend(cv::InputOutputArray dst, cv::InputOutputArray dst_mask) override;
+
+ private:
+  BufferPool* buffer_pool_;
 };
 
-class MultiBandOpenCV : public cv::detail::MultiBandBlender {
+// No blending, each pixel comes from the image owning it after seam finding
+class SeamOnly : public cv::detail::Blender {
  public:
-  using cv::detail::MultiBandBlender::MultiBandBlender;
+  explicit SeamOnly(BufferPool* buffer_pool = nullptr)
+      : buffer_pool_(buffer_pool) {}
 
   void feed(cv::InputArray img, cv::InputArray mask,
             cv::Point top_left) override;
   void blend(cv::InputOutputArray dst, cv::InputOutputArray dst_mask) override;
 
  private:
+  BufferPool* buffer_pool_;
 };
 
 }  // namespace xpano::algorithm::blenders
@@ -0,0 +1,83 @@
+// SPDX-FileCopyrightText: 2024 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/buffer_pool.h"
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <iterator>
+#include <mutex>
+
+#include <opencv2/core.hpp>
+
+namespace xpano::algorithm {
+
+namespace {
+
+constexpr size_t kMinCapacity = 4096;
+
+size_t BufferBytes(const cv::UMat& storage) {
+  return storage.total() * storage.elemSize();
+}
+
+}  // namespace
+
+bool BufferPool::IsFree(const Buffer& buffer) {
+  // Only the pool's own header references the data
+  return buffer.storage.u->refcount == 1;
+}
+
+cv::UMat BufferPool::Acquire(cv::Size size, int type) {
+  const auto elements = static_cast<size_t>(size.area());
+  if (elements == 0) {
+    return cv::UMat(size, type);
+  }
+  const size_t capacity = std::bit_ceil(std::max(elements, kMinCapacity));
+
+  const std::lock_guard lock(mutex_);
+  auto buffer = std::find_if(
+      buffers_.begin(), buffers_.end(), [&](const Buffer& candidate) {
+        return candidate.type == type && candidate.capacity == capacity &&
+               IsFree(candidate);
+      });
+  if (buffer != buffers_.end()) {
+    stats_.reuses++;
+  } else {
+    buffers_.push_back({cv::UMat(1, static_cast<int>(capacity), type), type,
+                        capacity});
+    buffer = std::prev(buffers_.end());
+    stats_.allocations++;
+    stats_.bytes += BufferBytes(buffer->storage);
+  }
+  return buffer->storage.colRange(0, static_cast<int>(elements))
+      .reshape(0, size.height);
+}
+
+void BufferPool::Trim(size_t max_free_bytes) {
+  const std::lock_guard lock(mutex_);
+  std::sort(buffers_.begin(), buffers_.end(),
+            [](const Buffer& lhs, const Buffer& rhs) {
+              return BufferBytes(lhs.storage) < BufferBytes(rhs.storage);
+            });
+  size_t free_bytes = 0;
+  std::erase_if(buffers_, [&](const Buffer& buffer) {
+    if (!IsFree(buffer)) {
+      return false;
+    }
+    const size_t bytes = BufferBytes(buffer.storage);
+    if (free_bytes + bytes <= max_free_bytes) {
+      free_bytes += bytes;
+      return false;
+    }
+    stats_.bytes -= bytes;
+    return true;
+  });
+}
+
+BufferPool::Stats BufferPool::GetStats() const {
+  const std::lock_guard lock(mutex_);
+  return stats_;
+}
+
+}  // namespace xpano::algorithm
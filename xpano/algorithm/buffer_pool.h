@@ -0,0 +1,50 @@
+// SPDX-FileCopyrightText: 2024 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace xpano::algorithm {
+
+// Reusable UMat allocations for the per image buffers of the compositing.
+//  - Buffers are bucketed by type and a power of two capacity, the returned
+//    UMat is a view into a buffer of the bucket.
+//  - A buffer is free again once nothing references it, no explicit release.
+//  - Thread safe, the images are warped concurrently.
+class BufferPool {
+ public:
+  struct Stats {
+    std::int64_t allocations = 0;
+    std::int64_t reuses = 0;
+    size_t bytes = 0;  // held by the pool, free or not
+  };
+
+  // Continuous UMat of the given size and type, the contents are undefined
+  [[nodiscard]] cv::UMat Acquire(cv::Size size, int type);
+
+  // Releases the free buffers exceeding max_free_bytes, the largest first
+  void Trim(size_t max_free_bytes);
+
+  [[nodiscard]] Stats GetStats() const;
+
+ private:
+  struct Buffer {
+    cv::UMat storage;  // single row of capacity elements
+    int type;
+    size_t capacity;
+  };
+
+  [[nodiscard]] static bool IsFree(const Buffer& buffer);
+
+  mutable std::mutex mutex_;
+  std::vector<Buffer> buffers_;
+  Stats stats_;
+};
+
+}  // namespace xpano::algorithm
@@ -0,0 +1,484 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-License-Identifier: Apache-2.0
+//
+///////////////////////////////////////////////////////////////////////////////////////
+//
+//  IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+//
+//  By downloading, copying, installing or using the software you agree to this
+//  license. If you do not agree to this license, do not download, install, copy
+//  or use the software.
+//
+//
+//                          License Agreement
+//                For Open Source Computer Vision Library
+//
+// Copyright (C) 2000-2008, Intel Corporation, all rights reserved.
+// Copyright (C) 2009, Willow Garage Inc., all rights reserved.
+// Third party copyrights are property of their respective owners.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//   * Redistribution's of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistribution's in binary form must reproduce the above copyright
+//   notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   * The name of the copyright holders may not be used to endorse or promote
+//   products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is"
+// and any express or implied warranties, including, but not limited to, the
+// implied warranties of merchantability and fitness for a particular purpose
+// are disclaimed. In no event shall the Intel Corporation or contributors be
+// liable for any direct, indirect, incidental, special, exemplary, or
+// consequential damages (including, but not limited to, procurement of
+// substitute goods or services; loss of use, data, or profits; or business
+// interruption) however caused and on any theory of liability, whether in
+// contract, strict liability, or tort (including negligence or otherwise)
+// arising in any way out of the use of this software, even if advised of the
+// possibility of such damage.
+//
+
+#include "xpano/algorithm/bundle_adjusters.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#include <opencv2/calib3d.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/stitching.hpp>
+#include <spdlog/spdlog.h>
+
+namespace xpano::algorithm::bundle_adjusters {
+
+namespace {
+
+constexpr int kParamsPerCamera = 4;  // focal length + rotation vector
+constexpr int kErrorsPerMatch = 3;
+
+// Same central difference step as OpenCV
+constexpr double kDerivativeStep = 1e-4;
+
+constexpr double kInitialLambda = 1e-3;
+constexpr double kLambdaIncrease = 10.0;
+constexpr double kLambdaDecrease = 0.1;
+constexpr double kMaxLambda = 1e10;
+constexpr double kMinRelativeImprovement = 1e-10;
+
+constexpr int kMaxCgIterations = 200;
+constexpr double kCgTolerance = 1e-10;  // relative to the right hand side
+
+using Params = cv::Vec4d;
+using Block = cv::Matx44d;
+
+struct Pair {
+  int first;
+  int second;
+  std::vector<cv::Point2d> first_points;
+  std::vector<cv::Point2d> second_points;
+  cv::Point2d first_center;
+  cv::Point2d second_center;
+};
+
+// Contribution of a pair to the normal equations J^T J x = -J^T r
+struct PairSystem {
+  Block first_first;
+  Block second_second;
+  Block first_second;
+  Params first_gradient;
+  Params second_gradient;
+};
+
+struct NormalEquations {
+  std::vector<Block> diagonal;      // per camera
+  std::vector<Block> off_diagonal;  // per pair, first x second
+  std::vector<Params> gradient;     // per camera
+};
+
+// Rotation times the inverse of the intrinsics, maps pixels to rays
+cv::Matx33d RayMatrix(const Params& params, const cv::Point2d& center) {
+  cv::Matx33d rotation;
+  cv::Rodrigues(cv::Vec3d(params[1], params[2], params[3]), rotation);
+  const double focal = params[0];
+  const cv::Matx33d k_inv(1.0 / focal, 0.0, -center.x / focal, 0.0,
+                          1.0 / focal, -center.y / focal, 0.0, 0.0, 1.0);
+  return rotation * k_inv;
+}
+
+cv::Vec3d Ray(const cv::Matx33d& ray_matrix, const cv::Point2d& point) {
+  const cv::Vec3d ray = ray_matrix * cv::Vec3d(point.x, point.y, 1.0);
+  return ray / cv::norm(ray);
+}
+
+// 3 residuals per match, scaled by the focal lengths as in OpenCV
+void Residuals(const Pair& pair, const Params& first, const Params& second,
+               std::vector<double>* residuals) {
+  const cv::Matx33d first_matrix = RayMatrix(first, pair.first_center);
+  const cv::Matx33d second_matrix = RayMatrix(second, pair.second_center);
+  const double mult = std::sqrt(first[0] * second[0]);
+  residuals->resize(pair.first_points.size() * kErrorsPerMatch);
+  for (size_t i = 0; i < pair.first_points.size(); ++i) {
+    const cv::Vec3d diff = Ray(first_matrix, pair.first_points[i]) -
+                           Ray(second_matrix, pair.second_points[i]);
+    for (int k = 0; k < kErrorsPerMatch; ++k) {
+      (*residuals)[i * kErrorsPerMatch + k] = mult * diff[k];
+    }
+  }
+}
+
+double SquaredError(const Pair& pair, const std::vector<Params>& params) {
+  std::vector<double> residuals;
+  Residuals(pair, params[pair.first], params[pair.second], &residuals);
+  return std::inner_product(residuals.begin(), residuals.end(),
+                            residuals.begin(), 0.0);
+}
+
+double TotalError(const std::vector<Pair>& pairs,
+                  const std::vector<Params>& params) {
+  std::vector<double> errors(pairs.size());
+  cv::parallel_for_(cv::Range(0, static_cast<int>(pairs.size())),
+                    [&](const cv::Range& range) {
+                      for (int i = range.start; i < range.end; ++i) {
+                        errors[i] = SquaredError(pairs[i], params);
+                      }
+                    });
+  return std::accumulate(errors.begin(), errors.end(), 0.0);
+}
+
+double Dot(const std::vector<double>& lhs, const std::vector<double>& rhs) {
+  return std::inner_product(lhs.begin(), lhs.end(), rhs.begin(), 0.0);
+}
+
+// Central differences, the first 4 columns belong to the first camera
+PairSystem BuildPairSystem(const Pair& pair,
+                           const std::vector<Params>& params) {
+  std::vector<double> residuals;
+  Residuals(pair, params[pair.first], params[pair.second], &residuals);
+
+  std::array<std::vector<double>, 2 * kParamsPerCamera> columns;
+  std::vector<double> minus;
+  std::vector<double> plus;
+  for (int col = 0; col < 2 * kParamsPerCamera; ++col) {
+    Params first = params[pair.first];
+    Params second = params[pair.second];
+    Params& perturbed = (col < kParamsPerCamera) ? first : second;
+    const int param = col % kParamsPerCamera;
+    const double value = perturbed[param];
+    perturbed[param] = value - kDerivativeStep;
+    Residuals(pair, first, second, &minus);
+    perturbed[param] = value + kDerivativeStep;
+    Residuals(pair, first, second, &plus);
+
+    columns[col].resize(residuals.size());
+    for (size_t i = 0; i < residuals.size(); ++i) {
+      columns[col][i] = (plus[i] - minus[i]) / (2.0 * kDerivativeStep);
+    }
+  }
+
+  PairSystem system;
+  for (int row = 0; row < kParamsPerCamera; ++row) {
+    const int second_row = row + kParamsPerCamera;
+    for (int col = 0; col < kParamsPerCamera; ++col) {
+      const int second_col = col + kParamsPerCamera;
+      system.first_first(row, col) = Dot(columns[row], columns[col]);
+      system.second_second(row, col) =
+          Dot(columns[second_row], columns[second_col]);
+      system.first_second(row, col) = Dot(columns[row], columns[second_col]);
+    }
+    system.first_gradient[row] = Dot(columns[row], residuals);
+    system.second_gradient[row] = Dot(columns[second_row], residuals);
+  }
+  return system;
+}
+
+NormalEquations BuildNormalEquations(const std::vector<Pair>& pairs,
+                                     const std::vector<Params>& params) {
+  std::vector<PairSystem> pair_systems(pairs.size());
+  cv::parallel_for_(cv::Range(0, static_cast<int>(pairs.size())),
+                    [&](const cv::Range& range) {
+                      for (int i = range.start; i < range.end; ++i) {
+                        pair_systems[i] = BuildPairSystem(pairs[i], params);
+                      }
+                    });
+
+  NormalEquations equations{std::vector<Block>(params.size(), Block::zeros()),
+                            std::vector<Block>(pairs.size()),
+                            std::vector<Params>(params.size())};
+  for (size_t i = 0; i < pairs.size(); ++i) {
+    const auto& pair = pairs[i];
+    const auto& system = pair_systems[i];
+    equations.diagonal[pair.first] += system.first_first;
+    equations.diagonal[pair.second] += system.second_second;
+    equations.off_diagonal[i] = system.first_second;
+    equations.gradient[pair.first] += system.first_gradient;
+    equations.gradient[pair.second] += system.second_gradient;
+  }
+  return equations;
+}
+
+double Dot(const std::vector<Params>& lhs, const std::vector<Params>& rhs) {
+  double result = 0.0;
+  for (size_t i = 0; i < lhs.size(); ++i) {
+    result += lhs[i].dot(rhs[i]);
+  }
+  return result;
+}
+
+// Block sparse matrix of the normal equations with a damped diagonal
+class DampedSystem {
+ public:
+  DampedSystem(const NormalEquations& equations,
+               const std::vector<Pair>& pairs, double lambda)
+      : equations_(equations), pairs_(pairs) {
+    for (auto block : equations.diagonal) {
+      // Marquardt's scaling, the gauge freedom of the rotations is damped
+      // away too
+      for (int k = 0; k < kParamsPerCamera; ++k) {
+        block(k, k) *= 1.0 + lambda;
+      }
+      diagonal_.push_back(block);
+      preconditioner_.push_back(block.inv(cv::DECOMP_CHOLESKY));
+    }
+  }
+
+  void Multiply(const std::vector<Params>& x,
+                std::vector<Params>* result) const {
+    result->resize(x.size());
+    for (size_t i = 0; i < x.size(); ++i) {
+      (*result)[i] = diagonal_[i] * x[i];
+    }
+    for (size_t i = 0; i < pairs_.size(); ++i) {
+      const auto& block = equations_.off_diagonal[i];
+      (*result)[pairs_[i].first] += block * x[pairs_[i].second];
+      (*result)[pairs_[i].second] += block.t() * x[pairs_[i].first];
+    }
+  }
+
+  void Precondition(const std::vector<Params>& x,
+                    std::vector<Params>* result) const {
+    result->resize(x.size());
+    for (size_t i = 0; i < x.size(); ++i) {
+      (*result)[i] = preconditioner_[i] * x[i];
+    }
+  }
+
+ private:
+  const NormalEquations& equations_;
+  const std::vector<Pair>& pairs_;
+  std::vector<Block> diagonal_;
+  std::vector<Block> preconditioner_;
+};
+
+// Preconditioned conjugate gradients for system * x = rhs
+std::vector<Params> Solve(const DampedSystem& system,
+                          const std::vector<Params>& rhs) {
+  std::vector<Params> x(rhs.size(), Params::all(0.0));
+  std::vector<Params> residual = rhs;
+  std::vector<Params> preconditioned;
+  system.Precondition(residual, &preconditioned);
+  std::vector<Params> direction = preconditioned;
+  std::vector<Params> product;
+
+  const double tolerance = kCgTolerance * kCgTolerance * Dot(rhs, rhs);
+  double residual_dot = Dot(residual, preconditioned);
+  for (int iteration = 0; iteration < kMaxCgIterations; ++iteration) {
+    system.Multiply(direction, &product);
+    const double curvature = Dot(direction, product);
+    if (curvature <= 0.0) {
+      break;
+    }
+    const double alpha = residual_dot / curvature;
+    for (size_t i = 0; i < x.size(); ++i) {
+      x[i] += alpha * direction[i];
+      residual[i] -= alpha * product[i];
+    }
+    if (Dot(residual, residual) <= tolerance) {
+      break;
+    }
+    system.Precondition(residual, &preconditioned);
+    const double next_residual_dot = Dot(residual, preconditioned);
+    const double beta = next_residual_dot / residual_dot;
+    residual_dot = next_residual_dot;
+    for (size_t i = 0; i < x.size(); ++i) {
+      direction[i] = preconditioned[i] + beta * direction[i];
+    }
+  }
+  return x;
+}
+
+}  // namespace
+
+SparseRay::SparseRay()
+    : BundleAdjusterBase(kParamsPerCamera, kErrorsPerMatch) {}
+
+bool SparseRay::estimate(
+    const std::vector<cv::detail::ImageFeatures>& features,
+    const std::vector<cv::detail::MatchesInfo>& pairwise_matches,
+    std::vector<cv::detail::CameraParams>& cameras) {
+  num_images_ = static_cast<int>(features.size());
+  setUpInitialCameraParams(cameras);
+
+  // The inlier matches of the confident pairs, as in BundleAdjusterBase
+  std::vector<Pair> pairs;
+  total_num_matches_ = 0;
+  for (int i = 0; i < num_images_ - 1; ++i) {
+    for (int j = i + 1; j < num_images_; ++j) {
+      const auto& matches_info = pairwise_matches[i * num_images_ + j];
+      if (matches_info.confidence <= conf_thresh_) {
+        continue;
+      }
+      Pair pair{.first = i,
+                .second = j,
+                .first_center = {features[i].img_size.width * 0.5,
+                                 features[i].img_size.height * 0.5},
+                .second_center = {features[j].img_size.width * 0.5,
+                                  features[j].img_size.height * 0.5}};
+      for (size_t k = 0; k < matches_info.matches.size(); ++k) {
+        if (matches_info.inliers_mask[k] == 0) {
+          continue;
+        }
+        const auto& match = matches_info.matches[k];
+        pair.first_points.emplace_back(
+            features[i].keypoints[match.queryIdx].pt);
+        pair.second_points.emplace_back(
+            features[j].keypoints[match.trainIdx].pt);
+      }
+      total_num_matches_ += static_cast<int>(pair.first_points.size());
+      pairs.push_back(std::move(pair));
+    }
+  }
+
+  std::vector<Params> params(num_images_);
+  for (int i = 0; i < num_images_; ++i) {
+    for (int k = 0; k < kParamsPerCamera; ++k) {
+      params[i][k] = cam_params_.at<double>(i * kParamsPerCamera + k, 0);
+    }
+  }
+
+  double error = TotalError(pairs, params);
+  const double initial_error = error;
+  double lambda = kInitialLambda;
+  int iteration = 0;
+  for (; iteration < term_criteria_.maxCount && error > 0.0; ++iteration) {
+    const auto equations = BuildNormalEquations(pairs, params);
+    std::vector<Params> rhs(equations.gradient.size());
+    for (size_t i = 0; i < rhs.size(); ++i) {
+      rhs[i] = -equations.gradient[i];
+    }
+
+    // Raise the damping until the step decreases the error
+    bool improved = false;
+    double step_norm = 0.0;
+    double new_error = error;
+    while (!improved && lambda < kMaxLambda) {
+      const auto step = Solve(DampedSystem(equations, pairs, lambda), rhs);
+      std::vector<Params> candidate = params;
+      for (size_t i = 0; i < params.size(); ++i) {
+        candidate[i] += step[i];
+      }
+      new_error = TotalError(pairs, candidate);
+      if (std::isfinite(new_error) && new_error < error) {
+        improved = true;
+        step_norm = std::sqrt(Dot(step, step));
+        params = std::move(candidate);
+        lambda = std::max(lambda * kLambdaDecrease, 1e-12);
+      } else {
+        lambda *= kLambdaIncrease;
+      }
+    }
+    if (!improved) {
+      break;
+    }
+    const double improvement = error - new_error;
+    error = new_error;
+    if (improvement < kMinRelativeImprovement * error ||
+        step_norm < term_criteria_.epsilon) {
+      break;
+    }
+  }
+
+  const double num_errors =
+      std::max(1.0, static_cast<double>(total_num_matches_) * kErrorsPerMatch);
+  spdlog::info(
+      "Sparse bundle adjustment: {} iterations, RMS error {:.4f} -> {:.4f}",
+      iteration, std::sqrt(initial_error / num_errors),
+      std::sqrt(error / num_errors));
+
+  for (int i = 0; i < num_images_; ++i) {
+    for (int k = 0; k < kParamsPerCamera; ++k) {
+      if (!std::isfinite(params[i][k])) {
+        return false;
+      }
+      cam_params_.at<double>(i * kParamsPerCamera + k, 0) = params[i][k];
+    }
+  }
+  obtainRefinedCameraParams(cameras);
+
+  // Normalize motion to the center image, as in BundleAdjusterBase
+  cv::detail::Graph span_tree;
+  std::vector<int> span_tree_centers;
+  cv::detail::findMaxSpanningTree(num_images_, pairwise_matches, span_tree,
+                                  span_tree_centers);
+  const cv::Mat r_inv = cameras[span_tree_centers[0]].R.inv();
+  for (auto& camera : cameras) {
+    camera.R = r_inv * camera.R;
+  }
+  return true;
+}
+
+void SparseRay::setUpInitialCameraParams(
+    const std::vector<cv::detail::CameraParams>& cameras) {
+  cam_params_.create(num_images_ * kParamsPerCamera, 1, CV_64F);
+  for (int i = 0; i < num_images_; ++i) {
+    cam_params_.at<double>(i * kParamsPerCamera, 0) = cameras[i].focal;
+
+    // Closest rotation, the estimated R doesn't have to be orthonormal
+    cv::Mat rotation;
+    cameras[i].R.convertTo(rotation, CV_64F);
+    const cv::SVD svd(rotation, cv::SVD::FULL_UV);
+    rotation = svd.u * svd.vt;
+    if (cv::determinant(rotation) < 0) {
+      rotation *= -1;
+    }
+    cv::Vec3d rvec;
+    cv::Rodrigues(rotation, rvec);
+    for (int k = 0; k < 3; ++k) {
+      cam_params_.at<double>(i * kParamsPerCamera + 1 + k, 0) = rvec[k];
+    }
+  }
+}
+
+void SparseRay::obtainRefinedCameraParams(
+    std::vector<cv::detail::CameraParams>& cameras) const {
+  for (int i = 0; i < num_images_; ++i) {
+    cameras[i].focal = cam_params_.at<double>(i * kParamsPerCamera, 0);
+    const cv::Vec3d rvec(cam_params_.at<double>(i * kParamsPerCamera + 1, 0),
+                         cam_params_.at<double>(i * kParamsPerCamera + 2, 0),
+                         cam_params_.at<double>(i * kParamsPerCamera + 3, 0));
+    cv::Mat rotation;
+    cv::Rodrigues(rvec, rotation);
+    rotation.convertTo(cameras[i].R, CV_32F);
+  }
+}
+
+void SparseRay::calcError(cv::Mat& /*err*/) {
+  CV_Error(cv::Error::StsNotImplemented, "SparseRay has no dense error");
+}
+
+void SparseRay::calcJacobian(cv::Mat& /*jac*/) {
+  CV_Error(cv::Error::StsNotImplemented, "SparseRay has no dense Jacobian");
+}
+
+}  // namespace xpano::algorithm::bundle_adjusters
@@ -0,0 +1,87 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-License-Identifier: Apache-2.0
+//
+///////////////////////////////////////////////////////////////////////////////////////
+//
+//  IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+//
+//  By downloading, copying, installing or using the software you agree to this
+//  license. If you do not agree to this license, do not download, install, copy
+//  or use the software.
+//
+//
+//                          License Agreement
+//                For Open Source Computer Vision Library
+//
+// Copyright (C) 2000-2008, Intel Corporation, all rights reserved.
+// Copyright (C) 2009, Willow Garage Inc., all rights reserved.
+// Third party copyrights are property of their respective owners.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//   * Redistribution's of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistribution's in binary form must reproduce the above copyright
+//   notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   * The name of the copyright holders may not be used to endorse or promote
+//   products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is"
+// and any express or implied warranties, including, but not limited to, the
+// implied warranties of merchantability and fitness for a particular purpose
+// are disclaimed. In no event shall the Intel Corporation or contributors be
+// liable for any direct, indirect, incidental, special, exemplary, or
+// consequential damages (including, but not limited to, procurement of
+// substitute goods or services; loss of use, data, or profits; or business
+// interruption) however caused and on any theory of liability, whether in
+// contract, strict liability, or tort (including negligence or otherwise)
+// arising in any way out of the use of this software, even if advised of the
+// possibility of such damage.
+//
+
+#pragma once
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/stitching.hpp>
+
+namespace xpano::algorithm::bundle_adjusters {
+
+// Minimizes the same error as cv::detail::BundleAdjusterRay: the focal
+// length and rotation of every camera are refined so that the rays of the
+// matched keypoints coincide. The dense Levenberg-Marquardt of OpenCV is
+// replaced by one working on the block sparse normal equations:
+//  - Every matched pair of images adds a 4x4 block between its two cameras,
+//    the system is as sparse as the match graph.
+//  - The damped system is solved with block Jacobi preconditioned conjugate
+//    gradients, an iteration costs O(images + pairs + matches) instead of
+//    O(images^3).
+//  - The Jacobians of the pairs are computed concurrently.
+// The cameras passed in are the starting point, they can come from an
+// earlier adjustment.
+class SparseRay : public cv::detail::BundleAdjusterBase {
+ public:
+  SparseRay();
+
+ private:
+  bool estimate(const std::vector<cv::detail::ImageFeatures>& features,
+                const std::vector<cv::detail::MatchesInfo>& pairwise_matches,
+                std::vector<cv::detail::CameraParams>& cameras) override;
+  void setUpInitialCameraParams(
+      const std::vector<cv::detail::CameraParams>& cameras) override;
+  void obtainRefinedCameraParams(
+      std::vector<cv::detail::CameraParams>& cameras) const override;
+  // The dense error and Jacobian of the base class are not used
+  void calcError(cv::Mat& err) override;
+  void calcJacobian(cv::Mat& jac) override;
+};
+
+}  // namespace xpano::algorithm::bundle_adjusters
@@ -0,0 +1,81 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/capture.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numbers>
+#include <optional>
+#include <vector>
+
+#include "xpano/utils/exiv2.h"
+
+namespace xpano::algorithm {
+
+namespace {
+
+constexpr double kEarthRadius = 6371000.0;  // meters
+
+double Radians(double degrees) { return degrees * std::numbers::pi / 180.0; }
+
+}  // namespace
+
+// Haversine formula
+double GpsDistance(const utils::exiv2::GpsPosition& position1,
+                   const utils::exiv2::GpsPosition& position2) {
+  const double d_latitude = Radians(position2.latitude - position1.latitude);
+  const double d_longitude =
+      Radians(position2.longitude - position1.longitude);
+  const double sin_latitude = std::sin(d_latitude / 2);
+  const double sin_longitude = std::sin(d_longitude / 2);
+  const double hav = sin_latitude * sin_latitude +
+                     std::cos(Radians(position1.latitude)) *
+                         std::cos(Radians(position2.latitude)) *
+                         sin_longitude * sin_longitude;
+  return 2 * kEarthRadius * std::asin(std::sqrt(std::min(hav, 1.0)));
+}
+
+CaptureFilter::CaptureFilter(
+    const std::vector<utils::exiv2::CaptureInfo>& infos, int max_time_gap,
+    double max_distance)
+    : time_groups_(infos.size()),
+      positions_(infos.size()),
+      max_distance_(max_distance) {
+  std::vector<int> timed_ids;
+  for (int i = 0; i < static_cast<int>(infos.size()); i++) {
+    positions_[i] = infos[i].position;
+    if (infos[i].time) {
+      timed_ids.push_back(i);
+    }
+  }
+  std::stable_sort(timed_ids.begin(), timed_ids.end(),
+                   [&infos](int left, int right) {
+                     return *infos[left].time < *infos[right].time;
+                   });
+
+  std::optional<std::int64_t> previous_time;
+  for (const int img_id : timed_ids) {
+    const auto time = *infos[img_id].time;
+    if (!previous_time || time - *previous_time > max_time_gap) {
+      num_time_groups_++;
+    }
+    time_groups_[img_id] = num_time_groups_ - 1;
+    previous_time = time;
+  }
+}
+
+bool CaptureFilter::Compatible(int img1_id, int img2_id) const {
+  const auto& group1 = time_groups_[img1_id];
+  const auto& group2 = time_groups_[img2_id];
+  if (group1 && group2 && *group1 != *group2) {
+    return false;
+  }
+  const auto& position1 = positions_[img1_id];
+  const auto& position2 = positions_[img2_id];
+  return !position1 || !position2 ||
+         GpsDistance(*position1, *position2) <= max_distance_;
+}
+
+}  // namespace xpano::algorithm
@@ -0,0 +1,38 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <optional>
+#include <vector>
+
+#include "xpano/utils/exiv2.h"
+
+namespace xpano::algorithm {
+
+// Great-circle distance in meters
+double GpsDistance(const utils::exiv2::GpsPosition& position1,
+                   const utils::exiv2::GpsPosition& position2);
+
+// Decides which pairs of images can be part of the same pano before any
+// matching is done:
+//  - The images sorted by capture time are split where the time between two
+//    consecutive images is larger than max_time_gap (seconds).
+//  - Images taken more than max_distance (meters) apart are never paired.
+//  - Images without the metadata can be paired with any image.
+class CaptureFilter {
+ public:
+  CaptureFilter(const std::vector<utils::exiv2::CaptureInfo>& infos,
+                int max_time_gap, double max_distance);
+
+  [[nodiscard]] bool Compatible(int img1_id, int img2_id) const;
+  [[nodiscard]] int NumTimeGroups() const { return num_time_groups_; }
+
+ private:
+  std::vector<std::optional<int>> time_groups_;
+  std::vector<std::optional<utils::exiv2::GpsPosition>> positions_;
+  double max_distance_;
+  int num_time_groups_ = 0;
+};
+
+}  // namespace xpano::algorithm
@@ -0,0 +1,50 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/descriptor_index.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/flann.hpp>
+
+namespace xpano::algorithm {
+
+// Defaults of cv::FlannBasedMatcher
+DescriptorIndex::DescriptorIndex(cv::Mat descriptors)
+    : descriptors_(std::move(descriptors)),
+      index_(std::make_unique<cv::flann::Index>(
+          descriptors_, cv::flann::KDTreeIndexParams())) {}
+
+std::vector<std::vector<cv::DMatch>> DescriptorIndex::KnnMatch(
+    const cv::Mat& query, int k) const {
+  std::vector<std::vector<cv::DMatch>> matches(query.rows);
+  k = std::min(k, descriptors_.rows);
+  if (k <= 0) {
+    return matches;
+  }
+
+  cv::Mat indices;
+  cv::Mat dists;
+  // Search only reads the trees, the result buffers are per call
+  index_->knnSearch(query, indices, dists, k, cv::flann::SearchParams());
+
+  for (int i = 0; i < query.rows; i++) {
+    for (int j = 0; j < k; j++) {
+      const int train_idx = indices.at<int>(i, j);
+      if (train_idx < 0) {
+        continue;
+      }
+      // The kd-tree reports squared L2 distances
+      matches[i].emplace_back(i, train_idx, 0,
+                              std::sqrt(dists.at<float>(i, j)));
+    }
+  }
+  return matches;
+}
+
+}  // namespace xpano::algorithm
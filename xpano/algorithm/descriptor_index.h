@@ -0,0 +1,31 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/flann.hpp>
+
+namespace xpano::algorithm {
+
+// FLANN kd-tree over the float descriptors of a single image.
+//  - Built once after loading, instead of once per matched pair.
+//  - Immutable after construction, KnnMatch can be called concurrently.
+class DescriptorIndex {
+ public:
+  explicit DescriptorIndex(cv::Mat descriptors);
+
+  // Same results as cv::FlannBasedMatcher::knnMatch(query, descriptors, k)
+  [[nodiscard]] std::vector<std::vector<cv::DMatch>> KnnMatch(
+      const cv::Mat& query, int k) const;
+
+ private:
+  // FLANN doesn't copy the data, it has to outlive the index
+  cv::Mat descriptors_;
+  std::unique_ptr<cv::flann::Index> index_;
+};
+
+}  // namespace xpano::algorithm
@@ -0,0 +1,373 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/exposure_compensators.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "xpano/utils/parallel_for.h"
+#include "xpano/utils/threadpool.h"
+
+namespace xpano::algorithm::exposure_compensators {
+
+namespace {
+
+// Weights of the intensity error and of the gain prior, the same as in
+// cv::detail::GainCompensator (sigma_N = 10, sigma_g = 0.1)
+constexpr double kAlpha = 0.01;
+constexpr double kBeta = 100.0;
+
+constexpr int kMaxIterations = 1000;
+// Of the residual relative to the right hand side
+constexpr double kTolerance = 1e-10;
+
+struct Frame {
+  cv::Mat image;
+  cv::Mat mask;
+  uchar mask_value;
+  cv::Point corner;
+  // Same block layout as cv::detail::BlocksCompensator
+  cv::Size blocks;
+  cv::Size block_size;
+  int first_block;
+
+  [[nodiscard]] cv::Rect Rect() const { return {corner, image.size()}; }
+
+  // In pano coordinates
+  [[nodiscard]] cv::Rect BlockRect(int block_x, int block_y) const {
+    const cv::Rect block(block_x * block_size.width,
+                         block_y * block_size.height, block_size.width,
+                         block_size.height);
+    return (block & cv::Rect({0, 0}, image.size())) + corner;
+  }
+
+  [[nodiscard]] int BlockId(int block_x, int block_y) const {
+    return first_block + block_y * blocks.width + block_x;
+  }
+
+  // Blocks intersecting the rect in pano coordinates
+  [[nodiscard]] cv::Rect BlockRange(const cv::Rect& rect) const {
+    const cv::Point tl = rect.tl() - corner;
+    const cv::Point br = rect.br() - corner - cv::Point(1, 1);
+    const int x_begin = tl.x / block_size.width;
+    const int y_begin = tl.y / block_size.height;
+    return {x_begin, y_begin, br.x / block_size.width - x_begin + 1,
+            br.y / block_size.height - y_begin + 1};
+  }
+};
+
+// Intensity statistics of two blocks of different images over the pixels
+// valid in both, the cv::detail::GainCompensator inputs
+struct Overlap {
+  int first;
+  int second;
+  // At least 1, the same as in cv::detail::GainCompensator
+  int num_pixels;
+  cv::Vec3d first_mean;
+  cv::Vec3d second_mean;
+};
+
+double Intensity(const cv::Vec3b& pixel) {
+  return std::sqrt(static_cast<double>(pixel[0] * pixel[0] +
+                                       pixel[1] * pixel[1] +
+                                       pixel[2] * pixel[2]));
+}
+
+Overlap Measure(const Frame& first, int first_block, const Frame& second,
+                int second_block, const cv::Rect& roi, bool channel_wise) {
+  int num_pixels = 0;
+  cv::Vec3d first_sum;
+  cv::Vec3d second_sum;
+  for (int y = roi.y; y < roi.y + roi.height; ++y) {
+    const int first_x = roi.x - first.corner.x;
+    const int second_x = roi.x - second.corner.x;
+    const auto* first_pixels =
+        first.image.ptr<cv::Vec3b>(y - first.corner.y) + first_x;
+    const auto* second_pixels =
+        second.image.ptr<cv::Vec3b>(y - second.corner.y) + second_x;
+    const auto* first_mask =
+        first.mask.ptr<uchar>(y - first.corner.y) + first_x;
+    const auto* second_mask =
+        second.mask.ptr<uchar>(y - second.corner.y) + second_x;
+    for (int x = 0; x < roi.width; ++x) {
+      if (first_mask[x] != first.mask_value ||
+          second_mask[x] != second.mask_value) {
+        continue;
+      }
+      num_pixels++;
+      if (channel_wise) {
+        first_sum += cv::Vec3d(first_pixels[x]);
+        second_sum += cv::Vec3d(second_pixels[x]);
+      } else {
+        first_sum[0] += Intensity(first_pixels[x]);
+        second_sum[0] += Intensity(second_pixels[x]);
+      }
+    }
+  }
+  num_pixels = std::max(1, num_pixels);
+  return {first_block, second_block, num_pixels, first_sum / num_pixels,
+          second_sum / num_pixels};
+}
+
+// All pairs of overlapping blocks of the two images
+std::vector<Overlap> MeasurePair(const Frame& first, const Frame& second,
+                                 bool channel_wise) {
+  std::vector<Overlap> overlaps;
+  const cv::Rect roi = first.Rect() & second.Rect();
+  const cv::Rect first_range = first.BlockRange(roi);
+  for (int by1 = first_range.y; by1 < first_range.br().y; ++by1) {
+    for (int bx1 = first_range.x; bx1 < first_range.br().x; ++bx1) {
+      const cv::Rect first_rect = first.BlockRect(bx1, by1);
+      const cv::Rect second_range = second.BlockRange(first_rect & roi);
+      for (int by2 = second_range.y; by2 < second_range.br().y; ++by2) {
+        for (int bx2 = second_range.x; bx2 < second_range.br().x; ++bx2) {
+          const cv::Rect block_roi = first_rect & second.BlockRect(bx2, by2);
+          if (block_roi.empty()) {
+            continue;
+          }
+          overlaps.push_back(Measure(first, first.BlockId(bx1, by1), second,
+                                     second.BlockId(bx2, by2), block_roi,
+                                     channel_wise));
+        }
+      }
+    }
+  }
+  return overlaps;
+}
+
+// The cv::detail::GainCompensator normal equations, one row per block with
+// entries only for the overlapping blocks
+struct GainSystem {
+  std::vector<double> diagonal;
+  std::vector<double> rhs;
+  std::vector<std::vector<std::pair<int, double>>> off_diagonal;
+};
+
+GainSystem BuildSystem(const std::vector<int>& num_block_pixels,
+                       const std::vector<std::vector<Overlap>>& overlaps,
+                       int channel) {
+  const auto num_blocks = num_block_pixels.size();
+  GainSystem system{std::vector<double>(num_blocks),
+                    std::vector<double>(num_blocks),
+                    std::vector<std::vector<std::pair<int, double>>>(
+                        num_blocks)};
+  for (size_t i = 0; i < num_blocks; ++i) {
+    system.diagonal[i] = system.rhs[i] = kBeta * num_block_pixels[i];
+  }
+  for (const auto& pair_overlaps : overlaps) {
+    for (const auto& overlap : pair_overlaps) {
+      const double num_pixels = overlap.num_pixels;
+      const double first_mean = overlap.first_mean[channel];
+      const double second_mean = overlap.second_mean[channel];
+      system.rhs[overlap.first] += kBeta * num_pixels;
+      system.rhs[overlap.second] += kBeta * num_pixels;
+      system.diagonal[overlap.first] +=
+          kBeta * num_pixels +
+          2 * kAlpha * first_mean * first_mean * num_pixels;
+      system.diagonal[overlap.second] +=
+          kBeta * num_pixels +
+          2 * kAlpha * second_mean * second_mean * num_pixels;
+      const double coupling =
+          -2 * kAlpha * first_mean * second_mean * num_pixels;
+      system.off_diagonal[overlap.first].emplace_back(overlap.second, coupling);
+      system.off_diagonal[overlap.second].emplace_back(overlap.first, coupling);
+    }
+  }
+  return system;
+}
+
+double Dot(const std::vector<double>& lhs, const std::vector<double>& rhs) {
+  double result = 0.0;
+  for (size_t i = 0; i < lhs.size(); ++i) {
+    result += lhs[i] * rhs[i];
+  }
+  return result;
+}
+
+void Multiply(const GainSystem& system, const std::vector<double>& vector,
+              std::vector<double>* result) {
+  for (size_t i = 0; i < vector.size(); ++i) {
+    double value = system.diagonal[i] * vector[i];
+    for (const auto& [j, coefficient] : system.off_diagonal[i]) {
+      value += coefficient * vector[j];
+    }
+    (*result)[i] = value;
+  }
+}
+
+// Conjugate gradients with the Jacobi preconditioner, the system is
+// symmetric positive definite: the normal equations of the gain energy
+std::vector<double> Solve(const GainSystem& system) {
+  const auto size = system.rhs.size();
+  std::vector<double> gains(size, 1.0);
+  std::vector<double> residual(size);
+  std::vector<double> preconditioned(size);
+  std::vector<double> product(size);
+
+  Multiply(system, gains, &product);
+  for (size_t i = 0; i < size; ++i) {
+    residual[i] = system.rhs[i] - product[i];
+    preconditioned[i] = residual[i] / system.diagonal[i];
+  }
+  auto direction = preconditioned;
+  double residual_dot = Dot(residual, preconditioned);
+  const double tolerance =
+      kTolerance * kTolerance * Dot(system.rhs, system.rhs);
+
+  for (int iteration = 0;
+       iteration < kMaxIterations && Dot(residual, residual) > tolerance;
+       ++iteration) {
+    Multiply(system, direction, &product);
+    const double step = residual_dot / Dot(direction, product);
+    for (size_t i = 0; i < size; ++i) {
+      gains[i] += step * direction[i];
+      residual[i] -= step * product[i];
+      preconditioned[i] = residual[i] / system.diagonal[i];
+    }
+    const double next_residual_dot = Dot(residual, preconditioned);
+    const double beta = next_residual_dot / residual_dot;
+    residual_dot = next_residual_dot;
+    for (size_t i = 0; i < size; ++i) {
+      direction[i] = preconditioned[i] + beta * direction[i];
+    }
+  }
+  return gains;
+}
+
+}  // namespace
+
+void ParallelBlocksGain::feed(
+    const std::vector<cv::Point>& corners, const std::vector<cv::UMat>& images,
+    const std::vector<std::pair<cv::UMat, uchar>>& masks) {
+  if (!getUpdateGain() && !gain_maps_.empty()) {
+    return;
+  }
+
+  const int num_images = static_cast<int>(images.size());
+  const cv::Size max_block_size = getBlockSize();
+  std::vector<Frame> frames(num_images);
+  int num_blocks = 0;
+  for (int i = 0; i < num_images; ++i) {
+    CV_Assert(images[i].type() == CV_8UC3);
+    auto& frame = frames[i];
+    frame.image = images[i].getMat(cv::ACCESS_READ);
+    frame.mask = masks[i].first.getMat(cv::ACCESS_READ);
+    frame.mask_value = masks[i].second;
+    frame.corner = corners[i];
+    const cv::Size size = frame.image.size();
+    frame.blocks = {(size.width + max_block_size.width - 1) /
+                        max_block_size.width,
+                    (size.height + max_block_size.height - 1) /
+                        max_block_size.height};
+    frame.block_size = {
+        (size.width + frame.blocks.width - 1) / frame.blocks.width,
+        (size.height + frame.blocks.height - 1) / frame.blocks.height};
+    frame.first_block = num_blocks;
+    num_blocks += frame.blocks.area();
+  }
+
+  std::vector<int> num_block_pixels(num_blocks);
+  std::vector<std::pair<int, int>> pairs;
+  for (int i = 0; i < num_images; ++i) {
+    const auto& frame = frames[i];
+    for (int by = 0; by < frame.blocks.height; ++by) {
+      for (int bx = 0; bx < frame.blocks.width; ++bx) {
+        const cv::Mat valid =
+            frame.mask(frame.BlockRect(bx, by) - frame.corner) ==
+            frame.mask_value;
+        num_block_pixels[frame.BlockId(bx, by)] =
+            std::max(1, cv::countNonZero(valid));
+      }
+    }
+    for (int j = i + 1; j < num_images; ++j) {
+      if (!(frame.Rect() & frames[j].Rect()).empty()) {
+        pairs.emplace_back(i, j);
+      }
+    }
+  }
+
+  const int num_pairs = static_cast<int>(pairs.size());
+  std::vector<std::vector<Overlap>> overlaps(num_pairs);
+  const int num_helpers =
+      threadpool_ == nullptr
+          ? 0
+          : std::min(static_cast<int>(threadpool_->get_thread_count()),
+                     std::max(0, num_pairs - 1));
+  utils::mt::ParallelFor(threadpool_, num_pairs, num_helpers,
+                         [&](int task, int /*thread_num*/) {
+                           const auto [first, second] = pairs[task];
+                           overlaps[task] =
+                               MeasurePair(frames[first], frames[second],
+                                           channel_wise_);
+                         });
+
+  const int num_channels = channel_wise_ ? 3 : 1;
+  std::vector<std::vector<double>> gains(num_channels);
+  for (int channel = 0; channel < num_channels; ++channel) {
+    gains[channel] = Solve(BuildSystem(num_block_pixels, overlaps, channel));
+  }
+
+  cv::Mat_<float> kernel(1, 3);
+  kernel << 0.25f, 0.5f, 0.25f;
+  gain_maps_.resize(num_images);
+  for (int i = 0; i < num_images; ++i) {
+    const auto& frame = frames[i];
+    cv::Mat gain_map(frame.blocks, CV_32FC(num_channels));
+    for (int by = 0; by < frame.blocks.height; ++by) {
+      auto* row = gain_map.ptr<float>(by);
+      for (int bx = 0; bx < frame.blocks.width; ++bx) {
+        for (int channel = 0; channel < num_channels; ++channel) {
+          row[bx * num_channels + channel] = static_cast<float>(
+              gains[channel][frame.BlockId(bx, by)]);
+        }
+      }
+    }
+    for (int iteration = 0; iteration < getNrGainsFilteringIterations();
+         ++iteration) {
+      cv::Mat filtered;
+      cv::sepFilter2D(gain_map, filtered, CV_32F, kernel, kernel);
+      gain_map = filtered;
+    }
+    gain_map.copyTo(gain_maps_[i]);
+  }
+}
+
+void ParallelBlocksGain::apply(int index, cv::Point /*corner*/,
+                               cv::InputOutputArray image,
+                               cv::InputArray /*mask*/) {
+  CV_Assert(image.type() == CV_8UC3);
+  cv::UMat gain_map = gain_maps_.at(index);
+  if (gain_map.size() != image.size()) {
+    cv::UMat resized;
+    cv::resize(gain_map, resized, image.size(), 0, 0, cv::INTER_LINEAR);
+    gain_map = resized;
+  }
+  if (gain_map.channels() != 3) {
+    cv::UMat merged;
+    cv::merge(std::vector<cv::UMat>(3, gain_map), merged);
+    gain_map = merged;
+  }
+  cv::multiply(image, gain_map, image, 1, image.type());
+}
+
+void ParallelBlocksGain::getMatGains(std::vector<cv::Mat>& umv) {
+  umv.resize(gain_maps_.size());
+  for (size_t i = 0; i < gain_maps_.size(); ++i) {
+    gain_maps_[i].copyTo(umv[i]);
+  }
+}
+
+void ParallelBlocksGain::setMatGains(std::vector<cv::Mat>& umv) {
+  gain_maps_.resize(umv.size());
+  for (size_t i = 0; i < umv.size(); ++i) {
+    umv[i].copyTo(gain_maps_[i]);
+  }
+}
+
+}  // namespace xpano::algorithm::exposure_compensators
@@ -0,0 +1,55 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/stitching/detail/exposure_compensate.hpp>
+
+#include "xpano/utils/threadpool.h"
+
+namespace xpano::algorithm::exposure_compensators {
+
+// Same gains as cv::detail::BlocksGainCompensator, for panos of many images:
+//  - The overlap statistics of the blocks are computed per overlapping image
+//    pair on the pool, instead of for all pairs of blocks of the pano.
+//  - The gain system has a row per block with entries only for the
+//    overlapping blocks. It's solved by preconditioned conjugate gradients
+//    instead of the dense LU decomposition.
+// The gain maps have the format of the BlocksCompensator ones, e.g. a
+// BlocksGainCompensator restored with setMatGains applies the same gains.
+//
+// channel_wise solves the gains of the B, G and R channels separately, like
+// cv::detail::BlocksChannelsCompensator, for shoots with a varying white
+// balance.
+class ParallelBlocksGain : public cv::detail::BlocksCompensator {
+ public:
+  explicit ParallelBlocksGain(utils::mt::Threadpool* threadpool,
+                              bool channel_wise = false, int bl_width = 32,
+                              int bl_height = 32)
+      : BlocksCompensator(bl_width, bl_height),
+        threadpool_(threadpool),
+        channel_wise_(channel_wise) {}
+
+  using ExposureCompensator::feed;
+  void feed(const std::vector<cv::Point>& corners,
+            const std::vector<cv::UMat>& images,
+            const std::vector<std::pair<cv::UMat, uchar>>& masks) override;
+  void apply(int index, cv::Point corner, cv::InputOutputArray image,
+             cv::InputArray mask) override;
+  void getMatGains(std::vector<cv::Mat>& umv) override;
+  void setMatGains(std::vector<cv::Mat>& umv) override;
+
+  [[nodiscard]] bool IsChannelWise() const { return channel_wise_; }
+
+ private:
+  utils::mt::Threadpool* threadpool_;
+  bool channel_wise_;
+  // One CV_32F or CV_32FC3 gain per block of the image
+  std::vector<cv::UMat> gain_maps_;
+};
+
+}  // namespace xpano::algorithm::exposure_compensators
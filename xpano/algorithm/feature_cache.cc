@@ -0,0 +1,315 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/feature_cache.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <spdlog/spdlog.h>
+
+#include "xpano/algorithm/image.h"
+#include "xpano/algorithm/lens.h"
+#include "xpano/algorithm/options.h"
+
+namespace xpano::algorithm {
+
+namespace {
+
+constexpr std::uint32_t kCacheMagic = 0x43465058;  // "XPFC"
+constexpr std::uint32_t kCacheFormatVersion = 2;
+
+std::optional<std::string> CacheKey(const std::filesystem::path& path,
+                                    const ImageLoadOptions& options,
+                                    const std::optional<LensProfile>& lens) {
+  std::error_code error;
+  auto canonical_path = std::filesystem::weakly_canonical(path, error);
+  if (error) {
+    return {};
+  }
+  auto file_size = std::filesystem::file_size(canonical_path, error);
+  if (error) {
+    return {};
+  }
+  auto modified = std::filesystem::last_write_time(canonical_path, error);
+  if (error) {
+    return {};
+  }
+  return fmt::format("{}|{}|{}|{}|{}|{}|{}|{}|{}:{}|{}:{}",
+                     canonical_path.string(), file_size,
+                     modified.time_since_epoch().count(),
+                     options.preview_longer_side,
+                     options.detection_longer_side, options.compute_keypoints,
+                     options.use_embedded_preview, options.compact_features,
+                     Label(options.feature), options.num_features,
+                     lens ? lens->k1 : 0.0f, lens ? lens->k2 : 0.0f);
+}
+
+template <typename TValue>
+void Write(std::ofstream& stream, const TValue& value) {
+  stream.write(reinterpret_cast<const char*>(&value), sizeof(TValue));
+}
+
+template <typename TValue>
+bool Read(std::ifstream& stream, TValue* value) {
+  stream.read(reinterpret_cast<char*>(value), sizeof(TValue));
+  return static_cast<bool>(stream);
+}
+
+void WriteBytes(std::ofstream& stream, const std::vector<uchar>& bytes) {
+  Write(stream, static_cast<std::uint64_t>(bytes.size()));
+  stream.write(reinterpret_cast<const char*>(bytes.data()),
+               static_cast<std::streamsize>(bytes.size()));
+}
+
+bool ReadBytes(std::ifstream& stream, std::vector<uchar>* bytes) {
+  std::uint64_t size = 0;
+  if (!Read(stream, &size)) {
+    return false;
+  }
+  bytes->resize(size);
+  stream.read(reinterpret_cast<char*>(bytes->data()),
+              static_cast<std::streamsize>(size));
+  return static_cast<bool>(stream);
+}
+
+void WriteString(std::ofstream& stream, const std::string& string) {
+  WriteBytes(stream, {string.begin(), string.end()});
+}
+
+bool ReadString(std::ifstream& stream, std::string* string) {
+  std::vector<uchar> bytes;
+  if (!ReadBytes(stream, &bytes)) {
+    return false;
+  }
+  *string = {bytes.begin(), bytes.end()};
+  return true;
+}
+
+// Lossless, so that cached and freshly loaded images give the same results
+void WriteImage(std::ofstream& stream, const cv::Mat& image) {
+  std::vector<uchar> encoded;
+  if (!image.empty()) {
+    cv::imencode(".png", image, encoded, {cv::IMWRITE_PNG_COMPRESSION, 1});
+  }
+  WriteBytes(stream, encoded);
+}
+
+bool ReadImage(std::ifstream& stream, cv::Mat* image) {
+  std::vector<uchar> encoded;
+  if (!ReadBytes(stream, &encoded)) {
+    return false;
+  }
+  if (!encoded.empty()) {
+    *image = cv::imdecode(encoded, cv::IMREAD_COLOR);
+  }
+  return true;
+}
+
+void WriteKeypoints(std::ofstream& stream,
+                    const std::vector<cv::KeyPoint>& keypoints) {
+  Write(stream, static_cast<std::uint64_t>(keypoints.size()));
+  for (const auto& keypoint : keypoints) {
+    Write(stream, keypoint.pt.x);
+    Write(stream, keypoint.pt.y);
+    Write(stream, keypoint.size);
+    Write(stream, keypoint.angle);
+    Write(stream, keypoint.response);
+    Write(stream, static_cast<std::int32_t>(keypoint.octave));
+    Write(stream, static_cast<std::int32_t>(keypoint.class_id));
+  }
+}
+
+bool ReadKeypoints(std::ifstream& stream,
+                   std::vector<cv::KeyPoint>* keypoints) {
+  std::uint64_t num_keypoints = 0;
+  if (!Read(stream, &num_keypoints)) {
+    return false;
+  }
+  keypoints->resize(num_keypoints);
+  for (auto& keypoint : *keypoints) {
+    std::int32_t octave = 0;
+    std::int32_t class_id = 0;
+    Read(stream, &keypoint.pt.x);
+    Read(stream, &keypoint.pt.y);
+    Read(stream, &keypoint.size);
+    Read(stream, &keypoint.angle);
+    Read(stream, &keypoint.response);
+    Read(stream, &octave);
+    Read(stream, &class_id);
+    keypoint.octave = octave;
+    keypoint.class_id = class_id;
+  }
+  return static_cast<bool>(stream);
+}
+
+void WriteDescriptors(std::ofstream& stream, const cv::Mat& descriptors) {
+  cv::Mat continuous =
+      descriptors.isContinuous() ? descriptors : descriptors.clone();
+  Write(stream, static_cast<std::int32_t>(continuous.rows));
+  Write(stream, static_cast<std::int32_t>(continuous.cols));
+  Write(stream, static_cast<std::int32_t>(continuous.type()));
+  stream.write(reinterpret_cast<const char*>(continuous.data),
+               static_cast<std::streamsize>(continuous.total() *
+                                            continuous.elemSize()));
+}
+
+bool ReadDescriptors(std::ifstream& stream, cv::Mat* descriptors) {
+  std::int32_t rows = 0;
+  std::int32_t cols = 0;
+  std::int32_t type = 0;
+  if (!Read(stream, &rows) || !Read(stream, &cols) || !Read(stream, &type)) {
+    return false;
+  }
+  if (rows == 0 || cols == 0) {
+    *descriptors = cv::Mat();
+    return true;
+  }
+  descriptors->create(rows, cols, type);
+  stream.read(reinterpret_cast<char*>(descriptors->data),
+              static_cast<std::streamsize>(descriptors->total() *
+                                           descriptors->elemSize()));
+  return static_cast<bool>(stream);
+}
+
+}  // namespace
+
+void WriteImageData(std::ofstream& stream, const Image& image) {
+  Write(stream, static_cast<std::uint8_t>(image.IsRaw()));
+  WriteImage(stream, image.GetPreview());
+  WriteImage(stream, image.GetThumbnail());
+  WriteKeypoints(stream, image.GetKeypoints());
+  WriteDescriptors(stream, image.GetDescriptors());
+}
+
+std::optional<Image> ReadImageData(std::ifstream& stream,
+                                   const std::filesystem::path& path) {
+  std::uint8_t is_raw = 0;
+  cv::Mat preview;
+  cv::Mat thumbnail;
+  std::vector<cv::KeyPoint> keypoints;
+  cv::Mat descriptors;
+  if (!Read(stream, &is_raw) || !ReadImage(stream, &preview) ||
+      !ReadImage(stream, &thumbnail) || !ReadKeypoints(stream, &keypoints) ||
+      !ReadDescriptors(stream, &descriptors) || preview.empty()) {
+    return {};
+  }
+  return Image(path, preview, thumbnail, std::move(keypoints), descriptors,
+               is_raw != 0);
+}
+
+FeatureCache::FeatureCache(std::filesystem::path cache_dir)
+    : cache_dir_(std::move(cache_dir)) {
+  std::error_code error;
+  std::filesystem::create_directories(cache_dir_, error);
+  if (error) {
+    spdlog::warn("Failed to create feature cache directory {}: {}",
+                 cache_dir_.string(), error.message());
+  }
+}
+
+std::filesystem::path FeatureCache::EntryPath(const std::string& key) const {
+  return cache_dir_ /
+         fmt::format("{:016x}.xpfc", std::hash<std::string>{}(key));
+}
+
+std::optional<Image> FeatureCache::Load(const std::filesystem::path& path,
+                                        const ImageLoadOptions& options) const {
+  auto image = LoadEntry(path, options);
+  (image ? hits_ : misses_)++;
+  return image;
+}
+
+FeatureCacheStats FeatureCache::Stats() const {
+  return {.hits = hits_, .misses = misses_};
+}
+
+std::optional<Image> FeatureCache::LoadEntry(
+    const std::filesystem::path& path, const ImageLoadOptions& options) const {
+  auto lens = lens::PickProfile(options.lens, path);
+  auto key = CacheKey(path, options, lens);
+  if (!key) {
+    return {};
+  }
+
+  std::ifstream stream(EntryPath(*key), std::ios::binary);
+  if (!stream) {
+    return {};
+  }
+
+  std::uint32_t magic = 0;
+  std::uint32_t version = 0;
+  std::string stored_key;
+  if (!Read(stream, &magic) || !Read(stream, &version) ||
+      magic != kCacheMagic || version != kCacheFormatVersion ||
+      !ReadString(stream, &stored_key) || stored_key != *key) {
+    return {};
+  }
+
+  auto image = ReadImageData(stream, path);
+  if (!image) {
+    spdlog::warn("Corrupted feature cache entry for {}", path.string());
+    return {};
+  }
+
+  spdlog::info("Loaded {} from cache", path.string());
+  image->SetLensProfile(lens);
+  if (options.compact_features) {
+    image->Compact();
+  }
+  if (options.compress_preview) {
+    image->CompressPreview();
+  }
+  return image;
+}
+
+void FeatureCache::Store(const Image& image,
+                         const ImageLoadOptions& options) const {
+  auto key = CacheKey(image.GetPath(), options, image.GetLensProfile());
+  if (!key || !image.IsLoaded()) {
+    return;
+  }
+
+  // Write to a temporary file first, readers never see partial entries
+  auto entry_path = EntryPath(*key);
+  auto tmp_path = entry_path;
+  tmp_path += fmt::format(
+      ".{}.tmp", std::hash<std::thread::id>{}(std::this_thread::get_id()));
+
+  bool written = false;
+  {
+    std::ofstream stream(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!stream) {
+      return;
+    }
+    Write(stream, kCacheMagic);
+    Write(stream, kCacheFormatVersion);
+    WriteString(stream, *key);
+    WriteImageData(stream, image);
+    written = static_cast<bool>(stream);
+  }
+
+  std::error_code error;
+  if (!written) {
+    spdlog::warn("Failed to write feature cache entry for {}",
+                 image.GetPath().string());
+    std::filesystem::remove(tmp_path, error);
+    return;
+  }
+  std::filesystem::rename(tmp_path, entry_path, error);
+  if (error) {
+    std::filesystem::remove(tmp_path, error);
+  }
+}
+
+}  // namespace xpano::algorithm
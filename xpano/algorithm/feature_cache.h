@@ -0,0 +1,53 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+
+#include "xpano/algorithm/image.h"
+
+namespace xpano::algorithm {
+
+struct FeatureCacheStats {
+  int hits = 0;
+  int misses = 0;
+};
+
+// Previews, keypoints and descriptors of a loaded image, the body of a cache
+// entry, also embedded in the project files. ReadImageData returns an empty
+// optional on a read error.
+void WriteImageData(std::ofstream& stream, const Image& image);
+std::optional<Image> ReadImageData(std::ifstream& stream,
+                                   const std::filesystem::path& path);
+
+// On-disk cache of the results of Image::Load.
+//  - One file per image, the filename is a hash of the cache key.
+//  - The key contains the source path, file size, modification time, preview
+//    size and detector settings and is also stored inside the file, so that
+//    hash collisions and stale entries are detected on load.
+//  - Entries for different images can be loaded / stored concurrently.
+class FeatureCache {
+ public:
+  explicit FeatureCache(std::filesystem::path cache_dir);
+
+  [[nodiscard]] std::optional<Image> Load(const std::filesystem::path& path,
+                                          const ImageLoadOptions& options) const;
+  void Store(const Image& image, const ImageLoadOptions& options) const;
+  [[nodiscard]] FeatureCacheStats Stats() const;
+
+ private:
+  [[nodiscard]] std::optional<Image> LoadEntry(
+      const std::filesystem::path& path, const ImageLoadOptions& options) const;
+  [[nodiscard]] std::filesystem::path EntryPath(const std::string& key) const;
+
+  std::filesystem::path cache_dir_;
+  mutable std::atomic_int hits_ = 0;
+  mutable std::atomic_int misses_ = 0;
+};
+
+}  // namespace xpano::algorithm
@@ -0,0 +1,104 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/grid.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/algorithm/options.h"
+
+namespace xpano::algorithm {
+
+namespace {
+
+bool Neighbors(const GridOptions& grid, cv::Point cell1, cv::Point cell2) {
+  const int dx = std::abs(cell1.x - cell2.x);
+  const int dy = std::abs(cell1.y - cell2.y);
+  return grid.diagonals ? std::max(dx, dy) == 1 : dx + dy == 1;
+}
+
+}  // namespace
+
+cv::Point GridCell(const GridOptions& grid, int index) {
+  switch (grid.order) {
+    case GridOrder::kRows:
+      return {index % grid.cols, index / grid.cols};
+    case GridOrder::kRowsSerpentine: {
+      const int row = index / grid.cols;
+      const int col = index % grid.cols;
+      return {row % 2 == 0 ? col : grid.cols - 1 - col, row};
+    }
+    case GridOrder::kColumns:
+      return {index / grid.rows, index % grid.rows};
+    case GridOrder::kColumnsSerpentine: {
+      const int col = index / grid.rows;
+      const int row = index % grid.rows;
+      return {col, col % 2 == 0 ? row : grid.rows - 1 - row};
+    }
+    default:
+      return {};
+  }
+}
+
+std::vector<std::pair<int, int>> GridPairs(const GridOptions& grid,
+                                           int num_images, int first_new_id) {
+  std::map<std::pair<int, int>, int> cell_ids;
+  for (int i = 0; i < num_images; i++) {
+    const auto cell = GridCell(grid, i);
+    cell_ids[{cell.x, cell.y}] = i;
+  }
+
+  // Half of the neighbourhood, each pair is found once
+  std::vector<cv::Point> offsets = {{1, 0}, {0, 1}};
+  if (grid.diagonals) {
+    offsets.insert(offsets.end(), {{1, 1}, {-1, 1}});
+  }
+  std::vector<std::pair<int, int>> pairs;
+  for (int i = 0; i < num_images; i++) {
+    const auto cell = GridCell(grid, i);
+    for (const auto& offset : offsets) {
+      auto neighbor = cell_ids.find({cell.x + offset.x, cell.y + offset.y});
+      if (neighbor == cell_ids.end()) {
+        continue;
+      }
+      auto pair = std::minmax(i, neighbor->second);
+      if (pair.second >= first_new_id) {
+        pairs.emplace_back(pair);
+      }
+    }
+  }
+  std::sort(pairs.begin(), pairs.end());
+  return pairs;
+}
+
+cv::Mat GridMatchingMask(const GridOptions& grid, const std::vector<int>& ids) {
+  const int num_images = static_cast<int>(ids.size());
+  const auto cells = GridCells(grid, ids);
+  cv::Mat mask = cv::Mat::zeros(num_images, num_images, CV_8U);
+  for (int i = 0; i < num_images; i++) {
+    for (int j = 0; j < num_images; j++) {
+      if (Neighbors(grid, cells[i], cells[j])) {
+        mask.at<uchar>(i, j) = 1;
+      }
+    }
+  }
+  return mask;
+}
+
+std::vector<cv::Point> GridCells(const GridOptions& grid,
+                                 const std::vector<int>& ids) {
+  std::vector<cv::Point> cells;
+  cells.reserve(ids.size());
+  for (const int id : ids) {
+    cells.push_back(GridCell(grid, id));
+  }
+  return cells;
+}
+
+}  // namespace xpano::algorithm
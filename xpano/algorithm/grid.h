@@ -0,0 +1,30 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/algorithm/options.h"
+
+namespace xpano::algorithm {
+
+// Column (x) and row (y) of the index-th image of the capture order
+cv::Point GridCell(const GridOptions& grid, int index);
+
+// Pairs i < j of the neighbouring images of the grid, 4- or 8-neighbours.
+// The pairs of two images with ids lower than first_new_id are skipped.
+std::vector<std::pair<int, int>> GridPairs(const GridOptions& grid,
+                                           int num_images, int first_new_id);
+
+// CV_8U num_images^2 mask of the neighbouring pano images, see MatchingMask
+cv::Mat GridMatchingMask(const GridOptions& grid, const std::vector<int>& ids);
+
+// Cells of the pano images, see Stitcher::SetGridCells
+std::vector<cv::Point> GridCells(const GridOptions& grid,
+                                 const std::vector<int>& ids);
+
+}  // namespace xpano::algorithm
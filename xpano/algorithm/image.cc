@@ -4,23 +4,83 @@
 #include "xpano/algorithm/image.h"
 
 #include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <memory>
 #include <optional>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <opencv2/core.hpp>
+#include <opencv2/core/ocl.hpp>
 #include <opencv2/features2d.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/imgproc.hpp>
 #include <spdlog/spdlog.h>
 
+#include "xpano/algorithm/descriptor_index.h"
+#include "xpano/algorithm/lens.h"
+#include "xpano/algorithm/preview_store.h"
+#include "xpano/algorithm/video.h"
 #include "xpano/constants.h"
+#include "xpano/utils/exiv2.h"
+#include "xpano/utils/fmt.h"
+#include "xpano/utils/jpeg.h"
+#include "xpano/utils/path.h"
+#include "xpano/utils/tiff.h"
 
 namespace xpano::algorithm {
 namespace {
-thread_local cv::Ptr<cv::Feature2D> sift = cv::SIFT::create(kNumFeatures);
+cv::Ptr<cv::Feature2D> CreateDetector(FeatureType feature, int num_features) {
+  switch (feature) {
+    case FeatureType::kSift:
+      return cv::SIFT::create(num_features);
+    case FeatureType::kOrb:
+      return cv::ORB::create(num_features);
+    case FeatureType::kAkaze:
+      return cv::AKAZE::create();
+    default:
+      return nullptr;
+  }
+}
+
+// Detectors aren't thread safe, each thread keeps one for the last settings
+cv::Ptr<cv::Feature2D> GetDetector(FeatureType feature, int num_features) {
+  struct CachedDetector {
+    FeatureType feature;
+    int num_features;
+    cv::Ptr<cv::Feature2D> detector;
+  };
+  thread_local CachedDetector cached{};
+  if (!cached.detector || cached.feature != feature ||
+      cached.num_features != num_features) {
+    cached = {feature, num_features, CreateDetector(feature, num_features)};
+  }
+  return cached.detector;
+}
+
+// AKAZE has no keypoint limit, the strongest keypoints are kept before
+// computing the descriptors
+void DetectAndCompute(cv::InputArray image, cv::InputArray mask,
+                      const ImageLoadOptions& options,
+                      std::vector<cv::KeyPoint>* keypoints,
+                      cv::OutputArray descriptors) {
+  auto detector = GetDetector(options.feature, options.num_features);
+  if (options.feature != FeatureType::kAkaze) {
+    detector->detectAndCompute(image, mask, *keypoints, descriptors);
+    return;
+  }
+  detector->detect(image, *keypoints, mask);
+  cv::KeyPointsFilter::retainBest(*keypoints, options.num_features);
+  detector->compute(image, *keypoints, descriptors);
+}
 
 std::optional<cv::Size> PreviewSize(const cv::Size& full_size,
                                     int preview_longer_side) {
@@ -37,23 +97,299 @@ std::optional<cv::Size> PreviewSize(const cv::Size& full_size,
                         preview_longer_side);
 }
 
+// Picks the largest DCT scaling factor (1/2, 1/4, 1/8) that still produces an
+// image at least as big as the requested preview, libjpeg rounds sizes up.
+int PickReducedFlag(const std::vector<unsigned char>& encoded,
+                    int preview_longer_side) {
+  if (preview_longer_side <= 0) {
+    return cv::IMREAD_COLOR;
+  }
+  auto jpeg_size = utils::jpeg::ReadSize(encoded);
+  if (!jpeg_size) {
+    return cv::IMREAD_COLOR;
+  }
+
+  const int longer_side = std::max((*jpeg_size)[0], (*jpeg_size)[1]);
+  const auto reduced_modes =
+      std::array{std::pair{8, cv::IMREAD_REDUCED_COLOR_8},
+                 std::pair{4, cv::IMREAD_REDUCED_COLOR_4},
+                 std::pair{2, cv::IMREAD_REDUCED_COLOR_2}};
+  for (const auto& [factor, flag] : reduced_modes) {
+    if ((longer_side + factor - 1) / factor >= preview_longer_side) {
+      return flag;
+    }
+  }
+  return cv::IMREAD_COLOR;
+}
+
+cv::Mat ApplyOrientation(const cv::Mat& image, int orientation) {
+  cv::Mat result;
+  switch (orientation) {
+    case 2:  // NOLINT(readability-magic-numbers)
+      cv::flip(image, result, 1);
+      return result;
+    case 3:  // NOLINT(readability-magic-numbers)
+      cv::rotate(image, result, cv::ROTATE_180);
+      return result;
+    case 4:  // NOLINT(readability-magic-numbers)
+      cv::flip(image, result, 0);
+      return result;
+    case 5:  // NOLINT(readability-magic-numbers)
+      cv::transpose(image, result);
+      return result;
+    case 6:  // NOLINT(readability-magic-numbers)
+      cv::rotate(image, result, cv::ROTATE_90_CLOCKWISE);
+      return result;
+    case 7:  // NOLINT(readability-magic-numbers)
+      cv::transpose(image, result);
+      cv::flip(result, result, -1);
+      return result;
+    case 8:  // NOLINT(readability-magic-numbers)
+      cv::rotate(image, result, cv::ROTATE_90_COUNTERCLOCKWISE);
+      return result;
+    default:
+      return image;
+  }
+}
+
+// Decodes JPEGs with restart markers on all threads, see
+// utils::jpeg::DecodeStriped
+cv::Mat DecodeFull(const std::vector<unsigned char>& encoded) {
+  if (encoded.empty()) {
+    return {};
+  }
+  if (cv::Mat image = utils::jpeg::DecodeStriped(encoded); !image.empty()) {
+    return ApplyOrientation(image, utils::jpeg::ReadOrientation(encoded));
+  }
+  return cv::imdecode(encoded, cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH);
+}
+
+cv::Mat Decode(const std::vector<unsigned char>& encoded,
+               int preview_longer_side) {
+  if (encoded.empty()) {
+    return {};
+  }
+  if (auto flag = PickReducedFlag(encoded, preview_longer_side);
+      flag != cv::IMREAD_COLOR) {
+    return cv::imdecode(encoded, flag);
+  }
+  return DecodeFull(encoded);
+}
+
+// Uses a preview embedded in the Exif data if it is large enough and has the
+// same aspect ratio as the main image (some cameras add black bars).
+cv::Mat DecodeEmbeddedPreview(const std::vector<unsigned char>& encoded,
+                              int preview_longer_side) {
+  auto main_size = utils::jpeg::ReadSize(encoded);
+  if (!main_size) {
+    return {};
+  }
+  auto preview =
+      utils::exiv2::ReadEmbeddedPreview(encoded, preview_longer_side);
+  if (!preview) {
+    return {};
+  }
+
+  auto main_aspect =
+      static_cast<float>((*main_size)[0]) / static_cast<float>((*main_size)[1]);
+  auto preview_aspect = static_cast<float>(preview->size[0]) /
+                        static_cast<float>(preview->size[1]);
+  if (std::abs(main_aspect / preview_aspect - 1.0f) >
+      kEmbeddedPreviewAspectTolerance) {
+    return {};
+  }
+
+  auto image = cv::imdecode(preview->data,
+                            cv::IMREAD_COLOR | cv::IMREAD_IGNORE_ORIENTATION);
+  if (image.empty()) {
+    return {};
+  }
+  return ApplyOrientation(image, preview->orientation);
+}
+
+// Feeds the detector with UMats, OpenCV dispatches to the OpenCL kernels of
+// the detector where they exist and keeps the rest on the CPU.
+bool DetectOpenCL(const cv::Mat& image, const cv::Mat& mask,
+                  const ImageLoadOptions& options,
+                  std::vector<cv::KeyPoint>* keypoints, cv::Mat* descriptors) {
+  if (!cv::ocl::useOpenCL()) {
+    return false;
+  }
+  try {
+    cv::UMat gray;
+    cv::cvtColor(image.getUMat(cv::ACCESS_READ), gray, cv::COLOR_BGR2GRAY);
+    cv::UMat device_descriptors;
+    DetectAndCompute(gray, mask, options, keypoints, device_descriptors);
+    *descriptors = device_descriptors.getMat(cv::ACCESS_READ).clone();
+  } catch (const cv::Exception& exception) {
+    spdlog::warn("OpenCL keypoint detection failed, using the CPU: {}",
+                 exception.what());
+    keypoints->clear();
+    return false;
+  }
+  return true;
+}
+
+// The mask is empty or of the image size
+void Detect(const cv::Mat& image, const cv::Mat& mask,
+            const ImageLoadOptions& options,
+            std::vector<cv::KeyPoint>* keypoints, cv::Mat* descriptors) {
+  if (options.detector_backend == DetectorBackend::kOpenCL &&
+      HasOpenCLDetector(options.feature) &&
+      DetectOpenCL(image, mask, options, keypoints, descriptors)) {
+    return;
+  }
+  DetectAndCompute(image, mask, options, keypoints, *descriptors);
+}
+
+// From the detection image to the preview coordinates
+void ScaleKeypoints(const cv::Size& detection_size,
+                    const cv::Size& preview_size,
+                    std::vector<cv::KeyPoint>* keypoints) {
+  const float scale = static_cast<float>(preview_size.width) /
+                      static_cast<float>(detection_size.width);
+  if (scale == 1.0f) {
+    return;
+  }
+  for (auto& keypoint : *keypoints) {
+    keypoint.pt *= scale;
+    keypoint.size *= scale;
+  }
+}
+
+// Detects on a downscaled copy of the decoded frame when asked for a smaller
+// size than the preview, the copy is released right after the detection.
+void DetectScaled(const cv::Mat& frame, const cv::Mat& preview,
+                  const ImageLoadOptions& options,
+                  std::vector<cv::KeyPoint>* keypoints, cv::Mat* descriptors) {
+  const int preview_longer_side = std::max(preview.cols, preview.rows);
+  if (options.detection_longer_side <= 0 ||
+      options.detection_longer_side == preview_longer_side) {
+    Detect(preview, {}, options, keypoints, descriptors);
+    return;
+  }
+
+  cv::Mat detection_image = frame;
+  if (auto detection_size =
+          PreviewSize(frame.size(), options.detection_longer_side);
+      detection_size) {
+    cv::resize(frame, detection_image, *detection_size, 0.0, 0.0,
+               cv::INTER_AREA);
+  }
+  Detect(detection_image, {}, options, keypoints, descriptors);
+  ScaleKeypoints(detection_image.size(), preview.size(), keypoints);
+}
+
+// Same mapping as cv::imread without IMREAD_ANYDEPTH, but without decoding
+// the file a second time.
+cv::Mat ToEightBit(const cv::Mat& image) {
+  double scale = 1.0;
+  switch (image.depth()) {
+    case CV_16U:
+    case CV_16S:
+      scale = 1.0 / 256.0;
+      break;
+    case CV_32F:
+    case CV_64F:
+      scale = 255.0;
+      break;
+    default:
+      break;
+  }
+  cv::Mat result;
+  image.convertTo(result, CV_8U, scale);
+  return result;
+}
+
+// Reads only the page of the TIFF closest to the size, e.g. an overview of a
+// huge scan, 0 reads the full resolution. Empty if the file isn't supported
+// by tiff::Reader.
+cv::Mat ReadTiff(const std::filesystem::path& path, int min_longer_side) {
+  if (!utils::path::IsTiff(path)) {
+    return {};
+  }
+  auto reader = utils::tiff::Reader::Open(path);
+  if (!reader) {
+    return {};
+  }
+  return reader->Read(utils::tiff::PickPage(reader->Pages(), min_longer_side));
+}
+
 }  // namespace
 
 Image::Image(std::filesystem::path path) : path_(std::move(path)) {}
 
+Image::Image(std::filesystem::path video_path, int video_frame)
+    : path_(std::move(video_path)), video_frame_(video_frame) {}
+
+Image::Image(std::filesystem::path name,
+             std::shared_ptr<const std::vector<unsigned char>> encoded)
+    : path_(std::move(name)), encoded_(std::move(encoded)) {}
+
+Image::Image(std::filesystem::path path, cv::Mat preview, cv::Mat thumbnail,
+             std::vector<cv::KeyPoint> keypoints, cv::Mat descriptors,
+             bool is_raw)
+    : path_(std::move(path)),
+      preview_(std::move(preview)),
+      thumbnail_(std::move(thumbnail)),
+      keypoints_(std::make_shared<const std::vector<cv::KeyPoint>>(
+          std::move(keypoints))),
+      descriptors_(std::move(descriptors)),
+      is_raw_(is_raw) {
+  if (!thumbnail_.empty()) {
+    perceptual_hash_ = DifferenceHash(thumbnail_);
+  }
+}
+
 void Image::Load(ImageLoadOptions options) {
-  cv::Mat tmp =
-      cv::imread(path_.string(), cv::IMREAD_COLOR | cv::IMREAD_ANYDEPTH);
+  if (encoded_) {
+    Load(*encoded_, options);
+    return;
+  }
+  cv::Mat tiff = ReadTiff(path_, std::max(options.preview_longer_side,
+                                          options.detection_longer_side));
+  if (tiff.empty()) {
+    Load(ReadFileBytes(path_), options);
+    return;
+  }
+  if (tiff.depth() != CV_8U) {
+    is_raw_ = true;
+    tiff = ToEightBit(tiff);
+  }
+  LoadFrame(std::move(tiff), options);
+}
+
+void Image::Load(const std::vector<unsigned char>& encoded,
+                 ImageLoadOptions options) {
+  cv::Mat tmp;
+  if (options.use_embedded_preview) {
+    tmp = DecodeEmbeddedPreview(encoded, options.preview_longer_side);
+    if (!tmp.empty()) {
+      spdlog::debug("Using embedded preview of {}", path_.string());
+    }
+  }
+  if (tmp.empty()) {
+    tmp = Decode(encoded, std::max(options.preview_longer_side,
+                                   options.detection_longer_side));
+  }
   if (!tmp.empty() && tmp.depth() != CV_8U) {
     is_raw_ = true;
     spdlog::warn("Image {} is not 8-bit, converting", path_.string());
-    tmp = cv::imread(path_.string());
+    tmp = ToEightBit(tmp);
   }
   if (tmp.empty()) {
     spdlog::error("Failed to load image {}", path_.string());
     return;
   }
+  LoadFrame(tmp, options);
+}
 
+void Image::LoadFrame(cv::Mat frame, ImageLoadOptions options) {
+  cv::Mat tmp = std::move(frame);
+  lens_ = lens::PickProfile(options.lens, path_);
+  if (lens_) {
+    tmp = lens::Undistort(tmp, *lens_);
+  }
   if (auto preview_size = PreviewSize(tmp.size(), options.preview_longer_side);
       preview_size) {
     cv::resize(tmp, preview_, *preview_size, 0.0, 0.0, cv::INTER_AREA);
@@ -62,59 +398,305 @@ void Image::Load(ImageLoadOptions options) {
   }
 
   if (options.compute_keypoints) {
-    sift->detectAndCompute(preview_, cv::Mat(), keypoints_, descriptors_);
+    std::vector<cv::KeyPoint> keypoints;
+    DetectScaled(tmp, preview_, options, &keypoints, &descriptors_);
+    keypoints_ =
+        std::make_shared<const std::vector<cv::KeyPoint>>(std::move(keypoints));
   }
   cv::resize(preview_, thumbnail_, cv::Size(kThumbnailSize, kThumbnailSize), 0,
              0, cv::INTER_AREA);
+  perceptual_hash_ = DifferenceHash(thumbnail_);
 
-  spdlog::info("Loaded {}", path_.string());
+  spdlog::info("Loaded {}", GetKey());
   if (options.compute_keypoints) {
     spdlog::info("Size: {} x {}, Keypoints: {}", preview_.size[1],
-                 preview_.size[0], keypoints_.size());
+                 preview_.size[0], NumKeypoints());
   } else {
     spdlog::info("Size: {} x {}", preview_.size[1], preview_.size[0]);
   }
+
+  if (options.compact_features) {
+    Compact();
+  }
+  if (options.compress_preview) {
+    CompressPreview();
+  }
+}
+
+void Image::DetectInRegion(const cv::Mat& region, ImageLoadOptions options) {
+  cv::Mat frame;
+  if (video_frame_) {
+    frame = video::ReadFrame(path_, *video_frame_);
+  } else if (encoded_) {
+    frame = Decode(*encoded_, options.detection_longer_side);
+  } else {
+    frame = ReadTiff(path_, options.detection_longer_side);
+  }
+  if (frame.empty() && !video_frame_ && !encoded_) {
+    frame = Decode(ReadFileBytes(path_), options.detection_longer_side);
+  }
+  if (frame.empty() || !IsLoaded()) {
+    spdlog::error("Failed to load image {}", GetKey());
+    return;
+  }
+  if (frame.depth() != CV_8U) {
+    frame = ToEightBit(frame);
+  }
+  if (lens_) {
+    frame = lens::Undistort(frame, *lens_);
+  }
+  if (auto detection_size =
+          PreviewSize(frame.size(), options.detection_longer_side);
+      detection_size) {
+    cv::resize(frame, frame, *detection_size, 0.0, 0.0, cv::INTER_AREA);
+  }
+  cv::Mat mask;
+  cv::resize(region, mask, frame.size(), 0.0, 0.0, cv::INTER_NEAREST);
+
+  std::vector<cv::KeyPoint> keypoints;
+  cv::Mat descriptors;
+  Detect(frame, mask, options, &keypoints, &descriptors);
+  ScaleKeypoints(frame.size(), GetPreviewSize(), &keypoints);
+  spdlog::debug("Detected {} keypoints in the overlaps of {}",
+                keypoints.size(), GetKey());
+
+  keypoints_ =
+      std::make_shared<const std::vector<cv::KeyPoint>>(std::move(keypoints));
+  keypoint_positions_.reset();
+  descriptors_ = descriptors;
+  const bool indexed = descriptor_index_ != nullptr;
+  descriptor_index_.reset();
+  if (options.compact_features) {
+    Compact();
+  }
+  if (indexed) {
+    BuildDescriptorIndex();
+  }
+}
+
+void Image::Compact() {
+  if (keypoints_ && !keypoints_->empty()) {
+    std::vector<cv::Point2f> positions;
+    positions.reserve(keypoints_->size());
+    std::transform(keypoints_->begin(), keypoints_->end(),
+                   std::back_inserter(positions),
+                   [](const cv::KeyPoint& keypoint) { return keypoint.pt; });
+    keypoint_positions_ =
+        std::make_shared<const std::vector<cv::Point2f>>(std::move(positions));
+    keypoints_.reset();
+  }
+  // Binary descriptors (ORB, AKAZE) are already stored as uint8
+  if (descriptors_.depth() == CV_32F) {
+    cv::Mat compact_descriptors;
+    descriptors_.convertTo(compact_descriptors, CV_8U);
+    descriptors_ = compact_descriptors;
+  }
 }
 
-bool Image::IsLoaded() const { return !preview_.empty(); }
+void Image::CompressPreview() {
+  if (preview_.empty()) {
+    return;
+  }
+  auto encoded = std::make_shared<std::vector<unsigned char>>();
+  if (!cv::imencode(".jpg", preview_, *encoded,
+                    {cv::IMWRITE_JPEG_QUALITY, kCompressedPreviewQuality})) {
+    spdlog::warn("Failed to compress the preview of {}", GetKey());
+    return;
+  }
+  spdlog::debug("Compressed the preview of {} to {} kB", GetKey(),
+                encoded->size() / 1024);
+  compressed_preview_ = std::move(encoded);
+  preview_id_ = NextPreviewId();
+  preview_size_ = preview_.size();
+  preview_.release();
+}
+
+bool Image::IsPreviewCompressed() const {
+  return compressed_preview_ != nullptr;
+}
+
+void Image::BuildDescriptorIndex() {
+  if (descriptors_.empty()) {
+    return;
+  }
+  cv::Mat float_descriptors = descriptors_;
+  if (descriptors_.depth() != CV_32F) {
+    descriptors_.convertTo(float_descriptors, CV_32F);
+  }
+  descriptor_index_ =
+      std::make_shared<const DescriptorIndex>(float_descriptors);
+}
+
+bool Image::IsLoaded() const {
+  return !preview_.empty() || compressed_preview_;
+}
 
 bool Image::IsRaw() const { return is_raw_; }
 
-cv::Mat Image::GetFullRes() const { return cv::imread(path_.string()); }
+std::optional<LensProfile> Image::GetLensProfile() const { return lens_; }
+
+void Image::SetLensProfile(std::optional<LensProfile> profile) {
+  lens_ = std::move(profile);
+}
+
+cv::Mat Image::GetFullRes() const {
+  cv::Mat full_res;
+  if (video_frame_) {
+    full_res = video::ReadFrame(path_, *video_frame_);
+  } else if (encoded_) {
+    full_res = DecodeFull(*encoded_);
+  } else if (cv::Mat tiff = ReadTiff(path_, 0); !tiff.empty()) {
+    full_res = tiff;
+  } else if (utils::path::IsJpeg(path_)) {
+    full_res = DecodeFull(ReadFileBytes(path_));
+  } else {
+    full_res = cv::imread(path_.string());
+  }
+  if (!full_res.empty() && full_res.depth() != CV_8U) {
+    full_res = ToEightBit(full_res);
+  }
+  if (lens_) {
+    return lens::Undistort(full_res, *lens_);
+  }
+  return full_res;
+}
 cv::Mat Image::GetThumbnail() const { return thumbnail_; }
-cv::Mat Image::GetPreview() const { return preview_; }
+cv::Mat Image::GetPreview() const {
+  if (compressed_preview_) {
+    return DecodePreview(preview_id_, *compressed_preview_);
+  }
+  return preview_;
+}
+
+cv::Size Image::GetPreviewSize() const {
+  return compressed_preview_ ? preview_size_ : preview_.size();
+}
 
 int Image::GetPreviewLongerSide() const {
-  return std::max(preview_.size[1], preview_.size[0]);
+  const auto size = GetPreviewSize();
+  return std::max(size.width, size.height);
+}
+
+std::size_t Image::GetPreviewBytes() const {
+  if (compressed_preview_) {
+    return compressed_preview_->size();
+  }
+  return preview_.total() * preview_.elemSize();
 }
 
 float Image::GetAspect() const {
-  auto width = static_cast<float>(preview_.size[1]);
-  auto height = static_cast<float>(preview_.size[0]);
-  return width / height;
+  const auto size = GetPreviewSize();
+  return static_cast<float>(size.width) / static_cast<float>(size.height);
 }
 
 cv::Mat Image::Draw(bool show_debug) const {
+  auto preview = GetPreview();
   if (show_debug) {
     cv::Mat tmp;
-    cv::drawKeypoints(preview_, keypoints_, tmp, cv::Scalar::all(-1),
+    cv::drawKeypoints(preview, GetKeypoints(), tmp, cv::Scalar::all(-1),
                       cv::DrawMatchesFlags::DRAW_RICH_KEYPOINTS);
     return tmp;
   }
-  return preview_;
+  return preview;
+}
+
+std::vector<cv::KeyPoint> Image::GetKeypoints() const {
+  if (keypoint_positions_) {
+    std::vector<cv::KeyPoint> keypoints;
+    cv::KeyPoint::convert(*keypoint_positions_, keypoints);
+    return keypoints;
+  }
+  if (keypoints_) {
+    return *keypoints_;
+  }
+  return {};
 }
 
-const std::vector<cv::KeyPoint>& Image::GetKeypoints() const {
-  return keypoints_;
+int Image::NumKeypoints() const {
+  if (keypoint_positions_) {
+    return static_cast<int>(keypoint_positions_->size());
+  }
+  return keypoints_ ? static_cast<int>(keypoints_->size()) : 0;
+}
+
+cv::Point2f Image::GetKeypointPosition(int keypoint_id) const {
+  return keypoint_positions_ ? (*keypoint_positions_)[keypoint_id]
+                             : (*keypoints_)[keypoint_id].pt;
 }
 
 cv::Mat Image::GetDescriptors() const { return descriptors_; }
 
+std::shared_ptr<const DescriptorIndex> Image::GetDescriptorIndex() const {
+  return descriptor_index_;
+}
+
+std::optional<std::uint64_t> Image::GetPerceptualHash() const {
+  return perceptual_hash_;
+}
+
 std::filesystem::path Image::GetPath() const { return path_; }
 
+bool Image::IsInMemory() const { return encoded_ != nullptr; }
+
+std::optional<int> Image::GetVideoFrame() const { return video_frame_; }
+
+std::string Image::GetKey() const {
+  auto key = video_frame_ ? fmt::format("{}#{}", path_.string(), *video_frame_)
+                          : path_.string();
+  if (lens_) {
+    key += fmt::format("|lens {} {}", lens_->k1, lens_->k2);
+  }
+  return key;
+}
+
 std::string Image::PanoName() const {
+  // Videos can't be written, several panos may start in the same video
+  if (video_frame_) {
+    return fmt::format("{}_{}{}.jpg", path_.stem().string(), *video_frame_,
+                       kDefaultPanoSuffix);
+  }
   return path_.stem().string() + kDefaultPanoSuffix +
          path_.extension().string();
 }
 
+std::vector<unsigned char> ReadFileBytes(const std::filesystem::path& path) {
+  std::ifstream stream(path, std::ios::binary | std::ios::ate);
+  if (!stream) {
+    return {};
+  }
+  const auto size = static_cast<std::streamsize>(stream.tellg());
+  std::vector<unsigned char> bytes(size);
+  stream.seekg(0);
+  if (!stream.read(reinterpret_cast<char*>(bytes.data()), size)) {
+    return {};
+  }
+  return bytes;
+}
+
+std::uint64_t DifferenceHash(const cv::Mat& image) {
+  constexpr int kHashWidth = 8;
+  constexpr int kHashHeight = 8;
+  cv::Mat gray = image;
+  if (image.channels() == 3) {
+    cv::cvtColor(image, gray, cv::COLOR_BGR2GRAY);
+  }
+  cv::Mat small;
+  cv::resize(gray, small, cv::Size(kHashWidth + 1, kHashHeight), 0, 0,
+             cv::INTER_AREA);
+
+  std::uint64_t hash = 0;
+  for (int row = 0; row < kHashHeight; row++) {
+    const auto* pixels = small.ptr<uchar>(row);
+    for (int col = 0; col < kHashWidth; col++) {
+      hash = (hash << 1) | static_cast<std::uint64_t>(pixels[col] >
+                                                      pixels[col + 1]);
+    }
+  }
+  return hash;
+}
+
+int HashDistance(std::uint64_t hash1, std::uint64_t hash2) {
+  return std::popcount(hash1 ^ hash2);
+}
+
 }  // namespace xpano::algorithm
@@ -3,47 +3,158 @@
 
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <filesystem>
+#include <memory>
+#include <optional>
 #include <string>
 #include <vector>
 
 #include <opencv2/core.hpp>
 
+#include "xpano/algorithm/descriptor_index.h"
+#include "xpano/algorithm/options.h"
+#include "xpano/constants.h"
+
 namespace xpano::algorithm {
 
 struct ImageLoadOptions {
   int preview_longer_side = 0;
+  // Keypoints are detected on their own copy of the image with this longer
+  // side and scaled to the preview coordinates, 0 detects on the preview
+  int detection_longer_side = 0;
   bool compute_keypoints = true;
+  FeatureType feature = FeatureType::kSift;
+  // Upper bound on the number of detected keypoints
+  int num_features = kNumFeatures;
+  // Take the preview from the Exif data when possible, see utils::exiv2
+  bool use_embedded_preview = false;
+  // Keep only keypoint positions and uint8 descriptors, see Image::Compact
+  bool compact_features = false;
+  // Falls back to the CPU when no OpenCL device is available or the feature
+  // has no OpenCL detector, see HasOpenCLDetector
+  DetectorBackend detector_backend = DetectorBackend::kCpu;
+  // Keep the preview JPEG-compressed, see Image::CompressPreview
+  bool compress_preview = false;
+  // The full resolution frames are undistorted with the same profile
+  LensOptions lens;
 };
 
+// Copies are cheap: the pixel data and the features are shared between the
+// copies and never modified in place after loading.
 class Image {
  public:
   Image() = default;
   explicit Image(std::filesystem::path path);
+  // A frame of a video, see video::LoadKeyframes
+  Image(std::filesystem::path video_path, int video_frame);
+  // An encoded file which exists only in memory, e.g. read from stdin. The
+  // name stands in for the path, the frames are decoded from the buffer.
+  Image(std::filesystem::path name,
+        std::shared_ptr<const std::vector<unsigned char>> encoded);
+  // Restores a previously loaded image, e.g. from the FeatureCache
+  Image(std::filesystem::path path, cv::Mat preview, cv::Mat thumbnail,
+        std::vector<cv::KeyPoint> keypoints, cv::Mat descriptors, bool is_raw);
 
   void Load(ImageLoadOptions options);
+  // Decodes an in-memory copy of the file, see ReadFileBytes
+  void Load(const std::vector<unsigned char>& encoded,
+            ImageLoadOptions options);
+  // Takes an already decoded 8-bit BGR frame
+  void LoadFrame(cv::Mat frame, ImageLoadOptions options);
+  // Coarse to fine: decodes the image again and detects the keypoints at
+  // options.detection_longer_side only inside the region, a CV_8U mask in
+  // preview coordinates. The keypoints replace the current ones, the matches
+  // of the image are no longer valid. Keeps the current ones if the image
+  // can't be decoded.
+  void DetectInRegion(const cv::Mat& region, ImageLoadOptions options);
 
+  // Decodes the file at full resolution, converted to 8-bit
   [[nodiscard]] cv::Mat GetFullRes() const;
   [[nodiscard]] cv::Mat GetThumbnail() const;
+  // Decodes a compressed preview through the shared LRU cache, see
+  // DecodePreview
   [[nodiscard]] cv::Mat GetPreview() const;
+  // Doesn't decode a compressed preview
+  [[nodiscard]] cv::Size GetPreviewSize() const;
   [[nodiscard]] int GetPreviewLongerSide() const;
+  // Held by the image, the compressed size of a compressed preview
+  [[nodiscard]] std::size_t GetPreviewBytes() const;
   [[nodiscard]] float GetAspect() const;
   [[nodiscard]] cv::Mat Draw(bool show_debug) const;
-  [[nodiscard]] const std::vector<cv::KeyPoint>& GetKeypoints() const;
+  // Returns only the positions after Compact()
+  [[nodiscard]] std::vector<cv::KeyPoint> GetKeypoints() const;
+  [[nodiscard]] int NumKeypoints() const;
+  [[nodiscard]] cv::Point2f GetKeypointPosition(int keypoint_id) const;
   [[nodiscard]] cv::Mat GetDescriptors() const;
+  // Empty until BuildDescriptorIndex() is called
+  [[nodiscard]] std::shared_ptr<const DescriptorIndex> GetDescriptorIndex()
+      const;
+  // DifferenceHash of the thumbnail, empty if the image isn't loaded
+  [[nodiscard]] std::optional<std::uint64_t> GetPerceptualHash() const;
   [[nodiscard]] bool IsLoaded() const;
+  // The video file for video frames
   [[nodiscard]] std::filesystem::path GetPath() const;
+  [[nodiscard]] std::optional<int> GetVideoFrame() const;
+  [[nodiscard]] bool IsInMemory() const;
+  // Unique per image and its decoded frames: the path, the frame of video
+  // frames and the lens profile
+  [[nodiscard]] std::string GetKey() const;
   [[nodiscard]] bool IsRaw() const;
+  // Applied to every decoded frame of the image, see lens::Undistort
+  [[nodiscard]] std::optional<LensProfile> GetLensProfile() const;
+  // The restored images are already undistorted, the later decoded frames
+  // are undistorted with the profile
+  void SetLensProfile(std::optional<LensProfile> profile);
   [[nodiscard]] std::string PanoName() const;
 
+  // Reduces the memory footprint of the detected features (~4x):
+  //  - SIFT descriptors are integers in [0, 255] stored as floats, converting
+  //    them to uint8 is lossless.
+  //  - Only the positions of the keypoints are kept.
+  void Compact();
+
+  // Keeps the preview JPEG-compressed (~10x smaller, lossy) and decodes it on
+  // demand in GetPreview(), for sessions of thousands of images. The decoded
+  // previews are shared by all images in a memory-budgeted LRU cache, see
+  // SetDecodedPreviewBudget.
+  void CompressPreview();
+  [[nodiscard]] bool IsPreviewCompressed() const;
+
+  // Prebuilds the search structure used by MatchImages, float descriptors
+  // (SIFT) only. Shared by all copies of the image.
+  void BuildDescriptorIndex();
+
  private:
   std::filesystem::path path_;
+  std::optional<int> video_frame_;
+  // Set for in-memory images, kept for the full resolution decoding
+  std::shared_ptr<const std::vector<unsigned char>> encoded_;
   cv::Mat preview_;
+  // Either preview_ or these are set, see CompressPreview
+  std::shared_ptr<const std::vector<unsigned char>> compressed_preview_;
+  std::uint64_t preview_id_ = 0;
+  cv::Size preview_size_;
   cv::Mat thumbnail_;
 
-  std::vector<cv::KeyPoint> keypoints_;
+  std::shared_ptr<const std::vector<cv::KeyPoint>> keypoints_;
+  std::shared_ptr<const std::vector<cv::Point2f>> keypoint_positions_;
   cv::Mat descriptors_;
+  std::shared_ptr<const DescriptorIndex> descriptor_index_;
+  std::optional<std::uint64_t> perceptual_hash_;
   bool is_raw_ = false;
+  std::optional<LensProfile> lens_;
 };
 
+// 64-bit difference hash (dHash): the signs of the horizontal gradients of
+// a 9x8 grayscale copy of the image. Near-identical images (bursts,
+// brackets) differ only in a few bits, see HashDistance.
+std::uint64_t DifferenceHash(const cv::Mat& image);
+
+int HashDistance(std::uint64_t hash1, std::uint64_t hash2);
+
+// Returns an empty vector if the file can't be read
+std::vector<unsigned char> ReadFileBytes(const std::filesystem::path& path);
+
 }  // namespace xpano::algorithm
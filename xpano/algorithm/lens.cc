@@ -0,0 +1,129 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/lens.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <filesystem>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "xpano/algorithm/options.h"
+#include "xpano/constants.h"
+#include "xpano/utils/exiv2.h"
+
+namespace xpano::algorithm::lens {
+
+namespace {
+
+struct RemapTables {
+  LensProfile profile;
+  cv::Size size;
+  cv::Mat map1;
+  cv::Mat map2;
+};
+
+RemapTables ComputeTables(const LensProfile& profile, const cv::Size& size) {
+  cv::Mat map_x(size, CV_32F);
+  cv::Mat map_y(size, CV_32F);
+  const float center_x = static_cast<float>(size.width - 1) / 2.0f;
+  const float center_y = static_cast<float>(size.height - 1) / 2.0f;
+  const float radius = std::hypot(static_cast<float>(size.width),
+                                  static_cast<float>(size.height)) /
+                       2.0f;
+  for (int row = 0; row < size.height; row++) {
+    auto* map_x_row = map_x.ptr<float>(row);
+    auto* map_y_row = map_y.ptr<float>(row);
+    const float dy = (static_cast<float>(row) - center_y) / radius;
+    for (int col = 0; col < size.width; col++) {
+      const float dx = (static_cast<float>(col) - center_x) / radius;
+      const float r2 = dx * dx + dy * dy;
+      const float scale = 1.0f + profile.k1 * r2 + profile.k2 * r2 * r2;
+      map_x_row[col] = center_x + dx * scale * radius;
+      map_y_row[col] = center_y + dy * scale * radius;
+    }
+  }
+  // Fixed point tables, cv::remap is faster with them
+  RemapTables tables{.profile = profile, .size = size};
+  cv::convertMaps(map_x, map_y, tables.map1, tables.map2, CV_16SC2);
+  return tables;
+}
+
+class RemapCache {
+ public:
+  RemapTables Get(const LensProfile& profile, const cv::Size& size) {
+    {
+      const std::lock_guard lock(mutex_);
+      auto iter = std::find_if(
+          tables_.begin(), tables_.end(), [&](const RemapTables& tables) {
+            return tables.profile.k1 == profile.k1 &&
+                   tables.profile.k2 == profile.k2 && tables.size == size;
+          });
+      if (iter != tables_.end()) {
+        tables_.splice(tables_.begin(), tables_, iter);
+        return tables_.front();
+      }
+    }
+    // Outside of the lock, images of other sizes are undistorted meanwhile
+    auto tables = ComputeTables(profile, size);
+    const std::lock_guard lock(mutex_);
+    tables_.push_front(tables);
+    if (tables_.size() > static_cast<std::size_t>(kLensMapCacheSize)) {
+      tables_.pop_back();
+    }
+    return tables;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::list<RemapTables> tables_;
+};
+
+RemapCache& Tables() {
+  static RemapCache cache;
+  return cache;
+}
+
+}  // namespace
+
+std::optional<LensProfile> PickProfile(const LensOptions& options,
+                                       const std::filesystem::path& path) {
+  if (!options.undistort || options.profiles.empty()) {
+    return {};
+  }
+  const auto any_named = std::any_of(
+      options.profiles.begin(), options.profiles.end(),
+      [](const LensProfile& profile) { return !profile.model.empty(); });
+  const std::string camera_model =
+      any_named ? utils::exiv2::ReadCameraModel(path) : std::string();
+  for (const auto& profile : options.profiles) {
+    if (camera_model.find(profile.model) == std::string::npos) {
+      continue;
+    }
+    if (profile.k1 == 0.0f && profile.k2 == 0.0f) {
+      return {};
+    }
+    return profile;
+  }
+  return {};
+}
+
+cv::Mat Undistort(const cv::Mat& image, const LensProfile& profile) {
+  if (image.empty()) {
+    return image;
+  }
+  const auto tables = Tables().Get(profile, image.size());
+  cv::Mat result;
+  cv::remap(image, result, tables.map1, tables.map2, cv::INTER_LINEAR,
+            cv::BORDER_CONSTANT);
+  return result;
+}
+
+}  // namespace xpano::algorithm::lens
@@ -0,0 +1,28 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <filesystem>
+#include <optional>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/algorithm/options.h"
+
+namespace xpano::algorithm::lens {
+
+// Empty if the options don't undistort the image or no profile matches
+std::optional<LensProfile> PickProfile(const LensOptions& options,
+                                       const std::filesystem::path& path);
+
+// Brown's radial model: a pixel at the distance r from the center of the
+// undistorted image comes from r * (1 + k1 * r^2 + k2 * r^4) in the source,
+// r relative to the half of the image diagonal. The result keeps the size of
+// the image, the parts outside of the source are black.
+//  - The remap tables are computed once per profile and image size and
+//    shared, the previews and the full resolution frames of a session each
+//    reuse theirs.
+cv::Mat Undistort(const cv::Mat& image, const LensProfile& profile);
+
+}  // namespace xpano::algorithm::lens
@@ -18,8 +18,25 @@ bool HasAdvancedParameters(ProjectionType projection_type) {
   }
 }
 
+bool HasBinaryDescriptors(FeatureType feature_type) {
+  return feature_type == FeatureType::kOrb ||
+         feature_type == FeatureType::kAkaze;
+}
+
+bool HasOpenCLDetector(FeatureType feature_type) {
+  return feature_type == FeatureType::kOrb;
+}
+
 // NOLINTEND(bugprone-branch-clone)
 
+SeamFinderType ResolveSeamFinder(SeamFinderType seam_finder_type,
+                                 bool preview) {
+  if (seam_finder_type != SeamFinderType::kAuto) {
+    return seam_finder_type;
+  }
+  return preview ? SeamFinderType::kDpColor : SeamFinderType::kGraphCut;
+}
+
 const char* Label(ProjectionType projection_type) {
   switch (projection_type) {
     case ProjectionType::kPerspective:
@@ -51,6 +68,43 @@ const char* Label(FeatureType feature_type) {
       return "SIFT";
     case FeatureType::kOrb:
       return "ORB";
+    case FeatureType::kAkaze:
+      return "AKAZE";
+    default:
+      return "Unknown";
+  }
+}
+
+const char* Label(DetectorBackend detector_backend) {
+  switch (detector_backend) {
+    case DetectorBackend::kCpu:
+      return "CPU";
+    case DetectorBackend::kOpenCL:
+      return "OpenCL";
+    default:
+      return "Unknown";
+  }
+}
+
+const char* Label(MatcherType matcher_type) {
+  switch (matcher_type) {
+    case MatcherType::kFlann:
+      return "FLANN";
+    case MatcherType::kBruteForce:
+      return "Brute force";
+    default:
+      return "Unknown";
+  }
+}
+
+const char* Label(HomographyMethod homography_method) {
+  switch (homography_method) {
+    case HomographyMethod::kRansac:
+      return "RANSAC";
+    case HomographyMethod::kUsacFast:
+      return "USAC fast";
+    case HomographyMethod::kUsacMagsac:
+      return "MAGSAC++";
     default:
       return "Unknown";
   }
@@ -88,6 +142,40 @@ const char* Label(BlendingMethod blending_method) {
       return "OpenCV";
     case BlendingMethod::kMultiblend:
       return "Multiblend";
+    case BlendingMethod::kFeather:
+      return "Feather";
+    case BlendingMethod::kSeamOnly:
+      return "Seam only";
+    default:
+      return "Unknown";
+  }
+}
+
+const char* Label(SeamFinderType seam_finder_type) {
+  switch (seam_finder_type) {
+    case SeamFinderType::kAuto:
+      return "Auto";
+    case SeamFinderType::kVoronoi:
+      return "Voronoi";
+    case SeamFinderType::kDpColor:
+      return "DP color";
+    case SeamFinderType::kGraphCut:
+      return "Graph cut";
+    default:
+      return "Unknown";
+  }
+}
+
+const char* Label(GridOrder grid_order) {
+  switch (grid_order) {
+    case GridOrder::kRows:
+      return "Rows";
+    case GridOrder::kRowsSerpentine:
+      return "Rows, serpentine";
+    case GridOrder::kColumns:
+      return "Columns";
+    case GridOrder::kColumnsSerpentine:
+      return "Columns, serpentine";
     default:
       return "Unknown";
   }
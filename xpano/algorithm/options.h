@@ -5,6 +5,8 @@
 
 #include <array>
 #include <cstdint>
+#include <string>
+#include <vector>
 
 #include "xpano/constants.h"
 
@@ -25,7 +27,17 @@ enum class ProjectionType : std::uint8_t {
   kTransverseMercator
 };
 
-enum class FeatureType : std::uint8_t { kSift, kOrb };
+enum class FeatureType : std::uint8_t { kSift, kOrb, kAkaze };
+
+enum class DetectorBackend : std::uint8_t { kCpu, kOpenCL };
+
+// kFlann: OpenCV matchers, kd-tree for SIFT and brute force for binary
+// descriptors. kBruteForce: exact search, see bf_matcher.h
+enum class MatcherType : std::uint8_t { kFlann, kBruteForce };
+
+// kRansac: classic RANSAC. kUsacFast, kUsacMagsac: OpenCV's USAC framework
+// with early termination, see cv::USAC_FAST and cv::USAC_MAGSAC
+enum class HomographyMethod : std::uint8_t { kRansac, kUsacFast, kUsacMagsac };
 
 enum class WaveCorrectionType : std::uint8_t {
   kOff,
@@ -39,16 +51,56 @@ enum class InpaintingMethod : std::uint8_t {
   kTelea,
 };
 
-enum class BlendingMethod : std::uint8_t { kOpenCV, kMultiblend };
+enum class BlendingMethod : std::uint8_t {
+  kOpenCV,
+  kMultiblend,
+  kFeather,
+  kSeamOnly
+};
+
+// kAuto: kDpColor for previews, kGraphCut for full resolution
+enum class SeamFinderType : std::uint8_t {
+  kAuto,
+  kVoronoi,
+  kDpColor,
+  kGraphCut
+};
+
+// Order in which a robotic head shoots a rows x cols grid:
+//  - kRows: each row left to right, top to bottom
+//  - kColumns: each column top to bottom, left to right
+//  - The serpentine variants reverse every other row / column
+enum class GridOrder : std::uint8_t {
+  kRows,
+  kRowsSerpentine,
+  kColumns,
+  kColumnsSerpentine
+};
 
 const char* Label(ProjectionType projection_type);
 const char* Label(FeatureType feature_type);
+const char* Label(DetectorBackend detector_backend);
+const char* Label(MatcherType matcher_type);
+const char* Label(HomographyMethod homography_method);
 const char* Label(WaveCorrectionType wave_correction_type);
 const char* Label(InpaintingMethod inpaint_method);
 const char* Label(BlendingMethod blending_method);
+const char* Label(SeamFinderType seam_finder_type);
+const char* Label(GridOrder grid_order);
 
 bool HasAdvancedParameters(ProjectionType projection_type);
 
+// ORB and AKAZE produce binary descriptors compared by the Hamming distance
+bool HasBinaryDescriptors(FeatureType feature_type);
+
+// Only ORB has OpenCL kernels in OpenCV, the other detectors would just copy
+// the image to the device and back
+bool HasOpenCLDetector(FeatureType feature_type);
+
+// Never returns kAuto
+SeamFinderType ResolveSeamFinder(SeamFinderType seam_finder_type,
+                                 bool preview);
+
 const auto kProjectionTypes = std::array{ProjectionType::kPerspective,
                                          ProjectionType::kCylindrical,
                                          ProjectionType::kSpherical,
@@ -59,7 +111,18 @@ const auto kProjectionTypes = std::array{ProjectionType::kPerspective,
                                          ProjectionType::kFisheye,
                                          ProjectionType::kStereographic};
 
-const auto kFeatureTypes = std::array{FeatureType::kSift, FeatureType::kOrb};
+const auto kFeatureTypes =
+    std::array{FeatureType::kSift, FeatureType::kOrb, FeatureType::kAkaze};
+
+const auto kDetectorBackends =
+    std::array{DetectorBackend::kCpu, DetectorBackend::kOpenCL};
+
+const auto kMatcherTypes =
+    std::array{MatcherType::kFlann, MatcherType::kBruteForce};
+
+const auto kHomographyMethods =
+    std::array{HomographyMethod::kRansac, HomographyMethod::kUsacFast,
+               HomographyMethod::kUsacMagsac};
 
 const auto kWaveCorrectionTypes =
     std::array{WaveCorrectionType::kOff, WaveCorrectionType::kAuto,
@@ -69,7 +132,20 @@ const auto kInpaintingMethods =
     std::array{InpaintingMethod::kNavierStokes, InpaintingMethod::kTelea};
 
 const auto kBlendingMethods =
-    std::array{BlendingMethod::kOpenCV, BlendingMethod::kMultiblend};
+    std::array{BlendingMethod::kOpenCV, BlendingMethod::kMultiblend,
+               BlendingMethod::kFeather, BlendingMethod::kSeamOnly};
+
+const auto kPreviewBlendingMethods =
+    std::array{BlendingMethod::kFeather, BlendingMethod::kSeamOnly,
+               BlendingMethod::kOpenCV};
+
+const auto kSeamFinderTypes =
+    std::array{SeamFinderType::kAuto, SeamFinderType::kVoronoi,
+               SeamFinderType::kDpColor, SeamFinderType::kGraphCut};
+
+const auto kGridOrders =
+    std::array{GridOrder::kRows, GridOrder::kRowsSerpentine,
+               GridOrder::kColumns, GridOrder::kColumnsSerpentine};
 
 #ifdef XPANO_WITH_MULTIBLEND
 const auto kDefaultBlendingMethod = BlendingMethod::kMultiblend;
@@ -83,6 +159,8 @@ struct ProjectionOptions {
   ProjectionType type = ProjectionType::kSpherical;
   float a_param = kDefaultPaniniA;
   float b_param = kDefaultPaniniB;
+
+  bool operator==(const ProjectionOptions&) const = default;
 };
 
 struct StitchUserOptions {
@@ -91,7 +169,58 @@ struct StitchUserOptions {
   WaveCorrectionType wave_correction = WaveCorrectionType::kAuto;
   float match_conf = kDefaultMatchConf;
   int max_pano_mpx = kMaxPanoMpx;
+  // Peak compositing memory, 0 means no limit, see Stitcher::SetMaxMemoryMb
+  int max_memory_mb = 0;
   BlendingMethod blending_method = kDefaultBlendingMethod;
+  // Used instead of blending_method for the interactive previews
+  BlendingMethod preview_blending_method = BlendingMethod::kFeather;
+  // Estimate the cameras from the features and matches of the loading
+  // pipeline instead of detecting and matching the features again
+  bool reuse_matches = true;
+  SeamFinderType seam_finder = SeamFinderType::kAuto;
+  // The full resolution pano reuses the exposure gains and seams of the
+  // preview instead of estimating them again, see Stitcher::SetSeamSource
+  bool reuse_preview_seams = false;
+  // Separate exposure gains of the color channels, for a varying white
+  // balance, see exposure_compensators::ParallelBlocksGain
+  bool exposure_per_channel = false;
+  // Keep the warped images, the blended pano and its display copy on the
+  // OpenCL device, see blenders::MultiBandOpenCV. Multiblend runs on the
+  // host, it's replaced by the OpenCV blender.
+  bool device_resident = false;
+
+  bool operator==(const StitchUserOptions&) const = default;
+};
+
+// Capture grid of the images in the input order, see GridPairs
+struct GridOptions {
+  int rows = 1;
+  int cols = 1;
+  GridOrder order = GridOrder::kRowsSerpentine;
+  // 8-neighbours instead of 4
+  bool diagonals = false;
+
+  bool operator==(const GridOptions&) const = default;
+};
+
+// Radial distortion of a lens, see lens::Undistort
+struct LensProfile {
+  // Matched against the Exif camera and lens, see utils::exiv2::
+  // ReadCameraModel. Empty matches every image.
+  std::string model;
+  float k1 = 0.0f;
+  float k2 = 0.0f;
+
+  bool operator==(const LensProfile&) const = default;
+};
+
+struct LensOptions {
+  bool undistort = false;
+  // The first profile with its model contained in the camera model of the
+  // image applies, the images without any are left as they are
+  std::vector<LensProfile> profiles;
+
+  bool operator==(const LensOptions&) const = default;
 };
 
 struct InpaintingOptions {
@@ -0,0 +1,135 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/preview_store.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include "xpano/constants.h"
+#include "xpano/utils/memory.h"
+
+namespace xpano::algorithm {
+
+namespace {
+
+using utils::memory::Category;
+
+class DecodedPreviews {
+ public:
+  void SetBudget(std::size_t budget_bytes) {
+    const std::lock_guard lock(mutex_);
+    budget_bytes_ = budget_bytes;
+    Evict();
+  }
+
+  cv::Mat Get(std::uint64_t id, const std::vector<unsigned char>& encoded) {
+    {
+      const std::lock_guard lock(mutex_);
+      if (auto iter = index_.find(id); iter != index_.end()) {
+        entries_.splice(entries_.begin(), entries_, iter->second);
+        stats_.hits++;
+        return iter->second->preview;
+      }
+      stats_.misses++;
+    }
+    // Decode outside of the lock, multiple previews can be decoded in
+    // parallel
+    auto preview = cv::imdecode(encoded, cv::IMREAD_COLOR);
+    if (!preview.empty()) {
+      Insert(id, preview);
+    }
+    return preview;
+  }
+
+  DecodedPreviewStats Stats() const {
+    const std::lock_guard lock(mutex_);
+    return stats_;
+  }
+
+  void Clear() {
+    const std::lock_guard lock(mutex_);
+    entries_.clear();
+    index_.clear();
+    utils::memory::Add(Category::kDecodedPreviews,
+                       -static_cast<std::int64_t>(stats_.bytes_used));
+    stats_.bytes_used = 0;
+  }
+
+ private:
+  struct Entry {
+    std::uint64_t id;
+    cv::Mat preview;
+    std::size_t bytes;
+  };
+
+  void Insert(std::uint64_t id, const cv::Mat& preview) {
+    const std::size_t bytes = preview.total() * preview.elemSize();
+    const std::lock_guard lock(mutex_);
+    if (bytes > budget_bytes_ || index_.contains(id)) {
+      return;
+    }
+    entries_.push_front({id, preview, bytes});
+    index_[id] = entries_.begin();
+    stats_.bytes_used += bytes;
+    utils::memory::Add(Category::kDecodedPreviews,
+                       static_cast<std::int64_t>(bytes));
+    Evict();
+  }
+
+  void Evict() {
+    std::size_t evicted_bytes = 0;
+    while (stats_.bytes_used > budget_bytes_) {
+      const auto& last = entries_.back();
+      stats_.bytes_used -= last.bytes;
+      evicted_bytes += last.bytes;
+      index_.erase(last.id);
+      entries_.pop_back();
+    }
+    utils::memory::Add(Category::kDecodedPreviews,
+                       -static_cast<std::int64_t>(evicted_bytes));
+  }
+
+  std::size_t budget_bytes_ =
+      static_cast<std::size_t>(kDefaultDecodedPreviewCacheMB) * kMegabyte;
+
+  mutable std::mutex mutex_;
+  std::list<Entry> entries_;
+  std::unordered_map<std::uint64_t, std::list<Entry>::iterator> index_;
+  DecodedPreviewStats stats_;
+};
+
+DecodedPreviews& Previews() {
+  static DecodedPreviews previews;
+  return previews;
+}
+
+}  // namespace
+
+void SetDecodedPreviewBudget(std::size_t budget_bytes) {
+  Previews().SetBudget(budget_bytes);
+}
+
+cv::Mat DecodePreview(std::uint64_t id,
+                      const std::vector<unsigned char>& encoded) {
+  return Previews().Get(id, encoded);
+}
+
+std::uint64_t NextPreviewId() {
+  static std::atomic<std::uint64_t> next_id = 1;
+  return next_id++;
+}
+
+DecodedPreviewStats GetDecodedPreviewStats() { return Previews().Stats(); }
+
+void ClearDecodedPreviews() { Previews().Clear(); }
+
+}  // namespace xpano::algorithm
@@ -0,0 +1,37 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace xpano::algorithm {
+
+struct DecodedPreviewStats {
+  int hits = 0;
+  int misses = 0;
+  std::size_t bytes_used = 0;
+};
+
+// Process wide thread safe LRU cache of the decoded compressed previews, see
+// Image::CompressPreview.
+//  - Least recently used previews are evicted once the budget is exceeded.
+//  - The returned cv::Mat shares the cached buffer, don't modify it in place.
+void SetDecodedPreviewBudget(std::size_t budget_bytes);
+
+// The id is unique per compressed preview, shared by the copies of the image
+cv::Mat DecodePreview(std::uint64_t id,
+                      const std::vector<unsigned char>& encoded);
+
+// New id for the next compressed preview
+std::uint64_t NextPreviewId();
+
+DecodedPreviewStats GetDecodedPreviewStats();
+
+void ClearDecodedPreviews();
+
+}  // namespace xpano::algorithm
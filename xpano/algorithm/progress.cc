@@ -3,8 +3,55 @@
 
 #include "xpano/algorithm/progress.h"
 
+#include <mutex>
+
 namespace xpano::algorithm {
 
+const char* Label(ProgressType type) {
+  switch (type) {
+    default:
+      return "";
+    case ProgressType::kLoadingImages:
+      return "Loading images";
+    case ProgressType::kStitchingPano:
+      return "Stitching pano";
+    case ProgressType::kAutoCrop:
+      return "Auto crop";
+    case ProgressType::kDetectingKeypoints:
+      return "Detecting keypoints";
+    case ProgressType::kMatchingImages:
+      return "Matching images";
+    case ProgressType::kRetrievingCandidates:
+      return "Finding similar images";
+    case ProgressType::kRefiningMatches:
+      return "Refining matches";
+    case ProgressType::kExport:
+      return "Exporting pano";
+    case ProgressType::kInpainting:
+      return "Auto fill";
+    case ProgressType::kStitchFindFeatures:
+      return "Finding features";
+    case ProgressType::kStitchMatchFeatures:
+      return "Matching features";
+    case ProgressType::kStitchEstimateHomography:
+      return "Estimating homography";
+    case ProgressType::kStitchBundleAdjustment:
+      return "Bundle adjustment";
+    case ProgressType::kStitchComputeRoi:
+      return "Computing pano size";
+    case ProgressType::kStitchSeamsPrepare:
+      return "Preparing seams";
+    case ProgressType::kStitchSeamsFind:
+      return "Finding seams";
+    case ProgressType::kStitchCompose:
+      return "Composing pano";
+    case ProgressType::kStitchBlend:
+      return "Blending";
+    case ProgressType::kCancelling:
+      return "Cancelling";
+  }
+}
+
 void ProgressMonitor::Reset(ProgressType type, int num_tasks) {
   type_ = type;
   done_ = 0;
@@ -24,7 +71,18 @@ ProgressReport ProgressMonitor::Report() const {
 
 void ProgressMonitor::NotifyTaskDone() { done_++; }
 
-void ProgressMonitor::Cancel() { cancel_ = true; }
+void ProgressMonitor::Cancel() {
+  cancel_ = true;
+  Notify();
+}
+
+void ProgressMonitor::Notify() {
+  // Waiters are either before the check of done() or already waiting
+  {
+    const std::lock_guard lock(mutex_);
+  }
+  wake_.notify_all();
+}
 
 bool ProgressMonitor::IsCancelled() const { return cancel_; }
 
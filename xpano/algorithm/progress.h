@@ -4,7 +4,9 @@
 #pragma once
 
 #include <atomic>
+#include <condition_variable>
 #include <cstdint>
+#include <mutex>
 
 namespace xpano::algorithm {
 
@@ -15,6 +17,8 @@ enum class ProgressType : std::uint8_t {
   kAutoCrop,
   kDetectingKeypoints,
   kMatchingImages,
+  kRetrievingCandidates,
+  kRefiningMatches,
   kExport,
   kInpainting,
   kStitchFindFeatures,
@@ -29,6 +33,9 @@ enum class ProgressType : std::uint8_t {
   kCancelling
 };
 
+// Shown in the GUI and used as the trace span names
+const char* Label(ProgressType type);
+
 struct ProgressReport {
   ProgressType type = ProgressType::kNone;
   int tasks_done = 0;
@@ -45,7 +52,25 @@ class ProgressMonitor {
   void Cancel();
   [[nodiscard]] bool IsCancelled() const;
 
+  // Blocks until done() returns true or the task is cancelled, done() is
+  // checked again on every Notify() and Cancel(). Returns the last done().
+  template <typename TDone>
+  bool WaitUntil(TDone done) {
+    std::unique_lock lock(mutex_);
+    bool finished = false;
+    wake_.wait(lock, [&]() {
+      finished = done();
+      return finished || IsCancelled();
+    });
+    return finished;
+  }
+
+  // Wakes WaitUntil(), call after changing what its done() checks
+  void Notify();
+
  private:
+  std::mutex mutex_;
+  std::condition_variable wake_;
   std::atomic<ProgressType> type_{ProgressType::kNone};
   std::atomic<int> done_ = 0;
   std::atomic<int> num_tasks_ = 0;
@@ -0,0 +1,254 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/reproject.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <optional>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/stitching/detail/util.hpp>
+#include <opencv2/stitching/detail/warpers.hpp>
+
+#include "xpano/algorithm/algorithm.h"
+#include "xpano/algorithm/options.h"
+#include "xpano/utils/opencv.h"
+
+namespace xpano::algorithm {
+
+namespace {
+
+constexpr int kBorderSamples = 32;
+
+bool HasClosedForm(ProjectionType projection) {
+  return projection == ProjectionType::kPerspective ||
+         projection == ProjectionType::kCylindrical ||
+         projection == ProjectionType::kSpherical ||
+         projection == ProjectionType::kMercator;
+}
+
+// The fast warpers derive from these, the portrait variants don't
+std::optional<ProjectionType> SourceProjection(
+    const cv::detail::RotationWarper* warper) {
+  if (dynamic_cast<const cv::detail::PlaneWarper*>(warper) != nullptr) {
+    return ProjectionType::kPerspective;
+  }
+  if (dynamic_cast<const cv::detail::CylindricalWarper*>(warper) != nullptr) {
+    return ProjectionType::kCylindrical;
+  }
+  if (dynamic_cast<const cv::detail::SphericalWarper*>(warper) != nullptr) {
+    return ProjectionType::kSpherical;
+  }
+  if (dynamic_cast<const cv::detail::MercatorWarper*>(warper) != nullptr) {
+    return ProjectionType::kMercator;
+  }
+  return {};
+}
+
+// Mirrors the projector's mapForward, in the units of the warper scale
+std::optional<cv::Point2d> Forward(ProjectionType projection,
+                                   const cv::Vec3d& ray) {
+  const double horizontal = std::hypot(ray[0], ray[2]);
+  switch (projection) {
+    case ProjectionType::kPerspective:
+      if (ray[2] <= 0.0) {
+        return {};
+      }
+      return cv::Point2d{ray[0] / ray[2], ray[1] / ray[2]};
+    case ProjectionType::kCylindrical:
+      if (horizontal <= 0.0) {
+        return {};
+      }
+      return cv::Point2d{std::atan2(ray[0], ray[2]), ray[1] / horizontal};
+    case ProjectionType::kSpherical:
+      return cv::Point2d{std::atan2(ray[0], ray[2]),
+                         CV_PI - std::acos(ray[1] / cv::norm(ray))};
+    case ProjectionType::kMercator:
+      if (horizontal <= 0.0) {
+        return {};
+      }
+      return cv::Point2d{std::atan2(ray[0], ray[2]),
+                         std::asinh(ray[1] / horizontal)};
+    default:
+      return {};
+  }
+}
+
+// Mirrors the projector's mapBackward, see fast::Projection in warpers.cc
+cv::Vec3d Backward(ProjectionType projection, const cv::Point2d& point) {
+  switch (projection) {
+    case ProjectionType::kPerspective:
+      return {point.x, point.y, 1.0};
+    case ProjectionType::kCylindrical:
+      return {std::sin(point.x), point.y, std::cos(point.x)};
+    case ProjectionType::kSpherical: {
+      const double radius = std::sin(CV_PI - point.y);
+      return {radius * std::sin(point.x), std::cos(CV_PI - point.y),
+              radius * std::cos(point.x)};
+    }
+    case ProjectionType::kMercator: {
+      const double latitude = std::atan(std::sinh(point.y));
+      return {std::cos(latitude) * std::sin(point.x), std::sin(latitude),
+              std::cos(latitude) * std::cos(point.x)};
+    }
+    default:
+      return {0.0, 0.0, 0.0};
+  }
+}
+
+struct Bounds {
+  double min_x = std::numeric_limits<double>::max();
+  double min_y = std::numeric_limits<double>::max();
+  double max_x = std::numeric_limits<double>::lowest();
+  double max_y = std::numeric_limits<double>::lowest();
+
+  void Add(const cv::Point2d& point) {
+    min_x = std::min(min_x, point.x);
+    min_y = std::min(min_y, point.y);
+    max_x = std::max(max_x, point.x);
+    max_y = std::max(max_y, point.y);
+  }
+};
+
+// Same as the warper's warpRoi over all images, but for any rotation and
+// closed-form projection, in the units of the warper scale
+std::optional<cv::Rect2d> PanoRoi(
+    const std::vector<cv::detail::CameraParams>& cameras,
+    const std::vector<cv::Size>& sizes, const cv::Matx33d& rotation,
+    ProjectionType projection) {
+  Bounds bounds;
+  for (int i = 0; i < cameras.size(); i++) {
+    const cv::Matx33d k_mat = cameras[i].K();
+    cv::Mat r_mat;
+    cameras[i].R.convertTo(r_mat, CV_64F);
+    const cv::Matx33d to_world = rotation * cv::Matx33d(r_mat) * k_mat.inv();
+
+    const auto width = static_cast<double>(sizes[i].width);
+    const auto height = static_cast<double>(sizes[i].height);
+    for (int sample = 0; sample <= kBorderSamples; sample++) {
+      const double alpha = static_cast<double>(sample) / kBorderSamples;
+      for (const auto& pixel :
+           {cv::Vec3d{alpha * width, 0.0, 1.0},
+            cv::Vec3d{alpha * width, height, 1.0},
+            cv::Vec3d{0.0, alpha * height, 1.0},
+            cv::Vec3d{width, alpha * height, 1.0}}) {
+        auto point = Forward(projection, to_world * pixel);
+        if (!point) {
+          return {};
+        }
+        bounds.Add(*point);
+      }
+    }
+
+    // An image containing a pole is not bounded by its border
+    for (const double pole : {-1.0, 1.0}) {
+      const cv::Vec3d pixel = to_world.inv() * cv::Vec3d{0.0, pole, 0.0};
+      if (pixel[2] <= 0.0 || pixel[0] < 0.0 || pixel[0] > pixel[2] * width ||
+          pixel[1] < 0.0 || pixel[1] > pixel[2] * height) {
+        continue;
+      }
+      if (projection != ProjectionType::kSpherical) {
+        return {};
+      }
+      bounds.Add({-CV_PI, pole > 0.0 ? CV_PI : 0.0});
+      bounds.Add({CV_PI, pole > 0.0 ? CV_PI : 0.0});
+    }
+  }
+  if (bounds.max_x <= bounds.min_x || bounds.max_y <= bounds.min_y) {
+    return {};
+  }
+  return cv::Rect2d{cv::Point2d{bounds.min_x, bounds.min_y},
+                    cv::Point2d{bounds.max_x, bounds.max_y}};
+}
+
+}  // namespace
+
+std::optional<ProjectionType> ComposedProjection(const Cameras& cameras) {
+  return SourceProjection(cameras.warp_helper.warper.get());
+}
+
+std::optional<cv::Mat> Reproject(const cv::Mat& pano, const Cameras& cameras,
+                                 const ReprojectOptions& options) {
+  const auto& warp_helper = cameras.warp_helper;
+  if (pano.empty() || !warp_helper.warper || warp_helper.corners.empty()) {
+    return {};
+  }
+  auto source = ComposedProjection(cameras);
+  if (!source) {
+    return {};
+  }
+  const auto target = options.projection.value_or(*source);
+  if (!HasClosedForm(target)) {
+    return {};
+  }
+
+  cv::Matx33d rotation = cv::Matx33d::eye();
+  if (!options.rotation_matrix.empty()) {
+    cv::Mat rotation_matrix;
+    options.rotation_matrix.convertTo(rotation_matrix, CV_64F);
+    rotation = cv::Matx33d(rotation_matrix);
+  }
+
+  const double scale = warp_helper.warper->getScale();
+  const auto src_roi =
+      cv::detail::resultRoi(warp_helper.corners, warp_helper.sizes);
+  // Pano pixels per warped pixel, the preview pano can be downscaled
+  const double pano_ratio = static_cast<double>(pano.cols) / src_roi.width;
+
+  cv::Rect2d dst_roi = src_roi;
+  if (target != *source) {
+    auto full_res_cameras =
+        utils::opencv::Scale(cameras.cameras, 1.0 / warp_helper.work_scale);
+    auto roi = PanoRoi(full_res_cameras, warp_helper.full_sizes, rotation,
+                       target);
+    if (!roi) {
+      return {};
+    }
+    dst_roi = {roi->tl() * scale, roi->br() * scale};
+  }
+
+  const double longer_side =
+      std::max(dst_roi.width, dst_roi.height) * pano_ratio;
+  const double dst_ratio =
+      pano_ratio * std::min(1.0, options.max_longer_side / longer_side);
+  const cv::Size dst_size{
+      std::max(1, static_cast<int>(std::lround(dst_roi.width * dst_ratio))),
+      std::max(1, static_cast<int>(std::lround(dst_roi.height * dst_ratio)))};
+
+  // Pano pixel of the ray through each result pixel
+  cv::Mat xmap(dst_size, CV_32F);
+  cv::Mat ymap(dst_size, CV_32F);
+  const cv::Matx33d inverse_rotation = rotation.t();
+  cv::parallel_for_(cv::Range(0, dst_size.height), [&](const cv::Range& rows) {
+    for (int row = rows.start; row < rows.end; row++) {
+      auto* xmap_row = xmap.ptr<float>(row);
+      auto* ymap_row = ymap.ptr<float>(row);
+      for (int col = 0; col < dst_size.width; col++) {
+        const cv::Point2d dst_point = {
+            (dst_roi.x + col / dst_ratio) / scale,
+            (dst_roi.y + row / dst_ratio) / scale};
+        auto src_point = Forward(
+            *source, inverse_rotation * Backward(target, dst_point));
+        if (!src_point) {
+          xmap_row[col] = -1.0f;
+          ymap_row[col] = -1.0f;
+          continue;
+        }
+        xmap_row[col] =
+            static_cast<float>((src_point->x * scale - src_roi.x) * pano_ratio);
+        ymap_row[col] =
+            static_cast<float>((src_point->y * scale - src_roi.y) * pano_ratio);
+      }
+    }
+  });
+
+  cv::Mat result;
+  cv::remap(pano, result, xmap, ymap, cv::INTER_LINEAR, cv::BORDER_CONSTANT);
+  return result;
+}
+
+}  // namespace xpano::algorithm
@@ -0,0 +1,39 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <optional>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/algorithm/algorithm.h"
+#include "xpano/algorithm/options.h"
+#include "xpano/constants.h"
+
+namespace xpano::algorithm {
+
+struct ReprojectOptions {
+  // Applied on top of the cameras, see Rotate, empty for no rotation
+  cv::Mat rotation_matrix;
+  // Projection of the composed pano when empty
+  std::optional<ProjectionType> projection;
+  int max_longer_side = kReprojectionLongerSide;
+};
+
+// Projection of the pano composed with the cameras, empty when it has no
+// closed-form ray mapping
+std::optional<ProjectionType> ComposedProjection(const Cameras& cameras);
+
+// Pano composed with the cameras remapped directly into another rotation /
+// projection with a single remap, without warping the source images again.
+//  - Only an approximation of the recomposed pano, the parts missing from the
+//    composed pano stay black, used for previews while the user adjusts.
+//  - The result keeps the pano ROI when the projection doesn't change, so
+//    that it stays aligned with the rotation widget.
+//  - Empty for projections without a closed-form ray mapping and for the
+//    portrait variants of projections.
+std::optional<cv::Mat> Reproject(const cv::Mat& pano, const Cameras& cameras,
+                                 const ReprojectOptions& options);
+
+}  // namespace xpano::algorithm
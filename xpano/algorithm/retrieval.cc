@@ -0,0 +1,135 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/retrieval.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+#include <set>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+
+#include "xpano/algorithm/image.h"
+#include "xpano/constants.h"
+#include "xpano/utils/opencv.h"
+
+namespace xpano::algorithm::retrieval {
+
+namespace {
+
+constexpr int kKmeansIterations = 10;
+constexpr int kCandidatesBlockSize = 256;
+
+cv::Mat FloatDescriptors(const Image& image) {
+  auto descriptors = image.GetDescriptors();
+  return descriptors.depth() == CV_32F ? descriptors
+                                       : utils::opencv::ToFloat(descriptors);
+}
+
+// Signed square root, reduces the influence of bursty visual words
+void PowerNormalize(cv::Mat* vector) {
+  for (auto& value : cv::Mat_<float>(*vector)) {
+    value = value >= 0.0f ? std::sqrt(value) : -std::sqrt(-value);
+  }
+  cv::normalize(*vector, *vector);
+}
+
+}  // namespace
+
+cv::Mat TrainVocabulary(const std::vector<Image>& images, int num_words) {
+  int total_descriptors = 0;
+  for (const auto& image : images) {
+    total_descriptors += image.GetDescriptors().rows;
+  }
+  if (total_descriptors < num_words) {
+    return {};
+  }
+
+  // Uniform subsample of all descriptors
+  const int step = std::max(1, total_descriptors / kRetrievalMaxSamples);
+  cv::Mat samples;
+  for (const auto& image : images) {
+    auto descriptors = FloatDescriptors(image);
+    for (int row = 0; row < descriptors.rows; row += step) {
+      samples.push_back(descriptors.row(row));
+    }
+  }
+
+  cv::Mat labels;
+  cv::Mat vocabulary;
+  const cv::TermCriteria criteria(
+      cv::TermCriteria::MAX_ITER | cv::TermCriteria::EPS, kKmeansIterations,
+      1.0);
+  cv::kmeans(samples, num_words, labels, criteria, 1, cv::KMEANS_PP_CENTERS,
+             vocabulary);
+  return vocabulary;
+}
+
+cv::Mat Describe(const Image& image, const cv::Mat& vocabulary) {
+  cv::Mat vlad = cv::Mat::zeros(vocabulary.rows, vocabulary.cols, CV_32F);
+  auto descriptors = FloatDescriptors(image);
+  if (!descriptors.empty()) {
+    std::vector<cv::DMatch> words;
+    const cv::BFMatcher matcher(cv::NORM_L2);
+    matcher.match(descriptors, vocabulary, words);
+    for (const auto& word : words) {
+      vlad.row(word.trainIdx) +=
+          descriptors.row(word.queryIdx) - vocabulary.row(word.trainIdx);
+    }
+  }
+  vlad = vlad.reshape(1, 1);
+  PowerNormalize(&vlad);
+  return vlad;
+}
+
+std::vector<std::pair<int, int>> FindCandidates(
+    const std::vector<cv::Mat>& descriptors, int num_candidates) {
+  const int num_images = static_cast<int>(descriptors.size());
+  num_candidates = std::min(num_candidates, num_images - 1);
+  if (num_candidates <= 0) {
+    return {};
+  }
+
+  cv::Mat all_descriptors;
+  cv::vconcat(descriptors, all_descriptors);
+
+  // The similarity search below is quadratic, but only in short vectors
+  const int num_dims = std::min(kRetrievalDims, num_images);
+  const cv::PCA pca(all_descriptors, cv::noArray(), cv::PCA::DATA_AS_ROW,
+                    num_dims);
+  cv::Mat projected = pca.project(all_descriptors);
+  for (int row = 0; row < projected.rows; row++) {
+    cv::Mat projected_row = projected.row(row);
+    cv::normalize(projected_row, projected_row);
+  }
+
+  std::set<std::pair<int, int>> candidates;
+  std::vector<int> order(num_images);
+  for (int begin = 0; begin < num_images; begin += kCandidatesBlockSize) {
+    const int end = std::min(begin + kCandidatesBlockSize, num_images);
+    cv::Mat similarity;
+    cv::gemm(projected.rowRange(begin, end), projected, 1.0, cv::noArray(), 0.0,
+             similarity, cv::GEMM_2_T);
+
+    for (int i = begin; i < end; i++) {
+      const auto* row = similarity.ptr<float>(i - begin);
+      std::iota(order.begin(), order.end(), 0);
+      // +1 for the image itself
+      std::partial_sort(
+          order.begin(), order.begin() + num_candidates + 1, order.end(),
+          [row](int lhs, int rhs) { return row[lhs] > row[rhs]; });
+      for (int k = 0; k < num_candidates + 1; k++) {
+        if (const int j = order[k]; j != i) {
+          candidates.emplace(std::min(i, j), std::max(i, j));
+        }
+      }
+    }
+  }
+  return {candidates.begin(), candidates.end()};
+}
+
+}  // namespace xpano::algorithm::retrieval
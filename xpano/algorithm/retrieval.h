@@ -0,0 +1,33 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/algorithm/image.h"
+
+namespace xpano::algorithm::retrieval {
+
+// Global image descriptors used to propose matching candidates in
+// collections which are not sorted in capture order:
+//  1. TrainVocabulary clusters a sample of the keypoint descriptors of all
+//     images.
+//  2. Describe computes a VLAD vector for each image (sum of the residuals
+//     to the nearest visual word, power and L2 normalized).
+//  3. FindCandidates compresses the vectors with PCA and returns the most
+//     similar images for each image.
+
+cv::Mat TrainVocabulary(const std::vector<Image>& images, int num_words);
+
+// Returns a 1 x (num_words * descriptor_size) CV_32F row
+cv::Mat Describe(const Image& image, const cv::Mat& vocabulary);
+
+// Pairs (i, j) with i < j, each image contributes up to num_candidates pairs
+std::vector<std::pair<int, int>> FindCandidates(
+    const std::vector<cv::Mat>& descriptors, int num_candidates);
+
+}  // namespace xpano::algorithm::retrieval
@@ -0,0 +1,95 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/rle_mask.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <span>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace xpano::algorithm {
+
+namespace {
+
+constexpr unsigned char kDecodedValueOn = 0xFF;
+
+std::vector<RleMask::Run> EncodeRow(const unsigned char* row, int cols) {
+  std::vector<RleMask::Run> runs;
+  const auto* end = row + cols;
+  const auto* pos = row;
+  while (pos != end) {
+    const auto* start = std::find_if(pos, end, [](auto value) {
+      return value != 0;
+    });
+    if (start == end) {
+      break;
+    }
+    pos = std::find(start, end, 0);
+    runs.push_back(
+        {static_cast<int>(start - row), static_cast<int>(pos - row)});
+  }
+  return runs;
+}
+
+}  // namespace
+
+RleMask::RleMask(const cv::Mat& mask) : size_(mask.size()) {
+  CV_Assert(mask.empty() || mask.type() == CV_8U);
+  std::vector<std::vector<Run>> rows(mask.rows);
+  cv::parallel_for_(cv::Range(0, mask.rows), [&](const cv::Range& range) {
+    for (int row = range.start; row < range.end; row++) {
+      rows[row] = EncodeRow(mask.ptr<unsigned char>(row), mask.cols);
+    }
+  });
+
+  row_offsets_.resize(mask.rows + 1);
+  for (int row = 0; row < mask.rows; row++) {
+    row_offsets_[row + 1] = row_offsets_[row] + rows[row].size();
+  }
+  runs_.reserve(row_offsets_.back());
+  for (const auto& row_runs : rows) {
+    runs_.insert(runs_.end(), row_runs.begin(), row_runs.end());
+  }
+}
+
+std::span<const RleMask::Run> RleMask::Row(int row) const {
+  return std::span(runs_).subspan(
+      row_offsets_[row], row_offsets_[row + 1] - row_offsets_[row]);
+}
+
+std::int64_t RleMask::CountSet() const {
+  return std::accumulate(runs_.begin(), runs_.end(), std::int64_t{0},
+                         [](std::int64_t sum, const Run& run) {
+                           return sum + run.end - run.start;
+                         });
+}
+
+std::size_t RleMask::Bytes() const {
+  return runs_.size() * sizeof(Run) +
+         row_offsets_.size() * sizeof(std::size_t);
+}
+
+cv::Mat RleMask::Decode() const { return Decode(kDecodedValueOn, 0); }
+
+cv::Mat RleMask::DecodeUnset() const { return Decode(0, kDecodedValueOn); }
+
+cv::Mat RleMask::Decode(unsigned char set_value,
+                        unsigned char unset_value) const {
+  cv::Mat mask(size_, CV_8U, cv::Scalar(unset_value));
+  cv::parallel_for_(cv::Range(0, Rows()), [&](const cv::Range& range) {
+    for (int row = range.start; row < range.end; row++) {
+      auto* dst = mask.ptr<unsigned char>(row);
+      for (const auto& run : Row(row)) {
+        std::fill(dst + run.start, dst + run.end, set_value);
+      }
+    }
+  });
+  return mask;
+}
+
+}  // namespace xpano::algorithm
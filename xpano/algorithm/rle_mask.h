@@ -0,0 +1,55 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+namespace xpano::algorithm {
+
+// Binary mask stored as the runs of set (non-zero) pixels of each row.
+//  - Masks of warped panos are a few long runs per row, a fraction of the
+//    size of the full 8-bit mask.
+//  - Counting the set pixels is proportional to the number of runs.
+class RleMask {
+ public:
+  struct Run {
+    int start;
+    int end;
+
+    bool operator==(const Run&) const = default;
+  };
+
+  RleMask() = default;
+  // Encodes the rows of a CV_8U mask in parallel
+  explicit RleMask(const cv::Mat& mask);
+
+  [[nodiscard]] bool Empty() const { return size_.empty(); }
+  [[nodiscard]] cv::Size Size() const { return size_; }
+  [[nodiscard]] int Rows() const { return size_.height; }
+  [[nodiscard]] int Cols() const { return size_.width; }
+
+  [[nodiscard]] std::span<const Run> Row(int row) const;
+  [[nodiscard]] std::int64_t CountSet() const;
+  [[nodiscard]] std::size_t Bytes() const;
+
+  // Set pixels are 0xFF, the rest 0
+  [[nodiscard]] cv::Mat Decode() const;
+  // Unset pixels are 0xFF, the rest 0, e.g. the pixels to inpaint
+  [[nodiscard]] cv::Mat DecodeUnset() const;
+
+ private:
+  cv::Mat Decode(unsigned char set_value, unsigned char unset_value) const;
+
+  cv::Size size_;
+  std::vector<Run> runs_;
+  // Runs of a row are runs_[row_offsets_[row], row_offsets_[row + 1])
+  std::vector<std::size_t> row_offsets_;
+};
+
+}  // namespace xpano::algorithm
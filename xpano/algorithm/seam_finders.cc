@@ -0,0 +1,251 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-License-Identifier: Apache-2.0
+//
+///////////////////////////////////////////////////////////////////////////////////////
+//
+//  IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+//
+//  By downloading, copying, installing or using the software you agree to this
+//  license. If you do not agree to this license, do not download, install, copy
+//  or use the software.
+//
+//
+//                          License Agreement
+//                For Open Source Computer Vision Library
+//
+// Copyright (C) 2000-2008, Intel Corporation, all rights reserved.
+// Copyright (C) 2009, Willow Garage Inc., all rights reserved.
+// Third party copyrights are property of their respective owners.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//   * Redistribution's of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistribution's in binary form must reproduce the above copyright
+//   notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   * The name of the copyright holders may not be used to endorse or promote
+//   products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is"
+// and any express or implied warranties, including, but not limited to, the
+// implied warranties of merchantability and fitness for a particular purpose
+// are disclaimed. In no event shall the Intel Corporation or contributors be
+// liable for any direct, indirect, incidental, special, exemplary, or
+// consequential damages (including, but not limited to, procurement of
+// substitute goods or services; loss of use, data, or profits; or business
+// interruption) however caused and on any theory of liability, whether in
+// contract, strict liability, or tort (including negligence or otherwise)
+// arising in any way out of the use of this software, even if advised of the
+// possibility of such damage.
+//
+
+#include "xpano/algorithm/seam_finders.h"
+
+#include <algorithm>
+#include <future>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc/detail/gcgraph.hpp>
+#include <opencv2/stitching.hpp>
+
+#include "xpano/utils/threadpool.h"
+
+namespace xpano::algorithm::seam_finders {
+
+namespace {
+
+// Color differences are squared, same as cv::detail::normL2
+float SquaredDistance(const cv::Point3f &lhs, const cv::Point3f &rhs) {
+  const cv::Point3f diff = lhs - rhs;
+  return diff.x * diff.x + diff.y * diff.y + diff.z * diff.z;
+}
+
+void SetGraphWeightsColor(const cv::Mat &img1, const cv::Mat &img2,
+                          const cv::Mat &mask1, const cv::Mat &mask2,
+                          float terminal_cost, float bad_region_penalty,
+                          cv::detail::GCGraph<float> *graph) {
+  const cv::Size img_size = img1.size();
+
+  // Set terminal weights
+  for (int y = 0; y < img_size.height; ++y) {
+    for (int x = 0; x < img_size.width; ++x) {
+      const int vertex = graph->addVtx();
+      graph->addTermWeights(vertex,
+                            mask1.at<uchar>(y, x) ? terminal_cost : 0.f,
+                            mask2.at<uchar>(y, x) ? terminal_cost : 0.f);
+    }
+  }
+
+  // Set regular edge weights
+  const float weight_eps = 1.f;
+  for (int y = 0; y < img_size.height; ++y) {
+    for (int x = 0; x < img_size.width; ++x) {
+      const int vertex = y * img_size.width + x;
+      if (x < img_size.width - 1) {
+        float weight = SquaredDistance(img1.at<cv::Point3f>(y, x),
+                                       img2.at<cv::Point3f>(y, x)) +
+                       SquaredDistance(img1.at<cv::Point3f>(y, x + 1),
+                                       img2.at<cv::Point3f>(y, x + 1)) +
+                       weight_eps;
+        if (!mask1.at<uchar>(y, x) || !mask1.at<uchar>(y, x + 1) ||
+            !mask2.at<uchar>(y, x) || !mask2.at<uchar>(y, x + 1)) {
+          weight += bad_region_penalty;
+        }
+        graph->addEdges(vertex, vertex + 1, weight, weight);
+      }
+      if (y < img_size.height - 1) {
+        float weight = SquaredDistance(img1.at<cv::Point3f>(y, x),
+                                       img2.at<cv::Point3f>(y, x)) +
+                       SquaredDistance(img1.at<cv::Point3f>(y + 1, x),
+                                       img2.at<cv::Point3f>(y + 1, x)) +
+                       weight_eps;
+        if (!mask1.at<uchar>(y, x) || !mask1.at<uchar>(y + 1, x) ||
+            !mask2.at<uchar>(y, x) || !mask2.at<uchar>(y + 1, x)) {
+          weight += bad_region_penalty;
+        }
+        graph->addEdges(vertex, vertex + img_size.width, weight, weight);
+      }
+    }
+  }
+}
+
+// Image and mask around roi with a gap, zero outside of the image
+void CutWithGap(const cv::Mat &img, const cv::Mat &mask, cv::Point tl,
+                const cv::Rect &roi, int gap, cv::Mat *subimg,
+                cv::Mat *submask) {
+  const cv::Size size(roi.width + 2 * gap, roi.height + 2 * gap);
+  *subimg = cv::Mat::zeros(size, CV_32FC3);
+  *submask = cv::Mat::zeros(size, CV_8U);
+
+  const cv::Rect cut(roi.x - tl.x - gap, roi.y - tl.y - gap, size.width,
+                     size.height);
+  const cv::Rect valid = cut & cv::Rect(cv::Point(), img.size());
+  if (valid.empty()) {
+    return;
+  }
+  const cv::Rect dst(valid.tl() - cut.tl(), valid.size());
+  img(valid).copyTo((*subimg)(dst));
+  mask(valid).copyTo((*submask)(dst));
+}
+
+}  // namespace
+
+void ParallelGraphCut::find(const std::vector<cv::UMat> &src,
+                            const std::vector<cv::Point> &corners,
+                            std::vector<cv::UMat> &masks) {
+  if (src.empty()) {
+    return;
+  }
+
+  std::vector<cv::Mat> images(src.size());
+  std::vector<cv::Mat> mask_mats(src.size());
+  std::vector<cv::Size> sizes(src.size());
+  for (size_t i = 0; i < src.size(); ++i) {
+    CV_Assert(src[i].type() == CV_32FC3);
+    src[i].copyTo(images[i]);
+    masks[i].copyTo(mask_mats[i]);
+    sizes[i] = src[i].size();
+  }
+
+  // Same pair order as cv::detail::PairwiseSeamFinder
+  std::vector<std::vector<Pair>> rounds;
+  std::vector<int> next_round(src.size(), 0);
+  for (size_t i = 0; i + 1 < src.size(); ++i) {
+    for (size_t j = i + 1; j < src.size(); ++j) {
+      cv::Rect roi;
+      if (!cv::detail::overlapRoi(corners[i], corners[j], sizes[i], sizes[j],
+                                  roi)) {
+        continue;
+      }
+      const int round = std::max(next_round[i], next_round[j]);
+      if (round == static_cast<int>(rounds.size())) {
+        rounds.emplace_back();
+      }
+      rounds[round].push_back({i, j, roi});
+      next_round[i] = next_round[j] = round + 1;
+    }
+  }
+
+  const bool parallel =
+      threadpool_ != nullptr && threadpool_->get_thread_count() > 1;
+  for (const auto &round : rounds) {
+    if (!parallel || round.size() == 1) {
+      for (const auto &pair : round) {
+        FindInPair(pair, images, corners, &mask_mats);
+      }
+      continue;
+    }
+
+    utils::mt::MultiFuture<void> round_future;
+    for (const auto &pair : round) {
+      round_future.push_back(
+          threadpool_->submit([this, &pair, &images, &corners, &mask_mats]() {
+            FindInPair(pair, images, corners, &mask_mats);
+          }));
+    }
+    // The tasks reference the locals, wait for all of them first
+    round_future.wait();
+    try {
+      round_future.get();
+    } catch (const std::future_error &) {
+      // A task was dropped without running, the masks are incomplete, the
+      // caller checks for cancellation
+      return;
+    }
+  }
+
+  for (size_t i = 0; i < masks.size(); ++i) {
+    mask_mats[i].copyTo(masks[i]);
+  }
+}
+
+void ParallelGraphCut::FindInPair(const Pair &pair,
+                                  const std::vector<cv::Mat> &images,
+                                  const std::vector<cv::Point> &corners,
+                                  std::vector<cv::Mat> *masks) const {
+  cv::Mat &mask1 = (*masks)[pair.first];
+  cv::Mat &mask2 = (*masks)[pair.second];
+  const cv::Point tl1 = corners[pair.first];
+  const cv::Point tl2 = corners[pair.second];
+  const cv::Rect &roi = pair.roi;
+
+  const int gap = 10;
+  cv::Mat subimg1;
+  cv::Mat subimg2;
+  cv::Mat submask1;
+  cv::Mat submask2;
+  CutWithGap(images[pair.first], mask1, tl1, roi, gap, &subimg1, &submask1);
+  CutWithGap(images[pair.second], mask2, tl2, roi, gap, &subimg2, &submask2);
+
+  const int vertex_count = (roi.height + 2 * gap) * (roi.width + 2 * gap);
+  const int edge_count = (roi.height - 1 + 2 * gap) * (roi.width + 2 * gap) +
+                         (roi.width - 1 + 2 * gap) * (roi.height + 2 * gap);
+  cv::detail::GCGraph<float> graph(vertex_count, edge_count);
+  SetGraphWeightsColor(subimg1, subimg2, submask1, submask2, terminal_cost_,
+                       bad_region_penalty_, &graph);
+  graph.maxFlow();
+
+  for (int y = 0; y < roi.height; ++y) {
+    for (int x = 0; x < roi.width; ++x) {
+      auto &value1 = mask1.at<uchar>(roi.y - tl1.y + y, roi.x - tl1.x + x);
+      auto &value2 = mask2.at<uchar>(roi.y - tl2.y + y, roi.x - tl2.x + x);
+      if (graph.inSourceSegment((y + gap) * (roi.width + 2 * gap) + x + gap)) {
+        if (value1 != 0) {
+          value2 = 0;
+        }
+      } else if (value2 != 0) {
+        value1 = 0;
+      }
+    }
+  }
+}
+
+}  // namespace xpano::algorithm::seam_finders
@@ -0,0 +1,95 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+// SPDX-License-Identifier: Apache-2.0
+//
+///////////////////////////////////////////////////////////////////////////////////////
+//
+//  IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+//
+//  By downloading, copying, installing or using the software you agree to this
+//  license. If you do not agree to this license, do not download, install, copy
+//  or use the software.
+//
+//
+//                          License Agreement
+//                For Open Source Computer Vision Library
+//
+// Copyright (C) 2000-2008, Intel Corporation, all rights reserved.
+// Copyright (C) 2009, Willow Garage Inc., all rights reserved.
+// Third party copyrights are property of their respective owners.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+//   * Redistribution's of source code must retain the above copyright notice,
+//     this list of conditions and the following disclaimer.
+//
+//   * Redistribution's in binary form must reproduce the above copyright
+//   notice,
+//     this list of conditions and the following disclaimer in the documentation
+//     and/or other materials provided with the distribution.
+//
+//   * The name of the copyright holders may not be used to endorse or promote
+//   products
+//     derived from this software without specific prior written permission.
+//
+// This software is provided by the copyright holders and contributors "as is"
+// and any express or implied warranties, including, but not limited to, the
+// implied warranties of merchantability and fitness for a particular purpose
+// are disclaimed. In no event shall the Intel Corporation or contributors be
+// liable for any direct, indirect, incidental, special, exemplary, or
+// consequential damages (including, but not limited to, procurement of
+// substitute goods or services; loss of use, data, or profits; or business
+// interruption) however caused and on any theory of liability, whether in
+// contract, strict liability, or tort (including negligence or otherwise)
+// arising in any way out of the use of this software, even if advised of the
+// possibility of such damage.
+//
+
+#pragma once
+
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/stitching.hpp>
+
+#include "xpano/utils/threadpool.h"
+
+namespace xpano::algorithm::seam_finders {
+
+// Same results as cv::detail::GraphCutSeamFinder with COST_COLOR, with the
+// overlapping pairs solved concurrently:
+//  - Every pair reads and writes only the masks of its two images.
+//  - The pairs are scheduled in rounds, a pair runs one round after the last
+//    earlier pair sharing an image, so the pairs of a round don't share any
+//    images and every mask sees its pairs in the serial order.
+class ParallelGraphCut : public cv::detail::SeamFinder {
+ public:
+  explicit ParallelGraphCut(utils::mt::Threadpool* threadpool,
+                            float terminal_cost = 10000.f,
+                            float bad_region_penalty = 1000.f)
+      : threadpool_(threadpool),
+        terminal_cost_(terminal_cost),
+        bad_region_penalty_(bad_region_penalty) {}
+
+  void find(const std::vector<cv::UMat>& src,
+            const std::vector<cv::Point>& corners,
+            std::vector<cv::UMat>& masks) override;
+
+ private:
+  struct Pair {
+    size_t first;
+    size_t second;
+    cv::Rect roi;
+  };
+
+  void FindInPair(const Pair& pair, const std::vector<cv::Mat>& images,
+                  const std::vector<cv::Point>& corners,
+                  std::vector<cv::Mat>* masks) const;
+
+  utils::mt::Threadpool* threadpool_;
+  float terminal_cost_;
+  float bad_region_penalty_;
+};
+
+}  // namespace xpano::algorithm::seam_finders
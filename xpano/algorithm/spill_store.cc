@@ -0,0 +1,105 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/spill_store.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "xpano/utils/fmt.h"
+#include "xpano/utils/path.h"
+
+namespace xpano::algorithm {
+
+SpillStore::SpillStore(SpillOptions options) : options_(std::move(options)) {}
+
+SpillStore::~SpillStore() {
+  if (!dir_) {
+    return;
+  }
+  std::error_code error;
+  std::filesystem::remove_all(*dir_, error);
+  if (error) {
+    spdlog::warn("Failed to remove spill directory {}: {}", dir_->string(),
+                 error.message());
+  }
+}
+
+bool SpillStore::Spill(Id id, const std::vector<std::uint8_t>& data,
+                       std::filesystem::path* path) {
+  if (!dir_) {
+    dir_ = utils::path::CreateUniqueDir(options_.dir, "xpano-spill");
+    if (!dir_) {
+      spdlog::warn("Failed to create a spill directory in {}",
+                   options_.dir.string());
+      // Not retried for every buffer
+      options_.threshold_bytes = std::numeric_limits<std::size_t>::max();
+      return false;
+    }
+  }
+  *path = *dir_ / fmt::format("{}.bin", id);
+  std::ofstream stream(*path, std::ios::binary | std::ios::trunc);
+  stream.write(reinterpret_cast<const char*>(data.data()),
+               static_cast<std::streamsize>(data.size()));
+  stream.close();
+  if (!stream) {
+    spdlog::warn("Failed to spill {} bytes to {}", data.size(),
+                 path->string());
+    std::error_code error;
+    std::filesystem::remove(*path, error);
+    return false;
+  }
+  return true;
+}
+
+SpillStore::Id SpillStore::Put(std::vector<std::uint8_t> data) {
+  const auto id = static_cast<Id>(entries_.size());
+  Entry entry{.size = data.size()};
+  std::filesystem::path path;
+  if (in_memory_bytes_ + data.size() > options_.threshold_bytes &&
+      Spill(id, data, &path)) {
+    entry.path = std::move(path);
+    spilled_bytes_ += entry.size;
+  } else {
+    entry.data = std::move(data);
+    in_memory_bytes_ += entry.size;
+  }
+  entries_.push_back(std::move(entry));
+  return id;
+}
+
+std::vector<std::uint8_t> SpillStore::Take(Id id) {
+  auto& entry = entries_.at(id);
+  if (!entry.path) {
+    in_memory_bytes_ -= entry.size;
+    return std::move(entry.data);
+  }
+
+  std::vector<std::uint8_t> data(entry.size);
+  {
+    std::ifstream stream(*entry.path, std::ios::binary);
+    stream.read(reinterpret_cast<char*>(data.data()),
+                static_cast<std::streamsize>(data.size()));
+    if (!stream) {
+      throw std::runtime_error(
+          fmt::format("Failed to read spilled {}", entry.path->string()));
+    }
+  }
+  std::error_code error;
+  std::filesystem::remove(*entry.path, error);
+  spilled_bytes_ -= entry.size;
+  entry.path.reset();
+  return data;
+}
+
+}  // namespace xpano::algorithm
@@ -0,0 +1,60 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+namespace xpano::algorithm {
+
+struct SpillOptions {
+  // Scratch directory, a fresh subdirectory is created inside
+  std::filesystem::path dir;
+  // Buffers are kept in memory up to this total, the rest goes to disk
+  std::size_t threshold_bytes = 0;
+};
+
+// Byte buffers moved out to scratch files and back, e.g. the warped images
+// waiting for the blender.
+//  - Buffers are kept in memory while their total stays under the threshold,
+//    Put() writes them to disk once it would be exceeded.
+//  - Take() returns the buffer and deletes its file.
+//  - The scratch subdirectory is removed with the store.
+// A buffer that can't be written stays in memory, spilling is best effort.
+class SpillStore {
+ public:
+  using Id = int;
+
+  explicit SpillStore(SpillOptions options);
+  SpillStore(const SpillStore&) = delete;
+  SpillStore& operator=(const SpillStore&) = delete;
+  ~SpillStore();
+
+  Id Put(std::vector<std::uint8_t> data);
+  [[nodiscard]] std::vector<std::uint8_t> Take(Id id);
+
+  [[nodiscard]] std::size_t InMemoryBytes() const { return in_memory_bytes_; }
+  [[nodiscard]] std::size_t SpilledBytes() const { return spilled_bytes_; }
+
+ private:
+  struct Entry {
+    std::vector<std::uint8_t> data;
+    std::optional<std::filesystem::path> path;
+    std::size_t size = 0;
+  };
+
+  [[nodiscard]] bool Spill(Id id, const std::vector<std::uint8_t>& data,
+                           std::filesystem::path* path);
+
+  SpillOptions options_;
+  std::optional<std::filesystem::path> dir_;
+  std::vector<Entry> entries_;
+  std::size_t in_memory_bytes_ = 0;
+  std::size_t spilled_bytes_ = 0;
+};
+
+}  // namespace xpano::algorithm
@@ -51,24 +51,128 @@
 #include <algorithm>
 #include <cmath>
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <optional>
 #include <string_view>
 #include <utility>
 #include <vector>
 
+#include <opencv2/calib3d.hpp>
 #include <spdlog/common.h>
 #include <spdlog/spdlog.h>
 
+#include "xpano/algorithm/blenders.h"
 #include "xpano/algorithm/progress.h"
+#include "xpano/utils/memory.h"
 #include "xpano/utils/opencv.h"
+#include "xpano/utils/parallel_for.h"
 
 namespace xpano::algorithm::stitcher {
 
 namespace {
 
-constexpr unsigned char kMaskValueOn = 0xFF;
+// Tiled compositing
+constexpr int kSourceBlockSize = 512;
+constexpr int kSourceBlockPadding = 8;
+constexpr int kTileMargin = 128;
+
+// Seam refinement: the seams move at most this many pixels per level, the
+// levels smaller than the step aren't worth another pass
+constexpr int kSeamBandRadius = 8;
+constexpr double kMinSeamRefinementStep = 1.25;
+
+// Compositing warp maps reused by the recompositions, enough for previews
+constexpr size_t kWarpMapCacheBytes = size_t{256} * 1024 * 1024;
+// Free compositing buffers kept for the next images and stitches
+constexpr size_t kBufferPoolRetainBytes = size_t{256} * 1024 * 1024;
+
+// Memory estimate, bytes per pixel
+constexpr double kBytesPerMb = 1024.0 * 1024.0;
+constexpr double kImageBytesPerPixel = 3.0;   // CV_8UC3
+constexpr double kResultBytesPerPixel = 4.0;  // CV_8UC3 pano + CV_8U mask
+// Warped image + mask + the pyramids built by the blender while feeding it
+constexpr double kWarpedBytesPerPixel = 18.0;
+// Warped seam estimation images, CV_8UC3 + CV_32FC3 + masks
+constexpr double kSeamBytesPerPixel = 17.0;
+// Warped seam refinement images, CV_8UC3 + masks, see RefineSeams
+constexpr double kRefinedSeamBytesPerPixel = 5.0;
+// Laplacian pyramid levels add up to a third of the base level
+constexpr double kPyramidFactor = 4.0 / 3.0;
+// CV_16SC3 accumulator + CV_32F weights + CV_8U mask
+constexpr double kMultiBandBytesPerPixel = kPyramidFactor * (6.0 + 4.0) + 1.0;
+constexpr double kFeatherBytesPerPixel = 6.0 + 4.0 + 1.0;
 
 using ProgressType = algorithm::ProgressType;
+using utils::memory::Category;
+
+struct BlenderCost {
+  double bytes_per_pixel = kMultiBandBytesPerPixel;
+  bool keeps_warped_images = true;
+};
+
+// Other blenders (multiblend) keep all the warped images until blending
+BlenderCost CostOf(const cv::detail::Blender *blender) {
+  if (dynamic_cast<const cv::detail::MultiBandBlender *>(blender) != nullptr ||
+      dynamic_cast<const blenders::MultiBandOpenCV *>(blender) != nullptr) {
+    return {.keeps_warped_images = false};
+  }
+  if (dynamic_cast<const cv::detail::FeatherBlender *>(blender) != nullptr) {
+    return {.bytes_per_pixel = kFeatherBytesPerPixel,
+            .keeps_warped_images = false};
+  }
+  return {};
+}
+
+std::int64_t UMatBytes(const cv::UMat &mat) {
+  return static_cast<std::int64_t>(mat.total() * mat.elemSize());
+}
+
+std::int64_t UMatBytes(const std::vector<cv::UMat> &mats) {
+  std::int64_t bytes = 0;
+  for (const auto &mat : mats) {
+    bytes += UMatBytes(mat);
+  }
+  return bytes;
+}
+
+// Same as warping an all-on mask with INTER_NEAREST and BORDER_CONSTANT:
+// nearest rounds the map coordinates, up to rounding ties at the edges
+void MaskFromMaps(const WarpMaps &maps, const cv::Size &src_size,
+                  BufferPool *pool, cv::UMat *mask) {
+  const cv::Size size = maps.xmap.size();
+  cv::UMat x_valid = pool->Acquire(size, CV_8U);
+  cv::UMat y_valid = pool->Acquire(size, CV_8U);
+  *mask = pool->Acquire(size, CV_8U);
+  cv::inRange(maps.xmap, -0.5, src_size.width - 0.5, x_valid);
+  cv::inRange(maps.ymap, -0.5, src_size.height - 0.5, y_valid);
+  cv::bitwise_and(x_valid, y_valid, *mask);
+}
+
+// Fused image + mask warp, the remap tables are built only once
+cv::Point WarpWithMask(const cv::UMat &img, const WarpMaps &maps,
+                       int interp_flags, BufferPool *pool, cv::UMat *warped,
+                       cv::UMat *mask) {
+  *warped = pool->Acquire(maps.xmap.size(), img.type());
+  cv::remap(img, *warped, maps.xmap, maps.ymap, interp_flags,
+            cv::BORDER_REFLECT);
+  MaskFromMaps(maps, img.size(), pool, mask);
+  return maps.dst_roi.tl();
+}
+
+WarpMaps BuildMaps(cv::detail::RotationWarper *warper,
+                   const cv::Size &src_size, const cv::Mat &k_float,
+                   const cv::Mat &rotation) {
+  WarpMaps maps;
+  maps.dst_roi =
+      warper->buildMaps(src_size, k_float, rotation, maps.xmap, maps.ymap);
+  return maps;
+}
 
 class Timer {
  public:
@@ -102,6 +206,26 @@ class Timer {
   int64 start_count_ = 0;
 };
 
+// Waits for the pending futures when going out of scope
+template <typename TResult>
+class FinishAll {
+ public:
+  explicit FinishAll(std::deque<std::future<TResult>> *futures)
+      : futures_(futures) {}
+  FinishAll(const FinishAll &) = delete;
+  FinishAll &operator=(const FinishAll &) = delete;
+  ~FinishAll() {
+    for (auto &future : *futures_) {
+      if (future.valid()) {
+        future.wait();
+      }
+    }
+  }
+
+ private:
+  std::deque<std::future<TResult>> *futures_;
+};
+
 double ComputeWarpScale(const std::vector<cv::detail::CameraParams> &cameras) {
   std::vector<double> focals(cameras.size());
   std::transform(cameras.begin(), cameras.end(), focals.begin(),
@@ -134,13 +258,6 @@ std::vector<TType> Index(const std::vector<TType> &vec,
   return subset;
 }
 
-struct Roi {
-  std::vector<cv::Point> corners;
-  std::vector<cv::Size> sizes;
-  cv::Ptr<cv::detail::RotationWarper> warper;
-  cv::Rect rect;
-};
-
 Roi ComputeRoi(const std::vector<cv::detail::CameraParams> &cameras_scaled,
                std::vector<cv::Size> full_img_sizes,
                const cv::Ptr<cv::WarperCreator> &warper_creater,
@@ -168,6 +285,53 @@ Roi ComputeRoi(const std::vector<cv::detail::CameraParams> &cameras_scaled,
   return {corners, sizes, warper, dst_roi};
 }
 
+bool Equal(const cv::Mat &lhs, const cv::Mat &rhs) {
+  return lhs.size() == rhs.size() && lhs.type() == rhs.type() &&
+         (lhs.empty() || cv::norm(lhs, rhs, cv::NORM_INF) == 0.0);
+}
+
+bool Equal(const cv::detail::CameraParams &lhs,
+           const cv::detail::CameraParams &rhs) {
+  return lhs.focal == rhs.focal && lhs.aspect == rhs.aspect &&
+         lhs.ppx == rhs.ppx && lhs.ppy == rhs.ppy && Equal(lhs.R, rhs.R) &&
+         Equal(lhs.t, rhs.t);
+}
+
+// Truncates like utils::GetCvRect, which crops the composed pano otherwise
+cv::Rect CropRect(const cv::Rect &rect, const cv::Rect2f &relative_crop) {
+  const cv::Rect crop(
+      rect.x + static_cast<int>(static_cast<float>(rect.width) *
+                                relative_crop.x),
+      rect.y + static_cast<int>(static_cast<float>(rect.height) *
+                                relative_crop.y),
+      static_cast<int>(static_cast<float>(rect.width) * relative_crop.width),
+      static_cast<int>(static_cast<float>(rect.height) *
+                       relative_crop.height));
+  return crop & rect;
+}
+
+// Camera of the image crop starting at offset
+cv::Mat ShiftedK(const cv::detail::CameraParams &camera, cv::Point offset) {
+  cv::Mat k_float = utils::opencv::ToFloat(camera.K());
+  k_float.at<float>(0, 2) -= static_cast<float>(offset.x);
+  k_float.at<float>(1, 2) -= static_cast<float>(offset.y);
+  return k_float;
+}
+
+// Part of the map as if it was resized to full_size with INTER_LINEAR
+cv::Mat ResizedRegion(const cv::Mat &map, const cv::Size &full_size,
+                      const cv::Rect &region) {
+  const double scale_x = static_cast<double>(map.cols) / full_size.width;
+  const double scale_y = static_cast<double>(map.rows) / full_size.height;
+  const cv::Matx23d transform(scale_x, 0, (region.x + 0.5) * scale_x - 0.5,
+                              0, scale_y, (region.y + 0.5) * scale_y - 0.5);
+  cv::Mat result;
+  cv::warpAffine(map, result, transform, region.size(),
+                 cv::INTER_LINEAR | cv::WARP_INVERSE_MAP,
+                 cv::BORDER_REPLICATE);
+  return result;
+}
+
 }  // namespace
 
 bool IsSuccess(Status status) {
@@ -224,7 +388,7 @@ cv::Ptr<Stitcher> Stitcher::Create(Mode mode) {
 
 Status Stitcher::EstimateTransform(cv::InputArrayOfArrays images,
                                    cv::InputArrayOfArrays masks) {
-  images.getUMatVector(imgs_);
+  SetImages(images);
   masks.getUMatVector(masks_);
 
   if (auto status = MatchImages(); status != Status::kSuccess) {
@@ -238,41 +402,53 @@ Status Stitcher::EstimateTransform(cv::InputArrayOfArrays images,
   return Status::kSuccess;
 }
 
+Status Stitcher::EstimateTransform(
+    cv::InputArrayOfArrays images,
+    std::vector<cv::detail::ImageFeatures> features,
+    std::vector<cv::detail::MatchesInfo> pairwise_matches) {
+  SetImages(images);
+  masks_.clear();
+
+  if (auto status =
+          UseFeatures(std::move(features), std::move(pairwise_matches));
+      status != Status::kSuccess) {
+    return status;
+  }
+
+  if (auto status = EstimateCameraParams(); status != Status::kSuccess) {
+    return status;
+  }
+
+  return Status::kSuccess;
+}
+
 Status Stitcher::EstimateSeams(std::vector<cv::UMat> *seams) {
   auto seam_timer = Timer();
 
-  std::vector<cv::UMat> masks(imgs_.size());
-  std::vector<cv::Point> corners(imgs_.size());
-  std::vector<cv::Size> sizes(imgs_.size());
+  std::vector<cv::Point> corners(NumImages());
+  std::vector<cv::Size> sizes(NumImages());
 
-  std::vector<cv::UMat> masks_warped(imgs_.size());
-  std::vector<cv::UMat> images_warped(imgs_.size());
-
-  // Prepare image masks
-  for (size_t i = 0; i < imgs_.size(); ++i) {
-    masks[i].create(seam_est_imgs_[i].size(), CV_8U);
-    masks[i].setTo(cv::Scalar::all(kMaskValueOn));
-  }
+  std::vector<cv::UMat> masks_warped(NumImages());
+  std::vector<cv::UMat> images_warped(NumImages());
 
   // Warp images and their masks
   const cv::Ptr<cv::detail::RotationWarper> warper = warper_creater_->create(
       static_cast<float>(warped_image_scale_ * seam_work_aspect_));
   auto seam_cameras = utils::opencv::Scale(cameras_, seam_work_aspect_);
-  for (size_t i = 0; i < imgs_.size(); ++i) {
+  for (size_t i = 0; i < NumImages(); ++i) {
     auto k_float = utils::opencv::ToFloat(seam_cameras[i].K());
 
-    corners[i] =
-        warper->warp(seam_est_imgs_[i], k_float, cameras_[i].R, interp_flags_,
-                     cv::BORDER_REFLECT, images_warped[i]);
+    const auto maps = BuildMaps(warper.get(), seam_est_imgs_[i].size(),
+                                k_float, cameras_[i].R);
+    corners[i] = WarpWithMask(seam_est_imgs_[i], maps, interp_flags_,
+                              buffer_pool_.get(), &images_warped[i],
+                              &masks_warped[i]);
     sizes[i] = images_warped[i].size();
-
-    warper->warp(masks[i], k_float, cameras_[i].R, cv::INTER_NEAREST,
-                 cv::BORDER_CONSTANT, masks_warped[i]);
   }
 
   // Compensate exposure before finding seams
   exposure_comp_->feed(corners, images_warped, masks_warped);
-  for (size_t i = 0; i < imgs_.size(); ++i) {
+  for (size_t i = 0; i < NumImages(); ++i) {
     exposure_comp_->apply(static_cast<int>(i), corners[i], images_warped[i],
                           masks_warped[i]);
   }
@@ -283,8 +459,8 @@ Status Stitcher::EstimateSeams(std::vector<cv::UMat> *seams) {
   NextTask(ProgressType::kStitchSeamsFind);
 
   // Find seams
-  std::vector<cv::UMat> images_warped_f(imgs_.size());
-  for (size_t i = 0; i < imgs_.size(); ++i) {
+  std::vector<cv::UMat> images_warped_f(NumImages());
+  for (size_t i = 0; i < NumImages(); ++i) {
     images_warped[i].convertTo(images_warped_f[i], CV_32F);
   }
   seam_finder_->find(images_warped_f, corners, masks_warped);
@@ -292,117 +468,548 @@ Status Stitcher::EstimateSeams(std::vector<cv::UMat> *seams) {
   seam_timer.Report("Finding seams");
 
   *seams = std::move(masks_warped);
+  return RefineSeams(seams);
+}
+
+double Stitcher::RefinedSeamScale() const {
+  if (seam_refine_resol_ <= seam_est_resol_ || NumImages() == 0) {
+    return seam_scale_;
+  }
+  // Previews when the full resolution images are loaded only for compositing
+  const double available_scale =
+      full_res_source_ ? static_cast<double>(imgs_[0].cols) /
+                             full_img_sizes_[0].width
+                       : 1.0;
+  const double max_scale =
+      std::min(ComputeSeamScale(full_img_sizes_[0], seam_refine_resol_),
+               available_scale);
+  return max_scale >= kMinSeamRefinementStep * seam_scale_ ? max_scale
+                                                           : seam_scale_;
+}
+
+Status Stitcher::RefineSeams(std::vector<cv::UMat> *seams) {
+  const double max_scale = RefinedSeamScale();
+  if (max_scale == seam_scale_) {
+    return Status::kSuccess;
+  }
+
+  auto refine_timer = Timer();
+  double scale = seam_scale_;
+  while (scale * kMinSeamRefinementStep <= max_scale) {
+    scale = std::min(2.0 * scale, max_scale);
+    if (auto status = RefineSeamsAt(scale, seams); status != Status::kSuccess) {
+      return status;
+    }
+  }
+  refine_timer.Report("Refining seams");
+  return Status::kSuccess;
+}
+
+Status Stitcher::RefineSeamsAt(double scale, std::vector<cv::UMat> *seams) {
+  const double work_aspect = scale / work_scale_;
+  const cv::Ptr<cv::detail::RotationWarper> warper = warper_creater_->create(
+      static_cast<float>(warped_image_scale_ * work_aspect));
+  auto level_cameras = utils::opencv::Scale(cameras_, work_aspect);
+
+  std::vector<cv::Point> corners(NumImages());
+  std::vector<cv::Mat> images(NumImages());
+  std::vector<cv::Mat> valid(NumImages());
+  std::vector<cv::Mat> masks(NumImages());
+  for (size_t i = 0; i < NumImages(); ++i) {
+    const cv::UMat image = ScaledImage(i, scale);
+    const auto maps =
+        BuildMaps(warper.get(), image.size(),
+                  utils::opencv::ToFloat(level_cameras[i].K()), cameras_[i].R);
+    cv::UMat image_warped;
+    cv::UMat mask_warped;
+    corners[i] = WarpWithMask(image, maps, interp_flags_, buffer_pool_.get(),
+                              &image_warped, &mask_warped);
+    exposure_comp_->apply(static_cast<int>(i), corners[i], image_warped,
+                          mask_warped);
+    image_warped.copyTo(images[i]);
+    mask_warped.copyTo(valid[i]);
+    cv::resize((*seams)[i], masks[i], mask_warped.size(), 0, 0,
+               cv::INTER_NEAREST);
+    cv::bitwise_and(masks[i], valid[i], masks[i]);
+  }
+
+  // Same pair order as cv::detail::PairwiseSeamFinder, every pair sees the
+  // masks refined by the earlier pairs
+  const cv::Mat band_kernel = cv::getStructuringElement(
+      cv::MORPH_ELLIPSE, {2 * kSeamBandRadius + 1, 2 * kSeamBandRadius + 1});
+  for (size_t i = 0; i + 1 < NumImages(); ++i) {
+    for (size_t j = i + 1; j < NumImages(); ++j) {
+      if (Cancelled()) {
+        return Status::kCancelled;
+      }
+      const cv::Rect roi =
+          cv::Rect(corners[i], images[i].size()) &
+          cv::Rect(corners[j], images[j].size());
+      if (roi.empty()) {
+        continue;
+      }
+      const cv::Rect roi1 = roi - corners[i];
+      const cv::Rect roi2 = roi - corners[j];
+      cv::Mat seam1 = masks[i](roi1);
+      cv::Mat seam2 = masks[j](roi2);
+
+      // Where the upscaled seams of the two images meet
+      cv::Mat contact1;
+      cv::Mat contact2;
+      cv::dilate(seam1, contact1, cv::Mat());
+      cv::dilate(seam2, contact2, cv::Mat());
+      const cv::Mat contact = (contact1 & seam2) | (contact2 & seam1);
+      if (cv::countNonZero(contact) == 0) {
+        continue;
+      }
+
+      // Pixels of the two images valid in both, the pixels given to other
+      // images by the earlier pairs stay theirs
+      cv::Mat band;
+      cv::dilate(contact, band, band_kernel);
+      band &= (seam1 | seam2) & valid[i](roi1) & valid[j](roi2);
+      if (cv::countNonZero(band) == 0) {
+        continue;
+      }
+      const cv::Rect box =
+          (cv::boundingRect(band) + cv::Point(-1, -1) + cv::Size(2, 2)) &
+          cv::Rect({0, 0}, roi.size());
+
+      std::vector<cv::UMat> pair_images(2);
+      images[i](roi1)(box).convertTo(pair_images[0], CV_32F);
+      images[j](roi2)(box).convertTo(pair_images[1], CV_32F);
+      std::vector<cv::UMat> pair_masks(2);
+      cv::bitwise_or(seam1(box), band(box), pair_masks[0]);
+      cv::bitwise_or(seam2(box), band(box), pair_masks[1]);
+      const cv::Point corner = roi.tl() + box.tl();
+      seam_finder_->find(pair_images, {corner, corner}, pair_masks);
+
+      // Only the band pixels given to exactly one of the images
+      const cv::Mat refined1 = pair_masks[0].getMat(cv::ACCESS_READ);
+      const cv::Mat refined2 = pair_masks[1].getMat(cv::ACCESS_READ);
+      const cv::Mat decided = (refined1 != refined2) & band(box);
+      refined1.copyTo(seam1(box), decided);
+      refined2.copyTo(seam2(box), decided);
+    }
+  }
+
+  for (size_t i = 0; i < NumImages(); ++i) {
+    cv::UMat refined;
+    masks[i].copyTo(refined);
+    (*seams)[i] = refined;
+  }
   return Status::kSuccess;
 }
 
 // NOLINTNEXTLINE(readability-function-cognitive-complexity):
-Status Stitcher::ComposePanorama(cv::OutputArray pano) {
-  cv::UMat img_warped;
-  cv::UMat dilated_mask;
-  cv::UMat seam_mask;
-  cv::UMat mask;
-  cv::UMat mask_warped;
+Stitcher::WarpedImage Stitcher::WarpImage(
+    const cv::UMat &img, size_t img_idx,
+    const cv::detail::CameraParams &camera_scaled, const cv::UMat &seam_mask,
+    const cv::Point &corner, cv::detail::RotationWarper *warper) const {
+  const cv::Mat k_float = utils::opencv::ToFloat(camera_scaled.K());
+
+  auto timer = Timer();
+  WarpedImage warped;
+
+  // Warp the current image and its mask
+  const auto map_cache =
+      compose_cache_ ? compose_cache_->warp_maps : nullptr;
+  auto maps = map_cache ? map_cache->Get(img_idx) : std::nullopt;
+  if (!maps) {
+    maps = BuildMaps(warper, img.size(), k_float, cameras_[img_idx].R);
+    if (map_cache) {
+      map_cache->Put(img_idx, *maps);
+    }
+  }
+  WarpWithMask(img, *maps, interp_flags_, buffer_pool_.get(), &warped.image,
+               &warped.mask);
+  timer.Report(" warp the current image and mask");
+
+  // Compensate exposure
+  exposure_comp_->apply(static_cast<int>(img_idx), corner, warped.image,
+                        warped.mask);
+  timer.Report(" compensate exposure");
+
+  // Make sure seam mask has proper size
+  cv::UMat dilated_mask = buffer_pool_->Acquire(seam_mask.size(), CV_8U);
+  cv::UMat resized_seam_mask =
+      buffer_pool_->Acquire(warped.mask.size(), CV_8U);
+  dilate(seam_mask, dilated_mask, cv::Mat());
+  resize(dilated_mask, resized_seam_mask, warped.mask.size(), 0, 0,
+         cv::INTER_LINEAR_EXACT);
+
+  bitwise_and(resized_seam_mask, warped.mask, warped.mask);
+  warped.corner = corner;
+  timer.Report(" other");
+  return warped;
+}
+
+std::optional<WarpMaps> WarpMapCache::Get(size_t img_idx) const {
+  const std::lock_guard lock(mutex_);
+  return maps_[img_idx];
+}
+
+void WarpMapCache::Put(size_t img_idx, const WarpMaps &maps) {
+  const size_t bytes = maps.xmap.total() * maps.xmap.elemSize() +
+                       maps.ymap.total() * maps.ymap.elemSize();
+  const std::lock_guard lock(mutex_);
+  if (maps_[img_idx] || bytes_used_ + bytes > budget_bytes_) {
+    return;
+  }
+  maps_[img_idx] = maps;
+  bytes_used_ += bytes;
+}
+
+bool Stitcher::CacheMatches(const ComposeCache &cache,
+                            float max_pano_mpx) const {
+  return cache.full_img_sizes == full_img_sizes_ &&
+         cache.warped_image_scale == warped_image_scale_ &&
+         cache.seam_work_aspect == seam_work_aspect_ &&
+         cache.max_pano_mpx == max_pano_mpx &&
+         cache.max_memory_mb == max_memory_mb_ &&
+         std::equal(cache.cameras.begin(), cache.cameras.end(),
+                    cameras_.begin(), cameras_.end(),
+                    [](const auto &lhs, const auto &rhs) {
+                      return Equal(lhs, rhs);
+                    });
+}
+
+bool Stitcher::CanReuseSeams(const ComposeCache &cache) const {
+  auto same_aspect = [](const cv::Size &lhs, const cv::Size &rhs) {
+    // Up to the rounding of the downscaled size
+    const auto cross = static_cast<std::int64_t>(lhs.width) * rhs.height -
+                       static_cast<std::int64_t>(lhs.height) * rhs.width;
+    return std::abs(cross) <= std::max(lhs.width + lhs.height,
+                                       rhs.width + rhs.height);
+  };
+  return std::equal(cache.full_img_sizes.begin(), cache.full_img_sizes.end(),
+                    full_img_sizes_.begin(), full_img_sizes_.end(),
+                    same_aspect) &&
+         std::equal(cache.cameras.begin(), cache.cameras.end(),
+                    cameras_.begin(), cameras_.end(),
+                    [](const auto &lhs, const auto &rhs) {
+                      return Equal(lhs, rhs);
+                    });
+}
+
+Stitcher::MemoryEstimate Stitcher::EstimateComposeMemory(const Roi &roi,
+                                                         int tile_size) const {
+  double full_px = 0.0;
+  double max_full_px = 0.0;
+  for (const auto &size : full_img_sizes_) {
+    full_px += size.area();
+    max_full_px = std::max(max_full_px, static_cast<double>(size.area()));
+  }
+  double warped_px = 0.0;
+  double max_warped_px = 0.0;
+  for (const auto &size : roi.sizes) {
+    warped_px += size.area();
+    max_warped_px = std::max(max_warped_px, static_cast<double>(size.area()));
+  }
+
+  const auto [blender_bytes_per_pixel, keeps_warped_images] =
+      CostOf(blender_.get());
 
+  double seam_bytes =
+      warped_px * seam_scale_ * seam_scale_ * kSeamBytesPerPixel;
+  if (const double refined_scale = RefinedSeamScale();
+      refined_scale > seam_scale_) {
+    seam_bytes +=
+        warped_px * refined_scale * refined_scale * kRefinedSeamBytesPerPixel;
+  }
+
+  MemoryEstimate estimate;
+  // The input images, the streamed ones are copied from the loader
+  const int in_flight = (compose_pool_ != nullptr) ? max_in_flight_ : 1;
+  estimate.fixed_bytes =
+      (full_res_source_ && tile_size == 0)
+          ? 2.0 * in_flight * max_full_px * kImageBytesPerPixel
+          : full_px * kImageBytesPerPixel;
+
+  if (tile_size > 0) {
+    // Only the padded tile is blended, the seams are still estimated for the
+    // whole pano
+    const double padded_px = std::pow(tile_size + 2.0 * kTileMargin, 2.0);
+    estimate.fixed_bytes +=
+        padded_px * (blender_bytes_per_pixel + kWarpedBytesPerPixel +
+                     kResultBytesPerPixel) +
+        seam_bytes;
+    return estimate;
+  }
+
+  const double pano_px = static_cast<double>(roi.rect.width) * roi.rect.height;
+  estimate.scaled_bytes =
+      pano_px * (blender_bytes_per_pixel + kResultBytesPerPixel) +
+      in_flight * max_warped_px * kWarpedBytesPerPixel + seam_bytes;
+  if (keeps_warped_images) {
+    estimate.scaled_bytes += warped_px * kWarpedBytesPerPixel;
+  }
+  return estimate;
+}
+
+Status Stitcher::FitMemoryBudget(int tile_size, ComposeInput *input) {
+  const double budget = max_memory_mb_ * kBytesPerMb;
+  const auto estimate = EstimateComposeMemory(input->roi, tile_size);
+  const double total = estimate.fixed_bytes + estimate.scaled_bytes;
+  spdlog::info("Estimated compositing memory: {:.0f} MB, budget {} MB",
+               total / kBytesPerMb, max_memory_mb_);
+  if (total <= budget) {
+    return Status::kSuccess;
+  }
+  if (tile_size > 0 || estimate.fixed_bytes >= budget) {
+    spdlog::error("Compositing needs about {:.0f} MB, the budget is {} MB",
+                  total / kBytesPerMb, max_memory_mb_);
+    return Status::kErrMemoryBudget;
+  }
+
+  // The scaled part shrinks with the pano area
+  const double downscale_ratio =
+      std::sqrt((budget - estimate.fixed_bytes) / estimate.scaled_bytes);
+  warped_image_scale_ *= downscale_ratio;
+  const double compose_work_aspect = 1.0 / work_scale_;
+  auto warp_scale =
+      static_cast<float>(warped_image_scale_ * compose_work_aspect);
+  input->roi = ComputeRoi(input->cameras_scaled, full_img_sizes_,
+                          warper_creater_, warp_scale);
+  spdlog::warn("Limiting panorama size to {}x{} to fit the memory budget",
+               input->roi.rect.width, input->roi.rect.height);
+  input->resolution_capped = true;
+  return Status::kSuccess;
+}
+
+Status Stitcher::PrepareCompose(int tile_size, ComposeInput *input) {
+  const bool cap_resolution = tile_size == 0;
   auto compose_work_aspect = 1.0 / work_scale_;
-  auto cameras_scaled = utils::opencv::Scale(cameras_, compose_work_aspect);
+  input->cameras_scaled = utils::opencv::Scale(cameras_, compose_work_aspect);
+  const float max_pano_mpx = cap_resolution ? max_pano_mpx_ : 0.0f;
 
   NextTask(ProgressType::kStitchComputeRoi);
 
-  bool resolution_capped = false;
+  if (compose_cache_ && CacheMatches(*compose_cache_, max_pano_mpx)) {
+    spdlog::info("Reusing pano size, exposure gains and seams");
+    warped_image_scale_ = compose_cache_->compose_warped_image_scale;
+    auto warper = warper_creater_->create(
+        static_cast<float>(warped_image_scale_ * compose_work_aspect));
+    input->roi = {compose_cache_->corners, compose_cache_->sizes,
+                  std::move(warper),
+                  cv::detail::resultRoi(compose_cache_->corners,
+                                        compose_cache_->sizes)};
+    input->resolution_capped = compose_cache_->resolution_capped;
+    input->seams = compose_cache_->seams;
+    exposure_comp_ = compose_cache_->exposure_comp;
+    seam_est_imgs_.clear();
+
+    NextTask(ProgressType::kStitchSeamsPrepare);
+    NextTask(ProgressType::kStitchSeamsFind);
+    return Cancelled() ? Status::kCancelled : Status::kSuccess;
+  }
+  const double warped_image_scale = warped_image_scale_;
+
   auto warp_scale =
       static_cast<float>(warped_image_scale_ * compose_work_aspect);
-  auto roi =
-      ComputeRoi(cameras_scaled, full_img_sizes_, warper_creater_, warp_scale);
-  auto pano_mpx = utils::opencv::MPx(roi.rect);
+  input->roi = ComputeRoi(input->cameras_scaled, full_img_sizes_,
+                          warper_creater_, warp_scale);
+  auto pano_mpx = utils::opencv::MPx(input->roi.rect);
 
-  if (pano_mpx > max_pano_mpx_) {
+  if (cap_resolution && pano_mpx > max_pano_mpx) {
     const float downscale_ratio = std::sqrt(max_pano_mpx_ / pano_mpx);
     warped_image_scale_ *= downscale_ratio;
 
     spdlog::warn(
         "Panorama is too large to compute: {}x{} ({:.2f} Mpx), max size is {} "
         "MPx",
-        roi.rect.width, roi.rect.height, pano_mpx, max_pano_mpx_);
+        input->roi.rect.width, input->roi.rect.height, pano_mpx,
+        max_pano_mpx_);
 
     auto smaller_warp_scale =
         static_cast<float>(warped_image_scale_ * compose_work_aspect);
-    roi = ComputeRoi(cameras_scaled, full_img_sizes_, warper_creater_,
-                     smaller_warp_scale);
-    spdlog::warn("Limiting panorama size to {}x{}", roi.rect.width,
-                 roi.rect.height);
+    input->roi = ComputeRoi(input->cameras_scaled, full_img_sizes_,
+                            warper_creater_, smaller_warp_scale);
+    spdlog::warn("Limiting panorama size to {}x{}", input->roi.rect.width,
+                 input->roi.rect.height);
+
+    input->resolution_capped = true;
+  }
 
-    resolution_capped = true;
+  if (max_memory_mb_ > 0) {
+    if (auto status = FitMemoryBudget(tile_size, input);
+        status != Status::kSuccess) {
+      return status;
+    }
   }
 
-  std::vector<cv::UMat> masks_warped;
-  {
+  if (seam_source_ && CanReuseSeams(*seam_source_)) {
+    // Upscaled with the warped images, see WarpImage
+    spdlog::info("Reusing exposure gains and seams of another resolution");
+    input->seams = seam_source_->seams;
+    exposure_comp_ = seam_source_->exposure_comp;
+    NextTask(ProgressType::kStitchSeamsPrepare);
+    NextTask(ProgressType::kStitchSeamsFind);
+  } else {
     spdlog::info("Estimating seams... ");
     NextTask(ProgressType::kStitchSeamsPrepare);
 
-    if (auto status = EstimateSeams(&masks_warped);
+    if (auto status = EstimateSeams(&input->seams);
         status != Status::kSuccess) {
       return status;
     }
+  }
 
-    seam_est_imgs_.clear();
+  seam_est_imgs_.clear();
 
-    if (Cancelled()) {
-      return Status::kCancelled;
-    }
+  if (Cancelled()) {
+    return Status::kCancelled;
+  }
+
+  compose_cache_ = std::make_shared<const ComposeCache>(ComposeCache{
+      .full_img_sizes = full_img_sizes_,
+      .cameras = cameras_,
+      .warped_image_scale = warped_image_scale,
+      .seam_work_aspect = seam_work_aspect_,
+      .max_pano_mpx = max_pano_mpx,
+      .max_memory_mb = max_memory_mb_,
+      .compose_warped_image_scale = warped_image_scale_,
+      .corners = input->roi.corners,
+      .sizes = input->roi.sizes,
+      .resolution_capped = input->resolution_capped,
+      .seams = input->seams,
+      .exposure_comp = exposure_comp_,
+      .warp_maps = std::make_shared<WarpMapCache>(NumImages(),
+                                                  kWarpMapCacheBytes)});
+  if (compose_cache_callback_) {
+    compose_cache_callback_(compose_cache_);
   }
+  return Status::kSuccess;
+}
 
-  spdlog::info("Compositing...");
+Status Stitcher::ComposePanorama(cv::OutputArray pano) {
+  ComposeInput input;
+  if (auto status = PrepareCompose(/*tile_size=*/0, &input);
+      status != Status::kSuccess) {
+    return status;
+  }
+  const auto &cameras_scaled = input.cameras_scaled;
+  const auto &masks_warped = input.seams;
+  auto &roi = input.roi;
+  const utils::memory::Scope seams_memory(Category::kSeamMasks,
+                                          UMatBytes(masks_warped));
+
+  cv::Rect dst_rect = roi.rect;
+  if (compose_crop_) {
+    if (auto crop = CropRect(roi.rect, *compose_crop_); !crop.empty()) {
+      dst_rect = crop;
+    }
+  }
+  const bool cropped = dst_rect != roi.rect;
+  if (cropped) {
+    spdlog::info("Compositing only the {}x{} crop", dst_rect.width,
+                 dst_rect.height);
+  } else {
+    spdlog::info("Compositing...");
+  }
   auto compositing_total_timer = Timer();
 
-  blender_->prepare(roi.rect);
-  for (size_t img_idx = 0; img_idx < imgs_.size(); ++img_idx) {
-    NextTask(ProgressType::kStitchCompose);
-    if (auto non_zero = cv::countNonZero(masks_warped[img_idx]);
-        non_zero == 0) {
+  std::vector<size_t> visible;
+  for (size_t img_idx = 0; img_idx < NumImages(); ++img_idx) {
+    if (cv::countNonZero(masks_warped[img_idx]) == 0) {
+      NextTask(ProgressType::kStitchCompose);
       spdlog::warn("Skipping fully obscured image");
       continue;
     }
+    if ((cv::Rect(roi.corners[img_idx], roi.sizes[img_idx]) & dst_rect)
+            .empty()) {
+      NextTask(ProgressType::kStitchCompose);
+      spdlog::trace("Skipping image #{} outside of the crop",
+                    indices_[img_idx] + 1);
+      continue;
+    }
+    visible.push_back(img_idx);
+  }
+
+  // See ComposePanoramaTiled, the cropped images are warped by regions too
+  std::vector<cv::Mat> gain_maps;
+  if (cropped && dynamic_cast<cv::detail::BlocksCompensator *>(
+                     exposure_comp_.get()) != nullptr) {
+    exposure_comp_->getMatGains(gain_maps);
+  }
 
+  const bool parallel = compose_pool_ != nullptr &&
+                        compose_pool_->get_thread_count() > 1 &&
+                        max_in_flight_ > 1;
+  const float compose_warp_scale = roi.warper->getScale();
+  // Each task needs its own warper, warp() modifies the projector
+  auto warp_cropped = [this, &cameras_scaled, &masks_warped, &roi,
+                       &gain_maps, dst_rect](
+                          size_t img_idx, cv::detail::RotationWarper *warper) {
+    const auto source = PrepareTileSource(
+        img_idx, cameras_scaled[img_idx],
+        cv::Rect(roi.corners[img_idx], roi.sizes[img_idx]),
+        masks_warped[img_idx],
+        gain_maps.empty() ? cv::Mat() : gain_maps[img_idx], warper);
+    return WarpRegion(source, cameras_scaled[img_idx], dst_rect, warper);
+  };
+  auto warp = [this, &cameras_scaled, &masks_warped, &roi, &warp_cropped,
+               cropped, compose_warp_scale](size_t img_idx) {
+    auto warper = warper_creater_->create(compose_warp_scale);
+    if (cropped) {
+      return warp_cropped(img_idx, warper.get());
+    }
+    return WarpImage(FullResImage(img_idx), img_idx, cameras_scaled[img_idx],
+                     masks_warped[img_idx], roi.corners[img_idx],
+                     warper.get());
+  };
+  std::deque<std::future<WarpedImage>> in_flight;
+  // The tasks reference the locals, wait for them on every return path
+  const FinishAll finish_all(&in_flight);
+  size_t next_submit = 0;
+
+  // Estimated, the blenders don't expose their buffers
+  const utils::memory::Scope blender_memory(
+      Category::kBlender,
+      static_cast<std::int64_t>(dst_rect.area() *
+                                CostOf(blender_.get()).bytes_per_pixel));
+  blender_->prepare(dst_rect);
+  for (const size_t img_idx : visible) {
+    NextTask(ProgressType::kStitchCompose);
     spdlog::trace("Compositing image #{}", indices_[img_idx] + 1);
     auto compositing_timer = Timer();
 
-    cv::UMat img = imgs_[img_idx];
-    const cv::Size img_size = img.size();
-
-    const cv::Mat k_float = utils::opencv::ToFloat(cameras_scaled[img_idx].K());
-
-    auto timer = Timer();
-
-    // Warp the current image
-    roi.warper->warp(img, k_float, cameras_[img_idx].R, interp_flags_,
-                     cv::BORDER_REFLECT, img_warped);
-    timer.Report(" warp the current image");
-
-    // Warp the current image mask
-    mask.create(img_size, CV_8U);
-    mask.setTo(cv::Scalar::all(kMaskValueOn));
-    roi.warper->warp(mask, k_float, cameras_[img_idx].R, cv::INTER_NEAREST,
-                     cv::BORDER_CONSTANT, mask_warped);
-    timer.Report(" warp the current image mask");
-
-    // Compensate exposure
-    exposure_comp_->apply(static_cast<int>(img_idx), roi.corners[img_idx],
-                          img_warped, mask_warped);
-    timer.Report(" compensate exposure");
-
-    img.release();
-    mask.release();
-
-    // Make sure seam mask has proper size
-    dilate(masks_warped[img_idx], dilated_mask, cv::Mat());
-    resize(dilated_mask, seam_mask, mask_warped.size(), 0, 0,
-           cv::INTER_LINEAR_EXACT);
-
-    bitwise_and(seam_mask, mask_warped, mask_warped);
-    timer.Report(" other");
+    WarpedImage warped;
+    if (parallel) {
+      while (next_submit < visible.size() &&
+             static_cast<int>(in_flight.size()) < max_in_flight_) {
+        // The images queued by a cancelled stitch are skipped
+        in_flight.push_back(compose_pool_->submit(
+            [this, warp, idx = visible[next_submit]]() {
+              return Cancelled() ? WarpedImage{} : warp(idx);
+            }));
+        next_submit++;
+      }
+      try {
+        warped = in_flight.front().get();
+      } catch (const std::future_error&) {
+        // The task was dropped without running, the compose pool is never
+        // purged but a broken promise still ends the stitch
+        return Status::kCancelled;
+      }
+      in_flight.pop_front();
+    } else if (cropped) {
+      warped = warp_cropped(img_idx, roi.warper.get());
+    } else {
+      warped = WarpImage(FullResImage(img_idx), img_idx,
+                         cameras_scaled[img_idx], masks_warped[img_idx],
+                         roi.corners[img_idx], roi.warper.get());
+    }
 
     // Blend the current image
-    blender_->feed(img_warped, mask_warped, roi.corners[img_idx]);
+    const utils::memory::Scope warped_memory(
+        Category::kWarpedImages,
+        UMatBytes(warped.image) + UMatBytes(warped.mask));
+    auto timer = Timer();
+    if (!warped.image.empty()) {
+      blender_->feed(warped.image, warped.mask,
+                     cropped ? warped.corner : roi.corners[img_idx]);
+    }
     timer.Report(" feed time");
 
     compositing_timer.Report("Compositing ## time");
@@ -418,17 +1025,263 @@ Status Stitcher::ComposePanorama(cv::OutputArray pano) {
   cv::UMat result;
   blender_->blend(result, result_mask_);
   blend_timer.Report(" blend time");
+  if (Cancelled()) {
+    return Status::kCancelled;
+  }
 
   compositing_total_timer.Report("Compositing");
 
+  // The whole pano crosses to the host unless the caller keeps it on the
+  // device
+  if (!pano.isUMat()) {
+    utils::memory::CountTransfer(utils::memory::Transfer::kDownload,
+                                 UMatBytes(result));
+  }
   pano.assign(result);
 
+  buffer_pool_->Trim(kBufferPoolRetainBytes);
+  const auto pool_stats = buffer_pool_->GetStats();
+  utils::memory::Set(Category::kComposeBuffers,
+                     static_cast<std::int64_t>(pool_stats.bytes));
+  spdlog::debug("Compose buffers: {} allocations, {} reuses, {:.0f} MB held",
+                pool_stats.allocations, pool_stats.reuses,
+                static_cast<double>(pool_stats.bytes) / kBytesPerMb);
+
   warp_helper_ = {work_scale_, roi.corners, roi.sizes, full_img_sizes_,
                   std::move(roi.warper)};
 
   EndMonitoring();
-  return (resolution_capped) ? Status::kSuccessResolutionCapped
-                             : Status::kSuccess;
+  return (input.resolution_capped) ? Status::kSuccessResolutionCapped
+                                   : Status::kSuccess;
+}
+
+Stitcher::TileSource Stitcher::PrepareTileSource(
+    size_t img_idx, const cv::detail::CameraParams &camera_scaled,
+    const cv::Rect &warped_rect, const cv::UMat &seam_mask,
+    const cv::Mat &gain_map, cv::detail::RotationWarper *warper) const {
+  TileSource source = {.img_idx = img_idx,
+                       .image = FullResImage(img_idx),
+                       .warped_rect = warped_rect};
+
+  const cv::Rect img_rect(cv::Point(), full_img_sizes_[img_idx]);
+  for (int y = 0; y < img_rect.height; y += kSourceBlockSize) {
+    for (int x = 0; x < img_rect.width; x += kSourceBlockSize) {
+      const cv::Rect block =
+          cv::Rect(x, y, kSourceBlockSize, kSourceBlockSize) & img_rect;
+      source.blocks.push_back(block);
+      source.warped_blocks.push_back(
+          warper->warpRoi(block.size(), ShiftedK(camera_scaled, block.tl()),
+                          cameras_[img_idx].R));
+    }
+  }
+
+  dilate(seam_mask, source.seam_mask, cv::Mat());
+  if (gain_map.empty() || gain_map.channels() == 3) {
+    source.gains = gain_map;
+  } else {
+    cv::merge(std::vector<cv::Mat>{gain_map, gain_map, gain_map},
+              source.gains);
+  }
+  return source;
+}
+
+Stitcher::WarpedImage Stitcher::WarpRegion(
+    const TileSource &source, const cv::detail::CameraParams &camera_scaled,
+    const cv::Rect &region, cv::detail::RotationWarper *warper) const {
+  WarpedImage warped;
+
+  cv::Rect src_rect;
+  for (size_t i = 0; i < source.blocks.size(); ++i) {
+    if (!(source.warped_blocks[i] & region).empty()) {
+      src_rect |= source.blocks[i];
+    }
+  }
+  if (src_rect.empty()) {
+    return warped;
+  }
+
+  // A few more pixels for the interpolation at the crop edges
+  const cv::UMat &img = source.image;
+  const cv::Point padding(kSourceBlockPadding, kSourceBlockPadding);
+  src_rect = cv::Rect(src_rect.tl() - padding, src_rect.br() + padding) &
+             cv::Rect(cv::Point(), img.size());
+  const cv::Mat k_float = ShiftedK(camera_scaled, src_rect.tl());
+  const cv::Mat &rotation = cameras_[source.img_idx].R;
+
+  cv::UMat image_warped;
+  cv::UMat mask_warped;
+  const auto maps = BuildMaps(warper, src_rect.size(), k_float, rotation);
+  const cv::Point corner =
+      WarpWithMask(img(src_rect), maps, interp_flags_, buffer_pool_.get(),
+                   &image_warped, &mask_warped);
+
+  const cv::Rect clipped = cv::Rect(corner, image_warped.size()) & region;
+  if (clipped.empty()) {
+    return warped;
+  }
+  const cv::Rect local(clipped.tl() - corner, clipped.size());
+  image_warped(local).copyTo(warped.image);
+  mask_warped(local).copyTo(warped.mask);
+  warped.corner = clipped.tl();
+
+  // Gains and seams are computed for the whole warped image, take only the
+  // part covered by the region
+  const cv::Rect relative(clipped.tl() - source.warped_rect.tl(),
+                          clipped.size());
+  if (!source.gains.empty()) {
+    cv::UMat gains;
+    ResizedRegion(source.gains, source.warped_rect.size(), relative)
+        .copyTo(gains);
+    multiply(warped.image, gains, warped.image, 1, warped.image.type());
+  } else {
+    exposure_comp_->apply(static_cast<int>(source.img_idx), warped.corner,
+                          warped.image, warped.mask);
+  }
+
+  cv::UMat seam_mask;
+  ResizedRegion(source.seam_mask, source.warped_rect.size(), relative)
+      .copyTo(seam_mask);
+  bitwise_and(seam_mask, warped.mask, warped.mask);
+  return warped;
+}
+
+// NOLINTNEXTLINE(readability-function-cognitive-complexity):
+Status Stitcher::ComposePanoramaTiled(const TiledOutput &output) {
+  CV_Assert(output.tile_size > 0);
+
+  ComposeInput input;
+  if (auto status = PrepareCompose(output.tile_size, &input);
+      status != Status::kSuccess) {
+    return status;
+  }
+  const auto &roi = input.roi;
+  const utils::memory::Scope seams_memory(Category::kSeamMasks,
+                                          UMatBytes(input.seams));
+
+  if (!output.open(roi.rect.size())) {
+    spdlog::error("Failed to open the tiled output");
+    return Status::kErrOutputFailed;
+  }
+
+  spdlog::info("Compositing {}x{} in tiles...", roi.rect.width,
+               roi.rect.height);
+  auto compositing_total_timer = Timer();
+
+  // Blocks compensators resize the gain maps to the size of the image they
+  // are applied to, which is only a part of the warped image here
+  std::vector<cv::Mat> gain_maps;
+  if (dynamic_cast<cv::detail::BlocksCompensator *>(exposure_comp_.get()) !=
+      nullptr) {
+    exposure_comp_->getMatGains(gain_maps);
+  }
+
+  const int tile_size = output.tile_size;
+  const int tiles_across = (roi.rect.width + tile_size - 1) / tile_size;
+  const int tiles_down = (roi.rect.height + tile_size - 1) / tile_size;
+  const int first_row = tiles_down * output.shard_index / output.num_shards;
+  const int end_row =
+      tiles_down * (output.shard_index + 1) / output.num_shards;
+  const cv::Rect band =
+      cv::Rect(roi.rect.x, roi.rect.y + first_row * tile_size - kTileMargin,
+               roi.rect.width,
+               (end_row - first_row) * tile_size + 2 * kTileMargin) &
+      roi.rect;
+
+  // The tiles need random access to the images, the full resolution images
+  // of the band are all loaded here
+  std::vector<TileSource> sources;
+  for (size_t img_idx = 0; img_idx < NumImages(); ++img_idx) {
+    const cv::Rect warped_rect(roi.corners[img_idx], roi.sizes[img_idx]);
+    if (end_row == first_row || (warped_rect & band).empty()) {
+      NextTask(ProgressType::kStitchCompose);
+      continue;
+    }
+    if (cv::countNonZero(input.seams[img_idx]) == 0) {
+      NextTask(ProgressType::kStitchCompose);
+      spdlog::warn("Skipping fully obscured image");
+      continue;
+    }
+    sources.push_back(PrepareTileSource(
+        img_idx, input.cameras_scaled[img_idx], warped_rect,
+        input.seams[img_idx],
+        gain_maps.empty() ? cv::Mat() : gain_maps[img_idx], roi.warper.get()));
+  }
+  if (output.num_shards > 1) {
+    spdlog::info("Compositing tile rows {} - {} of {} from {} images",
+                 first_row + 1, end_row, tiles_down, sources.size());
+  }
+
+  const size_t num_tiles =
+      static_cast<size_t>(tiles_across) * (end_row - first_row);
+  size_t images_reported = 0;
+
+  for (size_t tile_idx = 0; tile_idx < num_tiles; ++tile_idx) {
+    auto tile_timer = Timer();
+    const cv::Point tile_offset(
+        static_cast<int>(tile_idx % tiles_across) * tile_size,
+        (first_row + static_cast<int>(tile_idx / tiles_across)) * tile_size);
+    const cv::Rect tile =
+        cv::Rect(roi.rect.tl() + tile_offset, cv::Size(tile_size, tile_size)) &
+        roi.rect;
+    // Blend with an overlap, so that the bands are continuous across tiles
+    const cv::Rect padded =
+        cv::Rect(tile.x - kTileMargin, tile.y - kTileMargin,
+                 tile.width + 2 * kTileMargin, tile.height + 2 * kTileMargin) &
+        roi.rect;
+
+    bool fed = false;
+    blender_->prepare(padded);
+    for (const auto &source : sources) {
+      if ((source.warped_rect & padded).empty()) {
+        continue;
+      }
+      auto warped = WarpRegion(source, input.cameras_scaled[source.img_idx],
+                               padded, roi.warper.get());
+      if (warped.image.empty()) {
+        continue;
+      }
+      blender_->feed(warped.image, warped.mask, warped.corner);
+      fed = true;
+    }
+
+    cv::Mat tile_image = cv::Mat::zeros(tile.size(), CV_8UC3);
+    cv::Mat tile_mask = cv::Mat::zeros(tile.size(), CV_8U);
+    if (fed) {
+      cv::Mat result;
+      cv::Mat result_mask;
+      blender_->blend(result, result_mask);
+      const cv::Rect inner(tile.tl() - padded.tl(), tile.size());
+      result(inner).convertTo(tile_image, CV_8U);
+      result_mask(inner).copyTo(tile_mask);
+    }
+
+    if (!output.write(tile_offset, tile_image, tile_mask)) {
+      spdlog::error("Failed to write tile at {}x{}", tile_offset.x,
+                    tile_offset.y);
+      return Status::kErrOutputFailed;
+    }
+    tile_timer.Report("Compositing tile ## time");
+
+    // Spread the per image compositing tasks over the tiles
+    const size_t images_done = sources.size() * (tile_idx + 1) / num_tiles;
+    for (; images_reported < images_done; ++images_reported) {
+      NextTask(ProgressType::kStitchCompose);
+    }
+
+    if (Cancelled()) {
+      return Status::kCancelled;
+    }
+  }
+
+  NextTask(ProgressType::kStitchBlend);
+  compositing_total_timer.Report("Compositing");
+
+  result_mask_.release();
+  warp_helper_ = {work_scale_, roi.corners, roi.sizes, full_img_sizes_,
+                  roi.warper};
+
+  EndMonitoring();
+  return Status::kSuccess;
 }
 
 Status Stitcher::Stitch(cv::InputArrayOfArrays images, cv::OutputArray pano) {
@@ -444,54 +1297,83 @@ Status Stitcher::Stitch(cv::InputArrayOfArrays images,
   return ComposePanorama(pano);
 }
 
+Status Stitcher::Stitch(cv::InputArrayOfArrays images,
+                        std::vector<cv::detail::ImageFeatures> features,
+                        std::vector<cv::detail::MatchesInfo> pairwise_matches,
+                        cv::OutputArray pano) {
+  const Status status = EstimateTransform(images, std::move(features),
+                                          std::move(pairwise_matches));
+  if (status != Status::kSuccess) {
+    return status;
+  }
+  return ComposePanorama(pano);
+}
+
 Status Stitcher::MatchImages() {
-  if (static_cast<int>(imgs_.size()) < 2) {
+  if (static_cast<int>(NumImages()) < 2) {
     spdlog::error("Need more images");
     return Status::kErrNeedMoreImgs;
   }
 
-  work_scale_ = ComputeWorkScale(imgs_[0].size(), registr_resol_);
-  seam_scale_ = ComputeSeamScale(imgs_[0].size(), seam_est_resol_);
+  work_scale_ = ComputeWorkScale(full_img_sizes_[0], registr_resol_);
+  seam_scale_ = ComputeSeamScale(full_img_sizes_[0], seam_est_resol_);
   seam_work_aspect_ = seam_scale_ / work_scale_;
 
-  features_.resize(imgs_.size());
-  seam_est_imgs_.resize(imgs_.size());
-  full_img_sizes_.resize(imgs_.size());
+  features_.resize(NumImages());
+  seam_est_imgs_.resize(NumImages());
 
   spdlog::info("Finding features...");
   NextTask(ProgressType::kStitchFindFeatures);
   auto timer = Timer();
 
-  std::vector<cv::UMat> feature_find_imgs(imgs_.size());
-  std::vector<cv::UMat> feature_find_masks(masks_.size());
-
-  for (size_t i = 0; i < imgs_.size(); ++i) {
-    full_img_sizes_[i] = imgs_[i].size();
-    if (registr_resol_ < 0) {
-      feature_find_imgs[i] = imgs_[i];
+  // The scaled copies are released right after each image
+  auto find_features = [this](size_t i,
+                              const cv::Ptr<cv::Feature2D> &finder) {
+    cv::UMat feature_find_img;
+    if (registr_resol_ < 0 && !full_res_source_) {
+      feature_find_img = imgs_[i];
     } else {
-      resize(imgs_[i], feature_find_imgs[i], cv::Size(), work_scale_,
-             work_scale_, cv::INTER_LINEAR_EXACT);
+      feature_find_img =
+          ScaledImage(i, (registr_resol_ < 0) ? 1.0 : work_scale_);
     }
 
+    cv::UMat feature_find_mask;
     if (!masks_.empty()) {
-      resize(masks_[i], feature_find_masks[i], cv::Size(), work_scale_,
+      resize(masks_[i], feature_find_mask, cv::Size(), work_scale_,
              work_scale_, cv::INTER_NEAREST);
     }
+    cv::detail::computeImageFeatures(finder, feature_find_img, features_[i],
+                                     feature_find_mask);
     features_[i].img_idx = static_cast<int>(i);
 
-    cv::resize(imgs_[i], seam_est_imgs_[i], cv::Size(), seam_scale_,
-               seam_scale_, cv::INTER_LINEAR_EXACT);
+    seam_est_imgs_[i] = ScaledImage(i, seam_scale_);
+  };
+
+  const int num_images = static_cast<int>(NumImages());
+  if (features_pool_ != nullptr && make_features_finder_) {
+    const int num_helpers =
+        std::min(num_images - 1,
+                 static_cast<int>(features_pool_->get_thread_count()));
+    // One per thread of the loop, the calling thread uses the default one
+    std::vector<cv::Ptr<cv::Feature2D>> finders(num_helpers + 1);
+    finders[0] = features_finder_;
+    utils::mt::ParallelFor(features_pool_, num_images, num_helpers,
+                           [&](int i, int thread_num) {
+                             if (Cancelled()) {
+                               return;
+                             }
+                             auto &finder = finders[thread_num];
+                             if (!finder) {
+                               finder = make_features_finder_();
+                             }
+                             find_features(i, finder);
+                           });
+  } else {
+    for (int i = 0; i < num_images && !Cancelled(); ++i) {
+      find_features(i, features_finder_);
+    }
   }
 
-  // find features possibly in parallel
-  cv::detail::computeImageFeatures(features_finder_, feature_find_imgs,
-                                   features_, feature_find_masks);
-
-  // Do it to save memory
-  feature_find_imgs.clear();
-  feature_find_masks.clear();
-
   timer.Report("Finding features");
   if (Cancelled()) {
     return Status::kCancelled;
@@ -508,6 +1390,71 @@ Status Stitcher::MatchImages() {
     return Status::kCancelled;
   }
 
+  return LeaveBiggestComponent();
+}
+
+Status Stitcher::UseFeatures(
+    std::vector<cv::detail::ImageFeatures> features,
+    std::vector<cv::detail::MatchesInfo> pairwise_matches) {
+  const int num_images = static_cast<int>(NumImages());
+  if (num_images < 2) {
+    spdlog::error("Need more images");
+    return Status::kErrNeedMoreImgs;
+  }
+  CV_Assert(features.size() == NumImages() &&
+            pairwise_matches.size() == NumImages() * NumImages());
+
+  work_scale_ = ComputeWorkScale(full_img_sizes_[0], registr_resol_);
+  seam_scale_ = ComputeSeamScale(full_img_sizes_[0], seam_est_resol_);
+  seam_work_aspect_ = seam_scale_ / work_scale_;
+
+  seam_est_imgs_.resize(NumImages());
+
+  spdlog::info("Rescaling precomputed features...");
+  NextTask(ProgressType::kStitchFindFeatures);
+  auto timer = Timer();
+
+  std::vector<double> scales(NumImages());
+  for (size_t i = 0; i < NumImages(); ++i) {
+    const cv::Size &full_size = full_img_sizes_[i];
+    seam_est_imgs_[i] = ScaledImage(i, seam_scale_);
+
+    scales[i] = work_scale_ * full_size.width / features[i].img_size.width;
+    features[i].img_idx = static_cast<int>(i);
+    features[i].img_size = {cvRound(full_size.width * work_scale_),
+                            cvRound(full_size.height * work_scale_)};
+    for (auto &keypoint : features[i].keypoints) {
+      keypoint.pt *= static_cast<float>(scales[i]);
+    }
+  }
+
+  // H maps src to dst points: H_work = S_dst * H * S_src^-1
+  for (int i = 0; i < num_images; ++i) {
+    for (int j = 0; j < num_images; ++j) {
+      auto &info = pairwise_matches[i * num_images + j];
+      if (info.H.empty()) {
+        continue;
+      }
+      const auto src_inv =
+          cv::Matx33d::diag({1.0 / scales[i], 1.0 / scales[i], 1.0});
+      const auto dst = cv::Matx33d::diag({scales[j], scales[j], 1.0});
+      const cv::Matx33d homography = info.H;
+      info.H = cv::Mat(dst * homography * src_inv);
+    }
+  }
+  features_ = std::move(features);
+  pairwise_matches_ = std::move(pairwise_matches);
+
+  timer.Report("Rescaling features");
+  NextTask(ProgressType::kStitchMatchFeatures);
+  if (Cancelled()) {
+    return Status::kCancelled;
+  }
+
+  return LeaveBiggestComponent();
+}
+
+Status Stitcher::LeaveBiggestComponent() {
   // Leave only images we are sure are from the same panorama
   indices_ = cv::detail::leaveBiggestComponent(
       features_, pairwise_matches_, static_cast<float>(conf_thresh_));
@@ -517,17 +1464,78 @@ Status Stitcher::MatchImages() {
     return Status::kErrNeedMoreImgs;
   }
 
-  seam_est_imgs_ = Index(seam_est_imgs_, indices_);
-  imgs_ = Index(imgs_, indices_);
-  full_img_sizes_ = Index(full_img_sizes_, indices_);
-
+  KeepImages(indices_);
   return Status::kSuccess;
 }
 
+void Stitcher::SetImages(cv::InputArrayOfArrays images) {
+  images.getUMatVector(imgs_);
+  if (images.kind() != cv::_InputArray::STD_VECTOR_UMAT) {
+    utils::memory::CountTransfer(utils::memory::Transfer::kUpload,
+                                 UMatBytes(imgs_));
+  }
+  if (full_res_source_) {
+    CV_Assert(full_res_source_->sizes.size() == imgs_.size());
+    full_img_sizes_ = full_res_source_->sizes;
+    return;
+  }
+  full_img_sizes_.resize(imgs_.size());
+  for (size_t i = 0; i < imgs_.size(); ++i) {
+    full_img_sizes_[i] = imgs_[i].size();
+  }
+}
+
+void Stitcher::KeepImages(const std::vector<int> &indices) {
+  seam_est_imgs_ = Index(seam_est_imgs_, indices);
+  imgs_ = Index(imgs_, indices);
+  full_img_sizes_ = Index(full_img_sizes_, indices);
+}
+
+cv::UMat Stitcher::ScaledImage(size_t img_idx, double scale) const {
+  cv::UMat result;
+  if (!full_res_source_) {
+    cv::resize(imgs_[img_idx], result, cv::Size(), scale, scale,
+               cv::INTER_LINEAR_EXACT);
+    return result;
+  }
+  const cv::Size &full_size = full_img_sizes_[img_idx];
+  const cv::Size size(cvRound(full_size.width * scale),
+                      cvRound(full_size.height * scale));
+  cv::resize(imgs_[img_idx], result, size, 0, 0, cv::INTER_LINEAR_EXACT);
+  return result;
+}
+
+cv::UMat Stitcher::FullResImage(size_t img_idx) const {
+  if (!full_res_source_) {
+    return imgs_[img_idx];
+  }
+  // indices_ maps back to the input images once the component is known
+  const int input_idx = indices_[img_idx];
+  cv::UMat result;
+  full_res_source_->load(input_idx).copyTo(result);
+  utils::memory::CountTransfer(utils::memory::Transfer::kUpload,
+                               UMatBytes(result));
+  if (result.empty()) {
+    spdlog::error("Failed to load full resolution image #{}", input_idx + 1);
+    return cv::UMat(full_img_sizes_[img_idx], CV_8UC3, cv::Scalar::all(0));
+  }
+  if (result.size() != full_img_sizes_[img_idx]) {
+    spdlog::warn("Full resolution image #{} has unexpected size {}x{}",
+                 input_idx + 1, result.cols, result.rows);
+    cv::resize(result, result, full_img_sizes_[img_idx], 0, 0,
+               cv::INTER_LINEAR_EXACT);
+  }
+  return result;
+}
+
 Status Stitcher::EstimateCameraParams() {
   NextTask(ProgressType::kStitchEstimateHomography);
-  // estimate homography in global frame
-  if (!(*estimator_)(features_, pairwise_matches_, cameras_)) {
+  if (UseInitialCameras()) {
+    spdlog::info("Refining the previous camera estimate");
+  } else if (UseGridCameras()) {
+    spdlog::info("Starting from the capture grid");
+  } else if (!(*estimator_)(features_, pairwise_matches_, cameras_)) {
+    // estimate homography in global frame
     return Status::kErrHomographyEstFail;
   }
 
@@ -575,6 +1583,134 @@ Status Stitcher::EstimateCameraParams() {
   return Status::kSuccess;
 }
 
+bool Stitcher::UseInitialCameras() {
+  const size_t num_images = NumImages();
+  std::vector<std::optional<cv::detail::CameraParams>> cameras(num_images);
+  std::deque<size_t> registered;
+  std::vector<double> focals;
+  for (size_t i = 0; i < num_images; ++i) {
+    if (const auto input_idx = static_cast<size_t>(indices_[i]);
+        input_idx < initial_cameras_.size() && initial_cameras_[input_idx]) {
+      cameras[i] = initial_cameras_[input_idx];
+      registered.push_back(i);
+      focals.push_back(cameras[i]->focal);
+    }
+  }
+  if (registered.empty()) {
+    return false;
+  }
+  auto median = focals.begin() + focals.size() / 2;
+  std::nth_element(focals.begin(), median, focals.end());
+  const double focal = *median;
+
+  // Breadth first from the known cameras, same relative rotation as in
+  // cv::detail::HomographyBasedEstimator
+  while (!registered.empty()) {
+    const size_t from = registered.front();
+    registered.pop_front();
+    for (size_t to = 0; to < num_images; ++to) {
+      const auto &match = pairwise_matches_[from * num_images + to];
+      if (cameras[to] || match.confidence <= conf_thresh_ || match.H.empty()) {
+        continue;
+      }
+      cv::detail::CameraParams camera;
+      camera.focal = focal;
+      camera.ppx = features_[to].img_size.width * 0.5;
+      camera.ppy = features_[to].img_size.height * 0.5;
+      cv::Mat from_rotation;
+      cameras[from]->R.convertTo(from_rotation, CV_64F);
+      const cv::Mat relative =
+          cameras[from]->K().inv() * match.H.inv() * camera.K();
+      camera.R = utils::opencv::ToFloat(from_rotation * relative);
+      cameras[to] = camera;
+      registered.push_back(to);
+      spdlog::info("Registered image #{} through image #{}",
+                   indices_[to] + 1, indices_[from] + 1);
+    }
+  }
+
+  if (!std::all_of(cameras.begin(), cameras.end(),
+                   [](const auto &camera) { return camera.has_value(); })) {
+    spdlog::warn("Some images aren't connected to the previous cameras");
+    return false;
+  }
+  cameras_.clear();
+  for (auto &camera : cameras) {
+    cameras_.push_back(*std::move(camera));
+  }
+  return true;
+}
+
+bool Stitcher::UseGridCameras() {
+  const size_t num_images = NumImages();
+  if (grid_cells_.empty() ||
+      std::any_of(indices_.begin(), indices_.end(), [this](int input_idx) {
+        return static_cast<size_t>(input_idx) >= grid_cells_.size();
+      })) {
+    return false;
+  }
+
+  std::vector<double> focals;
+  cv::detail::estimateFocal(features_, pairwise_matches_, focals);
+  auto median = focals.begin() + focals.size() / 2;
+  std::nth_element(focals.begin(), median, focals.end());
+  const double focal = *median;
+
+  // Mean angles between the neighbouring columns / rows: the centre of the
+  // first image is shifted by focal * tan(angle) in the second one
+  double col_angle = 0.0;
+  double row_angle = 0.0;
+  int num_cols = 0;
+  int num_rows = 0;
+  for (size_t i = 0; i < num_images; ++i) {
+    for (size_t j = 0; j < num_images; ++j) {
+      const auto &match = pairwise_matches_[i * num_images + j];
+      if (i == j || match.confidence <= conf_thresh_ || match.H.empty()) {
+        continue;
+      }
+      const cv::Point step =
+          grid_cells_[indices_[j]] - grid_cells_[indices_[i]];
+      const cv::Size &size_i = features_[i].img_size;
+      const cv::Size &size_j = features_[j].img_size;
+      std::vector<cv::Point2d> centre = {
+          {size_i.width * 0.5, size_i.height * 0.5}};
+      std::vector<cv::Point2d> projected;
+      cv::perspectiveTransform(centre, projected, match.H);
+      if (step == cv::Point{1, 0}) {
+        col_angle += std::atan((size_j.width * 0.5 - projected[0].x) / focal);
+        num_cols++;
+      } else if (step == cv::Point{0, 1}) {
+        row_angle +=
+            std::atan((size_j.height * 0.5 - projected[0].y) / focal);
+        num_rows++;
+      }
+    }
+  }
+  if (num_cols + num_rows == 0) {
+    return false;
+  }
+  col_angle = num_cols > 0 ? col_angle / num_cols : 0.0;
+  row_angle = num_rows > 0 ? row_angle / num_rows : 0.0;
+
+  // Pan around the vertical axis after tilting, same convention as in
+  // cv::detail::HomographyBasedEstimator
+  cameras_.resize(num_images);
+  for (size_t i = 0; i < num_images; ++i) {
+    const auto cell = grid_cells_[indices_[i]];
+    auto &camera = cameras_[i];
+    camera = cv::detail::CameraParams();
+    camera.focal = focal;
+    camera.ppx = features_[i].img_size.width * 0.5;
+    camera.ppy = features_[i].img_size.height * 0.5;
+    cv::Mat pan;
+    cv::Mat tilt;
+    cv::Rodrigues(cv::Vec3d{0.0, cell.x * col_angle, 0.0}, pan);
+    cv::Rodrigues(cv::Vec3d{-cell.y * row_angle, 0.0, 0.0}, tilt);
+    camera.R = utils::opencv::ToFloat(pan * tilt);
+  }
+  return true;
+}
+
 Status Stitcher::SetTransform(
     cv::InputArrayOfArrays images,
     const std::vector<cv::detail::CameraParams> &cameras) {
@@ -588,35 +1724,28 @@ Status Stitcher::SetTransform(
     cv::InputArrayOfArrays images,
     const std::vector<cv::detail::CameraParams> &cameras,
     const std::vector<int> &component) {
-  images.getUMatVector(imgs_);
+  SetImages(images);
   masks_.clear();
 
-  if (imgs_.size() < 2 || component.size() < 2) {
+  if (NumImages() < 2 || component.size() < 2) {
     spdlog::error("Need more images");
     return Status::kErrNeedMoreImgs;
   }
 
-  work_scale_ = ComputeWorkScale(imgs_[0].size(), registr_resol_);
-  seam_scale_ = ComputeSeamScale(imgs_[0].size(), seam_est_resol_);
+  work_scale_ = ComputeWorkScale(full_img_sizes_[0], registr_resol_);
+  seam_scale_ = ComputeSeamScale(full_img_sizes_[0], seam_est_resol_);
   seam_work_aspect_ = seam_scale_ / work_scale_;
 
-  seam_est_imgs_.resize(imgs_.size());
-  full_img_sizes_.resize(imgs_.size());
-
-  for (size_t i = 0; i < imgs_.size(); ++i) {
-    full_img_sizes_[i] = imgs_[i].size();
-
-    resize(imgs_[i], seam_est_imgs_[i], cv::Size(), seam_scale_, seam_scale_,
-           cv::INTER_LINEAR_EXACT);
+  seam_est_imgs_.resize(NumImages());
+  for (size_t i = 0; i < NumImages(); ++i) {
+    seam_est_imgs_[i] = ScaledImage(i, seam_scale_);
   }
 
   features_.clear();
   pairwise_matches_.clear();
 
   indices_ = component;
-  seam_est_imgs_ = Index(seam_est_imgs_, indices_);
-  imgs_ = Index(imgs_, indices_);
-  full_img_sizes_ = Index(full_img_sizes_, indices_);
+  KeepImages(indices_);
 
   cameras_ = cameras;
   warped_image_scale_ = ComputeWarpScale(cameras_);
@@ -629,6 +1758,8 @@ bool Stitcher::Cancelled() const {
 }
 
 void Stitcher::NextTask(algorithm::ProgressType task) {
+  stage_span_.reset();
+  stage_span_.emplace(Label(task));
   if (monitor_ != nullptr) {
     monitor_->NotifyTaskDone();
     monitor_->SetTaskType(task);
@@ -636,6 +1767,7 @@ void Stitcher::NextTask(algorithm::ProgressType task) {
 }
 
 void Stitcher::EndMonitoring() {
+  stage_span_.reset();
   if (monitor_ != nullptr) {
     monitor_->NotifyTaskDone();
   }
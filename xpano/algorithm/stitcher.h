@@ -48,7 +48,13 @@
 
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
 #include <vector>
 
 #include <opencv2/core.hpp>
@@ -56,7 +62,10 @@
 #include <opencv2/imgproc.hpp>
 #include <opencv2/stitching.hpp>
 
+#include "xpano/algorithm/buffer_pool.h"
 #include "xpano/algorithm/progress.h"
+#include "xpano/utils/threadpool.h"
+#include "xpano/utils/trace.h"
 
 namespace xpano::algorithm::stitcher {
 
@@ -66,7 +75,9 @@ enum class Status : std::uint8_t {
   kCancelled,
   kErrNeedMoreImgs,
   kErrHomographyEstFail,
-  kErrCameraParamsAdjustFail
+  kErrCameraParamsAdjustFail,
+  kErrOutputFailed,
+  kErrMemoryBudget
 };
 
 bool IsSuccess(Status status);
@@ -79,6 +90,81 @@ struct WarpHelper {
   cv::Ptr<cv::detail::RotationWarper> warper;
 };
 
+struct Roi {
+  std::vector<cv::Point> corners;
+  std::vector<cv::Size> sizes;
+  cv::Ptr<cv::detail::RotationWarper> warper;
+  cv::Rect rect;
+};
+
+// Remap tables of a warp, the warped image and its mask are both produced
+// from them
+struct WarpMaps {
+  cv::UMat xmap;
+  cv::UMat ymap;
+  cv::Rect dst_roi;
+};
+
+// Compositing warp maps of the images, kept while they fit the budget.
+// Thread safe, the images are warped concurrently.
+class WarpMapCache {
+ public:
+  WarpMapCache(size_t num_images, size_t budget_bytes)
+      : maps_(num_images), budget_bytes_(budget_bytes) {}
+
+  [[nodiscard]] std::optional<WarpMaps> Get(size_t img_idx) const;
+  void Put(size_t img_idx, const WarpMaps& maps);
+
+ private:
+  mutable std::mutex mutex_;
+  std::vector<std::optional<WarpMaps>> maps_;
+  size_t budget_bytes_;
+  size_t bytes_used_ = 0;
+};
+
+// Compositing steps that don't depend on the blender, reusable when composing
+// again with the same inputs, see Stitcher::SetComposeCache
+struct ComposeCache {
+  // Inputs
+  std::vector<cv::Size> full_img_sizes;
+  std::vector<cv::detail::CameraParams> cameras;
+  double warped_image_scale;
+  double seam_work_aspect;
+  float max_pano_mpx;  // 0 if the resolution isn't capped
+  int max_memory_mb;
+  // Results
+  double compose_warped_image_scale;
+  std::vector<cv::Point> corners;
+  std::vector<cv::Size> sizes;
+  bool resolution_capped;
+  std::vector<cv::UMat> seams;
+  cv::Ptr<cv::detail::ExposureCompensator> exposure_comp;
+  // Filled in while compositing
+  std::shared_ptr<WarpMapCache> warp_maps;
+};
+
+// Receives the pano tile by tile, see Stitcher::ComposePanoramaTiled
+struct TiledOutput {
+  int tile_size;
+  // Called once with the full pano size before the first tile
+  std::function<bool(cv::Size)> open;
+  // Tile top left corner relative to the pano, CV_8UC3 image and CV_8U mask
+  std::function<bool(cv::Point, const cv::Mat&, const cv::Mat&)> write;
+  // Only the shard_index-th of num_shards bands of tile rows is composed,
+  // only the images intersecting it are loaded. The other bands are left to
+  // other processes, see pipeline::ShardWriter.
+  int shard_index = 0;
+  int num_shards = 1;
+};
+
+// Full resolution images loaded on demand, see Stitcher::SetFullResSource
+struct FullResSource {
+  std::vector<cv::Size> sizes;
+  // Called with the index of the input image, concurrently when the images
+  // are warped on the compose threads
+  std::function<cv::Mat(int)> load;
+};
+
 class Stitcher {
  public:
   using Mode = cv::Stitcher::Mode;
@@ -91,6 +177,17 @@ class Stitcher {
   [[nodiscard]] double SeamEstimationResol() const { return seam_est_resol_; }
   void SetSeamEstimationResol(double resol_mpx) { seam_est_resol_ = resol_mpx; }
 
+  // Coarse to fine: the seams estimated at SeamEstimationResol are refined up
+  // to this resolution, each level doubles the resolution and runs the seam
+  // finder again only in a narrow band around the upscaled seams. Limited by
+  // the resolution of the images passed to the stitcher, 0 disables.
+  [[nodiscard]] double SeamRefinementResol() const {
+    return seam_refine_resol_;
+  }
+  void SetSeamRefinementResol(double resol_mpx) {
+    seam_refine_resol_ = resol_mpx;
+  }
+
   [[nodiscard]] double PanoConfidenceThresh() const { return conf_thresh_; }
   void SetPanoConfidenceThresh(double conf_thresh) {
     conf_thresh_ = conf_thresh;
@@ -138,10 +235,83 @@ class Stitcher {
     features_matcher_ = features_matcher;
   }
 
+  // Finds the features of the images concurrently on the pool, one task per
+  // image. Feature finders aren't thread safe, the pool threads detect with
+  // their own ones from make_finder.
+  void SetFeatureThreads(utils::mt::Threadpool* pool,
+                         std::function<cv::Ptr<cv::Feature2D>()> make_finder) {
+    features_pool_ = pool;
+    make_features_finder_ = std::move(make_finder);
+  }
+
+  // Warps the images for compositing concurrently on the pool, at most
+  // max_in_flight warped images are kept in memory. The blender is still fed
+  // in order from the calling thread.
+  void SetComposeThreads(utils::mt::Threadpool* pool, int max_in_flight) {
+    compose_pool_ = pool;
+    max_in_flight_ = max_in_flight;
+  }
+
+  // The images passed to EstimateTransform / SetTransform are then low
+  // resolution copies used only for the registration and seam estimation.
+  // Each full resolution image is loaded right before it is warped and
+  // released after it is fed to the blender, the compose threads prefetch up
+  // to max_in_flight images.
+  void SetFullResSource(FullResSource source) {
+    full_res_source_ = std::move(source);
+  }
+
+  // Skips the pano size computation, exposure compensation and seam
+  // estimation if the cache inputs match. The warper and exposure compensator
+  // types are not part of the cache inputs, the caller has to check them.
+  void SetComposeCache(std::shared_ptr<const ComposeCache> cache) {
+    compose_cache_ = std::move(cache);
+  }
+  // Seams and exposure gains of the same cameras at another resolution, e.g.
+  // of the preview, reused when the compose cache doesn't match instead of
+  // estimating them again. The seam masks are upscaled to the warped images.
+  // The warper type isn't checked, the caller has to.
+  void SetSeamSource(std::shared_ptr<const ComposeCache> cache) {
+    seam_source_ = std::move(cache);
+  }
+  // ComposePanorama then returns only the crop, given relative to the pano
+  // size. Only the parts of the images inside it are warped and blended, the
+  // seams are still estimated over the whole overlaps.
+  void SetComposeCrop(cv::Rect2f relative_crop) {
+    compose_crop_ = relative_crop;
+  }
+
+  // Called with the new cache once the seams are estimated, before the
+  // images are composed, e.g. to checkpoint it. Not called for a reused cache.
+  void SetComposeCacheCallback(
+      std::function<void(std::shared_ptr<const ComposeCache>)> callback) {
+    compose_cache_callback_ = std::move(callback);
+  }
+
+  // Valid after a successful composition
+  [[nodiscard]] std::shared_ptr<const ComposeCache> GetComposeCache() const {
+    return compose_cache_;
+  }
+
+  // Per image buffers of the compositing, shared with the next stitches of
+  // the same pano, see StitchSession
+  void SetBufferPool(std::shared_ptr<BufferPool> pool) {
+    buffer_pool_ = std::move(pool);
+  }
+  [[nodiscard]] std::shared_ptr<BufferPool> GetBufferPool() const {
+    return buffer_pool_;
+  }
+
   void SetMaxPanoMpx(int max_pano_mpx) {
     max_pano_mpx_ = static_cast<float>(max_pano_mpx);
   }
 
+  // Estimates the peak memory of the compositing once the pano size is
+  // known. ComposePanorama downscales the pano to fit the budget,
+  // kErrMemoryBudget is returned before compositing if it can't fit.
+  // 0 means no limit.
+  void SetMaxMemoryMb(int max_memory_mb) { max_memory_mb_ = max_memory_mb; }
+
   [[nodiscard]] const cv::UMat& MatchingMask() const { return matching_mask_; }
   void SetMatchingMask(const cv::UMat& mask) {
     CV_Assert(mask.type() == CV_8U && mask.cols == mask.rows);
@@ -159,6 +329,23 @@ class Stitcher {
     bundle_adjuster_ = bundle_adjuster;
   }
 
+  // Indexed as the input images. EstimateTransform then skips the homography
+  // estimation and starts the bundle adjustment from these cameras. The
+  // images without one are registered through their matches to the images
+  // with one, the homography estimation runs only if some can't be reached.
+  void SetInitialCameras(
+      std::vector<std::optional<cv::detail::CameraParams>> cameras) {
+    initial_cameras_ = std::move(cameras);
+  }
+
+  // Capture grid cells of the input images, see algorithm::GridCell. Without
+  // initial cameras, EstimateTransform starts the bundle adjustment from the
+  // rotations of the grid instead of estimating the homographies. The angles
+  // between the columns / rows are measured on the neighbouring pairs.
+  void SetGridCells(std::vector<cv::Point> cells) {
+    grid_cells_ = std::move(cells);
+  }
+
   cv::Ptr<cv::detail::Estimator> Estimator() { return estimator_; }
   [[nodiscard]] cv::Ptr<cv::detail::Estimator> Estimator() const {
     return estimator_;
@@ -209,6 +396,14 @@ class Stitcher {
   Status EstimateTransform(cv::InputArrayOfArrays images,
                            cv::InputArrayOfArrays masks = cv::noArray());
 
+  // Skips the feature detection and matching. The features can come from a
+  // differently sized copy of the images (ImageFeatures::img_size), they are
+  // rescaled to the work scale together with the homographies.
+  Status EstimateTransform(
+      cv::InputArrayOfArrays images,
+      std::vector<cv::detail::ImageFeatures> features,
+      std::vector<cv::detail::MatchesInfo> pairwise_matches);
+
   Status SetTransform(cv::InputArrayOfArrays images,
                       const std::vector<cv::detail::CameraParams>& cameras,
                       const std::vector<int>& component);
@@ -218,11 +413,22 @@ class Stitcher {
 
   Status ComposePanorama(cv::OutputArray pano);
 
+  // Composes the pano one tile at a time, only the parts of the images
+  // intersecting a tile are warped, so the memory used for compositing is
+  // bounded by the tile size instead of the pano size. The pano size is not
+  // capped by SetMaxPanoMpx. Needs a blender that can be prepared repeatedly.
+  Status ComposePanoramaTiled(const TiledOutput& output);
+
   Status Stitch(cv::InputArrayOfArrays images, cv::OutputArray pano);
 
   Status Stitch(cv::InputArrayOfArrays images, cv::InputArrayOfArrays masks,
                 cv::OutputArray pano);
 
+  Status Stitch(cv::InputArrayOfArrays images,
+                std::vector<cv::detail::ImageFeatures> features,
+                std::vector<cv::detail::MatchesInfo> pairwise_matches,
+                cv::OutputArray pano);
+
   [[nodiscard]] std::vector<int> Component() const { return indices_; }
   [[nodiscard]] std::vector<cv::detail::CameraParams> Cameras() const {
     return cameras_;
@@ -236,9 +442,88 @@ class Stitcher {
   [[nodiscard]] WarpHelper GetWarpHelper() const { return warp_helper_; }
 
  private:
+  struct WarpedImage {
+    cv::UMat image;
+    cv::UMat mask;
+    cv::Point corner;
+  };
+
+  // Image split into source blocks, so that only the blocks intersecting a
+  // tile have to be warped
+  struct TileSource {
+    size_t img_idx;
+    cv::UMat image;  // full resolution
+    cv::Rect warped_rect;
+    std::vector<cv::Rect> blocks;
+    std::vector<cv::Rect> warped_blocks;
+    cv::Mat seam_mask;  // dilated
+    cv::Mat gains;      // CV_32FC3 gain map of blocks compensators
+  };
+
+  // Rough peak memory of the compositing in bytes
+  struct MemoryEstimate {
+    double fixed_bytes = 0.0;   // independent of the pano scale
+    double scaled_bytes = 0.0;  // proportional to the pano area
+  };
+
+  struct ComposeInput {
+    std::vector<cv::detail::CameraParams> cameras_scaled;
+    Roi roi;
+    std::vector<cv::UMat> seams;
+    bool resolution_capped = false;
+  };
+
+  void SetImages(cv::InputArrayOfArrays images);
+  [[nodiscard]] size_t NumImages() const { return full_img_sizes_.size(); }
+  // Keeps only the images of the pano component
+  void KeepImages(const std::vector<int>& indices);
+  // Input image resized to scale * its full resolution size
+  [[nodiscard]] cv::UMat ScaledImage(size_t img_idx, double scale) const;
+  [[nodiscard]] cv::UMat FullResImage(size_t img_idx) const;
   Status MatchImages();
+  Status UseFeatures(std::vector<cv::detail::ImageFeatures> features,
+                     std::vector<cv::detail::MatchesInfo> pairwise_matches);
+  Status LeaveBiggestComponent();
   Status EstimateCameraParams();
+  // Cameras of the component from initial_cameras_, false if incomplete
+  bool UseInitialCameras();
+  // Cameras of the component from grid_cells_, false if unusable
+  bool UseGridCameras();
   Status EstimateSeams(std::vector<cv::UMat>* seams);
+  // Scale of the last RefineSeams level, seam_scale_ if there are none
+  [[nodiscard]] double RefinedSeamScale() const;
+  Status RefineSeams(std::vector<cv::UMat>* seams);
+  // One level of RefineSeams, the seams are upscaled to the scale
+  Status RefineSeamsAt(double scale, std::vector<cv::UMat>* seams);
+  // Pano size + seams, shared by both the compositing variants. tile_size is
+  // 0 when composing the whole pano at once, only then the resolution can be
+  // capped.
+  Status PrepareCompose(int tile_size, ComposeInput* input);
+  [[nodiscard]] MemoryEstimate EstimateComposeMemory(const Roi& roi,
+                                                     int tile_size) const;
+  // Downscales the pano to fit max_memory_mb_ if possible
+  Status FitMemoryBudget(int tile_size, ComposeInput* input);
+  [[nodiscard]] bool CacheMatches(const ComposeCache& cache,
+                                  float max_pano_mpx) const;
+  // Same cameras, input sizes with the same aspect ratios
+  [[nodiscard]] bool CanReuseSeams(const ComposeCache& cache) const;
+  // Warp + exposure compensation + seam mask of a single image
+  WarpedImage WarpImage(const cv::UMat& img, size_t img_idx,
+                        const cv::detail::CameraParams& camera_scaled,
+                        const cv::UMat& seam_mask, const cv::Point& corner,
+                        cv::detail::RotationWarper* warper) const;
+  TileSource PrepareTileSource(size_t img_idx,
+                               const cv::detail::CameraParams& camera_scaled,
+                               const cv::Rect& warped_rect,
+                               const cv::UMat& seam_mask,
+                               const cv::Mat& gain_map,
+                               cv::detail::RotationWarper* warper) const;
+  // Same as WarpImage, limited to the part of the image inside region, the
+  // result is empty if they don't intersect
+  WarpedImage WarpRegion(const TileSource& source,
+                         const cv::detail::CameraParams& camera_scaled,
+                         const cv::Rect& region,
+                         cv::detail::RotationWarper* warper) const;
 
   [[nodiscard]] bool Cancelled() const;
   void NextTask(algorithm::ProgressType task);
@@ -246,6 +531,7 @@ class Stitcher {
 
   double registr_resol_;
   double seam_est_resol_;
+  double seam_refine_resol_ = 0.0;
   double conf_thresh_;
 
   cv::InterpolationFlags interp_flags_;
@@ -264,12 +550,15 @@ class Stitcher {
 
   std::vector<cv::UMat> imgs_;
   std::vector<cv::UMat> masks_;
+  std::optional<FullResSource> full_res_source_;
   std::vector<cv::Size> full_img_sizes_;
   std::vector<cv::detail::ImageFeatures> features_;
   std::vector<cv::detail::MatchesInfo> pairwise_matches_;
   std::vector<cv::UMat> seam_est_imgs_;
   std::vector<int> indices_;
   std::vector<cv::detail::CameraParams> cameras_;
+  std::vector<std::optional<cv::detail::CameraParams>> initial_cameras_;
+  std::vector<cv::Point> grid_cells_;
   cv::UMat result_mask_;
 
   double work_scale_ = 1.0;
@@ -278,8 +567,21 @@ class Stitcher {
   double warped_image_scale_ = 1.0;
 
   ProgressMonitor* monitor_ = nullptr;
+  // Trace span of the current sub-stage, see NextTask
+  std::optional<utils::trace::Span> stage_span_;
+  utils::mt::Threadpool* features_pool_ = nullptr;
+  std::function<cv::Ptr<cv::Feature2D>()> make_features_finder_;
+  utils::mt::Threadpool* compose_pool_ = nullptr;
+  int max_in_flight_ = 1;
   WarpHelper warp_helper_ = {};
+  std::shared_ptr<const ComposeCache> compose_cache_;
+  std::shared_ptr<const ComposeCache> seam_source_;
+  std::function<void(std::shared_ptr<const ComposeCache>)>
+      compose_cache_callback_;
+  std::optional<cv::Rect2f> compose_crop_;
   float max_pano_mpx_;
+  int max_memory_mb_ = 0;
+  std::shared_ptr<BufferPool> buffer_pool_ = std::make_shared<BufferPool>();
 };
 
 }  // namespace xpano::algorithm::stitcher
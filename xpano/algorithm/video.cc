@@ -0,0 +1,154 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/video.h"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include <opencv2/calib3d.hpp>
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+#include <opencv2/imgproc.hpp>
+#include <spdlog/spdlog.h>
+
+#ifdef XPANO_WITH_VIDEO
+#include <opencv2/videoio.hpp>
+#endif
+
+#include "xpano/algorithm/image.h"
+#include "xpano/constants.h"
+
+namespace xpano::algorithm::video {
+
+KeyframeSelector::KeyframeSelector(KeyframeOptions options)
+    : options_(options), orb_(cv::ORB::create(kKeyframeTrackingFeatures)) {}
+
+bool KeyframeSelector::Push(const cv::Mat& frame) {
+  if (tracking_size_.empty()) {
+    const double scale =
+        std::min(1.0, static_cast<double>(options_.tracking_longer_side) /
+                          std::max(frame.cols, frame.rows));
+    tracking_size_ = cv::Size(static_cast<int>(std::round(frame.cols * scale)),
+                              static_cast<int>(std::round(frame.rows * scale)));
+  }
+  cv::Mat gray;
+  if (frame.channels() == 1) {
+    gray = frame;
+  } else {
+    cv::cvtColor(frame, gray, cv::COLOR_BGR2GRAY);
+  }
+  cv::Mat small;
+  cv::resize(gray, small, tracking_size_, 0.0, 0.0, cv::INTER_AREA);
+
+  std::vector<cv::KeyPoint> keypoints;
+  cv::Mat descriptors;
+  orb_->detectAndCompute(small, cv::noArray(), keypoints, descriptors);
+
+  const bool keyframe = keyframe_descriptors_.empty() ||
+                        EstimateOverlap(keypoints, descriptors) <
+                            options_.min_overlap;
+  if (keyframe) {
+    keyframe_keypoints_ = std::move(keypoints);
+    keyframe_descriptors_ = descriptors;
+  }
+  return keyframe;
+}
+
+// Zero when the tracking is lost
+float KeyframeSelector::EstimateOverlap(
+    const std::vector<cv::KeyPoint>& keypoints,
+    const cv::Mat& descriptors) const {
+  if (descriptors.empty()) {
+    return 0.0f;
+  }
+  const cv::BFMatcher matcher(cv::NORM_HAMMING, /*crossCheck=*/true);
+  std::vector<cv::DMatch> matches;
+  matcher.match(keyframe_descriptors_, descriptors, matches);
+  if (static_cast<int>(matches.size()) < kMinKeyframeInliers) {
+    return 0.0f;
+  }
+
+  std::vector<cv::Point2f> keyframe_points;
+  std::vector<cv::Point2f> points;
+  for (const auto& match : matches) {
+    keyframe_points.push_back(keyframe_keypoints_[match.queryIdx].pt);
+    points.push_back(keypoints[match.trainIdx].pt);
+  }
+  cv::Mat inliers;
+  const cv::Mat transform =
+      cv::estimateAffinePartial2D(keyframe_points, points, inliers, cv::RANSAC);
+  if (transform.empty() || cv::countNonZero(inliers) < kMinKeyframeInliers) {
+    return 0.0f;
+  }
+
+  // Shift of the keyframe center, rotations of a sweep are small
+  const double width = tracking_size_.width;
+  const double height = tracking_size_.height;
+  const double shift_x = transform.at<double>(0, 0) * width / 2 +
+                         transform.at<double>(0, 1) * height / 2 +
+                         transform.at<double>(0, 2) - width / 2;
+  const double shift_y = transform.at<double>(1, 0) * width / 2 +
+                         transform.at<double>(1, 1) * height / 2 +
+                         transform.at<double>(1, 2) - height / 2;
+  const double overlap = std::max(0.0, width - std::abs(shift_x)) *
+                         std::max(0.0, height - std::abs(shift_y)) /
+                         (width * height);
+  return static_cast<float>(overlap);
+}
+
+std::vector<Image> LoadKeyframes(const std::filesystem::path& path,
+                                 const ImageLoadOptions& load_options,
+                                 const KeyframeOptions& options,
+                                 const std::function<bool()>& is_cancelled) {
+#ifdef XPANO_WITH_VIDEO
+  cv::VideoCapture capture(path.string());
+  if (!capture.isOpened()) {
+    spdlog::error("Failed to open video {}", path.string());
+    return {};
+  }
+
+  KeyframeSelector selector(options);
+  std::vector<Image> keyframes;
+  cv::Mat frame;
+  int frame_id = 0;
+  for (; capture.read(frame); frame_id++) {
+    if (is_cancelled()) {
+      return {};
+    }
+    if (!selector.Push(frame)) {
+      continue;
+    }
+    Image image(path, frame_id);
+    // The capture reuses the buffer for the next frame
+    image.LoadFrame(frame.clone(), load_options);
+    if (image.IsLoaded()) {
+      keyframes.push_back(std::move(image));
+    }
+  }
+  spdlog::info("Picked {} keyframes out of {} frames of {}", keyframes.size(),
+               frame_id, path.string());
+  return keyframes;
+#else
+  spdlog::error("Failed to load video {}, built without video support",
+                path.string());
+  return {};
+#endif
+}
+
+cv::Mat ReadFrame(const std::filesystem::path& path, int frame) {
+  cv::Mat result;
+#ifdef XPANO_WITH_VIDEO
+  cv::VideoCapture capture(path.string());
+  if (capture.isOpened() && capture.set(cv::CAP_PROP_POS_FRAMES, frame)) {
+    capture.read(result);
+  }
+#endif
+  return result;
+}
+
+}  // namespace xpano::algorithm::video
@@ -0,0 +1,57 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <filesystem>
+#include <functional>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/features2d.hpp>
+
+#include "xpano/algorithm/image.h"
+#include "xpano/constants.h"
+
+namespace xpano::algorithm::video {
+
+struct KeyframeOptions {
+  float min_overlap = kDefaultKeyframeOverlap;
+  int tracking_longer_side = kKeyframeTrackingSize;
+};
+
+// Picks the keyframes of a sweep on the fly, without keeping the frames:
+// each frame is tracked against the last keyframe with ORB at a low
+// resolution. A frame becomes a keyframe once its overlap with the last one,
+// estimated from the shift of the tracked features, drops below
+// min_overlap, or when the tracking is lost.
+class KeyframeSelector {
+ public:
+  explicit KeyframeSelector(KeyframeOptions options = {});
+
+  // True if the frame is a new keyframe, the first frame always is
+  bool Push(const cv::Mat& frame);
+
+ private:
+  [[nodiscard]] float EstimateOverlap(
+      const std::vector<cv::KeyPoint>& keypoints,
+      const cv::Mat& descriptors) const;
+
+  KeyframeOptions options_;
+  cv::Ptr<cv::ORB> orb_;
+  cv::Size tracking_size_;
+  std::vector<cv::KeyPoint> keyframe_keypoints_;
+  cv::Mat keyframe_descriptors_;
+};
+
+// Decodes the video as a stream and loads only the keyframes, no temporary
+// files. Empty if the video can't be read or the build has no video support.
+std::vector<Image> LoadKeyframes(const std::filesystem::path& path,
+                                 const ImageLoadOptions& load_options,
+                                 const KeyframeOptions& options,
+                                 const std::function<bool()>& is_cancelled);
+
+// Full resolution frame, empty on failure
+cv::Mat ReadFrame(const std::filesystem::path& path, int frame);
+
+}  // namespace xpano::algorithm::video
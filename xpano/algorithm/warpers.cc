@@ -0,0 +1,274 @@
+// SPDX-FileCopyrightText: 2024 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/algorithm/warpers.h"
+
+#include <cmath>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/ocl.hpp>
+#include <opencv2/stitching/detail/warpers.hpp>
+#include <simde/x86/avx.h>
+
+namespace xpano::algorithm::stitcher::fast {
+
+namespace {
+
+constexpr int kLanes = 8;
+constexpr float kPi = static_cast<float>(CV_PI);
+
+// The ray through the pano pixel (u, v) before the rotation is
+// (col_x[u] * row_r[v], row_y[v], col_z[u] * row_r[v])
+struct RayTables {
+  std::vector<float> col_x;
+  std::vector<float> col_z;
+  std::vector<float> row_r;
+  std::vector<float> row_y;
+};
+
+// Specialized per projector, each mirrors the projector's mapBackward
+template <typename TProjector>
+struct Projection;
+
+template <>
+struct Projection<cv::detail::PlaneProjector> {
+  static constexpr bool kClipBehindCamera = false;
+
+  static void Column(const cv::detail::PlaneProjector& projector, float u,
+                     float* col_x, float* col_z) {
+    *col_x = u / projector.scale - projector.t[0];
+    *col_z = 1 - projector.t[2];
+  }
+  static void Row(const cv::detail::PlaneProjector& projector, float v,
+                  float* row_r, float* row_y) {
+    *row_r = 1.0f;
+    *row_y = v / projector.scale - projector.t[1];
+  }
+};
+
+template <>
+struct Projection<cv::detail::CylindricalProjector> {
+  static constexpr bool kClipBehindCamera = true;
+
+  static void Column(const cv::detail::CylindricalProjector& projector,
+                     float u, float* col_x, float* col_z) {
+    u /= projector.scale;
+    *col_x = sinf(u);
+    *col_z = cosf(u);
+  }
+  static void Row(const cv::detail::CylindricalProjector& projector, float v,
+                  float* row_r, float* row_y) {
+    *row_r = 1.0f;
+    *row_y = v / projector.scale;
+  }
+};
+
+template <>
+struct Projection<cv::detail::SphericalProjector> {
+  static constexpr bool kClipBehindCamera = true;
+
+  static void Column(const cv::detail::SphericalProjector& projector, float u,
+                     float* col_x, float* col_z) {
+    u /= projector.scale;
+    *col_x = sinf(u);
+    *col_z = cosf(u);
+  }
+  static void Row(const cv::detail::SphericalProjector& projector, float v,
+                  float* row_r, float* row_y) {
+    v /= projector.scale;
+    *row_r = sinf(kPi - v);
+    *row_y = cosf(kPi - v);
+  }
+};
+
+template <>
+struct Projection<cv::detail::MercatorProjector> {
+  static constexpr bool kClipBehindCamera = true;
+
+  static void Column(const cv::detail::MercatorProjector& projector, float u,
+                     float* col_x, float* col_z) {
+    u /= projector.scale;
+    *col_x = sinf(u);
+    *col_z = cosf(u);
+  }
+  static void Row(const cv::detail::MercatorProjector& projector, float v,
+                  float* row_r, float* row_y) {
+    v /= projector.scale;
+    const float latitude = atanf(sinhf(v));
+    *row_r = cosf(latitude);
+    *row_y = sinf(latitude);
+  }
+};
+
+template <typename TProjector>
+RayTables ComputeRayTables(const TProjector& projector, cv::Point dst_tl,
+                           cv::Point dst_br) {
+  const int cols = dst_br.x - dst_tl.x + 1;
+  const int rows = dst_br.y - dst_tl.y + 1;
+  RayTables tables{std::vector<float>(cols), std::vector<float>(cols),
+                   std::vector<float>(rows), std::vector<float>(rows)};
+  for (int col = 0; col < cols; col++) {
+    Projection<TProjector>::Column(projector,
+                                   static_cast<float>(dst_tl.x + col),
+                                   &tables.col_x[col], &tables.col_z[col]);
+  }
+  for (int row = 0; row < rows; row++) {
+    Projection<TProjector>::Row(projector, static_cast<float>(dst_tl.y + row),
+                                &tables.row_r[row], &tables.row_y[row]);
+  }
+  return tables;
+}
+
+template <typename TProjector>
+void FillMapRow(const TProjector& projector, const RayTables& tables, int row,
+                float* xmap, float* ymap) {
+  constexpr bool kClip = Projection<TProjector>::kClipBehindCamera;
+  const float* k = projector.k_rinv;
+  const int cols = static_cast<int>(tables.col_x.size());
+  const float row_r = tables.row_r[row];
+  const float y_ = tables.row_y[row];
+
+  // The y part of the rotation is constant along the row
+  const float x_base = k[1] * y_;
+  const float y_base = k[4] * y_;
+  const float z_base = k[7] * y_;
+
+  const simde__m256 r = simde_mm256_set1_ps(row_r);
+  const simde__m256 k0 = simde_mm256_set1_ps(k[0]);
+  const simde__m256 k2 = simde_mm256_set1_ps(k[2]);
+  const simde__m256 k3 = simde_mm256_set1_ps(k[3]);
+  const simde__m256 k5 = simde_mm256_set1_ps(k[5]);
+  const simde__m256 k6 = simde_mm256_set1_ps(k[6]);
+  const simde__m256 k8 = simde_mm256_set1_ps(k[8]);
+  const simde__m256 xb = simde_mm256_set1_ps(x_base);
+  const simde__m256 yb = simde_mm256_set1_ps(y_base);
+  const simde__m256 zb = simde_mm256_set1_ps(z_base);
+  const simde__m256 zero = simde_mm256_setzero_ps();
+  const simde__m256 invalid = simde_mm256_set1_ps(-1.0f);
+
+  int col = 0;
+  for (; col + kLanes <= cols; col += kLanes) {
+    const simde__m256 x_ =
+        simde_mm256_mul_ps(simde_mm256_loadu_ps(&tables.col_x[col]), r);
+    const simde__m256 z_ =
+        simde_mm256_mul_ps(simde_mm256_loadu_ps(&tables.col_z[col]), r);
+    const simde__m256 x = simde_mm256_add_ps(
+        simde_mm256_add_ps(simde_mm256_mul_ps(k0, x_), xb),
+        simde_mm256_mul_ps(k2, z_));
+    const simde__m256 y = simde_mm256_add_ps(
+        simde_mm256_add_ps(simde_mm256_mul_ps(k3, x_), yb),
+        simde_mm256_mul_ps(k5, z_));
+    const simde__m256 z = simde_mm256_add_ps(
+        simde_mm256_add_ps(simde_mm256_mul_ps(k6, x_), zb),
+        simde_mm256_mul_ps(k8, z_));
+    simde__m256 map_x = simde_mm256_div_ps(x, z);
+    simde__m256 map_y = simde_mm256_div_ps(y, z);
+    if constexpr (kClip) {
+      const simde__m256 in_front = simde_mm256_cmp_ps(z, zero, SIMDE_CMP_GT_OQ);
+      map_x = simde_mm256_blendv_ps(invalid, map_x, in_front);
+      map_y = simde_mm256_blendv_ps(invalid, map_y, in_front);
+    }
+    simde_mm256_storeu_ps(xmap + col, map_x);
+    simde_mm256_storeu_ps(ymap + col, map_y);
+  }
+  for (; col < cols; col++) {
+    const float x_ = tables.col_x[col] * row_r;
+    const float z_ = tables.col_z[col] * row_r;
+    const float x = k[0] * x_ + x_base + k[2] * z_;
+    const float y = k[3] * x_ + y_base + k[5] * z_;
+    const float z = k[6] * x_ + z_base + k[8] * z_;
+    if (kClip && !(z > 0)) {
+      xmap[col] = -1.0f;
+      ymap[col] = -1.0f;
+    } else {
+      xmap[col] = x / z;
+      ymap[col] = y / z;
+    }
+  }
+}
+
+template <typename TProjector>
+cv::Rect BuildMaps(const TProjector& projector, cv::Point dst_tl,
+                   cv::Point dst_br, cv::OutputArray xmap_out,
+                   cv::OutputArray ymap_out) {
+  const cv::Size size{dst_br.x - dst_tl.x + 1, dst_br.y - dst_tl.y + 1};
+  xmap_out.create(size, CV_32F);
+  ymap_out.create(size, CV_32F);
+  cv::Mat xmap = xmap_out.getMat();
+  cv::Mat ymap = ymap_out.getMat();
+
+  const auto tables = ComputeRayTables(projector, dst_tl, dst_br);
+  cv::parallel_for_(cv::Range(0, size.height), [&](const cv::Range& range) {
+    for (int row = range.start; row < range.end; row++) {
+      FillMapRow(projector, tables, row, xmap.ptr<float>(row),
+                 ymap.ptr<float>(row));
+    }
+  });
+  return {dst_tl, dst_br};
+}
+
+bool UseOpenCL(cv::OutputArray xmap, cv::OutputArray ymap) {
+  return cv::ocl::isOpenCLActivated() && xmap.isUMat() && ymap.isUMat();
+}
+
+}  // namespace
+
+cv::Rect PlaneWarper::buildMaps(cv::Size src_size, cv::InputArray K,
+                                cv::InputArray R, cv::OutputArray xmap,
+                                cv::OutputArray ymap) {
+  return buildMaps(src_size, K, R, cv::Mat::zeros(3, 1, CV_32FC1), xmap,
+                   ymap);
+}
+
+cv::Rect PlaneWarper::buildMaps(cv::Size src_size, cv::InputArray K,
+                                cv::InputArray R, cv::InputArray T,
+                                cv::OutputArray xmap, cv::OutputArray ymap) {
+  if (UseOpenCL(xmap, ymap)) {
+    return cv::detail::PlaneWarper::buildMaps(src_size, K, R, T, xmap, ymap);
+  }
+  projector_.setCameraParams(K, R, T);
+  cv::Point dst_tl;
+  cv::Point dst_br;
+  detectResultRoi(src_size, dst_tl, dst_br);
+  return BuildMaps(projector_, dst_tl, dst_br, xmap, ymap);
+}
+
+cv::Rect CylindricalWarper::buildMaps(cv::Size src_size, cv::InputArray K,
+                                      cv::InputArray R, cv::OutputArray xmap,
+                                      cv::OutputArray ymap) {
+  if (UseOpenCL(xmap, ymap)) {
+    return cv::detail::CylindricalWarper::buildMaps(src_size, K, R, xmap,
+                                                    ymap);
+  }
+  projector_.setCameraParams(K, R);
+  cv::Point dst_tl;
+  cv::Point dst_br;
+  detectResultRoi(src_size, dst_tl, dst_br);
+  return BuildMaps(projector_, dst_tl, dst_br, xmap, ymap);
+}
+
+cv::Rect SphericalWarper::buildMaps(cv::Size src_size, cv::InputArray K,
+                                    cv::InputArray R, cv::OutputArray xmap,
+                                    cv::OutputArray ymap) {
+  if (UseOpenCL(xmap, ymap)) {
+    return cv::detail::SphericalWarper::buildMaps(src_size, K, R, xmap, ymap);
+  }
+  projector_.setCameraParams(K, R);
+  cv::Point dst_tl;
+  cv::Point dst_br;
+  detectResultRoi(src_size, dst_tl, dst_br);
+  return BuildMaps(projector_, dst_tl, dst_br, xmap, ymap);
+}
+
+cv::Rect MercatorWarper::buildMaps(cv::Size src_size, cv::InputArray K,
+                                   cv::InputArray R, cv::OutputArray xmap,
+                                   cv::OutputArray ymap) {
+  projector_.setCameraParams(K, R);
+  cv::Point dst_tl;
+  cv::Point dst_br;
+  detectResultRoi(src_size, dst_tl, dst_br);
+  return BuildMaps(projector_, dst_tl, dst_br, xmap, ymap);
+}
+
+}  // namespace xpano::algorithm::stitcher::fast
@@ -1,6 +1,9 @@
 // SPDX-FileCopyrightText: 2024 Tomas Krupka
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+#pragma once
+
+#include <opencv2/core.hpp>
 #include <opencv2/stitching/detail/warpers.hpp>
 #include <opencv2/stitching/warpers.hpp>
 
@@ -30,4 +33,63 @@ class SphericalPortraitWarper : public cv::WarperCreator {
   }
 };
 
-}  // namespace xpano::algorithm::stitcher
\ No newline at end of file
+// Warpers with the same projection and result ROI as their OpenCV bases, but
+// with vectorized map building.
+//  - The backward ray of these projections factors into a column and a row
+//    part, so the trig runs once per map column and row instead of per pixel.
+//  - The per pixel rotation and perspective divide runs 8 pixels at a time.
+//  - OpenCV's own OpenCL kernels are kept when the maps live on the GPU.
+namespace fast {
+
+class PlaneWarper : public cv::detail::PlaneWarper {
+ public:
+  using cv::detail::PlaneWarper::PlaneWarper;
+
+  cv::Rect buildMaps(cv::Size src_size, cv::InputArray K, cv::InputArray R,
+                     cv::OutputArray xmap, cv::OutputArray ymap) override;
+  cv::Rect buildMaps(cv::Size src_size, cv::InputArray K, cv::InputArray R,
+                     cv::InputArray T, cv::OutputArray xmap,
+                     cv::OutputArray ymap) override;
+};
+
+class CylindricalWarper : public cv::detail::CylindricalWarper {
+ public:
+  using cv::detail::CylindricalWarper::CylindricalWarper;
+
+  cv::Rect buildMaps(cv::Size src_size, cv::InputArray K, cv::InputArray R,
+                     cv::OutputArray xmap, cv::OutputArray ymap) override;
+};
+
+class SphericalWarper : public cv::detail::SphericalWarper {
+ public:
+  using cv::detail::SphericalWarper::SphericalWarper;
+
+  cv::Rect buildMaps(cv::Size src_size, cv::InputArray K, cv::InputArray R,
+                     cv::OutputArray xmap, cv::OutputArray ymap) override;
+};
+
+class MercatorWarper : public cv::detail::MercatorWarper {
+ public:
+  using cv::detail::MercatorWarper::MercatorWarper;
+
+  cv::Rect buildMaps(cv::Size src_size, cv::InputArray K, cv::InputArray R,
+                     cv::OutputArray xmap, cv::OutputArray ymap) override;
+};
+
+}  // namespace fast
+
+template <typename TWarper>
+class FastWarper : public cv::WarperCreator {
+ public:
+  [[nodiscard]] cv::Ptr<cv::detail::RotationWarper> create(
+      float scale) const override {
+    return cv::makePtr<TWarper>(scale);
+  }
+};
+
+using FastPlaneWarper = FastWarper<fast::PlaneWarper>;
+using FastCylindricalWarper = FastWarper<fast::CylindricalWarper>;
+using FastSphericalWarper = FastWarper<fast::SphericalWarper>;
+using FastMercatorWarper = FastWarper<fast::MercatorWarper>;
+
+}  // namespace xpano::algorithm::stitcher
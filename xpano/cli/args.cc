@@ -5,8 +5,12 @@
 
 #include <algorithm>
 #include <charconv>
+#include <cmath>
+#include <cstddef>
 #include <exception>
 #include <filesystem>
+#include <iterator>
+#include <limits>
 #include <optional>
 #include <string>
 #include <string_view>
@@ -15,6 +19,7 @@
 #include <spdlog/spdlog.h>
 
 #include "xpano/algorithm/options.h"
+#include "xpano/cli/stream.h"
 #include "xpano/constants.h"
 #include "xpano/utils/fmt.h"
 #include "xpano/utils/path.h"
@@ -25,19 +30,52 @@ namespace {
 
 const std::string kGuiFlag = "--gui";
 const std::string kOutputFlag = "--output=";
+const std::string kStdinFlag = "--stdin";
+const std::string kAllPanosFlag = "--all-panos";
+const std::string kTraceFlag = "--trace=";
+const std::string kReportFlag = "--report=";
+const std::string kCheckpointDirFlag = "--checkpoint-dir=";
+const std::string kSpillDirFlag = "--spill-dir=";
+const std::string kMappedFramesDirFlag = "--mapped-frames-dir=";
+const std::string kWatchFlag = "--watch=";
+const std::string kJobsFlag = "--jobs=";
+const std::string kQuietPeriodFlag = "--quiet-period=";
+const std::string kShardFlag = "--shard=";
+const std::string kNoWarmUpFlag = "--no-warm-up";
+const std::string kThreadsFlag = "--threads=";
+const std::string kCpusFlag = "--cpus=";
 const std::string kHelpFlag = "--help";
 const std::string kVersionFlag = "--version";
 const std::string kProjectionFlag = "--projection=";
+const std::string kFeatureFlag = "--feature=";
+const std::string kNumFeaturesFlag = "--num-features=";
+const std::string kLensFlag = "--lens=";
+const std::string kLensProfileFlag = "--lens-profile=";
 const std::string kMatchingTypeFlag = "--matching-type=";
 const std::string kMatchThresholdFlag = "--match-threshold=";
 const std::string kMinShiftFlag = "--min-shift=";
+const std::string kAdaptiveNeighborhoodFlag = "--adaptive-neighborhood";
+const std::string kGridFlag = "--grid=";
+const std::string kGridOrderFlag = "--grid-order=";
+const std::string kGridDiagonalsFlag = "--grid-diagonals";
+const std::string kCoarseToFineFlag = "--coarse-to-fine";
 const std::string kJpegQualityFlag = "--jpeg-quality=";
 const std::string kPngCompressionFlag = "--png-compression=";
+const std::string kEncoderQualityFlag = "--encoder-quality=";
+const std::string kEncoderEffortFlag = "--encoder-effort=";
 const std::string kCopyMetadataFlag = "--copy-metadata";
 const std::string kNoCopyMetadataFlag = "--no-copy-metadata";
 const std::string kWaveCorrectionFlag = "--wave-correction=";
 const std::string kMaxPanoMpxFlag = "--max-pano-mpx=";
+const std::string kMaxMemoryMbFlag = "--max-memory-mb=";
 const std::string kNoFullResFlag = "--no-full-res";
+const std::string kTiledFlag = "--tiled";
+const std::string kTiffOverviewsFlag = "--tiff-overviews";
+const std::string kSeamFinderFlag = "--seam-finder=";
+const std::string kDeviceResidentFlag = "--device-resident";
+
+constexpr float kInvalidLensCoefficient =
+    std::numeric_limits<float>::quiet_NaN();
 
 std::optional<int> ParseInt(const std::string& str) {
   int value;
@@ -60,6 +98,42 @@ std::optional<float> ParseFloat(const std::string& str) {
   return std::nullopt;
 }
 
+// "<index>/<count>", 1-based
+std::optional<pipeline::ShardOptions> ParseShard(const std::string& str) {
+  auto separator = str.find('/');
+  if (separator == std::string::npos) {
+    return std::nullopt;
+  }
+  auto index = ParseInt(str.substr(0, separator));
+  auto count = ParseInt(str.substr(separator + 1));
+  if (!index || !count || *count < 1 || *index < 1 || *index > *count) {
+    return std::nullopt;
+  }
+  return pipeline::ShardOptions{.index = *index - 1, .count = *count};
+}
+
+// Comma separated CPUs or ranges, e.g. 0-3,8
+std::optional<std::vector<int>> ParseCpus(const std::string& str) {
+  std::vector<int> cpus;
+  std::size_t start = 0;
+  while (start <= str.size()) {
+    auto end = std::min(str.find(',', start), str.size());
+    auto item = str.substr(start, end - start);
+    auto dash = item.find('-');
+    auto first = ParseInt(item.substr(0, dash));
+    auto last = dash == std::string::npos ? first
+                                          : ParseInt(item.substr(dash + 1));
+    if (!first || !last || *first < 0 || *last < *first) {
+      return std::nullopt;
+    }
+    for (int cpu = *first; cpu <= *last; cpu++) {
+      cpus.push_back(cpu);
+    }
+    start = end + 1;
+  }
+  return cpus;
+}
+
 std::optional<algorithm::ProjectionType> ParseProjectionType(
     const std::string& str) {
   if (str == "perspective") return algorithm::ProjectionType::kPerspective;
@@ -85,11 +159,82 @@ std::optional<algorithm::WaveCorrectionType> ParseWaveCorrectionType(
   return std::nullopt;
 }
 
+std::optional<algorithm::SeamFinderType> ParseSeamFinderType(
+    const std::string& str) {
+  if (str == "auto") return algorithm::SeamFinderType::kAuto;
+  if (str == "voronoi") return algorithm::SeamFinderType::kVoronoi;
+  if (str == "dp") return algorithm::SeamFinderType::kDpColor;
+  if (str == "graphcut") return algorithm::SeamFinderType::kGraphCut;
+  return std::nullopt;
+}
+
+std::optional<algorithm::FeatureType> ParseFeatureType(
+    const std::string& str) {
+  if (str == "sift") return algorithm::FeatureType::kSift;
+  if (str == "orb") return algorithm::FeatureType::kOrb;
+  if (str == "akaze") return algorithm::FeatureType::kAkaze;
+  return std::nullopt;
+}
+
+// "<k1>,<k2>"
+std::optional<algorithm::LensProfile> ParseLens(const std::string& str) {
+  auto separator = str.find(',');
+  if (separator == std::string::npos) {
+    return std::nullopt;
+  }
+  auto k1 = ParseFloat(str.substr(0, separator));
+  auto k2 = ParseFloat(str.substr(separator + 1));
+  if (!k1 || !k2) {
+    return std::nullopt;
+  }
+  return algorithm::LensProfile{.k1 = *k1, .k2 = *k2};
+}
+
+// "<model>:<k1>,<k2>", the model may contain colons
+std::optional<algorithm::LensProfile> ParseLensProfile(
+    const std::string& str) {
+  auto separator = str.rfind(':');
+  if (separator == std::string::npos || separator == 0) {
+    return std::nullopt;
+  }
+  auto profile = ParseLens(str.substr(separator + 1));
+  if (!profile) {
+    return std::nullopt;
+  }
+  profile->model = str.substr(0, separator);
+  return profile;
+}
+
 std::optional<pipeline::MatchingType> ParseMatchingType(
     const std::string& str) {
   if (str == "auto") return pipeline::MatchingType::kAuto;
   if (str == "single") return pipeline::MatchingType::kSinglePano;
   if (str == "none") return pipeline::MatchingType::kNone;
+  if (str == "grid") return pipeline::MatchingType::kGrid;
+  return std::nullopt;
+}
+
+// "<cols>x<rows>"
+std::optional<algorithm::GridOptions> ParseGrid(const std::string& str) {
+  auto separator = str.find('x');
+  if (separator == std::string::npos) {
+    return std::nullopt;
+  }
+  auto cols = ParseInt(str.substr(0, separator));
+  auto rows = ParseInt(str.substr(separator + 1));
+  if (!cols || !rows) {
+    return std::nullopt;
+  }
+  return algorithm::GridOptions{.rows = *rows, .cols = *cols};
+}
+
+std::optional<algorithm::GridOrder> ParseGridOrder(const std::string& str) {
+  if (str == "rows") return algorithm::GridOrder::kRows;
+  if (str == "serpentine") return algorithm::GridOrder::kRowsSerpentine;
+  if (str == "columns") return algorithm::GridOrder::kColumns;
+  if (str == "columns-serpentine") {
+    return algorithm::GridOrder::kColumnsSerpentine;
+  }
   return std::nullopt;
 }
 
@@ -103,14 +248,89 @@ void ParseArg(Args* result, const std::string& arg) {
   } else if (arg.starts_with(kOutputFlag)) {
     auto substr = arg.substr(kOutputFlag.size());
     result->output_path = std::filesystem::path(substr);
+  } else if (arg == kStdinFlag) {
+    result->read_stdin = true;
+  } else if (arg == kAllPanosFlag) {
+    result->all_panos = true;
+  } else if (arg.starts_with(kTraceFlag)) {
+    auto substr = arg.substr(kTraceFlag.size());
+    result->trace_path = std::filesystem::path(substr);
+  } else if (arg.starts_with(kReportFlag)) {
+    auto substr = arg.substr(kReportFlag.size());
+    result->report_path = std::filesystem::path(substr);
+  } else if (arg.starts_with(kCheckpointDirFlag)) {
+    auto substr = arg.substr(kCheckpointDirFlag.size());
+    result->checkpoint_dir = std::filesystem::path(substr);
+  } else if (arg.starts_with(kSpillDirFlag)) {
+    auto substr = arg.substr(kSpillDirFlag.size());
+    result->spill_dir = std::filesystem::path(substr);
+  } else if (arg.starts_with(kMappedFramesDirFlag)) {
+    auto substr = arg.substr(kMappedFramesDirFlag.size());
+    result->mapped_frames_dir = std::filesystem::path(substr);
+  } else if (arg.starts_with(kWatchFlag)) {
+    auto substr = arg.substr(kWatchFlag.size());
+    result->watch_dir = std::filesystem::path(substr);
+  } else if (arg.starts_with(kJobsFlag)) {
+    auto substr = arg.substr(kJobsFlag.size());
+    result->jobs_path = std::filesystem::path(substr);
+  } else if (arg.starts_with(kQuietPeriodFlag)) {
+    auto substr = arg.substr(kQuietPeriodFlag.size());
+    result->quiet_period_s = ParseInt(substr);
+    if (!result->quiet_period_s) {
+      result->quiet_period_s = -1;
+    }
+  } else if (arg.starts_with(kShardFlag)) {
+    auto substr = arg.substr(kShardFlag.size());
+    result->shard = ParseShard(substr);
+    if (!result->shard) {
+      // Rejected by ValidateArgs
+      result->shard = pipeline::ShardOptions{.index = -1, .count = 0};
+    }
+  } else if (arg == kNoWarmUpFlag) {
+    result->warm_up = false;
+  } else if (arg.starts_with(kThreadsFlag)) {
+    auto substr = arg.substr(kThreadsFlag.size());
+    result->threads = ParseInt(substr);
+    if (!result->threads) {
+      result->threads = -1;
+    }
+  } else if (arg.starts_with(kCpusFlag)) {
+    auto substr = arg.substr(kCpusFlag.size());
+    // Rejected by ValidateArgs if invalid
+    result->cpus = ParseCpus(substr).value_or(std::vector{-1});
   } else if (arg.starts_with(kProjectionFlag)) {
     auto substr = arg.substr(kProjectionFlag.size());
     result->projection = ParseProjectionType(substr);
+  } else if (arg.starts_with(kFeatureFlag)) {
+    auto substr = arg.substr(kFeatureFlag.size());
+    result->feature = ParseFeatureType(substr);
+    if (!result->feature) {
+      spdlog::warn(
+          "Invalid --feature '{}', using default (sift). Valid: sift, orb, "
+          "akaze",
+          substr);
+    }
+  } else if (arg.starts_with(kNumFeaturesFlag)) {
+    auto substr = arg.substr(kNumFeaturesFlag.size());
+    result->num_features = ParseInt(substr);
+    if (!result->num_features) {
+      spdlog::warn("Invalid --num-features '{}', using default ({})", substr,
+                   kNumFeatures);
+    }
+  } else if (arg.starts_with(kLensFlag)) {
+    auto substr = arg.substr(kLensFlag.size());
+    // Rejected by ValidateArgs if invalid
+    result->lens_profiles.push_back(ParseLens(substr).value_or(
+        algorithm::LensProfile{.k1 = kInvalidLensCoefficient}));
+  } else if (arg.starts_with(kLensProfileFlag)) {
+    auto substr = arg.substr(kLensProfileFlag.size());
+    result->lens_profiles.push_back(ParseLensProfile(substr).value_or(
+        algorithm::LensProfile{.k1 = kInvalidLensCoefficient}));
   } else if (arg.starts_with(kMatchingTypeFlag)) {
     auto substr = arg.substr(kMatchingTypeFlag.size());
     result->matching_type = ParseMatchingType(substr);
     if (!result->matching_type) {
-      spdlog::warn("Invalid --matching-type '{}', using default (auto). Valid: auto, single, none", substr);
+      spdlog::warn("Invalid --matching-type '{}', using default (auto). Valid: auto, single, none, grid", substr);
     }
   } else if (arg.starts_with(kMatchThresholdFlag)) {
     auto substr = arg.substr(kMatchThresholdFlag.size());
@@ -118,12 +338,42 @@ void ParseArg(Args* result, const std::string& arg) {
   } else if (arg.starts_with(kMinShiftFlag)) {
     auto substr = arg.substr(kMinShiftFlag.size());
     result->min_shift = ParseFloat(substr);
+  } else if (arg == kAdaptiveNeighborhoodFlag) {
+    result->adaptive_neighborhood = true;
+  } else if (arg == kCoarseToFineFlag) {
+    result->coarse_to_fine = true;
+  } else if (arg.starts_with(kGridFlag)) {
+    auto substr = arg.substr(kGridFlag.size());
+    result->grid = ParseGrid(substr);
+    if (!result->grid) {
+      // Rejected by ValidateArgs
+      result->grid = algorithm::GridOptions{.rows = 0, .cols = 0};
+    }
+  } else if (arg.starts_with(kGridOrderFlag)) {
+    auto substr = arg.substr(kGridOrderFlag.size());
+    auto order = ParseGridOrder(substr);
+    if (!order) {
+      spdlog::warn(
+          "Invalid --grid-order '{}', using default (serpentine). Valid: "
+          "rows, serpentine, columns, columns-serpentine",
+          substr);
+    } else {
+      result->grid_order = order;
+    }
+  } else if (arg == kGridDiagonalsFlag) {
+    result->grid_diagonals = true;
   } else if (arg.starts_with(kJpegQualityFlag)) {
     auto substr = arg.substr(kJpegQualityFlag.size());
     result->jpeg_quality = ParseInt(substr);
   } else if (arg.starts_with(kPngCompressionFlag)) {
     auto substr = arg.substr(kPngCompressionFlag.size());
     result->png_compression = ParseInt(substr);
+  } else if (arg.starts_with(kEncoderQualityFlag)) {
+    auto substr = arg.substr(kEncoderQualityFlag.size());
+    result->encoder_quality = ParseInt(substr);
+  } else if (arg.starts_with(kEncoderEffortFlag)) {
+    auto substr = arg.substr(kEncoderEffortFlag.size());
+    result->encoder_effort = ParseInt(substr);
   } else if (arg == kCopyMetadataFlag) {
     result->copy_metadata = true;
   } else if (arg == kNoCopyMetadataFlag) {
@@ -134,8 +384,26 @@ void ParseArg(Args* result, const std::string& arg) {
   } else if (arg.starts_with(kMaxPanoMpxFlag)) {
     auto substr = arg.substr(kMaxPanoMpxFlag.size());
     result->max_pano_mpx = ParseInt(substr);
+  } else if (arg.starts_with(kMaxMemoryMbFlag)) {
+    auto substr = arg.substr(kMaxMemoryMbFlag.size());
+    result->max_memory_mb = ParseInt(substr);
   } else if (arg == kNoFullResFlag) {
     result->full_res = false;
+  } else if (arg == kTiledFlag) {
+    result->tiled = true;
+  } else if (arg == kTiffOverviewsFlag) {
+    result->tiff_overviews = true;
+  } else if (arg == kDeviceResidentFlag) {
+    result->device_resident = true;
+  } else if (arg.starts_with(kSeamFinderFlag)) {
+    auto substr = arg.substr(kSeamFinderFlag.size());
+    result->seam_finder = ParseSeamFinderType(substr);
+    if (!result->seam_finder) {
+      spdlog::warn(
+          "Invalid --seam-finder '{}', using default (auto). Valid: auto, "
+          "voronoi, dp, graphcut",
+          substr);
+    }
   } else {
     result->input_paths.emplace_back(arg);
   }
@@ -152,21 +420,144 @@ Args ParseArgsRaw(int argc, char** argv) {
 }
 
 bool ValidateArgs(const Args& args) {
-  if (args.output_path && args.input_paths.empty()) {
+  if (args.output_path && args.input_paths.empty() && !args.read_stdin) {
     spdlog::error("No supported images provided");
     return false;
   }
-  if (args.output_path &&
-      !utils::path::IsExtensionSupported(*args.output_path)) {
+  if (args.read_stdin) {
+    if (!args.input_paths.empty() || args.run_gui || args.watch_dir) {
+      spdlog::error("--stdin takes all the images from stdin, input images, "
+                    "--gui and --watch are not supported.");
+      return false;
+    }
+    // Keyed by the image paths, the streamed images have only their names
+    if (args.checkpoint_dir || args.mapped_frames_dir) {
+      spdlog::error("--checkpoint-dir and --mapped-frames-dir are not "
+                    "supported with --stdin");
+      return false;
+    }
+  }
+  if (args.output_path && IsStdout(*args.output_path)) {
+    if (args.output_path->has_extension() &&
+        !utils::path::IsExtensionSupported(*args.output_path)) {
+      spdlog::error("Unsupported output format: \"{}\"",
+                    args.output_path->extension().string());
+      return false;
+    }
+    if (args.tiled) {
+      spdlog::error("--output=- writes a single encoded image, --tiled is "
+                    "not supported");
+      return false;
+    }
+  }
+  if (args.all_panos && args.output_path) {
+    spdlog::error(
+        "--all-panos names the outputs after the first image of each pano, "
+        "--output is not supported.");
+    return false;
+  }
+  if (args.all_panos && args.run_gui) {
+    spdlog::error(
+        "Specifying --gui and --all-panos together is not supported.");
+    return false;
+  }
+  if (args.output_path && !IsStdout(*args.output_path) &&
+      !utils::path::IsExtensionSupported(*args.output_path) &&
+      !utils::path::IsDeepZoom(*args.output_path) &&
+      !utils::path::IsModernFormat(*args.output_path)) {
     spdlog::error("Unsupported output file extension: \"{}\"",
                   args.output_path->extension().string());
     return false;
   }
+  if (args.tiled && args.output_path &&
+      !utils::path::IsTiff(*args.output_path) &&
+      !utils::path::IsDeepZoom(*args.output_path)) {
+    spdlog::error("--tiled needs a .tif / .tiff / .dzi output file");
+    return false;
+  }
+  if (args.tiff_overviews && !args.tiled) {
+    spdlog::error("--tiff-overviews needs --tiled");
+    return false;
+  }
   if (args.output_path && args.run_gui) {
     spdlog::error(
         "Specifying --gui and --output together is not yet supported.");
     return false;
   }
+  if (args.report_path &&
+      (args.run_gui ||
+       (args.input_paths.empty() && !args.read_stdin && !args.jobs_path))) {
+    spdlog::error("--report needs input images and is not supported by the "
+                  "GUI");
+    return false;
+  }
+  if (args.checkpoint_dir && (args.run_gui || !args.full_res)) {
+    spdlog::error("--checkpoint-dir needs a full resolution stitch and is not "
+                  "supported by the GUI");
+    return false;
+  }
+  if (args.spill_dir && (args.run_gui || !args.full_res)) {
+    spdlog::error("--spill-dir needs a full resolution stitch and is not "
+                  "supported by the GUI");
+    return false;
+  }
+  if (args.watch_dir) {
+    if (!args.input_paths.empty() || args.output_path || args.run_gui) {
+      spdlog::error(
+          "--watch names the outputs after the first image of each pano, "
+          "input images, --output and --gui are not supported.");
+      return false;
+    }
+    if (!std::filesystem::is_directory(*args.watch_dir)) {
+      spdlog::error("--watch needs an existing directory: \"{}\"",
+                    args.watch_dir->string());
+      return false;
+    }
+  }
+  if (args.jobs_path) {
+    if (!args.input_paths.empty() || args.output_path || args.read_stdin ||
+        args.watch_dir || args.run_gui || args.shard) {
+      spdlog::error("--jobs takes the inputs and outputs from the jobs file, "
+                    "input images, --output, --stdin, --watch, --gui and "
+                    "--shard are not supported.");
+      return false;
+    }
+    if (!std::filesystem::is_regular_file(*args.jobs_path)) {
+      spdlog::error("--jobs needs an existing file: \"{}\"",
+                    args.jobs_path->string());
+      return false;
+    }
+  }
+  if (args.quiet_period_s) {
+    if (!args.watch_dir) {
+      spdlog::error("--quiet-period needs --watch");
+      return false;
+    }
+    if (*args.quiet_period_s < 0) {
+      spdlog::error("Invalid value for --quiet-period");
+      return false;
+    }
+  }
+  if (args.shard) {
+    if (args.shard->count < 1) {
+      spdlog::error("Invalid value for --shard, expected <index>/<count>");
+      return false;
+    }
+    if (!args.tiled || !args.output_path || !args.checkpoint_dir ||
+        args.all_panos) {
+      spdlog::error("--shard needs a single --tiled --output and a "
+                    "--checkpoint-dir shared by the shards");
+      return false;
+    }
+  }
+  if (args.num_features.has_value()) {
+    int val = *args.num_features;
+    if (val < kMinNumFeatures || val > kMaxNumFeatures) {
+      spdlog::error("--num-features must be between {} and {}",
+                    kMinNumFeatures, kMaxNumFeatures);
+      return false;
+    }
+  }
   if (args.match_threshold.has_value() && !args.match_threshold.value()) {
     spdlog::error("Invalid value for --match-threshold");
     return false;
@@ -187,6 +578,34 @@ bool ValidateArgs(const Args& args) {
       return false;
     }
   }
+  if (std::any_of(args.lens_profiles.begin(), args.lens_profiles.end(),
+                  [](const algorithm::LensProfile& profile) {
+                    return !(std::abs(profile.k1) <= kMaxLensCoefficient &&
+                             std::abs(profile.k2) <= kMaxLensCoefficient);
+                  })) {
+    spdlog::error(
+        "Invalid --lens or --lens-profile, expected [<model>:]<k1>,<k2> with "
+        "coefficients between -{0} and {0}",
+        kMaxLensCoefficient);
+    return false;
+  }
+  if (args.grid) {
+    if (args.grid->rows < 1 || args.grid->cols < 1 ||
+        args.grid->rows > kMaxGridSize || args.grid->cols > kMaxGridSize) {
+      spdlog::error("--grid must be <cols>x<rows>, each between 1 and {}",
+                    kMaxGridSize);
+      return false;
+    }
+    if (args.matching_type &&
+        *args.matching_type != pipeline::MatchingType::kGrid) {
+      spdlog::error("--grid needs --matching-type=grid");
+      return false;
+    }
+  } else if (args.grid_order || args.grid_diagonals ||
+             args.matching_type == pipeline::MatchingType::kGrid) {
+    spdlog::error("Grid matching needs --grid=<cols>x<rows>");
+    return false;
+  }
   if (args.jpeg_quality.has_value()) {
     int val = *args.jpeg_quality;
     if (val < 0 || val > kMaxJpegQuality) {
@@ -202,6 +621,22 @@ bool ValidateArgs(const Args& args) {
       return false;
     }
   }
+  if (args.encoder_quality.has_value()) {
+    int val = *args.encoder_quality;
+    if (val < 0 || val > kMaxEncoderQuality) {
+      spdlog::error("--encoder-quality must be between 0 and {}",
+                    kMaxEncoderQuality);
+      return false;
+    }
+  }
+  if (args.encoder_effort.has_value()) {
+    int val = *args.encoder_effort;
+    if (val < kMinEncoderEffort || val > kMaxEncoderEffort) {
+      spdlog::error("--encoder-effort must be between {} and {}",
+                    kMinEncoderEffort, kMaxEncoderEffort);
+      return false;
+    }
+  }
   if (args.max_pano_mpx.has_value()) {
     int val = *args.max_pano_mpx;
     if (val < 1 || val > 5000) {
@@ -209,6 +644,19 @@ bool ValidateArgs(const Args& args) {
       return false;
     }
   }
+  if (args.max_memory_mb.has_value() && *args.max_memory_mb < 0) {
+    spdlog::error("--max-memory-mb must not be negative");
+    return false;
+  }
+  if (args.threads.has_value() && *args.threads < kMinThreads) {
+    spdlog::error("--threads must be at least {}", kMinThreads);
+    return false;
+  }
+  if (std::any_of(args.cpus.begin(), args.cpus.end(),
+                  [](int cpu) { return cpu < 0; })) {
+    spdlog::error("Invalid value for --cpus, expected e.g. 0-3,8");
+    return false;
+  }
   return true;
 }
 
@@ -220,11 +668,8 @@ std::vector<std::filesystem::path> ExpandDirectories(
   for (const auto& path : paths) {
     if (std::filesystem::is_directory(path)) {
       spdlog::info("Expanding directory: {}", path.string());
-      for (const auto& entry : std::filesystem::directory_iterator(path)) {
-        if (entry.is_regular_file()) {
-          result.push_back(entry.path());
-        }
-      }
+      auto files = utils::path::ListSupported(path);
+      std::move(files.begin(), files.end(), std::back_inserter(result));
     } else {
       result.push_back(path);
     }
@@ -250,7 +695,7 @@ std::optional<Args> ParseArgs(int argc, char** argv) {
     return {};
   }
   args.input_paths = supported_inputs;
-  std::sort(args.input_paths.begin(), args.input_paths.end());
+  utils::path::SortNatural(&args.input_paths);
 
   if (!ValidateArgs(args)) {
     return {};
@@ -265,8 +710,21 @@ void PrintHelp() {
   spdlog::info("Usage: Xpano [<input files or directories>] [options]");
   spdlog::info("");
   spdlog::info("Options:");
-  spdlog::info("  --output=<path>          Output file path");
+  spdlog::info("  --output=<path>          Output file path, - writes a JPEG to stdout (-.png, -.tif other formats)");
+  spdlog::info("  --stdin                  Read the images from stdin: a tar archive or <8-byte little-endian size><image> frames");
+  spdlog::info("  --all-panos              Stitch and export all detected panos, named after their first image");
+  spdlog::info("  --trace=<path>           Write a Chrome trace of the pipeline stages");
+  spdlog::info("  --report=<path>          Write a JSON report of the timings, sizes and matches");
+  spdlog::info("  --checkpoint-dir=<path>  Keep checkpoints of the full resolution stitch, a rerun resumes from them");
+  spdlog::info("  --spill-dir=<path>       Keep the warped images waiting for multiblend on disk once over {} MB", kDefaultSpillThresholdMB);
+  spdlog::info("  --mapped-frames-dir=<path> Keep the decoded full resolution images there, later stitches map them instead of decoding");
+  spdlog::info("  --watch=<dir>            Keep running, stitch the panos of the images added to the directory");
+  spdlog::info("  --quiet-period=<N>       --watch: seconds without new images before a pano is stitched (default: {})", kDefaultWatchQuietSeconds);
+  spdlog::info("  --jobs=<path>            Stitch the input sets of a JSON file in one process, the next one loads while the others stitch");
+  spdlog::info("                           e.g. [\"dir1\", {{\"inputs\": [\"a.jpg\", \"b.jpg\"], \"output\": \"ab.jpg\"}}]");
+  spdlog::info("  --shard=<i>/<n>          Compose the i-th of n bands of the --tiled output, shard 1 assembles them");
   spdlog::info("  --gui                    Launch GUI mode");
+  spdlog::info("  --no-warm-up             GUI / --watch: don't compile the OpenCL kernels in the background at startup");
   spdlog::info("  --help                   Show this help message");
   spdlog::info("  --version                Show version");
   spdlog::info("");
@@ -276,22 +734,45 @@ void PrintHelp() {
   spdlog::info("                           fisheye, stereographic, rectilinear, panini,");
   spdlog::info("                           mercator, transverse-mercator");
   spdlog::info("");
+  spdlog::info("Loading:");
+  spdlog::info("  --feature=<type>         Keypoint detector (default: sift)");
+  spdlog::info("                           Types: sift, orb, akaze");
+  spdlog::info("                           orb: much faster, less precise");
+  spdlog::info("  --num-features=<N>       Max keypoints, {} - {} (default: {})",
+               kMinNumFeatures, kMaxNumFeatures, kNumFeatures);
+  spdlog::info("  --lens=<k1>,<k2>         Undistort the images, radial coefficients, e.g. -0.1,0.02");
+  spdlog::info("  --lens-profile=<model>:<k1>,<k2>");
+  spdlog::info("                           Undistort the images whose Exif camera or lens contains the model");
+  spdlog::info("");
   spdlog::info("Matching:");
   spdlog::info("  --matching-type=<type>   Matching mode (default: auto)");
-  spdlog::info("                           Types: auto, single, none");
+  spdlog::info("                           Types: auto, single, none, grid");
   spdlog::info("                           auto: pairwise matching, recommended");
   spdlog::info("                           single: assume all images form one pano");
   spdlog::info("                           none: skip matching");
+  spdlog::info("                           grid: neighbours of the --grid only");
   spdlog::info("  --match-threshold=<N>    Match threshold, {} - {} (default: {})",
                kMinMatchThreshold, kMaxMatchThreshold, kDefaultMatchThreshold);
   spdlog::info("  --min-shift=<F>          Min shift filter, {} - {} (default: {})",
                kMinShiftInPano, kMaxShiftInPano, kDefaultShiftInPano);
+  spdlog::info("  --adaptive-neighborhood  Match further images only while the close ones match weakly");
+  spdlog::info("  --grid=<cols>x<rows>     Images shot as a grid, e.g. by a robotic head");
+  spdlog::info("  --grid-order=<order>     Capture order (default: serpentine)");
+  spdlog::info("                           Orders: rows, serpentine, columns,");
+  spdlog::info("                           columns-serpentine");
+  spdlog::info("  --grid-diagonals         Also match the diagonal neighbours");
+  spdlog::info("  --coarse-to-fine         Match the panos again at {} px, only where the images overlap",
+               kDefaultFineLongerSide);
   spdlog::info("");
   spdlog::info("Export:");
   spdlog::info("  --jpeg-quality=<N>       JPEG quality, 0 - {} (default: {})",
                kMaxJpegQuality, kDefaultJpegQuality);
   spdlog::info("  --png-compression=<N>    PNG compression, 0 - {} (default: {})",
                kMaxPngCompression, kDefaultPngCompression);
+  spdlog::info("  --encoder-quality=<N>    JPEG XL / AVIF / WebP quality, 0 - {}, {} is lossless (default: {})",
+               kMaxEncoderQuality, kMaxEncoderQuality, kDefaultEncoderQuality);
+  spdlog::info("  --encoder-effort=<N>     JPEG XL / AVIF / WebP effort, {} - {} (default: {})",
+               kMinEncoderEffort, kMaxEncoderEffort, kDefaultEncoderEffort);
   spdlog::info("  --copy-metadata          Copy EXIF from first image");
   spdlog::info("  --no-copy-metadata       Don't copy EXIF metadata");
   spdlog::info("");
@@ -300,9 +781,21 @@ void PrintHelp() {
   spdlog::info("                           Types: off, auto, horizontal, vertical");
   spdlog::info("  --max-pano-mpx=<N>       Max panorama size in megapixels (default: {})",
                kMaxPanoMpx);
+  spdlog::info("  --max-memory-mb=<N>      Peak compositing memory, downscales or fails if exceeded, also bounds the caches (default: 0 = no limit)");
+  spdlog::info("  --threads=<N>            Worker threads of the pipeline, multiblend and OpenCV (default: one per core)");
+  spdlog::info("  --cpus=<list>            Pin the process to the CPUs, e.g. 0-3,8");
   spdlog::info("  --no-full-res            Use preview resolution (2048 px) instead of full resolution");
+  spdlog::info("  --seam-finder=<type>     Seam finder (default: auto)");
+  spdlog::info("                           Types: auto, voronoi, dp, graphcut");
+  spdlog::info("  --tiled                  Compose in tiles to a BigTIFF or .dzi pyramid, no size limit, no auto crop");
+  spdlog::info("  --tiff-overviews         Add pyramidal overview levels to the --tiled BigTIFF");
+  spdlog::info("  --device-resident        Keep the warped images and the blended pano on the OpenCL device, multiblend falls back to OpenCV");
   spdlog::info("");
   spdlog::info("Supported formats: {}", fmt::join(kSupportedExtensions, ", "));
+  spdlog::info("Input only: {} (videos, only the keyframes are stitched)",
+               fmt::join(kVideoExtensions, ", "));
+  spdlog::info("Output only: {} (Deep Zoom tile pyramid)",
+               fmt::join(kDeepZoomExtensions, ", "));
 }
 
 }  // namespace xpano::cli
@@ -17,29 +17,82 @@ struct Args {
   bool print_help = false;
   bool print_version = false;
   std::vector<std::filesystem::path> input_paths;
+  // Encoded images streamed to stdin instead of the input files, see
+  // ReadStreamedFiles
+  bool read_stdin = false;
+  // "-" writes the encoded pano to stdout, see IsStdout
   std::optional<std::filesystem::path> output_path;
+  // Stitch and export every detected pano, named after its first image
+  bool all_panos = false;
+  // Chrome trace of the pipeline stages
+  std::optional<std::filesystem::path> trace_path;
+  // JSON summary of the run: timings, sizes, matches, see cli::RunReport
+  std::optional<std::filesystem::path> report_path;
+  // Resumes an interrupted full resolution stitch, see pipeline::Checkpoint
+  std::optional<std::filesystem::path> checkpoint_dir;
+  // Scratch directory for the warped images waiting for multiblend
+  std::optional<std::filesystem::path> spill_dir;
+  // Decoded full resolution frames mapped by later stitches of the session
+  std::optional<std::filesystem::path> mapped_frames_dir;
+  // Keeps running, stitches the panos of the images added to the directory
+  std::optional<std::filesystem::path> watch_dir;
+  std::optional<int> quiet_period_s;
+  // Many input sets in one process, each one stitched like the command line
+  // inputs, see ReadJobs
+  std::optional<std::filesystem::path> jobs_path;
+  // This process composes one band of the --tiled export, see ShardWriter
+  std::optional<pipeline::ShardOptions> shard;
+  // GUI / --watch: stitch a synthetic pano at startup, see algorithm::WarmUp
+  bool warm_up = true;
 
   // Projection
   std::optional<algorithm::ProjectionType> projection;
 
+  // Loading
+  std::optional<algorithm::FeatureType> feature;
+  std::optional<int> num_features;
+  // --lens applies to every image without a matching --lens-profile
+  std::vector<algorithm::LensProfile> lens_profiles;
+
   // Matching
   std::optional<pipeline::MatchingType> matching_type;
   std::optional<int> match_threshold;
   std::optional<float> min_shift;
+  bool adaptive_neighborhood = false;
+  // Rows and cols of the capture grid, implies MatchingType::kGrid
+  std::optional<algorithm::GridOptions> grid;
+  std::optional<algorithm::GridOrder> grid_order;
+  bool grid_diagonals = false;
+  bool coarse_to_fine = false;
 
   // Export
   std::optional<int> jpeg_quality;
   std::optional<int> png_compression;
+  // .jxl / .avif / .webp
+  std::optional<int> encoder_quality;
+  std::optional<int> encoder_effort;
   std::optional<bool> copy_metadata;
 
   // Stitching
   std::optional<algorithm::WaveCorrectionType> wave_correction;
   std::optional<int> max_pano_mpx;
+  std::optional<int> max_memory_mb;
+  // Process wide, see pipeline::ResourceOptions
+  std::optional<int> threads;
+  std::vector<int> cpus;
+  std::optional<algorithm::SeamFinderType> seam_finder;
   bool full_res = true;
+  bool tiled = false;
+  bool tiff_overviews = false;
+  bool device_resident = false;
 };
 
 std::optional<Args> ParseArgs(int argc, char** argv);
 
+// The directories replaced by the supported images in them
+std::vector<std::filesystem::path> ExpandDirectories(
+    const std::vector<std::filesystem::path>& paths);
+
 void PrintHelp();
 
 }  // namespace xpano::cli
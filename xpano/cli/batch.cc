@@ -0,0 +1,55 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/cli/batch.h"
+
+#include <algorithm>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace xpano::cli {
+
+BatchScheduler::BatchScheduler(std::vector<int> memory_mb, int max_running,
+                               int budget_mb)
+    : memory_mb_(std::move(memory_mb)),
+      max_running_(std::max(1, max_running)),
+      budget_mb_(std::max(0, budget_mb)) {}
+
+int BatchScheduler::Add(int memory_mb) {
+  memory_mb_.push_back(memory_mb);
+  return static_cast<int>(memory_mb_.size()) - 1;
+}
+
+int BatchScheduler::MemoryMb(int pano_id) const {
+  if (budget_mb_ == 0) {
+    return 0;
+  }
+  return std::min(memory_mb_[pano_id], budget_mb_);
+}
+
+std::optional<int> BatchScheduler::Next() {
+  if (next_ >= memory_mb_.size() || num_running_ >= max_running_) {
+    return {};
+  }
+  if (budget_mb_ > 0 && num_running_ > 0 &&
+      running_mb_ + MemoryMb(next_) > budget_mb_) {
+    return {};
+  }
+  num_running_++;
+  running_mb_ += MemoryMb(next_);
+  return next_++;
+}
+
+void BatchScheduler::Finish(int pano_id) {
+  num_running_--;
+  running_mb_ -= MemoryMb(pano_id);
+}
+
+bool BatchScheduler::Done() const {
+  return next_ >= memory_mb_.size() && num_running_ == 0;
+}
+
+int BatchScheduler::NumRunning() const { return num_running_; }
+
+}  // namespace xpano::cli
@@ -0,0 +1,45 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <optional>
+#include <vector>
+
+namespace xpano::cli {
+
+// Admission of the panos of an --all-panos batch:
+//  - The panos start in order, up to max_running at a time and only while
+//    the estimated memory of the running panos fits the budget.
+//  - A pano estimated over the whole budget runs alone.
+//  - A budget of 0 means no memory limit.
+class BatchScheduler {
+ public:
+  BatchScheduler(std::vector<int> memory_mb, int max_running, int budget_mb);
+
+  // Queues one more pano after the others, e.g. of the next --jobs job,
+  // returns its id
+  int Add(int memory_mb);
+
+  // Id of the next pano to start, empty if it has to wait for a running one
+  // or if all the panos added so far were started
+  std::optional<int> Next();
+
+  void Finish(int pano_id);
+
+  [[nodiscard]] bool Done() const;
+  [[nodiscard]] int NumRunning() const;
+
+ private:
+  [[nodiscard]] int MemoryMb(int pano_id) const;
+
+  std::vector<int> memory_mb_;
+  int max_running_;
+  int budget_mb_;
+
+  int next_ = 0;
+  int num_running_ = 0;
+  int running_mb_ = 0;
+};
+
+}  // namespace xpano::cli
@@ -0,0 +1,347 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/cli/jobs.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <spdlog/spdlog.h>
+
+#include "xpano/cli/args.h"
+#include "xpano/utils/path.h"
+
+namespace xpano::cli {
+
+namespace {
+
+constexpr int kHexBase = 16;
+
+// Just the JSON the jobs file needs: arrays, objects and strings
+class JsonReader {
+ public:
+  explicit JsonReader(std::string_view text) : text_(text) {}
+
+  bool Consume(char expected) {
+    SkipSpace();
+    if (pos_ < text_.size() && text_[pos_] == expected) {
+      pos_++;
+      return true;
+    }
+    return false;
+  }
+
+  [[nodiscard]] char Peek() {
+    SkipSpace();
+    return pos_ < text_.size() ? text_[pos_] : '\0';
+  }
+
+  bool AtEnd() {
+    SkipSpace();
+    return pos_ == text_.size();
+  }
+
+  [[nodiscard]] std::size_t Pos() const { return pos_; }
+
+  std::optional<std::string> String() {
+    if (!Consume('"')) {
+      return std::nullopt;
+    }
+    std::string result;
+    while (pos_ < text_.size()) {
+      const char character = text_[pos_++];
+      if (character == '"') {
+        return result;
+      }
+      if (character != '\\') {
+        result += character;
+        continue;
+      }
+      if (pos_ == text_.size()) {
+        return std::nullopt;
+      }
+      switch (const char escaped = text_[pos_++]) {
+        case 'b':
+          result += '\b';
+          break;
+        case 'f':
+          result += '\f';
+          break;
+        case 'n':
+          result += '\n';
+          break;
+        case 'r':
+          result += '\r';
+          break;
+        case 't':
+          result += '\t';
+          break;
+        case 'u':
+          if (!CodePoint(&result)) {
+            return std::nullopt;
+          }
+          break;
+        default:
+          result += escaped;
+      }
+    }
+    return std::nullopt;
+  }
+
+ private:
+  void SkipSpace() {
+    while (pos_ < text_.size() &&
+           (text_[pos_] == ' ' || text_[pos_] == '\n' || text_[pos_] == '\r' ||
+            text_[pos_] == '\t')) {
+      pos_++;
+    }
+  }
+
+  std::optional<std::uint32_t> Hex4() {
+    if (pos_ + 4 > text_.size()) {
+      return std::nullopt;
+    }
+    std::uint32_t value = 0;
+    for (int i = 0; i < 4; i++) {
+      const char digit = text_[pos_++];
+      value *= kHexBase;
+      if (digit >= '0' && digit <= '9') {
+        value += digit - '0';
+      } else if (digit >= 'a' && digit <= 'f') {
+        value += digit - 'a' + 10;
+      } else if (digit >= 'A' && digit <= 'F') {
+        value += digit - 'A' + 10;
+      } else {
+        return std::nullopt;
+      }
+    }
+    return value;
+  }
+
+  // \uXXXX, or a surrogate pair of them, as UTF-8
+  bool CodePoint(std::string* out) {
+    auto code = Hex4();
+    if (!code) {
+      return false;
+    }
+    if (*code >= 0xd800 && *code < 0xdc00) {
+      if (text_.substr(pos_, 2) != "\\u") {
+        return false;
+      }
+      pos_ += 2;
+      const auto low = Hex4();
+      if (!low || *low < 0xdc00 || *low >= 0xe000) {
+        return false;
+      }
+      code = 0x10000 + ((*code - 0xd800) << 10) + (*low - 0xdc00);
+    }
+    if (*code < 0x80) {
+      *out += static_cast<char>(*code);
+    } else if (*code < 0x800) {
+      *out += static_cast<char>(0xc0 | (*code >> 6));
+      *out += static_cast<char>(0x80 | (*code & 0x3f));
+    } else if (*code < 0x10000) {
+      *out += static_cast<char>(0xe0 | (*code >> 12));
+      *out += static_cast<char>(0x80 | ((*code >> 6) & 0x3f));
+      *out += static_cast<char>(0x80 | (*code & 0x3f));
+    } else {
+      *out += static_cast<char>(0xf0 | (*code >> 18));
+      *out += static_cast<char>(0x80 | ((*code >> 12) & 0x3f));
+      *out += static_cast<char>(0x80 | ((*code >> 6) & 0x3f));
+      *out += static_cast<char>(0x80 | (*code & 0x3f));
+    }
+    return true;
+  }
+
+  std::string_view text_;
+  std::size_t pos_ = 0;
+};
+
+std::filesystem::path JobPath(const std::string& utf8,
+                              const std::filesystem::path& base_dir) {
+  const auto path = std::filesystem::path(std::u8string(utf8.begin(),
+                                                        utf8.end()));
+  return path.is_absolute() ? path : base_dir / path;
+}
+
+std::optional<std::vector<std::string>> Strings(JsonReader* reader) {
+  if (reader->Peek() == '"') {
+    auto single = reader->String();
+    if (!single) {
+      return std::nullopt;
+    }
+    return std::vector{*std::move(single)};
+  }
+  if (!reader->Consume('[')) {
+    return std::nullopt;
+  }
+  std::vector<std::string> result;
+  if (reader->Consume(']')) {
+    return result;
+  }
+  do {
+    auto value = reader->String();
+    if (!value) {
+      return std::nullopt;
+    }
+    result.push_back(*std::move(value));
+  } while (reader->Consume(','));
+  if (!reader->Consume(']')) {
+    return std::nullopt;
+  }
+  return result;
+}
+
+struct RawJob {
+  std::vector<std::string> inputs;
+  std::optional<std::string> output;
+};
+
+std::optional<RawJob> ParseJob(JsonReader* reader) {
+  if (reader->Peek() == '"') {
+    auto dir = reader->String();
+    if (!dir) {
+      return std::nullopt;
+    }
+    return RawJob{.inputs = {*std::move(dir)}};
+  }
+  if (!reader->Consume('{')) {
+    return std::nullopt;
+  }
+  RawJob job;
+  if (reader->Consume('}')) {
+    return job;
+  }
+  do {
+    const auto key = reader->String();
+    if (!key || !reader->Consume(':')) {
+      return std::nullopt;
+    }
+    if (*key == "inputs") {
+      auto inputs = Strings(reader);
+      if (!inputs) {
+        return std::nullopt;
+      }
+      job.inputs = *std::move(inputs);
+    } else if (*key == "output") {
+      job.output = reader->String();
+      if (!job.output) {
+        return std::nullopt;
+      }
+    } else {
+      spdlog::error("Unknown job key \"{}\", expected inputs or output",
+                    *key);
+      return std::nullopt;
+    }
+  } while (reader->Consume(','));
+  if (!reader->Consume('}')) {
+    return std::nullopt;
+  }
+  return job;
+}
+
+}  // namespace
+
+std::optional<std::vector<Job>> ParseJobs(
+    std::string_view json, const std::filesystem::path& base_dir) {
+  JsonReader reader(json);
+  std::vector<RawJob> raw_jobs;
+  bool valid = reader.Consume('[');
+  if (valid && !reader.Consume(']')) {
+    do {
+      auto job = ParseJob(&reader);
+      if (!job) {
+        valid = false;
+        break;
+      }
+      raw_jobs.push_back(*std::move(job));
+    } while (reader.Consume(','));
+    valid = valid && reader.Consume(']');
+  }
+  if (!valid || !reader.AtEnd()) {
+    spdlog::error("Malformed jobs at byte {}, expected an array of "
+                  "directories or {{\"inputs\": [...], \"output\": ...}}",
+                  reader.Pos());
+    return std::nullopt;
+  }
+
+  std::vector<Job> jobs;
+  jobs.reserve(raw_jobs.size());
+  for (const auto& raw_job : raw_jobs) {
+    std::vector<std::filesystem::path> paths;
+    paths.reserve(raw_job.inputs.size());
+    for (const auto& input : raw_job.inputs) {
+      paths.push_back(JobPath(input, base_dir));
+    }
+    auto& job = jobs.emplace_back();
+    job.input_paths = utils::path::KeepSupported(ExpandDirectories(paths));
+    utils::path::SortNatural(&job.input_paths);
+    if (job.input_paths.empty()) {
+      spdlog::error("Job {} has no supported images", jobs.size());
+      return std::nullopt;
+    }
+    if (raw_job.output) {
+      job.output_path = JobPath(*raw_job.output, base_dir);
+      if (!utils::path::IsExtensionSupported(*job.output_path) &&
+          !utils::path::IsDeepZoom(*job.output_path) &&
+          !utils::path::IsModernFormat(*job.output_path)) {
+        spdlog::error("Job {}: unsupported output file extension: \"{}\"",
+                      jobs.size(), job.output_path->extension().string());
+        return std::nullopt;
+      }
+    }
+  }
+  return jobs;
+}
+
+std::optional<std::vector<Job>> ReadJobs(const std::filesystem::path& path) {
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream) {
+    spdlog::error("Failed to read the jobs file {}", path.string());
+    return std::nullopt;
+  }
+  std::stringstream text;
+  text << stream.rdbuf();
+  return ParseJobs(text.str(), path.parent_path());
+}
+
+JobQueue::JobQueue(int num_jobs, int max_waiting)
+    : waiting_panos_(num_jobs, 0), max_waiting_(std::max(1, max_waiting)) {}
+
+std::optional<int> JobQueue::NextLoad() {
+  if (loading_ || next_ >= waiting_panos_.size() ||
+      num_waiting_jobs_ >= max_waiting_) {
+    return {};
+  }
+  loading_ = true;
+  return next_++;
+}
+
+void JobQueue::Loaded(int job_id, int num_panos) {
+  loading_ = false;
+  waiting_panos_[job_id] = num_panos;
+  if (num_panos > 0) {
+    num_waiting_jobs_++;
+  }
+}
+
+void JobQueue::Started(int job_id) {
+  if (--waiting_panos_[job_id] == 0) {
+    num_waiting_jobs_--;
+  }
+}
+
+bool JobQueue::AllLoaded() const {
+  return !loading_ && next_ >= waiting_panos_.size();
+}
+
+}  // namespace xpano::cli
@@ -0,0 +1,58 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+namespace xpano::cli {
+
+// An input set of --jobs, stitched like the command line inputs with the
+// options of the command line
+struct Job {
+  // Supported images only, the directories expanded, naturally sorted
+  std::vector<std::filesystem::path> input_paths;
+  // Named after the first image of the pano without one
+  std::optional<std::filesystem::path> output_path;
+};
+
+// A JSON array of the jobs, each one either a directory or an object, e.g.
+//   ["shoot1", {"inputs": ["shoot2/a.jpg", "shoot2/b.jpg"],
+//               "output": "out/shoot2.jpg"}]
+// The relative paths are relative to base_dir, usually the directory of the
+// jobs file. Empty if malformed or if a job has no supported images.
+std::optional<std::vector<Job>> ParseJobs(
+    std::string_view json, const std::filesystem::path& base_dir);
+
+std::optional<std::vector<Job>> ReadJobs(const std::filesystem::path& path);
+
+// Admission of the jobs loading ahead of the stitching: a job starts loading
+// only after the previous one, and only while fewer than max_waiting loaded
+// jobs still have panos waiting to start
+class JobQueue {
+ public:
+  JobQueue(int num_jobs, int max_waiting);
+
+  // Id of the next job to load, empty if a job is loading or enough of them
+  // are waiting, or if all the jobs were started
+  std::optional<int> NextLoad();
+
+  // Called once the job is loaded, with the number of its panos to stitch
+  void Loaded(int job_id, int num_panos);
+  // One of the panos of the job was handed to the stitching
+  void Started(int job_id);
+
+  [[nodiscard]] bool AllLoaded() const;
+
+ private:
+  std::vector<int> waiting_panos_;
+  int max_waiting_;
+  int next_ = 0;
+  bool loading_ = false;
+  int num_waiting_jobs_ = 0;
+};
+
+}  // namespace xpano::cli
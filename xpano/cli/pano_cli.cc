@@ -3,26 +3,59 @@
 
 #include "xpano/cli/pano_cli.h"
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <condition_variable>
 #include <exception>
 #include <filesystem>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <string>
+#include <system_error>
+#include <thread>
 #include <utility>
+#include <vector>
 
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
 #include <spdlog/spdlog.h>
 
 #include "xpano/algorithm/algorithm.h"
 #include "xpano/cli/args.h"
+#include "xpano/cli/batch.h"
+#include "xpano/cli/jobs.h"
+#include "xpano/cli/report.h"
 #include "xpano/cli/signal.h"
+#include "xpano/cli/stream.h"
+#include "xpano/cli/watch.h"
 #include "xpano/constants.h"
+#include "xpano/core.h"
 #include "xpano/log/logger.h"
 #include "xpano/pipeline/options.h"
+#include "xpano/pipeline/resources.h"
 #include "xpano/pipeline/stitcher_pipeline.h"
+#include "xpano/utils/deep_zoom.h"
 #include "xpano/utils/future.h"
+#include "xpano/utils/jpeg.h"
+#include "xpano/utils/memory.h"
+#include "xpano/utils/parallel_for.h"
+#include "xpano/utils/path.h"
+#include "xpano/utils/process.h"
+#include "xpano/utils/trace.h"
+#include "xpano/utils/vec.h"
 #include "xpano/version_fmt.h"
 
 #ifdef _WIN32
 #include <consoleapi.h>
+#include <fcntl.h>
+#include <io.h>
 #include <minwindef.h>
 
 #include "xpano/cli/windows_console.h"
@@ -51,10 +84,119 @@ void CancelHandler(int /*signal*/) { cancel.fetch_add(1); }
 
 void PrintVersion() { spdlog::info("Xpano version {}", version::Current()); }
 
-ResultType RunPipeline(const Args &args) {
-  pipeline::StitcherPipeline<pipeline::RunTraits::kReturnFuture> pipeline;
+// Wakes the batch loop when a task is done, see
+// StitcherPipelineOptions::on_task_done
+class TaskSignal {
+ public:
+  void Notify() {
+    {
+      const std::lock_guard lock(mutex_);
+      notified_ = true;
+    }
+    notified_cv_.notify_all();
+  }
+
+  // Returns after a Notify() since the last call or after the timeout, the
+  // interrupt flag can't notify
+  void Wait() {
+    std::unique_lock lock(mutex_);
+    notified_cv_.wait_for(lock, kCancellationTimeout,
+                          [this]() { return notified_; });
+    notified_ = false;
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable notified_cv_;
+  bool notified_ = false;
+};
+
+// Panos stitched at the same time by --all-panos, limited by the threads of
+// the shared pool, see --threads
+int BatchConcurrency() {
+  return std::max(1, utils::mt::SharedPoolThreads() / kBatchThreadsPerPano);
+}
+
+// Upper estimate of the peak stitching memory of a pano, the full resolution
+// sizes are read from the JPEG headers, other inputs count with the preview
+int EstimateMemoryMb(const pipeline::StitcherData &data,
+                     const algorithm::Pano &pano) {
+  double input_px = 0.0;
+  for (const int image_id : pano.ids) {
+    const auto &image = data.images[image_id];
+    if (auto size = utils::jpeg::ReadSize(image.GetPath()); size) {
+      input_px += static_cast<double>((*size)[0]) * (*size)[1];
+    } else {
+      input_px += image.GetPreviewSize().area();
+    }
+  }
+  return static_cast<int>(
+      std::ceil(input_px * kBatchBytesPerInputPixel / kMegabyte));
+}
 
-  // Build MatchingOptions from args
+std::filesystem::path ExportPath(
+    const std::optional<std::filesystem::path> &output_path, bool tiled,
+    const algorithm::Image &first_image) {
+  auto export_path = output_path
+                         ? *output_path
+                         : std::filesystem::path(first_image.PanoName());
+  if (tiled && !utils::path::IsTiff(export_path) &&
+      !utils::path::IsDeepZoom(export_path)) {
+    export_path.replace_extension("tif");
+  }
+  return export_path;
+}
+
+std::filesystem::path ExportPath(const Args &args,
+                                 const algorithm::Image &first_image) {
+  return ExportPath(args.output_path, args.tiled, first_image);
+}
+
+// The streams carry encoded images
+void SetBinaryMode([[maybe_unused]] FILE *file) {
+#ifdef _WIN32
+  _setmode(_fileno(file), _O_BINARY);
+#endif
+}
+
+std::optional<std::vector<algorithm::Image>> ReadStdinImages() {
+  SetBinaryMode(stdin);
+  auto files = ReadStreamedFiles(&std::cin);
+  if (!files) {
+    spdlog::error("Malformed --stdin stream, expected a tar archive or "
+                  "<8-byte little-endian size><image> frames");
+    return std::nullopt;
+  }
+  std::vector<algorithm::Image> images;
+  images.reserve(files->size());
+  for (auto &file : *files) {
+    images.emplace_back(std::move(file.name),
+                        std::make_shared<const std::vector<unsigned char>>(
+                            std::move(file.bytes)));
+  }
+  spdlog::info("Read {} images from stdin", images.size());
+  return images;
+}
+
+// Encoded in the format of the extension of output_path, JPEG without one
+bool WriteStdout(const cv::Mat &pano, const std::filesystem::path &output_path,
+                 const pipeline::CompressionOptions &compression) {
+  const std::string extension =
+      output_path.has_extension() ? output_path.extension().string() : ".jpg";
+  std::vector<unsigned char> encoded;
+  if (!cv::imencode(extension, pano, encoded,
+                    pipeline::CompressionParameters(compression))) {
+    return false;
+  }
+  SetBinaryMode(stdout);
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+  std::cout.write(reinterpret_cast<const char *>(encoded.data()),
+                  static_cast<std::streamsize>(encoded.size()));
+  std::cout.flush();
+  return static_cast<bool>(std::cout);
+}
+
+pipeline::MatchingOptions MatchingOptionsFromArgs(const Args &args) {
   pipeline::MatchingOptions matching_opts{
       .type = pipeline::MatchingType::kAuto};  // Default to auto for better results
   if (args.matching_type) {
@@ -66,36 +208,43 @@ ResultType RunPipeline(const Args &args) {
   if (args.min_shift) {
     matching_opts.min_shift = *args.min_shift;
   }
-
-  auto loading_task = pipeline.RunLoading(
-      args.input_paths, {.preview_longer_side = kMaxImageSizeForCLI},
-      matching_opts);
-
-  pipeline::StitcherData stitcher_data;
-
-  try {
-    stitcher_data = utils::future::GetWithCancellation(
-        std::move(loading_task.future), cancel);
-  } catch (const utils::future::Cancelled) {
-    spdlog::info("Canceling, press CTRL+C again to force quit.");
-    loading_task.progress->Cancel();
-    pipeline.CancelAndWait();
-    return ResultType::kError;
-  } catch (const std::exception &e) {
-    spdlog::error("Failed to load images: {}", e.what());
-    return ResultType::kError;
+  matching_opts.adaptive_neighborhood = args.adaptive_neighborhood;
+  matching_opts.coarse_to_fine = args.coarse_to_fine;
+  if (args.grid) {
+    matching_opts.type = pipeline::MatchingType::kGrid;
+    matching_opts.grid = *args.grid;
+    if (args.grid_order) {
+      matching_opts.grid.order = *args.grid_order;
+    }
+    matching_opts.grid.diagonals = args.grid_diagonals;
   }
+  return matching_opts;
+}
 
-  if (stitcher_data.images.empty()) {
-    spdlog::error("Failed to load any images");
-    return ResultType::kError;
+pipeline::LoadingOptions LoadingOptionsFromArgs(const Args &args) {
+  pipeline::LoadingOptions loading_opts{
+      .preview_longer_side = kMaxImageSizeForCLI,
+      .detection_longer_side = kMaxImageSizeForCLI};
+  if (args.feature) {
+    loading_opts.feature = *args.feature;
   }
+  if (args.num_features) {
+    loading_opts.num_features = *args.num_features;
+  }
+  if (!args.lens_profiles.empty()) {
+    loading_opts.lens.undistort = true;
+    loading_opts.lens.profiles = args.lens_profiles;
+    // The first match applies, --lens only to the images without a profile
+    std::stable_partition(
+        loading_opts.lens.profiles.begin(), loading_opts.lens.profiles.end(),
+        [](const auto &profile) { return !profile.model.empty(); });
+  }
+  return loading_opts;
+}
 
-  auto export_path =
-      args.output_path
-          ? *args.output_path
-          : std::filesystem::path(stitcher_data.images[0].PanoName());
-
+// Everything but the pano id and the export path
+pipeline::StitchingOptions StitchingOptionsFromArgs(
+    const Args &args, const pipeline::MatchingOptions &matching_opts) {
   // Build CompressionOptions from args
   pipeline::CompressionOptions compression_opts;
   if (args.jpeg_quality) {
@@ -104,6 +253,14 @@ ResultType RunPipeline(const Args &args) {
   if (args.png_compression) {
     compression_opts.png_compression = *args.png_compression;
   }
+  if (args.encoder_quality) {
+    compression_opts.encoder_quality = *args.encoder_quality;
+  }
+  if (args.encoder_effort) {
+    compression_opts.encoder_effort = *args.encoder_effort;
+  }
+  compression_opts.tiff_tiled = args.tiled;
+  compression_opts.tiff_overviews = args.tiff_overviews;
 
   // Build MetadataOptions from args
   pipeline::MetadataOptions metadata_opts;
@@ -122,14 +279,129 @@ ResultType RunPipeline(const Args &args) {
   if (args.max_pano_mpx) {
     stitch_opts.max_pano_mpx = *args.max_pano_mpx;
   }
+  if (args.max_memory_mb) {
+    stitch_opts.max_memory_mb = *args.max_memory_mb;
+  }
+  if (args.seam_finder) {
+    stitch_opts.seam_finder = *args.seam_finder;
+  }
+  stitch_opts.device_resident = args.device_resident;
+
+  return {.full_res = args.full_res,
+          .metadata = metadata_opts,
+          .compression = compression_opts,
+          .stitch_algorithm = stitch_opts,
+          .match_threshold = matching_opts.match_threshold,
+          .grid = matching_opts.type == pipeline::MatchingType::kGrid
+                      ? std::optional(matching_opts.grid)
+                      : std::nullopt,
+          .tiled_export = args.tiled,
+          .shard = args.shard};
+}
+
+bool ReportResult(const pipeline::StitchingResult &stitching_result,
+                  const std::filesystem::path &export_path, bool tiled) {
+  if (!stitching_result.pano) {
+    spdlog::error("Failed to stitch panorama: {}",
+                  algorithm::ToString(stitching_result.status));
+    return false;
+  }
+
+  if (!stitching_result.export_path) {
+    spdlog::error("Failed to export panorama to file: {}",
+                  export_path.string());
+    return false;
+  }
+
+  spdlog::info("Successfully exported to {}",
+               stitching_result.export_path->string());
+  if (!tiled) {
+    spdlog::info("Size: {} x {}", stitching_result.pano->cols,
+                 stitching_result.pano->rows);
+  }
+  return true;
+}
+
+std::int64_t FileBytes(const std::filesystem::path &path) {
+  std::error_code error;
+  const auto bytes = std::filesystem::file_size(path, error);
+  return error ? 0 : static_cast<std::int64_t>(bytes);
+}
+
+// Including the tiles of a Deep Zoom pyramid
+std::int64_t ExportBytes(const std::filesystem::path &export_path) {
+  std::int64_t bytes = FileBytes(export_path);
+  if (!utils::path::IsDeepZoom(export_path)) {
+    return bytes;
+  }
+  std::error_code error;
+  for (std::filesystem::recursive_directory_iterator
+           entry(utils::deep_zoom::FilesDir(export_path), error),
+       end;
+       !error && entry != end; entry.increment(error)) {
+    if (entry->is_regular_file(error)) {
+      bytes += FileBytes(entry->path());
+    }
+  }
+  return bytes;
+}
+
+void AddImagesToReport(const pipeline::StitcherData &stitcher_data,
+                       RunReport *report) {
+  for (const auto &image : stitcher_data.images) {
+    report->images.push_back({.path = image.GetPath(),
+                              .num_keypoints = image.NumKeypoints(),
+                              .bytes = FileBytes(image.GetPath())});
+  }
+}
+
+void AddLoadingToReport(const pipeline::StitcherData &stitcher_data,
+                        RunReport *report) {
+  AddImagesToReport(stitcher_data, report);
+  for (const auto &match : stitcher_data.matches) {
+    report->matches.push_back(
+        {.id1 = match.id1,
+         .id2 = match.id2,
+         .num_matches = algorithm::NumInliers(match)});
+  }
+  for (const auto &pano : stitcher_data.panos) {
+    report->detected_panos.push_back(pano.ids);
+  }
+}
+
+void AddPanoToReport(const std::vector<int> &image_ids,
+                     pipeline::StitchingResult stitching_result, bool tiled,
+                     RunReport *report) {
+  using algorithm::stitcher::Status;
+  const auto &pano = stitching_result.pano;
+  PanoReport pano_report = {
+      .pano_id = stitching_result.pano_id,
+      .image_ids = image_ids,
+      .status = algorithm::ToString(stitching_result.status),
+      .resolution_capped =
+          stitching_result.status == Status::kSuccessResolutionCapped,
+      .export_path = stitching_result.export_path};
+  if (pano && !tiled) {
+    pano_report.resolution = utils::Vec2i{pano->cols, pano->rows};
+  }
+  if (stitching_result.export_path) {
+    pano_report.bytes_written = ExportBytes(*stitching_result.export_path);
+  }
+  report->panos.push_back(std::move(pano_report));
+}
 
-  auto stitching_task = pipeline.RunStitching(
-      stitcher_data, {.pano_id = 0,
-                      .full_res = args.full_res,
-                      .export_path = export_path,
-                      .metadata = metadata_opts,
-                      .compression = compression_opts,
-                      .stitch_algorithm = stitch_opts});
+ResultType RunSinglePano(const Args &args,
+                         const pipeline::StitcherData &stitcher_data,
+                         pipeline::StitchingOptions options,
+                         Pipeline *pipeline, RunReport *report) {
+  const auto export_path = ExportPath(args, stitcher_data.images[0]);
+  // Written here once stitched, the pipeline exports only to files
+  const bool to_stdout = IsStdout(export_path);
+  options.pano_id = 0;
+  if (!to_stdout) {
+    options.export_path = export_path;
+  }
+  auto stitching_task = pipeline->RunStitching(stitcher_data, options);
 
   pipeline::StitchingResult stitching_result;
 
@@ -139,32 +411,495 @@ ResultType RunPipeline(const Args &args) {
   } catch (const utils::future::Cancelled) {
     spdlog::info("Canceling, press CTRL+C again to force quit.");
     stitching_task.progress->Cancel();
-    pipeline.CancelAndWait();
+    pipeline->CancelAndWait();
     return ResultType::kError;
   } catch (const std::exception &e) {
     spdlog::error("Failed to stitch panorama: {}", e.what());
     return ResultType::kError;
   }
 
-  if (!stitching_result.pano) {
-    spdlog::error("Failed to stitch panorama: {}",
-                  algorithm::ToString(stitching_result.status));
+  if (to_stdout && stitching_result.pano &&
+      WriteStdout(*stitching_result.pano, export_path, options.compression)) {
+    stitching_result.export_path = export_path;
+  }
+  if (report != nullptr) {
+    AddPanoToReport(stitcher_data.panos[0].ids, stitching_result, args.tiled,
+                    report);
+  }
+  return ReportResult(stitching_result, export_path, args.tiled)
+             ? ResultType::kSuccess
+             : ResultType::kError;
+}
+
+// The panos are exported in the background queue of the pipeline, the
+// scheduler keeps as many of them running as the CPU and the memory budget
+// allow. The panos complete before the end of the matching start while the
+// rest is still loading, see Pipeline::PopEarlyPanos.
+ResultType RunAllPanos(
+    const Args &args,
+    pipeline::Task<std::future<pipeline::StitcherData>> loading_task,
+    const pipeline::StitchingOptions &options, Pipeline *pipeline,
+    TaskSignal *task_done, RunReport *report) {
+  BatchScheduler scheduler({}, BatchConcurrency(),
+                           args.max_memory_mb.value_or(0));
+
+  // By the scheduler id, the data is released once the pano starts. The data
+  // of an early pano holds only that pano.
+  struct WaitingPano {
+    std::vector<int> image_ids;
+    int pano_id;
+    std::shared_ptr<const pipeline::StitcherData> data;
+  };
+  struct RunningPano {
+    int id;
+    std::filesystem::path export_path;
+    pipeline::Task<std::future<pipeline::StitchingResult>> task;
+  };
+  std::vector<WaitingPano> waiting;
+  std::vector<RunningPano> running;
+  auto add = [&scheduler, &waiting](
+                 const std::shared_ptr<const pipeline::StitcherData> &data,
+                 int pano_id) {
+    const auto &pano = data->panos[pano_id];
+    scheduler.Add(EstimateMemoryMb(*data, pano));
+    waiting.push_back({pano.ids, pano_id, data});
+  };
+  // Of the loading result, known once the matching is done
+  std::optional<std::vector<algorithm::Pano>> panos;
+  int num_exported = 0;
+
+  while (!panos || !scheduler.Done()) {
+    if (!panos) {
+      // All the early panos are published before the loading is done
+      const bool loaded = utils::future::IsReady(loading_task.future);
+      for (auto &data : pipeline->PopEarlyPanos()) {
+        add(std::make_shared<const pipeline::StitcherData>(std::move(data)),
+            0);
+      }
+      if (loaded) {
+        std::shared_ptr<const pipeline::StitcherData> data;
+        try {
+          data = std::make_shared<const pipeline::StitcherData>(
+              loading_task.future.get());
+        } catch (const std::exception &e) {
+          spdlog::error("Failed to load images: {}", e.what());
+          pipeline->CancelAndWait();
+          return ResultType::kError;
+        }
+        if (report != nullptr) {
+          AddLoadingToReport(*data, report);
+        }
+        if (data->images.empty()) {
+          spdlog::error("Failed to load any images");
+          return ResultType::kError;
+        }
+        if (data->panos.empty()) {
+          spdlog::error("No panos detected");
+          return ResultType::kError;
+        }
+        spdlog::info("Detected {} panos, {} of them before the matching ended",
+                     data->panos.size(), waiting.size());
+        for (int pano_id = 0; pano_id < data->panos.size(); pano_id++) {
+          const auto &ids = data->panos[pano_id].ids;
+          if (std::none_of(waiting.begin(), waiting.end(),
+                           [&ids](const auto &pano) {
+                             return pano.image_ids == ids;
+                           })) {
+            add(data, pano_id);
+          }
+        }
+        panos = data->panos;
+      }
+    }
+
+    while (auto id = scheduler.Next()) {
+      auto &pano = waiting[*id];
+      const auto &data = *pano.data;
+      auto export_path = ExportPath(args, data.images[pano.image_ids[0]]);
+      if (panos) {
+        spdlog::info("Stitching pano {} of {} to {}", *id + 1, panos->size(),
+                     export_path.string());
+      } else {
+        spdlog::info("Stitching pano {} to {}", *id + 1,
+                     export_path.string());
+      }
+      auto pano_options = options;
+      pano_options.pano_id = pano.pano_id;
+      pano_options.export_path = export_path;
+      running.push_back({*id, std::move(export_path),
+                         pipeline->RunStitching(data, pano_options)});
+      pano.data.reset();
+    }
+
+    if (cancel > 0) {
+      spdlog::info("Canceling, press CTRL+C again to force quit.");
+      if (!panos) {
+        loading_task.progress->Cancel();
+      }
+      for (auto &pano : running) {
+        pano.task.progress->Cancel();
+      }
+      pipeline->CancelAndWait();
+      return ResultType::kError;
+    }
+
+    auto finished =
+        std::find_if(running.begin(), running.end(), [](const auto &pano) {
+          return utils::future::IsReady(pano.task.future);
+        });
+    if (finished == running.end()) {
+      task_done->Wait();
+      continue;
+    }
+
+    try {
+      const auto stitching_result = finished->task.future.get();
+      if (report != nullptr) {
+        AddPanoToReport(waiting[finished->id].image_ids, stitching_result,
+                        args.tiled, report);
+      }
+      if (ReportResult(stitching_result, finished->export_path, args.tiled)) {
+        num_exported++;
+      }
+    } catch (const std::exception &e) {
+      spdlog::error("Failed to stitch pano {}: {}", finished->id + 1,
+                    e.what());
+    }
+    scheduler.Finish(finished->id);
+    running.erase(finished);
+  }
+
+  // The early panos were stitched with ids of their own data
+  if (report != nullptr) {
+    for (auto &pano_report : report->panos) {
+      auto pano = std::find_if(panos->begin(), panos->end(),
+                               [&pano_report](const auto &pano) {
+                                 return pano.ids == pano_report.image_ids;
+                               });
+      pano_report.pano_id = static_cast<int>(pano - panos->begin());
+    }
+  }
+
+  spdlog::info("Exported {} of {} panos", num_exported, panos->size());
+  return num_exported == static_cast<int>(panos->size()) ? ResultType::kSuccess
+                                                         : ResultType::kError;
+}
+
+// The report is optional, filled with the results of the stages
+ResultType RunPipeline(const Args &args, RunReport *report) {
+  TaskSignal task_done;
+  Pipeline pipeline(pipeline::FitToMemoryBudget(
+      {.checkpoint_dir = args.checkpoint_dir,
+       .spill_dir = args.spill_dir,
+       .mapped_frames_dir = args.mapped_frames_dir,
+       .max_concurrent_exports = args.all_panos ? BatchConcurrency()
+                                                : kDefaultConcurrentExports,
+       .pool = utils::mt::SharedPool(),
+       .stream_panos = args.all_panos,
+       .on_task_done = [&task_done]() { task_done.Notify(); }},
+      args.max_memory_mb.value_or(0)));
+
+  const auto matching_opts = MatchingOptionsFromArgs(args);
+  const auto loading_opts = LoadingOptionsFromArgs(args);
+  std::optional<std::vector<algorithm::Image>> stdin_images;
+  if (args.read_stdin) {
+    stdin_images = ReadStdinImages();
+    if (!stdin_images) {
+      return ResultType::kError;
+    }
+  }
+  auto loading_task = stdin_images
+                          ? pipeline.RunLoadingImages(*std::move(stdin_images),
+                                                      loading_opts,
+                                                      matching_opts)
+                          : pipeline.RunLoading(args.input_paths, loading_opts,
+                                                matching_opts);
+  auto options = StitchingOptionsFromArgs(args, matching_opts);
+  if (args.all_panos) {
+    return RunAllPanos(args, std::move(loading_task), options, &pipeline,
+                       &task_done, report);
+  }
+
+  pipeline::StitcherData stitcher_data;
+
+  try {
+    stitcher_data = utils::future::GetWithCancellation(
+        std::move(loading_task.future), cancel);
+  } catch (const utils::future::Cancelled) {
+    spdlog::info("Canceling, press CTRL+C again to force quit.");
+    loading_task.progress->Cancel();
+    pipeline.CancelAndWait();
+    return ResultType::kError;
+  } catch (const std::exception &e) {
+    spdlog::error("Failed to load images: {}", e.what());
     return ResultType::kError;
   }
 
-  if (!stitching_result.export_path) {
-    spdlog::error("Failed to export panorama to file: {}",
-                  export_path.string());
+  if (report != nullptr) {
+    AddLoadingToReport(stitcher_data, report);
+  }
+  if (stitcher_data.images.empty()) {
+    spdlog::error("Failed to load any images");
     return ResultType::kError;
   }
 
-  spdlog::info("Successfully exported to {}",
-               stitching_result.export_path->string());
-  spdlog::info("Size: {} x {}", stitching_result.pano->cols,
-               stitching_result.pano->rows);
+  return RunSinglePano(args, stitcher_data, options, &pipeline, report);
+}
+
+// The stages of consecutive jobs overlap in the one pipeline: the next job
+// loads and matches on the shared pool while the panos of the earlier ones
+// compose and encode in the export queue, admitted as for --all-panos. The
+// loaded jobs waiting for the stitching are limited by kMaxWaitingJobs.
+ResultType RunJobs(const Args &args, RunReport *report) {
+  const auto read_jobs = ReadJobs(*args.jobs_path);
+  if (!read_jobs) {
+    return ResultType::kError;
+  }
+  const auto &jobs = *read_jobs;
+  if (args.all_panos &&
+      std::any_of(jobs.begin(), jobs.end(),
+                  [](const Job &job) { return job.output_path.has_value(); })) {
+    spdlog::error("--all-panos names the outputs after the first image of "
+                  "each pano, jobs with an output are not supported.");
+    return ResultType::kError;
+  }
+
+  TaskSignal task_done;
+  Pipeline pipeline(pipeline::FitToMemoryBudget(
+      {.checkpoint_dir = args.checkpoint_dir,
+       .spill_dir = args.spill_dir,
+       .mapped_frames_dir = args.mapped_frames_dir,
+       .max_concurrent_exports = BatchConcurrency(),
+       .pool = utils::mt::SharedPool(),
+       .on_task_done = [&task_done]() { task_done.Notify(); }},
+      args.max_memory_mb.value_or(0)));
+  const auto matching_opts = MatchingOptionsFromArgs(args);
+  const auto loading_opts = LoadingOptionsFromArgs(args);
+  const auto options = StitchingOptionsFromArgs(args, matching_opts);
+
+  JobQueue job_queue(static_cast<int>(jobs.size()), kMaxWaitingJobs);
+  BatchScheduler scheduler({}, BatchConcurrency(),
+                           args.max_memory_mb.value_or(0));
+
+  struct LoadingJob {
+    int job_id;
+    pipeline::Task<std::future<pipeline::StitcherData>> task;
+  };
+  // By the scheduler id, the data is released once the pano starts, the
+  // stitching keeps its own copy
+  struct WaitingPano {
+    int job_id;
+    int pano_id;
+    std::shared_ptr<const pipeline::StitcherData> data;
+  };
+  struct RunningPano {
+    int id;
+    std::vector<int> image_ids;
+    std::filesystem::path export_path;
+    pipeline::Task<std::future<pipeline::StitchingResult>> task;
+  };
+  std::optional<LoadingJob> loading;
+  std::vector<WaitingPano> waiting;
+  std::vector<RunningPano> running;
+  int num_failed_jobs = 0;
+  int num_exported = 0;
+
+  while (!job_queue.AllLoaded() || !scheduler.Done()) {
+    if (auto job_id = job_queue.NextLoad()) {
+      spdlog::info("Loading job {} of {}", *job_id + 1, jobs.size());
+      loading = LoadingJob{*job_id, pipeline.RunLoading(
+                                        jobs[*job_id].input_paths,
+                                        loading_opts, matching_opts)};
+    }
+
+    while (auto id = scheduler.Next()) {
+      auto &pano = waiting[*id];
+      job_queue.Started(pano.job_id);
+      const auto &data = *pano.data;
+      auto export_path =
+          ExportPath(jobs[pano.job_id].output_path, args.tiled,
+                     data.images[data.panos[pano.pano_id].ids[0]]);
+      spdlog::info("Stitching pano {} of job {} to {}", pano.pano_id + 1,
+                   pano.job_id + 1, export_path.string());
+      auto pano_options = options;
+      pano_options.pano_id = pano.pano_id;
+      pano_options.export_path = export_path;
+      running.push_back({*id, data.panos[pano.pano_id].ids,
+                         std::move(export_path),
+                         pipeline.RunStitching(data, pano_options)});
+      pano.data.reset();
+    }
+
+    if (cancel > 0) {
+      spdlog::info("Canceling, press CTRL+C again to force quit.");
+      if (loading) {
+        loading->task.progress->Cancel();
+      }
+      for (auto &pano : running) {
+        pano.task.progress->Cancel();
+      }
+      pipeline.CancelAndWait();
+      return ResultType::kError;
+    }
+
+    if (loading && utils::future::IsReady(loading->task.future)) {
+      const int job_id = loading->job_id;
+      int num_panos = 0;
+      try {
+        auto data = std::make_shared<const pipeline::StitcherData>(
+            loading->task.future.get());
+        if (report != nullptr) {
+          AddImagesToReport(*data, report);
+        }
+        num_panos = args.all_panos ? static_cast<int>(data->panos.size())
+                                   : std::min(1, static_cast<int>(
+                                                     data->panos.size()));
+        if (num_panos == 0) {
+          spdlog::error("No panos detected in job {}", job_id + 1);
+          num_failed_jobs++;
+        }
+        for (int pano_id = 0; pano_id < num_panos; pano_id++) {
+          scheduler.Add(EstimateMemoryMb(*data, data->panos[pano_id]));
+          waiting.push_back({job_id, pano_id, data});
+        }
+      } catch (const std::exception &e) {
+        spdlog::error("Failed to load the images of job {}: {}", job_id + 1,
+                      e.what());
+        num_failed_jobs++;
+      }
+      job_queue.Loaded(job_id, num_panos);
+      loading.reset();
+      continue;
+    }
+
+    auto finished =
+        std::find_if(running.begin(), running.end(), [](const auto &pano) {
+          return utils::future::IsReady(pano.task.future);
+        });
+    if (finished == running.end()) {
+      task_done.Wait();
+      continue;
+    }
+
+    const auto &pano = waiting[finished->id];
+    try {
+      const auto stitching_result = finished->task.future.get();
+      if (report != nullptr) {
+        AddPanoToReport(finished->image_ids, stitching_result, args.tiled,
+                        report);
+        report->panos.back().job_id = pano.job_id;
+      }
+      if (ReportResult(stitching_result, finished->export_path, args.tiled)) {
+        num_exported++;
+      }
+    } catch (const std::exception &e) {
+      spdlog::error("Failed to stitch pano {} of job {}: {}",
+                    pano.pano_id + 1, pano.job_id + 1, e.what());
+    }
+    scheduler.Finish(finished->id);
+    running.erase(finished);
+  }
+
+  spdlog::info("Exported {} of {} panos from {} jobs", num_exported,
+               waiting.size(), jobs.size());
+  return num_failed_jobs == 0 &&
+                 num_exported == static_cast<int>(waiting.size())
+             ? ResultType::kSuccess
+             : ResultType::kError;
+}
+
+std::vector<std::vector<std::filesystem::path>> PanoPaths(
+    const pipeline::StitcherData &stitcher_data) {
+  std::vector<std::vector<std::filesystem::path>> result;
+  result.reserve(stitcher_data.panos.size());
+  for (const auto &pano : stitcher_data.panos) {
+    auto &paths = result.emplace_back();
+    for (const int image_id : pano.ids) {
+      paths.push_back(stitcher_data.images[image_id].GetPath());
+    }
+  }
+  return result;
+}
+
+// Runs until CTRL+C, the pipeline stays alive between the batches of new
+// images, so only those are loaded and matched against the ones already
+// loaded, while the thread pool and the caches stay warm
+ResultType RunWatch(const Args &args) {
+  Pipeline pipeline(pipeline::FitToMemoryBudget(
+      {.checkpoint_dir = args.checkpoint_dir,
+       .spill_dir = args.spill_dir,
+       .mapped_frames_dir = args.mapped_frames_dir,
+       .pool = utils::mt::SharedPool()},
+      args.max_memory_mb.value_or(0)));
+  const auto matching_opts = MatchingOptionsFromArgs(args);
+  const auto loading_opts = LoadingOptionsFromArgs(args);
+  const auto options =
+      StitchingOptionsFromArgs(args, matching_opts);
+  // Compiles the OpenCL kernels while waiting for the first images
+  auto warm_up = args.warm_up
+                     ? std::async(std::launch::async, algorithm::WarmUp)
+                     : std::future<void>{};
+
+  WatchedFolder folder(*args.watch_dir);
+  QuietPanos quiet_panos(std::chrono::seconds(
+      args.quiet_period_s.value_or(kDefaultWatchQuietSeconds)));
+  pipeline::StitcherData stitcher_data;
+  spdlog::info("Watching {}, press CTRL+C to stop.",
+               args.watch_dir->string());
+
+  while (cancel == 0) {
+    if (auto new_files = folder.Poll(); !new_files.empty()) {
+      spdlog::info("Loading {} new images", new_files.size());
+      auto loading_task =
+          stitcher_data.images.empty()
+              ? pipeline.RunLoading(new_files, loading_opts, matching_opts)
+              : pipeline.RunAppending(stitcher_data, new_files, loading_opts,
+                                      matching_opts);
+      try {
+        stitcher_data = utils::future::GetWithCancellation(
+            std::move(loading_task.future), cancel);
+      } catch (const utils::future::Cancelled) {
+        loading_task.progress->Cancel();
+        pipeline.CancelAndWait();
+        break;
+      } catch (const std::exception &e) {
+        spdlog::error("Failed to load images: {}", e.what());
+      }
+      quiet_panos.Update(PanoPaths(stitcher_data),
+                         QuietPanos::Clock::now());
+    }
+
+    for (const int pano_id : quiet_panos.Ready(QuietPanos::Clock::now())) {
+      const auto &pano = stitcher_data.panos[pano_id];
+      const auto export_path =
+          ExportPath(args, stitcher_data.images[pano.ids[0]]);
+      folder.Ignore(export_path);
+      spdlog::info("Stitching {} images to {}", pano.ids.size(),
+                   export_path.string());
+      auto pano_options = options;
+      pano_options.pano_id = pano_id;
+      pano_options.export_path = export_path;
+      auto stitching_task = pipeline.RunStitching(stitcher_data, pano_options);
+      try {
+        ReportResult(utils::future::GetWithCancellation(
+                         std::move(stitching_task.future), cancel),
+                     export_path, args.tiled);
+      } catch (const utils::future::Cancelled) {
+        stitching_task.progress->Cancel();
+        pipeline.CancelAndWait();
+        break;
+      } catch (const std::exception &e) {
+        spdlog::error("Failed to stitch panorama: {}", e.what());
+      }
+      quiet_panos.MarkStitched(pano_id);
+    }
 
+    std::this_thread::sleep_for(kWatchPollInterval);
+  }
+  spdlog::info("Stopped watching {}", args.watch_dir->string());
   return ResultType::kSuccess;
 }
+
 }  // namespace
 
 std::pair<ResultType, std::optional<Args>> Run(int argc, char **argv) {
@@ -174,6 +909,9 @@ std::pair<ResultType, std::optional<Args>> Run(int argc, char **argv) {
   logger::RedirectSpdlogToCout();
 
   auto args = ParseArgs(argc, argv);
+  if (args && args->output_path && IsStdout(*args->output_path)) {
+    logger::RedirectSpdlogToCerr();
+  }
 
   if (!args) {
     PrintHelp();
@@ -190,12 +928,53 @@ std::pair<ResultType, std::optional<Args>> Run(int argc, char **argv) {
     return {ResultType::kSuccess, std::nullopt};
   }
 
-  if (args->run_gui || args->input_paths.empty()) {
+  // Also for the GUI, before the shared pool is used
+  pipeline::ApplyResources({.threads = args->threads.value_or(0),
+                            .cpus = args->cpus,
+                            .memory_mb = args->max_memory_mb.value_or(0)});
+
+  if (args->watch_dir) {
+    signal::RegisterInterruptHandler(CancelHandler);
+    return {RunWatch(*args), args};
+  }
+
+  if (args->run_gui || (args->input_paths.empty() && !args->read_stdin &&
+                        !args->jobs_path)) {
     return {ResultType::kForwardToGui, args};
   }
 
   signal::RegisterInterruptHandler(CancelHandler);
-  return {RunPipeline(*args), args};
+  // The report takes the stage timings from the trace
+  const bool record = args->trace_path || args->report_path;
+  if (record) {
+    utils::trace::Start();
+  }
+  const auto start = std::chrono::steady_clock::now();
+  RunReport report;
+  // The pipeline is gone by now, all of its spans are recorded
+  auto *report_ptr = args->report_path ? &report : nullptr;
+  auto result = args->jobs_path ? RunJobs(*args, report_ptr)
+                                : RunPipeline(*args, report_ptr);
+  if (record) {
+    utils::trace::Stop();
+  }
+  if (args->trace_path) {
+    utils::trace::Write(*args->trace_path);
+  }
+  if (args->report_path) {
+    report.success = result == ResultType::kSuccess;
+    report.wall_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    report.cpu_us = utils::process::ProcessCpuUs();
+    report.peak_rss_bytes = utils::process::PeakRssBytes();
+    report.stages = utils::trace::Totals();
+    report.memory = utils::memory::Snapshot();
+    report.opencl_reserved_bytes = utils::memory::OpenClReservedBytes();
+    report.transfers = utils::memory::Transfers();
+    WriteReport(*args->report_path, report);
+  }
+  return {result, args};
 }
 
 int ExitCode(ResultType result) {
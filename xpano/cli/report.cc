@@ -0,0 +1,174 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/cli/report.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+
+#include "xpano/utils/memory.h"
+#include "xpano/utils/trace.h"
+
+namespace xpano::cli {
+
+namespace {
+
+constexpr double kUsPerMs = 1000.0;
+
+std::string Quote(std::string_view text) {
+  std::string result = "\"";
+  for (const char character : text) {
+    switch (character) {
+      case '"':
+        result += "\\\"";
+        break;
+      case '\\':
+        result += "\\\\";
+        break;
+      case '\n':
+        result += "\\n";
+        break;
+      default:
+        if (static_cast<unsigned char>(character) < 0x20) {
+          result += fmt::format("\\u{:04x}", static_cast<int>(character));
+        } else {
+          result += character;
+        }
+    }
+  }
+  return result + "\"";
+}
+
+std::string QuotePath(const std::filesystem::path& path) {
+  const auto text = path.u8string();
+  return Quote(std::string_view(reinterpret_cast<const char*>(text.data()),
+                                text.size()));
+}
+
+template <typename TValue>
+std::string Optional(const std::optional<TValue>& value) {
+  return value ? fmt::format("{}", *value) : "null";
+}
+
+template <typename TItem, typename TFormat>
+std::string List(const std::vector<TItem>& items, TFormat format,
+                 std::string_view separator = ",\n    ") {
+  std::string result;
+  for (int i = 0; i < items.size(); i++) {
+    if (i > 0) {
+      result += separator;
+    }
+    result += format(items[i]);
+  }
+  return result;
+}
+
+std::string Ids(const std::vector<int>& ids) {
+  return "[" + List(ids, [](int id) { return std::to_string(id); }, ", ") +
+         "]";
+}
+
+std::string Ms(std::int64_t time_us) {
+  return fmt::format("{:.3f}", static_cast<double>(time_us) / kUsPerMs);
+}
+
+std::string Stage(const utils::trace::StageTotals& stage) {
+  return fmt::format(
+      "{{\"name\": {}, \"count\": {}, \"wall_ms\": {}, \"cpu_ms\": {}, "
+      "\"peak_rss_bytes\": {}}}",
+      Quote(stage.name), stage.count, Ms(stage.wall_us), Ms(stage.cpu_us),
+      stage.peak_rss_bytes);
+}
+
+std::string Memory(const utils::memory::Usage& usage) {
+  return fmt::format(
+      "{{\"category\": {}, \"bytes\": {}, \"peak_bytes\": {}}}",
+      Quote(utils::memory::Label(usage.category)), usage.bytes,
+      usage.peak_bytes);
+}
+
+std::string Transfers(const utils::memory::TransferStats& transfers) {
+  return fmt::format(
+      "{{\"uploads\": {}, \"upload_bytes\": {}, \"downloads\": {}, "
+      "\"download_bytes\": {}}}",
+      transfers.uploads, transfers.upload_bytes, transfers.downloads,
+      transfers.download_bytes);
+}
+
+std::string Image(const ImageReport& image) {
+  return fmt::format("{{\"path\": {}, \"keypoints\": {}, \"bytes\": {}}}",
+                     QuotePath(image.path), image.num_keypoints, image.bytes);
+}
+
+std::string Match(const MatchReport& match) {
+  return fmt::format("{{\"id1\": {}, \"id2\": {}, \"matches\": {}}}",
+                     match.id1, match.id2, match.num_matches);
+}
+
+std::string Pano(const PanoReport& pano) {
+  return fmt::format(
+      "{{\"job\": {}, \"pano_id\": {}, \"images\": {}, \"status\": {}, "
+      "\"resolution_capped\": {}, \"export_path\": {}, \"width\": {}, "
+      "\"height\": {}, \"bytes_written\": {}}}",
+      Optional(pano.job_id), pano.pano_id, Ids(pano.image_ids),
+      Quote(pano.status), pano.resolution_capped,
+      pano.export_path ? QuotePath(*pano.export_path) : "null",
+      pano.resolution ? std::to_string((*pano.resolution)[0]) : "null",
+      pano.resolution ? std::to_string((*pano.resolution)[1]) : "null",
+      pano.bytes_written);
+}
+
+}  // namespace
+
+bool WriteReport(const std::filesystem::path& path, const RunReport& report) {
+  std::int64_t bytes_read = 0;
+  for (const auto& image : report.images) {
+    bytes_read += image.bytes;
+  }
+  std::int64_t bytes_written = 0;
+  for (const auto& pano : report.panos) {
+    bytes_written += pano.bytes_written;
+  }
+
+  std::ofstream stream(path, std::ios::trunc);
+  stream << fmt::format(
+      "{{\n"
+      "  \"success\": {},\n"
+      "  \"wall_ms\": {},\n"
+      "  \"cpu_ms\": {},\n"
+      "  \"peak_rss_bytes\": {},\n"
+      "  \"opencl_reserved_bytes\": {},\n"
+      "  \"transfers\": {},\n"
+      "  \"bytes_read\": {},\n"
+      "  \"bytes_written\": {},\n"
+      "  \"stages\": [\n    {}\n  ],\n"
+      "  \"memory\": [\n    {}\n  ],\n"
+      "  \"images\": [\n    {}\n  ],\n"
+      "  \"matches\": [\n    {}\n  ],\n"
+      "  \"detected_panos\": [\n    {}\n  ],\n"
+      "  \"panos\": [\n    {}\n  ]\n"
+      "}}\n",
+      report.success, Ms(report.wall_us), Ms(report.cpu_us),
+      Optional(report.peak_rss_bytes), Optional(report.opencl_reserved_bytes),
+      Transfers(report.transfers), bytes_read, bytes_written,
+      List(report.stages, Stage), List(report.memory, Memory),
+      List(report.images, Image), List(report.matches, Match),
+      List(report.detected_panos, Ids), List(report.panos, Pano));
+  stream.close();
+  if (!stream) {
+    spdlog::error("Failed to write the report to {}", path.string());
+    return false;
+  }
+  spdlog::info("Written the run report to {}", path.string());
+  return true;
+}
+
+}  // namespace xpano::cli
@@ -0,0 +1,65 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "xpano/utils/memory.h"
+#include "xpano/utils/trace.h"
+#include "xpano/utils/vec.h"
+
+namespace xpano::cli {
+
+struct ImageReport {
+  std::filesystem::path path;
+  int num_keypoints = 0;
+  std::int64_t bytes = 0;
+};
+
+struct MatchReport {
+  int id1;
+  int id2;
+  int num_matches;
+};
+
+struct PanoReport {
+  // Index in the --jobs file
+  std::optional<int> job_id;
+  int pano_id = 0;
+  std::vector<int> image_ids;
+  std::string status;
+  bool resolution_capped = false;
+  std::optional<std::filesystem::path> export_path;
+  // Not known for the tiled exports
+  std::optional<utils::Vec2i> resolution;
+  std::int64_t bytes_written = 0;
+};
+
+// Summary of a CLI run written by --report, for tracking the performance
+// across versions and machines without parsing the log
+struct RunReport {
+  bool success = false;
+  std::int64_t wall_us = 0;
+  std::int64_t cpu_us = 0;
+  std::optional<std::int64_t> peak_rss_bytes;
+  std::vector<utils::trace::StageTotals> stages;
+  std::vector<utils::memory::Usage> memory;
+  std::optional<std::int64_t> opencl_reserved_bytes;
+  utils::memory::TransferStats transfers;
+  std::vector<ImageReport> images;
+  // Not reported for --jobs, the image ids are per job
+  std::vector<MatchReport> matches;
+  // Image ids of the detected panos
+  std::vector<std::vector<int>> detected_panos;
+  // Stitched panos in the order they finished
+  std::vector<PanoReport> panos;
+};
+
+bool WriteReport(const std::filesystem::path& path, const RunReport& report);
+
+}  // namespace xpano::cli
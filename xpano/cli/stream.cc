@@ -0,0 +1,267 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/cli/stream.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <initializer_list>
+#include <ios>
+#include <istream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "xpano/utils/fmt.h"
+#include "xpano/utils/path.h"
+
+namespace xpano::cli {
+
+namespace {
+
+constexpr std::size_t kTarBlockSize = 512;
+constexpr std::size_t kTarNameOffset = 0;
+constexpr std::size_t kTarNameLength = 100;
+constexpr std::size_t kTarSizeOffset = 124;
+constexpr std::size_t kTarSizeLength = 12;
+constexpr std::size_t kTarTypeOffset = 156;
+constexpr std::size_t kTarMagicOffset = 257;
+constexpr std::size_t kTarPrefixOffset = 345;
+constexpr std::size_t kTarPrefixLength = 155;
+constexpr std::size_t kFrameHeaderSize = 8;
+// Rejects the streams in neither format, e.g. a single image piped as is
+constexpr std::uint64_t kMaxStreamedFileBytes = std::uint64_t{4} << 30;
+
+using TarHeader = std::array<char, kTarBlockSize>;
+
+// Serves the bytes peeked to detect the format before the rest of the stream
+class Reader {
+ public:
+  Reader(std::istream* stream, std::vector<char> head)
+      : stream_(stream), head_(std::move(head)) {}
+
+  // False if the stream ends before size bytes
+  bool Read(char* out, std::size_t size) {
+    const std::size_t from_head = std::min(size, head_.size() - head_pos_);
+    std::copy_n(head_.begin() + static_cast<std::ptrdiff_t>(head_pos_),
+                from_head, out);
+    head_pos_ += from_head;
+    if (from_head == size) {
+      return true;
+    }
+    const auto rest = static_cast<std::streamsize>(size - from_head);
+    stream_->read(out + from_head, rest);
+    return stream_->gcount() == rest;
+  }
+
+  bool Read(std::vector<unsigned char>* out) {
+    // NOLINTNEXTLINE(cppcoreguidelines-pro-type-reinterpret-cast)
+    return Read(reinterpret_cast<char*>(out->data()), out->size());
+  }
+
+  bool Skip(std::size_t size) {
+    const std::size_t from_head = std::min(size, head_.size() - head_pos_);
+    head_pos_ += from_head;
+    if (from_head == size) {
+      return true;
+    }
+    const auto rest = static_cast<std::streamsize>(size - from_head);
+    stream_->ignore(rest);
+    return stream_->gcount() == rest;
+  }
+
+  bool AtEnd() {
+    return head_pos_ == head_.size() &&
+           stream_->peek() == std::istream::traits_type::eof();
+  }
+
+ private:
+  std::istream* stream_;
+  std::vector<char> head_;
+  std::size_t head_pos_ = 0;
+};
+
+bool IsTar(const std::vector<char>& head) {
+  const std::string_view magic = "ustar";
+  return head.size() == kTarBlockSize &&
+         std::equal(magic.begin(), magic.end(),
+                    head.begin() +
+                        static_cast<std::ptrdiff_t>(kTarMagicOffset));
+}
+
+std::string TarString(const TarHeader& header, std::size_t offset,
+                      std::size_t length) {
+  const auto* begin = header.data() + offset;
+  return {begin, std::find(begin, begin + length, '\0')};
+}
+
+// Octal, or base-256 with the high bit of the first byte set for the sizes
+// over 8 GB
+std::optional<std::uint64_t> TarSize(const TarHeader& header) {
+  const auto* field = header.data() + kTarSizeOffset;
+  std::uint64_t size = 0;
+  if ((static_cast<unsigned char>(field[0]) & 0x80) != 0) {
+    size = static_cast<unsigned char>(field[0]) & 0x7f;
+    for (std::size_t i = 1; i < kTarSizeLength; i++) {
+      size = (size << 8) | static_cast<unsigned char>(field[i]);
+    }
+    return size;
+  }
+  std::size_t i = 0;
+  while (i < kTarSizeLength && field[i] == ' ') {
+    i++;
+  }
+  for (; i < kTarSizeLength && field[i] != '\0' && field[i] != ' '; i++) {
+    if (field[i] < '0' || field[i] > '7') {
+      return std::nullopt;
+    }
+    size = size * 8 + (field[i] - '0');
+  }
+  return size;
+}
+
+// The "path" record of a pax extended header, e.g. "30 path=dir/image.jpg\n"
+std::optional<std::string> PaxPath(const std::string& records) {
+  std::size_t pos = 0;
+  while (pos < records.size()) {
+    const auto space = records.find(' ', pos);
+    std::size_t length = 0;
+    if (space == std::string::npos ||
+        std::from_chars(records.data() + pos, records.data() + space, length)
+                .ec != std::errc() ||
+        pos + length > records.size() || space + 2 > pos + length) {
+      return std::nullopt;
+    }
+    const auto record = records.substr(space + 1, pos + length - space - 2);
+    if (record.starts_with("path=")) {
+      return record.substr(5);
+    }
+    pos += length;
+  }
+  return std::nullopt;
+}
+
+std::optional<std::vector<StreamedFile>> ReadTar(Reader* reader) {
+  std::vector<StreamedFile> files;
+  // Set by a GNU long name or a pax header for the next entry
+  std::optional<std::string> next_name;
+  TarHeader header;
+  // An archive without the terminating blocks ends after its last entry
+  while (reader->Read(header.data(), header.size())) {
+    if (std::all_of(header.begin(), header.end(),
+                    [](char byte) { return byte == '\0'; })) {
+      break;
+    }
+    const auto size = TarSize(header);
+    if (!size || *size > kMaxStreamedFileBytes) {
+      return std::nullopt;
+    }
+    const std::size_t padding =
+        (kTarBlockSize - *size % kTarBlockSize) % kTarBlockSize;
+    const char type = header[kTarTypeOffset];
+
+    if (type == 'L' || type == 'x') {
+      std::string value(*size, '\0');
+      if (!reader->Read(value.data(), value.size()) ||
+          !reader->Skip(padding)) {
+        return std::nullopt;
+      }
+      next_name = type == 'L' ? value.substr(0, value.find('\0'))
+                              : PaxPath(value);
+      continue;
+    }
+
+    std::filesystem::path name;
+    if (next_name) {
+      name = *std::exchange(next_name, std::nullopt);
+    } else {
+      const auto prefix =
+          TarString(header, kTarPrefixOffset, kTarPrefixLength);
+      name = TarString(header, kTarNameOffset, kTarNameLength);
+      if (!prefix.empty()) {
+        name = std::filesystem::path(prefix) / name;
+      }
+    }
+
+    const bool regular_file = type == '0' || type == '\0';
+    if (!regular_file || !utils::path::IsExtensionSupported(name)) {
+      if (!reader->Skip(*size + padding)) {
+        return std::nullopt;
+      }
+      continue;
+    }
+    std::vector<unsigned char> bytes(*size);
+    if (!reader->Read(&bytes) || !reader->Skip(padding)) {
+      return std::nullopt;
+    }
+    files.push_back({std::move(name), std::move(bytes)});
+  }
+  return files;
+}
+
+bool StartsWith(const std::vector<unsigned char>& bytes,
+                std::initializer_list<unsigned char> magic) {
+  return bytes.size() >= magic.size() &&
+         std::equal(magic.begin(), magic.end(), bytes.begin());
+}
+
+std::string FrameName(int frame_id, const std::vector<unsigned char>& bytes) {
+  std::string extension = ".jpg";
+  if (StartsWith(bytes, {0x89, 'P', 'N', 'G'})) {
+    extension = ".png";
+  } else if (StartsWith(bytes, {'I', 'I', 0x2a, 0x00}) ||
+             StartsWith(bytes, {'M', 'M', 0x00, 0x2a})) {
+    extension = ".tif";
+  }
+  return fmt::format("stdin_{}{}", frame_id + 1, extension);
+}
+
+std::optional<std::vector<StreamedFile>> ReadFrames(Reader* reader) {
+  std::vector<StreamedFile> files;
+  std::vector<unsigned char> header(kFrameHeaderSize);
+  while (!reader->AtEnd()) {
+    if (!reader->Read(&header)) {
+      return std::nullopt;
+    }
+    std::uint64_t size = 0;
+    for (std::size_t i = 0; i < kFrameHeaderSize; i++) {
+      size |= std::uint64_t{header[i]} << (8 * i);
+    }
+    if (size > kMaxStreamedFileBytes) {
+      return std::nullopt;
+    }
+    std::vector<unsigned char> bytes(size);
+    if (!reader->Read(&bytes)) {
+      return std::nullopt;
+    }
+    auto name = FrameName(static_cast<int>(files.size()), bytes);
+    files.push_back({std::move(name), std::move(bytes)});
+  }
+  return files;
+}
+
+}  // namespace
+
+std::optional<std::vector<StreamedFile>> ReadStreamedFiles(
+    std::istream* stream) {
+  std::vector<char> head(kTarBlockSize);
+  stream->read(head.data(), static_cast<std::streamsize>(head.size()));
+  head.resize(static_cast<std::size_t>(stream->gcount()));
+
+  const bool tar = IsTar(head);
+  Reader reader(stream, std::move(head));
+  return tar ? ReadTar(&reader) : ReadFrames(&reader);
+}
+
+bool IsStdout(const std::filesystem::path& path) {
+  return !path.has_parent_path() && path.stem() == "-";
+}
+
+}  // namespace xpano::cli
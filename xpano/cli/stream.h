@@ -0,0 +1,32 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <filesystem>
+#include <istream>
+#include <optional>
+#include <vector>
+
+namespace xpano::cli {
+
+// An encoded image read from a stream, the name stands in for its path
+struct StreamedFile {
+  std::filesystem::path name;
+  std::vector<unsigned char> bytes;
+};
+
+// Reads the encoded images streamed to stdin by --stdin, one of:
+//  - A tar archive, e.g. "tar cf - *.jpg". Entries with an unsupported
+//    extension are skipped.
+//  - Frames of the image size as an 8-byte little-endian integer followed by
+//    the encoded image. The images are named stdin_<N> with the extension of
+//    their format.
+// Stops at the end of the stream, empty if the stream is malformed.
+std::optional<std::vector<StreamedFile>> ReadStreamedFiles(
+    std::istream* stream);
+
+// --output=- writes the pano to stdout, "-.png" or "-.tif" pick the format
+bool IsStdout(const std::filesystem::path& path);
+
+}  // namespace xpano::cli
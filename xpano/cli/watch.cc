@@ -0,0 +1,105 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/cli/watch.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "xpano/utils/path.h"
+
+namespace xpano::cli {
+
+namespace {
+
+std::filesystem::path Normalized(const std::filesystem::path& path) {
+  std::error_code error;
+  auto absolute = std::filesystem::absolute(path, error);
+  return error ? path.lexically_normal() : absolute.lexically_normal();
+}
+
+}  // namespace
+
+WatchedFolder::WatchedFolder(std::filesystem::path dir)
+    : dir_(std::move(dir)) {}
+
+void WatchedFolder::Ignore(const std::filesystem::path& path) {
+  ignored_.insert(Normalized(path));
+}
+
+std::vector<std::filesystem::path> WatchedFolder::Poll() {
+  std::vector<std::filesystem::path> ready;
+  std::error_code error;
+  for (std::filesystem::directory_iterator entry(dir_, error), end;
+       !error && entry != end; entry.increment(error)) {
+    const auto& path = entry->path();
+    std::error_code stat_error;
+    if (!entry->is_regular_file(stat_error) ||
+        !utils::path::IsExtensionSupported(path) ||
+        ignored_.contains(Normalized(path))) {
+      continue;
+    }
+    const auto size = entry->file_size(stat_error);
+    const auto modified = entry->last_write_time(stat_error);
+    if (stat_error) {
+      continue;
+    }
+
+    auto [iter, inserted] =
+        files_.try_emplace(path, FileState{.size = size, .modified = modified});
+    auto& state = iter->second;
+    if (inserted || state.returned) {
+      continue;
+    }
+    if (state.size != size || state.modified != modified) {
+      // Still being written
+      state.size = size;
+      state.modified = modified;
+      continue;
+    }
+    state.returned = true;
+    ready.push_back(path);
+  }
+  utils::path::SortNatural(&ready);
+  return ready;
+}
+
+QuietPanos::QuietPanos(Clock::duration quiet_period)
+    : quiet_period_(quiet_period) {}
+
+void QuietPanos::Update(
+    const std::vector<std::vector<std::filesystem::path>>& panos,
+    Clock::time_point now) {
+  std::vector<Pano> updated;
+  updated.reserve(panos.size());
+  for (const auto& images : panos) {
+    auto previous =
+        std::find_if(panos_.begin(), panos_.end(), [&images](const auto& pano) {
+          return pano.images == images;
+        });
+    if (previous != panos_.end()) {
+      updated.push_back(*previous);
+    } else {
+      updated.push_back({.images = images, .changed = now});
+    }
+  }
+  panos_ = std::move(updated);
+}
+
+std::vector<int> QuietPanos::Ready(Clock::time_point now) const {
+  std::vector<int> ready;
+  for (int i = 0; i < static_cast<int>(panos_.size()); i++) {
+    const auto& pano = panos_[i];
+    if (!pano.stitched && now - pano.changed >= quiet_period_) {
+      ready.push_back(i);
+    }
+  }
+  return ready;
+}
+
+void QuietPanos::MarkStitched(int pano_id) { panos_[pano_id].stitched = true; }
+
+}  // namespace xpano::cli
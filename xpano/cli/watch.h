@@ -0,0 +1,71 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <set>
+#include <vector>
+
+namespace xpano::cli {
+
+// New images of a --watch directory, polled:
+//  - Only the supported images directly in the directory.
+//  - A file is ready once its size and modification time stayed the same
+//    between two polls, i.e. it's no longer being written.
+//  - Each file is returned once, the ignored ones never, e.g. the exports.
+class WatchedFolder {
+ public:
+  explicit WatchedFolder(std::filesystem::path dir);
+
+  // Files that became ready since the last call, sorted
+  std::vector<std::filesystem::path> Poll();
+
+  void Ignore(const std::filesystem::path& path);
+
+ private:
+  struct FileState {
+    std::uintmax_t size;
+    std::filesystem::file_time_type modified;
+    bool returned = false;
+  };
+
+  std::filesystem::path dir_;
+  std::map<std::filesystem::path, FileState> files_;
+  std::set<std::filesystem::path> ignored_;
+};
+
+// Panos of the growing --watch image set, ready to stitch once they haven't
+// changed for the quiet period. A pano is identified by its images, one that
+// gets more images is a new pano and waits for the quiet period again.
+class QuietPanos {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit QuietPanos(Clock::duration quiet_period);
+
+  // All the panos after loading new images, as the paths of their images
+  void Update(const std::vector<std::vector<std::filesystem::path>>& panos,
+              Clock::time_point now);
+
+  // Indices of the panos of the last update quiet for the period, not
+  // stitched yet
+  [[nodiscard]] std::vector<int> Ready(Clock::time_point now) const;
+
+  void MarkStitched(int pano_id);
+
+ private:
+  struct Pano {
+    std::vector<std::filesystem::path> images;
+    Clock::time_point changed;
+    bool stitched = false;
+  };
+
+  Clock::duration quiet_period_;
+  std::vector<Pano> panos_;
+};
+
+}  // namespace xpano::cli
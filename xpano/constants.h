@@ -10,9 +10,24 @@
 namespace xpano {
 
 constexpr int kNumFeatures = 3000;
+constexpr int kMinNumFeatures = 500;
+constexpr int kMaxNumFeatures = 20000;
+constexpr int kStepNumFeatures = 500;
 constexpr int kThumbnailSize = 256;
+// Thumbnails along the side of a page of the thumbnail atlas
+constexpr int kThumbnailPageSide = 16;
+// Mini panos along the side of a page of the pano atlas
+constexpr int kPanoThumbnailPageSide = 4;
+// Height of the mini panos in the pano list, in text lines
+constexpr float kPanoThumbnailRows = 3.0f;
 constexpr int kMaxTexSize = 16384;
 constexpr int kLoupeSize = 4096;
+// Shown while the preview texture is being downscaled
+constexpr int kLoupeCoarseSize = 1024;
+// Tiles of the full resolution pano, see TiledImage
+constexpr int kTileSize = 512;
+constexpr int kMaxTileTextures = 128;
+constexpr int kMaxPendingTiles = 16;
 constexpr int kMinMatchThreshold = 4;
 constexpr int kDefaultMatchThreshold = 70;
 constexpr int kMaxMatchThreshold = 250;
@@ -39,20 +54,54 @@ const std::array<std::string, 6> kSupportedExtensions = {"jpg", "jpeg", "tiff",
 const std::array<std::string, 4> kMetadataSupportedExtensions = {"jpg", "jpeg",
                                                                  "tiff", "tif"};
 
+const std::array<std::string, 2> kTiffExtensions = {"tiff", "tif"};
+
+const std::array<std::string, 2> kJpegExtensions = {"jpg", "jpeg"};
+
+const std::array<std::string, 1> kDeepZoomExtensions = {"dzi"};
+
+// Output only, encoded when built with the libraries, see utils::encoders
+const std::array<std::string, 3> kModernExtensions = {"jxl", "avif", "webp"};
+
+// Input only, decoded with cv::VideoCapture when built with videoio
+const std::array<std::string, 5> kVideoExtensions = {"mp4", "mov", "avi",
+                                                     "mkv", "m4v"};
+
+const std::array<std::string, 1> kProjectExtensions = {"xpano"};
+
 const std::string kLogFilename = "logs/xpano.log";
 constexpr int kMaxLogSize = 5 * 1024 * 1024;
 constexpr int kMaxLogFiles = 5;
+// Messages in flight to the log pane, more are dropped until it catches up
+constexpr int kLogRingCapacity = 4096;
+// Lines kept by the log pane
+constexpr int kMaxLogLines = 10000;
+// Messages queued for the asynchronous file sink, the oldest are overwritten
+constexpr int kLogQueueSize = 8192;
+constexpr int kMaxTraceEvents = 1 << 20;
+const std::string kTraceFilename = "xpano_trace.json";
 
 const char* const kCheckMark = reinterpret_cast<const char*>(u8"✓");
 const char* const kCommandSymbol = reinterpret_cast<const char*>(u8"⌘");
 
-constexpr auto kTaskCancellationTimeout = std::chrono::milliseconds(500);
-constexpr auto kCancellationTimeout = std::chrono::milliseconds(500);
+// The CLI interrupt flag is set by a signal handler, which can't notify
+constexpr auto kCancellationTimeout = std::chrono::milliseconds(50);
+// The GUI renders a few frames after the last event or pending work, then
+// sleeps until the next one. Progress bars of running tasks and the text
+// cursor are redrawn at this interval.
+constexpr int kFramesBeforeSleep = 3;
+constexpr auto kBusyFrameInterval = std::chrono::milliseconds(100);
 
 constexpr int kDefaultJpegQuality = 95;
 constexpr int kMaxJpegQuality = 100;
 constexpr int kDefaultPngCompression = 6;
 constexpr int kMaxPngCompression = 9;
+// JPEG XL, AVIF and WebP, see utils::encoders
+constexpr int kDefaultEncoderQuality = 90;
+constexpr int kMaxEncoderQuality = 100;
+constexpr int kDefaultEncoderEffort = 7;
+constexpr int kMinEncoderEffort = 1;
+constexpr int kMaxEncoderEffort = 9;
 
 constexpr int kAboutBoxWidth = 70;
 constexpr int kAboutBoxHeight = 30;
@@ -69,11 +118,53 @@ const std::string kIconPath = "assets/icon.png";
 
 constexpr int kDefaultNeighborhoodSearchSize = 2;
 constexpr int kMaxNeighborhoodSearchSize = 10;
+// Adaptive neighborhood: an image with a match of at least this many times
+// the match threshold doesn't need the further images
+constexpr int kAdaptiveStrongMatchFactor = 2;
+// Rows / columns of a capture grid, see algorithm::GridOptions
+constexpr int kMaxGridSize = 100;
+// Coarse to fine matching, see pipeline::MatchingOptions::coarse_to_fine
+constexpr int kDefaultFineLongerSide = 3072;
+constexpr int kMaxFineLongerSide = 4096;
+// Guided matching, fraction of the larger preview around the keypoint
+// predicted by the coarse homography
+constexpr float kGuidedMatchRadius = 0.01f;
+constexpr int kDefaultRetrievalCandidates = 5;
+constexpr int kMaxRetrievalCandidates = 30;
+constexpr int kRetrievalVocabularySize = 32;
+constexpr int kRetrievalMaxSamples = 50000;
+constexpr int kRetrievalDims = 128;
+
+// Bounds the memory used by the parallel compositing
+constexpr int kMaxWarpedImagesInFlight = 8;
+// OpenCV's dense bundle adjustment is fine for smaller panos
+constexpr int kSparseBundleAdjustmentMinImages = 16;
+// First stage of a progressive preview, below the registration resolution
+constexpr int kProgressivePreviewLongerSide = 256;
+// Previews composed into the mini panos of the pano list, see
+// pipeline::StitcherPipeline::RunPanoThumbnails
+constexpr int kPanoThumbnailImageSide = 128;
+// Rotated / reprojected pano shown while adjusting, see algorithm::Reproject
+constexpr int kReprojectionLongerSide = 1024;
+// Tiled export, multiple of 16 (TIFF requirement)
+constexpr int kTiledExportTileSize = 2048;
+// Deep Zoom export, kTiledExportTileSize is a multiple
+constexpr int kDeepZoomTileSize = 256;
+
+constexpr int kDefaultDuplicateHashDistance = 4;
+constexpr int kMaxDuplicateHashDistance = 16;
+
+constexpr int kDefaultMaxTimeGap = 60;       // seconds
+constexpr int kMaxTimeGap = 3600;            // seconds
+constexpr int kDefaultMaxGpsDistance = 100;  // meters
+constexpr int kMaxGpsDistance = 10000;       // meters
 
 constexpr int kDefaultPreviewLongerSide = 1024;
 constexpr int kMinPreviewLongerSide = 512;
 constexpr int kMaxPreviewLongerSide = 2048;
 constexpr int kStepPreviewLongerSide = 256;
+// Keypoint detection, independent of the preview size
+constexpr int kDefaultDetectionLongerSide = 1024;
 
 constexpr float kDefaultPaniniA = 2.0f;
 constexpr float kDefaultPaniniB = 1.0f;
@@ -84,19 +175,26 @@ constexpr float kMaxMatchConf = 0.4f;
 const std::string kAppConfigFilename = "app_config.alpaca";
 const std::string kUserConfigFilename = "user_config.alpaca";
 const std::string kChangelogFilename = "CHANGELOG.md";
+const std::string kFeatureCacheDirname = "feature_cache";
+// Compiled OpenCL kernels, see utils::opencv::UseOpenCLCache
+const std::string kOpenCLCacheDirname = "opencl_cache";
 
 constexpr int kCropEdgeTolerance = 10;
-constexpr int kAutoCropSamplingDistance = 512;
 
 constexpr double kDefaultInpaintingRadius = 3.0;
 constexpr double kMaxInpaintingRadius = 15.0;
+// Inpainted regions, see algorithm::Inpaint
+constexpr int kInpaintingTileSize = 512;
+constexpr int kInpaintingTilePadding = 32;
+constexpr int kInpaintingCoarseLongerSide = 1024;
 constexpr double kInpaintingRadiusStep = 1.0;
 constexpr float kMegapixel = 1'000'000;
 
 const std::string kDefaultPanoSuffix = "_pano";
-constexpr int kMaxImageSizeForCLI = 2048; // originally 8192 which is too slow, GUI default is 1024
+constexpr int kMaxImageSizeForCLI = 2048; // detection and preview, originally 8192 which is too slow, GUI default is 1024
 
 constexpr int kExifDefaultOrientation = 1;
+constexpr float kEmbeddedPreviewAspectTolerance = 0.01f;
 
 constexpr int kCancelAnimationFrameDuration = 128;
 
@@ -104,5 +202,68 @@ const std::string kGithubIssuesLink = "https://github.com/krupkat/xpano/issues";
 const std::string kAuthorEmail = "tomas@krupkat.cz";
 
 constexpr int kMaxPanoMpx = 100;
+// Full resolution stitches refine the seams up to this resolution per image,
+// see Stitcher::SetSeamRefinementResol
+constexpr double kSeamRefinementMpx = 1.0;
+
+constexpr int kLoadingIoThreads = 4;
+// The pipeline tasks wait for each other, see --threads
+constexpr int kMinThreads = 2;
+// Background stitching of the neighbouring panos, see RunSpeculativeStitching
+constexpr int kSpeculativeThreads = 2;
+// Exports running at the same time, the rest waits in the export queue
+constexpr int kDefaultConcurrentExports = 2;
+// --all-panos: worker threads per pano stitched at the same time
+constexpr int kBatchThreadsPerPano = 4;
+// --all-panos: rough peak memory per full resolution input pixel before the
+// cameras are known, the inputs + warped images + blender + pano of
+// Stitcher::EstimateComposeMemory for a pano as large as its inputs
+constexpr int kBatchBytesPerInputPixel = 40;
+// --jobs: loaded jobs with panos waiting to stitch, the next job loads only
+// while there are fewer
+constexpr int kMaxWaitingJobs = 2;
+// Stitched previews kept across pano switches, see StitchingResultCache
+constexpr int kDefaultPreviewCacheMB = 256;
+// Compressed image previews decoded on demand, see Image::CompressPreview
+constexpr int kDefaultDecodedPreviewCacheMB = 512;
+constexpr int kCompressedPreviewQuality = 90;
+constexpr int kLoadingImagesInFlightPerThread = 2;
+
+constexpr int kMegabyte = 1024 * 1024;
+constexpr int kDefaultFullResCacheMB = 2048;
+// Warped images fed to multiblend kept in memory before spilling to disk, see
+// StitcherPipelineOptions::spill_dir
+constexpr int kDefaultSpillThresholdMB = 4096;
+// Shares of the memory budget of the caches and of the images waiting for
+// multiblend, the rest is left for compositing, see FitToMemoryBudget
+constexpr int kFullResCacheBudgetDivisor = 4;
+constexpr int kPreviewCacheBudgetDivisor = 16;
+constexpr int kDecodedPreviewBudgetDivisor = 16;
+constexpr int kSpillBudgetDivisor = 4;
+
+// --watch: a pano is stitched once no image was added to it for this long
+constexpr int kDefaultWatchQuietSeconds = 10;
+constexpr auto kWatchPollInterval = std::chrono::seconds(1);
+
+// Side of the synthetic images stitched at startup, see algorithm::WarmUp
+constexpr int kWarmUpImageSize = 256;
+
+// Video input: a frame becomes a keyframe once its estimated overlap with the
+// previous keyframe drops below this, see algorithm::video::KeyframeSelector
+constexpr float kDefaultKeyframeOverlap = 0.6f;
+constexpr int kKeyframeTrackingSize = 480;
+constexpr int kKeyframeTrackingFeatures = 500;
+constexpr int kMinKeyframeInliers = 20;
+
+// Lens profiles: remap tables kept for the distinct profile and image size
+// pairs, see algorithm::lens::Undistort
+constexpr int kLensMapCacheSize = 8;
+constexpr float kMaxLensCoefficient = 1.0f;
+
+// --shard: how often the shards check for each other's results
+constexpr auto kShardPollInterval = std::chrono::seconds(2);
+// The first shard gives up once none of the others published anything for
+// this long, e.g. after one of them crashed
+constexpr auto kShardStallTimeout = std::chrono::minutes(30);
 
 }  // namespace xpano
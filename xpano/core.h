@@ -0,0 +1,35 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+// Entry point of the xpano_core library, headless stitching for embedding,
+// e.g. in a service. A long lived Pipeline keeps its thread pool, caches and
+// cameras across jobs:
+//
+//   xpano::Pipeline pipeline({.pool = xpano::utils::mt::SharedPool()});
+//   auto data = pipeline.RunLoading(paths, {}, {}).future.get();
+//   auto result =
+//       pipeline.RunStitching(data, {.pano_id = 0, .full_res = true,
+//                                    .export_path = "pano.jpg"})
+//           .future.get();
+//
+// The types reachable from this header are the supported API, kApiVersion is
+// bumped whenever they change incompatibly. There is no stable ABI, build
+// against the same sources as the library.
+
+#include "xpano/algorithm/algorithm.h"  // IWYU pragma: export
+#include "xpano/algorithm/progress.h"  // IWYU pragma: export
+#include "xpano/pipeline/options.h"  // IWYU pragma: export
+#include "xpano/pipeline/resources.h"  // IWYU pragma: export
+#include "xpano/pipeline/stitcher_pipeline.h"  // IWYU pragma: export
+#include "xpano/utils/parallel_for.h"  // IWYU pragma: export
+#include "xpano/version.h"  // IWYU pragma: export
+
+namespace xpano {
+
+constexpr int kApiVersion = 1;
+
+using Pipeline = pipeline::StitcherPipeline<pipeline::RunTraits::kReturnFuture>;
+
+}  // namespace xpano
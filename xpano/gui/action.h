@@ -19,6 +19,8 @@ namespace xpano::gui {
 
 enum class ActionType : std::uint8_t {
   kNone,
+  kAddFiles,
+  kAppendFiles,
   kCancelPipeline,
   kToggleCrop,
   kToggleRotate,
@@ -29,6 +31,7 @@ enum class ActionType : std::uint8_t {
   kLoadFiles,
   kOpenDirectory,
   kOpenFiles,
+  kOpenProject,
   kShowAbout,
   kShowBugReport,
   kShowImage,
@@ -37,13 +40,16 @@ enum class ActionType : std::uint8_t {
   kModifyPano,
   kRecomputePano,
   kRecomputePanoFullRes,
+  kRegroupPanos,
   kQuit,
   kToggleDebugLog,
+  kTogglePerfPane,
   kWarnInputConversion,
   kResetOptions,
   kResetRotation,
   kResetCrop,
   kSaveCrop,
+  kSaveProject,
   kRecrop
 };
 
@@ -31,8 +31,15 @@ class Base {
  public:
   virtual ~Base() = default;
   virtual Texture CreateTexture(utils::Vec2i size) = 0;
+  // For textures updated often, e.g. the preview
+  virtual Texture CreateStreamingTexture(utils::Vec2i size) = 0;
   virtual void UpdateTexture(ImTextureID tex, cv::Mat image) = 0;
+  // Updates only the part of the texture starting at offset
+  virtual void UpdateTextureRegion(ImTextureID tex, utils::Point2i offset,
+                                   cv::Mat image) = 0;
   virtual void DestroyTexture(ImTextureID tex) = 0;
+  // Thread safe, makes the main loop render the next frame if it is sleeping
+  virtual void WakeUp() = 0;
 };
 
 }  // namespace xpano::gui::backends
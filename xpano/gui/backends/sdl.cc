@@ -3,18 +3,38 @@
 
 #include "xpano/gui/backends/sdl.h"
 
+#include <cstdint>
+#include <utility>
+
 #include <imgui.h>
 #include <opencv2/core.hpp>
 #include <SDL.h>
 #include <spdlog/spdlog.h>
 
 #include "xpano/gui/backends/base.h"
+#include "xpano/utils/memory.h"
 #include "xpano/utils/vec.h"
 #include "xpano/utils/vec_converters.h"
 
 namespace xpano::gui::backends {
 
-Sdl::Sdl(SDL_Renderer *renderer) : renderer_(renderer) {
+namespace {
+
+// SDL_PIXELFORMAT_BGR24
+constexpr int kTextureBytesPerPixel = 3;
+
+std::int64_t TextureBytes(int width, int height) {
+  return std::int64_t{width} * height * kTextureBytesPerPixel;
+}
+
+}  // namespace
+
+Sdl::Sdl(SDL_Renderer *renderer)
+    : renderer_(renderer), wake_up_event_(SDL_RegisterEvents(1)) {
+  if (wake_up_event_ == static_cast<Uint32>(-1)) {
+    spdlog::warn("Failed to register the wake up event: {}", SDL_GetError());
+    wake_up_event_ = SDL_USEREVENT;
+  }
   if (SDL_GetRendererInfo(renderer, &info_) == 0) {
     spdlog::info("Current SDL_Renderer: {}", info_.name);
     spdlog::info("Max tex width: {}", info_.max_texture_width);
@@ -25,14 +45,22 @@ Sdl::Sdl(SDL_Renderer *renderer) : renderer_(renderer) {
 }
 
 Texture Sdl::CreateTexture(utils::Vec2i size) {
+  return CreateTexture(size, SDL_TEXTUREACCESS_STATIC);
+}
+
+Texture Sdl::CreateStreamingTexture(utils::Vec2i size) {
+  return CreateTexture(size, SDL_TEXTUREACCESS_STREAMING);
+}
+
+Texture Sdl::CreateTexture(utils::Vec2i size, SDL_TextureAccess access) {
   if (size[0] > info_.max_texture_width || size[1] > info_.max_texture_height) {
     spdlog::error("Texture size {} x {} is too big.", size[0], size[1]);
     return nullptr;
   }
   const char *old_texture_sampling = SDL_GetHint(SDL_HINT_RENDER_SCALE_QUALITY);
   SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "best");
-  auto *sdl_tex = SDL_CreateTexture(renderer_, SDL_PIXELFORMAT_BGR24,
-                                    SDL_TEXTUREACCESS_STATIC, size[0], size[1]);
+  auto *sdl_tex = SDL_CreateTexture(renderer_, SDL_PIXELFORMAT_BGR24, access,
+                                    size[0], size[1]);
   if (old_texture_sampling != nullptr) {
     SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, old_texture_sampling);
   }
@@ -40,12 +68,34 @@ Texture Sdl::CreateTexture(utils::Vec2i size) {
     spdlog::error("Failed to create SDL_Texture: {}", SDL_GetError());
     return nullptr;
   }
+  utils::memory::Add(utils::memory::Category::kTextures,
+                     TextureBytes(size[0], size[1]));
   return {static_cast<ImTextureID>(sdl_tex), TexDeleter{this}};
 }
 
 void Sdl::UpdateTexture(ImTextureID tex, cv::Mat image) {
-  auto target = utils::SdlRect(utils::Point2i{0}, utils::ToIntVec(image.size));
+  UpdateTextureRegion(tex, utils::Point2i{0}, std::move(image));
+}
+
+void Sdl::UpdateTextureRegion(ImTextureID tex, utils::Point2i offset,
+                              cv::Mat image) {
+  auto target = utils::SdlRect(offset, utils::ToIntVec(image.size));
   auto *sdl_tex = static_cast<SDL_Texture *>(tex);
+  int access = SDL_TEXTUREACCESS_STATIC;
+  SDL_QueryTexture(sdl_tex, nullptr, &access, nullptr, nullptr);
+  if (access == SDL_TEXTUREACCESS_STREAMING) {
+    // Writes straight into the texture memory, without a staging copy
+    void *pixels = nullptr;
+    int pitch = 0;
+    if (SDL_LockTexture(sdl_tex, &target, &pixels, &pitch) != 0) {
+      spdlog::error("Failed to lock SDL_Texture: {}", SDL_GetError());
+      return;
+    }
+    cv::Mat locked(image.rows, image.cols, image.type(), pixels, pitch);
+    image.copyTo(locked);
+    SDL_UnlockTexture(sdl_tex);
+    return;
+  }
   if (SDL_UpdateTexture(sdl_tex, &target, image.data,
                         static_cast<int>(image.step1())) != 0) {
     spdlog::error("Failed to update SDL_Texture: {}", SDL_GetError());
@@ -53,7 +103,22 @@ void Sdl::UpdateTexture(ImTextureID tex, cv::Mat image) {
 }
 
 void Sdl::DestroyTexture(ImTextureID tex) {
-  SDL_DestroyTexture(static_cast<SDL_Texture *>(tex));
+  auto *sdl_tex = static_cast<SDL_Texture *>(tex);
+  int width = 0;
+  int height = 0;
+  if (SDL_QueryTexture(sdl_tex, nullptr, nullptr, &width, &height) == 0) {
+    utils::memory::Add(utils::memory::Category::kTextures,
+                       -TextureBytes(width, height));
+  }
+  SDL_DestroyTexture(sdl_tex);
+}
+
+void Sdl::WakeUp() {
+  SDL_Event event = {};
+  event.type = wake_up_event_;
+  if (SDL_PushEvent(&event) < 0) {
+    spdlog::warn("Failed to push the wake up event: {}", SDL_GetError());
+  }
 }
 
 }  // namespace xpano::gui::backends
@@ -17,12 +17,20 @@ class Sdl final : public Base {
   explicit Sdl(SDL_Renderer* renderer);
 
   Texture CreateTexture(utils::Vec2i size) override;
+  Texture CreateStreamingTexture(utils::Vec2i size) override;
   void UpdateTexture(ImTextureID tex, cv::Mat image) override;
+  void UpdateTextureRegion(ImTextureID tex, utils::Point2i offset,
+                           cv::Mat image) override;
   void DestroyTexture(ImTextureID tex) override;
+  // Pushes an event of its own type into the SDL event queue
+  void WakeUp() override;
 
  private:
+  Texture CreateTexture(utils::Vec2i size, SDL_TextureAccess access);
+
   SDL_Renderer* renderer_;
   SDL_RendererInfo info_;
+  Uint32 wake_up_event_;
 };
 
 }  // namespace xpano::gui::backends
@@ -16,6 +16,7 @@
 
 #include "xpano/constants.h"
 #include "xpano/gui/action.h"
+#include "xpano/utils/encoders.h"
 #include "xpano/utils/expected.h"
 #include "xpano/utils/fmt.h"
 #include "xpano/utils/path.h"
@@ -48,12 +49,18 @@ utils::Expected<std::vector<std::filesystem::path>, Error> MultifileOpen() {
   NFD::UniquePathSet out_paths;
 
   auto extensions = fmt::format("{}", fmt::join(kSupportedExtensions, ","));
+  auto video_extensions = fmt::format("{}", fmt::join(kVideoExtensions, ","));
 #ifndef _WIN32
   extensions = fmt::format("{},{}", extensions,
                            fmt::join(Uppercase(kSupportedExtensions), ","));
+  video_extensions =
+      fmt::format("{},{}", video_extensions,
+                  fmt::join(Uppercase(kVideoExtensions), ","));
 #endif
-  auto filter_item = std::array{nfdfilteritem_t{"Images", extensions.c_str()}};
-  auto nfd_result = NFD::OpenDialogMultiple(out_paths, filter_item.data(), 1);
+  auto filter_items =
+      std::array{nfdfilteritem_t{"Images", extensions.c_str()},
+                 nfdfilteritem_t{"Videos", video_extensions.c_str()}};
+  auto nfd_result = NFD::OpenDialogMultiple(out_paths, filter_items.data(), 2);
 
   if (nfd_result == NFD_CANCEL) {
     return MakeUnexpected(ErrorType::kUserCancelled);
@@ -94,19 +101,15 @@ utils::Expected<std::vector<std::filesystem::path>, Error> DirectoryOpen() {
   }
   spdlog::info("Selected directory {}", dir_path.string());
 
-  std::vector<std::filesystem::path> results;
-  for (const auto& file : std::filesystem::directory_iterator(dir_path)) {
-    results.emplace_back(file.path());
-  }
-  std::sort(results.begin(), results.end());
-  return results;
+  return utils::path::ListSupported(dir_path);
 }
 
 }  // namespace
 
 utils::Expected<std::vector<std::filesystem::path>, Error> Open(
     const Action& action) {
-  if (action.type == ActionType::kOpenFiles) {
+  if (action.type == ActionType::kOpenFiles ||
+      action.type == ActionType::kAddFiles) {
     return MultifileOpen().map(utils::path::KeepSupported);
   }
 
@@ -121,9 +124,27 @@ utils::Expected<std::filesystem::path, Error> Save(
     const std::string& default_name) {
   NFD::UniquePath out_path;
   auto extensions = fmt::format("{}", fmt::join(kSupportedExtensions, ","));
-  auto filter_item = std::array{nfdfilteritem_t{"Images", extensions.c_str()}};
-  auto nfd_result = NFD::SaveDialog(out_path, filter_item.data(), 1, nullptr,
-                                    default_name.c_str());
+  auto deep_zoom_extensions =
+      fmt::format("{}", fmt::join(kDeepZoomExtensions, ","));
+  std::vector<std::string> enabled_modern;
+  for (const auto& extension : kModernExtensions) {
+    const auto format = utils::encoders::FormatOf("." + extension);
+    if (format && utils::encoders::Enabled(*format)) {
+      enabled_modern.push_back(extension);
+    }
+  }
+  auto modern_extensions = fmt::format("{}", fmt::join(enabled_modern, ","));
+  auto filter_items =
+      std::vector{nfdfilteritem_t{"Images", extensions.c_str()},
+                  nfdfilteritem_t{"Deep Zoom", deep_zoom_extensions.c_str()}};
+  if (!enabled_modern.empty()) {
+    filter_items.push_back(
+        nfdfilteritem_t{"JPEG XL / AVIF / WebP", modern_extensions.c_str()});
+  }
+  auto nfd_result = NFD::SaveDialog(
+      out_path, filter_items.data(),
+      static_cast<nfdfiltersize_t>(filter_items.size()), nullptr,
+      default_name.c_str());
 
   if (nfd_result == NFD_CANCEL) {
     return MakeUnexpected(ErrorType::kUserCancelled);
@@ -134,11 +155,61 @@ utils::Expected<std::filesystem::path, Error> Save(
 
   auto result_path = std::filesystem::path(out_path.get());
   spdlog::info("Picked save file {}", result_path.string());
-  if (!utils::path::IsExtensionSupported(result_path)) {
+  if (!utils::path::IsExtensionSupported(result_path) &&
+      !utils::path::IsDeepZoom(result_path) &&
+      !utils::path::IsModernFormat(result_path)) {
+    return MakeUnexpected(ErrorType::kUnsupportedExtension,
+                          result_path.filename().string());
+  }
+
+  return result_path;
+}
+
+utils::Expected<std::filesystem::path, Error> OpenProject() {
+  NFD::UniquePath out_path;
+  auto extensions = fmt::format("{}", fmt::join(kProjectExtensions, ","));
+  auto filter_item =
+      std::array{nfdfilteritem_t{"Xpano project", extensions.c_str()}};
+  auto nfd_result = NFD::OpenDialog(out_path, filter_item.data(), 1);
+
+  if (nfd_result == NFD_CANCEL) {
+    return MakeUnexpected(ErrorType::kUserCancelled);
+  }
+  if (nfd_result == NFD_ERROR) {
+    return MakeUnexpected(ErrorType::kUnknownError, NFD::GetError());
+  }
+
+  auto result_path = std::filesystem::path(out_path.get());
+  spdlog::info("Picked project file {}", result_path.string());
+  if (!utils::path::IsProject(result_path)) {
     return MakeUnexpected(ErrorType::kUnsupportedExtension,
                           result_path.filename().string());
   }
+  return result_path;
+}
 
+utils::Expected<std::filesystem::path, Error> SaveProject(
+    const std::string& default_name) {
+  NFD::UniquePath out_path;
+  auto extensions = fmt::format("{}", fmt::join(kProjectExtensions, ","));
+  auto filter_item =
+      std::array{nfdfilteritem_t{"Xpano project", extensions.c_str()}};
+  auto nfd_result = NFD::SaveDialog(out_path, filter_item.data(), 1, nullptr,
+                                    default_name.c_str());
+
+  if (nfd_result == NFD_CANCEL) {
+    return MakeUnexpected(ErrorType::kUserCancelled);
+  }
+  if (nfd_result == NFD_ERROR) {
+    return MakeUnexpected(ErrorType::kUnknownError, NFD::GetError());
+  }
+
+  auto result_path = std::filesystem::path(out_path.get());
+  spdlog::info("Picked project save file {}", result_path.string());
+  if (!utils::path::IsProject(result_path)) {
+    return MakeUnexpected(ErrorType::kUnsupportedExtension,
+                          result_path.filename().string());
+  }
   return result_path;
 }
 
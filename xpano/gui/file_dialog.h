@@ -33,6 +33,11 @@ utils::Expected<std::vector<std::filesystem::path>, Error> Open(
 utils::Expected<std::filesystem::path, Error> Save(
     const std::string& default_name);
 
+utils::Expected<std::filesystem::path, Error> OpenProject();
+
+utils::Expected<std::filesystem::path, Error> SaveProject(
+    const std::string& default_name);
+
 }  // namespace xpano::gui::file_dialog
 
 template <>
@@ -5,6 +5,7 @@
 #include "xpano/gui/panels/about.h"
 
 #include <algorithm>
+#include <functional>
 #include <future>
 #include <iterator>
 #include <optional>
@@ -63,12 +64,18 @@ utils::Text DefaultNotice() {
 }
 }  // namespace
 
-AboutPane::AboutPane(std::future<utils::Texts> licenses)
-    : licenses_future_(std::move(licenses)), licenses_{DefaultNotice()} {}
+AboutPane::AboutPane(std::function<utils::Texts()> load_licenses)
+    : load_licenses_(std::move(load_licenses)), licenses_{DefaultNotice()} {}
 
-void AboutPane::Show() { show_ = true; }
+void AboutPane::Show() {
+  show_ = true;
+  StartLicenseLoading();
+}
+
+bool AboutPane::IsLoading() const { return show_ && licenses_future_.valid(); }
 
 std::optional<utils::Text> AboutPane::GetText(const std::string& name) {
+  StartLicenseLoading();
   if (licenses_future_.valid()) {
     WaitForLicenseLoading();
   }
@@ -81,6 +88,14 @@ std::optional<utils::Text> AboutPane::GetText(const std::string& name) {
   return *result;
 }
 
+void AboutPane::StartLicenseLoading() {
+  if (!load_licenses_) {
+    return;
+  }
+  licenses_future_ = std::async(std::launch::async, load_licenses_);
+  load_licenses_ = nullptr;
+}
+
 void AboutPane::WaitForLicenseLoading() {
   auto temp_licenses = licenses_future_.get();
   std::copy(temp_licenses.begin(), temp_licenses.end(),
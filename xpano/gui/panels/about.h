@@ -4,6 +4,7 @@
 
 #pragma once
 
+#include <functional>
 #include <future>
 #include <optional>
 #include <string>
@@ -14,17 +15,22 @@ namespace xpano::gui {
 
 class AboutPane {
  public:
-  explicit AboutPane(std::future<utils::Texts> licenses);
+  // The licenses are loaded in the background once the pane is first shown
+  explicit AboutPane(std::function<utils::Texts()> load_licenses);
   void Draw();
   void Show();
+  // Shown before the licenses were loaded, see Draw
+  [[nodiscard]] bool IsLoading() const;
 
   std::optional<utils::Text> GetText(const std::string& name);
 
  private:
+  void StartLicenseLoading();
   void WaitForLicenseLoading();
 
   bool show_ = false;
   int current_license_ = 0;
+  std::function<utils::Texts()> load_licenses_;
   std::future<utils::Texts> licenses_future_;
   utils::Texts licenses_;
 };
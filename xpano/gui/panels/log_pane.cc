@@ -3,9 +3,14 @@
 
 #include "xpano/gui/panels/log_pane.h"
 
+#include <filesystem>
+
 #include <imgui.h>
+#include <spdlog/spdlog.h>
 
+#include "xpano/constants.h"
 #include "xpano/log/logger.h"
+#include "xpano/utils/trace.h"
 
 namespace xpano::gui {
 
@@ -17,10 +22,17 @@ void LogPane::Draw() {
   }
 
   ImGui::Begin("Logger");
+  DrawTraceControls();
+  ImGui::Separator();
   const auto &log = logger_->Log();
   ImGui::PushStyleVar(ImGuiStyleVar_ItemSpacing, ImVec2(0, 0));
-  for (const auto &line : log) {
-    ImGui::TextUnformatted(line.c_str());
+  // Only the visible lines
+  ImGuiListClipper clipper;
+  clipper.Begin(static_cast<int>(log.size()));
+  while (clipper.Step()) {
+    for (int i = clipper.DisplayStart; i < clipper.DisplayEnd; i++) {
+      ImGui::TextUnformatted(log[i].c_str());
+    }
   }
   ImGui::PopStyleVar();
   if (ImGui::GetScrollY() >= ImGui::GetScrollMaxY()) {
@@ -29,6 +41,25 @@ void LogPane::Draw() {
   ImGui::End();
 }
 
+void LogPane::DrawTraceControls() {
+  if (!utils::trace::IsRecording()) {
+    if (ImGui::SmallButton("Record trace")) {
+      utils::trace::Start();
+    }
+    return;
+  }
+  if (ImGui::SmallButton("Save trace")) {
+    utils::trace::Stop();
+    if (auto log_dir = logger_->GetLogDirPath(); log_dir) {
+      utils::trace::Write(std::filesystem::path(*log_dir) / kTraceFilename);
+    } else {
+      spdlog::warn("No log directory to save the trace to");
+    }
+  }
+  ImGui::SameLine();
+  ImGui::Text("%d events", utils::trace::NumEvents());
+}
+
 void LogPane::ToggleShow() { show_ = !show_; }
 
 bool LogPane::IsShown() const { return show_; }
@@ -13,6 +13,8 @@ class LogPane {
   [[nodiscard]] bool IsShown() const;
 
  private:
+  void DrawTraceControls();
+
   logger::Logger* logger_;
   bool show_ = false;
 };
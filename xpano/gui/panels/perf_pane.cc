@@ -0,0 +1,208 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/gui/panels/perf_pane.h"
+
+#include <cstdint>
+
+#include <imgui.h>
+
+#include "xpano/constants.h"
+#include "xpano/pipeline/stitcher_pipeline.h"
+#include "xpano/utils/imgui_.h"
+#include "xpano/utils/memory.h"
+#include "xpano/utils/process.h"
+#include "xpano/utils/trace.h"
+
+namespace xpano::gui {
+
+namespace {
+
+constexpr double kUsPerMs = 1000.0;
+
+double ToMb(std::int64_t bytes) {
+  return static_cast<double>(bytes) / kMegabyte;
+}
+
+double ToMs(std::int64_t time_us) {
+  return static_cast<double>(time_us) / kUsPerMs;
+}
+
+void DrawHitRate(const char* name, int hits, int misses) {
+  const int total = hits + misses;
+  if (total == 0) {
+    ImGui::Text("%s: no lookups", name);
+    return;
+  }
+  ImGui::Text("%s: %.0f%% of %d lookups", name, 100.0 * hits / total, total);
+}
+
+}  // namespace
+
+PerfPane::PerfPane(pipeline::StitcherPipeline<>* pipeline)
+    : pipeline_(pipeline) {}
+
+void PerfPane::ToggleShow() {
+  show_ = !show_;
+  if (show_) {
+    StartTrace();
+  } else {
+    StopTrace();
+  }
+}
+
+void PerfPane::StartTrace() {
+  if (!utils::trace::IsRecording()) {
+    utils::trace::Start();
+    owns_trace_ = true;
+  }
+}
+
+void PerfPane::StopTrace() {
+  if (owns_trace_) {
+    utils::trace::Stop();
+    owns_trace_ = false;
+  }
+}
+
+void PerfPane::Draw() {
+  // Closed by the window button
+  if (!show_) {
+    StopTrace();
+    return;
+  }
+
+  const bool busy = !pipeline_->IsIdle();
+  if (busy && !busy_) {
+    task_start_us_ = utils::trace::NowUs();
+  }
+  busy_ = busy;
+
+  ImGui::SetNextWindowSize(utils::imgui::DpiAwareSize(420, 520),
+                           ImGuiCond_FirstUseEver);
+  ImGui::Begin("Performance", &show_, ImGuiWindowFlags_NoDocking);
+  DrawStages();
+  DrawPools();
+  DrawCaches();
+  DrawMemory();
+  ImGui::End();
+}
+
+void PerfPane::DrawStages() {
+  ImGui::SeparatorText("Stages of the last task");
+  if (!utils::trace::IsRecording()) {
+    ImGui::TextDisabled("Not recording, reopen the pane to restart");
+  }
+  const auto stages = utils::trace::Totals(task_start_us_);
+  if (stages.empty()) {
+    ImGui::TextDisabled("No spans yet");
+    return;
+  }
+  const ImGuiTableFlags flags =
+      ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingStretchProp;
+  if (ImGui::BeginTable("stages", 5, flags)) {
+    ImGui::TableSetupColumn("Stage");
+    ImGui::TableSetupColumn("Spans");
+    ImGui::TableSetupColumn("Wall ms");
+    ImGui::TableSetupColumn("CPU ms");
+    ImGui::TableSetupColumn("CPU / wall");
+    ImGui::TableHeadersRow();
+    for (const auto& stage : stages) {
+      ImGui::TableNextRow();
+      ImGui::TableNextColumn();
+      ImGui::TextUnformatted(stage.name);
+      ImGui::TableNextColumn();
+      ImGui::Text("%d", stage.count);
+      ImGui::TableNextColumn();
+      ImGui::Text("%.1f", ToMs(stage.wall_us));
+      ImGui::TableNextColumn();
+      ImGui::Text("%.1f", ToMs(stage.cpu_us));
+      ImGui::TableNextColumn();
+      if (stage.wall_us > 0) {
+        ImGui::Text("%.1f", static_cast<double>(stage.cpu_us) /
+                                static_cast<double>(stage.wall_us));
+      }
+    }
+    ImGui::EndTable();
+  }
+  ImGui::TextDisabled(
+      "CPU / wall is the number of threads kept busy by the stage, low\n"
+      "values with the pool threads running point at I/O or memory stalls");
+}
+
+void PerfPane::DrawPools() {
+  ImGui::SeparatorText("Thread pools");
+  const ImGuiTableFlags flags =
+      ImGuiTableFlags_RowBg | ImGuiTableFlags_SizingStretchProp;
+  if (!ImGui::BeginTable("pools", 5, flags)) {
+    return;
+  }
+  ImGui::TableSetupColumn("Pool");
+  ImGui::TableSetupColumn("Threads");
+  ImGui::TableSetupColumn("Running");
+  ImGui::TableSetupColumn("Queued");
+  ImGui::TableSetupColumn("Busy");
+  ImGui::TableHeadersRow();
+  for (const auto& pool : pipeline_->GetPoolStats()) {
+    ImGui::TableNextRow();
+    ImGui::TableNextColumn();
+    ImGui::TextUnformatted(pool.name);
+    ImGui::TableNextColumn();
+    ImGui::Text("%d", pool.threads);
+    ImGui::TableNextColumn();
+    ImGui::Text("%d", pool.running);
+    ImGui::TableNextColumn();
+    ImGui::Text("%d", pool.queued);
+    ImGui::TableNextColumn();
+    if (pool.threads > 0) {
+      ImGui::Text("%.0f%%", 100.0 * pool.running / pool.threads);
+    }
+  }
+  ImGui::EndTable();
+}
+
+void PerfPane::DrawCaches() {
+  ImGui::SeparatorText("Caches");
+  if (auto features = pipeline_->GetFeatureCacheStats(); features) {
+    DrawHitRate("Features", features->hits, features->misses);
+  } else {
+    ImGui::TextDisabled("Features: no cache directory");
+  }
+  const auto full_res = pipeline_->GetFullResCacheStats();
+  DrawHitRate("Full resolution", full_res.hits + full_res.mapped_hits,
+              full_res.misses);
+  ImGui::SameLine();
+  ImGui::TextDisabled("(%.0f MB, %d mapped)",
+                      ToMb(static_cast<std::int64_t>(full_res.bytes_used)),
+                      full_res.mapped_hits);
+  const auto previews = pipeline_->GetPreviewCacheStats();
+  DrawHitRate("Previews", previews.hits, previews.misses);
+  ImGui::SameLine();
+  ImGui::TextDisabled("(%.0f MB)",
+                      ToMb(static_cast<std::int64_t>(previews.bytes_used)));
+}
+
+void PerfPane::DrawMemory() {
+  ImGui::SeparatorText("Memory");
+  const auto rss = utils::process::CurrentRssBytes();
+  const auto peak_rss = utils::process::PeakRssBytes();
+  ImGui::Text("Process: %.0f MB, peak %.0f MB", ToMb(rss.value_or(0)),
+              ToMb(peak_rss.value_or(0)));
+  for (const auto& usage : utils::memory::Snapshot()) {
+    ImGui::Text("%s: %.1f MB, peak %.1f MB",
+                utils::memory::Label(usage.category), ToMb(usage.bytes),
+                ToMb(usage.peak_bytes));
+  }
+  if (auto opencl = utils::memory::OpenClReservedBytes(); opencl) {
+    ImGui::Text("OpenCL buffer pools: %.1f MB", ToMb(*opencl));
+    const auto transfers = utils::memory::Transfers();
+    ImGui::Text("OpenCL uploads: %lld, %.1f MB",
+                static_cast<long long>(transfers.uploads),
+                ToMb(transfers.upload_bytes));
+    ImGui::Text("OpenCL downloads: %lld, %.1f MB",
+                static_cast<long long>(transfers.downloads),
+                ToMb(transfers.download_bytes));
+  }
+}
+
+}  // namespace xpano::gui
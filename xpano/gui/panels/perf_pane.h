@@ -0,0 +1,39 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+
+#include "xpano/pipeline/stitcher_pipeline.h"
+
+namespace xpano::gui {
+
+// Live view of where the time and memory of the current task go:
+//  - Stage timings of the spans since the pipeline got busy, the pane
+//    records the trace while shown unless it was already recording.
+//  - Queue depth and utilisation of the pools.
+//  - Hit rates of the feature, full resolution and preview caches.
+//  - Process RSS and the utils::memory counters.
+class PerfPane {
+ public:
+  explicit PerfPane(pipeline::StitcherPipeline<>* pipeline);
+  void Draw();
+  void ToggleShow();
+
+ private:
+  void StartTrace();
+  void StopTrace();
+  void DrawStages();
+  void DrawPools();
+  void DrawCaches();
+  void DrawMemory();
+
+  pipeline::StitcherPipeline<>* pipeline_;
+  bool show_ = false;
+  bool owns_trace_ = false;
+  bool busy_ = false;
+  std::int64_t task_start_us_ = 0;
+};
+
+}  // namespace xpano::gui
@@ -4,7 +4,11 @@
 #include "xpano/gui/panels/preview_pane.h"
 
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <exception>
+#include <future>
+#include <memory>
 #include <numeric>
 #include <optional>
 #include <string>
@@ -17,6 +21,8 @@
 #include <spdlog/spdlog.h>
 
 #include "xpano/algorithm/algorithm.h"
+#include "xpano/algorithm/options.h"
+#include "xpano/algorithm/reproject.h"
 #include "xpano/constants.h"
 #include "xpano/gui/action.h"
 #include "xpano/gui/backends/base.h"
@@ -24,6 +30,7 @@
 #include "xpano/gui/widgets/rotate.h"
 #include "xpano/gui/widgets/widgets.h"
 #include "xpano/utils/fmt.h"
+#include "xpano/utils/future.h"
 #include "xpano/utils/opencv.h"
 #include "xpano/utils/rect.h"
 #include "xpano/utils/vec.h"
@@ -130,7 +137,8 @@ void Overlay(const widgets::RotationWidget& widget, const utils::RectPVf& image,
 
 }  // namespace
 
-PreviewPane::PreviewPane(backends::Base* backend) : backend_(backend) {
+PreviewPane::PreviewPane(backends::Base* backend)
+    : backend_(backend), tiles_(backend) {
   std::iota(zoom_levels_.begin(), zoom_levels_.end(), -1.0f);
   std::transform(zoom_levels_.begin(), zoom_levels_.end(), zoom_levels_.begin(),
                  [](float exp) { return std::pow(kZoomFactor, exp); });
@@ -140,6 +148,10 @@ float PreviewPane::Zoom() const { return zoom_; }
 
 bool PreviewPane::IsZoomed() const { return zoom_id_ != 1; }
 
+bool PreviewPane::IsAnimating() const {
+  return zoom_ != zoom_levels_[zoom_id_];
+}
+
 void PreviewPane::ZoomIn() {
   if (crop_mode_ != CropMode::kEnabled && zoom_id_ < kZoomLevels - 1) {
     zoom_id_++;
@@ -174,35 +186,103 @@ void PreviewPane::Load(cv::Mat image, ImageType image_type) {
   Reload(std::move(image), image_type);
 }
 
-void PreviewPane::Reload(cv::Mat image, ImageType image_type) {
+void PreviewPane::Reload(cv::Mat image, ImageType image_type,
+                         const std::optional<cv::Mat>& display) {
+  UpdateTexture(display ? *display : image);
+
+  image_type_ = image_type;
+  if (image_type == ImageType::kPanoFullRes) {
+    full_resolution_pano_ = image;
+    tiles_.Load(image);
+  } else {
+    tiles_.Reset();
+  }
+}
+
+void PreviewPane::UpdateTexture(const cv::Mat& image) {
   auto texture_size = utils::Vec2i{kLoupeSize};
   if (!tex_) {
-    tex_ = backend_->CreateTexture(texture_size);
+    tex_ = backend_->CreateStreamingTexture(texture_size);
   }
+  CancelPendingLevels();
 
   const int larger_dim = image.size[0] > image.size[1] ? 0 : 1;
+  if (image.size[larger_dim] <= kLoupeSize) {
+    UploadLevel({image, utils::ToIntVec(image.size) / texture_size});
+    return;
+  }
+
+  // Downscaling a large pano takes a while, the coarse level only samples it
+  pending_cancelled_ = std::make_shared<std::atomic_bool>(false);
+  QueueLevel(image, static_cast<float>(kLoupeCoarseSize) / kLoupeSize,
+             cv::INTER_LINEAR);
+  QueueLevel(image, 1.0f, cv::INTER_AREA);
+}
 
-  cv::Mat resized;
+void PreviewPane::QueueLevel(const cv::Mat& image, float scale,
+                             int interpolation) {
+  auto texture_size = utils::Vec2i{kLoupeSize};
   utils::Ratio2f coord_uv;
-  if (image.size[larger_dim] > kLoupeSize) {
-    if (const float aspect = utils::ToIntVec(image.size).Aspect();
-        aspect >= 1.0f) {
-      coord_uv = {1.0f, 1.0f / aspect};
-    } else {
-      coord_uv = {1.0f * aspect, 1.0f};
-    }
-    auto size = utils::ToIntVec(texture_size * coord_uv);
-    cv::resize(image, resized, utils::CvSize(size), 0, 0, cv::INTER_AREA);
+  if (const float aspect = utils::ToIntVec(image.size).Aspect();
+      aspect >= 1.0f) {
+    coord_uv = {scale, scale / aspect};
   } else {
-    resized = image;
-    coord_uv = utils::ToIntVec(image.size) / texture_size;
+    coord_uv = {scale * aspect, scale};
   }
-  backend_->UpdateTexture(tex_.get(), resized);
-  tex_coord_ = coord_uv;
+  auto size = utils::CvSize(utils::ToIntVec(texture_size * coord_uv));
+
+  auto promise = std::make_shared<std::promise<TextureLevel>>();
+  pending_levels_.push_back(promise->get_future());
+  worker_.push_task([image, size, coord_uv, interpolation, promise,
+                     cancelled = pending_cancelled_, backend = backend_]() {
+    if (*cancelled) {
+      return;
+    }
+    try {
+      cv::Mat resized;
+      cv::resize(image, resized, size, 0, 0, interpolation);
+      promise->set_value({resized, coord_uv});
+    } catch (...) {
+      promise->set_exception(std::current_exception());
+    }
+    backend->WakeUp();
+  });
+}
 
-  image_type_ = image_type;
-  if (image_type == ImageType::kPanoFullRes) {
-    full_resolution_pano_ = image;
+void PreviewPane::UploadLevel(const TextureLevel& level) {
+  backend_->UpdateTexture(tex_.get(), level.image);
+  tex_coord_ = level.coord_uv;
+}
+
+void PreviewPane::UploadReadyLevels() {
+  while (!pending_levels_.empty() &&
+         utils::future::IsReady(pending_levels_.front())) {
+    try {
+      UploadLevel(pending_levels_.front().get());
+    } catch (const std::exception& e) {
+      spdlog::error("Failed to downscale the preview: {}", e.what());
+    }
+    pending_levels_.pop_front();
+  }
+}
+
+void PreviewPane::CancelPendingLevels() {
+  if (pending_cancelled_) {
+    *pending_cancelled_ = true;
+  }
+  pending_levels_.clear();
+}
+
+void PreviewPane::ShowReprojection(
+    const algorithm::ReprojectOptions& options) {
+  if (!cameras_ || composed_pano_.empty()) {
+    return;
+  }
+  if (auto reprojected =
+          algorithm::Reproject(composed_pano_, *cameras_, options);
+      reprojected) {
+    tiles_.Reset();
+    UpdateTexture(*reprojected);
   }
 }
 
@@ -215,9 +295,38 @@ void PreviewPane::Reset() {
   rotate_widget_ = {};
   suggested_crop_ = utils::DefaultCropRect();
   full_resolution_pano_ = cv::Mat{};
+  composed_pano_ = cv::Mat{};
+  CancelPendingLevels();
+  tiles_.Reset();
+}
+
+void PreviewPane::DrawTiles(const utils::RectPVf& window,
+                            const utils::RectPVf& image) {
+  // The whole pano, only the crop rect of it is shown when cropped
+  auto pano = image;
+  if (crop_mode_ == CropMode::kDisabled) {
+    const auto& crop = crop_widget_.rect;
+    const utils::Vec2f size = {image.size[0] / (crop.end[0] - crop.start[0]),
+                               image.size[1] / (crop.end[1] - crop.start[1])};
+    pano = utils::Rect(utils::Point2f{image.start[0] - size[0] * crop.start[0],
+                                      image.start[1] - size[1] * crop.start[1]},
+                       size);
+  }
+  const utils::RectPPf clip = {
+      utils::Point2f{std::max(image.start[0], window.start[0]),
+                     std::max(image.start[1], window.start[1])},
+      utils::Point2f{
+          std::min(image.start[0] + image.size[0],
+                   window.start[0] + window.size[0]),
+          std::min(image.start[1] + image.size[1],
+                   window.start[1] + window.size[1])}};
+  const float base_scale = tex_coord_[0] * kLoupeSize /
+                           static_cast<float>(full_resolution_pano_.cols);
+  tiles_.Draw(pano, clip, base_scale);
 }
 
 Action PreviewPane::Draw(const std::string& message) {
+  UploadReadyLevels();
   Action action{};
   ImGui::Begin("Preview");
   auto window = utils::Rect(utils::ToPoint(ImGui::GetCursorScreenPos()),
@@ -265,6 +374,10 @@ Action PreviewPane::Draw(const std::string& message) {
                                          utils::ImVec(tex_coords.start),
                                          utils::ImVec(tex_coords.end));
 
+    if (!tiles_.Empty() && rotate_mode_ == RotateMode::kDisabled) {
+      DrawTiles(window, image);
+    }
+
     if (crop_mode_ == CropMode::kEnabled) {
       Overlay(crop_widget_.rect, image);
     }
@@ -303,8 +416,16 @@ Action PreviewPane::HandleInputs(const utils::RectPVf& window,
     if (rotate_mode_ == RotateMode::kEnabled) {
       auto [new_state, finished_dragging] =
           Drag(rotate_widget_, image, mouse_pos, mouse_clicked, mouse_down);
+      const bool rotated = new_state.yaw != rotate_widget_.rotation.yaw ||
+                           new_state.pitch != rotate_widget_.rotation.pitch ||
+                           new_state.roll != rotate_widget_.rotation.roll;
       rotate_widget_.rotation = new_state;
       SelectMouseCursor(rotate_widget_);
+      // The pano is recomposed only once the user stops dragging
+      if (rotated) {
+        ShowReprojection({.rotation_matrix = FullRotation(
+                              rotate_widget_.rotation, rotate_widget_.warp)});
+      }
       if (finished_dragging) {
         return Action{.type = ActionType::kRotate,
                       .delayed = true,
@@ -441,9 +562,20 @@ void PreviewPane::SetSuggestedCrop(const utils::RectRRf& rect) {
   suggested_crop_ = rect;
 }
 
-void PreviewPane::SetCameras(const algorithm::Cameras& cameras) {
+void PreviewPane::SetCameras(const algorithm::Cameras& cameras,
+                             cv::Mat pano) {
   cameras_ = cameras;
+  composed_pano_ = std::move(pano);
   rotate_widget_ = widgets::SetupRotationWidget(*cameras_);
 }
 
+void PreviewPane::PreviewProjection(algorithm::ProjectionType projection) {
+  // The rotation widget is set up for the current projection
+  if (IsRotateEnabled() || !cameras_ ||
+      algorithm::ComposedProjection(*cameras_) == projection) {
+    return;
+  }
+  ShowReprojection({.projection = projection});
+}
+
 }  // namespace xpano::gui
@@ -4,19 +4,27 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <cstdint>
+#include <deque>
+#include <future>
+#include <memory>
 #include <optional>
 #include <string>
 
 #include <opencv2/core.hpp>
 
 #include "xpano/algorithm/algorithm.h"
+#include "xpano/algorithm/options.h"
+#include "xpano/algorithm/reproject.h"
 #include "xpano/constants.h"
 #include "xpano/gui/action.h"
 #include "xpano/gui/backends/base.h"
+#include "xpano/gui/panels/tiled_image.h"
 #include "xpano/gui/widgets/drag.h"
 #include "xpano/gui/widgets/rotate.h"
 #include "xpano/utils/rect.h"
+#include "xpano/utils/threadpool.h"
 #include "xpano/utils/vec.h"
 
 namespace xpano::gui {
@@ -33,22 +41,34 @@ enum class CropMode : std::uint8_t { kInitial, kEnabled, kDisabled };
 
 enum class RotateMode : std::uint8_t { kEnabled, kDisabled };
 
+struct TextureLevel {
+  cv::Mat image;
+  utils::Ratio2f coord_uv;
+};
+
 class PreviewPane {
  public:
   explicit PreviewPane(backends::Base* backend);
   void Load(cv::Mat image, ImageType image_type);
-  void Reload(cv::Mat image, ImageType image_type);
+  // The display copy, if set, is shown instead of a downscale of the image
+  void Reload(cv::Mat image, ImageType image_type,
+              const std::optional<cv::Mat>& display = std::nullopt);
   Action Draw(const std::string& message);
   void Reset();
   Action ToggleCrop();
   Action ToggleRotate();
   [[nodiscard]] bool IsRotateEnabled() const;
+  // Zooming over the next frames
+  [[nodiscard]] bool IsAnimating() const;
   void EndCrop();
   void EndRotate();
   void ResetCrop(const utils::RectRRf& rect);
   void ForceCrop(const utils::RectRRf& rect);
   void SetSuggestedCrop(const utils::RectRRf& rect);
-  void SetCameras(const algorithm::Cameras& cameras);
+  // Cameras of the composed pano, used for rotating and reprojecting it
+  void SetCameras(const algorithm::Cameras& cameras, cv::Mat pano);
+  // Shows the pano reprojected until the recomposed pano arrives
+  void PreviewProjection(algorithm::ProjectionType projection);
 
   [[nodiscard]] ImageType Type() const;
   [[nodiscard]] cv::Mat Image() const;
@@ -62,6 +82,13 @@ class PreviewPane {
   void ResetZoom(int target_level = 1);
   Action HandleInputs(const utils::RectPVf& window,
                       const utils::RectPVf& image);
+  void UpdateTexture(const cv::Mat& image);
+  void QueueLevel(const cv::Mat& image, float scale, int interpolation);
+  void UploadLevel(const TextureLevel& level);
+  void UploadReadyLevels();
+  void CancelPendingLevels();
+  void ShowReprojection(const algorithm::ReprojectOptions& options);
+  void DrawTiles(const utils::RectPVf& window, const utils::RectPVf& image);
 
   utils::Ratio2f tex_coord_;
 
@@ -71,6 +98,7 @@ class PreviewPane {
   widgets::RotationWidget rotate_widget_;
   utils::RectRRf suggested_crop_ = utils::DefaultCropRect();
   std::optional<algorithm::Cameras> cameras_;
+  cv::Mat composed_pano_;
 
   int zoom_id_ = 1;
   float zoom_ = 1.0f;
@@ -84,6 +112,15 @@ class PreviewPane {
 
   ImageType image_type_ = ImageType::kNone;
   cv::Mat full_resolution_pano_;
+  // Sharper than the texture when zoomed into the full resolution pano
+  TiledImage tiles_;
+
+  // Images larger than the texture are downscaled on the worker, a coarse
+  // level first, then the full texture. Uploaded in order as they are ready.
+  std::deque<std::future<TextureLevel>> pending_levels_;
+  std::shared_ptr<std::atomic_bool> pending_cancelled_;
+  // Last, the queued levels are done before the rest is destroyed
+  utils::mt::Threadpool worker_{1};
 };
 
 }  // namespace xpano::gui
@@ -10,12 +10,14 @@
 
 #include <imgui.h>
 #include <opencv2/core.hpp>
+#include <opencv2/core/ocl.hpp>
 #include <opencv2/features2d.hpp>
 
 #include "xpano/algorithm/algorithm.h"
 #include "xpano/algorithm/blenders.h"
 #include "xpano/algorithm/image.h"
 #include "xpano/algorithm/options.h"
+#include "xpano/algorithm/progress.h"
 #include "xpano/constants.h"
 #include "xpano/gui/action.h"
 #include "xpano/gui/panels/preview_pane.h"
@@ -23,6 +25,7 @@
 #include "xpano/gui/shortcut.h"
 #include "xpano/pipeline/options.h"
 #include "xpano/pipeline/stitcher_pipeline.h"
+#include "xpano/utils/encoders.h"
 #include "xpano/utils/exiv2.h"
 #include "xpano/utils/fmt.h"
 #include "xpano/utils/imgui_.h"
@@ -31,47 +34,6 @@
 namespace xpano::gui {
 
 namespace {
-std::string ProgressLabel(pipeline::ProgressType type) {
-  switch (type) {
-    default:
-      return "";
-    case pipeline::ProgressType::kLoadingImages:
-      return "Loading images";
-    case pipeline::ProgressType::kStitchingPano:
-      return "Stitching pano";
-    case pipeline::ProgressType::kAutoCrop:
-      return "Auto crop";
-    case pipeline::ProgressType::kDetectingKeypoints:
-      return "Detecting keypoints";
-    case pipeline::ProgressType::kMatchingImages:
-      return "Matching images";
-    case pipeline::ProgressType::kExport:
-      return "Exporting pano";
-    case pipeline::ProgressType::kInpainting:
-      return "Auto fill";
-    case pipeline::ProgressType::kStitchFindFeatures:
-      return "Finding features";
-    case pipeline::ProgressType::kStitchMatchFeatures:
-      return "Matching features";
-    case pipeline::ProgressType::kStitchEstimateHomography:
-      return "Estimating homography";
-    case pipeline::ProgressType::kStitchBundleAdjustment:
-      return "Bundle adjustment";
-    case pipeline::ProgressType::kStitchComputeRoi:
-      return "Computing pano size";
-    case pipeline::ProgressType::kStitchSeamsPrepare:
-      return "Preparing seams";
-    case pipeline::ProgressType::kStitchSeamsFind:
-      return "Finding seams";
-    case pipeline::ProgressType::kStitchCompose:
-      return "Composing pano";
-    case pipeline::ProgressType::kStitchBlend:
-      return "Blending";
-    case pipeline::ProgressType::kCancelling:
-      return "Cancelling";
-  }
-}
-
 Action DrawFileMenu() {
   Action action{};
   if (ImGui::BeginMenu("File")) {
@@ -81,10 +43,20 @@ Action DrawFileMenu() {
     if (ImGui::MenuItem("Open directory")) {
       action |= {ActionType::kOpenDirectory};
     }
+    if (ImGui::MenuItem("Add files")) {
+      action |= {ActionType::kAddFiles};
+    }
     if (ImGui::MenuItem("Export", Label(ShortcutType::kExport))) {
       action |= {ActionType::kExport};
     }
     ImGui::Separator();
+    if (ImGui::MenuItem("Open project")) {
+      action |= {ActionType::kOpenProject};
+    }
+    if (ImGui::MenuItem("Save project")) {
+      action |= {ActionType::kSaveProject};
+    }
+    ImGui::Separator();
     if (ImGui::MenuItem("Quit")) {
       action |= {ActionType::kQuit};
     }
@@ -113,6 +85,38 @@ Action DrawEditMenu() {
   return action;
 }
 
+void DrawEncoderOptions(pipeline::CompressionOptions* compression_options) {
+  using utils::encoders::Format;
+  std::string enabled;
+  for (const auto format : {Format::kJxl, Format::kAvif, Format::kWebp}) {
+    if (utils::encoders::Enabled(format)) {
+      enabled += fmt::format("{}{}", enabled.empty() ? "" : ", ",
+                             utils::encoders::Label(format));
+    }
+  }
+  ImGui::Text("JPEG XL / AVIF / WebP");
+  utils::imgui::EnableIf(
+      !enabled.empty(),
+      [&] {
+        ImGui::SliderInt("Quality##encoders",
+                         &compression_options->encoder_quality, 0,
+                         kMaxEncoderQuality);
+        ImGui::SameLine();
+        utils::imgui::InfoMarker(
+            "(?)", "100 is lossless.\nExif metadata is not copied.");
+        ImGui::SliderInt("Effort", &compression_options->encoder_effort,
+                         kMinEncoderEffort, kMaxEncoderEffort);
+        ImGui::SameLine();
+        utils::imgui::InfoMarker(
+            "(?)",
+            fmt::format("Smaller files for a slower export.\nAvailable in "
+                        "this version: {}.",
+                        enabled));
+      },
+      "This version was not built with any of the encoders.\nAvailable when "
+      "built from source with libjxl, libavif or libwebp.");
+}
+
 void DrawExportOptionsMenu(pipeline::MetadataOptions* metadata_options,
                            pipeline::CompressionOptions* compression_options) {
   if (ImGui::BeginMenu("Image export")) {
@@ -151,10 +155,44 @@ void DrawExportOptionsMenu(pipeline::MetadataOptions* metadata_options,
     ImGui::Text("PNG");
     ImGui::SliderInt("Compression", &compression_options->png_compression, 0,
                      kMaxPngCompression);
+    ImGui::Separator();
+    ImGui::Text("TIFF");
+    ImGui::Checkbox("Tiled BigTIFF", &compression_options->tiff_tiled);
+    ImGui::SameLine();
+    utils::imgui::InfoMarker(
+        "(?)",
+        "Uncompressed tiled BigTIFF, for panoramas over 4 GB.\nExif metadata "
+        "is not copied.");
+    utils::imgui::EnableIf(
+        compression_options->tiff_tiled,
+        [&] {
+          ImGui::Checkbox("Overviews", &compression_options->tiff_overviews);
+          ImGui::SameLine();
+          utils::imgui::InfoMarker(
+              "(?)",
+              "Pyramid of downscaled copies, for faster zooming out in the "
+              "viewers.");
+        },
+        "Available for the tiled BigTIFF.");
+    ImGui::Separator();
+    DrawEncoderOptions(compression_options);
     ImGui::EndMenu();
   }
 }
 
+// The profile without a model, applied to the images without another one
+algorithm::LensProfile* GenericLensProfile(algorithm::LensOptions* lens) {
+  auto generic = std::find_if(lens->profiles.begin(), lens->profiles.end(),
+                              [](const algorithm::LensProfile& profile) {
+                                return profile.model.empty();
+                              });
+  if (generic != lens->profiles.end()) {
+    return &*generic;
+  }
+  lens->profiles.emplace_back();
+  return &lens->profiles.back();
+}
+
 void DrawLoadingOptionsMenu(pipeline::LoadingOptions* loading_options) {
   if (ImGui::BeginMenu("Image loading")) {
     ImGui::Text(
@@ -172,8 +210,109 @@ void DrawLoadingOptionsMenu(pipeline::LoadingOptions* loading_options) {
     utils::imgui::InfoMarker(
         "(?)",
         "Size of the preview image's longer side in pixels.\n - decrease to "
-        "get faster loading times.\n - increase to get nicer preview images\n "
-        "- increase to get more precision for panorama detection.");
+        "get faster loading times.\n - increase to get nicer preview "
+        "images.");
+    if (ImGui::InputInt("Detection size",
+                        &loading_options->detection_longer_side,
+                        kStepPreviewLongerSide, kStepPreviewLongerSide)) {
+      loading_options->detection_longer_side =
+          std::clamp(loading_options->detection_longer_side,
+                     kMinPreviewLongerSide, kMaxPreviewLongerSide);
+    }
+    ImGui::SameLine();
+    utils::imgui::InfoMarker(
+        "(?)",
+        "Size of the longer side in pixels of the image the keypoints are "
+        "detected on, independent of the preview size.\n - decrease to get "
+        "faster loading and matching.\n - increase to get more precision for "
+        "panorama detection.");
+    ImGui::Text("Keypoint detector:");
+    ImGui::SameLine();
+    utils::imgui::RadioBox(&loading_options->feature, algorithm::kFeatureTypes);
+    utils::imgui::InfoMarker(
+        "(?)",
+        "Algorithm used to find the keypoints for panorama detection.\n - "
+        "SIFT is the most precise.\n - ORB is much faster, useful for a quick "
+        "triage of large shoots.");
+    if (ImGui::InputInt("Keypoints", &loading_options->num_features,
+                        kStepNumFeatures, kStepNumFeatures)) {
+      loading_options->num_features =
+          std::clamp(loading_options->num_features, kMinNumFeatures,
+                     kMaxNumFeatures);
+    }
+    ImGui::SameLine();
+    utils::imgui::InfoMarker(
+        "(?)",
+        "Maximum number of keypoints per image.\n - decrease to get faster "
+        "loading and matching.");
+    ImGui::Checkbox("Feature cache", &loading_options->use_feature_cache);
+    ImGui::SameLine();
+    utils::imgui::InfoMarker(
+        "(?)",
+        "Store the preview images and detected keypoints on disk.\n - "
+        "reopening the same images is much faster.");
+    utils::imgui::EnableIf(
+        utils::exiv2::Enabled(),
+        [&] {
+          ImGui::Checkbox("Use embedded previews",
+                          &loading_options->use_embedded_previews);
+          ImGui::SameLine();
+          utils::imgui::InfoMarker(
+              "(?)",
+              "Take the preview image from the Exif data if the camera stored "
+              "one at least as large as the preview size.\n - much faster "
+              "loading of large JPEG files.");
+        },
+        "This version was not built with exif support.\nAvailable in: "
+        "Flatpak, Windows, built from source.");
+    ImGui::Checkbox("Compact features", &loading_options->compact_features);
+    ImGui::SameLine();
+    utils::imgui::InfoMarker(
+        "(?)",
+        "Store the detected keypoints in a compact form.\n - uses ~4x less "
+        "memory, useful when loading thousands of images.");
+    ImGui::Checkbox("Compress previews", &loading_options->compress_previews);
+    ImGui::SameLine();
+    utils::imgui::InfoMarker(
+        "(?)",
+        "Keep the preview images JPEG-compressed in memory, decompress them "
+        "when needed.\n - uses ~10x less memory, useful when loading "
+        "thousands of images.");
+    ImGui::Checkbox("Lens correction", &loading_options->lens.undistort);
+    ImGui::SameLine();
+    utils::imgui::InfoMarker(
+        "(?)",
+        "Undistort the images before matching and stitching, radial "
+        "distortion coefficients.\n - negative k1 for barrel distortion of "
+        "wide-angle lenses.\n - the full resolution images are undistorted "
+        "the same way.");
+    if (loading_options->lens.undistort) {
+      auto* profile = GenericLensProfile(&loading_options->lens);
+      if (ImGui::InputFloat("k1", &profile->k1, 0.01f, 0.01f, "%.3f")) {
+        profile->k1 = std::clamp(profile->k1, -kMaxLensCoefficient,
+                                 kMaxLensCoefficient);
+      }
+      if (ImGui::InputFloat("k2", &profile->k2, 0.01f, 0.01f, "%.3f")) {
+        profile->k2 = std::clamp(profile->k2, -kMaxLensCoefficient,
+                                 kMaxLensCoefficient);
+      }
+    }
+    const bool has_opencl = cv::ocl::haveOpenCL();
+    utils::imgui::EnableIf(
+        has_opencl && algorithm::HasOpenCLDetector(loading_options->feature),
+        [&] {
+          ImGui::Text("Keypoint detection:");
+          ImGui::SameLine();
+          utils::imgui::RadioBox(&loading_options->detector_backend,
+                                 algorithm::kDetectorBackends);
+          utils::imgui::InfoMarker(
+              "(?)",
+              "Run the ORB keypoint detection on the GPU through OpenCL.\n - "
+              "falls back to the CPU if the device fails.");
+        },
+        has_opencl ? "Only ORB has OpenCL kernels, SIFT and AKAZE always "
+                     "run on the CPU."
+                   : "No OpenCL device was found.");
     ImGui::EndMenu();
   }
 }
@@ -200,8 +339,11 @@ bool DrawMatchConf(float* match_conf) {
   return value_changed;
 }
 
-void DrawMatchingOptionsMenu(pipeline::MatchingOptions* matching_options,
-                             bool debug_enabled) {
+Action DrawMatchingOptionsMenu(pipeline::MatchingOptions* matching_options,
+                               bool debug_enabled) {
+  Action action{};
+  // The thresholds regroup the loaded images, see RunRegrouping
+  const Action regroup = {.type = ActionType::kRegroupPanos};
   if (ImGui::BeginMenu("Panorama detection")) {
     ImGui::Text("Matching type:");
     ImGui::SameLine();
@@ -209,25 +351,104 @@ void DrawMatchingOptionsMenu(pipeline::MatchingOptions* matching_options,
     utils::imgui::InfoMarker("(?)",
                              "(1) Autodetect panoramas\n(2) Put all images in "
                              "a single panorama\n(3) No groups are created "
-                             "(useful for manual image selection)");
+                             "(useful for manual image selection)\n(4) "
+                             "Images shot as a grid, e.g. by a robotic "
+                             "head");
 
-    if (matching_options->type == pipeline::MatchingType::kAuto) {
+    if (matching_options->type == pipeline::MatchingType::kAuto ||
+        matching_options->type == pipeline::MatchingType::kGrid) {
       ImGui::Separator();
       ImGui::Spacing();
       ImGui::Text(
           "Experiment with this if the app cannot find the panoramas you "
-          "want.\nThese options are applied only after reloading images.");
+          "want.\nThe thresholds apply right away, the other options only "
+          "after reloading images.");
       ImGui::Spacing();
-      ImGui::SliderInt("Matching neighbors",
-                       &matching_options->neighborhood_search_size, 0,
-                       kMaxNeighborhoodSearchSize);
+      if (matching_options->type == pipeline::MatchingType::kGrid) {
+        auto& grid = matching_options->grid;
+        ImGui::SliderInt("Grid rows", &grid.rows, 1, kMaxGridSize);
+        ImGui::SliderInt("Grid columns", &grid.cols, 1, kMaxGridSize);
+        ImGui::Text("Capture order:");
+        ImGui::SameLine();
+        utils::imgui::RadioBox(&grid.order, algorithm::kGridOrders);
+        utils::imgui::InfoMarker(
+            "(?)",
+            "Order in which the images of the grid were shot, serpentine "
+            "reverses every other row / column.");
+        ImGui::Checkbox("Match diagonals", &grid.diagonals);
+        ImGui::SameLine();
+        utils::imgui::InfoMarker("(?)",
+                                 "Also match the diagonal neighbours in the "
+                                 "grid, slower but more robust.");
+      } else {
+        ImGui::SliderInt("Matching neighbors",
+                         &matching_options->neighborhood_search_size, 0,
+                         kMaxNeighborhoodSearchSize);
+        ImGui::SameLine();
+        utils::imgui::InfoMarker("(?)",
+                                 "Select how many neighboring images will be "
+                                 "considered for panorama "
+                                 "auto detection.");
+        ImGui::Checkbox("Adaptive neighbors",
+                        &matching_options->adaptive_neighborhood);
+        ImGui::SameLine();
+        utils::imgui::InfoMarker(
+            "(?)",
+            "Match the further neighbors only for the images without a "
+            "strong match yet.\nFaster on long sequences, the neighbors "
+            "above are the maximum.");
+      }
+      ImGui::Checkbox("Find similar images",
+                      &matching_options->use_retrieval);
       ImGui::SameLine();
-      utils::imgui::InfoMarker("(?)",
-                               "Select how many neighboring images will be "
-                               "considered for panorama "
-                               "auto detection.");
+      utils::imgui::InfoMarker(
+          "(?)",
+          "Also match each image with the most similar images of the whole "
+          "set.\nUseful when the images are not sorted in capture order, "
+          "e.g. when merging photos from multiple cameras.");
+      if (matching_options->use_retrieval) {
+        ImGui::SliderInt("Similar images",
+                         &matching_options->retrieval_candidates, 1,
+                         kMaxRetrievalCandidates);
+      }
+      utils::imgui::EnableIf(
+          utils::exiv2::Enabled(),
+          [&] {
+            ImGui::Checkbox("Split by capture time",
+                            &matching_options->split_by_capture);
+          },
+          "Xpano was built without Exiv2 support");
+      ImGui::SameLine();
+      utils::imgui::InfoMarker(
+          "(?)",
+          "Never match images taken too long after each other or too far "
+          "apart, based on the Exif capture time and GPS position.\nImages "
+          "without the metadata are matched as usual.");
+      if (matching_options->split_by_capture) {
+        ImGui::SliderInt("Max time gap [s]", &matching_options->max_time_gap,
+                         1, kMaxTimeGap);
+        ImGui::SliderInt("Max distance [m]",
+                         &matching_options->max_gps_distance, 1,
+                         kMaxGpsDistance);
+      }
+      ImGui::Checkbox("Skip duplicates", &matching_options->skip_duplicates);
+      ImGui::SameLine();
+      utils::imgui::InfoMarker(
+          "(?)",
+          "Don't match near-identical images, e.g. burst shots or "
+          "exposure brackets.\nThe images are compared by a perceptual hash "
+          "of their thumbnails, the distance is the number of differing "
+          "bits.");
+      if (matching_options->skip_duplicates) {
+        ImGui::SliderInt("Hash distance",
+                         &matching_options->duplicate_hash_distance, 0,
+                         kMaxDuplicateHashDistance);
+      }
       ImGui::SliderInt("Matching threshold", &matching_options->match_threshold,
                        kMinMatchThreshold, kMaxMatchThreshold);
+      if (ImGui::IsItemDeactivatedAfterEdit()) {
+        action |= regroup;
+      }
       ImGui::SameLine();
       utils::imgui::InfoMarker("(?)",
                                "Number of keypoints that need to match in "
@@ -235,6 +456,9 @@ void DrawMatchingOptionsMenu(pipeline::MatchingOptions* matching_options,
                                "images in a panorama.");
       ImGui::SliderFloat("Minimum shift", &matching_options->min_shift,
                          kMinShiftInPano, kMaxShiftInPano, "%.2f");
+      if (ImGui::IsItemDeactivatedAfterEdit()) {
+        action |= regroup;
+      }
       ImGui::SameLine();
       utils::imgui::InfoMarker(
           "(?)",
@@ -242,13 +466,47 @@ void DrawMatchingOptionsMenu(pipeline::MatchingOptions* matching_options,
           "panorama.\nUseful to filter out burst shots / focus stacks that "
           "shouldn't be handled by Xpano.\nThe value is specified in relative "
           "terms to the size of the image.");
+      ImGui::Text("Matcher:");
+      ImGui::SameLine();
+      utils::imgui::RadioBox(&matching_options->matcher,
+                             algorithm::kMatcherTypes);
+      utils::imgui::InfoMarker(
+          "(?)",
+          "FLANN: approximate nearest neighbor search.\nBrute force: exact "
+          "search.");
+      ImGui::Checkbox("Coarse to fine", &matching_options->coarse_to_fine);
+      ImGui::SameLine();
+      utils::imgui::InfoMarker(
+          "(?)",
+          "Match the images of the detected panoramas again at a higher "
+          "resolution, only where they overlap.\nMore precise registration of "
+          "distant detail, slower loading.");
+      if (matching_options->coarse_to_fine) {
+        if (ImGui::InputInt("Fine size", &matching_options->fine_longer_side,
+                            kStepPreviewLongerSide, kStepPreviewLongerSide)) {
+          matching_options->fine_longer_side =
+              std::clamp(matching_options->fine_longer_side,
+                         kMinPreviewLongerSide, kMaxFineLongerSide);
+        }
+      }
       if (debug_enabled) {
         ImGui::SeparatorText("Debug");
-        DrawMatchConf(&matching_options->match_conf);
+        if (DrawMatchConf(&matching_options->match_conf)) {
+          action |= regroup;
+        }
+        ImGui::Text("Homography:");
+        ImGui::SameLine();
+        utils::imgui::RadioBox(&matching_options->homography,
+                               algorithm::kHomographyMethods);
+        utils::imgui::InfoMarker(
+            "(?)",
+            "Robust estimator used to verify the matches.\nThe USAC variants "
+            "terminate early once a good model is found.");
       }
     }
     ImGui::EndMenu();
   }
+  return action;
 }
 
 Action DrawProjectionOptions(pipeline::StitchAlgorithmOptions* stitch_options) {
@@ -282,12 +540,27 @@ Action DrawProjectionOptions(pipeline::StitchAlgorithmOptions* stitch_options) {
 Action DrawFeatureMatchingOptions(
     pipeline::StitchAlgorithmOptions* stitch_options) {
   Action action{};
-  ImGui::Text("Feature algorithm for matching:");
-  ImGui::Spacing();
-  if (utils::imgui::ComboBox(&stitch_options->feature, algorithm::kFeatureTypes,
-                             "##feature_type")) {
+  if (ImGui::Checkbox("Reuse image matches", &stitch_options->reuse_matches)) {
     action |= {ActionType::kRecomputePano};
   }
+  ImGui::SameLine();
+  utils::imgui::InfoMarker(
+      "(?)",
+      "Estimates the panorama from the features and matches found when "
+      "loading the images.\nTurn off to detect and match the features again "
+      "with the algorithm below.");
+  ImGui::Text("Feature algorithm for matching:");
+  ImGui::Spacing();
+  utils::imgui::EnableIf(
+      !stitch_options->reuse_matches,
+      [&] {
+        if (utils::imgui::ComboBox(&stitch_options->feature,
+                                   algorithm::kFeatureTypes,
+                                   "##feature_type")) {
+          action |= {ActionType::kRecomputePano};
+        }
+      },
+      "Used only when not reusing the image matches");
   return action;
 }
 
@@ -321,7 +594,8 @@ Action DrawBlendingOptions(pipeline::StitchAlgorithmOptions* stitch_options) {
       "(?)",
       "OpenCV: better seam finding\nMultiblend: better "
       "image detail and smoother image transitions\nMultiblend (with alpha): "
-      "Multiblend + OpenCV seam finding");
+      "Multiblend + OpenCV seam finding\nFeather, Seam only: fast, visible "
+      "transitions");
   ImGui::Spacing();
   if (utils::imgui::ComboBox(&stitch_options->blending_method,
                              algorithm::kBlendingMethods, "##blending_type")) {
@@ -330,6 +604,82 @@ Action DrawBlendingOptions(pipeline::StitchAlgorithmOptions* stitch_options) {
   return action;
 }
 
+Action DrawDeviceResidentOption(
+    pipeline::StitchAlgorithmOptions* stitch_options) {
+  Action action{};
+  utils::imgui::EnableIf(
+      cv::ocl::haveOpenCL(),
+      [&] {
+        if (ImGui::Checkbox("Keep on GPU", &stitch_options->device_resident)) {
+          action |= {ActionType::kRecomputePano};
+        }
+        ImGui::SameLine();
+        utils::imgui::InfoMarker(
+            "(?)",
+            "Warp, blend and downscale the panorama on the GPU through "
+            "OpenCL.\nOnly the display copy and the exported panorama are "
+            "copied back, Multiblend is replaced by OpenCV.");
+      },
+      "No OpenCL device was found.");
+  return action;
+}
+
+Action DrawSeamFinderOptions(
+    pipeline::StitchAlgorithmOptions* stitch_options) {
+  Action action{};
+  ImGui::Text("Seam finder:");
+  ImGui::SameLine();
+  utils::imgui::InfoMarker(
+      "(?)",
+      "Auto: fast DP color seams for previews, graph cut seams for the full "
+      "resolution panorama and export\nVoronoi: fastest, visible seams on "
+      "moving objects\nGraph cut: best quality, slowest");
+  ImGui::Spacing();
+  if (utils::imgui::ComboBox(&stitch_options->seam_finder,
+                             algorithm::kSeamFinderTypes, "##seam_finder")) {
+    action |= {ActionType::kRecomputePano};
+  }
+  // Read only by the next full resolution stitch
+  ImGui::Checkbox("Reuse preview seams", &stitch_options->reuse_preview_seams);
+  ImGui::SameLine();
+  utils::imgui::InfoMarker(
+      "(?)",
+      "The full resolution panorama and export reuse the seams and exposure "
+      "of the preview instead of estimating them again.
+Faster, the seams "
+      "are the ones of the preview seam finder.");
+  if (ImGui::Checkbox("Exposure per channel",
+                      &stitch_options->exposure_per_channel)) {
+    action |= {ActionType::kRecomputePano};
+  }
+  ImGui::SameLine();
+  utils::imgui::InfoMarker(
+      "(?)",
+      "Compensates the exposure of the red, green and blue channels "
+      "separately.\nFor images with a different white balance.");
+  return action;
+}
+
+Action DrawPreviewBlendingOptions(
+    pipeline::StitchAlgorithmOptions* stitch_options) {
+  Action action{};
+  ImGui::Text("Preview blending:");
+  ImGui::SameLine();
+  utils::imgui::InfoMarker(
+      "(?)",
+      "Used for the interactive previews, the full resolution panorama and "
+      "export keep the multi-band blending\nFeather: fast, soft "
+      "transitions\nSeam only: fastest, hard transitions\nOpenCV: same as "
+      "multi-band export");
+  ImGui::Spacing();
+  if (utils::imgui::ComboBox(&stitch_options->preview_blending_method,
+                             algorithm::kPreviewBlendingMethods,
+                             "##preview_blending_type")) {
+    action |= {ActionType::kRecomputePano};
+  }
+  return action;
+}
+
 Action DrawMaxPanoSizeOptions(
     pipeline::StitchAlgorithmOptions* stitch_options) {
   static bool show_apply_button = false;
@@ -346,6 +696,18 @@ Action DrawMaxPanoSizeOptions(
     show_apply_button = true;
   }
 
+  ImGui::Text("Memory budget:");
+  ImGui::SameLine();
+  utils::imgui::InfoMarker(
+      "(?)",
+      "Estimated peak memory of the compositing, 0 means no limit.\n "
+      "The panorama will be downscaled to fit, or the stitching will fail.");
+  ImGui::Spacing();
+  if (ImGui::InputInt("[MB]", &stitch_options->max_memory_mb)) {
+    stitch_options->max_memory_mb = std::max(stitch_options->max_memory_mb, 0);
+    show_apply_button = true;
+  }
+
   if (show_apply_button) {
     ImGui::SameLine();
     if (ImGui::Button("Apply")) {
@@ -356,13 +718,42 @@ Action DrawMaxPanoSizeOptions(
   return action;
 }
 
+void DrawSpeculativeStitchingOption(pipeline::PreviewOptions* preview_options) {
+  ImGui::Checkbox("Stitch neighbouring panos",
+                  &preview_options->speculative_stitching);
+  ImGui::SameLine();
+  utils::imgui::InfoMarker(
+      "(?)",
+      "Stitches the previous and the next panorama in the background while "
+      "one is shown, so that switching to them is instant.
+Stops whenever "
+      "anything else is computed.");
+}
+
+void DrawPanoThumbnailsOption(pipeline::PreviewOptions* preview_options) {
+  ImGui::Checkbox("Mini previews of all panos",
+                  &preview_options->pano_thumbnails);
+  ImGui::SameLine();
+  utils::imgui::InfoMarker(
+      "(?)",
+      "Stitches a tiny version of every detected panorama in the background "
+      "after the images are loaded, shown in the list of panoramas.\nThe "
+      "panoramas then open faster, their cameras are already estimated.");
+}
+
 Action DrawStitchOptionsMenu(pipeline::StitchAlgorithmOptions* stitch_options,
+                             pipeline::PreviewOptions* preview_options,
                              bool debug_enabled) {
   Action action{};
   if (ImGui::BeginMenu("Panorama stitching")) {
     action |= DrawProjectionOptions(stitch_options);
     action |= DrawWaveCorrectionOptions(stitch_options);
+    action |= DrawSeamFinderOptions(stitch_options);
+    action |= DrawPreviewBlendingOptions(stitch_options);
     action |= DrawMaxPanoSizeOptions(stitch_options);
+    action |= DrawDeviceResidentOption(stitch_options);
+    DrawSpeculativeStitchingOption(preview_options);
+    DrawPanoThumbnailsOption(preview_options);
 
     if (debug_enabled) {
       ImGui::SeparatorText("Debug");
@@ -410,8 +801,9 @@ Action DrawOptionsMenu(pipeline::Options* options, bool debug_enabled) {
     action |= DrawResetButton();
     DrawExportOptionsMenu(&options->metadata, &options->compression);
     DrawLoadingOptionsMenu(&options->loading);
-    DrawMatchingOptionsMenu(&options->matching, debug_enabled);
-    action |= DrawStitchOptionsMenu(&options->stitch, debug_enabled);
+    action |= DrawMatchingOptionsMenu(&options->matching, debug_enabled);
+    action |= DrawStitchOptionsMenu(&options->stitch, &options->preview,
+                                    debug_enabled);
     if (debug_enabled) {
       DrawAutofillOptionsMenu(&options->inpaint);
     }
@@ -426,6 +818,9 @@ Action DrawHelpMenu() {
     if (ImGui::MenuItem("Show debug info", Label(ShortcutType::kDebug))) {
       action |= {ActionType::kToggleDebugLog};
     }
+    if (ImGui::MenuItem("Show performance")) {
+      action |= {ActionType::kTogglePerfPane};
+    }
     if (ImGui::MenuItem("Support")) {
       action |= {ActionType::kShowBugReport};
     }
@@ -448,14 +843,15 @@ void DrawProgressBar(pipeline::ProgressReport progress) {
                      static_cast<float>(progress.num_tasks);
   }
   if (progress.tasks_done != progress.num_tasks) {
-    label = fmt::format("{}: {:.0f}%", ProgressLabel(progress.type),
+    label = fmt::format("{}: {:.0f}%", algorithm::Label(progress.type),
                         progress_ratio * max_percent);
   }
   if (progress.type == pipeline::ProgressType::kCancelling) {
     static int iter = 0;
     iter = (iter + 1) % kCancelAnimationFrameDuration;
     const int num_dots = iter / 16;
-    label = ProgressLabel(progress.type) + std::string(num_dots, '.');
+    label = std::string(algorithm::Label(progress.type)) +
+            std::string(num_dots, '.');
   }
   ImGui::ProgressBar(progress_ratio, ImVec2(-1.0f, 0.f), label.c_str());
 }
@@ -493,7 +889,7 @@ Action DrawMatchesMenu(const std::vector<algorithm::Match>& matches,
       ImGui::TableNextColumn();
       ImGui::Text("%d, %d", matches[i].id1, matches[i].id2);
       ImGui::TableNextColumn();
-      ImGui::Text("%ld", matches[i].matches.size());
+      ImGui::Text("%d", algorithm::NumInliers(matches[i]));
       ImGui::TableNextColumn();
       ImGui::PushID(i);
       if (ImGui::SmallButton("Show")) {
@@ -534,6 +930,12 @@ Action DrawPanosMenu(const std::vector<algorithm::Pano>& panos,
 
     for (int i = 0; i < panos.size(); i++) {
       ImGui::TableNextColumn();
+      if (thumbnail_pane.DrawPanoThumbnail(
+              panos[i].ids, ImGui::GetContentRegionAvail().x,
+              kPanoThumbnailRows * ImGui::GetTextLineHeight()) &&
+          ImGui::IsItemHovered()) {
+        thumbnail_pane.ThumbnailTooltip(panos[i].ids);
+      }
       auto string = fmt::format("{}", fmt::join(panos[i].ids, ","));
       ImGui::TextUnformatted(string.c_str());
       ImGui::TableNextColumn();
@@ -5,12 +5,14 @@
 
 #include <algorithm>
 #include <cmath>
+#include <filesystem>
 #include <functional>
 #include <numeric>
 #include <vector>
 
 #include <imgui.h>
 #include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
 #include <spdlog/spdlog.h>
 
 #include "xpano/algorithm/image.h"
@@ -22,6 +24,27 @@
 
 namespace xpano::gui {
 
+namespace {
+
+// First index in [0, size) for which the predicate is false, it has to be
+// true for all the indices before it
+template <typename TPredicate>
+int PartitionPoint(int size, TPredicate predicate) {
+  int first = 0;
+  while (size > 0) {
+    const int half = size / 2;
+    if (predicate(first + half)) {
+      first += half + 1;
+      size -= half + 1;
+    } else {
+      size = half;
+    }
+  }
+  return first;
+}
+
+}  // namespace
+
 void HoverChecker::SetColor(int img_id) {
   const bool highlighted =
       std::find(highlighted_ids_.begin(), highlighted_ids_.end(), img_id) !=
@@ -121,38 +144,189 @@ ResizeChecker::Status ResizeChecker::Check(ImVec2 window_size) {
   return Status::kIdle;
 }
 
+bool ResizeChecker::IsResizing() const { return resizing_streak_ > 0; }
+
 ThumbnailPane::ThumbnailPane(backends::Base *backend) : backend_(backend) {}
 
+void ThumbnailPane::CreateAtlas(int num_images) {
+  atlas_side_ = 0;
+  while (atlas_side_ * atlas_side_ < num_images &&
+         atlas_side_ < kThumbnailPageSide) {
+    atlas_side_++;
+  }
+  const int page_slots = atlas_side_ * atlas_side_;
+  const int num_pages = (num_images + page_slots - 1) / page_slots;
+  atlas_size_ = utils::Vec2i{kThumbnailSize} * atlas_side_;
+  spdlog::info("Thumbnail texture size: {} x {}, {} pages", atlas_size_[0],
+               atlas_size_[1], num_pages);
+  pages_.resize(num_pages);
+  pending_uploads_.resize(num_images);
+}
+
+void ThumbnailPane::ClearAtlas() {
+  pages_.clear();
+  pending_uploads_.clear();
+  coords_.clear();
+  aspect_prefix_.clear();
+  pending_coords_.clear();
+  pending_slots_.clear();
+  first_input_slot_ = 0;
+}
+
+void ThumbnailPane::UpdateAspectPrefix() {
+  aspect_prefix_.resize(coords_.size() + 1);
+  aspect_prefix_[0] = 0.0f;
+  for (int i = 0; i < coords_.size(); i++) {
+    aspect_prefix_[i + 1] = aspect_prefix_[i] + coords_[i].aspect;
+  }
+}
+
+utils::Point2i ThumbnailPane::SlotOffset(int slot) const {
+  const int page_slot = slot % (atlas_side_ * atlas_side_);
+  auto tex_coord =
+      utils::Vec2i{kThumbnailSize} *
+      utils::Ratio2i{page_slot % atlas_side_, page_slot / atlas_side_};
+  return utils::Point2i{0} + tex_coord;
+}
+
+auto ThumbnailPane::SlotCoord(int slot, float aspect) const -> Coord {
+  auto thumbnail_size = utils::Vec2i{kThumbnailSize};
+  auto tex_coord = SlotOffset(slot) - utils::Point2i{0};
+  return {tex_coord / atlas_size_, (tex_coord + thumbnail_size) / atlas_size_,
+          aspect, slot};
+}
+
+ImTextureID ThumbnailPane::SlotTexture(int slot) const {
+  auto &page = pages_[slot / (atlas_side_ * atlas_side_)];
+  if (!page) {
+    page = backend_->CreateTexture(atlas_size_);
+  }
+  if (page && !pending_uploads_[slot].empty()) {
+    backend_->UpdateTextureRegion(page.get(), SlotOffset(slot),
+                                  pending_uploads_[slot]);
+    pending_uploads_[slot] = cv::Mat{};
+  }
+  return page.get();
+}
+
+utils::Point2i ThumbnailPane::PanoSlotOffset(int slot) {
+  const int page_slot =
+      slot % (kPanoThumbnailPageSide * kPanoThumbnailPageSide);
+  auto tex_coord = utils::Vec2i{kThumbnailSize} *
+                   utils::Ratio2i{page_slot % kPanoThumbnailPageSide,
+                                  page_slot / kPanoThumbnailPageSide};
+  return utils::Point2i{0} + tex_coord;
+}
+
+ImTextureID ThumbnailPane::PanoSlotTexture(int slot) const {
+  const int page_id =
+      slot / (kPanoThumbnailPageSide * kPanoThumbnailPageSide);
+  if (page_id >= static_cast<int>(pano_pages_.size())) {
+    pano_pages_.resize(page_id + 1);
+  }
+  auto &page = pano_pages_[page_id];
+  if (!page) {
+    page = backend_->CreateTexture(
+        utils::Vec2i{kThumbnailSize * kPanoThumbnailPageSide});
+  }
+  if (page && !pano_uploads_[slot].empty()) {
+    backend_->UpdateTextureRegion(page.get(), PanoSlotOffset(slot),
+                                  pano_uploads_[slot]);
+    pano_uploads_[slot] = cv::Mat{};
+  }
+  return page.get();
+}
+
+float ThumbnailPane::ItemStart(int coord_id) const {
+  const auto &style = ImGui::GetStyle();
+  return row_start_ + thumbnail_height_ * aspect_prefix_[coord_id] +
+         static_cast<float>(coord_id) *
+             (2 * style.FramePadding.x + style.ItemSpacing.x);
+}
+
+float ThumbnailPane::ItemCenter(int coord_id) const {
+  return (ItemStart(coord_id) + ItemStart(coord_id + 1)) / 2.0f;
+}
+
 void ThumbnailPane::Load(const std::vector<algorithm::Image> &images) {
   spdlog::info("Loading {} thumbnails", images.size());
-  const int num_images = static_cast<int>(images.size());
-  auto thumbnail_size = utils::Vec2i{kThumbnailSize};
-  int side = 0;
-  while (side * side < num_images) {
-    side++;
-  }
-  auto size = thumbnail_size * side;
-  spdlog::info("Thumbnail texture size: {} x {}", size[0], size[1]);
-  auto type = images[0].GetThumbnail().type();
-  const cv::Mat atlas{utils::CvSize(size), type};
-  for (int i = 0; i < images.size(); i++) {
-    auto tex_coord = thumbnail_size * utils::Ratio2i{i % side, i / side};
-    const auto preview = images[i].GetThumbnail();
-    preview.copyTo(
-        atlas(utils::CvRect(utils::Point2i{0} + tex_coord, thumbnail_size)));
-    const Coord coord{tex_coord / size, (tex_coord + thumbnail_size) / size,
-                      images[i].GetAspect()};
-    coords_.emplace_back(coord);
-  }
-  scroll_.resize(coords_.size());
-
-  tex_ = backend_->CreateTexture(size);
-  backend_->UpdateTexture(tex_.get(), atlas);
+
+  if (!pages_.empty() && !pending_slots_.empty()) {
+    // Reuse the progressively added thumbnails, the images kept by an append
+    // come first in their slots
+    const int num_images = static_cast<int>(images.size());
+    coords_.resize(std::min(first_input_slot_, num_images));
+    for (int i = first_input_slot_; i < num_images; i++) {
+      auto slot = pending_slots_.at(images[i].GetPath().string());
+      if (!pending_coords_[slot]) {
+        pending_uploads_[slot] = images[i].GetThumbnail();
+        pending_coords_[slot] = SlotCoord(slot, images[i].GetAspect());
+      }
+      coords_.emplace_back(*pending_coords_[slot]);
+    }
+    pending_coords_.clear();
+    pending_slots_.clear();
+    first_input_slot_ = 0;
+  } else {
+    ClearAtlas();
+    const int num_images = static_cast<int>(images.size());
+    CreateAtlas(num_images);
+    for (int i = 0; i < images.size(); i++) {
+      pending_uploads_[i] = images[i].GetThumbnail();
+      coords_.emplace_back(SlotCoord(i, images[i].GetAspect()));
+    }
+  }
+  UpdateAspectPrefix();
   spdlog::info("Thumbnails loaded successfully");
 }
 
+void ThumbnailPane::BeginLoading(
+    const std::vector<std::filesystem::path> &inputs) {
+  const int num_inputs = static_cast<int>(inputs.size());
+  CreateAtlas(num_inputs);
+  pending_coords_.resize(num_inputs);
+  for (int i = 0; i < num_inputs; i++) {
+    pending_slots_[inputs[i].string()] = i;
+  }
+}
+
+void ThumbnailPane::BeginAppending(
+    const std::vector<algorithm::Image> &images,
+    const std::vector<std::filesystem::path> &inputs) {
+  const int num_images = static_cast<int>(images.size());
+  const int num_inputs = static_cast<int>(inputs.size());
+  ClearAtlas();
+  CreateAtlas(num_images + num_inputs);
+  // The atlas layout depends on the number of slots, the kept thumbnails are
+  // uploaded again
+  for (int i = 0; i < num_images; i++) {
+    pending_uploads_[i] = images[i].GetThumbnail();
+    coords_.emplace_back(SlotCoord(i, images[i].GetAspect()));
+  }
+  UpdateAspectPrefix();
+  pending_coords_.resize(num_images + num_inputs);
+  first_input_slot_ = num_images;
+  for (int i = 0; i < num_inputs; i++) {
+    pending_slots_[inputs[i].string()] = num_images + i;
+  }
+}
+
+void ThumbnailPane::AddThumbnail(int input_id, const cv::Mat &thumbnail,
+                                 float aspect) {
+  const int slot = first_input_slot_ + input_id;
+  if (pages_.empty() || slot >= pending_coords_.size()) {
+    return;
+  }
+  pending_uploads_[slot] = thumbnail;
+  pending_coords_[slot] = SlotCoord(slot, aspect);
+}
+
 bool ThumbnailPane::Loaded() const { return !coords_.empty(); }
 
+bool ThumbnailPane::IsAnimating() const {
+  return auto_scroller_.NeedsRescroll() || resize_checker_.IsResizing();
+}
+
 Action ThumbnailPane::Draw() {
   ImGui::Begin("Images", nullptr, ImGuiWindowFlags_AlwaysHorizontalScrollbar);
   Action action{};
@@ -170,31 +344,63 @@ Action ThumbnailPane::Draw() {
     }
   }
 
-  for (int coord_id = 0; coord_id < coords_.size(); coord_id++) {
+  if (Loaded()) {
+    DrawVisible(&action);
+  }
+
+  // The appended thumbnails follow the loaded ones
+  if (!pending_coords_.empty()) {
+    if (Loaded()) {
+      ImGui::SameLine();
+    }
+    DrawPending();
+  }
+
+  if (ImGui::IsWindowHovered()) {
+    if (const float mouse_wheel = io_.MouseWheel; mouse_wheel != 0) {
+      auto_scroller_.SetScrollTargetRelative(-1 * mouse_wheel * kScrollingStep);
+    }
+  }
+  ImGui::End();
+
+  return action;
+}
+
+// The thumbnails have the same height, their positions follow from the sum
+// of the aspects before them
+void ThumbnailPane::DrawVisible(Action *action) {
+  const int num_coords = static_cast<int>(coords_.size());
+  row_start_ = ImGui::GetCursorPosX();
+  const float visible_start = ImGui::GetScrollX();
+  const float visible_end = visible_start + ImGui::GetWindowWidth();
+  const int first = PartitionPoint(num_coords, [this, visible_start](int id) {
+    return ItemStart(id + 1) <= visible_start;
+  });
+  const int end = PartitionPoint(num_coords, [this, visible_end](int id) {
+    return ItemStart(id) < visible_end;
+  });
+
+  if (first < end) {
+    ImGui::SetCursorPosX(ItemStart(first));
+  }
+  for (int coord_id = first; coord_id < end; coord_id++) {
     ImGui::PushID(coord_id);
     hover_checker_.SetColor(coord_id);
-    const float scroll_pre = ImGui::GetCursorPosX();
     if (ThumbnailButton(coord_id)) {
       if (io_.KeyCtrl) {
-        action = {ActionType::kModifyPano, coord_id};
+        *action = {ActionType::kModifyPano, coord_id};
       } else {
-        action = {ActionType::kShowImage, coord_id};
+        *action = {ActionType::kShowImage, coord_id};
       }
     }
     hover_checker_.ResetColor(coord_id, io_.KeyCtrl);
     ImGui::PopID();
     ImGui::SameLine();
-    scroll_[coord_id] = (scroll_pre + ImGui::GetCursorPosX()) / 2.0f;
-  }
-
-  if (ImGui::IsWindowHovered()) {
-    if (const float mouse_wheel = io_.MouseWheel; mouse_wheel != 0) {
-      auto_scroller_.SetScrollTargetRelative(-1 * mouse_wheel * kScrollingStep);
-    }
   }
-  ImGui::End();
 
-  return action;
+  // Keeps the scroll range of the whole row
+  ImGui::SetCursorPosX(ItemStart(num_coords) - ImGui::GetStyle().ItemSpacing.x);
+  ImGui::Dummy(ImVec2(0.0f, 0.0f));
 }
 
 void ThumbnailPane::ThumbnailTooltip(const std::vector<int> &images) const {
@@ -211,14 +417,66 @@ void ThumbnailPane::ThumbnailTooltip(const std::vector<int> &images) const {
   ImGui::EndTooltip();
 }
 
+void ThumbnailPane::AddPanoThumbnail(const std::vector<int> &ids,
+                                     const cv::Mat &thumbnail) {
+  if (thumbnail.empty()) {
+    return;
+  }
+  auto [coord, inserted] = pano_coords_.try_emplace(ids);
+  if (inserted) {
+    coord->second.slot = static_cast<int>(pano_uploads_.size());
+    pano_uploads_.emplace_back();
+  }
+  const int slot = coord->second.slot;
+  // Stretched to the square slot as the image thumbnails, drawn with the
+  // aspect
+  cv::resize(thumbnail, pano_uploads_[slot],
+             cv::Size(kThumbnailSize, kThumbnailSize), 0, 0, cv::INTER_AREA);
+  auto page_size = utils::Vec2i{kThumbnailSize * kPanoThumbnailPageSide};
+  auto tex_coord = PanoSlotOffset(slot) - utils::Point2i{0};
+  coord->second = {
+      tex_coord / page_size,
+      (tex_coord + utils::Vec2i{kThumbnailSize}) / page_size,
+      static_cast<float>(thumbnail.cols) / static_cast<float>(thumbnail.rows),
+      slot};
+}
+
+bool ThumbnailPane::HasPanoThumbnail(const std::vector<int> &ids) const {
+  return pano_coords_.contains(ids);
+}
+
+bool ThumbnailPane::DrawPanoThumbnail(const std::vector<int> &ids,
+                                      float max_width, float height) const {
+  auto coord = pano_coords_.find(ids);
+  if (coord == pano_coords_.end()) {
+    return false;
+  }
+  const auto &[uv0, uv1, aspect, slot] = coord->second;
+  const float width = std::min(max_width, height * aspect);
+  ImGui::Image(PanoSlotTexture(slot), ImVec2(width, width / aspect),
+               utils::ImVec(uv0), utils::ImVec(uv1));
+  return true;
+}
+
 bool ThumbnailPane::ThumbnailButton(int img_id) const {
   const auto &coord = coords_[img_id];
   return ImGui::ImageButton(
-      "", tex_.get(),
+      "", SlotTexture(coord.slot),
       ImVec2(thumbnail_height_ * coord.aspect, thumbnail_height_),
       utils::ImVec(coord.uv0), utils::ImVec(coord.uv1));
 }
 
+void ThumbnailPane::DrawPending() const {
+  for (const auto &coord : pending_coords_) {
+    if (coord) {
+      ImGui::Image(SlotTexture(coord->slot),
+                   ImVec2(thumbnail_height_ * coord->aspect, thumbnail_height_),
+                   utils::ImVec(coord->uv0), utils::ImVec(coord->uv1));
+      ImGui::SameLine();
+    }
+  }
+}
+
 void ThumbnailPane::SetScrollX(int img_id) {
   SetScrollX(std::vector<int>({img_id}));
 }
@@ -228,7 +486,7 @@ void ThumbnailPane::SetScrollX(int id1, int id2) {
 void ThumbnailPane::SetScrollX(const std::vector<int> &ids) {
   const float scroll =
       std::transform_reduce(ids.begin(), ids.end(), 0.0f, std::plus<>(),
-                            [this](int index) { return scroll_[index]; }) /
+                            [this](int index) { return ItemCenter(index); }) /
       static_cast<float>(ids.size());
 
   ImGui::Begin("Images");
@@ -248,9 +506,10 @@ void ThumbnailPane::Highlight(const std::vector<int> &ids) {
 void ThumbnailPane::DisableHighlight() { hover_checker_.DisableHighlight(); }
 
 void ThumbnailPane::Reset() {
-  tex_.reset(nullptr);
-  coords_.resize(0);
-  scroll_.resize(0);
+  ClearAtlas();
+  pano_coords_.clear();
+  pano_pages_.clear();
+  pano_uploads_.clear();
   hover_checker_ = HoverChecker{};
 }
 
@@ -4,9 +4,15 @@
 #pragma once
 
 #include <cstdint>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <imgui.h>
+#include <opencv2/core.hpp>
 
 #include "xpano/algorithm/image.h"
 #include "xpano/constants.h"
@@ -61,6 +67,7 @@ class ResizeChecker {
 
   explicit ResizeChecker(int delay = kResizingDelayFrames);
   Status Check(ImVec2 window_size);
+  [[nodiscard]] bool IsResizing() const;
 
  private:
   const int delay_;
@@ -74,17 +81,41 @@ class ThumbnailPane {
     utils::Ratio2f uv0;
     utils::Ratio2f uv1;
     float aspect;
+    int slot;
   };
 
  public:
   explicit ThumbnailPane(backends::Base *backend);
   void Load(const std::vector<algorithm::Image> &images);
+
+  // Progressive loading: the atlas slots are reserved for all inputs up front
+  // and thumbnails are added one by one as they arrive. They are shown
+  // without interaction until Load is called with the final list of images.
+  void BeginLoading(const std::vector<std::filesystem::path> &inputs);
+  // Appending: the loaded images stay interactive, the slots of the appended
+  // inputs are reserved after them and their thumbnails are drawn at the end
+  // of the row until Load is called with the final list of images.
+  void BeginAppending(const std::vector<algorithm::Image> &images,
+                      const std::vector<std::filesystem::path> &inputs);
+  void AddThumbnail(int input_id, const cv::Mat &thumbnail, float aspect);
+
   [[nodiscard]] bool Loaded() const;
+  // Scrolling or waiting for the resizing to settle over the next frames
+  [[nodiscard]] bool IsAnimating() const;
 
   Action Draw();
 
   void ThumbnailTooltip(const std::vector<int> &images) const;
 
+  // Mini pano of the pano with the image ids, kept in an atlas of its own
+  // until Reset, see pipeline::StitcherPipeline::RunPanoThumbnails
+  void AddPanoThumbnail(const std::vector<int> &ids, const cv::Mat &thumbnail);
+  [[nodiscard]] bool HasPanoThumbnail(const std::vector<int> &ids) const;
+  // Fits the width, false if the pano has no mini pano yet
+  // NOLINTNEXTLINE(modernize-use-nodiscard)
+  bool DrawPanoThumbnail(const std::vector<int> &ids, float max_width,
+                         float height) const;
+
   void SetScrollX(int img_id);
   void SetScrollX(int id1, int id2);
   void SetScrollX(const std::vector<int> &ids);
@@ -99,18 +130,51 @@ class ThumbnailPane {
  private:
   // NOLINTNEXTLINE(modernize-use-nodiscard)
   bool ThumbnailButton(int img_id) const;
+  void DrawPending() const;
+  void DrawVisible(Action *action);
+
+  void CreateAtlas(int num_images);
+  void ClearAtlas();
+  void UpdateAspectPrefix();
+  [[nodiscard]] utils::Point2i SlotOffset(int slot) const;
+  [[nodiscard]] Coord SlotCoord(int slot, float aspect) const;
+  // Creates the page and uploads the thumbnail on first use
+  [[nodiscard]] ImTextureID SlotTexture(int slot) const;
+  [[nodiscard]] static utils::Point2i PanoSlotOffset(int slot);
+  [[nodiscard]] ImTextureID PanoSlotTexture(int slot) const;
+
+  // Layout of the thumbnail row, in the cursor coordinates of the window
+  [[nodiscard]] float ItemStart(int coord_id) const;
+  [[nodiscard]] float ItemCenter(int coord_id) const;
 
   std::vector<Coord> coords_;
-  std::vector<float> scroll_;
+  std::vector<std::optional<Coord>> pending_coords_;
+  std::unordered_map<std::string, int> pending_slots_;
+  // Slot of the first progressively loaded input, after the kept images when
+  // appending
+  int first_input_slot_ = 0;
+  // Sum of the aspects of the thumbnails before each one
+  std::vector<float> aspect_prefix_;
+  float row_start_ = 0.0f;
 
   AutoScroller auto_scroller_;
   ResizeChecker resize_checker_;
 
   float thumbnail_height_ = 0.0f;
+  int atlas_side_ = 0;
+  utils::Vec2i atlas_size_ = {0};
 
   HoverChecker hover_checker_;
 
-  backends::Texture tex_;
+  // Pages of atlas_side_ x atlas_side_ slots. Only the drawn thumbnails are
+  // uploaded, also from the const tooltips, the rest waits in the slots.
+  mutable std::vector<backends::Texture> pages_;
+  mutable std::vector<cv::Mat> pending_uploads_;
+  // Pages of kPanoThumbnailPageSide x kPanoThumbnailPageSide slots, by the
+  // pano image ids
+  std::map<std::vector<int>, Coord> pano_coords_;
+  mutable std::vector<backends::Texture> pano_pages_;
+  mutable std::vector<cv::Mat> pano_uploads_;
   backends::Base *backend_;
 
   ImGuiIO &io_ = ImGui::GetIO();
@@ -0,0 +1,207 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/gui/panels/tiled_image.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <exception>
+#include <future>
+#include <memory>
+#include <set>
+#include <utility>
+
+#include <imgui.h>
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <spdlog/spdlog.h>
+
+#include "xpano/constants.h"
+#include "xpano/gui/backends/base.h"
+#include "xpano/utils/future.h"
+#include "xpano/utils/rect.h"
+#include "xpano/utils/vec.h"
+#include "xpano/utils/vec_converters.h"
+
+namespace xpano::gui {
+
+namespace {
+
+// Full resolution pixels covered by the tile
+cv::Rect TileRect(const TileKey& key, cv::Size image_size) {
+  const int span = kTileSize << key.level;
+  return cv::Rect(key.col * span, key.row * span, span, span) &
+         cv::Rect(cv::Point(0, 0), image_size);
+}
+
+cv::Mat RenderTile(const cv::Mat& image, const TileKey& key) {
+  const cv::Rect rect = TileRect(key, image.size());
+  if (key.level == 0) {
+    return image(rect).clone();
+  }
+  const int scale = 1 << key.level;
+  const cv::Size size((rect.width + scale - 1) / scale,
+                      (rect.height + scale - 1) / scale);
+  cv::Mat tile;
+  cv::resize(image(rect), tile, size, 0, 0, cv::INTER_AREA);
+  return tile;
+}
+
+}  // namespace
+
+TiledImage::TiledImage(backends::Base* backend) : backend_(backend) {}
+
+void TiledImage::Load(cv::Mat image) {
+  Reset();
+  image_ = std::move(image);
+}
+
+void TiledImage::Reset() {
+  DropPendingTiles();
+  tile_index_.clear();
+  tiles_.clear();
+  image_ = cv::Mat{};
+}
+
+bool TiledImage::Empty() const { return image_.empty(); }
+
+void TiledImage::Draw(const utils::RectPVf& image, const utils::RectPPf& clip,
+                      float base_scale) {
+  UploadReadyTiles();
+  if (Empty() || image.size[0] <= 0.0f) {
+    return;
+  }
+
+  // Screen pixels per image pixel, the texture is enough when zoomed out
+  const float screen_scale = image.size[0] / static_cast<float>(image_.cols);
+  const int level =
+      std::max(0, static_cast<int>(std::floor(-std::log2(screen_scale))));
+  if (std::ldexp(1.0f, -level) <= base_scale) {
+    DropPendingTiles();
+    return;
+  }
+
+  // Visible image pixels
+  const float left = (clip.start[0] - image.start[0]) / screen_scale;
+  const float top = (clip.start[1] - image.start[1]) / screen_scale;
+  const float right = (clip.end[0] - image.start[0]) / screen_scale;
+  const float bottom = (clip.end[1] - image.start[1]) / screen_scale;
+  const int span = kTileSize << level;
+  const int num_cols = (image_.cols + span - 1) / span;
+  const int num_rows = (image_.rows + span - 1) / span;
+  const int first_col = std::clamp(static_cast<int>(left) / span, 0, num_cols);
+  const int first_row = std::clamp(static_cast<int>(top) / span, 0, num_rows);
+  const int end_col = std::clamp(
+      static_cast<int>(std::ceil(right / static_cast<float>(span))), 0,
+      num_cols);
+  const int end_row = std::clamp(
+      static_cast<int>(std::ceil(bottom / static_cast<float>(span))), 0,
+      num_rows);
+
+  auto* draw_list = ImGui::GetWindowDrawList();
+  draw_list->PushClipRect(utils::ImVec(clip.start), utils::ImVec(clip.end),
+                          true);
+  std::set<TileKey> visible;
+  for (int row = first_row; row < end_row; row++) {
+    for (int col = first_col; col < end_col; col++) {
+      const TileKey key = {level, col, row};
+      visible.insert(key);
+      auto tile = tile_index_.find(key);
+      if (tile == tile_index_.end()) {
+        QueueTile(key);
+        continue;
+      }
+      tiles_.splice(tiles_.begin(), tiles_, tile->second);
+
+      const cv::Rect rect = TileRect(key, image_.size());
+      const ImVec2 start = {image.start[0] + rect.x * screen_scale,
+                            image.start[1] + rect.y * screen_scale};
+      const ImVec2 end = {start.x + rect.width * screen_scale,
+                          start.y + rect.height * screen_scale};
+      const auto& size = tile->second->size;
+      draw_list->AddImage(tile->second->tex.get(), start, end, {0.0f, 0.0f},
+                          {static_cast<float>(size[0]) / kTileSize,
+                           static_cast<float>(size[1]) / kTileSize});
+    }
+  }
+  draw_list->PopClipRect();
+
+  // Panned or zoomed away before the tiles were generated
+  for (auto pending = pending_.begin(); pending != pending_.end();) {
+    if (visible.contains(pending->first)) {
+      pending++;
+      continue;
+    }
+    *pending->second.dropped = true;
+    pending = pending_.erase(pending);
+  }
+}
+
+void TiledImage::UploadReadyTiles() {
+  for (auto pending = pending_.begin(); pending != pending_.end();) {
+    if (!utils::future::IsReady(pending->second.future)) {
+      pending++;
+      continue;
+    }
+    const TileKey key = pending->first;
+    cv::Mat image;
+    try {
+      image = pending->second.future.get();
+    } catch (const std::exception& e) {
+      spdlog::error("Failed to generate a preview tile: {}", e.what());
+    }
+    pending = pending_.erase(pending);
+    if (image.empty()) {
+      continue;
+    }
+
+    // Reuses the texture of the least recently drawn tile
+    backends::Texture tex;
+    if (tiles_.size() >= kMaxTileTextures) {
+      tex = std::move(tiles_.back().tex);
+      tile_index_.erase(tiles_.back().key);
+      tiles_.pop_back();
+    } else {
+      tex = backend_->CreateTexture(utils::Vec2i{kTileSize});
+    }
+    if (!tex) {
+      continue;
+    }
+    backend_->UpdateTexture(tex.get(), image);
+    tiles_.push_front({.key = key,
+                       .tex = std::move(tex),
+                       .size = utils::ToIntVec(image.size)});
+    tile_index_[key] = tiles_.begin();
+  }
+}
+
+void TiledImage::QueueTile(const TileKey& key) {
+  if (pending_.contains(key) || pending_.size() >= kMaxPendingTiles) {
+    return;
+  }
+  auto dropped = std::make_shared<std::atomic_bool>(false);
+  auto promise = std::make_shared<std::promise<cv::Mat>>();
+  pending_[key] = {.future = promise->get_future(), .dropped = dropped};
+  workers_.push_task(
+      [image = image_, key, promise, dropped, backend = backend_]() {
+        if (*dropped) {
+          return;
+        }
+        try {
+          promise->set_value(RenderTile(image, key));
+        } catch (...) {
+          promise->set_exception(std::current_exception());
+        }
+        backend->WakeUp();
+      });
+}
+
+void TiledImage::DropPendingTiles() {
+  for (auto& [key, pending] : pending_) {
+    *pending.dropped = true;
+  }
+  pending_.clear();
+}
+
+}  // namespace xpano::gui
@@ -0,0 +1,81 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <atomic>
+#include <compare>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/gui/backends/base.h"
+#include "xpano/utils/rect.h"
+#include "xpano/utils/threadpool.h"
+#include "xpano/utils/vec.h"
+
+namespace xpano::gui {
+
+struct TileKey {
+  int level;
+  int col;
+  int row;
+
+  auto operator<=>(const TileKey&) const = default;
+};
+
+// Pyramid of kTileSize tiles of a large image, drawn over the preview
+// texture once the texture gets blurry:
+//  - Level 0 is the full image, each next level is halved. The level used is
+//    the coarsest one with at least one pixel per screen pixel.
+//  - Only the visible tiles are generated, on the worker threads, the tiles
+//    out of view are dropped before they are generated.
+//  - The uploaded tiles are kept in an LRU of kMaxTileTextures textures.
+class TiledImage {
+ public:
+  explicit TiledImage(backends::Base* backend);
+  TiledImage(const TiledImage&) = delete;
+  TiledImage& operator=(const TiledImage&) = delete;
+
+  // BGR image, shared with the caller, it shouldn't be modified
+  void Load(cv::Mat image);
+  void Reset();
+  [[nodiscard]] bool Empty() const;
+
+  // image is the screen rect of the whole image, drawn only within clip.
+  // base_scale is the pixels of the underlying texture per image pixel.
+  void Draw(const utils::RectPVf& image, const utils::RectPPf& clip,
+            float base_scale);
+
+ private:
+  struct Tile {
+    TileKey key;
+    backends::Texture tex;
+    utils::Vec2i size;
+  };
+
+  struct PendingTile {
+    std::future<cv::Mat> future;
+    std::shared_ptr<std::atomic_bool> dropped;
+  };
+
+  void UploadReadyTiles();
+  void QueueTile(const TileKey& key);
+  void DropPendingTiles();
+
+  cv::Mat image_;
+
+  // Most recently drawn first
+  std::list<Tile> tiles_;
+  std::map<TileKey, std::list<Tile>::iterator> tile_index_;
+  std::map<TileKey, PendingTile> pending_;
+
+  backends::Base* backend_;
+  // Last, the queued tiles are done before the rest is destroyed
+  utils::mt::Threadpool workers_;
+};
+
+}  // namespace xpano::gui
@@ -8,6 +8,7 @@
 #include <algorithm>
 #include <exception>
 #include <filesystem>
+#include <functional>
 #include <future>
 #include <optional>
 #include <string>
@@ -35,11 +36,14 @@
 #include "xpano/gui/shortcut.h"
 #include "xpano/log/logger.h"
 #include "xpano/pipeline/options.h"
+#include "xpano/pipeline/project.h"
+#include "xpano/pipeline/resources.h"
 #include "xpano/pipeline/stitcher_pipeline.h"
 #include "xpano/utils/common.h"
 #include "xpano/utils/config.h"
 #include "xpano/utils/fmt.h"
 #include "xpano/utils/imgui_.h"
+#include "xpano/utils/parallel_for.h"
 #include "xpano/utils/text.h"
 #include "xpano/version.h"
 
@@ -84,6 +88,19 @@ std::string PreviewMessage(const Selection& selection, ImageType image_type) {
   }
 }
 
+int SelectedPanoId(const Selection& selection) {
+  return selection.type == SelectionType::kPano ? selection.target_id : -1;
+}
+
+// The pano a result was computed for still exists, a background export may
+// finish after the panos were regrouped or images appended
+bool IsCurrentPano(const std::optional<pipeline::StitcherData>& stitcher_data,
+                   int pano_id, const std::vector<int>& ids) {
+  return stitcher_data && pano_id >= 0 &&
+         pano_id < static_cast<int>(stitcher_data->panos.size()) &&
+         stitcher_data->panos[pano_id].ids == ids;
+}
+
 Action ModifyPano(int clicked_image, Selection* selection,
                   std::vector<algorithm::Pano>* panos) {
   // Nothing was selected and an image was ctrl clicked
@@ -95,12 +112,19 @@ Action ModifyPano(int clicked_image, Selection* selection,
   // Existing pano is being edited
   if (selection->type == SelectionType::kPano) {
     auto& pano = panos->at(selection->target_id);
+    const auto old_ids = pano.ids;
     auto iter = std::find(pano.ids.begin(), pano.ids.end(), clicked_image);
     if (iter == pano.ids.end()) {
       pano.ids.push_back(clicked_image);
     } else {
       pano.ids.erase(iter);
     }
+    // The next stitch starts from the cameras of the remaining images
+    const auto cameras =
+        pano.cameras ? algorithm::PerImageCameras(
+                           *pano.cameras, static_cast<int>(old_ids.size()))
+                     : pano.initial_cameras;
+    pano.initial_cameras = algorithm::KeepCameras(cameras, old_ids, pano.ids);
     // Pano was deleted
     if (pano.ids.empty()) {
       auto pano_iter = panos->begin() + selection->target_id;
@@ -158,8 +182,11 @@ auto ResolveStitcherDataFuture(
 }
 
 auto ResolveStitchingResultFuture(
-    std::future<pipeline::StitchingResult> pano_future, PreviewPane* plot_pane,
-    StatusMessage* status_message) -> pipeline::StitchingResult {
+    std::future<pipeline::StitchingResult> pano_future,
+    const std::optional<pipeline::StitcherData>& stitcher_data,
+    int selected_pano_id, PreviewPane* plot_pane,
+    StatusMessage* status_message)
+    -> pipeline::StitchingResult {
   pipeline::StitchingResult result;
   try {
     result = pano_future.get();
@@ -169,6 +196,16 @@ auto ResolveStitchingResultFuture(
     plot_pane->Reset();
     return {};
   }
+  if (result.coarse) {
+    // Only a stand in until the preview is ready
+    if (result.pano) {
+      if (!plot_pane->IsRotateEnabled()) {
+        plot_pane->Reset();
+      }
+      plot_pane->Reload(*result.pano, ImageType::kPanoPreview);
+    }
+    return result;
+  }
   if (!result.pano) {
     *status_message = {fmt::format("Failed to stitch pano {}", result.pano_id),
                        algorithm::ToString(result.status)};
@@ -183,16 +220,33 @@ auto ResolveStitchingResultFuture(
       fmt::format("Stitched pano {} successfully", result.pano_id)};
   spdlog::info(*status_message);
 
+  // Only the exported crop or a background export of another pano, keep
+  // showing what is shown
+  const bool shown =
+      result.pano_id == selected_pano_id &&
+      IsCurrentPano(stitcher_data, result.pano_id, result.ids);
+  if (result.cropped || (result.export_path && !shown)) {
+    if (result.export_path) {
+      *status_message = {
+          fmt::format("Exported pano {} successfully", result.pano_id),
+          result.export_path->string()};
+      spdlog::info(*status_message);
+    }
+    return result;
+  }
+
   if (!plot_pane->IsRotateEnabled() || result.full_res) {
     plot_pane->Reset();
   }
 
   if (result.cameras) {
-    plot_pane->SetCameras(*result.cameras);
+    plot_pane->SetCameras(*result.cameras, *result.pano);
   }
 
-  plot_pane->Reload(*result.pano, result.full_res ? ImageType::kPanoFullRes
-                                                  : ImageType::kPanoPreview);
+  plot_pane->Reload(*result.pano,
+                    result.full_res ? ImageType::kPanoFullRes
+                                    : ImageType::kPanoPreview,
+                    result.display);
 
   if (result.auto_crop) {
     plot_pane->SetSuggestedCrop(*result.auto_crop);
@@ -208,9 +262,12 @@ auto ResolveStitchingResultFuture(
   return result;
 }
 
-auto ResolveExportFuture(std::future<pipeline::ExportResult> export_future,
-                         PreviewPane* plot_pane,
-                         StatusMessage* status_message) -> std::optional<int> {
+// The id of the exported pano, empty if it failed or the pano is gone
+auto ResolveExportFuture(
+    std::future<pipeline::ExportResult> export_future,
+    const std::optional<pipeline::StitcherData>& stitcher_data,
+    int selected_pano_id, PreviewPane* plot_pane,
+    StatusMessage* status_message) -> std::optional<int> {
   pipeline::ExportResult result;
   try {
     result = export_future.get();
@@ -225,7 +282,12 @@ auto ResolveExportFuture(std::future<pipeline::ExportResult> export_future,
         fmt::format("Exported pano {} successfully", result.pano_id),
         result.export_path->string()};
     spdlog::info(*status_message);
-    plot_pane->EndCrop();
+    if (!IsCurrentPano(stitcher_data, result.pano_id, result.ids)) {
+      return {};
+    }
+    if (result.pano_id == selected_pano_id) {
+      plot_pane->EndCrop();
+    }
     return result.pano_id;
   }
   return {};
@@ -275,17 +337,40 @@ const algorithm::Image* FirstImage(const pipeline::StitcherData& stitcher_data,
   return &stitcher_data.images.at(pano.ids.at(0));
 }
 
+std::optional<algorithm::GridOptions> StitchingGrid(
+    const pipeline::MatchingOptions& matching) {
+  if (matching.type != pipeline::MatchingType::kGrid) {
+    return std::nullopt;
+  }
+  return matching.grid;
+}
+
+// The match inliers are needed only by the debug views
+pipeline::MatchingOptions LoadingMatching(pipeline::MatchingOptions matching,
+                                          bool debug_enabled) {
+  matching.release_inliers = !debug_enabled;
+  return matching;
+}
+
 }  // namespace
 
 PanoGui::PanoGui(backends::Base* backend, logger::Logger* logger,
                  const utils::config::Config& config,
-                 std::future<utils::Texts> licenses, const cli::Args& args)
+                 std::function<utils::Texts()> load_licenses,
+                 const cli::Args& args)
     : options_(config.user_options),
       log_pane_(logger),
-      about_pane_(std::move(licenses)),
+      about_pane_(std::move(load_licenses)),
       bugreport_pane_(logger),
+      perf_pane_(&stitcher_pipeline_),
       plot_pane_(backend),
-      thumbnail_pane_(backend) {
+      thumbnail_pane_(backend),
+      stitcher_pipeline_(pipeline::FitToMemoryBudget(
+          {.feature_cache_dir = config.feature_cache_path,
+           .mapped_frames_dir = args.mapped_frames_dir,
+           .pool = utils::mt::SharedPool(),
+           .on_task_done = [backend]() { backend->WakeUp(); }},
+          args.max_memory_mb.value_or(0))) {
   if (config.app_state.xpano_version != version::Current()) {
     warning_pane_.QueueNewVersion(config.app_state.xpano_version,
                                   about_pane_.GetText(kChangelogFilename));
@@ -328,6 +413,7 @@ Action PanoGui::DrawGui() {
   log_pane_.Draw();
   about_pane_.Draw();
   bugreport_pane_.Draw();
+  perf_pane_.Draw();
   warning_pane_.Draw();
   return action;
 }
@@ -353,12 +439,15 @@ Action PanoGui::DrawSidebar() {
     ImGui::SameLine();
   }
   DrawInfoMessage(status_message_);
+  for (const auto& export_progress : stitcher_pipeline_.GetExportProgress()) {
+    ImGui::Text("Exporting pano %d", export_progress.pano_id);
+    DrawProgressBar(export_progress.report);
+  }
 
   ImGui::Separator();
   ImGui::BeginChild("Panos");
   if (stitcher_data_) {
-    auto highlight_id =
-        selection_.type == SelectionType::kPano ? selection_.target_id : -1;
+    auto highlight_id = SelectedPanoId(selection_);
     action |=
         DrawPanosMenu(stitcher_data_->panos, thumbnail_pane_, highlight_id);
     if (IsDebugEnabled()) {
@@ -380,7 +469,7 @@ void PanoGui::Reset() {
   plot_pane_.Reset();
   selection_ = {};
   status_message_ = {};
-  pano_mask_ = cv::Mat{};
+  pano_mask_.reset();
   // Order of the following lines is important
   stitcher_pipeline_.CancelAndWait();
   stitcher_data_.reset();
@@ -425,27 +514,98 @@ Action PanoGui::PerformAction(const Action& action) {
     }
     case ActionType::kOpenDirectory:
       [[fallthrough]];
-    case ActionType::kOpenFiles: {
+    case ActionType::kOpenFiles:
+      [[fallthrough]];
+    case ActionType::kAddFiles: {
       auto files = file_dialog::Open(action);
       if (!files) {
         spdlog::warn(files.error());
         warning_pane_.QueueFilePickerError(files.error());
         break;
       }
-      return {.type = ActionType::kLoadFiles, .delayed = true, .extra = *files};
+      auto type = action.type == ActionType::kAddFiles
+                      ? ActionType::kAppendFiles
+                      : ActionType::kLoadFiles;
+      return {.type = type, .delayed = true, .extra = *files};
+    }
+    case ActionType::kOpenProject: {
+      auto path = file_dialog::OpenProject();
+      if (!path) {
+        spdlog::warn(path.error());
+        warning_pane_.QueueFilePickerError(path.error());
+        break;
+      }
+      if (auto options = pipeline::LoadProjectOptions(*path); options) {
+        options_ = *options;
+      }
+      Reset();
+      stitcher_pipeline_.RunOpenProject(*path);
+      break;
+    }
+    case ActionType::kSaveProject: {
+      if (!stitcher_data_) {
+        break;
+      }
+      const auto& first_path = stitcher_data_->images[0].GetPath();
+      auto path = file_dialog::SaveProject(fmt::format(
+          "{}.{}", first_path.stem().string(), kProjectExtensions[0]));
+      if (!path) {
+        spdlog::warn(path.error());
+        warning_pane_.QueueFilePickerError(path.error());
+        break;
+      }
+      if (pipeline::SaveProject(*path, *stitcher_data_, options_)) {
+        status_message_ = {fmt::format("Saved project {}", path->string())};
+        spdlog::info(status_message_);
+      } else {
+        status_message_ = {"Couldn't save the project", path->string()};
+        spdlog::error(status_message_);
+      }
+      break;
+    }
+    case ActionType::kAppendFiles: {
+      auto files = ValueOrDefault<LoadFilesExtra>(action);
+      if (files.empty()) {
+        break;
+      }
+      if (!stitcher_data_) {
+        return {
+            .type = ActionType::kLoadFiles, .delayed = true, .extra = files};
+      }
+      spdlog::info("Adding {} images", files.size());
+      status_message_ = {};
+      stitcher_pipeline_.RunAppending(
+          *stitcher_data_, files, options_.loading,
+          LoadingMatching(options_.matching, IsDebugEnabled()));
+      thumbnail_pane_.BeginAppending(stitcher_data_->images, files);
+      break;
+    }
+    case ActionType::kRegroupPanos: {
+      if (!stitcher_data_ || stitcher_data_->matches.empty()) {
+        break;
+      }
+      spdlog::info("Regrouping {} images", stitcher_data_->images.size());
+      status_message_ = {};
+      stitcher_pipeline_.RunRegrouping(*stitcher_data_, options_.matching);
+      break;
     }
     case ActionType::kLoadFiles: {
       if (auto files = ValueOrDefault<LoadFilesExtra>(action); !files.empty()) {
         Reset();
-        stitcher_pipeline_.RunLoading(files, options_.loading,
-                                      options_.matching);
+        stitcher_pipeline_.RunLoading(
+            files, options_.loading,
+            LoadingMatching(options_.matching, IsDebugEnabled()));
+        thumbnail_pane_.BeginLoading(files);
       }
       break;
     }
     case ActionType::kShowMatch: {
       selection_ = {SelectionType::kMatch, action.target_id};
       spdlog::info("Clicked match {}", action.target_id);
-      const auto& match = stitcher_data_->matches[action.target_id];
+      const auto& stored = stitcher_data_->matches[action.target_id];
+      const auto match = algorithm::RestoreInliers(
+          stored, stitcher_data_->images[stored.id1],
+          stitcher_data_->images[stored.id2]);
       spdlog::info("Match distance {}", match.avg_shift);
       auto img = DrawMatches(match, stitcher_data_->images);
       plot_pane_.Load(img, ImageType::kMatch);
@@ -462,14 +622,21 @@ Action PanoGui::PerformAction(const Action& action) {
       if (extra.reset_cameras) {
         pano.cameras.reset();
         pano.backup_cameras.reset();
+        pano.session.reset();
       }
       if (extra.reset_crop) {
         pano.crop.reset();
       }
-      stitcher_pipeline_.RunStitching(*stitcher_data_,
-                                      {.pano_id = selection_.target_id,
-                                       .full_res = extra.full_res,
-                                       .stitch_algorithm = options_.stitch});
+      stitched_options_ = options_;
+      stitcher_pipeline_.RunStitching(
+          *stitcher_data_,
+          {.pano_id = selection_.target_id,
+           .full_res = extra.full_res,
+           .stitch_algorithm = options_.stitch,
+           .match_threshold = options_.matching.match_threshold,
+           .grid = StitchingGrid(options_.matching),
+           .progressive = true,
+           .display_longer_side = kLoupeSize});
       thumbnail_pane_.Highlight(pano.ids);
       if (extra.scroll_thumbnails) {
         thumbnail_pane_.SetScrollX(pano.ids);
@@ -493,16 +660,32 @@ Action PanoGui::PerformAction(const Action& action) {
     case ActionType::kRecomputePanoFullRes:
       [[fallthrough]];
     case ActionType::kRecomputePano: {
+      // Nothing for unchanged options, e.g. after resetting the cameras
+      const auto stage =
+          pipeline::FirstInvalidStage(stitched_options_, options_);
+      if (action.type == ActionType::kRecomputePano &&
+          stage == pipeline::StitchStage::kExport) {
+        // Read by the next export, the shown pano stays valid
+        break;
+      }
+      stitcher_pipeline_.ClearPreviewCache();
       if (selection_.type == SelectionType::kPano) {
         spdlog::info("Recomputing pano {}: {}", selection_.target_id,
                      Label(options_.stitch.projection.type));
+        if (action.type == ActionType::kRecomputePano) {
+          plot_pane_.PreviewProjection(options_.stitch.projection.type);
+        }
         return {
             .type = ActionType::kShowPano,
             .target_id = selection_.target_id,
             .delayed = true,
             .extra = ShowPanoExtra{
                 .full_res = action.type == ActionType::kRecomputePanoFullRes,
-                .reset_crop = action.type != ActionType::kRotate}};
+                // The blending doesn't move the pano borders
+                .reset_crop = action.type != ActionType::kRotate &&
+                              stage != pipeline::StitchStage::kComposition,
+                // The cameras would be reused regardless of the features
+                .reset_cameras = stage == pipeline::StitchStage::kFeatures}};
       }
       break;
     }
@@ -525,6 +708,10 @@ Action PanoGui::PerformAction(const Action& action) {
       log_pane_.ToggleShow();
       break;
     }
+    case ActionType::kTogglePerfPane: {
+      perf_pane_.ToggleShow();
+      break;
+    }
     case ActionType::kToggleCrop: {
       return plot_pane_.ToggleCrop();
     }
@@ -602,6 +789,7 @@ void PanoGui::PerformExportAction(int pano_id) {
     }
     stitcher_pipeline_.RunExport(plot_pane_.Image(),
                                  {.pano_id = pano_id,
+                                  .ids = pano.ids,
                                   .export_path = *export_path,
                                   .metadata_path = metadata_path,
                                   .compression = options_.compression,
@@ -614,7 +802,9 @@ void PanoGui::PerformExportAction(int pano_id) {
                                      .export_crop = pano.crop,
                                      .metadata = options_.metadata,
                                      .compression = options_.compression,
-                                     .stitch_algorithm = options_.stitch});
+                                     .stitch_algorithm = options_.stitch,
+                                     .match_threshold =
+                                         options_.matching.match_threshold});
   }
 }
 
@@ -631,6 +821,22 @@ MultiAction PanoGui::ResolveFutures() {
         if (stitcher_data_ && AnyRawImage(stitcher_data_->images)) {
           actions |= {.type = ActionType::kWarnInputConversion};
         }
+        if (stitcher_data_ && options_.preview.pano_thumbnails) {
+          // The panos kept by the regrouping keep their mini panos
+          std::vector<int> pano_ids;
+          const int num_panos = static_cast<int>(stitcher_data_->panos.size());
+          for (int pano_id = 0; pano_id < num_panos; pano_id++) {
+            if (!thumbnail_pane_.HasPanoThumbnail(
+                    stitcher_data_->panos[pano_id].ids)) {
+              pano_ids.push_back(pano_id);
+            }
+          }
+          stitcher_pipeline_.RunPanoThumbnails(
+              *stitcher_data_, pano_ids,
+              {.stitch_algorithm = options_.stitch,
+               .match_threshold = options_.matching.match_threshold,
+               .grid = StitchingGrid(options_.matching)});
+        }
         if (stitcher_data_ && !stitcher_data_->panos.empty()) {
           // keep delayed == true to wait for the thumbnails to be drawn at
           // leaset once before scrolling
@@ -643,9 +849,16 @@ MultiAction PanoGui::ResolveFutures() {
 
   auto handle_pano =
       [this](std::future<pipeline::StitchingResult> pano_future) {
+        const int selected_pano_id = SelectedPanoId(selection_);
         auto result = ResolveStitchingResultFuture(
-            std::move(pano_future), &plot_pane_, &status_message_);
+            std::move(pano_future), stitcher_data_, selected_pano_id,
+            &plot_pane_, &status_message_);
+        if (result.coarse ||
+            !IsCurrentPano(stitcher_data_, result.pano_id, result.ids)) {
+          return;
+        }
         auto& pano = stitcher_data_->panos[result.pano_id];
+        const bool shown = result.pano_id == selected_pano_id;
         if (result.full_res &&
             result.status ==
                 algorithm::stitcher::Status::kSuccessResolutionCapped) {
@@ -656,23 +869,50 @@ MultiAction PanoGui::ResolveFutures() {
         }
         if (result.cameras) {
           pano.cameras = result.cameras;
+          pano.initial_cameras.clear();
           if (!pano.backup_cameras) {
             pano.backup_cameras = result.cameras;
           }
         }
+        if (result.session) {
+          pano.session = result.session;
+        }
         if (result.auto_crop) {
           pano.auto_crop = result.auto_crop;
         }
+        if (result.export_path && !shown) {
+          // Finished in the background, another pano is shown
+          return;
+        }
         if (pano.crop && !plot_pane_.IsRotateEnabled()) {
           plot_pane_.ForceCrop(*pano.crop);
         }
-        pano_mask_ = result.mask;
+        if (!result.cropped) {
+          pano_mask_ = result.mask;
+        }
+        if (result.pano && !result.full_res &&
+            options_.preview.speculative_stitching) {
+          // The next and the previous pano are likely to be shown next
+          std::vector<int> neighbours;
+          const int num_panos = static_cast<int>(stitcher_data_->panos.size());
+          for (const int pano_id : {result.pano_id + 1, result.pano_id - 1}) {
+            if (pano_id >= 0 && pano_id < num_panos) {
+              neighbours.push_back(pano_id);
+            }
+          }
+          stitcher_pipeline_.RunSpeculativeStitching(
+              *stitcher_data_, neighbours,
+              {.stitch_algorithm = options_.stitch,
+               .match_threshold = options_.matching.match_threshold,
+               .grid = StitchingGrid(options_.matching)});
+        }
       };
 
   auto handle_export =
       [this](std::future<pipeline::ExportResult> export_future) {
         auto exported_pano_id = ResolveExportFuture(
-            std::move(export_future), &plot_pane_, &status_message_);
+            std::move(export_future), stitcher_data_,
+            SelectedPanoId(selection_), &plot_pane_, &status_message_);
         if (exported_pano_id) {
           stitcher_data_->panos[*exported_pano_id].exported = true;
         }
@@ -684,6 +924,31 @@ MultiAction PanoGui::ResolveFutures() {
                                       &status_message_);
       };
 
+  for (const auto& loaded : stitcher_pipeline_.PopLoadedThumbnails()) {
+    thumbnail_pane_.AddThumbnail(loaded.input_id, loaded.thumbnail,
+                                 loaded.aspect);
+  }
+
+  for (auto& stitched : stitcher_pipeline_.PopPanoThumbnails()) {
+    thumbnail_pane_.AddPanoThumbnail(stitched.ids, stitched.thumbnail);
+    if (!stitcher_data_ || !stitched.cameras) {
+      continue;
+    }
+    auto& panos = stitcher_data_->panos;
+    // Warm cameras for the first stitch, unless the pano was edited since
+    if (stitched.pano_id >= static_cast<int>(panos.size())) {
+      continue;
+    }
+    auto& pano = panos[stitched.pano_id];
+    if (pano.ids == stitched.ids && !pano.cameras) {
+      pano.cameras = std::move(stitched.cameras);
+      pano.initial_cameras.clear();
+      if (!pano.backup_cameras) {
+        pano.backup_cameras = pano.cameras;
+      }
+    }
+  }
+
   if (auto task = stitcher_pipeline_.GetReadyTask();
       task && task->progress->IsCancelled()) {
     spdlog::info("Task cancelled");
@@ -698,4 +963,11 @@ MultiAction PanoGui::ResolveFutures() {
 
 pipeline::Options PanoGui::GetOptions() const { return options_; }
 
+bool PanoGui::IsBusy() const { return !stitcher_pipeline_.IsIdle(); }
+
+bool PanoGui::NeedsRedraw() const {
+  return !next_actions_.items.empty() || thumbnail_pane_.IsAnimating() ||
+         plot_pane_.IsAnimating() || about_pane_.IsLoading();
+}
+
 }  // namespace xpano::gui
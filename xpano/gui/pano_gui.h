@@ -6,18 +6,21 @@
 #pragma once
 
 #include <cstdint>
+#include <functional>
 #include <future>
 #include <optional>
 #include <string>
 
 #include <opencv2/core.hpp>
 
+#include "xpano/algorithm/rle_mask.h"
 #include "xpano/cli/args.h"
 #include "xpano/gui/action.h"
 #include "xpano/gui/backends/base.h"
 #include "xpano/gui/panels/about.h"
 #include "xpano/gui/panels/bugreport_pane.h"
 #include "xpano/gui/panels/log_pane.h"
+#include "xpano/gui/panels/perf_pane.h"
 #include "xpano/gui/panels/preview_pane.h"
 #include "xpano/gui/panels/thumbnail_pane.h"
 #include "xpano/gui/panels/warning_pane.h"
@@ -50,10 +53,15 @@ class PanoGui {
  public:
   PanoGui(backends::Base* backend, logger::Logger* logger,
           const utils::config::Config& config,
-          std::future<utils::Texts> licenses, const cli::Args& args);
+          std::function<utils::Texts()> load_licenses, const cli::Args& args);
 
   bool Run();
   pipeline::Options GetOptions() const;
+  // Running tasks, their progress needs redrawing
+  [[nodiscard]] bool IsBusy() const;
+  // Work spread over the next frames, e.g. delayed actions or animations,
+  // the main loop shouldn't sleep
+  [[nodiscard]] bool NeedsRedraw() const;
 
  private:
   Action DrawGui();
@@ -70,12 +78,15 @@ class PanoGui {
   StatusMessage status_message_;
 
   pipeline::Options options_;
+  // Of the last stitched pano, see pipeline::FirstInvalidStage
+  pipeline::Options stitched_options_;
   std::optional<pipeline::StitcherData> stitcher_data_;
 
   // Gui panels
   LogPane log_pane_;
   AboutPane about_pane_;
   BugReportPane bugreport_pane_;
+  PerfPane perf_pane_;
   PreviewPane plot_pane_;
   ThumbnailPane thumbnail_pane_;
   WarningPane warning_pane_;
@@ -84,7 +95,7 @@ class PanoGui {
   pipeline::StitcherPipeline<> stitcher_pipeline_;
 
   // Used for inpainting
-  std::optional<cv::Mat> pano_mask_;
+  std::optional<algorithm::RleMask> pano_mask_;
 };
 
 }  // namespace xpano::gui
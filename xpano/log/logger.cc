@@ -4,20 +4,21 @@
 
 #include "xpano/log/logger.h"
 
-#include <algorithm>
+#include <deque>
 #include <filesystem>
-#include <iterator>
 #include <memory>
-#include <mutex>
 #include <optional>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <SDL.h>
+#include <spdlog/async_logger.h>
 #include <spdlog/common.h>
 #include <spdlog/details/log_msg.h>
+#include <spdlog/details/thread_pool.h>
+#include <spdlog/formatter.h>
 #include <spdlog/logger.h>
-#include <spdlog/sinks/base_sink.h>
 #include <spdlog/sinks/rotating_file_sink.h>
 #include <spdlog/sinks/stdout_sinks.h>
 #include <spdlog/spdlog.h>
@@ -61,22 +62,57 @@ void CustomLog(void * /*userdata*/, int /*category*/, SDL_LogPriority priority,
 }
 }  // namespace
 
-std::vector<std::string> BufferSinkMt::LastFormatted() {
-  const std::lock_guard<std::mutex> lock(base_sink<std::mutex>::mutex_);
-  std::vector<std::string> new_messages;
-  std::swap(new_messages, messages_);
-  return new_messages;
+void RingSinkMt::log(const spdlog::details::log_msg &msg) {
+  auto formatted = fmt::format("[{}] {}",
+                               spdlog::level::to_string_view(msg.level),
+                               fmt::string_view(msg.payload.data(),
+                                                msg.payload.size()));
+  if (!messages_.TryPush(std::move(formatted))) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+void RingSinkMt::flush() {}
+
+void RingSinkMt::set_pattern(const std::string & /*pattern*/) {}
+
+void RingSinkMt::set_formatter(
+    std::unique_ptr<spdlog::formatter> /*formatter*/) {}
+
+void RingSinkMt::MoveNew(std::deque<std::string> *log) {
+  while (auto message = messages_.TryPop()) {
+    log->push_back(std::move(*message));
+  }
+  if (const int dropped = dropped_.exchange(0, std::memory_order_relaxed);
+      dropped > 0) {
+    log->push_back(fmt::format("[warning] {} messages dropped", dropped));
+  }
+}
+
+AsyncSink::AsyncSink(spdlog::sink_ptr sink)
+    : pool_(std::make_shared<spdlog::details::thread_pool>(kLogQueueSize, 1)),
+      logger_(std::make_shared<spdlog::async_logger>(
+          "XPanoAsync", std::move(sink), pool_,
+          spdlog::async_overflow_policy::overrun_oldest)) {
+  // Filtered by the level of this sink
+  logger_->set_level(spdlog::level::trace);
 }
 
-void BufferSinkMt::sink_it_(const spdlog::details::log_msg &msg) {
-  spdlog::memory_buf_t formatted;
-  base_sink<std::mutex>::formatter_->format(msg, formatted);
-  messages_.push_back(fmt::to_string(formatted));
+void AsyncSink::log(const spdlog::details::log_msg &msg) {
+  logger_->log(msg.time, msg.source, msg.level, msg.payload);
 }
 
-void BufferSinkMt::flush_() {}
+void AsyncSink::flush() { logger_->flush(); }
 
-Logger::Logger() : sink_(std::make_shared<BufferSinkMt>()) {}
+void AsyncSink::set_pattern(const std::string &pattern) {
+  logger_->set_pattern(pattern);
+}
+
+void AsyncSink::set_formatter(std::unique_ptr<spdlog::formatter> formatter) {
+  logger_->set_formatter(std::move(formatter));
+}
+
+Logger::Logger() : sink_(std::make_shared<RingSinkMt>()) {}
 
 Logger::~Logger() {
 #ifdef XPANO_WITH_MULTIBLEND
@@ -85,17 +121,22 @@ Logger::~Logger() {
 }
 
 void Logger::RedirectSpdlogToGui(
-    std::optional<std::filesystem::path> app_data_path) {
+    std::optional<std::filesystem::path> app_data_path,
+    FileLogging file_logging) {
   std::vector<spdlog::sink_ptr> sinks;
-  sink_->set_pattern("[%l] %v");
   sinks.push_back(sink_);
 
   if (app_data_path) {
     auto log_path = *app_data_path / kLogFilename;
     log_dir_path_ = app_data_path->string();
 
-    sinks.push_back(std::make_shared<spdlog::sinks::rotating_file_sink_mt>(
-        log_path.string(), kMaxLogSize, kMaxLogFiles, true));
+    spdlog::sink_ptr file_sink =
+        std::make_shared<spdlog::sinks::rotating_file_sink_mt>(
+            log_path.string(), kMaxLogSize, kMaxLogFiles, true);
+    if (file_logging == FileLogging::kAsync) {
+      file_sink = std::make_shared<AsyncSink>(std::move(file_sink));
+    }
+    sinks.push_back(std::move(file_sink));
   }
 
   auto logger =
@@ -109,14 +150,16 @@ void Logger::RedirectSpdlogToGui(
 #endif
 }
 
-const std::vector<std::string> &Logger::Log() {
+const std::deque<std::string> &Logger::Log() {
   Concatenate();
   return log_;
 }
 
 void Logger::Concatenate() {
-  auto new_messages = sink_->LastFormatted();
-  std::copy(new_messages.begin(), new_messages.end(), std::back_inserter(log_));
+  sink_->MoveNew(&log_);
+  while (log_.size() > kMaxLogLines) {
+    log_.pop_front();
+  }
 }
 
 std::optional<std::string> Logger::GetLogDirPath() { return log_dir_path_; }
@@ -130,4 +173,12 @@ void RedirectSpdlogToCout() {
   spdlog::set_default_logger(logger);
 };
 
+void RedirectSpdlogToCerr() {
+  spdlog::drop("console");
+  auto logger = spdlog::stderr_logger_mt("console");
+  logger->flush_on(spdlog::level::info);
+  logger->set_pattern("%l: %v");
+  spdlog::set_default_logger(logger);
+}
+
 }  // namespace xpano::logger
@@ -4,30 +4,64 @@
 
 #pragma once
 
+#include <atomic>
+#include <cstdint>
+#include <deque>
 #include <filesystem>
 #include <memory>
-#include <mutex>
 #include <optional>
 #include <string>
-#include <vector>
 
+#include <spdlog/async_logger.h>
 #include <spdlog/details/log_msg.h>
-#include <spdlog/sinks/base_sink.h>
+#include <spdlog/details/thread_pool.h>
+#include <spdlog/formatter.h>
+#include <spdlog/sinks/sink.h>
+
+#include "xpano/constants.h"
+#include "xpano/utils/ring_buffer.h"
 
 namespace xpano::logger {
 
-class BufferSinkMt final : public spdlog::sinks::base_sink<std::mutex> {
+// Formats the messages as "[level] message" on the logging threads and
+// hands them to the GUI thread through a RingBuffer, without a mutex.
+// Messages logged while the buffer is full are dropped and counted.
+class RingSinkMt final : public spdlog::sinks::sink {
  public:
-  std::vector<std::string> LastFormatted();
+  void log(const spdlog::details::log_msg &msg) override;
+  void flush() override;
+  // The format is fixed
+  void set_pattern(const std::string &pattern) override;
+  void set_formatter(std::unique_ptr<spdlog::formatter> formatter) override;
 
- protected:
-  void sink_it_(const spdlog::details::log_msg &msg) override;
-  void flush_() override;
+  // Only from a single thread, appends the messages since the last call
+  void MoveNew(std::deque<std::string> *log);
 
  private:
-  std::vector<std::string> messages_;
+  utils::RingBuffer<std::string, kLogRingCapacity> messages_;
+  std::atomic_int dropped_ = 0;
 };
 
+// Runs the wrapped sink on a background thread, the logging threads only
+// queue the message. The oldest messages are overwritten when the queue is
+// full.
+class AsyncSink final : public spdlog::sinks::sink {
+ public:
+  explicit AsyncSink(spdlog::sink_ptr sink);
+
+  void log(const spdlog::details::log_msg &msg) override;
+  void flush() override;
+  void set_pattern(const std::string &pattern) override;
+  void set_formatter(std::unique_ptr<spdlog::formatter> formatter) override;
+
+ private:
+  // Outlives the logger, which processes the queued messages on destruction
+  std::shared_ptr<spdlog::details::thread_pool> pool_;
+  std::shared_ptr<spdlog::async_logger> logger_;
+};
+
+enum class FileLogging : std::uint8_t { kSync, kAsync };
+
 class Logger {
  public:
   Logger();
@@ -38,16 +72,18 @@ class Logger {
   Logger(Logger &&) = delete;
   Logger &operator=(Logger &&) = delete;
 
-  const std::vector<std::string> &Log();
-  void RedirectSpdlogToGui(std::optional<std::filesystem::path> app_data_path);
+  // Last kMaxLogLines lines
+  const std::deque<std::string> &Log();
+  void RedirectSpdlogToGui(std::optional<std::filesystem::path> app_data_path,
+                           FileLogging file_logging = FileLogging::kAsync);
 
   std::optional<std::string> GetLogDirPath();
 
  private:
   void Concatenate();
 
-  std::vector<std::string> log_;
-  std::shared_ptr<BufferSinkMt> sink_;
+  std::deque<std::string> log_;
+  std::shared_ptr<RingSinkMt> sink_;
 
   std::optional<std::string> log_dir_path_;
 };
@@ -56,4 +92,7 @@ void RedirectSDLOutput();
 
 void RedirectSpdlogToCout();
 
+// Keeps stdout for the data, e.g. the pano written by --output=-
+void RedirectSpdlogToCerr();
+
 }  // namespace xpano::logger
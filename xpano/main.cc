@@ -2,6 +2,7 @@
 // SPDX-FileCopyrightText: 2022 Vaibhav Sharma
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+#include <chrono>
 #include <clocale>
 #include <cstdio>
 #include <future>
@@ -15,6 +16,7 @@
 #include <SDL.h>
 #include <spdlog/spdlog.h>
 
+#include "xpano/algorithm/algorithm.h"
 #include "xpano/cli/pano_cli.h"
 #include "xpano/constants.h"
 #include "xpano/gui/backends/sdl.h"
@@ -23,6 +25,7 @@
 #include "xpano/utils/config.h"
 #include "xpano/utils/fmt.h"
 #include "xpano/utils/imgui_.h"
+#include "xpano/utils/opencv.h"
 #include "xpano/utils/resource.h"
 #include "xpano/utils/sdl_.h"
 #include "xpano/utils/text.h"
@@ -32,13 +35,52 @@
 #error This backend requires SDL 2.0.17+ because of SDL_RenderGeometry() function
 #endif
 
+namespace {
+
+// Launch to first frame, logged as the durations of the startup phases
+class StartupTimer {
+ public:
+  void Mark(const char* phase) {
+    const auto now = Clock::now();
+    phases_ += fmt::format("{} {} ms, ", phase, Milliseconds(now - last_));
+    last_ = now;
+  }
+
+  void Log() const {
+    spdlog::info("Startup: {}total {} ms", phases_,
+                 Milliseconds(Clock::now() - start_));
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+
+  static auto Milliseconds(Clock::duration duration) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(duration)
+        .count();
+  }
+
+  Clock::time_point start_ = Clock::now();
+  Clock::time_point last_ = start_;
+  std::string phases_;
+};
+
+}  // namespace
+
 int main(int argc, char** argv) {
+  StartupTimer startup_timer;
   const char* locale = std::setlocale(LC_ALL, "en_US.UTF-8");
+  // Doesn't need SDL_Init, the CLI uses the OpenCL cache as well
+  auto app_data_path = xpano::utils::sdl::InitializePrefPath();
+  if (app_data_path) {
+    xpano::utils::opencv::UseOpenCLCache(*app_data_path /
+                                         xpano::kOpenCLCacheDirname);
+  }
   auto [cli_status, args] = xpano::cli::Run(argc, argv);
 
   if (cli_status != xpano::cli::ResultType::kForwardToGui) {
     return xpano::cli::ExitCode(cli_status);
   }
+  startup_timer.Mark("CLI");
 
 #if SDL_VERSION_ATLEAST(2, 23, 1)
   SDL_SetHint(SDL_HINT_WINDOWS_DPI_AWARENESS, "permonitorv2");
@@ -46,13 +88,15 @@ int main(int argc, char** argv) {
   // SDL_SetHint(SDL_HINT_WINDOWS_DPI_SCALING, "1");
 #endif
 
-  const bool has_wayland_support = (SDL_VideoInit("wayland") == 0);
-
 #if SDL_VERSION_ATLEAST(2, 0, 22)
-  // Prefer Wayland as it provides non-blurry fractional scaling
+  // Prefer Wayland as it provides non-blurry fractional scaling. Probing the
+  // driver with SDL_VideoInit would initialize the video twice.
+  const bool has_wayland_support = xpano::utils::sdl::IsWaylandSession();
   if (has_wayland_support) {
     SDL_SetHint(SDL_HINT_VIDEODRIVER, "wayland,x11");
   }
+#else
+  const bool has_wayland_support = (SDL_VideoInit("wayland") == 0);
 #endif
 
   if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_TIMER) != 0) {
@@ -60,7 +104,6 @@ int main(int argc, char** argv) {
     return -1;
   }
 
-  auto app_data_path = xpano::utils::sdl::InitializePrefPath();
   auto app_exe_path = xpano::utils::sdl::InitializeBasePath();
 
   // Setup logging
@@ -83,20 +126,25 @@ int main(int argc, char** argv) {
     return -1;
   }
 
-  auto config = xpano::utils::config::Load(app_data_path);
+  startup_timer.Mark("SDL");
+
+  // Read while the window and the renderer are created
+  auto config_future = std::async(std::launch::async,
+                                  xpano::utils::config::Load, app_data_path);
 
   // Setup file dialog library
   if (NFD_Init() != NFD_OKAY) {
     spdlog::error("Couldn't initialize NFD");
   }
 
-  // Setup SDL Window + Renderer
-  auto window_flags = SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI;
+  // Setup SDL Window + Renderer, the window is shown once it has the size
+  // from the config
+  auto window_flags =
+      SDL_WINDOW_RESIZABLE | SDL_WINDOW_ALLOW_HIGHDPI | SDL_WINDOW_HIDDEN;
   auto window_title = fmt::format("Xpano {}", xpano::version::Current());
-  SDL_Window* window =
-      SDL_CreateWindow(window_title.c_str(), SDL_WINDOWPOS_CENTERED,
-                       SDL_WINDOWPOS_CENTERED, config.app_state.window_width,
-                       config.app_state.window_height, window_flags);
+  SDL_Window* window = SDL_CreateWindow(
+      window_title.c_str(), SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
+      xpano::kWindowWidth, xpano::kWindowHeight, window_flags);
 
   if (window == nullptr) {
     spdlog::error("Error creating SDL_Window! {}", SDL_GetError());
@@ -113,6 +161,14 @@ int main(int argc, char** argv) {
   auto icon = xpano::utils::resource::LoadIcon(*app_exe_path, xpano::kIconPath);
   SDL_SetWindowIcon(window, icon.get());
 
+  auto config = config_future.get();
+  SDL_SetWindowSize(window, config.app_state.window_width,
+                    config.app_state.window_height);
+  SDL_SetWindowPosition(window, SDL_WINDOWPOS_CENTERED,
+                        SDL_WINDOWPOS_CENTERED);
+  SDL_ShowWindow(window);
+  startup_timer.Mark("window");
+
   // Setup Dear ImGui context
   IMGUI_CHECKVERSION();
   ImGui::CreateContext();
@@ -131,12 +187,17 @@ int main(int argc, char** argv) {
   // Application specific
   auto backend = xpano::gui::backends::Sdl{renderer};
 
-  std::future<xpano::utils::Texts> license_texts =
-      std::async(std::launch::async, xpano::utils::LoadTexts, *app_exe_path,
-                 xpano::kLicensePath);
+  // The first pano doesn't wait for the OpenCL kernels to compile
+  auto warm_up = args->warm_up
+                     ? std::async(std::launch::async, xpano::algorithm::WarmUp)
+                     : std::future<void>{};
 
-  xpano::gui::PanoGui gui(&backend, &logger, config, std::move(license_texts),
-                          *args);
+  // Only when needed, see AboutPane
+  auto load_licenses = [exe_path = *app_exe_path]() {
+    return xpano::utils::LoadTexts(exe_path, xpano::kLicensePath);
+  };
+
+  xpano::gui::PanoGui gui(&backend, &logger, config, load_licenses, *args);
 
   auto window_manager =
       xpano::utils::sdl::DetermineWindowManager(has_wayland_support);
@@ -147,12 +208,26 @@ int main(int argc, char** argv) {
     spdlog::error("Font location not found!");
     return -1;
   }
+  startup_timer.Mark("GUI");
 
-  // Main loop
+  // Main loop, sleeps while there are no events, the finished tasks wake it
+  // up, see Base::WakeUp
   bool done = false;
+  bool first_frame_shown = false;
+  int idle_frames = 0;
   while (!done) {
     SDL_Event event;
-    while (SDL_PollEvent(&event) > 0) {
+    bool has_event = SDL_PollEvent(&event) > 0;
+    if (!has_event && idle_frames >= xpano::kFramesBeforeSleep) {
+      // The progress of the running tasks and the text cursor still need
+      // redrawing
+      const bool busy = gui.IsBusy() || imgui_io.WantTextInput;
+      const int timeout_ms =
+          busy ? static_cast<int>(xpano::kBusyFrameInterval.count()) : -1;
+      has_event = SDL_WaitEventTimeout(&event, timeout_ms) > 0;
+    }
+    idle_frames = has_event ? 0 : idle_frames + 1;
+    for (; has_event; has_event = SDL_PollEvent(&event) > 0) {
       ImGui_ImplSDL2_ProcessEvent(&event);
       if (event.type == SDL_QUIT) {
         done = true;
@@ -168,6 +243,9 @@ int main(int argc, char** argv) {
     if (dpi_handler.DpiChanged()) {
       font_loader.Reload(dpi_handler.DpiScale());
     }
+    if (first_frame_shown) {
+      font_loader.LoadDeferred();
+    }
 
     // Start the Dear ImGui frame
     ImGui_ImplSDLRenderer2_NewFrame();
@@ -176,6 +254,9 @@ int main(int argc, char** argv) {
 
     // User code
     done |= gui.Run();
+    if (gui.NeedsRedraw()) {
+      idle_frames = 0;
+    }
 
     // ImGui::ShowDemoWindow();
 
@@ -186,6 +267,11 @@ int main(int argc, char** argv) {
     ImGui::Render();
     ImGui_ImplSDLRenderer2_RenderDrawData(ImGui::GetDrawData(), renderer);
     SDL_RenderPresent(renderer);
+    if (!first_frame_shown) {
+      first_frame_shown = true;
+      startup_timer.Mark("first frame");
+      startup_timer.Log();
+    }
   }
 
   auto size = xpano::utils::sdl::GetSize(window);
@@ -0,0 +1,411 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/pipeline/checkpoint.h"
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/stitching/detail/camera.hpp>
+#include <opencv2/stitching/detail/exposure_compensate.hpp>
+#include <spdlog/spdlog.h>
+
+#include "xpano/algorithm/algorithm.h"
+#include "xpano/algorithm/image.h"
+#include "xpano/algorithm/options.h"
+#include "xpano/algorithm/rle_mask.h"
+#include "xpano/algorithm/stitcher.h"
+#include "xpano/pipeline/stitcher_pipeline.h"
+#include "xpano/utils/fmt.h"
+
+namespace xpano::pipeline {
+
+namespace {
+
+constexpr std::uint32_t kCheckpointMagic = 0x4B435058;  // "XPCK"
+constexpr std::uint32_t kCheckpointFormatVersion = 1;
+
+const std::string kCamerasFile = "cameras.xpck";
+const std::string kSessionFile = "session.xpck";
+const std::string kPanoFile = "pano.xpck";
+
+template <typename TValue>
+void Write(std::ofstream& stream, const TValue& value) {
+  stream.write(reinterpret_cast<const char*>(&value), sizeof(TValue));
+}
+
+template <typename TValue>
+bool Read(std::ifstream& stream, TValue* value) {
+  stream.read(reinterpret_cast<char*>(value), sizeof(TValue));
+  return static_cast<bool>(stream);
+}
+
+void WriteString(std::ofstream& stream, const std::string& string) {
+  Write(stream, static_cast<std::uint64_t>(string.size()));
+  stream.write(string.data(), static_cast<std::streamsize>(string.size()));
+}
+
+bool ReadString(std::ifstream& stream, std::string* string) {
+  std::uint64_t size = 0;
+  if (!Read(stream, &size)) {
+    return false;
+  }
+  string->resize(size);
+  stream.read(string->data(), static_cast<std::streamsize>(size));
+  return static_cast<bool>(stream);
+}
+
+// Raw pixels, checkpoints are written and read once
+void WriteMat(std::ofstream& stream, const cv::Mat& mat) {
+  const cv::Mat continuous = mat.isContinuous() ? mat : mat.clone();
+  Write(stream, static_cast<std::int32_t>(continuous.rows));
+  Write(stream, static_cast<std::int32_t>(continuous.cols));
+  Write(stream, static_cast<std::int32_t>(continuous.type()));
+  stream.write(reinterpret_cast<const char*>(continuous.data),
+               static_cast<std::streamsize>(continuous.total() *
+                                            continuous.elemSize()));
+}
+
+bool ReadMat(std::ifstream& stream, cv::Mat* mat) {
+  std::int32_t rows = 0;
+  std::int32_t cols = 0;
+  std::int32_t type = 0;
+  if (!Read(stream, &rows) || !Read(stream, &cols) || !Read(stream, &type)) {
+    return false;
+  }
+  if (rows == 0 || cols == 0) {
+    *mat = cv::Mat();
+    return true;
+  }
+  mat->create(rows, cols, type);
+  stream.read(reinterpret_cast<char*>(mat->data),
+              static_cast<std::streamsize>(mat->total() * mat->elemSize()));
+  return static_cast<bool>(stream);
+}
+
+template <typename TValue, typename TFunction>
+void WriteVector(std::ofstream& stream, const std::vector<TValue>& values,
+                 TFunction write) {
+  Write(stream, static_cast<std::uint64_t>(values.size()));
+  for (const auto& value : values) {
+    write(stream, value);
+  }
+}
+
+template <typename TValue, typename TFunction>
+bool ReadVector(std::ifstream& stream, std::vector<TValue>* values,
+                TFunction read) {
+  std::uint64_t size = 0;
+  if (!Read(stream, &size)) {
+    return false;
+  }
+  values->resize(size);
+  for (auto& value : *values) {
+    if (!read(stream, &value)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+template <typename TValue>
+void WritePod(std::ofstream& stream, const TValue& value) {
+  Write(stream, value);
+}
+
+template <typename TValue>
+bool ReadPod(std::ifstream& stream, TValue* value) {
+  return Read(stream, value);
+}
+
+void WriteUMat(std::ofstream& stream, const cv::UMat& mat) {
+  WriteMat(stream, mat.getMat(cv::ACCESS_READ));
+}
+
+bool ReadUMat(std::ifstream& stream, cv::UMat* mat) {
+  cv::Mat values;
+  if (!ReadMat(stream, &values)) {
+    return false;
+  }
+  values.copyTo(*mat);
+  return true;
+}
+
+void WriteCamera(std::ofstream& stream,
+                 const cv::detail::CameraParams& camera) {
+  Write(stream, camera.focal);
+  Write(stream, camera.aspect);
+  Write(stream, camera.ppx);
+  Write(stream, camera.ppy);
+  WriteMat(stream, camera.R);
+  WriteMat(stream, camera.t);
+}
+
+bool ReadCamera(std::ifstream& stream, cv::detail::CameraParams* camera) {
+  return Read(stream, &camera->focal) && Read(stream, &camera->aspect) &&
+         Read(stream, &camera->ppx) && Read(stream, &camera->ppy) &&
+         ReadMat(stream, &camera->R) && ReadMat(stream, &camera->t);
+}
+
+std::string CamerasKey(const algorithm::Cameras& cameras) {
+  std::string key = fmt::format("{}|{}", fmt::join(cameras.component, ","),
+                                static_cast<int>(cameras.wave_correction_user));
+  for (const auto& camera : cameras.cameras) {
+    cv::Mat rotation;
+    camera.R.convertTo(rotation, CV_64F);
+    key += fmt::format("|{},{},{},{},{}", camera.focal, camera.aspect,
+                       camera.ppx, camera.ppy,
+                       fmt::join(rotation.begin<double>(),
+                                 rotation.end<double>(), ","));
+  }
+  return key;
+}
+
+std::string CheckpointKey(const algorithm::Pano& pano,
+                          const std::vector<algorithm::Image>& images,
+                          const StitchingOptions& options) {
+  std::string key;
+  for (const int img_id : pano.ids) {
+    const auto& path = images[img_id].GetPath();
+    std::error_code size_error;
+    std::error_code time_error;
+    const auto file_size = std::filesystem::file_size(path, size_error);
+    const auto modified = std::filesystem::last_write_time(path, time_error);
+    key += fmt::format("{}|{}|{}\n", images[img_id].GetKey(),
+                       size_error ? 0 : file_size,
+                       time_error ? 0 : modified.time_since_epoch().count());
+  }
+  const auto& stitch = options.stitch_algorithm;
+  key += fmt::format(
+      "{}|{}|{}|{}|{}|{}|{}|{}|{}|{}|{}|{}|{}\n",
+      static_cast<int>(stitch.projection.type), stitch.projection.a_param,
+      stitch.projection.b_param, static_cast<int>(stitch.feature),
+      static_cast<int>(stitch.wave_correction), stitch.match_conf,
+      stitch.max_pano_mpx, stitch.max_memory_mb,
+      static_cast<int>(stitch.blending_method), stitch.reuse_matches,
+      static_cast<int>(stitch.seam_finder), stitch.exposure_per_channel,
+      options.match_threshold);
+  if (options.export_crop) {
+    const auto& crop = *options.export_crop;
+    key += fmt::format("{},{},{},{}\n", crop.start[0], crop.start[1],
+                       crop.end[0], crop.end[1]);
+  }
+  if (algorithm::CanReuseCameras(pano.cameras, stitch)) {
+    key += CamerasKey(*pano.cameras);
+  }
+  return key;
+}
+
+// Writes the header and the content to a temporary file renamed once
+// complete
+template <typename TFunction>
+void WriteFile(const std::filesystem::path& path, const std::string& key,
+               TFunction write) {
+  std::error_code error;
+  std::filesystem::create_directories(path.parent_path(), error);
+  if (error) {
+    spdlog::warn("Failed to create checkpoint directory {}: {}",
+                 path.parent_path().string(), error.message());
+    return;
+  }
+  auto tmp_path = path;
+  tmp_path += ".tmp";
+  {
+    std::ofstream stream(tmp_path, std::ios::binary | std::ios::trunc);
+    Write(stream, kCheckpointMagic);
+    Write(stream, kCheckpointFormatVersion);
+    WriteString(stream, key);
+    write(stream);
+    stream.close();
+    if (!stream) {
+      spdlog::warn("Failed to write checkpoint {}", tmp_path.string());
+      std::filesystem::remove(tmp_path, error);
+      return;
+    }
+  }
+  std::filesystem::rename(tmp_path, path, error);
+  if (error) {
+    spdlog::warn("Failed to write checkpoint {}: {}", path.string(),
+                 error.message());
+    std::filesystem::remove(tmp_path, error);
+    return;
+  }
+  spdlog::info("Written checkpoint {}", path.string());
+}
+
+// Opened past the header if it matches the key
+std::optional<std::ifstream> OpenFile(const std::filesystem::path& path,
+                                      const std::string& key) {
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream) {
+    return {};
+  }
+  std::uint32_t magic = 0;
+  std::uint32_t version = 0;
+  std::string stored_key;
+  if (!Read(stream, &magic) || !Read(stream, &version) ||
+      magic != kCheckpointMagic || version != kCheckpointFormatVersion ||
+      !ReadString(stream, &stored_key) || stored_key != key) {
+    spdlog::warn("Ignoring checkpoint {} of other inputs", path.string());
+    return {};
+  }
+  return stream;
+}
+
+}  // namespace
+
+Checkpoint::Checkpoint(const std::filesystem::path& checkpoint_dir,
+                       const algorithm::Pano& pano,
+                       const std::vector<algorithm::Image>& images,
+                       const StitchingOptions& options)
+    : key_(CheckpointKey(pano, images, options)),
+      dir_(checkpoint_dir /
+           fmt::format("{:016x}", std::hash<std::string>{}(key_))),
+      num_images_(static_cast<int>(pano.ids.size())),
+      projection_(options.stitch_algorithm.projection),
+      exposure_per_channel_(options.stitch_algorithm.exposure_per_channel) {}
+
+std::filesystem::path Checkpoint::FilePath(const std::string& name) const {
+  return dir_ / name;
+}
+
+void Checkpoint::SaveCameras(const algorithm::Cameras& cameras) const {
+  WriteFile(FilePath(kCamerasFile), key_, [&cameras](std::ofstream& stream) {
+    WriteVector(stream, cameras.cameras, WriteCamera);
+    WriteVector(stream, cameras.component, WritePod<int>);
+    Write(stream, cameras.wave_correction_user);
+    Write(stream, static_cast<std::int32_t>(cameras.wave_correction_auto));
+  });
+}
+
+std::optional<algorithm::Cameras> Checkpoint::LoadCameras() const {
+  auto stream = OpenFile(FilePath(kCamerasFile), key_);
+  if (!stream) {
+    return {};
+  }
+  algorithm::Cameras cameras;
+  std::int32_t wave_correction_auto = 0;
+  if (!ReadVector(*stream, &cameras.cameras, ReadCamera) ||
+      !ReadVector(*stream, &cameras.component, ReadPod<int>) ||
+      !Read(*stream, &cameras.wave_correction_user) ||
+      !Read(*stream, &wave_correction_auto) ||
+      static_cast<int>(cameras.cameras.size()) != num_images_) {
+    return {};
+  }
+  cameras.wave_correction_auto =
+      static_cast<cv::detail::WaveCorrectKind>(wave_correction_auto);
+  return cameras;
+}
+
+void Checkpoint::SaveSession(const algorithm::StitchSession& session) const {
+  auto* gains = dynamic_cast<cv::detail::BlocksCompensator*>(
+      session.compose ? session.compose->exposure_comp.get() : nullptr);
+  if (gains == nullptr) {
+    spdlog::debug("Not checkpointing the seams without the block gains");
+    return;
+  }
+  std::vector<cv::Mat> gain_maps;
+  gains->getMatGains(gain_maps);
+  const auto& cache = *session.compose;
+  WriteFile(FilePath(kSessionFile), key_, [&](std::ofstream& stream) {
+    Write(stream, static_cast<std::int32_t>(session.wave_correct_kind));
+    Write(stream, session.seam_finder);
+    WriteVector(stream, cache.full_img_sizes, WritePod<cv::Size>);
+    WriteVector(stream, cache.cameras, WriteCamera);
+    Write(stream, cache.warped_image_scale);
+    Write(stream, cache.seam_work_aspect);
+    Write(stream, cache.max_pano_mpx);
+    Write(stream, cache.max_memory_mb);
+    Write(stream, cache.compose_warped_image_scale);
+    WriteVector(stream, cache.corners, WritePod<cv::Point>);
+    WriteVector(stream, cache.sizes, WritePod<cv::Size>);
+    Write(stream, static_cast<std::uint8_t>(cache.resolution_capped));
+    WriteVector(stream, cache.seams, WriteUMat);
+    WriteVector(stream, gain_maps, WriteMat);
+  });
+}
+
+std::shared_ptr<const algorithm::StitchSession> Checkpoint::LoadSession()
+    const {
+  auto stream = OpenFile(FilePath(kSessionFile), key_);
+  if (!stream) {
+    return {};
+  }
+  std::int32_t wave_correct_kind = 0;
+  algorithm::SeamFinderType seam_finder{};
+  algorithm::stitcher::ComposeCache cache;
+  std::uint8_t resolution_capped = 0;
+  std::vector<cv::Mat> gain_maps;
+  if (!Read(*stream, &wave_correct_kind) || !Read(*stream, &seam_finder) ||
+      !ReadVector(*stream, &cache.full_img_sizes, ReadPod<cv::Size>) ||
+      !ReadVector(*stream, &cache.cameras, ReadCamera) ||
+      !Read(*stream, &cache.warped_image_scale) ||
+      !Read(*stream, &cache.seam_work_aspect) ||
+      !Read(*stream, &cache.max_pano_mpx) ||
+      !Read(*stream, &cache.max_memory_mb) ||
+      !Read(*stream, &cache.compose_warped_image_scale) ||
+      !ReadVector(*stream, &cache.corners, ReadPod<cv::Point>) ||
+      !ReadVector(*stream, &cache.sizes, ReadPod<cv::Size>) ||
+      !Read(*stream, &resolution_capped) ||
+      !ReadVector(*stream, &cache.seams, ReadUMat) ||
+      !ReadVector(*stream, &gain_maps, ReadMat) ||
+      static_cast<int>(cache.seams.size()) != num_images_) {
+    return {};
+  }
+  cache.resolution_capped = resolution_capped != 0;
+  auto gains = cv::makePtr<cv::detail::BlocksGainCompensator>();
+  gains->setMatGains(gain_maps);
+  cache.exposure_comp = gains;
+  return std::make_shared<const algorithm::StitchSession>(
+      algorithm::StitchSession{
+          projection_,
+          static_cast<cv::detail::WaveCorrectKind>(wave_correct_kind),
+          seam_finder,
+          std::make_shared<const algorithm::stitcher::ComposeCache>(
+              std::move(cache)),
+          nullptr, exposure_per_channel_});
+}
+
+void Checkpoint::SavePano(const ComposedPano& composed) const {
+  WriteFile(FilePath(kPanoFile), key_, [&composed](std::ofstream& stream) {
+    Write(stream, composed.status);
+    WriteMat(stream, composed.pano);
+    WriteMat(stream, composed.mask.Decode());
+  });
+}
+
+std::optional<ComposedPano> Checkpoint::LoadPano() const {
+  auto stream = OpenFile(FilePath(kPanoFile), key_);
+  if (!stream) {
+    return {};
+  }
+  algorithm::stitcher::Status status{};
+  cv::Mat pano;
+  cv::Mat mask;
+  if (!Read(*stream, &status) || !ReadMat(*stream, &pano) ||
+      !ReadMat(*stream, &mask) || pano.empty()) {
+    return {};
+  }
+  return ComposedPano{
+      .status = status, .pano = pano, .mask = algorithm::RleMask(mask)};
+}
+
+void Checkpoint::Remove() const {
+  std::error_code error;
+  std::filesystem::remove_all(dir_, error);
+  if (error) {
+    spdlog::warn("Failed to remove checkpoints {}: {}", dir_.string(),
+                 error.message());
+  }
+}
+
+}  // namespace xpano::pipeline
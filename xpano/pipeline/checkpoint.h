@@ -0,0 +1,73 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/algorithm/algorithm.h"
+#include "xpano/algorithm/image.h"
+#include "xpano/algorithm/options.h"
+#include "xpano/algorithm/rle_mask.h"
+#include "xpano/algorithm/stitcher.h"
+#include "xpano/pipeline/stitcher_pipeline.h"
+
+namespace xpano::pipeline {
+
+struct ComposedPano {
+  algorithm::stitcher::Status status;
+  cv::Mat pano;
+  algorithm::RleMask mask;
+};
+
+// Intermediate results of a full resolution stitch kept on disk, a stitch
+// restarted with the same inputs after a failure, cancellation or a killed
+// process resumes after the last completed stage:
+//  - The cameras, once estimated.
+//  - The pano size, exposure gains and seams, once the seams are estimated.
+//  - The composed pano and its mask, before the auto crop and export.
+// The images with their file sizes and modification times, the cameras of
+// the pano and the stitching options select a subdirectory of the checkpoint
+// directory. Each file is written to a temporary one first, a killed process
+// leaves only complete checkpoints behind.
+class Checkpoint {
+ public:
+  Checkpoint(const std::filesystem::path& checkpoint_dir,
+             const algorithm::Pano& pano,
+             const std::vector<algorithm::Image>& images,
+             const StitchingOptions& options);
+
+  void SaveCameras(const algorithm::Cameras& cameras) const;
+  [[nodiscard]] std::optional<algorithm::Cameras> LoadCameras() const;
+
+  // Only sessions with the exposure gains of a BlocksCompensator
+  void SaveSession(const algorithm::StitchSession& session) const;
+  [[nodiscard]] std::shared_ptr<const algorithm::StitchSession> LoadSession()
+      const;
+
+  void SavePano(const ComposedPano& composed) const;
+  [[nodiscard]] std::optional<ComposedPano> LoadPano() const;
+
+  // Once the stitch is complete
+  void Remove() const;
+
+  [[nodiscard]] const std::filesystem::path& Dir() const { return dir_; }
+
+ private:
+  [[nodiscard]] std::filesystem::path FilePath(const std::string& name) const;
+
+  std::string key_;
+  std::filesystem::path dir_;
+  int num_images_;
+  algorithm::ProjectionOptions projection_;
+  bool exposure_per_channel_;
+};
+
+}  // namespace xpano::pipeline
@@ -0,0 +1,135 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/pipeline/full_res_cache.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/algorithm/image.h"
+#include "xpano/pipeline/mapped_frames.h"
+#include "xpano/utils/fmt.h"
+#include "xpano/utils/memory.h"
+
+namespace xpano::pipeline {
+
+using utils::memory::Category;
+
+namespace {
+
+// Stamps the key with the size and modification time of the file, a file
+// edited on disk is decoded again. Images decoded from memory keep the plain
+// key.
+std::string CacheKey(const algorithm::Image& image) {
+  auto key = image.GetKey();
+  std::error_code error;
+  const auto size = std::filesystem::file_size(image.GetPath(), error);
+  if (error) {
+    return key;
+  }
+  const auto modified =
+      std::filesystem::last_write_time(image.GetPath(), error);
+  if (error) {
+    return key;
+  }
+  return fmt::format("{}|{}|{}", key, size,
+                     modified.time_since_epoch().count());
+}
+
+}  // namespace
+
+FullResCache::FullResCache(
+    std::size_t budget_bytes,
+    const std::optional<std::filesystem::path>& mapped_dir)
+    : budget_bytes_(budget_bytes),
+      mapped_frames_(mapped_dir
+                         ? std::make_unique<MappedFrameStore>(*mapped_dir)
+                         : nullptr) {}
+
+FullResCache::~FullResCache() { Clear(); }
+
+cv::Mat FullResCache::Get(const algorithm::Image& image) {
+  auto key = CacheKey(image);
+  {
+    const std::lock_guard lock(mutex_);
+    if (auto iter = index_.find(key); iter != index_.end()) {
+      entries_.splice(entries_.begin(), entries_, iter->second);
+      stats_.hits++;
+      return iter->second->frame;
+    }
+  }
+
+  // Left out of the memory budget, the OS pages the mapping in and out
+  if (mapped_frames_) {
+    if (auto frame = mapped_frames_->Load(image); !frame.empty()) {
+      const std::lock_guard lock(mutex_);
+      stats_.mapped_hits++;
+      return frame;
+    }
+  }
+
+  {
+    const std::lock_guard lock(mutex_);
+    stats_.misses++;
+  }
+  // Decode outside of the lock, multiple frames can be loaded in parallel
+  auto frame = image.GetFullRes();
+  if (!frame.empty()) {
+    Insert(key, frame);
+    if (mapped_frames_) {
+      mapped_frames_->Save(image, frame);
+    }
+  }
+  return frame;
+}
+
+void FullResCache::Insert(const std::string& key, const cv::Mat& frame) {
+  const std::size_t bytes = frame.total() * frame.elemSize();
+  if (bytes > budget_bytes_) {
+    return;
+  }
+
+  const std::lock_guard lock(mutex_);
+  if (index_.contains(key)) {
+    return;
+  }
+  entries_.push_front({key, frame, bytes});
+  index_[key] = entries_.begin();
+  stats_.bytes_used += bytes;
+  std::size_t evicted_bytes = 0;
+
+  while (stats_.bytes_used > budget_bytes_) {
+    const auto& last = entries_.back();
+    stats_.bytes_used -= last.bytes;
+    evicted_bytes += last.bytes;
+    index_.erase(last.key);
+    entries_.pop_back();
+  }
+  utils::memory::Add(Category::kFullResFrames,
+                     static_cast<std::int64_t>(bytes) -
+                         static_cast<std::int64_t>(evicted_bytes));
+}
+
+FullResCacheStats FullResCache::Stats() const {
+  const std::lock_guard lock(mutex_);
+  return stats_;
+}
+
+void FullResCache::Clear() {
+  const std::lock_guard lock(mutex_);
+  entries_.clear();
+  index_.clear();
+  utils::memory::Add(Category::kFullResFrames,
+                     -static_cast<std::int64_t>(stats_.bytes_used));
+  stats_.bytes_used = 0;
+}
+
+}  // namespace xpano::pipeline
@@ -0,0 +1,69 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/algorithm/image.h"
+#include "xpano/pipeline/mapped_frames.h"
+
+namespace xpano::pipeline {
+
+struct FullResCacheStats {
+  int hits = 0;
+  int mapped_hits = 0;
+  int misses = 0;
+  std::size_t bytes_used = 0;
+};
+
+// Thread safe LRU cache of decoded full resolution frames.
+//  - Least recently used frames are evicted once the budget is exceeded.
+//  - Frames larger than the whole budget are never cached.
+//  - The returned cv::Mat shares the cached buffer, don't modify it in place.
+//  - With mapped_dir set, every decoded frame is also kept in a
+//    MappedFrameStore there. Frames missing from memory are mapped from it
+//    instead of being decoded again, see FullResCacheStats::mapped_hits.
+class FullResCache {
+ public:
+  explicit FullResCache(
+      std::size_t budget_bytes,
+      const std::optional<std::filesystem::path>& mapped_dir = {});
+  FullResCache(const FullResCache&) = delete;
+  FullResCache& operator=(const FullResCache&) = delete;
+  FullResCache(FullResCache&&) = delete;
+  FullResCache& operator=(FullResCache&&) = delete;
+  ~FullResCache();
+
+  cv::Mat Get(const algorithm::Image& image);
+  [[nodiscard]] FullResCacheStats Stats() const;
+  void Clear();
+
+ private:
+  struct Entry {
+    std::string key;
+    cv::Mat frame;
+    std::size_t bytes;
+  };
+
+  void Insert(const std::string& key, const cv::Mat& frame);
+
+  std::size_t budget_bytes_;
+  std::unique_ptr<MappedFrameStore> mapped_frames_;
+
+  mutable std::mutex mutex_;
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  FullResCacheStats stats_;
+};
+
+}  // namespace xpano::pipeline
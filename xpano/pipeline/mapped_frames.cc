@@ -0,0 +1,187 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/pipeline/mapped_frames.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <opencv2/core.hpp>
+#include <spdlog/spdlog.h>
+
+#include "xpano/algorithm/image.h"
+#include "xpano/utils/fmt.h"
+#include "xpano/utils/mapped_file.h"
+#include "xpano/utils/path.h"
+
+namespace xpano::pipeline {
+
+namespace {
+
+// Frees the mapping with the last cv::Mat referencing it, anything else is
+// left to the standard allocator, e.g. when a Mat header sharing this
+// allocator is reallocated
+class MappedAllocator : public cv::MatAllocator {
+ public:
+  cv::UMatData* allocate(int dims, const int* sizes, int type, void* data,
+                         size_t* step, cv::AccessFlag flags,
+                         cv::UMatUsageFlags usage_flags) const override {
+    return cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data, step,
+                                                flags, usage_flags);
+  }
+
+  bool allocate(cv::UMatData* data, cv::AccessFlag flags,
+                cv::UMatUsageFlags usage_flags) const override {
+    return cv::Mat::getStdAllocator()->allocate(data, flags, usage_flags);
+  }
+
+  void deallocate(cv::UMatData* data) const override {
+    if (data == nullptr) {
+      return;
+    }
+    delete static_cast<utils::MappedFile*>(data->userdata);
+    delete data;
+  }
+};
+
+const MappedAllocator* GetMappedAllocator() {
+  static const MappedAllocator kAllocator;
+  return &kAllocator;
+}
+
+cv::Mat ToMat(std::unique_ptr<utils::MappedFile> file, int rows, int cols,
+              int type) {
+  const auto* allocator = GetMappedAllocator();
+  cv::Mat mat(rows, cols, type, file->Data());
+  auto* data = new cv::UMatData(allocator);
+  data->data = data->origdata = file->Data();
+  data->size = file->Size();
+  data->userdata = file.release();
+  data->refcount = 1;
+  mat.allocator = allocator;
+  mat.u = data;
+  return mat;
+}
+
+struct FileStamp {
+  std::uintmax_t size;
+  std::filesystem::file_time_type modified;
+};
+
+std::optional<FileStamp> Stamp(const std::filesystem::path& path) {
+  std::error_code error;
+  const auto size = std::filesystem::file_size(path, error);
+  if (error) {
+    return {};
+  }
+  const auto modified = std::filesystem::last_write_time(path, error);
+  if (error) {
+    return {};
+  }
+  return FileStamp{size, modified};
+}
+
+}  // namespace
+
+MappedFrameStore::MappedFrameStore(std::filesystem::path dir)
+    : parent_dir_(std::move(dir)) {}
+
+MappedFrameStore::~MappedFrameStore() {
+  if (!dir_) {
+    return;
+  }
+  // Fails on Windows while a frame is still mapped
+  std::error_code error;
+  std::filesystem::remove_all(*dir_, error);
+  if (error) {
+    spdlog::warn("Failed to remove mapped frames {}: {}", dir_->string(),
+                 error.message());
+  }
+}
+
+cv::Mat MappedFrameStore::Load(const algorithm::Image& image) const {
+  std::optional<Entry> entry;
+  {
+    const std::lock_guard lock(mutex_);
+    if (auto iter = entries_.find(image.GetKey());
+        iter != entries_.end()) {
+      entry = iter->second;
+    }
+  }
+  if (!entry) {
+    return {};
+  }
+  const auto stamp = Stamp(image.GetPath());
+  if (!stamp || stamp->size != entry->file_size ||
+      stamp->modified != entry->modified) {
+    return {};
+  }
+  auto file = utils::MappedFile::Open(entry->path);
+  const auto bytes = static_cast<std::size_t>(entry->rows) * entry->cols *
+                     CV_ELEM_SIZE(entry->type);
+  if (!file || file->Size() != bytes) {
+    return {};
+  }
+  return ToMat(std::move(file), entry->rows, entry->cols, entry->type);
+}
+
+void MappedFrameStore::Save(const algorithm::Image& image,
+                            const cv::Mat& frame) {
+  const auto key = image.GetKey();
+  const auto stamp = Stamp(image.GetPath());
+  if (!stamp || frame.empty()) {
+    return;
+  }
+
+  std::filesystem::path path;
+  {
+    const std::lock_guard lock(mutex_);
+    if (dir_failed_ || entries_.contains(key)) {
+      return;
+    }
+    if (!dir_) {
+      dir_ = utils::path::CreateUniqueDir(parent_dir_, "xpano-frames");
+      if (!dir_) {
+        spdlog::warn("Failed to create a mapped frames directory in {}",
+                     parent_dir_.string());
+        dir_failed_ = true;
+        return;
+      }
+    }
+    path = *dir_ / fmt::format("{}.raw", next_file_id_++);
+  }
+
+  // Raw rows, the mapping is read back with the same layout
+  const cv::Mat continuous = frame.isContinuous() ? frame : frame.clone();
+  {
+    std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+    stream.write(reinterpret_cast<const char*>(continuous.data),
+                 static_cast<std::streamsize>(continuous.total() *
+                                              continuous.elemSize()));
+    stream.close();
+    if (!stream) {
+      spdlog::warn("Failed to write mapped frame {}", path.string());
+      std::error_code error;
+      std::filesystem::remove(path, error);
+      return;
+    }
+  }
+
+  const std::lock_guard lock(mutex_);
+  entries_.try_emplace(key, Entry{.path = path,
+                                  .file_size = stamp->size,
+                                  .modified = stamp->modified,
+                                  .rows = frame.rows,
+                                  .cols = frame.cols,
+                                  .type = frame.type()});
+}
+
+}  // namespace xpano::pipeline
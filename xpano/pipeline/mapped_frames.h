@@ -0,0 +1,58 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/algorithm/image.h"
+
+namespace xpano::pipeline {
+
+// Decoded full resolution frames kept as raw files for the session, later
+// stitches map the pixels instead of decoding the image again.
+//  - One file per image in a fresh subdirectory of dir, removed with the
+//    store.
+//  - The OS page cache decides which pixels stay resident, not the heap.
+//  - A frame is reused only while the image file keeps its size and
+//    modification time.
+//  - The returned cv::Mat keeps its mapping alive, writes to it stay private.
+// Thread safe.
+class MappedFrameStore {
+ public:
+  explicit MappedFrameStore(std::filesystem::path dir);
+  MappedFrameStore(const MappedFrameStore&) = delete;
+  MappedFrameStore& operator=(const MappedFrameStore&) = delete;
+  ~MappedFrameStore();
+
+  // Empty if not saved or the image changed since
+  [[nodiscard]] cv::Mat Load(const algorithm::Image& image) const;
+  void Save(const algorithm::Image& image, const cv::Mat& frame);
+
+ private:
+  struct Entry {
+    std::filesystem::path path;
+    std::uintmax_t file_size;
+    std::filesystem::file_time_type modified;
+    int rows;
+    int cols;
+    int type;
+  };
+
+  std::filesystem::path parent_dir_;
+
+  mutable std::mutex mutex_;
+  std::optional<std::filesystem::path> dir_;
+  bool dir_failed_ = false;
+  int next_file_id_ = 0;
+  std::unordered_map<std::string, Entry> entries_;
+};
+
+}  // namespace xpano::pipeline
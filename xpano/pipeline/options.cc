@@ -3,8 +3,97 @@
 
 #include "xpano/pipeline/options.h"
 
+#include <algorithm>
+#include <array>
+#include <optional>
+
 namespace xpano::pipeline {
 
+namespace {
+
+struct Dependency {
+  StitchStage stage;
+  bool (*changed)(const Options &before, const Options &after);
+};
+
+template <auto kGroup, auto kField>
+bool Changed(const Options &before, const Options &after) {
+  return before.*kGroup.*kField != after.*kGroup.*kField;
+}
+
+// Every field read by the stitching and the export, with the first stage
+// reading it
+constexpr auto kStitchDependencies = std::array{
+    Dependency{StitchStage::kFeatures,
+               Changed<&Options::stitch, &StitchAlgorithmOptions::feature>},
+    Dependency{StitchStage::kFeatures,
+               Changed<&Options::stitch, &StitchAlgorithmOptions::match_conf>},
+    Dependency{
+        StitchStage::kFeatures,
+        Changed<&Options::stitch, &StitchAlgorithmOptions::reuse_matches>},
+    Dependency{
+        StitchStage::kCameras,
+        Changed<&Options::stitch, &StitchAlgorithmOptions::wave_correction>},
+    Dependency{StitchStage::kSeams,
+               Changed<&Options::stitch, &StitchAlgorithmOptions::projection>},
+    Dependency{StitchStage::kSeams,
+               Changed<&Options::stitch, &StitchAlgorithmOptions::seam_finder>},
+    Dependency{
+        StitchStage::kSeams,
+        Changed<&Options::stitch, &StitchAlgorithmOptions::max_pano_mpx>},
+    Dependency{
+        StitchStage::kSeams,
+        Changed<&Options::stitch,
+                &StitchAlgorithmOptions::reuse_preview_seams>},
+    Dependency{
+        StitchStage::kSeams,
+        Changed<&Options::stitch,
+                &StitchAlgorithmOptions::exposure_per_channel>},
+    Dependency{
+        StitchStage::kSeams,
+        Changed<&Options::stitch, &StitchAlgorithmOptions::max_memory_mb>},
+    Dependency{
+        StitchStage::kComposition,
+        Changed<&Options::stitch, &StitchAlgorithmOptions::blending_method>},
+    Dependency{
+        StitchStage::kComposition,
+        Changed<&Options::stitch, &StitchAlgorithmOptions::device_resident>},
+    Dependency{StitchStage::kComposition,
+               Changed<&Options::stitch,
+                       &StitchAlgorithmOptions::preview_blending_method>},
+    Dependency{
+        StitchStage::kExport,
+        Changed<&Options::compression, &CompressionOptions::jpeg_quality>},
+    Dependency{
+        StitchStage::kExport,
+        Changed<&Options::compression, &CompressionOptions::jpeg_progressive>},
+    Dependency{
+        StitchStage::kExport,
+        Changed<&Options::compression, &CompressionOptions::jpeg_optimize>},
+    Dependency{
+        StitchStage::kExport,
+        Changed<&Options::compression, &CompressionOptions::jpeg_subsampling>},
+    Dependency{
+        StitchStage::kExport,
+        Changed<&Options::compression, &CompressionOptions::png_compression>},
+    Dependency{StitchStage::kExport,
+               Changed<&Options::compression, &CompressionOptions::tiff_tiled>},
+    Dependency{
+        StitchStage::kExport,
+        Changed<&Options::compression, &CompressionOptions::tiff_overviews>},
+    Dependency{
+        StitchStage::kExport,
+        Changed<&Options::compression, &CompressionOptions::encoder_quality>},
+    Dependency{
+        StitchStage::kExport,
+        Changed<&Options::compression, &CompressionOptions::encoder_effort>},
+    Dependency{StitchStage::kExport,
+               Changed<&Options::metadata,
+                       &MetadataOptions::copy_from_first_image>},
+};
+
+}  // namespace
+
 const char *Label(ChromaSubsampling subsampling) {
   switch (subsampling) {
     case ChromaSubsampling::k444:
@@ -26,9 +115,23 @@ const char *Label(MatchingType type) {
       return "Single pano";
     case MatchingType::kAuto:
       return "Auto";
+    case MatchingType::kGrid:
+      return "Grid";
     default:
       return "Unknown";
   }
 }
 
+std::optional<StitchStage> FirstInvalidStage(const Options &before,
+                                             const Options &after) {
+  std::optional<StitchStage> first;
+  for (const auto &dependency : kStitchDependencies) {
+    if ((!first || dependency.stage < *first) &&
+        dependency.changed(before, after)) {
+      first = dependency.stage;
+    }
+  }
+  return first;
+}
+
 }  // namespace xpano::pipeline
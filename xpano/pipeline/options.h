@@ -5,6 +5,8 @@
 
 #include <array>
 #include <cstdint>
+#include <optional>
+#include <vector>
 
 #include "xpano/algorithm/options.h"
 #include "xpano/constants.h"
@@ -16,7 +18,7 @@ namespace xpano::pipeline {
 //  - Major changes can be auto detected by alpaca reflection, but e.g.
 //    modifying the enums cannot, so bump the version number in this case.
 //  - Will result in reloading the default values when loading the config.
-constexpr int kOptionsVersion = 5;
+constexpr int kOptionsVersion = 33;
 
 enum class ChromaSubsampling : std::uint8_t {
   k444,
@@ -29,12 +31,14 @@ const char *Label(ChromaSubsampling subsampling);
 const auto kSubsamplingModes = std::array{
     ChromaSubsampling::k444, ChromaSubsampling::k422, ChromaSubsampling::k420};
 
-enum class MatchingType : std::uint8_t { kNone, kSinglePano, kAuto };
+// kGrid: the 4- or 8-neighbours of a known capture grid, see GridPairs
+enum class MatchingType : std::uint8_t { kNone, kSinglePano, kAuto, kGrid };
 
 const char *Label(MatchingType type);
 
-const auto kMatchingTypes = std::array{
-    MatchingType::kAuto, MatchingType::kSinglePano, MatchingType::kNone};
+const auto kMatchingTypes =
+    std::array{MatchingType::kAuto, MatchingType::kSinglePano,
+               MatchingType::kNone, MatchingType::kGrid};
 
 /*****************************************************************************/
 
@@ -48,10 +52,48 @@ struct CompressionOptions {
   bool jpeg_optimize = false;
   ChromaSubsampling jpeg_subsampling = ChromaSubsampling::k422;
   int png_compression = kDefaultPngCompression;
+  // Tiled BigTIFF instead of cv::imwrite, for .tif / .tiff
+  bool tiff_tiled = false;
+  bool tiff_overviews = false;
+  // .jxl / .avif / .webp, see utils::encoders
+  int encoder_quality = kDefaultEncoderQuality;
+  int encoder_effort = kDefaultEncoderEffort;
+};
+
+// One of the processes composing a tiled export together, see ShardWriter
+struct ShardOptions {
+  int index = 0;
+  int count = 1;
+};
+
+// Process wide budgets of a run, e.g. to pack several jobs on one machine,
+// see ApplyResources
+struct ResourceOptions {
+  // Threads of the shared pool running the loading, matching, stitching,
+  // multiblend and the OpenCV loops, 0: one per core
+  int threads = 0;
+  // CPUs the process is pinned to, empty: no affinity
+  std::vector<int> cpus;
+  // Peak memory of the caches and the compositing, 0: no limit
+  int memory_mb = 0;
 };
 
 struct LoadingOptions {
   int preview_longer_side = kDefaultPreviewLongerSide;
+  int detection_longer_side = kDefaultDetectionLongerSide;
+  algorithm::FeatureType feature = algorithm::FeatureType::kSift;
+  int num_features = kNumFeatures;
+  bool use_feature_cache = true;
+  bool use_embedded_previews = false;
+  bool compact_features = false;
+  // Previews decoded on demand, see algorithm::Image::CompressPreview
+  bool compress_previews = false;
+  algorithm::DetectorBackend detector_backend =
+      algorithm::DetectorBackend::kCpu;
+  // Video inputs, see algorithm::video::KeyframeSelector
+  float keyframe_overlap = kDefaultKeyframeOverlap;
+  // Also applied to the full resolution frames, see algorithm::lens
+  algorithm::LensOptions lens;
 };
 
 using InpaintingOptions = algorithm::InpaintingOptions;
@@ -59,13 +101,48 @@ using InpaintingOptions = algorithm::InpaintingOptions;
 struct MatchingOptions {
   MatchingType type = MatchingType::kAuto;
   int neighborhood_search_size = kDefaultNeighborhoodSearchSize;
+  // The neighborhood is the max distance, the further images are matched only
+  // while the closer ones match weakly, see algorithm::MatchConnectivity
+  bool adaptive_neighborhood = false;
+  // Used instead of the neighborhood with MatchingType::kGrid
+  algorithm::GridOptions grid;
+  // Additionally match the most similar images across the whole set
+  bool use_retrieval = false;
+  int retrieval_candidates = kDefaultRetrievalCandidates;
+  // Skip the pairs of near-identical images, see algorithm::DifferenceHash
+  bool skip_duplicates = false;
+  int duplicate_hash_distance = kDefaultDuplicateHashDistance;
+  // Skip the pairs taken far apart, see algorithm::CaptureFilter
+  bool split_by_capture = false;
+  int max_time_gap = kDefaultMaxTimeGap;
+  int max_gps_distance = kDefaultMaxGpsDistance;
   int match_threshold = kDefaultMatchThreshold;
   float min_shift = kDefaultShiftInPano;
   float match_conf = kDefaultMatchConf;
+  algorithm::MatcherType matcher = algorithm::MatcherType::kFlann;
+  algorithm::HomographyMethod homography =
+      algorithm::HomographyMethod::kRansac;
+  // The pairs passing match_threshold are matched again at fine_longer_side,
+  // only inside the overlaps predicted by their homographies, see
+  // algorithm::GuidedMatch
+  bool coarse_to_fine = false;
+  int fine_longer_side = kDefaultFineLongerSide;
+  // Keeps only the summaries of the matches once the panos are found, the
+  // inliers are restored on demand, see algorithm::ReleaseInliers. Set by
+  // the GUI outside of the debug mode.
+  bool release_inliers = false;
 };
 
 using StitchAlgorithmOptions = algorithm::StitchUserOptions;
 
+struct PreviewOptions {
+  // Stitches the neighbours of the shown pano in the background
+  bool speculative_stitching = true;
+  // Mini panos of all the detected panos for the pano list, their cameras
+  // are then ready for the first stitch
+  bool pano_thumbnails = true;
+};
+
 struct Options {
   MetadataOptions metadata;
   CompressionOptions compression;
@@ -73,6 +150,25 @@ struct Options {
   InpaintingOptions inpaint;
   MatchingOptions matching;
   StitchAlgorithmOptions stitch;
+  PreviewOptions preview;
+};
+
+// Stages of stitching a pano, each one reuses the results of the earlier
+// ones: Pano::cameras, Pano::session and the StitchingResultCache
+enum class StitchStage : std::uint8_t {
+  kFeatures,     // the stitcher's own features and matches
+  kCameras,      // bundle adjustment, wave correction
+  kSeams,        // warping at the pano scale, exposure, seams
+  kComposition,  // blending
+  kCrop,         // auto crop of the composed pano
+  kExport,       // encoding of the exported file
 };
 
+// The earliest stage whose results are invalidated by changing the options
+// from before to after, see kStitchDependencies in options.cc. Nothing if
+// none of the fields read by the stitching changed. Loading and matching
+// changes invalidate the loaded images instead and aren't covered.
+std::optional<StitchStage> FirstInvalidStage(const Options &before,
+                                             const Options &after);
+
 }  // namespace xpano::pipeline
@@ -0,0 +1,534 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/pipeline/project.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/stitching/detail/camera.hpp>
+#include <spdlog/spdlog.h>
+
+#include "xpano/algorithm/algorithm.h"
+#include "xpano/algorithm/feature_cache.h"
+#include "xpano/algorithm/image.h"
+#include "xpano/algorithm/progress.h"
+#include "xpano/pipeline/options.h"
+#include "xpano/pipeline/stitcher_pipeline.h"
+#include "xpano/utils/rect.h"
+#include "xpano/utils/serialize.h"
+
+namespace xpano::pipeline {
+
+namespace {
+
+constexpr std::uint32_t kProjectMagic = 0x4A505058;  // "XPPJ"
+constexpr std::uint32_t kProjectFormatVersion = 3;
+
+// Hashed part of the source files, enough to notice a replaced file
+constexpr std::size_t kHashedBytes = 64 * 1024;
+
+struct SavedImage {
+  std::string path;
+  std::uint64_t file_size;
+  std::uint64_t hash;
+  // The saved preview is already undistorted, see algorithm::lens
+  std::optional<algorithm::LensProfile> lens;
+};
+
+struct SavedDMatch {
+  int query_id;
+  int train_id;
+  int image_id;
+  float distance;
+};
+
+struct SavedMatchSummary {
+  int num_inliers;
+  std::vector<double> homography;
+  algorithm::MatchOptions options;
+};
+
+struct SavedMatch {
+  int id1;
+  int id2;
+  std::vector<SavedDMatch> matches;
+  float avg_shift;
+  std::optional<SavedMatchSummary> summary;
+};
+
+struct SavedCamera {
+  double focal;
+  double aspect;
+  double ppx;
+  double ppy;
+  int rotation_type;
+  std::vector<double> rotation;
+  int translation_type;
+  std::vector<double> translation;
+};
+
+struct SavedCameras {
+  std::vector<SavedCamera> cameras;
+  std::vector<int> component;
+  algorithm::WaveCorrectionType wave_correction_user;
+  int wave_correction_auto;
+  // The warper is created again by the next composition
+  double work_scale;
+  std::vector<int> corners;
+  std::vector<int> sizes;
+  std::vector<int> full_sizes;
+};
+
+struct SavedRect {
+  float start_x;
+  float start_y;
+  float end_x;
+  float end_y;
+};
+
+struct SavedPano {
+  std::vector<int> ids;
+  bool exported;
+  std::optional<SavedRect> crop;
+  std::optional<SavedRect> auto_crop;
+  std::optional<SavedCameras> cameras;
+  std::optional<SavedCameras> backup_cameras;
+  std::vector<std::optional<SavedCamera>> initial_cameras;
+};
+
+struct SavedOptions {
+  int version;
+  Options options;
+};
+
+struct SavedState {
+  std::vector<SavedImage> images;
+  std::vector<SavedMatch> matches;
+  std::vector<SavedPano> panos;
+};
+
+template <typename TValue>
+void Write(std::ofstream& stream, const TValue& value) {
+  stream.write(reinterpret_cast<const char*>(&value), sizeof(TValue));
+}
+
+template <typename TValue>
+bool Read(std::ifstream& stream, TValue* value) {
+  stream.read(reinterpret_cast<char*>(value), sizeof(TValue));
+  return static_cast<bool>(stream);
+}
+
+void WriteBytes(std::ofstream& stream,
+                const std::vector<std::uint8_t>& bytes) {
+  Write(stream, static_cast<std::uint64_t>(bytes.size()));
+  stream.write(reinterpret_cast<const char*>(bytes.data()),
+               static_cast<std::streamsize>(bytes.size()));
+}
+
+bool ReadBytes(std::ifstream& stream, std::vector<std::uint8_t>* bytes) {
+  std::uint64_t size = 0;
+  if (!Read(stream, &size)) {
+    return false;
+  }
+  bytes->resize(size);
+  stream.read(reinterpret_cast<char*>(bytes->data()),
+              static_cast<std::streamsize>(size));
+  return static_cast<bool>(stream);
+}
+
+std::string ToUtf8(const std::filesystem::path& path) {
+  const auto text = path.u8string();
+  return {reinterpret_cast<const char*>(text.data()), text.size()};
+}
+
+std::filesystem::path FromUtf8(const std::string& text) {
+  return {std::u8string(reinterpret_cast<const char8_t*>(text.data()),
+                        text.size())};
+}
+
+// FNV-1a of the first kHashedBytes, empty if the file can't be read
+std::optional<std::uint64_t> HashFile(const std::filesystem::path& path) {
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream) {
+    return {};
+  }
+  std::vector<char> bytes(kHashedBytes);
+  stream.read(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+  bytes.resize(stream.gcount());
+  std::uint64_t hash = 0xcbf29ce484222325;
+  for (const char byte : bytes) {
+    hash = (hash ^ static_cast<std::uint8_t>(byte)) * 0x100000001b3;
+  }
+  return hash;
+}
+
+SavedImage SaveImage(const algorithm::Image& image) {
+  std::error_code error;
+  const auto file_size = std::filesystem::file_size(image.GetPath(), error);
+  return {.path = ToUtf8(image.GetPath()),
+          .file_size = error ? 0 : file_size,
+          .hash = HashFile(image.GetPath()).value_or(0),
+          .lens = image.GetLensProfile()};
+}
+
+bool SourceChanged(const SavedImage& image) {
+  const auto path = FromUtf8(image.path);
+  std::error_code error;
+  const auto file_size = std::filesystem::file_size(path, error);
+  return error || file_size != image.file_size ||
+         HashFile(path) != image.hash;
+}
+
+std::vector<double> ToVector(const cv::Mat& mat) {
+  if (mat.empty()) {
+    return {};
+  }
+  cv::Mat values;
+  mat.convertTo(values, CV_64F);
+  return {values.begin<double>(), values.end<double>()};
+}
+
+cv::Mat ToMat(const std::vector<double>& values, int rows, int type) {
+  if (values.empty()) {
+    return {};
+  }
+  cv::Mat mat;
+  cv::Mat(values, /*copyData=*/true).reshape(1, rows).convertTo(mat, type);
+  return mat;
+}
+
+SavedCamera SaveCamera(const cv::detail::CameraParams& camera) {
+  return {.focal = camera.focal,
+          .aspect = camera.aspect,
+          .ppx = camera.ppx,
+          .ppy = camera.ppy,
+          .rotation_type = camera.R.type(),
+          .rotation = ToVector(camera.R),
+          .translation_type = camera.t.type(),
+          .translation = ToVector(camera.t)};
+}
+
+cv::detail::CameraParams RestoreCamera(const SavedCamera& saved) {
+  cv::detail::CameraParams camera;
+  camera.focal = saved.focal;
+  camera.aspect = saved.aspect;
+  camera.ppx = saved.ppx;
+  camera.ppy = saved.ppy;
+  camera.R = ToMat(saved.rotation, 3, saved.rotation_type);
+  camera.t = ToMat(saved.translation, 3, saved.translation_type);
+  return camera;
+}
+
+template <typename TValue>
+std::vector<int> Flatten(const std::vector<TValue>& values) {
+  std::vector<int> flat;
+  for (const auto& value : values) {
+    if constexpr (std::is_same_v<TValue, cv::Point>) {
+      flat.insert(flat.end(), {value.x, value.y});
+    } else {
+      flat.insert(flat.end(), {value.width, value.height});
+    }
+  }
+  return flat;
+}
+
+template <typename TValue>
+std::vector<TValue> Unflatten(const std::vector<int>& flat) {
+  std::vector<TValue> values;
+  for (int i = 0; i + 1 < flat.size(); i += 2) {
+    values.emplace_back(flat[i], flat[i + 1]);
+  }
+  return values;
+}
+
+SavedCameras SaveCameras(const algorithm::Cameras& cameras) {
+  SavedCameras saved = {
+      .component = cameras.component,
+      .wave_correction_user = cameras.wave_correction_user,
+      .wave_correction_auto = static_cast<int>(cameras.wave_correction_auto),
+      .work_scale = cameras.warp_helper.work_scale,
+      .corners = Flatten(cameras.warp_helper.corners),
+      .sizes = Flatten(cameras.warp_helper.sizes),
+      .full_sizes = Flatten(cameras.warp_helper.full_sizes)};
+  for (const auto& camera : cameras.cameras) {
+    saved.cameras.push_back(SaveCamera(camera));
+  }
+  return saved;
+}
+
+algorithm::Cameras RestoreCameras(const SavedCameras& saved) {
+  algorithm::Cameras cameras = {
+      .component = saved.component,
+      .wave_correction_user = saved.wave_correction_user,
+      .wave_correction_auto =
+          static_cast<cv::detail::WaveCorrectKind>(saved.wave_correction_auto),
+      .warp_helper = {.work_scale = saved.work_scale,
+                      .corners = Unflatten<cv::Point>(saved.corners),
+                      .sizes = Unflatten<cv::Size>(saved.sizes),
+                      .full_sizes = Unflatten<cv::Size>(saved.full_sizes)}};
+  for (const auto& camera : saved.cameras) {
+    cameras.cameras.push_back(RestoreCamera(camera));
+  }
+  return cameras;
+}
+
+SavedRect SaveRect(const utils::RectRRf& rect) {
+  return {.start_x = rect.start[0],
+          .start_y = rect.start[1],
+          .end_x = rect.end[0],
+          .end_y = rect.end[1]};
+}
+
+utils::RectRRf RestoreRect(const SavedRect& saved) {
+  return {.start = {saved.start_x, saved.start_y},
+          .end = {saved.end_x, saved.end_y}};
+}
+
+template <typename TSaved, typename TValue, typename TFunction>
+std::optional<TSaved> Map(const std::optional<TValue>& value,
+                          TFunction function) {
+  if (!value) {
+    return {};
+  }
+  return function(*value);
+}
+
+SavedPano SavePano(const algorithm::Pano& pano) {
+  SavedPano saved = {
+      .ids = pano.ids,
+      .exported = pano.exported,
+      .crop = Map<SavedRect>(pano.crop, SaveRect),
+      .auto_crop = Map<SavedRect>(pano.auto_crop, SaveRect),
+      .cameras = Map<SavedCameras>(pano.cameras, SaveCameras),
+      .backup_cameras = Map<SavedCameras>(pano.backup_cameras, SaveCameras)};
+  for (const auto& camera : pano.initial_cameras) {
+    saved.initial_cameras.push_back(Map<SavedCamera>(camera, SaveCamera));
+  }
+  return saved;
+}
+
+algorithm::Pano RestorePano(const SavedPano& saved) {
+  algorithm::Pano pano = {
+      .ids = saved.ids,
+      .exported = saved.exported,
+      .crop = Map<utils::RectRRf>(saved.crop, RestoreRect),
+      .auto_crop = Map<utils::RectRRf>(saved.auto_crop, RestoreRect),
+      .cameras = Map<algorithm::Cameras>(saved.cameras, RestoreCameras),
+      .backup_cameras =
+          Map<algorithm::Cameras>(saved.backup_cameras, RestoreCameras)};
+  for (const auto& camera : saved.initial_cameras) {
+    pano.initial_cameras.push_back(
+        Map<cv::detail::CameraParams>(camera, RestoreCamera));
+  }
+  return pano;
+}
+
+SavedMatch SaveMatch(const algorithm::Match& match) {
+  SavedMatch saved = {
+      .id1 = match.id1, .id2 = match.id2, .avg_shift = match.avg_shift};
+  for (const auto& dmatch : match.matches) {
+    saved.matches.push_back({.query_id = dmatch.queryIdx,
+                             .train_id = dmatch.trainIdx,
+                             .image_id = dmatch.imgIdx,
+                             .distance = dmatch.distance});
+  }
+  if (const auto& summary = match.summary; summary) {
+    saved.summary = {.num_inliers = summary->num_inliers,
+                     .homography = ToVector(summary->homography),
+                     .options = summary->options};
+  }
+  return saved;
+}
+
+algorithm::Match RestoreMatch(const SavedMatch& saved) {
+  algorithm::Match match = {
+      .id1 = saved.id1, .id2 = saved.id2, .avg_shift = saved.avg_shift};
+  for (const auto& dmatch : saved.matches) {
+    match.matches.emplace_back(dmatch.query_id, dmatch.train_id,
+                               dmatch.image_id, dmatch.distance);
+  }
+  if (const auto& summary = saved.summary; summary) {
+    match.summary = {.num_inliers = summary->num_inliers,
+                     .homography = ToMat(summary->homography, 3, CV_64F),
+                     .options = summary->options};
+  }
+  return match;
+}
+
+bool ValidIds(const SavedState& state) {
+  const int num_images = static_cast<int>(state.images.size());
+  auto valid = [num_images](int id) { return id >= 0 && id < num_images; };
+  return std::all_of(state.matches.begin(), state.matches.end(),
+                     [&valid](const SavedMatch& match) {
+                       return valid(match.id1) && valid(match.id2);
+                     }) &&
+         std::all_of(state.panos.begin(), state.panos.end(),
+                     [&valid](const SavedPano& pano) {
+                       return std::all_of(pano.ids.begin(), pano.ids.end(),
+                                          valid);
+                     });
+}
+
+// Reads up to and including the options
+bool ReadHeader(std::ifstream& stream, const std::filesystem::path& path,
+                std::optional<Options>* options) {
+  std::uint32_t magic = 0;
+  std::uint32_t version = 0;
+  if (!Read(stream, &magic) || !Read(stream, &version) ||
+      magic != kProjectMagic) {
+    spdlog::error("{} is not a project file", path.string());
+    return false;
+  }
+  if (version != kProjectFormatVersion) {
+    spdlog::error("{} was saved by another version of the app",
+                  path.string());
+    return false;
+  }
+
+  std::vector<std::uint8_t> buffer;
+  if (!ReadBytes(stream, &buffer)) {
+    spdlog::error("Failed to read {}", path.string());
+    return false;
+  }
+  auto [status, saved] =
+      utils::serialize::DeserializeFromBuffer<SavedOptions>(buffer);
+  if (status == utils::serialize::DeserializeStatus::kSuccess &&
+      saved.version == kOptionsVersion) {
+    *options = saved.options;
+  } else {
+    spdlog::warn("The options of {} are from another version, keeping the "
+                 "current ones",
+                 path.string());
+  }
+  return true;
+}
+
+}  // namespace
+
+bool SaveProject(const std::filesystem::path& path, const StitcherData& data,
+                 const Options& options) {
+  SavedState state;
+  for (const auto& image : data.images) {
+    state.images.push_back(SaveImage(image));
+  }
+  for (const auto& match : data.matches) {
+    state.matches.push_back(SaveMatch(match));
+  }
+  for (const auto& pano : data.panos) {
+    state.panos.push_back(SavePano(pano));
+  }
+
+  auto tmp_path = path;
+  tmp_path += ".tmp";
+  bool written = false;
+  {
+    std::ofstream stream(tmp_path, std::ios::binary | std::ios::trunc);
+    if (!stream) {
+      spdlog::error("Failed to open {}", tmp_path.string());
+      return false;
+    }
+    Write(stream, kProjectMagic);
+    Write(stream, kProjectFormatVersion);
+    WriteBytes(stream, utils::serialize::SerializeToBuffer(SavedOptions{
+                           .version = kOptionsVersion, .options = options}));
+    WriteBytes(stream, utils::serialize::SerializeToBuffer(state));
+    for (const auto& image : data.images) {
+      algorithm::WriteImageData(stream, image);
+    }
+    written = static_cast<bool>(stream);
+  }
+
+  std::error_code error;
+  if (written) {
+    std::filesystem::rename(tmp_path, path, error);
+  }
+  if (!written || error) {
+    spdlog::error("Failed to write the project {}", path.string());
+    std::filesystem::remove(tmp_path, error);
+    return false;
+  }
+  spdlog::info("Saved the project {}", path.string());
+  return true;
+}
+
+std::optional<Project> LoadProject(const std::filesystem::path& path,
+                                   algorithm::ProgressMonitor* progress) {
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream) {
+    spdlog::error("Failed to open {}", path.string());
+    return {};
+  }
+  Project project;
+  if (!ReadHeader(stream, path, &project.options)) {
+    return {};
+  }
+
+  std::vector<std::uint8_t> buffer;
+  if (!ReadBytes(stream, &buffer)) {
+    spdlog::error("Failed to read {}", path.string());
+    return {};
+  }
+  auto [status, state] =
+      utils::serialize::DeserializeFromBuffer<SavedState>(buffer);
+  if (status == utils::serialize::DeserializeStatus::kBreakingChange) {
+    spdlog::error("{} was saved by another version of the app",
+                  path.string());
+    return {};
+  }
+  if (status != utils::serialize::DeserializeStatus::kSuccess ||
+      !ValidIds(state)) {
+    spdlog::error("Corrupted project {}", path.string());
+    return {};
+  }
+
+  progress->Reset(algorithm::ProgressType::kLoadingImages,
+                  static_cast<int>(state.images.size()));
+  for (int i = 0; i < state.images.size(); i++) {
+    const auto& saved = state.images[i];
+    auto image = algorithm::ReadImageData(stream, FromUtf8(saved.path));
+    if (!image) {
+      spdlog::error("Corrupted project {}", path.string());
+      return {};
+    }
+    image->SetLensProfile(saved.lens);
+    if (SourceChanged(saved)) {
+      spdlog::warn("{} changed since the project was saved", saved.path);
+      project.changed_images.push_back(i);
+    }
+    project.data.images.push_back(*std::move(image));
+    progress->NotifyTaskDone();
+    if (progress->IsCancelled()) {
+      return {};
+    }
+  }
+
+  for (const auto& match : state.matches) {
+    project.data.matches.push_back(RestoreMatch(match));
+  }
+  for (const auto& pano : state.panos) {
+    project.data.panos.push_back(RestorePano(pano));
+  }
+  spdlog::info("Opened the project {}", path.string());
+  return project;
+}
+
+std::optional<Options> LoadProjectOptions(const std::filesystem::path& path) {
+  std::ifstream stream(path, std::ios::binary);
+  std::optional<Options> options;
+  if (!stream || !ReadHeader(stream, path, &options)) {
+    return {};
+  }
+  return options;
+}
+
+}  // namespace xpano::pipeline
@@ -0,0 +1,43 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+#include "xpano/algorithm/progress.h"
+#include "xpano/pipeline/options.h"
+#include "xpano/pipeline/stitcher_pipeline.h"
+
+namespace xpano::pipeline {
+
+// Project file, reopening it skips the loading, matching and camera
+// estimation:
+//  - The images are stored by path and a hash of the start of the source
+//    file together with their previews, keypoints and descriptors, same as
+//    the FeatureCache entries. A changed source is only reported.
+//  - The matches, the panos with their crops and cameras and the options.
+//    The options are stored separately, projects saved with other options
+//    versions open with the current options.
+//  - Written to a temporary file first, an existing project is replaced only
+//    by a complete one.
+bool SaveProject(const std::filesystem::path& path, const StitcherData& data,
+                 const Options& options);
+
+struct Project {
+  StitcherData data;
+  std::optional<Options> options;
+  // Images whose source file changed since the project was saved
+  std::vector<int> changed_images;
+};
+
+// Empty if the file can't be read or was cancelled through the progress
+std::optional<Project> LoadProject(const std::filesystem::path& path,
+                                   algorithm::ProgressMonitor* progress);
+
+// Only the options, without reading the images
+std::optional<Options> LoadProjectOptions(const std::filesystem::path& path);
+
+}  // namespace xpano::pipeline
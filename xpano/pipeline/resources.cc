@@ -0,0 +1,61 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/pipeline/resources.h"
+
+#include <algorithm>
+#include <cstddef>
+
+#include <opencv2/core.hpp>
+#include <spdlog/spdlog.h>
+
+#include "xpano/constants.h"
+#include "xpano/pipeline/options.h"
+#include "xpano/pipeline/stitcher_pipeline.h"
+#include "xpano/utils/fmt.h"
+#include "xpano/utils/parallel_for.h"
+#include "xpano/utils/process.h"
+
+namespace xpano::pipeline {
+
+void ApplyResources(const ResourceOptions &resources) {
+  int threads = resources.threads;
+  if (!resources.cpus.empty()) {
+    if (utils::process::SetCpuAffinity(resources.cpus)) {
+      spdlog::info("Pinned to CPUs {}", fmt::join(resources.cpus, ", "));
+      // One thread per pinned CPU unless set
+      if (threads == 0) {
+        threads =
+            std::max(kMinThreads, static_cast<int>(resources.cpus.size()));
+      }
+    } else {
+      spdlog::warn("Couldn't pin the process to CPUs {}",
+                   fmt::join(resources.cpus, ", "));
+    }
+  }
+
+  utils::mt::SetSharedPoolThreads(threads);
+  utils::mt::UsePoolForOpenCV(utils::mt::SharedPool());
+  // Also limits the OpenCV's own threads if it can't use the pool
+  cv::setNumThreads(utils::mt::SharedPoolThreads());
+}
+
+StitcherPipelineOptions FitToMemoryBudget(StitcherPipelineOptions options,
+                                          int memory_mb) {
+  if (memory_mb <= 0) {
+    return options;
+  }
+  const auto budget = static_cast<std::size_t>(memory_mb) * kMegabyte;
+  options.full_res_cache_bytes = std::min(
+      options.full_res_cache_bytes, budget / kFullResCacheBudgetDivisor);
+  options.preview_cache_bytes = std::min(options.preview_cache_bytes,
+                                         budget / kPreviewCacheBudgetDivisor);
+  options.decoded_preview_cache_bytes =
+      std::min(options.decoded_preview_cache_bytes,
+               budget / kDecodedPreviewBudgetDivisor);
+  options.spill_threshold_bytes =
+      std::min(options.spill_threshold_bytes, budget / kSpillBudgetDivisor);
+  return options;
+}
+
+}  // namespace xpano::pipeline
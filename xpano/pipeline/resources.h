@@ -0,0 +1,21 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include "xpano/pipeline/options.h"
+#include "xpano/pipeline/stitcher_pipeline.h"
+
+namespace xpano::pipeline {
+
+// Process wide, call once at startup before the first utils::mt::SharedPool
+// use: pins the process to the CPUs, sizes the shared pool and runs the
+// OpenCV loops on it with the same number of threads
+void ApplyResources(const ResourceOptions &resources);
+
+// Caches and the spill threshold of the pipeline limited to their shares of
+// the memory budget, no change for 0
+StitcherPipelineOptions FitToMemoryBudget(StitcherPipelineOptions options,
+                                          int memory_mb);
+
+}  // namespace xpano::pipeline
@@ -0,0 +1,261 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/pipeline/shards.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <spdlog/spdlog.h>
+
+#include "xpano/algorithm/progress.h"
+#include "xpano/algorithm/stitcher.h"
+#include "xpano/pipeline/checkpoint.h"
+#include "xpano/utils/fmt.h"
+
+namespace xpano::pipeline {
+
+namespace {
+
+// Fast, the tiles are read back once
+constexpr int kTilePngCompression = 1;
+
+std::filesystem::path TilePath(const std::filesystem::path& dir,
+                               cv::Point tile_tl) {
+  return dir / fmt::format("tile-{}-{}.png", tile_tl.x, tile_tl.y);
+}
+
+std::filesystem::path DonePath(const std::filesystem::path& dir, int index) {
+  return dir / fmt::format("shard-{}.done", index);
+}
+
+// Written next to the final file and renamed, the other processes never see
+// a partial file
+bool Publish(const std::filesystem::path& tmp_path,
+             const std::filesystem::path& path) {
+  std::error_code error;
+  std::filesystem::rename(tmp_path, path, error);
+  if (error) {
+    spdlog::error("Failed to write {}: {}", path.string(), error.message());
+    std::filesystem::remove(tmp_path, error);
+    return false;
+  }
+  return true;
+}
+
+// Changes whenever a shard publishes a tile or completes. Only compared with
+// the earlier ones of this process, the clocks of the nodes may differ.
+struct ShardActivity {
+  std::size_t num_files = 0;
+  std::filesystem::file_time_type newest;
+
+  bool operator==(const ShardActivity&) const = default;
+};
+
+ShardActivity Activity(const std::filesystem::path& dir) {
+  ShardActivity activity;
+  std::error_code error;
+  for (std::filesystem::directory_iterator entry(dir, error), end;
+       !error && entry != end; entry.increment(error)) {
+    activity.num_files++;
+    std::error_code time_error;
+    const auto time = entry->last_write_time(time_error);
+    if (!time_error) {
+      activity.newest = std::max(activity.newest, time);
+    }
+  }
+  return activity;
+}
+
+// Polls done() until it returns a value. Gives up once nothing in the
+// directory changed for the stall timeout and sets *stalled.
+template <typename TDone>
+auto Poll(const std::filesystem::path& dir, TDone done,
+          algorithm::ProgressMonitor* progress, const ShardWait& wait,
+          bool* stalled) -> decltype(done()) {
+  auto activity = Activity(dir);
+  auto deadline = std::chrono::steady_clock::now() + wait.stall_timeout;
+  while (!progress->IsCancelled()) {
+    if (auto result = done(); result) {
+      return result;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (auto current = Activity(dir); current != activity) {
+      activity = current;
+      deadline = now + wait.stall_timeout;
+    } else if (now >= deadline) {
+      *stalled = true;
+      return {};
+    }
+    std::this_thread::sleep_for(wait.poll_interval);
+  }
+  return {};
+}
+
+std::int64_t Seconds(std::chrono::milliseconds duration) {
+  return std::chrono::duration_cast<std::chrono::seconds>(duration).count();
+}
+
+}  // namespace
+
+std::filesystem::path ShardDir(const std::filesystem::path& export_path) {
+  auto dir = export_path;
+  dir += ".shards";
+  return dir;
+}
+
+ShardWriter::ShardWriter(std::filesystem::path dir, ShardOptions shard)
+    : dir_(std::move(dir)), shard_(shard) {}
+
+bool ShardWriter::Open(cv::Size pano_size) {
+  pano_size_ = pano_size;
+  std::error_code error;
+  std::filesystem::create_directories(dir_, error);
+  if (error) {
+    spdlog::error("Failed to create {}: {}", dir_.string(), error.message());
+    return false;
+  }
+  spdlog::info("Composing shard {} of {} into {}", shard_.index + 1,
+               shard_.count, dir_.string());
+  return true;
+}
+
+bool ShardWriter::WriteTile(cv::Point tile_tl, const cv::Mat& image,
+                            const cv::Mat& mask) {
+  cv::Mat tile;
+  cv::merge(std::vector<cv::Mat>{image, mask}, tile);
+  // Keeps the extension, cv::imwrite picks the format by it
+  const auto path = TilePath(dir_, tile_tl);
+  auto tmp_path = path;
+  tmp_path.replace_filename("tmp-" + path.filename().string());
+  if (!cv::imwrite(tmp_path.string(), tile,
+                   {cv::IMWRITE_PNG_COMPRESSION, kTilePngCompression})) {
+    spdlog::error("Failed to write {}", tmp_path.string());
+    return false;
+  }
+  return Publish(tmp_path, path);
+}
+
+bool ShardWriter::Close() {
+  const auto path = DonePath(dir_, shard_.index);
+  auto tmp_path = path;
+  tmp_path += ".tmp";
+  {
+    std::ofstream stream(tmp_path);
+    stream << pano_size_.width << " " << pano_size_.height << "\n";
+    if (!stream) {
+      spdlog::error("Failed to write {}", tmp_path.string());
+      return false;
+    }
+  }
+  return Publish(tmp_path, path);
+}
+
+std::optional<cv::Size> ShardsDone(const std::filesystem::path& dir,
+                                   int num_shards) {
+  std::optional<cv::Size> pano_size;
+  for (int index = 0; index < num_shards; index++) {
+    std::ifstream stream(DonePath(dir, index));
+    cv::Size size;
+    if (!(stream >> size.width >> size.height)) {
+      return {};
+    }
+    if (pano_size && *pano_size != size) {
+      spdlog::error("Shard {} composed a different pano, {}x{} != {}x{}",
+                    index + 1, size.width, size.height, pano_size->width,
+                    pano_size->height);
+      return {};
+    }
+    pano_size = size;
+  }
+  return pano_size;
+}
+
+std::optional<cv::Size> WaitForShards(const std::filesystem::path& dir,
+                                      int num_shards,
+                                      algorithm::ProgressMonitor* progress,
+                                      const ShardWait& wait) {
+  spdlog::info("Waiting for {} shards in {}", num_shards, dir.string());
+  bool stalled = false;
+  auto pano_size = Poll(
+      dir, [&]() { return ShardsDone(dir, num_shards); }, progress, wait,
+      &stalled);
+  if (stalled) {
+    for (int index = 0; index < num_shards; index++) {
+      if (!std::filesystem::exists(DonePath(dir, index))) {
+        spdlog::error("Shard {} of {} is not complete", index + 1,
+                      num_shards);
+      }
+    }
+    spdlog::error("No shard made progress for {} s, giving up on {}",
+                  Seconds(wait.stall_timeout), dir.string());
+  }
+  return pano_size;
+}
+
+bool WaitForFirstShard(const Checkpoint& checkpoint,
+                       algorithm::ProgressMonitor* progress,
+                       const ShardWait& wait) {
+  if (checkpoint.LoadSession()) {
+    return true;
+  }
+  spdlog::info("Waiting for the seams of the first shard");
+  bool stalled = false;
+  auto session = Poll(
+      checkpoint.Dir(), [&]() { return checkpoint.LoadSession(); }, progress,
+      wait, &stalled);
+  if (stalled) {
+    spdlog::error("The first shard made no progress for {} s, giving up on {}",
+                  Seconds(wait.stall_timeout), checkpoint.Dir().string());
+  }
+  return session != nullptr;
+}
+
+bool AssembleShards(const std::filesystem::path& dir, cv::Size pano_size,
+                    const algorithm::stitcher::TiledOutput& output) {
+  if (!output.open(pano_size)) {
+    return false;
+  }
+  const int tile_size = output.tile_size;
+  for (int y = 0; y < pano_size.height; y += tile_size) {
+    for (int x = 0; x < pano_size.width; x += tile_size) {
+      const cv::Point tile_tl(x, y);
+      const auto path = TilePath(dir, tile_tl);
+      const cv::Mat tile = cv::imread(path.string(), cv::IMREAD_UNCHANGED);
+      if (tile.empty() || tile.channels() != 4) {
+        spdlog::error("Failed to read {}", path.string());
+        return false;
+      }
+      std::vector<cv::Mat> channels;
+      cv::split(tile, channels);
+      cv::Mat image;
+      cv::merge(std::vector<cv::Mat>{channels[0], channels[1], channels[2]},
+                image);
+      if (!output.write(tile_tl, image, channels[3])) {
+        return false;
+      }
+    }
+  }
+
+  std::error_code error;
+  std::filesystem::remove_all(dir, error);
+  if (error) {
+    spdlog::warn("Failed to remove {}: {}", dir.string(), error.message());
+  }
+  return true;
+}
+
+}  // namespace xpano::pipeline
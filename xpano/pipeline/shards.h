@@ -0,0 +1,76 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <chrono>
+#include <filesystem>
+#include <optional>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/algorithm/progress.h"
+#include "xpano/algorithm/stitcher.h"
+#include "xpano/constants.h"
+#include "xpano/pipeline/checkpoint.h"
+#include "xpano/pipeline/options.h"
+
+namespace xpano::pipeline {
+
+// A tiled export composed by several processes, e.g. on nodes sharing a
+// network file system:
+//  - The first shard estimates the cameras and the seams, they are shared
+//    through the checkpoint directory, see Checkpoint. The other shards wait
+//    for them.
+//  - Each shard composes a band of the tile rows into the shard directory
+//    next to the export, one BGRA PNG per tile, the alpha channel is the
+//    mask. A "shard-<index>.done" file with the pano size marks a complete
+//    shard.
+//  - The first shard waits for all the others and assembles the tiles into
+//    the export, see AssembleShards.
+std::filesystem::path ShardDir(const std::filesystem::path& export_path);
+
+class ShardWriter {
+ public:
+  ShardWriter(std::filesystem::path dir, ShardOptions shard);
+
+  bool Open(cv::Size pano_size);
+  bool WriteTile(cv::Point tile_tl, const cv::Mat& image, const cv::Mat& mask);
+  // Marks the shard as complete
+  bool Close();
+
+ private:
+  std::filesystem::path dir_;
+  ShardOptions shard_;
+  cv::Size pano_size_;
+};
+
+// The pano size once all the shards are complete
+std::optional<cv::Size> ShardsDone(const std::filesystem::path& dir,
+                                   int num_shards);
+
+struct ShardWait {
+  std::chrono::milliseconds poll_interval = kShardPollInterval;
+  // Without a new tile or a complete shard
+  std::chrono::milliseconds stall_timeout = kShardStallTimeout;
+};
+
+// Polls ShardsDone until all the shards are complete. Empty if cancelled or
+// if the shards stalled, the incomplete ones are logged.
+std::optional<cv::Size> WaitForShards(const std::filesystem::path& dir,
+                                      int num_shards,
+                                      algorithm::ProgressMonitor* progress,
+                                      const ShardWait& wait = {});
+
+// Polls until the first shard saved the seams into the checkpoint, false if
+// cancelled or if the checkpoint stalled
+bool WaitForFirstShard(const Checkpoint& checkpoint,
+                       algorithm::ProgressMonitor* progress,
+                       const ShardWait& wait = {});
+
+// Streams the tiles of the complete shards to the output in row order and
+// removes the shard directory
+bool AssembleShards(const std::filesystem::path& dir, cv::Size pano_size,
+                    const algorithm::stitcher::TiledOutput& output);
+
+}  // namespace xpano::pipeline
@@ -5,29 +5,61 @@
 #include "xpano/pipeline/stitcher_pipeline.h"
 
 #include <algorithm>
+#include <cstddef>
 #include <cstdint>
+#include <exception>
 #include <filesystem>
+#include <fstream>
+#include <functional>
 #include <future>
+#include <initializer_list>
+#include <iterator>
+#include <list>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <semaphore>
+#include <set>
+#include <span>
 #include <type_traits>
 #include <utility>
 #include <vector>
 
 #include <opencv2/core.hpp>
 #include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
 #include <spdlog/spdlog.h>
 
 #include "xpano/algorithm/algorithm.h"
+#include "xpano/algorithm/capture.h"
+#include "xpano/algorithm/feature_cache.h"
+#include "xpano/algorithm/grid.h"
 #include "xpano/algorithm/image.h"
+#include "xpano/algorithm/preview_store.h"
 #include "xpano/algorithm/progress.h"
+#include "xpano/algorithm/retrieval.h"
 #include "xpano/algorithm/stitcher.h"
+#include "xpano/algorithm/video.h"
 #include "xpano/constants.h"
+#include "xpano/pipeline/checkpoint.h"
+#include "xpano/pipeline/full_res_cache.h"
 #include "xpano/pipeline/options.h"
+#include "xpano/pipeline/project.h"
+#include "xpano/pipeline/shards.h"
+#include "xpano/utils/deep_zoom.h"
+#include "xpano/utils/encoders.h"
 #include "xpano/utils/exiv2.h"
 #include "xpano/utils/future.h"
+#include "xpano/utils/jpeg.h"
+#include "xpano/utils/memory.h"
 #include "xpano/utils/opencv.h"
+#include "xpano/utils/parallel_for.h"
+#include "xpano/utils/path.h"
+#include "xpano/utils/task_graph.h"
 #include "xpano/utils/threadpool.h"
+#include "xpano/utils/tiff.h"
+#include "xpano/utils/trace.h"
 #include "xpano/utils/vec_opencv.h"
 
 namespace xpano::pipeline {
@@ -49,50 +81,120 @@ cv::ImwriteJPEGSamplingFactorParams ToOpenCVEnum(
 }
 #endif
 
-std::vector<int> CompressionParameters(const CompressionOptions &options) {
-  return {cv::IMWRITE_JPEG_QUALITY,
-          options.jpeg_quality,
-          cv::IMWRITE_JPEG_PROGRESSIVE,
-          static_cast<int>(options.jpeg_progressive),
-          cv::IMWRITE_JPEG_OPTIMIZE,
-          static_cast<int>(options.jpeg_optimize),
-#if XPANO_OPENCV_HAS_JPEG_SUBSAMPLING_SUPPORT
-          cv::IMWRITE_JPEG_SAMPLING_FACTOR,
-          ToOpenCVEnum(options.jpeg_subsampling),
-#endif
-          cv::IMWRITE_PNG_COMPRESSION,
-          options.png_compression};
-}
-
 template <typename TFutureType, RunTraits run>
 auto MakeTask() -> std::conditional_t<run == RunTraits::kReturnFuture,
                                       Task<TFutureType>, Task<GenericFuture>> {
   return {.progress = std::make_unique<ProgressMonitor>()};
 }
 
-enum class WaitStatus : std::uint8_t {
-  kReady,
-  kCancelled,
-};
+bool WriteBytes(const std::filesystem::path &path,
+                std::initializer_list<std::span<const unsigned char>> parts) {
+  std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+  for (const auto &part : parts) {
+    stream.write(reinterpret_cast<const char *>(part.data()),
+                 static_cast<std::streamsize>(part.size()));
+  }
+  return static_cast<bool>(stream);
+}
 
-template <typename TFutureType>
-WaitStatus WaitWithCancellation(TFutureType *future,
-                                ProgressMonitor *progress) {
-  std::future_status status;
-  while ((status = future->wait_for(kTaskCancellationTimeout)) !=
-         std::future_status::ready) {
-    if (progress->IsCancelled()) {
-      return WaitStatus::kCancelled;
+// Large JPEGs are encoded in stripes on the pool, the rest by OpenCV
+std::optional<std::vector<unsigned char>> EncodeJpeg(
+    const cv::Mat &pano, const std::vector<int> &params,
+    utils::mt::Threadpool *pool) {
+  if (auto encoded = utils::jpeg::EncodeStriped(pano, params, pool)) {
+    return encoded;
+  }
+  std::vector<unsigned char> encoded;
+  if (!cv::imencode(".jpg", pano, encoded, params)) {
+    return {};
+  }
+  return encoded;
+}
+
+// Encoded in memory, the Exif segment is spliced in before writing the file
+// once. Returns whether the Exif was written.
+bool WriteJpeg(const std::filesystem::path &path, const cv::Mat &pano,
+               const std::vector<int> &params,
+               const std::optional<std::vector<unsigned char>> &exif_segment,
+               utils::mt::Threadpool *pool, bool *exif_written) {
+  auto encoded = EncodeJpeg(pano, params, pool);
+  if (!encoded) {
+    return false;
+  }
+  auto position = exif_segment ? utils::jpeg::MetadataPosition(*encoded)
+                               : std::nullopt;
+  if (!position) {
+    return WriteBytes(path, {*encoded});
+  }
+  const std::span<const unsigned char> data = *encoded;
+  *exif_written = true;
+  return WriteBytes(path, {data.first(*position), *exif_segment,
+                           data.subspan(*position)});
+}
+
+bool IsTiledTiff(const std::filesystem::path &path,
+                 const CompressionOptions &options) {
+  return options.tiff_tiled && utils::path::IsTiff(path);
+}
+
+// Exiv2 doesn't write BigTIFF, a pyramid has no single image file
+bool SupportsExif(const std::filesystem::path &path,
+                  const CompressionOptions &options) {
+  return !IsTiledTiff(path, options) && !utils::path::IsDeepZoom(path);
+}
+
+// The pano is already in memory, the same writers as for the tiled composer
+template <typename TWriter>
+bool WriteTiles(const cv::Mat &pano, TWriter *writer) {
+  const cv::Rect pano_rect(cv::Point(0, 0), pano.size());
+  for (int y = 0; y < pano.rows; y += kTiledExportTileSize) {
+    for (int x = 0; x < pano.cols; x += kTiledExportTileSize) {
+      const auto tile_rect =
+          cv::Rect(x, y, kTiledExportTileSize, kTiledExportTileSize) &
+          pano_rect;
+      const cv::Mat opaque(tile_rect.size(), CV_8U, cv::Scalar(255));
+      if (!writer->WriteTile(tile_rect.tl(), pano(tile_rect), opaque)) {
+        return false;
+      }
     }
   }
-  if (progress->IsCancelled()) {
-    return WaitStatus::kCancelled;
+  return writer->Close();
+}
+
+bool WritePano(const std::filesystem::path &path, const cv::Mat &pano,
+               const CompressionOptions &options,
+               utils::mt::Threadpool *pool) {
+  if (IsTiledTiff(path, options)) {
+    utils::tiff::TiledWriter writer(path, pano.size(), kTiledExportTileSize,
+                                    options.tiff_overviews);
+    return WriteTiles(pano, &writer);
   }
-  return WaitStatus::kReady;
+  if (const auto format = utils::encoders::FormatOf(path)) {
+    const auto encoded = utils::encoders::Encode(
+        pano, *format,
+        {.quality = options.encoder_quality, .effort = options.encoder_effort},
+        pool);
+    return encoded && WriteBytes(path, {*encoded});
+  }
+  const auto params = CompressionParameters(options);
+  if (utils::path::IsDeepZoom(path)) {
+    utils::deep_zoom::PyramidWriter writer(path, pano.size(),
+                                           kTiledExportTileSize,
+                                           kDeepZoomTileSize, params, pool);
+    return WriteTiles(pano, &writer);
+  }
+  return cv::imwrite(path.string(), pano, params);
+}
+
+// Guaranteed copy elision, the span isn't movable
+utils::trace::Span StageSpan(ProgressType type) {
+  return utils::trace::Span(algorithm::Label(type));
 }
 
 ExportResult RunExportPipeline(cv::Mat pano, const ExportOptions &options,
-                               ProgressMonitor *progress) {
+                               ProgressMonitor *progress,
+                               utils::mt::Threadpool *pool) {
+  const auto span = StageSpan(ProgressType::kExport);
   const int num_tasks = 2;
   progress->Reset(ProgressType::kExport, num_tasks);
 
@@ -101,134 +203,1146 @@ ExportResult RunExportPipeline(cv::Mat pano, const ExportOptions &options,
     pano = pano(crop_rect);
   }
 
+  const auto pano_size = utils::ToIntVec(pano.size);
+  bool write_exif = utils::exiv2::Enabled() &&
+                    SupportsExif(options.export_path, options.compression);
+  bool written = false;
+  if (utils::path::IsJpeg(options.export_path)) {
+    std::optional<std::vector<unsigned char>> exif_segment;
+    if (write_exif) {
+      exif_segment =
+          utils::exiv2::CreateExifSegment(options.metadata_path, pano_size);
+    }
+    bool exif_written = false;
+    written = WriteJpeg(options.export_path, pano,
+                        CompressionParameters(options.compression),
+                        exif_segment, pool, &exif_written);
+    write_exif &= !exif_written;
+  } else {
+    written = WritePano(options.export_path, pano, options.compression, pool);
+  }
+
   std::optional<std::filesystem::path> export_path;
-  if (cv::imwrite(options.export_path.string(), pano,
-                  CompressionParameters(options.compression))) {
+  if (written) {
     export_path = options.export_path;
   }
   progress->NotifyTaskDone();
-  if (export_path && utils::exiv2::Enabled()) {
-    auto pano_size = utils::ToIntVec(pano.size);
+  // Rewrites the exported file
+  if (export_path && write_exif) {
     utils::exiv2::CreateExif(options.metadata_path, *export_path, pano_size);
   }
   progress->NotifyTaskDone();
-  return ExportResult{options.pano_id, export_path};
+  return ExportResult{.pano_id = options.pano_id,
+                      .ids = options.ids,
+                      .export_path = export_path};
 }
 
-std::vector<algorithm::Image> RunLoadingPipeline(
-    const std::vector<std::filesystem::path> &inputs,
-    const LoadingOptions &options, bool compute_keypoints,
-    ProgressMonitor *progress, utils::mt::Threadpool *pool) {
+using DataGraph = utils::mt::TaskGraph<StitcherData>;
+using Pairs = std::vector<std::pair<int, int>>;
+
+// Images are shared by the tasks of the following stages
+using SharedImages = std::shared_ptr<const std::vector<algorithm::Image>>;
+
+std::shared_ptr<DataGraph> MakeDataGraph(StitcherData cancelled_result,
+                                         ProgressMonitor *progress,
+                                         std::function<void()> on_done) {
+  return std::make_shared<DataGraph>(
+      std::move(cancelled_result),
+      [progress]() { return progress->IsCancelled(); }, std::move(on_done));
+}
+
+std::vector<algorithm::Image> ToImages(
+    const std::vector<std::filesystem::path> &paths) {
+  std::vector<algorithm::Image> images;
+  images.reserve(paths.size());
+  for (const auto &path : paths) {
+    images.emplace_back(path);
+  }
+  return images;
+}
+
+// Two stages: io_pool reads the compressed files, pool decodes them and
+// detects keypoints. The semaphore limits the number of files which were
+// read but not yet processed, so that the io stage can't run far ahead.
+// The slot of each image is handed over from the io task to the decoding.
+// A video is streamed by its io task, which loads only its keyframes, see
+// algorithm::video::LoadKeyframes. In-memory inputs skip the io stage and
+// the feature cache.
+void LoadImages(const std::vector<algorithm::Image> &inputs,
+                const LoadingOptions &options, bool compute_keypoints,
+                ProgressMonitor *progress, utils::mt::Threadpool *pool,
+                utils::mt::Threadpool *io_pool,
+                const algorithm::FeatureCache *cache,
+                const std::shared_ptr<ThumbnailQueue> &thumbnail_queue,
+                DataGraph *graph,
+                std::function<void(std::vector<algorithm::Image>)> done) {
   const int num_tasks = static_cast<int>(inputs.size());
   progress->Reset(ProgressType::kDetectingKeypoints, num_tasks);
-  utils::mt::MultiFuture<algorithm::Image> loading_future;
-  for (const auto &input : inputs) {
-    loading_future.push_back(
-        pool->submit([options, input, compute_keypoints, progress]() {
-          algorithm::Image image(input);
-          image.Load({.preview_longer_side = options.preview_longer_side,
-                      .compute_keypoints = compute_keypoints});
+  const algorithm::ImageLoadOptions load_options = {
+      .preview_longer_side = options.preview_longer_side,
+      .detection_longer_side = options.detection_longer_side,
+      .compute_keypoints = compute_keypoints,
+      .feature = options.feature,
+      .num_features = options.num_features,
+      .use_embedded_preview = options.use_embedded_previews,
+      .compact_features = options.compact_features,
+      .detector_backend = options.detector_backend,
+      .compress_preview = options.compress_previews,
+      .lens = options.lens};
+
+  auto in_flight = std::make_shared<std::counting_semaphore<>>(
+      static_cast<std::ptrdiff_t>(kLoadingImagesInFlightPerThread *
+                                  pool->get_thread_count()));
+
+  // Each image is matched against up to neighborhood_search_size others,
+  // build its search index once here instead of in every match task
+  const bool build_index = compute_keypoints &&
+                           !algorithm::HasBinaryDescriptors(options.feature);
+
+  auto publish = [thumbnail_queue](int input_id,
+                                   const algorithm::Image &image) {
+    if (image.IsLoaded()) {
+      thumbnail_queue->Push(
+          {input_id, image.GetThumbnail(), image.GetAspect()});
+    }
+  };
+
+  const algorithm::video::KeyframeOptions keyframe_options = {
+      .min_overlap = options.keyframe_overlap};
+
+  // One slot per input, the keyframes of a video share the slot
+  auto slots = graph->Stage<std::vector<algorithm::Image>>(
+      num_tasks, [done = std::move(done)](
+                     std::vector<std::vector<algorithm::Image>> loaded) {
+        std::vector<algorithm::Image> images;
+        for (auto &input_images : loaded) {
+          std::move(input_images.begin(), input_images.end(),
+                    std::back_inserter(images));
+        }
+        auto num_erased = std::erase_if(
+            images, [](const auto &img) { return !img.IsLoaded(); });
+        if (num_erased > 0) {
+          spdlog::warn("Failed to load {} images", num_erased);
+        }
+        done(std::move(images));
+      });
+  for (int input_id = 0; input_id < inputs.size(); input_id++) {
+    io_pool->push_task([load_options, keyframe_options,
+                        input = inputs[input_id], input_id, progress, cache,
+                        pool, in_flight, publish, build_index,
+                        slot = std::move(slots[input_id])]() mutable {
+      // The cancelled loading only drops its own tasks, see Cancel()
+      if (slot->IsCancelled()) {
+        slot.reset();
+        return;
+      }
+      const auto span = StageSpan(ProgressType::kLoadingImages);
+      const auto path = input.GetPath();
+      try {
+        if (!input.IsInMemory() && utils::path::IsVideo(path)) {
+          auto keyframes = algorithm::video::LoadKeyframes(
+              path, load_options, keyframe_options,
+              [&slot]() { return slot->IsCancelled(); });
+          if (!keyframes.empty()) {
+            publish(input_id, keyframes[0]);
+          }
+          if (build_index) {
+            for (auto &keyframe : keyframes) {
+              keyframe.BuildDescriptorIndex();
+            }
+          }
           progress->NotifyTaskDone();
-          return image;
-        }));
+          slot->Set(std::move(keyframes));
+          slot.reset();
+          return;
+        }
+        if (cache != nullptr && !input.IsInMemory()) {
+          if (auto cached = cache->Load(path, load_options); cached) {
+            publish(input_id, *cached);
+            if (build_index) {
+              cached->BuildDescriptorIndex();
+            }
+            progress->NotifyTaskDone();
+            slot->Set({*std::move(cached)});
+            return;
+          }
+        }
+
+        // The decoding tasks notify the monitor when they release a permit
+        if (!progress->WaitUntil(
+                [&in_flight]() { return in_flight->try_acquire(); })) {
+          slot->Drop();
+          return;
+        }
+        // TIFFs can be larger than the memory, the decoding task reads only
+        // the page it needs, see Image::Load
+        auto encoded = input.IsInMemory() || utils::path::IsTiff(path)
+                           ? nullptr
+                           : std::make_shared<std::vector<unsigned char>>(
+                                 algorithm::ReadFileBytes(path));
+
+        pool->push_task([load_options, input, input_id, progress, cache,
+                         in_flight, encoded, publish, build_index,
+                         slot = std::move(slot)]() mutable {
+          try {
+            if (slot->IsCancelled()) {
+              in_flight->release();
+              slot.reset();
+              return;
+            }
+            const auto span = StageSpan(ProgressType::kDetectingKeypoints);
+            algorithm::Image image = input;
+            if (encoded) {
+              image.Load(*encoded, load_options);
+            } else {
+              image.Load(load_options);
+            }
+            in_flight->release();
+            progress->Notify();
+            publish(input_id, image);
+            if (cache != nullptr && !image.IsInMemory()) {
+              cache->Store(image, load_options);
+            }
+            if (build_index) {
+              image.BuildDescriptorIndex();
+            }
+            progress->NotifyTaskDone();
+            slot->Set({std::move(image)});
+          } catch (...) {
+            slot->Fail(std::current_exception());
+          }
+          slot.reset();
+        });
+      } catch (...) {
+        if (slot) {
+          slot->Fail(std::current_exception());
+        }
+      }
+      slot.reset();
+    });
   }
-  if (auto status = WaitWithCancellation(&loading_future, progress);
-      status == WaitStatus::kCancelled) {
-    return {};
+}
+
+// Pairs (i, j), i < j, of images at most num_neighbors apart, with j being
+// at least first_new_id
+Pairs NeighborPairs(int num_images, int num_neighbors, int first_new_id) {
+  Pairs pairs;
+  for (int j = first_new_id; j < num_images; j++) {
+    for (int i = std::max(0, j - num_neighbors); i < j; i++) {
+      pairs.emplace_back(i, j);
+    }
   }
-  auto images = loading_future.get();
+  return pairs;
+}
 
-  auto num_erased =
-      std::erase_if(images, [](const auto &img) { return !img.IsLoaded(); });
-  if (num_erased > 0) {
-    spdlog::warn("Failed to load {} images", num_erased);
+// Proposes the visually most similar images of each image, needed when the
+// images are not sorted in capture order
+void RetrievalPairs(const SharedImages &images, int num_candidates,
+                    ProgressMonitor *progress, utils::mt::Threadpool *pool,
+                    DataGraph *graph, std::function<void(Pairs)> done) {
+  const int num_images = static_cast<int>(images->size());
+  progress->Reset(ProgressType::kRetrievingCandidates, num_images + 2);
+  cv::Mat vocabulary;
+  {
+    const auto span = StageSpan(ProgressType::kRetrievingCandidates);
+    vocabulary = algorithm::retrieval::TrainVocabulary(
+        *images, kRetrievalVocabularySize);
   }
-  return images;
+  progress->NotifyTaskDone();
+  if (vocabulary.empty()) {
+    done({});
+    return;
+  }
+
+  graph->ForEach<cv::Mat>(
+      pool, num_images,
+      [images, vocabulary, progress](int i) {
+        const auto span = StageSpan(ProgressType::kRetrievingCandidates);
+        auto descriptor =
+            algorithm::retrieval::Describe((*images)[i], vocabulary);
+        progress->NotifyTaskDone();
+        return descriptor;
+      },
+      [num_candidates, progress,
+       done = std::move(done)](const std::vector<cv::Mat> &descriptors) {
+        auto pairs =
+            algorithm::retrieval::FindCandidates(descriptors, num_candidates);
+        progress->NotifyTaskDone();
+        done(std::move(pairs));
+      });
 }
 
-StitcherData RunMatchingPipeline(std::vector<algorithm::Image> images,
-                                 const MatchingOptions &options,
-                                 ProgressMonitor *progress,
-                                 utils::mt::Threadpool *pool) {
+// Bursts and brackets, these pairs would be filtered out by min_shift
+// after matching anyway
+bool NearDuplicates(const algorithm::Image &img1, const algorithm::Image &img2,
+                    int max_hash_distance) {
+  auto hash1 = img1.GetPerceptualHash();
+  auto hash2 = img2.GetPerceptualHash();
+  return hash1 && hash2 &&
+         algorithm::HashDistance(*hash1, *hash2) <= max_hash_distance;
+}
+
+void SkipDuplicates(const std::vector<algorithm::Image> &images,
+                    const MatchingOptions &options, Pairs *pairs) {
+  const auto num_pairs = pairs->size();
+  std::erase_if(*pairs, [&images, &options](const auto &pair) {
+    return NearDuplicates(images[pair.first], images[pair.second],
+                          options.duplicate_hash_distance);
+  });
+  spdlog::info("Skipped {} pairs of near-duplicate images",
+               num_pairs - pairs->size());
+}
+
+// Skips the pairs from different capture groups, reads the capture infos on
+// the pool
+void SplitByCapture(const SharedImages &images, const MatchingOptions &options,
+                    Pairs pairs, utils::mt::Threadpool *pool, DataGraph *graph,
+                    std::function<void(Pairs)> done) {
+  graph->ForEach<utils::exiv2::CaptureInfo>(
+      pool, static_cast<int>(images->size()),
+      [images](int i) {
+        return utils::exiv2::ReadCaptureInfo((*images)[i].GetPath());
+      },
+      [options, pairs = std::move(pairs), done = std::move(done)](
+          const std::vector<utils::exiv2::CaptureInfo> &infos) mutable {
+        const algorithm::CaptureFilter filter(infos, options.max_time_gap,
+                                              options.max_gps_distance);
+        const auto num_pairs = pairs.size();
+        std::erase_if(pairs, [&filter](const auto &pair) {
+          return !filter.Compatible(pair.first, pair.second);
+        });
+        spdlog::info("{} capture time groups, skipped {} of {} pairs",
+                     filter.NumTimeGroups(), num_pairs - pairs.size(),
+                     num_pairs);
+        done(std::move(pairs));
+      });
+}
+
+// Pairs of images to match, the pairs between images with ids lower than
+// first_new_id are skipped (they were matched before)
+void MatchingPairs(const SharedImages &images, const MatchingOptions &options,
+                   int first_new_id, ProgressMonitor *progress,
+                   utils::mt::Threadpool *pool, DataGraph *graph,
+                   std::function<void(Pairs)> done) {
+  const int num_images = static_cast<int>(images->size());
+  const int num_neighbors =
+      std::min(options.neighborhood_search_size, num_images - 1);
+  auto pairs =
+      options.type == MatchingType::kGrid
+          ? algorithm::GridPairs(options.grid, num_images, first_new_id)
+          : NeighborPairs(num_images, num_neighbors, first_new_id);
+
+  // Retrieval -> capture groups -> duplicates, the first two on the pool
+  auto filter = [images, options, pool, graph,
+                 done = std::move(done)](Pairs pairs) {
+    auto skip_duplicates = [images, options, done](Pairs pairs) {
+      if (options.skip_duplicates) {
+        SkipDuplicates(*images, options, &pairs);
+      }
+      done(std::move(pairs));
+    };
+    if (options.split_by_capture) {
+      SplitByCapture(images, options, std::move(pairs), pool, graph,
+                     skip_duplicates);
+    } else {
+      skip_duplicates(std::move(pairs));
+    }
+  };
+
+  if (!options.use_retrieval) {
+    filter(std::move(pairs));
+    return;
+  }
+  RetrievalPairs(
+      images, options.retrieval_candidates, progress, pool, graph,
+      [pairs = std::move(pairs), first_new_id,
+       filter = std::move(filter)](const Pairs &retrieved) mutable {
+        const std::set<std::pair<int, int>> neighbors(pairs.begin(),
+                                                      pairs.end());
+        std::copy_if(retrieved.begin(), retrieved.end(),
+                     std::back_inserter(pairs),
+                     [&neighbors, first_new_id](const auto &pair) {
+                       return pair.second >= first_new_id &&
+                              !neighbors.contains(pair);
+                     });
+        spdlog::info("Matching {} pairs, {} proposed by retrieval",
+                     pairs.size(), pairs.size() - neighbors.size());
+        filter(std::move(pairs));
+      });
+}
+
+// See MatchingOptions::release_inliers, after FindPanos
+void ReleaseInliers(const MatchingOptions &options,
+                    const algorithm::MatchOptions &match_options,
+                    const std::vector<algorithm::Image> &images,
+                    std::vector<algorithm::Match> *matches) {
+  if (!options.release_inliers) {
+    return;
+  }
+  for (auto &match : *matches) {
+    algorithm::ReleaseInliers(&match, images[match.id1], images[match.id2],
+                              match_options);
+  }
+}
+
+// Publishes the panos of MatchPairs as soon as they are complete, see
+// StitcherPipelineOptions::stream_panos
+class PanoStreaming {
+ public:
+  PanoStreaming(int num_images, const Pairs &pairs,
+                const MatchingOptions &options,
+                const algorithm::MatchOptions &match_options,
+                std::shared_ptr<EarlyPanoQueue> queue)
+      : stream_(num_images, pairs, options.match_threshold, options.min_shift),
+        matches_(pairs.size()),
+        options_(options),
+        match_options_(match_options),
+        queue_(std::move(queue)) {}
+
+  void Add(const std::vector<algorithm::Image> &images, int pair_id,
+           const algorithm::Match &match) {
+    std::vector<StitcherData> early;
+    {
+      const std::lock_guard lock(mutex_);
+      matches_[pair_id] = match;
+      for (auto &pano : stream_.Add(pair_id, match)) {
+        auto &data = early.emplace_back();
+        // No later pano needs them
+        for (const int id : stream_.PairsOf(pano)) {
+          data.matches.push_back(std::move(matches_[id]));
+        }
+        data.panos = {std::move(pano)};
+      }
+    }
+    for (auto &data : early) {
+      ReleaseInliers(options_, match_options_, images, &data.matches);
+      data.images = images;
+      queue_->Push(std::move(data));
+    }
+  }
+
+ private:
+  std::mutex mutex_;
+  algorithm::PanoStream stream_;
+  std::vector<algorithm::Match> matches_;
+  MatchingOptions options_;
+  algorithm::MatchOptions match_options_;
+  std::shared_ptr<EarlyPanoQueue> queue_;
+};
+
+// Resets the progress, the last task (FindPanos) is left to done
+void MatchPairs(const SharedImages &images, Pairs pairs,
+                const algorithm::MatchOptions &match_options,
+                ProgressMonitor *progress, utils::mt::Threadpool *pool,
+                DataGraph *graph, std::shared_ptr<PanoStreaming> streaming,
+                std::function<void(std::vector<algorithm::Match>)> done) {
+  const int num_tasks = 1 +  // FindPanos
+                        static_cast<int>(pairs.size());
+
+  progress->Reset(ProgressType::kMatchingImages, num_tasks);
+  auto shared_pairs = std::make_shared<const Pairs>(std::move(pairs));
+  graph->ForEach<algorithm::Match>(
+      pool, num_tasks - 1,
+      [images, pairs = shared_pairs, match_options, progress,
+       streaming = std::move(streaming)](int pair_id) {
+        const auto span = StageSpan(ProgressType::kMatchingImages);
+        const auto [i, j] = (*pairs)[pair_id];
+        auto match = algorithm::MatchImages(i, j, (*images)[i], (*images)[j],
+                                            match_options);
+        if (streaming) {
+          streaming->Add(*images, pair_id, match);
+        }
+        progress->NotifyTaskDone();
+        return match;
+      },
+      std::move(done));
+}
+
+// Candidate pairs of the adaptive neighborhood by rounds: the immediate
+// neighbors and the pairs outside the neighborhood (retrieval) first, then by
+// the distance in the input order
+std::vector<Pairs> AdaptiveRounds(const Pairs &pairs, int num_neighbors) {
+  std::vector<Pairs> rounds(std::max(num_neighbors, 1));
+  for (const auto &pair : pairs) {
+    const int distance = pair.second - pair.first;
+    rounds[distance <= num_neighbors ? distance - 1 : 0].push_back(pair);
+  }
+  return rounds;
+}
+
+struct AdaptiveMatching {
+  std::vector<Pairs> rounds;
+  algorithm::MatchConnectivity connectivity;
+  std::vector<algorithm::Match> matches;
+};
+
+// One round of the adaptive neighborhood, the pairs of the round still
+// needed after the previous rounds are matched. The task count grows with
+// every round.
+void MatchAdaptiveRound(
+    const SharedImages &images, std::shared_ptr<AdaptiveMatching> state,
+    int round, const algorithm::MatchOptions &match_options,
+    ProgressMonitor *progress, utils::mt::Threadpool *pool, DataGraph *graph,
+    std::function<void(std::vector<algorithm::Match>)> done) {
+  Pairs pairs;
+  std::copy_if(state->rounds[round].begin(), state->rounds[round].end(),
+               std::back_inserter(pairs), [&state, round](const auto &pair) {
+                 return round == 0 ||
+                        state->connectivity.Needs(pair.first, pair.second);
+               });
+  progress->SetNumTasks(1 +  // FindPanos
+                        static_cast<int>(state->matches.size() + pairs.size()));
+
+  auto shared_pairs = std::make_shared<const Pairs>(std::move(pairs));
+  graph->ForEach<algorithm::Match>(
+      pool, static_cast<int>(shared_pairs->size()),
+      [images, pairs = shared_pairs, match_options, progress](int pair_id) {
+        const auto span = StageSpan(ProgressType::kMatchingImages);
+        const auto [i, j] = (*pairs)[pair_id];
+        auto match = algorithm::MatchImages(i, j, (*images)[i], (*images)[j],
+                                            match_options);
+        progress->NotifyTaskDone();
+        return match;
+      },
+      [images, state, round, match_options, progress, pool, graph,
+       done = std::move(done)](std::vector<algorithm::Match> matches) {
+        for (auto &match : matches) {
+          state->connectivity.Add(match);
+          state->matches.push_back(std::move(match));
+        }
+        if (round + 1 == static_cast<int>(state->rounds.size())) {
+          spdlog::info("Adaptive neighborhood: matched {} pairs",
+                       state->matches.size());
+          done(std::move(state->matches));
+          return;
+        }
+        MatchAdaptiveRound(images, state, round + 1, match_options, progress,
+                           pool, graph, done);
+      });
+}
+
+// MatchPairs, or the adaptive neighborhood with known_matches of the images
+// loaded before, see MatchingOptions::adaptive_neighborhood. Only MatchPairs
+// publishes the early panos, the rounds change the pairs as they go.
+void MatchCandidatePairs(
+    const SharedImages &images, Pairs pairs,
+    const std::vector<algorithm::Match> &known_matches,
+    const MatchingOptions &options,
+    const algorithm::MatchOptions &match_options, ProgressMonitor *progress,
+    utils::mt::Threadpool *pool, DataGraph *graph,
+    const std::shared_ptr<EarlyPanoQueue> &early_panos,
+    std::function<void(std::vector<algorithm::Match>)> done) {
+  if (!options.adaptive_neighborhood || options.type != MatchingType::kAuto) {
+    auto streaming =
+        early_panos ? std::make_shared<PanoStreaming>(
+                          static_cast<int>(images->size()), pairs, options,
+                          match_options, early_panos)
+                    : nullptr;
+    MatchPairs(images, std::move(pairs), match_options, progress, pool, graph,
+               std::move(streaming), std::move(done));
+    return;
+  }
+
+  const int num_neighbors = std::min(options.neighborhood_search_size,
+                                     static_cast<int>(images->size()) - 1);
+  auto state = std::make_shared<AdaptiveMatching>(AdaptiveMatching{
+      .rounds = AdaptiveRounds(pairs, num_neighbors),
+      .connectivity = algorithm::MatchConnectivity(
+          options.match_threshold, options.min_shift,
+          kAdaptiveStrongMatchFactor * options.match_threshold)});
+  for (const auto &match : known_matches) {
+    state->connectivity.Add(match);
+  }
+  progress->Reset(ProgressType::kMatchingImages, 1);
+  MatchAdaptiveRound(images, std::move(state), 0, match_options, progress,
+                     pool, graph, std::move(done));
+}
+
+algorithm::MatchOptions MakeMatchOptions(const MatchingOptions &options,
+                                         algorithm::FeatureType feature) {
+  return {.match_conf = options.match_conf,
+          .feature = feature,
+          .matcher = options.matcher,
+          .homography = options.homography};
+}
+
+// Coarse to fine, see MatchingOptions::coarse_to_fine
+algorithm::ImageLoadOptions FineLoadOptions(const LoadingOptions &loading,
+                                            const MatchingOptions &matching) {
+  return {.preview_longer_side = loading.preview_longer_side,
+          .detection_longer_side = matching.fine_longer_side,
+          .feature = loading.feature,
+          .num_features = loading.num_features,
+          .compact_features = loading.compact_features,
+          .detector_backend = loading.detector_backend,
+          .lens = loading.lens};
+}
+
+struct Refinement {
+  std::vector<algorithm::Image> images;
+  std::vector<algorithm::Match> matches;
+  // Indices of the refined matches, with their coarse homographies
+  std::vector<int> match_ids;
+  std::vector<cv::Mat> homographies;
+  std::vector<int> image_ids;
+  std::vector<cv::Mat> regions;
+};
+
+// The images of the matches passing the threshold detect their keypoints
+// again at the fine size, only in the overlaps predicted by the coarse
+// homographies, then the matches are redone by GuidedMatch. The other matches
+// of those images are cleared, their keypoint ids no longer apply.
+void RefineMatches(std::vector<algorithm::Image> images,
+                   std::vector<algorithm::Match> matches,
+                   const MatchingOptions &options,
+                   const algorithm::ImageLoadOptions &fine_options,
+                   const algorithm::MatchOptions &match_options,
+                   ProgressMonitor *progress, utils::mt::Threadpool *pool,
+                   DataGraph *graph,
+                   std::function<void(std::vector<algorithm::Image>,
+                                      std::vector<algorithm::Match>)>
+                       done) {
+  auto state = std::make_shared<Refinement>();
+  std::map<int, cv::Mat> regions;
+  for (int i = 0; i < static_cast<int>(matches.size()); i++) {
+    const auto &match = matches[i];
+    if (algorithm::NumInliers(match) < options.match_threshold) {
+      continue;
+    }
+    const auto &img1 = images[match.id1];
+    const auto &img2 = images[match.id2];
+    auto homography = algorithm::MatchHomography(match, img1, img2);
+    if (homography.empty()) {
+      continue;
+    }
+    for (const auto &[id, region] :
+         {std::pair{match.id2,
+                    algorithm::OverlapRegion(img1, img2, homography)},
+          std::pair{match.id1,
+                    algorithm::OverlapRegion(img2, img1, homography.inv())}}) {
+      auto [iter, inserted] = regions.try_emplace(id, region);
+      if (!inserted) {
+        cv::bitwise_or(iter->second, region, iter->second);
+      }
+    }
+    state->match_ids.push_back(i);
+    state->homographies.push_back(std::move(homography));
+  }
+  for (auto &[id, region] : regions) {
+    state->image_ids.push_back(id);
+    state->regions.push_back(std::move(region));
+  }
+  state->images = std::move(images);
+  state->matches = std::move(matches);
+  spdlog::info("Refining {} matches of {} images at {} px",
+               state->match_ids.size(), state->image_ids.size(),
+               fine_options.detection_longer_side);
+
+  const int num_images = static_cast<int>(state->image_ids.size());
+  const int num_matches = static_cast<int>(state->match_ids.size());
+  progress->Reset(ProgressType::kRefiningMatches,
+                  1 +  // FindPanos
+                      num_images + num_matches);
+  graph->ForEach<algorithm::Image>(
+      pool, num_images,
+      [state, fine_options, progress](int index) {
+        const auto span = StageSpan(ProgressType::kRefiningMatches);
+        auto image = state->images[state->image_ids[index]];
+        image.DetectInRegion(state->regions[index], fine_options);
+        progress->NotifyTaskDone();
+        return image;
+      },
+      [state, num_matches, match_options, progress, pool, graph,
+       done = std::move(done)](std::vector<algorithm::Image> refined) mutable {
+        for (int i = 0; i < static_cast<int>(refined.size()); i++) {
+          state->images[state->image_ids[i]] = std::move(refined[i]);
+        }
+        state->regions.clear();
+        graph->ForEach<algorithm::Match>(
+            pool, num_matches,
+            [state, match_options, progress](int index) {
+              const auto span = StageSpan(ProgressType::kRefiningMatches);
+              const auto &coarse = state->matches[state->match_ids[index]];
+              auto match = algorithm::GuidedMatch(
+                  coarse.id1, coarse.id2, state->images[coarse.id1],
+                  state->images[coarse.id2], state->homographies[index],
+                  match_options);
+              progress->NotifyTaskDone();
+              return match;
+            },
+            [state, done = std::move(done)](
+                std::vector<algorithm::Match> refined_matches) {
+              const std::set<int> refined_images(state->image_ids.begin(),
+                                                 state->image_ids.end());
+              for (auto &match : state->matches) {
+                if (refined_images.contains(match.id1) ||
+                    refined_images.contains(match.id2)) {
+                  match = {.id1 = match.id1, .id2 = match.id2};
+                }
+              }
+              for (int i = 0; i < static_cast<int>(refined_matches.size());
+                   i++) {
+                auto &match = state->matches[state->match_ids[i]];
+                const int id1 = match.id1;
+                const int id2 = match.id2;
+                match = std::move(refined_matches[i]);
+                match.id1 = id1;
+                match.id2 = id2;
+              }
+              done(std::move(state->images), std::move(state->matches));
+            });
+      });
+}
+
+using utils::memory::Category;
+
+std::int64_t MatBytes(const cv::Mat &mat) {
+  return static_cast<std::int64_t>(mat.total() * mat.elemSize());
+}
+
+// The images and matches of the last result, replaced as a whole
+void AccountMemory(const StitcherData &data) {
+  std::int64_t image_bytes = 0;
+  std::int64_t feature_bytes = 0;
+  for (const auto &image : data.images) {
+    image_bytes +=
+        static_cast<std::int64_t>(image.GetPreviewBytes()) +
+        MatBytes(image.GetThumbnail());
+    feature_bytes +=
+        MatBytes(image.GetDescriptors()) +
+        static_cast<std::int64_t>(image.NumKeypoints() * sizeof(cv::KeyPoint));
+  }
+  std::int64_t match_bytes = 0;
+  for (const auto &match : data.matches) {
+    match_bytes +=
+        static_cast<std::int64_t>(match.matches.size() * sizeof(cv::DMatch));
+    if (const auto &candidates = match.candidates; candidates) {
+      match_bytes += static_cast<std::int64_t>(
+          candidates->nearest.size() *
+          (sizeof(cv::DMatch) + sizeof(float) + sizeof(uchar)));
+    }
+  }
+  utils::memory::Set(Category::kImages, image_bytes);
+  utils::memory::Set(Category::kFeatures, feature_bytes);
+  utils::memory::Set(Category::kMatches, match_bytes);
+}
+
+void SetDataResult(DataGraph *graph, StitcherData data) {
+  AccountMemory(data);
+  graph->SetResult(std::move(data));
+}
+
+// Sets the result of the graph
+void RunMatchingPipeline(std::vector<algorithm::Image> images,
+                         const MatchingOptions &options,
+                         const LoadingOptions &loading_options,
+                         ProgressMonitor *progress,
+                         utils::mt::Threadpool *pool, DataGraph *graph,
+                         std::shared_ptr<EarlyPanoQueue> early_panos) {
   if (images.empty()) {
-    return {};
+    SetDataResult(graph, {});
+    return;
   }
 
   if (options.type == MatchingType::kNone) {
-    return StitcherData{std::move(images)};
+    SetDataResult(graph, StitcherData{std::move(images)});
+    return;
   }
 
   if (options.type == MatchingType::kSinglePano) {
     auto pano = algorithm::SinglePano(static_cast<int>(images.size()));
-    return StitcherData{std::move(images), {}, {pano}};
+    SetDataResult(graph, StitcherData{std::move(images), {}, {pano}});
+    return;
   }
 
-  const int num_images = static_cast<int>(images.size());
-  const int num_neighbors =
-      std::min(options.neighborhood_search_size, num_images - 1);
-  const int num_tasks =
-      1 +                                             // FindPanos
-      (num_images - num_neighbors) * num_neighbors +  // full n-tuples
-      ((num_neighbors - 1) * num_neighbors) / 2;      // non-full (j - i < 0)
+  auto shared_images =
+      std::make_shared<const std::vector<algorithm::Image>>(std::move(images));
+  auto match_options = MakeMatchOptions(options, loading_options.feature);
+  auto fine_options = FineLoadOptions(loading_options, options);
+  auto find_panos = [options, match_options, progress, graph](
+                        std::vector<algorithm::Image> images,
+                        std::vector<algorithm::Match> matches) {
+    auto panos =
+        FindPanos(matches, options.match_threshold, options.min_shift);
+    ReleaseInliers(options, match_options, images, &matches);
+    progress->NotifyTaskDone();
+    SetDataResult(graph, StitcherData{std::move(images), std::move(matches),
+                                      std::move(panos)});
+  };
+  // The refinement may still change the coarse matches
+  if (options.coarse_to_fine) {
+    early_panos = nullptr;
+  }
+  MatchingPairs(
+      shared_images, options, 0, progress, pool, graph,
+      [shared_images, options, match_options, fine_options, find_panos,
+       early_panos, progress, pool, graph](Pairs pairs) {
+        MatchCandidatePairs(
+            shared_images, std::move(pairs), {}, options, match_options,
+            progress, pool, graph, early_panos,
+            [shared_images, options, match_options, fine_options, find_panos,
+             progress, pool, graph](std::vector<algorithm::Match> matches) {
+              if (!options.coarse_to_fine) {
+                find_panos(*shared_images, std::move(matches));
+                return;
+              }
+              RefineMatches(*shared_images, std::move(matches), options,
+                            fine_options, match_options, progress, pool,
+                            graph, find_panos);
+            });
+      });
+}
 
-  progress->Reset(ProgressType::kMatchingImages, num_tasks);
-  utils::mt::MultiFuture<algorithm::Match> matches_future;
-  for (int j = 0; j < images.size(); j++) {
-    for (int i = std::max(0, j - num_neighbors); i < j; i++) {
-      matches_future.push_back(
-          pool->submit([i, j, left = images[i], right = images[j],
-                        match_conf = options.match_conf, progress]() {
-            auto match = algorithm::MatchImages(i, j, left, right, match_conf);
-            progress->NotifyTaskDone();
-            return match;
-          }));
+// Panos with the same images as before keep their state (cameras, crop, ...)
+void KeepUnchangedPanos(const std::vector<algorithm::Pano> &old_panos,
+                        std::vector<algorithm::Pano> *panos) {
+  for (auto &pano : *panos) {
+    auto old_pano = std::find_if(
+        old_panos.begin(), old_panos.end(),
+        [&pano](const algorithm::Pano &old) { return old.ids == pano.ids; });
+    if (old_pano != old_panos.end()) {
+      pano = *old_pano;
     }
   }
-  if (auto status = WaitWithCancellation(&matches_future, progress);
-      status == WaitStatus::kCancelled) {
-    return {};
+}
+
+// Sets the result of the graph, the cancelled result is the previous data
+void RunAppendingPipeline(StitcherData data,
+                          std::vector<algorithm::Image> new_images,
+                          const MatchingOptions &options,
+                          algorithm::FeatureType feature,
+                          ProgressMonitor *progress,
+                          utils::mt::Threadpool *pool, DataGraph *graph) {
+  if (new_images.empty()) {
+    SetDataResult(graph, std::move(data));
+    return;
   }
-  auto matches = matches_future.get();
+  const int first_new_id = static_cast<int>(data.images.size());
+  std::move(new_images.begin(), new_images.end(),
+            std::back_inserter(data.images));
 
-  auto panos = FindPanos(matches, options.match_threshold, options.min_shift);
-  progress->NotifyTaskDone();
-  return StitcherData{images, matches, panos};
+  if (options.type == MatchingType::kNone) {
+    SetDataResult(graph, std::move(data));
+    return;
+  }
+
+  if (options.type == MatchingType::kSinglePano) {
+    data.panos = {algorithm::SinglePano(static_cast<int>(data.images.size()))};
+    SetDataResult(graph, std::move(data));
+    return;
+  }
+
+  auto shared_images =
+      std::make_shared<const std::vector<algorithm::Image>>(data.images);
+  auto shared_data = std::make_shared<StitcherData>(std::move(data));
+  auto match_options = MakeMatchOptions(options, feature);
+  MatchingPairs(
+      shared_images, options, first_new_id, progress, pool, graph,
+      [shared_images, shared_data, options, match_options, progress, pool,
+       graph](Pairs pairs) {
+        MatchCandidatePairs(
+            shared_images, std::move(pairs), shared_data->matches, options,
+            match_options, progress, pool, graph, /*early_panos=*/nullptr,
+            [shared_data, options, match_options, progress,
+             graph](std::vector<algorithm::Match> matches) {
+              auto &data = *shared_data;
+              std::move(matches.begin(), matches.end(),
+                        std::back_inserter(data.matches));
+
+              // The disjoint set over all matches is cheap compared to the
+              // matching
+              auto panos = FindPanos(data.matches, options.match_threshold,
+                                     options.min_shift);
+              KeepUnchangedPanos(data.panos, &panos);
+              data.panos = std::move(panos);
+              ReleaseInliers(options, match_options, data.images,
+                             &data.matches);
+              progress->NotifyTaskDone();
+              SetDataResult(graph, std::move(data));
+            });
+      });
+}
+
+// See StitcherPipeline::RunRegrouping
+void RegroupPanos(const MatchingOptions &options, StitcherData *data) {
+  if (options.type != MatchingType::kAuto &&
+      options.type != MatchingType::kGrid) {
+    return;
+  }
+  for (auto &match : data->matches) {
+    if (match.candidates) {
+      match = algorithm::Rematch(match, data->images[match.id1],
+                                 data->images[match.id2], options.match_conf);
+    }
+  }
+  auto panos =
+      FindPanos(data->matches, options.match_threshold, options.min_shift);
+  KeepUnchangedPanos(data->panos, &panos);
+  data->panos = std::move(panos);
 }
 
 int StitchTaskCount(const StitchingOptions &options, int num_images,
-                    bool cameras_precomputed) {
+                    bool cameras_precomputed, bool streaming) {
+  const bool preload = options.full_res && !streaming;
   return 1 +  // Stitching
          algorithm::StitchTasksCount(
              num_images, cameras_precomputed) +  // Stitching subtasks
          (options.export_path ? 1 : 0) +         // Export
          1 +                                     // Auto crop
-         (options.full_res ? num_images : 1);  // Load full res / load previews
+         (preload ? num_images : 1);  // Load full res / load previews
+}
+
+// Full resolution sizes from the JPEG headers, so that the images can be
+// streamed into the stitcher. Empty if any of the sizes can't be read.
+std::optional<std::vector<cv::Size>> FullResSizes(
+    const std::vector<int> &ids, const std::vector<algorithm::Image> &images) {
+  std::vector<cv::Size> sizes;
+  for (const int img_id : ids) {
+    const auto &image = images[img_id];
+    const cv::Size preview = image.GetPreviewSize();
+    if (image.IsRaw() || preview.empty()) {
+      return {};
+    }
+    auto header_size = utils::jpeg::ReadSize(image.GetPath());
+    if (!header_size) {
+      return {};
+    }
+    cv::Size size((*header_size)[0], (*header_size)[1]);
+    // The header is before the Exif orientation, the preview after it
+    if (preview.width != preview.height &&
+        (size.width > size.height) != (preview.width > preview.height)) {
+      std::swap(size.width, size.height);
+    }
+    sizes.push_back(size);
+  }
+  return sizes;
+}
+
+// The previews downscaled with one common factor, the first one to the
+// longer_side, stitched with the cameras and Voronoi seams
+algorithm::StitchResult StitchCoarse(
+    const algorithm::Pano &pano, const std::vector<algorithm::Image> &images,
+    const Cameras &cameras, StitchAlgorithmOptions stitch_algorithm,
+    int longer_side, utils::mt::Threadpool *pool) {
+  const cv::Size first_size = images[pano.ids[0]].GetPreviewSize();
+  const double scale =
+      std::min(1.0, static_cast<double>(longer_side) /
+                        std::max(first_size.width, first_size.height));
+  std::vector<cv::Mat> imgs;
+  for (const int img_id : pano.ids) {
+    cv::Mat downscaled;
+    cv::resize(images[img_id].GetPreview(), downscaled, cv::Size(), scale,
+               scale, cv::INTER_AREA);
+    imgs.push_back(downscaled);
+  }
+
+  stitch_algorithm.seam_finder = algorithm::SeamFinderType::kVoronoi;
+  return algorithm::Stitch(imgs, algorithm::DownscaleCameras(cameras, scale),
+                           stitch_algorithm,
+                           {.threads_for_compose = pool, .preview = true});
+}
+
+// The first stage of a progressive preview, with the cached cameras
+StitchingResult RunCoarseStitchingPipeline(
+    const algorithm::Pano &pano, const std::vector<algorithm::Image> &images,
+    const StitchingOptions &options, ProgressMonitor *progress,
+    utils::mt::Threadpool *pool) {
+  StitchingResult result = {.pano_id = options.pano_id, .coarse = true};
+  if (progress->IsCancelled()) {
+    return result;
+  }
+
+  auto stitched =
+      StitchCoarse(pano, images, *pano.cameras, options.stitch_algorithm,
+                   kProgressivePreviewLongerSide, pool);
+  result.status = stitched.status;
+  if (IsSuccess(stitched.status)) {
+    result.pano = stitched.pano;
+  }
+  return result;
+}
+
+std::optional<std::filesystem::path> ExportComposedPano(
+    const cv::Mat &result, const algorithm::Pano &pano,
+    const std::vector<algorithm::Image> &images,
+    const StitchingOptions &options, bool cropped, ProgressMonitor *progress,
+    utils::mt::Threadpool *pool) {
+  std::optional<std::filesystem::path> metadata_path;
+  if (options.metadata.copy_from_first_image) {
+    const auto &first_image = images[pano.ids[0]];
+    // In-memory images have no file to copy the metadata from
+    if (!first_image.IsInMemory()) {
+      metadata_path = first_image.GetPath();
+    }
+  }
+
+  return RunExportPipeline(result,
+                           {.export_path = *options.export_path,
+                            .metadata_path = metadata_path,
+                            .compression = options.compression,
+                            .crop = cropped ? std::nullopt
+                                            : options.export_crop},
+                           progress, pool)
+      .export_path;
+}
+
+// Only the auto crop and export are left
+StitchingResult ResumeFromComposedPano(
+    const algorithm::Pano &pano, const std::vector<algorithm::Image> &images,
+    const StitchingOptions &options, bool cropped,
+    const Checkpoint &checkpoint, ComposedPano composed,
+    ProgressMonitor *progress, utils::mt::Threadpool *pool) {
+  spdlog::info("Resuming pano {} from the composed pano checkpoint",
+               options.pano_id);
+  progress->Reset(ProgressType::kAutoCrop, 2);
+  std::optional<utils::RectRRf> auto_crop;
+  if (!cropped) {
+    const auto crop_span = StageSpan(ProgressType::kAutoCrop);
+    auto_crop = algorithm::FindLargestCrop(composed.mask);
+  }
+  progress->NotifyTaskDone();
+
+  auto export_path = ExportComposedPano(composed.pano, pano, images, options,
+                                        cropped, progress, pool);
+  if (export_path) {
+    checkpoint.Remove();
+  }
+  auto cameras =
+      algorithm::CanReuseCameras(pano.cameras, options.stitch_algorithm)
+          ? pano.cameras
+          : checkpoint.LoadCameras();
+  return StitchingResult{
+      .pano_id = options.pano_id,
+      .full_res = options.full_res,
+      .cropped = cropped,
+      .status = composed.status,
+      .pano = composed.pano,
+      .auto_crop = auto_crop,
+      .export_path = export_path,
+      .mask = std::move(composed.mask),
+      .cameras = std::move(cameras),
+  };
+}
+
+// Inputs of the camera estimation, see algorithm::StitchOptions
+struct CameraEstimation {
+  std::optional<algorithm::StitchFeatures> features;
+  cv::Mat matching_mask;
+  std::vector<cv::Point> grid_cells;
+};
+
+CameraEstimation PrepareCameraEstimation(
+    const algorithm::Pano &pano, const std::vector<algorithm::Image> &images,
+    const std::vector<algorithm::Match> &matches,
+    const StitchingOptions &options) {
+  CameraEstimation estimation;
+  if (options.stitch_algorithm.reuse_matches) {
+    estimation.features =
+        algorithm::PrepareStitchFeatures(pano.ids, images, matches);
+  }
+  if (!estimation.features) {
+    estimation.matching_mask =
+        options.grid ? algorithm::GridMatchingMask(*options.grid, pano.ids)
+                     : algorithm::MatchingMask(pano.ids, matches,
+                                               options.match_threshold,
+                                               /*expand_one_hop=*/true);
+  }
+  if (options.grid) {
+    estimation.grid_cells = algorithm::GridCells(*options.grid, pano.ids);
+  }
+  return estimation;
 }
 
 StitchingResult RunStitchingPipeline(
     const algorithm::Pano &pano, const std::vector<algorithm::Image> &images,
+    const std::vector<algorithm::Match> &matches,
     const StitchingOptions &options, ProgressMonitor *progress,
     // NOLINTNEXTLINE(bugprone-easily-swappable-parameters): fixme
-    utils::mt::Threadpool *pool, utils::mt::Threadpool *multiblend_pool) {
+    utils::mt::Threadpool *pool, FullResCache *full_res_cache,
+    const std::optional<std::filesystem::path> &checkpoint_dir,
+    const std::optional<algorithm::SpillOptions> &spill) {
+  if (progress->IsCancelled()) {
+    return {};
+  }
+  const auto span = StageSpan(ProgressType::kStitchingPano);
   const int num_images = static_cast<int>(pano.ids.size());
-  const int num_tasks =
-      StitchTaskCount(options, num_images, pano.cameras.has_value());
-  progress->Reset(ProgressType::kLoadingImages, num_tasks);
-  std::vector<cv::Mat> imgs;
+
+  const bool tiled = options.tiled_export && options.export_path;
+  // The rest of the pano would be thrown away by the export
+  const bool cropped = !tiled && options.export_path && options.export_crop;
+  // Only with a checkpoint directory shared by the shards
+  const auto shard = tiled && checkpoint_dir && options.full_res
+                         ? options.shard
+                         : std::nullopt;
+
+  // Resumes after the last stage completed by an earlier run
+  std::optional<Checkpoint> checkpoint;
+  auto pano_cameras = pano.cameras;
+  auto pano_session = pano.session;
+  if (options.full_res && checkpoint_dir) {
+    checkpoint.emplace(*checkpoint_dir, pano, images, options);
+    if (shard && shard->index > 0 &&
+        !WaitForFirstShard(*checkpoint, progress)) {
+      return {};
+    }
+    if (options.export_path && !tiled) {
+      if (auto composed = checkpoint->LoadPano(); composed) {
+        return ResumeFromComposedPano(pano, images, options, cropped,
+                                      *checkpoint, *std::move(composed),
+                                      progress, pool);
+      }
+    }
+    if (!algorithm::CanReuseCameras(pano_cameras, options.stitch_algorithm)) {
+      if (auto cameras = checkpoint->LoadCameras(); cameras) {
+        spdlog::info("Resuming pano {} from the camera checkpoint",
+                     options.pano_id);
+        pano_cameras = std::move(cameras);
+      }
+    }
+    if (auto session = checkpoint->LoadSession(); session) {
+      spdlog::info("Resuming pano {} from the seam checkpoint",
+                   options.pano_id);
+      pano_session = std::move(session);
+    }
+  }
+
+  // Streams the full resolution images into the stitcher instead of loading
+  // them all up front, the previews stand in for them until compositing
+  std::optional<algorithm::stitcher::FullResSource> full_res_source;
   if (options.full_res) {
-    utils::mt::MultiFuture<cv::Mat> imgs_future;
-    for (const auto &img_id : pano.ids) {
-      imgs_future.push_back(pool->submit([&image = images[img_id], progress]() {
-        auto full_res_image = image.GetFullRes();
-        progress->NotifyTaskDone();
-        return full_res_image;
-      }));
+    if (auto sizes = FullResSizes(pano.ids, images)) {
+      full_res_source = {
+          .sizes = *std::move(sizes),
+          .load =
+              [&pano, &images, full_res_cache](int i) {
+                return full_res_cache->Get(images[pano.ids[i]]);
+              },
+      };
     }
-    if (auto status = WaitWithCancellation(&imgs_future, progress);
-        status == WaitStatus::kCancelled) {
+  }
+  const bool streaming = full_res_source.has_value();
+
+  const int num_tasks = StitchTaskCount(options, num_images,
+                                        pano_cameras.has_value(), streaming);
+  progress->Reset(ProgressType::kLoadingImages, num_tasks);
+  std::vector<cv::Mat> imgs;
+  if (options.full_res && !streaming) {
+    // The stitching thread loads images too instead of waiting for the pool
+    imgs.resize(num_images);
+    utils::mt::ParallelFor(
+        pool, num_images,
+        std::min(num_images - 1, static_cast<int>(pool->get_thread_count())),
+        [&](int i, int /*thread_num*/) {
+          if (progress->IsCancelled()) {
+            return;
+          }
+          const auto span = StageSpan(ProgressType::kLoadingImages);
+          imgs[i] = full_res_cache->Get(images[pano.ids[i]]);
+          progress->NotifyTaskDone();
+        });
+    if (progress->IsCancelled()) {
       return {};
     }
-    imgs = imgs_future.get();
   } else {
     for (const int img_id : pano.ids) {
       imgs.push_back(images[img_id].GetPreview());
@@ -236,13 +1350,118 @@ StitchingResult RunStitchingPipeline(
     progress->NotifyTaskDone();
   }
 
+  CameraEstimation estimation;
+  if (!algorithm::CanReuseCameras(pano_cameras, options.stitch_algorithm)) {
+    estimation = PrepareCameraEstimation(pano, images, matches, options);
+  }
+
+  // Deep Zoom pyramid or BigTIFF
+  const bool deep_zoom =
+      tiled && utils::path::IsDeepZoom(*options.export_path);
+  std::optional<utils::tiff::TiledWriter> tiff_writer;
+  std::optional<utils::deep_zoom::PyramidWriter> pyramid_writer;
+  const algorithm::stitcher::TiledOutput tiled_output = {
+      .tile_size = kTiledExportTileSize,
+      .open =
+          [&tiff_writer, &pyramid_writer, &options, deep_zoom,
+           pool](cv::Size pano_size) {
+            spdlog::info("Exporting {}x{} tiled pano to {}", pano_size.width,
+                         pano_size.height, options.export_path->string());
+            if (deep_zoom) {
+              pyramid_writer.emplace(
+                  *options.export_path, pano_size, kTiledExportTileSize,
+                  kDeepZoomTileSize,
+                  CompressionParameters(options.compression), pool);
+              return pyramid_writer->IsOpen();
+            }
+            tiff_writer.emplace(*options.export_path, pano_size,
+                                kTiledExportTileSize,
+                                options.compression.tiff_overviews);
+            return tiff_writer->IsOpen();
+          },
+      .write =
+          [&tiff_writer, &pyramid_writer](cv::Point tile_tl,
+                                          const cv::Mat &image,
+                                          const cv::Mat &mask) {
+            if (pyramid_writer) {
+              return pyramid_writer->WriteTile(tile_tl, image, mask);
+            }
+            return tiff_writer->WriteTile(tile_tl, image, mask);
+          },
+  };
+  std::optional<ShardWriter> shard_writer;
+  algorithm::stitcher::TiledOutput shard_output;
+  if (shard) {
+    shard_writer.emplace(ShardDir(*options.export_path), *shard);
+    shard_output = {
+        .tile_size = kTiledExportTileSize,
+        .open =
+            [&shard_writer](cv::Size pano_size) {
+              return shard_writer->Open(pano_size);
+            },
+        .write =
+            [&shard_writer](cv::Point tile_tl, const cv::Mat &image,
+                            const cv::Mat &mask) {
+              return shard_writer->WriteTile(tile_tl, image, mask);
+            },
+        .shard_index = shard->index,
+        .num_shards = shard->count,
+    };
+  }
+
+  std::function<void(const algorithm::Cameras &)> on_cameras;
+  std::function<void(const algorithm::StitchSession &)> on_session;
+  if (checkpoint) {
+    on_cameras = [&checkpoint](const algorithm::Cameras &cameras) {
+      checkpoint->SaveCameras(cameras);
+    };
+    on_session = [&checkpoint](const algorithm::StitchSession &session) {
+      checkpoint->SaveSession(session);
+    };
+  }
+
   progress->SetTaskType(ProgressType::kStitchingPano);
-  auto [status, result, mask, cameras] =
-      algorithm::Stitch(imgs, pano.cameras, options.stitch_algorithm,
+  auto [status, result, mask, cameras, session, display] =
+      algorithm::Stitch(imgs, pano_cameras, options.stitch_algorithm,
                         {.return_pano_mask = true,
-                         .threads_for_multiblend = multiblend_pool,
-                         .progress_monitor = progress});
+                         .threads_for_multiblend = pool,
+                         .multiblend_spill =
+                             options.full_res ? spill : std::nullopt,
+                         .threads_for_compose = pool,
+                         .threads_for_features = pool,
+                         .threads_for_seams = pool,
+                         .progress_monitor = progress,
+                         .features = estimation.features
+                                          ? &*estimation.features
+                                          : nullptr,
+                         .matching_mask = estimation.matching_mask,
+                         .tiled_output = !tiled  ? nullptr
+                                         : shard ? &shard_output
+                                                 : &tiled_output,
+                         .session = pano_session,
+                         .preview = !options.full_res,
+                         .display_longer_side = options.display_longer_side,
+                         .full_res_source =
+                             streaming ? &*full_res_source : nullptr,
+                         .initial_cameras = pano.initial_cameras.empty()
+                                                ? nullptr
+                                                : &pano.initial_cameras,
+                         .grid_cells = estimation.grid_cells.empty()
+                                           ? nullptr
+                                           : &estimation.grid_cells,
+                         .compose_crop = cropped ? options.export_crop
+                                                 : std::nullopt,
+                         .on_cameras = on_cameras,
+                         .on_session = on_session});
   progress->NotifyTaskDone();
+  if (options.full_res) {
+    auto stats = full_res_cache->Stats();
+    spdlog::debug(
+        "Full resolution cache: {} hits, {} mapped hits, {} misses, {:.1f} MB "
+        "used",
+        stats.hits, stats.mapped_hits, stats.misses,
+        static_cast<float>(stats.bytes_used) / kMegabyte);
+  }
 
   if (!IsSuccess(status)) {
     return StitchingResult{
@@ -252,38 +1471,306 @@ StitchingResult RunStitchingPipeline(
     };
   }
 
+  if (checkpoint && options.export_path && !tiled) {
+    checkpoint->SavePano({.status = status, .pano = result, .mask = mask});
+  }
+
   progress->SetTaskType(ProgressType::kAutoCrop);
-  auto auto_crop = algorithm::FindLargestCrop(mask);
+  std::optional<utils::RectRRf> auto_crop;
+  if (!tiled && !cropped) {
+    const auto crop_span = StageSpan(ProgressType::kAutoCrop);
+    auto_crop = algorithm::FindLargestCrop(mask);
+  }
   progress->NotifyTaskDone();
 
   std::optional<std::filesystem::path> export_path;
-  if (options.export_path) {
-    std::optional<std::filesystem::path> metadata_path;
-    if (options.metadata.copy_from_first_image) {
-      const auto &first_image = images[pano.ids[0]];
-      metadata_path = first_image.GetPath();
+  if (shard) {
+    progress->SetTaskType(ProgressType::kExport);
+    const auto export_span = StageSpan(ProgressType::kExport);
+    const auto shard_dir = ShardDir(*options.export_path);
+    if (!shard_writer->Close()) {
+      spdlog::error("Failed to complete shard {}", shard->index + 1);
+    } else if (shard->index > 0) {
+      export_path = shard_dir;
+    } else if (auto pano_size =
+                   WaitForShards(shard_dir, shard->count, progress);
+               pano_size) {
+      if (AssembleShards(shard_dir, *pano_size, tiled_output) &&
+          (pyramid_writer ? pyramid_writer->Close() : tiff_writer->Close())) {
+        export_path = options.export_path;
+      } else {
+        spdlog::error("Failed to write {}", options.export_path->string());
+      }
     }
+    progress->NotifyTaskDone();
+  } else if (tiled) {
+    progress->SetTaskType(ProgressType::kExport);
+    const auto export_span = StageSpan(ProgressType::kExport);
+    if (pyramid_writer ? pyramid_writer->Close() : tiff_writer->Close()) {
+      export_path = options.export_path;
+    } else {
+      spdlog::error("Failed to write {}", options.export_path->string());
+    }
+    progress->NotifyTaskDone();
+  } else if (options.export_path) {
+    export_path = ExportComposedPano(result, pano, images, options, cropped,
+                                     progress, pool);
+  }
+  // The other shards may still need the seams
+  if (checkpoint && (export_path || !options.export_path) &&
+      (!shard || shard->index == 0)) {
+    checkpoint->Remove();
+  }
+
+  return StitchingResult{
+      .pano_id = options.pano_id,
+      .full_res = options.full_res,
+      .cropped = cropped,
+      .status = status,
+      .pano = result,
+      .auto_crop = auto_crop,
+      .export_path = export_path,
+      .mask = mask,
+      .cameras = cameras,
+      .session = session,
+      .display = display.empty() ? std::nullopt
+                                 : std::optional<cv::Mat>(display),
+  };
+}
+
+// See StitcherPipeline::RunPanoThumbnails, empty if the stitching failed
+std::optional<PanoThumbnail> RunPanoThumbnailPipeline(
+    int pano_id, const algorithm::Pano &pano,
+    const std::vector<algorithm::Image> &images,
+    const std::vector<algorithm::Match> &matches,
+    const StitchingOptions &options, ProgressMonitor *progress,
+    utils::mt::Threadpool *pool) {
+  PanoThumbnail result = {.pano_id = pano_id, .ids = pano.ids};
+  auto cameras = pano.cameras;
+  if (!algorithm::CanReuseCameras(cameras, options.stitch_algorithm)) {
+    std::vector<cv::Mat> imgs;
+    for (const int img_id : pano.ids) {
+      imgs.push_back(images[img_id].GetPreview());
+    }
+    const auto estimation =
+        PrepareCameraEstimation(pano, images, matches, options);
+    auto estimated = algorithm::Stitch(
+        imgs, cameras, options.stitch_algorithm,
+        {.threads_for_features = pool,
+         .progress_monitor = progress,
+         .features = estimation.features ? &*estimation.features : nullptr,
+         .matching_mask = estimation.matching_mask,
+         .preview = true,
+         .initial_cameras =
+             pano.initial_cameras.empty() ? nullptr : &pano.initial_cameras,
+         .grid_cells = estimation.grid_cells.empty()
+                           ? nullptr
+                           : &estimation.grid_cells,
+         .cameras_only = true});
+    if (!IsSuccess(estimated.status)) {
+      return {};
+    }
+    cameras = std::move(estimated.cameras);
+    result.cameras = cameras;
+  }
+  if (progress->IsCancelled()) {
+    return {};
+  }
+
+  auto stitched = StitchCoarse(pano, images, *cameras, options.stitch_algorithm,
+                               kPanoThumbnailImageSide, pool);
+  if (!IsSuccess(stitched.status)) {
+    return {};
+  }
+  result.thumbnail = stitched.pano;
+  return result;
+}
+
+bool SameCamera(const cv::detail::CameraParams &lhs,
+                const cv::detail::CameraParams &rhs) {
+  return lhs.focal == rhs.focal && lhs.aspect == rhs.aspect &&
+         lhs.ppx == rhs.ppx && lhs.ppy == rhs.ppy &&
+         cv::norm(lhs.R, rhs.R, cv::NORM_INF) == 0.0 &&
+         cv::norm(lhs.t, rhs.t, cv::NORM_INF) == 0.0;
+}
 
-    export_path = RunExportPipeline(result,
-                                    {.export_path = *options.export_path,
-                                     .metadata_path = metadata_path,
-                                     .compression = options.compression,
-                                     .crop = options.export_crop},
-                                    progress)
-                      .export_path;
+bool SameCameras(const std::optional<Cameras> &lhs,
+                 const std::optional<Cameras> &rhs) {
+  if (!lhs || !rhs) {
+    return !lhs && !rhs;
   }
+  return lhs->component == rhs->component &&
+         lhs->wave_correction_user == rhs->wave_correction_user &&
+         lhs->wave_correction_auto == rhs->wave_correction_auto &&
+         std::equal(lhs->cameras.begin(), lhs->cameras.end(),
+                    rhs->cameras.begin(), rhs->cameras.end(), SameCamera);
+}
 
-  return StitchingResult{options.pano_id, options.full_res, status, result,
-                         auto_crop,       export_path,      mask,   cameras};
+std::size_t MatBytes(const std::optional<cv::Mat> &mat) {
+  return mat ? mat->total() * mat->elemSize() : 0;
 }
 
 }  // namespace
 
+std::vector<int> CompressionParameters(const CompressionOptions &options) {
+  return {cv::IMWRITE_JPEG_QUALITY,
+          options.jpeg_quality,
+          cv::IMWRITE_JPEG_PROGRESSIVE,
+          static_cast<int>(options.jpeg_progressive),
+          cv::IMWRITE_JPEG_OPTIMIZE,
+          static_cast<int>(options.jpeg_optimize),
+#if XPANO_OPENCV_HAS_JPEG_SUBSAMPLING_SUPPORT
+          cv::IMWRITE_JPEG_SAMPLING_FACTOR,
+          ToOpenCVEnum(options.jpeg_subsampling),
+#endif
+          cv::IMWRITE_PNG_COMPRESSION,
+          options.png_compression};
+}
+
+int StitchingResultCache::Generation() const {
+  const std::lock_guard lock(mutex_);
+  return generation_;
+}
+
+bool StitchingResultCache::Matches(const Entry &entry,
+                                   const std::vector<int> &ids,
+                                   const StitchingOptions &options,
+                                   const std::optional<Cameras> &cameras) {
+  return entry.ids == ids &&
+         entry.stitch_algorithm == options.stitch_algorithm &&
+         entry.match_threshold == options.match_threshold &&
+         SameCameras(entry.cameras, cameras);
+}
+
+auto StitchingResultCache::Find(const std::vector<int> &ids,
+                                const StitchingOptions &options,
+                                const std::optional<Cameras> &cameras)
+    -> std::list<Entry>::iterator {
+  return std::find_if(entries_.begin(), entries_.end(),
+                      [&](const Entry &entry) {
+                        return Matches(entry, ids, options, cameras);
+                      });
+}
+
+void StitchingResultCache::Erase(std::list<Entry>::iterator entry) {
+  bytes_used_ -= entry->bytes;
+  entries_.erase(entry);
+}
+
+void StitchingResultCache::Insert(int generation, const algorithm::Pano &pano,
+                                  const StitchingOptions &options,
+                                  const std::optional<Cameras> &cameras,
+                                  StitchingResult result) {
+  const std::size_t bytes =
+      MatBytes(result.pano) + (result.mask ? result.mask->Bytes() : 0);
+  if (bytes > budget_bytes_) {
+    return;
+  }
+
+  const std::lock_guard lock(mutex_);
+  if (generation != generation_) {
+    return;
+  }
+  if (auto entry = Find(pano.ids, options, cameras); entry != entries_.end()) {
+    Erase(entry);
+  }
+  entries_.push_front({pano.ids, options.stitch_algorithm,
+                       options.match_threshold, cameras, std::move(result),
+                       bytes});
+  bytes_used_ += bytes;
+  while (bytes_used_ > budget_bytes_) {
+    Erase(std::prev(entries_.end()));
+  }
+}
+
+bool StitchingResultCache::Contains(const algorithm::Pano &pano,
+                                    const StitchingOptions &options) const {
+  const std::lock_guard lock(mutex_);
+  return std::any_of(entries_.begin(), entries_.end(),
+                     [&](const Entry &entry) {
+                       return Matches(entry, pano.ids, options, pano.cameras);
+                     });
+}
+
+std::optional<StitchingResult> StitchingResultCache::Get(
+    const algorithm::Pano &pano, const StitchingOptions &options) {
+  const std::lock_guard lock(mutex_);
+  auto entry = Find(pano.ids, options, pano.cameras);
+  if (entry == entries_.end()) {
+    misses_++;
+    return {};
+  }
+  hits_++;
+  entry->cameras = entry->result.cameras;
+  entries_.splice(entries_.begin(), entries_, entry);
+  return entry->result;
+}
+
+PreviewCacheStats StitchingResultCache::Stats() const {
+  const std::lock_guard lock(mutex_);
+  return {.hits = hits_, .misses = misses_, .bytes_used = bytes_used_};
+}
+
+void StitchingResultCache::Clear() {
+  const std::lock_guard lock(mutex_);
+  entries_.clear();
+  bytes_used_ = 0;
+  generation_++;
+}
+
 using ProgressType = algorithm::ProgressType;
 
+template <RunTraits run>
+StitcherPipeline<run>::StitcherPipeline(
+    const StitcherPipelineOptions &options)
+    : full_res_cache_(options.full_res_cache_bytes,
+                      options.mapped_frames_dir),
+      preview_cache_(options.preview_cache_bytes),
+      checkpoint_dir_(options.checkpoint_dir),
+      spill_(options.spill_dir ? std::make_optional(algorithm::SpillOptions{
+                                     .dir = *options.spill_dir,
+                                     .threshold_bytes =
+                                         options.spill_threshold_bytes})
+                               : std::nullopt),
+      on_task_done_(options.on_task_done),
+      pool_(options.pool ? options.pool
+                         : std::make_shared<utils::mt::Threadpool>(
+                               utils::mt::SharedPoolThreads())),
+      stream_panos_(options.stream_panos),
+      export_pool_(std::max(1, options.max_concurrent_exports)) {
+  algorithm::SetDecodedPreviewBudget(options.decoded_preview_cache_bytes);
+  if (options.feature_cache_dir) {
+    feature_cache_.emplace(*options.feature_cache_dir);
+  }
+}
+
+template <RunTraits run>
+template <typename TFunction>
+auto StitcherPipeline<run>::Submit(utils::mt::Threadpool *pool,
+                                   TFunction task)
+    -> std::future<std::invoke_result_t<TFunction>> {
+  auto promise =
+      std::make_shared<std::promise<std::invoke_result_t<TFunction>>>();
+  auto future = promise->get_future();
+  pool->push_task(
+      [task = std::move(task), promise, on_done = on_task_done_]() mutable {
+        try {
+          promise->set_value(task());
+        } catch (...) {
+          promise->set_exception(std::current_exception());
+        }
+        if (on_done) {
+          on_done();
+        }
+      });
+  return future;
+}
+
 template <RunTraits run>
 StitcherPipeline<run>::~StitcherPipeline() {
   Cancel();
+  CancelExports();
+  CancelPanoThumbnails();
 }
 
 template <RunTraits run>
@@ -291,14 +1778,30 @@ void StitcherPipeline<run>::Cancel() {
   if (!queue_.empty()) {
     queue_.back().progress->Cancel();
   }
-  pool_.purge();
+  if (speculative_progress_) {
+    speculative_progress_->Cancel();
+  }
+}
+
+template <RunTraits run>
+void StitcherPipeline<run>::CancelExports() {
+  for (auto &queued : export_queue_) {
+    queued.task.progress->Cancel();
+  }
+  export_pool_.purge();
 }
 
 template <RunTraits run>
 void StitcherPipeline<run>::CancelAndWait() {
   Cancel();
+  CancelExports();
+  CancelPanoThumbnails();
   spdlog::info("Waiting for running tasks to finish...");
-  pool_.wait_for_tasks();
+  export_pool_.wait_for_tasks();
+  // The loading tasks hand their work over to pool_
+  io_pool_.wait_for_tasks();
+  pool_->wait_for_tasks();
+  speculative_pool_.wait_for_tasks();
   spdlog::info("Finished");
 }
 
@@ -309,16 +1812,93 @@ auto StitcherPipeline<run>::RunLoading(
     const MatchingOptions &matching_options)
     -> std::conditional_t<run == RunTraits::kReturnFuture,
                           Task<std::future<StitcherData>>, void> {
+  return RunLoadingImages(ToImages(inputs), loading_options, matching_options);
+}
+
+template <RunTraits run>
+auto StitcherPipeline<run>::RunLoadingImages(
+    std::vector<algorithm::Image> inputs,
+    const LoadingOptions &loading_options,
+    const MatchingOptions &matching_options)
+    -> std::conditional_t<run == RunTraits::kReturnFuture,
+                          Task<std::future<StitcherData>>, void> {
+  Cancel();
+  CancelPanoThumbnails();
+  preview_cache_.Clear();
+  auto task = MakeTask<std::future<StitcherData>, run>();
+
+  const algorithm::FeatureCache *cache =
+      (loading_options.use_feature_cache && feature_cache_)
+          ? &*feature_cache_
+          : nullptr;
+  thumbnail_queue_ = std::make_shared<ThumbnailQueue>(on_task_done_);
+  early_panos_ = stream_panos_
+                     ? std::make_shared<EarlyPanoQueue>(on_task_done_)
+                     : nullptr;
+  auto *progress = task.progress.get();
+  auto graph = MakeDataGraph({}, progress, on_task_done_);
+  task.future = graph->GetFuture();
+  // load -> match -> FindPanos, the stages run on the pool as continuations
+  graph->Run(pool_.get(), [this, loading_options, matching_options,
+                           inputs = std::move(inputs), progress, cache,
+                           thumbnail_queue = thumbnail_queue_,
+                           early_panos = early_panos_,
+                           graph = graph.get()]() {
+    LoadImages(
+        inputs, loading_options,
+        /*compute_keypoints=*/matching_options.type == MatchingType::kAuto ||
+            matching_options.type == MatchingType::kGrid,
+        progress, pool_.get(), &io_pool_, cache, thumbnail_queue, graph,
+        [this, matching_options, loading_options, progress, early_panos,
+         graph](std::vector<algorithm::Image> images) {
+          RunMatchingPipeline(std::move(images), matching_options,
+                              loading_options, progress, pool_.get(), graph,
+                              early_panos);
+        });
+  });
+
+  if constexpr (run == RunTraits::kReturnFuture) {
+    return task;
+  } else {
+    queue_.push_back(std::move(task));
+  }
+}
+
+template <RunTraits run>
+auto StitcherPipeline<run>::RunAppending(
+    const StitcherData &data, const std::vector<std::filesystem::path> &inputs,
+    const LoadingOptions &loading_options,
+    const MatchingOptions &matching_options)
+    -> std::conditional_t<run == RunTraits::kReturnFuture,
+                          Task<std::future<StitcherData>>, void> {
   Cancel();
+  CancelPanoThumbnails();
+  preview_cache_.Clear();
   auto task = MakeTask<std::future<StitcherData>, run>();
 
-  task.future = pool_.submit([this, loading_options, matching_options, inputs,
-                              progress = task.progress.get()]() {
-    auto images = RunLoadingPipeline(
+  const algorithm::FeatureCache *cache =
+      (loading_options.use_feature_cache && feature_cache_)
+          ? &*feature_cache_
+          : nullptr;
+  thumbnail_queue_ = std::make_shared<ThumbnailQueue>(on_task_done_);
+  auto *progress = task.progress.get();
+  // A cancelled append leaves the previous data intact
+  auto graph = MakeDataGraph(data, progress, on_task_done_);
+  task.future = graph->GetFuture();
+  graph->Run(pool_.get(), [this, data, loading_options, matching_options,
+                           inputs = ToImages(inputs), progress, cache,
+                           thumbnail_queue = thumbnail_queue_,
+                           graph = graph.get()]() {
+    LoadImages(
         inputs, loading_options,
-        /*compute_keypoints=*/matching_options.type == MatchingType::kAuto,
-        progress, &pool_);
-    return RunMatchingPipeline(images, matching_options, progress, &pool_);
+        /*compute_keypoints=*/matching_options.type == MatchingType::kAuto ||
+            matching_options.type == MatchingType::kGrid,
+        progress, pool_.get(), &io_pool_, cache, thumbnail_queue, graph,
+        [this, data, matching_options, feature = loading_options.feature,
+         progress, graph](std::vector<algorithm::Image> new_images) {
+          RunAppendingPipeline(data, std::move(new_images), matching_options,
+                               feature, progress, pool_.get(), graph);
+        });
   });
 
   if constexpr (run == RunTraits::kReturnFuture) {
@@ -328,19 +1908,151 @@ auto StitcherPipeline<run>::RunLoading(
   }
 }
 
+template <RunTraits run>
+auto StitcherPipeline<run>::RunRegrouping(
+    const StitcherData &data, const MatchingOptions &matching_options)
+    -> std::conditional_t<run == RunTraits::kReturnFuture,
+                          Task<std::future<StitcherData>>, void> {
+  Cancel();
+  CancelPanoThumbnails();
+  preview_cache_.Clear();
+  auto task = MakeTask<std::future<StitcherData>, run>();
+  task.future = Submit(
+      pool_.get(),
+      [data, matching_options, progress = task.progress.get()]() mutable {
+        const auto span = StageSpan(ProgressType::kMatchingImages);
+        progress->Reset(ProgressType::kMatchingImages, 1);
+        RegroupPanos(matching_options, &data);
+        progress->NotifyTaskDone();
+        AccountMemory(data);
+        return data;
+      });
+
+  if constexpr (run == RunTraits::kReturnFuture) {
+    return task;
+  } else {
+    queue_.push_back(std::move(task));
+  }
+}
+
+template <RunTraits run>
+auto StitcherPipeline<run>::RunOpenProject(const std::filesystem::path &path)
+    -> std::conditional_t<run == RunTraits::kReturnFuture,
+                          Task<std::future<StitcherData>>, void> {
+  Cancel();
+  preview_cache_.Clear();
+  auto task = MakeTask<std::future<StitcherData>, run>();
+  task.future =
+      Submit(pool_.get(), [path, progress = task.progress.get()]() {
+        const auto span = StageSpan(ProgressType::kLoadingImages);
+        auto project = LoadProject(path, progress);
+        if (!project) {
+          return StitcherData{};
+        }
+        AccountMemory(project->data);
+        return std::move(project->data);
+      });
+
+  if constexpr (run == RunTraits::kReturnFuture) {
+    return task;
+  } else {
+    queue_.push_back(std::move(task));
+  }
+}
+
 template <RunTraits run>
 auto StitcherPipeline<run>::RunStitching(const StitcherData &data,
                                          const StitchingOptions &options)
     -> std::conditional_t<run == RunTraits::kReturnFuture,
                           Task<std::future<StitchingResult>>, void> {
-  Cancel();
   auto task = MakeTask<std::future<StitchingResult>, run>();
-
   auto pano = data.panos[options.pano_id];
-  task.future = pool_.submit([pano, &images = data.images, options,
-                              progress = task.progress.get(), this]() {
-    return RunStitchingPipeline(pano, images, options, progress, &pool_,
-                                &multiblend_pool_);
+
+  if (options.export_path) {
+    // Copies, the export outlives the next RunLoading / Reset
+    task.future = Submit(
+        &export_pool_,
+        [pano, images = data.images, matches = data.matches, options,
+         progress = task.progress.get(), this]() {
+          auto result = RunStitchingPipeline(
+              pano, images, matches, options, progress, pool_.get(),
+              &full_res_cache_, checkpoint_dir_, spill_);
+          result.ids = pano.ids;
+          return result;
+        });
+    if constexpr (run == RunTraits::kReturnFuture) {
+      return task;
+    } else {
+      export_queue_.push_back({options.pano_id, std::move(task)});
+      return;
+    }
+  }
+
+  Cancel();
+  const bool preview = !options.full_res;
+  std::optional<StitchingResult> cached;
+  if (preview) {
+    cached = preview_cache_.Get(pano, options);
+  }
+  if (cached) {
+    spdlog::info("Reusing the stitched preview of pano {}", options.pano_id);
+    cached->pano_id = options.pano_id;
+    cached->ids = pano.ids;
+    std::promise<StitchingResult> ready;
+    ready.set_value(*std::move(cached));
+    task.future = ready.get_future();
+    if constexpr (run == RunTraits::kReturnFuture) {
+      return task;
+    } else {
+      queue_.push_back(std::move(task));
+      return;
+    }
+  }
+
+  // Fulfilled by the preview task before it starts, the preview task is the
+  // last one queued and so the one cancelled by the next task
+  std::shared_ptr<std::promise<StitchingResult>> coarse;
+  if constexpr (run == RunTraits::kOwnFuture) {
+    if (options.progressive && !options.full_res &&
+        algorithm::CanReuseCameras(pano.cameras, options.stitch_algorithm)) {
+      coarse = std::make_shared<std::promise<StitchingResult>>();
+      auto coarse_task = MakeTask<std::future<StitchingResult>, run>();
+      coarse_task.future = coarse->get_future();
+      queue_.push_back(std::move(coarse_task));
+    }
+  }
+
+  task.future = Submit(pool_.get(), [pano, &images = data.images,
+                                     &matches = data.matches, options, coarse,
+                                     preview,
+                                     generation = preview_cache_.Generation(),
+                                     progress = task.progress.get(), this]() {
+    if (coarse) {
+      if (progress->IsCancelled()) {
+        coarse->set_value({.pano_id = options.pano_id, .coarse = true});
+      } else {
+        try {
+          coarse->set_value(RunCoarseStitchingPipeline(
+              pano, images, options, progress, pool_.get()));
+        } catch (const std::exception &e) {
+          // The preview follows, no need to fail the whole stitching
+          spdlog::warn("Failed to stitch the coarse preview: {}", e.what());
+          coarse->set_value({.pano_id = options.pano_id, .coarse = true});
+        }
+      }
+      if (on_task_done_) {
+        on_task_done_();
+      }
+    }
+    auto result = RunStitchingPipeline(pano, images, matches, options,
+                                       progress, pool_.get(), &full_res_cache_,
+                                       checkpoint_dir_, spill_);
+    result.ids = pano.ids;
+    if (preview && result.pano && !progress->IsCancelled()) {
+      // The pano gets these cameras once the result is shown
+      preview_cache_.Insert(generation, pano, options, result.cameras, result);
+    }
+    return result;
   });
 
   if constexpr (run == RunTraits::kReturnFuture) {
@@ -350,28 +2062,153 @@ auto StitcherPipeline<run>::RunStitching(const StitcherData &data,
   }
 }
 
+template <RunTraits run>
+auto StitcherPipeline<run>::RunSpeculativeStitching(
+    const StitcherData &data, const std::vector<int> &pano_ids,
+    const StitchingOptions &options)
+    -> std::conditional_t<run == RunTraits::kReturnFuture, std::future<void>,
+                          void> {
+  if (speculative_progress_) {
+    speculative_progress_->Cancel();
+  }
+  speculative_progress_ = std::make_shared<ProgressMonitor>();
+
+  // Only the previews are kept
+  auto preview_options = options;
+  preview_options.full_res = false;
+  preview_options.export_path.reset();
+  preview_options.tiled_export = false;
+  preview_options.progressive = false;
+
+  std::vector<algorithm::Pano> panos;
+  for (const int pano_id : pano_ids) {
+    const auto &pano = data.panos[pano_id];
+    if (!pano.cameras && !preview_cache_.Contains(pano, preview_options)) {
+      panos.push_back(pano);
+    }
+  }
+
+  auto future = speculative_pool_.submit(
+      // Owned, the GUI replaces its data while this may still run
+      [panos = std::move(panos),
+       data = std::make_shared<const StitcherData>(data),
+       options = preview_options,
+       generation = preview_cache_.Generation(),
+       progress = speculative_progress_, this]() {
+        for (const auto &pano : panos) {
+          if (progress->IsCancelled()) {
+            return;
+          }
+          auto result = RunStitchingPipeline(
+              pano, data->images, data->matches, options, progress.get(),
+              &speculative_pool_, &full_res_cache_, /*checkpoint_dir=*/{},
+              /*spill=*/{});
+          if (!progress->IsCancelled() && result.pano) {
+            preview_cache_.Insert(generation, pano, options, pano.cameras,
+                                  std::move(result));
+          }
+        }
+      });
+
+  if constexpr (run == RunTraits::kReturnFuture) {
+    return future;
+  }
+}
+
+template <RunTraits run>
+auto StitcherPipeline<run>::RunPanoThumbnails(
+    const StitcherData &data, const std::vector<int> &pano_ids,
+    const StitchingOptions &options)
+    -> std::conditional_t<run == RunTraits::kReturnFuture, std::future<void>,
+                          void> {
+  CancelPanoThumbnails();
+  pano_thumbnails_progress_ = std::make_shared<ProgressMonitor>();
+  pano_thumbnail_queue_ = std::make_shared<PanoThumbnailQueue>(on_task_done_);
+
+  // Only the previews are composed
+  auto preview_options = options;
+  preview_options.full_res = false;
+  preview_options.export_path.reset();
+  preview_options.tiled_export = false;
+  preview_options.progressive = false;
+
+  auto done = std::make_shared<std::promise<void>>();
+  auto future = done->get_future();
+  StitchPanoThumbnail(std::make_shared<const StitcherData>(data),
+                      std::make_shared<const std::vector<int>>(pano_ids), 0,
+                      preview_options, pano_thumbnails_progress_,
+                      pano_thumbnail_queue_, std::move(done));
+
+  if constexpr (run == RunTraits::kReturnFuture) {
+    return future;
+  }
+}
+
+template <RunTraits run>
+void StitcherPipeline<run>::StitchPanoThumbnail(
+    std::shared_ptr<const StitcherData> data,
+    std::shared_ptr<const std::vector<int>> pano_ids, int index,
+    const StitchingOptions &options, std::shared_ptr<ProgressMonitor> progress,
+    std::shared_ptr<PanoThumbnailQueue> queue,
+    std::shared_ptr<std::promise<void>> done) {
+  if (index == static_cast<int>(pano_ids->size()) || progress->IsCancelled()) {
+    done->set_value();
+    return;
+  }
+  speculative_pool_.push_task([data = std::move(data),
+                               pano_ids = std::move(pano_ids), index, options,
+                               progress = std::move(progress),
+                               queue = std::move(queue),
+                               done = std::move(done), this]() mutable {
+    const int pano_id = (*pano_ids)[index];
+    try {
+      auto thumbnail = RunPanoThumbnailPipeline(
+          pano_id, data->panos[pano_id], data->images, data->matches,
+          options, progress.get(), &speculative_pool_);
+      if (thumbnail && !progress->IsCancelled()) {
+        queue->Push(*std::move(thumbnail));
+      }
+    } catch (const std::exception &e) {
+      spdlog::warn("Failed to stitch the mini pano {}: {}", pano_id + 1,
+                   e.what());
+    }
+    StitchPanoThumbnail(std::move(data), std::move(pano_ids), index + 1,
+                        options, std::move(progress), std::move(queue),
+                        std::move(done));
+  });
+}
+
+template <RunTraits run>
+void StitcherPipeline<run>::CancelPanoThumbnails() {
+  if (pano_thumbnails_progress_) {
+    pano_thumbnails_progress_->Cancel();
+  }
+}
+
 template <RunTraits run>
 auto StitcherPipeline<run>::RunExport(cv::Mat pano,
                                       const ExportOptions &options)
     -> std::conditional_t<run == RunTraits::kReturnFuture,
                           Task<std::future<ExportResult>>, void> {
-  Cancel();
   auto task = MakeTask<std::future<ExportResult>, run>();
 
-  task.future = pool_.submit(
-      [pano = std::move(pano), options, progress = task.progress.get()]() {
-        return RunExportPipeline(pano, options, progress);
+  task.future = Submit(
+      &export_pool_,
+      [pano = std::move(pano), options, progress = task.progress.get(),
+       this]() {
+        return RunExportPipeline(pano, options, progress, pool_.get());
       });
 
   if constexpr (run == RunTraits::kReturnFuture) {
     return task;
   } else {
-    queue_.push_back(std::move(task));
+    export_queue_.push_back({options.pano_id, std::move(task)});
   }
 }
 
 template <RunTraits run>
-auto StitcherPipeline<run>::RunInpainting(cv::Mat pano, cv::Mat pano_mask,
+auto StitcherPipeline<run>::RunInpainting(cv::Mat pano,
+                                          algorithm::RleMask pano_mask,
                                           const InpaintingOptions &options)
     -> std::conditional_t<run == RunTraits::kReturnFuture,
                           Task<std::future<InpaintingResult>>, void> {
@@ -379,17 +2216,20 @@ auto StitcherPipeline<run>::RunInpainting(cv::Mat pano, cv::Mat pano_mask,
   auto task = MakeTask<std::future<InpaintingResult>, run>();
 
   task.future =
-      pool_.submit([pano = std::move(pano), pano_mask = std::move(pano_mask),
-                    options, progress = task.progress.get()]() {
+      Submit(pool_.get(), [pano = std::move(pano),
+                           pano_mask = std::move(pano_mask), options,
+                           progress = task.progress.get(),
+                           pool = pool_.get()]() {
+        const auto span = StageSpan(ProgressType::kInpainting);
         const int num_tasks = 3;
         progress->Reset(ProgressType::kInpainting, num_tasks);
 
-        cv::Mat inpaint_mask;
-        cv::bitwise_not(pano_mask, inpaint_mask);
+        auto inpaint_mask = pano_mask.DecodeUnset();
         progress->NotifyTaskDone();
-        const int pixels_filled = cv::countNonZero(inpaint_mask);
+        const auto pixels_filled = static_cast<int>(
+            pano_mask.Size().area() - pano_mask.CountSet());
         progress->NotifyTaskDone();
-        auto result = algorithm::Inpaint(pano, inpaint_mask, options);
+        auto result = algorithm::Inpaint(pano, inpaint_mask, options, pool);
         progress->NotifyTaskDone();
 
         return InpaintingResult{result, pixels_filled};
@@ -410,6 +2250,79 @@ ProgressReport StitcherPipeline<run>::Progress() const {
   return queue_.back().progress->Report();
 }
 
+template <RunTraits run>
+std::vector<ExportProgress> StitcherPipeline<run>::GetExportProgress() const {
+  std::vector<ExportProgress> result;
+  for (const auto &queued : export_queue_) {
+    auto report = queued.task.progress->Report();
+    if (report.num_tasks == 0 || report.tasks_done < report.num_tasks) {
+      result.push_back({queued.pano_id, report});
+    }
+  }
+  return result;
+}
+
+template <RunTraits run>
+std::vector<LoadedThumbnail> StitcherPipeline<run>::PopLoadedThumbnails() {
+  if (!thumbnail_queue_) {
+    return {};
+  }
+  return thumbnail_queue_->PopAll();
+}
+
+template <RunTraits run>
+std::vector<StitcherData> StitcherPipeline<run>::PopEarlyPanos() {
+  if (!early_panos_) {
+    return {};
+  }
+  return early_panos_->PopAll();
+}
+
+template <RunTraits run>
+std::vector<PanoThumbnail> StitcherPipeline<run>::PopPanoThumbnails() {
+  if (!pano_thumbnail_queue_) {
+    return {};
+  }
+  return pano_thumbnail_queue_->PopAll();
+}
+
+template <RunTraits run>
+FullResCacheStats StitcherPipeline<run>::GetFullResCacheStats() const {
+  return full_res_cache_.Stats();
+}
+
+template <RunTraits run>
+std::optional<algorithm::FeatureCacheStats>
+StitcherPipeline<run>::GetFeatureCacheStats() const {
+  if (!feature_cache_) {
+    return {};
+  }
+  return feature_cache_->Stats();
+}
+
+template <RunTraits run>
+PreviewCacheStats StitcherPipeline<run>::GetPreviewCacheStats() const {
+  return preview_cache_.Stats();
+}
+
+template <RunTraits run>
+std::vector<PoolStats> StitcherPipeline<run>::GetPoolStats() const {
+  auto stats = [](const char *name, const utils::mt::Threadpool &pool) {
+    return PoolStats{.name = name,
+                     .threads = static_cast<int>(pool.get_thread_count()),
+                     .queued = static_cast<int>(pool.get_tasks_queued()),
+                     .running = static_cast<int>(pool.get_tasks_running())};
+  };
+  return {stats("Tasks", *pool_.get()), stats("Loading I/O", io_pool_),
+          stats("Speculative", speculative_pool_),
+          stats("Exports", export_pool_)};
+}
+
+template <RunTraits run>
+void StitcherPipeline<run>::ClearPreviewCache() {
+  preview_cache_.Clear();
+}
+
 template <RunTraits run>
 auto StitcherPipeline<run>::GetReadyTask()
     -> std::optional<Task<GenericFuture>> {
@@ -431,9 +2344,27 @@ auto StitcherPipeline<run>::GetReadyTask()
     return task;
   }
 
+  auto ready_export = std::find_if(
+      export_queue_.begin(), export_queue_.end(), [](const auto &queued) {
+        return std::visit(
+            [](const auto &future) { return utils::future::IsReady(future); },
+            queued.task.future);
+      });
+
+  if (ready_export != export_queue_.end()) {
+    auto task = std::move(ready_export->task);
+    export_queue_.erase(ready_export);
+    return task;
+  }
+
   return {};
 }
 
+template <RunTraits run>
+bool StitcherPipeline<run>::IsIdle() const {
+  return queue_.empty() && export_queue_.empty();
+}
+
 template class StitcherPipeline<RunTraits::kOwnFuture>;
 template class StitcherPipeline<RunTraits::kReturnFuture>;
 
@@ -5,22 +5,31 @@
 #pragma once
 
 #include <algorithm>
+#include <cstddef>
 #include <deque>
 #include <filesystem>
+#include <functional>
 #include <future>
+#include <list>
 #include <memory>
+#include <mutex>
 #include <optional>
 #include <thread>
 #include <type_traits>
+#include <utility>
 #include <variant>
 #include <vector>
 
 #include <opencv2/core.hpp>
 
 #include "xpano/algorithm/algorithm.h"
+#include "xpano/algorithm/feature_cache.h"
 #include "xpano/algorithm/image.h"
 #include "xpano/algorithm/progress.h"
+#include "xpano/algorithm/spill_store.h"
 #include "xpano/algorithm/stitcher.h"
+#include "xpano/constants.h"
+#include "xpano/pipeline/full_res_cache.h"
 #include "xpano/pipeline/options.h"
 #include "xpano/utils/rect.h"
 #include "xpano/utils/threadpool.h"
@@ -35,16 +44,38 @@ struct StitchingOptions {
   MetadataOptions metadata;
   CompressionOptions compression;
   StitchAlgorithmOptions stitch_algorithm;
+  // Pairs below the threshold are not matched again, see MatchingMask
+  int match_threshold = kDefaultMatchThreshold;
+  // Capture grid of MatchingType::kGrid, replaces the matching mask and seeds
+  // the cameras, see algorithm::GridCells
+  std::optional<algorithm::GridOptions> grid;
+  // Composes the pano in tiles streamed to export_path as a tiled BigTIFF,
+  // the pano isn't returned, nor auto cropped
+  bool tiled_export = false;
+  // Publishes a low resolution pano before the preview when the cameras can
+  // be reused, see StitcherPipeline::RunStitching
+  bool progressive = false;
+  // Tiled export composed by several processes sharing the checkpoint
+  // directory, this one composes only a band of the tiles, see ShardWriter
+  std::optional<ShardOptions> shard;
+  // Longer side of the display copy of a device resident pano, see
+  // StitchingResult::display
+  int display_longer_side = 0;
 };
 
 struct ExportOptions {
   int pano_id = 0;
+  // Of the pano, returned in the result, see StitchingResult::ids
+  std::vector<int> ids;
   std::filesystem::path export_path;
   std::optional<std::filesystem::path> metadata_path;
   CompressionOptions compression;
   std::optional<utils::RectRRf> crop;
 };
 
+// Of cv::imwrite / cv::imencode, for every supported format
+std::vector<int> CompressionParameters(const CompressionOptions &options);
+
 struct StitcherData {
   std::vector<algorithm::Image> images;
   std::vector<algorithm::Match> matches;
@@ -60,20 +91,190 @@ using Cameras = algorithm::Cameras;
 
 struct StitchingResult {
   int pano_id = 0;
+  // Image ids of the stitched pano, the pano id may name another pano once
+  // the panos were regrouped. Not set for the coarse stage.
+  std::vector<int> ids;
   bool full_res = false;
+  // First stage of a progressive preview, only the pano is set
+  bool coarse = false;
+  // The pano and mask are only the export crop, see StitchOptions::compose_crop
+  bool cropped = false;
   algorithm::stitcher::Status status;
   std::optional<cv::Mat> pano;
   std::optional<utils::RectRRf> auto_crop;
   std::optional<std::filesystem::path> export_path;
-  std::optional<cv::Mat> mask;
+  std::optional<algorithm::RleMask> mask;
   std::optional<Cameras> cameras;
+  std::shared_ptr<const algorithm::StitchSession> session;
+  // Downscaled on the OpenCL device with StitchUserOptions::device_resident,
+  // the pano is then only downloaded once for the export and the tiles
+  std::optional<cv::Mat> display;
 };
 
 struct ExportResult {
   int pano_id = 0;
+  std::vector<int> ids;
   std::optional<std::filesystem::path> export_path;
 };
 
+struct ExportProgress {
+  int pano_id;
+  algorithm::ProgressReport report;
+};
+
+struct StitcherPipelineOptions {
+  std::optional<std::filesystem::path> feature_cache_dir;
+  // Full resolution stitches resume after the last completed stage of an
+  // earlier run with the same inputs, see Checkpoint
+  std::optional<std::filesystem::path> checkpoint_dir;
+  // Full resolution stitches with multiblend keep the warped images over
+  // spill_threshold_bytes in scratch files there, see algorithm::SpillStore
+  std::optional<std::filesystem::path> spill_dir;
+  std::size_t spill_threshold_bytes =
+      static_cast<std::size_t>(kDefaultSpillThresholdMB) * kMegabyte;
+  // Decoded full resolution frames are also kept there for the session and
+  // mapped by later stitches, see MappedFrameStore
+  std::optional<std::filesystem::path> mapped_frames_dir;
+  std::size_t full_res_cache_bytes =
+      static_cast<std::size_t>(kDefaultFullResCacheMB) * kMegabyte;
+  std::size_t preview_cache_bytes =
+      static_cast<std::size_t>(kDefaultPreviewCacheMB) * kMegabyte;
+  // Process wide, the compressed image previews decoded on demand, see
+  // LoadingOptions::compress_previews
+  std::size_t decoded_preview_cache_bytes =
+      static_cast<std::size_t>(kDefaultDecodedPreviewCacheMB) * kMegabyte;
+  int max_concurrent_exports = kDefaultConcurrentExports;
+  // Runs the tasks on a pool shared with others instead of an own one, e.g.
+  // utils::mt::SharedPool which also runs the parallel OpenCV loops
+  std::shared_ptr<utils::mt::Threadpool> pool;
+  // RunLoading publishes the panos complete before the matching of the other
+  // pairs ends, see PopEarlyPanos
+  bool stream_panos = false;
+  // Called from the worker threads whenever a task is ready or a thumbnail
+  // was loaded, e.g. to wake up the GUI waiting for events instead of
+  // polling GetReadyTask() continuously
+  std::function<void()> on_task_done;
+};
+
+// Published by RunLoading as soon as an image is loaded, before matching
+struct LoadedThumbnail {
+  int input_id;
+  cv::Mat thumbnail;
+  float aspect;
+};
+
+// Mini pano of RunPanoThumbnails, with the cameras it estimated
+struct PanoThumbnail {
+  int pano_id;
+  std::vector<int> ids;
+  cv::Mat thumbnail;
+  // Empty if the pano already had reusable cameras
+  std::optional<Cameras> cameras;
+};
+
+// Results published by the worker threads one by one, popped all at once by
+// the thread owning the pipeline
+template <typename TValue>
+class PublishQueue {
+ public:
+  explicit PublishQueue(std::function<void()> on_push = {})
+      : on_push_(std::move(on_push)) {}
+
+  void Push(TValue value) {
+    {
+      const std::lock_guard lock(mutex_);
+      values_.push_back(std::move(value));
+    }
+    if (on_push_) {
+      on_push_();
+    }
+  }
+
+  std::vector<TValue> PopAll() {
+    const std::lock_guard lock(mutex_);
+    return std::exchange(values_, {});
+  }
+
+ private:
+  std::function<void()> on_push_;
+  std::mutex mutex_;
+  std::vector<TValue> values_;
+};
+
+using ThumbnailQueue = PublishQueue<LoadedThumbnail>;
+// Published by RunLoading with StitcherPipelineOptions::stream_panos, each
+// entry holds one pano and its matches
+using EarlyPanoQueue = PublishQueue<StitcherData>;
+using PanoThumbnailQueue = PublishQueue<PanoThumbnail>;
+
+struct PreviewCacheStats {
+  int hits = 0;
+  int misses = 0;
+  std::size_t bytes_used = 0;
+};
+
+// Thread safe LRU of the stitched previews, the viewed and the speculatively
+// stitched ones.
+//  - Keyed by the pano image ids, the options affecting the preview and the
+//    cameras the pano has when it is requested. The viewed results are keyed
+//    by their own cameras, which the pano gets once they are shown.
+//  - Least recently used results are evicted once the pano and mask bytes
+//    exceed the budget.
+//  - Clear() also drops the results of the tasks started before it, see
+//    Generation().
+//  - The results share the cached buffers, don't modify them in place.
+class StitchingResultCache {
+ public:
+  explicit StitchingResultCache(std::size_t budget_bytes)
+      : budget_bytes_(budget_bytes) {}
+
+  [[nodiscard]] int Generation() const;
+  void Insert(int generation, const algorithm::Pano &pano,
+              const StitchingOptions &options,
+              const std::optional<Cameras> &cameras, StitchingResult result);
+  [[nodiscard]] bool Contains(const algorithm::Pano &pano,
+                              const StitchingOptions &options) const;
+  // The result is then keyed by its own cameras
+  std::optional<StitchingResult> Get(const algorithm::Pano &pano,
+                                     const StitchingOptions &options);
+  [[nodiscard]] PreviewCacheStats Stats() const;
+  void Clear();
+
+ private:
+  struct Entry {
+    std::vector<int> ids;
+    StitchAlgorithmOptions stitch_algorithm;
+    int match_threshold;
+    std::optional<Cameras> cameras;
+    StitchingResult result;
+    std::size_t bytes;
+  };
+
+  static bool Matches(const Entry &entry, const std::vector<int> &ids,
+                      const StitchingOptions &options,
+                      const std::optional<Cameras> &cameras);
+  std::list<Entry>::iterator Find(const std::vector<int> &ids,
+                                  const StitchingOptions &options,
+                                  const std::optional<Cameras> &cameras);
+  void Erase(std::list<Entry>::iterator entry);
+
+  std::size_t budget_bytes_;
+
+  mutable std::mutex mutex_;
+  std::list<Entry> entries_;
+  std::size_t bytes_used_ = 0;
+  int hits_ = 0;
+  int misses_ = 0;
+  int generation_ = 0;
+};
+
+struct PoolStats {
+  const char *name;
+  int threads;
+  int queued;
+  int running;
+};
+
 using ProgressMonitor = algorithm::ProgressMonitor;
 using ProgressReport = algorithm::ProgressReport;
 using ProgressType = algorithm::ProgressType;
@@ -98,10 +299,40 @@ using GenericFuture =
 // Whenever a new task is queued, the previous task is cancelled. The queue
 // serves the purpose of holding on to the resources of the cancelled tasks
 // until they are finished and can be safely deleted.
+//
+// The ProgressMonitor of each task is its cancellation token. Cancelling a
+// task doesn't purge the pools, which may hold the work of other tasks
+// (speculative stitching, exports, OpenCV loops), the queued subtasks of the
+// cancelled task check the token and skip their work instead.
+//
+// Exports (RunExport and RunStitching with an export path) are the exception,
+// they go to a separate queue, run on their own pool up to
+// max_concurrent_exports at a time and are only cancelled by CancelAndWait.
+// They own copies of their inputs and use pool_ for the subtasks.
+//
+// Each class of tasks has its own thread cap: the interactive tasks and the
+// subtasks of the exports run on pool_, the exports themselves on up to
+// max_concurrent_exports threads and the speculative stitching on
+// kSpeculativeThreads threads only, so the background work can't take over
+// pool_. The parallel OpenCV loops of the app run on the idle threads of the
+// same pool when it is shared, see StitcherPipelineOptions::pool.
+//
+// Loading and appending are chains of stages (load -> match -> FindPanos)
+// linked by continuations, see utils::mt::TaskGraph, so no thread of pool_
+// waits for the others. The stitching task loads the full resolution images
+// on its own thread together with the idle ones.
+//
+// If constructed with a feature cache directory, RunLoading reuses previously
+// computed previews / keypoints when LoadingOptions::use_feature_cache is set.
+// Full resolution frames are kept in a memory bounded LRU cache, so that
+// repeated full resolution stitching / exports don't decode them again.
+// Likewise the stitched previews, showing a pano again with the same cameras
+// and options returns an already ready task.
 template <RunTraits run = RunTraits::kOwnFuture>
 class StitcherPipeline {
  public:
-  StitcherPipeline() = default;
+  StitcherPipeline() : StitcherPipeline(StitcherPipelineOptions{}) {}
+  explicit StitcherPipeline(const StitcherPipelineOptions &options);
   ~StitcherPipeline();
 
   // reason: some tasks use pointers to members
@@ -115,40 +346,169 @@ class StitcherPipeline {
                   const MatchingOptions &matching_options)
       -> std::conditional_t<run == RunTraits::kReturnFuture,
                             Task<std::future<StitcherData>>, void>;
+  // Not yet loaded images, e.g. the in-memory ones read from stdin
+  auto RunLoadingImages(std::vector<algorithm::Image> inputs,
+                        const LoadingOptions &loading_options,
+                        const MatchingOptions &matching_options)
+      -> std::conditional_t<run == RunTraits::kReturnFuture,
+                            Task<std::future<StitcherData>>, void>;
+
+  // Loads only the new inputs and matches them against the images in data,
+  // the panos which didn't change keep their state (cameras, crop, ...).
+  auto RunAppending(const StitcherData &data,
+                    const std::vector<std::filesystem::path> &inputs,
+                    const LoadingOptions &loading_options,
+                    const MatchingOptions &matching_options)
+      -> std::conditional_t<run == RunTraits::kReturnFuture,
+                            Task<std::future<StitcherData>>, void>;
+
+  // Regroups the images into panos with the thresholds and match_conf of
+  // matching_options, without loading or matching them again, see
+  // algorithm::Rematch. The panos which didn't change keep their state.
+  auto RunRegrouping(const StitcherData &data,
+                     const MatchingOptions &matching_options)
+      -> std::conditional_t<run == RunTraits::kReturnFuture,
+                            Task<std::future<StitcherData>>, void>;
 
+  // Restores the data of a project saved by SaveProject, see project.h. An
+  // unreadable project gives empty data.
+  auto RunOpenProject(const std::filesystem::path &path)
+      -> std::conditional_t<run == RunTraits::kReturnFuture,
+                            Task<std::future<StitcherData>>, void>;
+
+  // With StitchingOptions::progressive and RunTraits::kOwnFuture, two results
+  // are queued: a coarse pano from kProgressivePreviewLongerSide inputs and
+  // the cached cameras, then the preview. The coarse one is always ready
+  // first, GetReadyTask returns it first.
   auto RunStitching(const StitcherData &data, const StitchingOptions &options)
       -> std::conditional_t<run == RunTraits::kReturnFuture,
                             Task<std::future<StitchingResult>>, void>;
 
+  // Stitches the previews of the panos without cameras one after another on a
+  // separate pool, the results are kept for RunStitching. Never competes with
+  // the other tasks: cancelled by any of them and also by the next call.
+  auto RunSpeculativeStitching(const StitcherData &data,
+                               const std::vector<int> &pano_ids,
+                               const StitchingOptions &options)
+      -> std::conditional_t<run == RunTraits::kReturnFuture,
+                            std::future<void>, void>;
+
+  // Stitches mini panos of the panos one after another on the speculative
+  // pool, see PopPanoThumbnails. The panos without cameras get them estimated
+  // on the previews first, as by the preview, the mini pano is then composed
+  // as the coarse progressive preview. Works on a copy of the data, cancelled
+  // only by the next call and by the tasks replacing the data (loading,
+  // appending, regrouping).
+  auto RunPanoThumbnails(const StitcherData &data,
+                         const std::vector<int> &pano_ids,
+                         const StitchingOptions &options)
+      -> std::conditional_t<run == RunTraits::kReturnFuture,
+                            std::future<void>, void>;
+
   auto RunExport(cv::Mat pano, const ExportOptions &options)
       -> std::conditional_t<run == RunTraits::kReturnFuture,
                             Task<std::future<ExportResult>>, void>;
 
-  auto RunInpainting(cv::Mat pano, cv::Mat mask,
+  auto RunInpainting(cv::Mat pano, algorithm::RleMask mask,
                      const InpaintingOptions &options)
       -> std::conditional_t<run == RunTraits::kReturnFuture,
                             Task<std::future<InpaintingResult>>, void>;
 
   ProgressReport Progress() const;
 
+  // Of the queued exports which aren't finished yet, oldest first
+  std::vector<ExportProgress> GetExportProgress() const;
+
+  // Thumbnails of the images loaded so far by the last RunLoading call,
+  // each thumbnail is returned only once.
+  std::vector<LoadedThumbnail> PopLoadedThumbnails();
+
+  // With StitcherPipelineOptions::stream_panos, the panos of the last
+  // RunLoading call which no pending match can change anymore, found while
+  // the other pairs are still matched, see algorithm::PanoStream. Only with
+  // MatchPairs, not with the adaptive neighborhood or coarse to fine
+  // matching. Each one is returned only once, the result of the loading
+  // lists them too.
+  std::vector<StitcherData> PopEarlyPanos();
+
+  // Mini panos of the last RunPanoThumbnails call stitched so far, each one
+  // is returned only once
+  std::vector<PanoThumbnail> PopPanoThumbnails();
+
+  [[nodiscard]] FullResCacheStats GetFullResCacheStats() const;
+  // Empty without a feature cache directory
+  [[nodiscard]] std::optional<algorithm::FeatureCacheStats>
+  GetFeatureCacheStats() const;
+  [[nodiscard]] PreviewCacheStats GetPreviewCacheStats() const;
+  [[nodiscard]] std::vector<PoolStats> GetPoolStats() const;
+
+  // Call when the stitching options change, the stored previews are then
+  // unlikely to be shown again
+  void ClearPreviewCache();
+
   auto GetReadyTask() -> std::optional<Task<GenericFuture>>;
 
+  // No queued tasks (the speculative stitching doesn't count)
+  [[nodiscard]] bool IsIdle() const;
+
+  // Cancels the last queued task and the speculative stitching, the other
+  // work on the pools (e.g. the exports) keeps running
   void Cancel();
 
+  // Cancels everything including the exports and waits for the tasks
   void CancelAndWait();
 
  private:
-  utils::mt::Threadpool pool_ = {
-      std::max(2U, std::thread::hardware_concurrency())};
+  // Declared before the threadpools, which must be destroyed first
+  std::optional<algorithm::FeatureCache> feature_cache_;
+  FullResCache full_res_cache_;
+  StitchingResultCache preview_cache_;
+  std::optional<std::filesystem::path> checkpoint_dir_;
+  std::optional<algorithm::SpillOptions> spill_;
+
+  // pool->submit(), calls on_task_done_ once the future is ready
+  template <typename TFunction>
+  auto Submit(utils::mt::Threadpool *pool, TFunction task)
+      -> std::future<std::invoke_result_t<TFunction>>;
+
+  // The mini pano of pano_ids[index], then the next one, see
+  // RunPanoThumbnails. One at a time, so that the speculative stitching
+  // queued meanwhile doesn't wait for all of them.
+  void StitchPanoThumbnail(std::shared_ptr<const StitcherData> data,
+                           std::shared_ptr<const std::vector<int>> pano_ids,
+                           int index, const StitchingOptions &options,
+                           std::shared_ptr<ProgressMonitor> progress,
+                           std::shared_ptr<PanoThumbnailQueue> queue,
+                           std::shared_ptr<std::promise<void>> done);
+  void CancelPanoThumbnails();
 
-  // Use a separate threadpool for multiblend.
-  // Reason: multiblend doesn't allow cancelling tasks (calling pool_.purge())
-  // without either a deadlock or undefined behavior. Primary reason is that it
-  // passes many arguments to its subtasks by reference.
-  utils::mt::Threadpool multiblend_pool_ = {
-      std::max(2U, std::thread::hardware_concurrency() - 1)};
+  std::function<void()> on_task_done_;
+  utils::mt::SharedThreadpool pool_;
+
+  // Reads input files during loading, tasks submit follow-up work to pool_,
+  // so it needs to be declared (destroyed) after it.
+  utils::mt::Threadpool io_pool_ = {kLoadingIoThreads};
 
   std::deque<Task<GenericFuture>> queue_;
+  std::shared_ptr<ThumbnailQueue> thumbnail_queue_;
+  bool stream_panos_;
+  std::shared_ptr<EarlyPanoQueue> early_panos_;
+
+  std::shared_ptr<ProgressMonitor> speculative_progress_;
+  std::shared_ptr<ProgressMonitor> pano_thumbnails_progress_;
+  std::shared_ptr<PanoThumbnailQueue> pano_thumbnail_queue_;
+  // The speculative tasks and the mini panos use the members above
+  utils::mt::Threadpool speculative_pool_ = {kSpeculativeThreads};
+
+  struct QueuedExport {
+    int pano_id;
+    Task<GenericFuture> task;
+  };
+  void CancelExports();
+
+  std::deque<QueuedExport> export_queue_;
+  // Declared last, the exports use the members above
+  utils::mt::Threadpool export_pool_;
 };
 
 }  // namespace xpano::pipeline
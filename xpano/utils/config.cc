@@ -22,6 +22,7 @@ Config Load(std::optional<std::filesystem::path> app_data_path) {
   }
 
   Config config;
+  config.feature_cache_path = *app_data_path / kFeatureCacheDirname;
   auto [app_state_status, app_state] =
       utils::serialize::DeserializeWithVersion<AppState>(*app_data_path /
                                                          kAppConfigFilename);
@@ -27,6 +27,7 @@ struct Config {
   AppState app_state;
   LoadingStatus user_options_status;
   pipeline::Options user_options;
+  std::optional<std::filesystem::path> feature_cache_path;
 };
 
 Config Load(std::optional<std::filesystem::path> app_data_path);
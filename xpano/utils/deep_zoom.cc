@@ -0,0 +1,188 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/deep_zoom.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+#include <spdlog/spdlog.h>
+
+#include "xpano/utils/threadpool.h"
+
+namespace xpano::utils::deep_zoom {
+
+namespace {
+
+constexpr char kTileFormat[] = "jpg";
+
+}  // namespace
+
+std::filesystem::path FilesDir(const std::filesystem::path& path) {
+  auto dir = path;
+  dir.replace_extension();
+  dir += "_files";
+  return dir;
+}
+
+PyramidWriter::PyramidWriter(const std::filesystem::path& path, cv::Size size,
+                             int block_size, int tile_size,
+                             std::vector<int> params, mt::Threadpool* threads)
+    : path_(path),
+      block_size_(block_size),
+      tile_size_(tile_size),
+      params_(std::move(params)),
+      threads_(threads) {
+  CV_Assert(tile_size_ > 0 && block_size_ % tile_size_ == 0 &&
+            block_size_ % 2 == 0);
+  levels_.push_back({.size = size});
+  while (size.width > 1 || size.height > 1) {
+    size = {(size.width + 1) / 2, (size.height + 1) / 2};
+    levels_.push_back({.size = size});
+  }
+
+  // The Deep Zoom levels count from the single pixel up
+  const auto files_dir = FilesDir(path_);
+  const int num_levels = static_cast<int>(levels_.size());
+  for (int level = 0; level < num_levels; level++) {
+    levels_[level].dir = files_dir / std::to_string(num_levels - 1 - level);
+    std::error_code error;
+    std::filesystem::create_directories(levels_[level].dir, error);
+    if (error) {
+      spdlog::error("Failed to create {}: {}", levels_[level].dir.string(),
+                    error.message());
+      failed_ = true;
+      return;
+    }
+  }
+}
+
+PyramidWriter::~PyramidWriter() { writes_.wait(); }
+
+bool PyramidWriter::IsOpen() const { return !failed_; }
+
+int PyramidWriter::BlocksAcross(int level) const {
+  return (levels_[level].size.width + block_size_ - 1) / block_size_;
+}
+
+int PyramidWriter::BlocksDown(int level) const {
+  return (levels_[level].size.height + block_size_ - 1) / block_size_;
+}
+
+bool PyramidWriter::WriteTile(cv::Point block_tl, const cv::Mat& image,
+                              const cv::Mat& mask) {
+  CV_Assert(image.type() == CV_8UC3 && mask.type() == CV_8U &&
+            image.size() == mask.size());
+  CV_Assert(block_tl.x % block_size_ == 0 && block_tl.y % block_size_ == 0);
+  if (!IsOpen()) {
+    return false;
+  }
+
+  cv::Mat block = cv::Mat::zeros(block_size_, block_size_, CV_8UC3);
+  const cv::Rect valid(0, 0, std::min(image.cols, block_size_),
+                       std::min(image.rows, block_size_));
+  image(valid).copyTo(block(valid), mask(valid));
+  WriteBlock(0, block_tl.y / block_size_, block_tl.x / block_size_, block);
+  return IsOpen();
+}
+
+void PyramidWriter::WriteBlock(int level, int block_row, int block_col,
+                               const cv::Mat& block) {
+  const cv::Point block_tl(block_col * block_size_, block_row * block_size_);
+  const cv::Rect level_rect(cv::Point(0, 0), levels_[level].size);
+  const cv::Rect valid =
+      (cv::Rect(block_tl, block.size()) & level_rect) - block_tl;
+
+  for (int y = 0; y < valid.height; y += tile_size_) {
+    for (int x = 0; x < valid.width; x += tile_size_) {
+      const cv::Mat tile =
+          block(cv::Rect(x, y, tile_size_, tile_size_) & valid);
+      const auto tile_path =
+          levels_[level].dir /
+          fmt::format("{}_{}.{}", (block_tl.x + x) / tile_size_,
+                      (block_tl.y + y) / tile_size_, kTileFormat);
+      // The tile shares the block data, the block isn't modified anymore
+      auto write = [this, tile, tile_path]() {
+        return cv::imwrite(tile_path.string(), tile, params_);
+      };
+      if (threads_ == nullptr) {
+        failed_ |= !write();
+      } else {
+        writes_.push_back(threads_->submit(write));
+      }
+    }
+  }
+  AddToNextLevel(level, block_row, block_col, block(valid));
+}
+
+void PyramidWriter::AddToNextLevel(int level, int block_row, int block_col,
+                                   const cv::Mat& block) {
+  if (level + 1 >= levels_.size()) {
+    return;
+  }
+  const int next_row = block_row / 2;
+  const int next_col = block_col / 2;
+  const int next_index = next_row * BlocksAcross(level + 1) + next_col;
+  auto& pending = levels_[level + 1].pending[next_index];
+  if (pending.block.empty()) {
+    pending.block = cv::Mat::zeros(block_size_, block_size_, CV_8UC3);
+  }
+  const int half = block_size_ / 2;
+  cv::Mat quadrant =
+      pending.block(cv::Rect((block_col % 2) * half, (block_row % 2) * half,
+                             (block.cols + 1) / 2, (block.rows + 1) / 2));
+  cv::resize(block, quadrant, quadrant.size(), 0.0, 0.0, cv::INTER_AREA);
+
+  // The blocks above, fewer on the right / bottom border
+  const int num_children =
+      std::min(2, BlocksAcross(level) - 2 * next_col) *
+      std::min(2, BlocksDown(level) - 2 * next_row);
+  if (++pending.num_children < num_children) {
+    return;
+  }
+  const cv::Mat next_block = pending.block;
+  levels_[level + 1].pending.erase(next_index);
+  WriteBlock(level + 1, next_row, next_col, next_block);
+}
+
+bool PyramidWriter::Close() {
+  // Blocks below the blocks that were never written
+  for (int level = 1; level < levels_.size(); level++) {
+    auto& pending = levels_[level].pending;
+    while (!pending.empty()) {
+      auto node = pending.extract(pending.begin());
+      WriteBlock(level, node.key() / BlocksAcross(level),
+                 node.key() % BlocksAcross(level), node.mapped().block);
+    }
+  }
+
+  writes_.wait();
+  for (const bool written : writes_.get()) {
+    failed_ |= !written;
+  }
+  if (failed_) {
+    return false;
+  }
+
+  std::ofstream stream(path_, std::ios::trunc);
+  stream << fmt::format(
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+      "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\"\n"
+      "  Format=\"{}\" Overlap=\"0\" TileSize=\"{}\">\n"
+      "  <Size Width=\"{}\" Height=\"{}\"/>\n"
+      "</Image>\n",
+      kTileFormat, tile_size_, levels_[0].size.width, levels_[0].size.height);
+  stream.close();
+  failed_ = !stream;
+  return !failed_;
+}
+
+}  // namespace xpano::utils::deep_zoom
@@ -0,0 +1,82 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <filesystem>
+#include <map>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/utils/threadpool.h"
+
+namespace xpano::utils::deep_zoom {
+
+// Tile directory next to the .dzi descriptor
+std::filesystem::path FilesDir(const std::filesystem::path& path);
+
+// Streaming writer of Deep Zoom (DZI) tile pyramids for web viewers:
+//  - <name>.dzi descriptor, <name>_files/<level>/<col>_<row>.jpg tiles.
+//    Level 0 is a single pixel, the last level is the full image.
+//  - The image comes in blocks which can be written in any order. A block of
+//    the next level is downsampled as soon as the blocks above it are
+//    complete, only the incomplete ones are kept in memory.
+//  - The tiles are encoded and written on the thread pool.
+class PyramidWriter {
+ public:
+  // block_size has to be a multiple of tile_size, params are the cv::imwrite
+  // params of the tiles
+  PyramidWriter(const std::filesystem::path& path, cv::Size size,
+                int block_size, int tile_size, std::vector<int> params,
+                mt::Threadpool* threads);
+  PyramidWriter(const PyramidWriter&) = delete;
+  PyramidWriter& operator=(const PyramidWriter&) = delete;
+  // Waits for the queued writes, they reference the writer
+  ~PyramidWriter();
+
+  [[nodiscard]] bool IsOpen() const;
+
+  // block_tl is a multiple of block_size, BGR image + 8-bit mask, the pixels
+  // outside of the mask are black. The blocks on the right / bottom border
+  // can be smaller than block_size.
+  bool WriteTile(cv::Point block_tl, const cv::Mat& image,
+                 const cv::Mat& mask);
+
+  // Waits for all the tiles, returns false if any of the writes failed
+  bool Close();
+
+ private:
+  struct PendingBlock {
+    cv::Mat block;
+    int num_children = 0;
+  };
+
+  struct Level {
+    cv::Size size;
+    std::filesystem::path dir;
+    // Blocks by index, waiting for the blocks of the level above
+    std::map<int, PendingBlock> pending;
+  };
+
+  [[nodiscard]] int BlocksAcross(int level) const;
+  [[nodiscard]] int BlocksDown(int level) const;
+
+  // BGR block of block_size x block_size, black past the level border
+  void WriteBlock(int level, int block_row, int block_col,
+                  const cv::Mat& block);
+  void AddToNextLevel(int level, int block_row, int block_col,
+                      const cv::Mat& block);
+
+  std::filesystem::path path_;
+  int block_size_;
+  int tile_size_;
+  std::vector<int> params_;
+  mt::Threadpool* threads_;
+  // The full image first, each next level is halved
+  std::vector<Level> levels_;
+  mt::MultiFuture<bool> writes_;
+  bool failed_ = false;
+};
+
+}  // namespace xpano::utils::deep_zoom
@@ -3,12 +3,20 @@
 
 #include "xpano/utils/disjoint_set.h"
 
+#include <algorithm>
+#include <cstddef>
 #include <numeric>
 #include <utility>
 #include <vector>
 
 namespace xpano::utils {
 
+DisjointSet::DisjointSet(int size)
+    : parent_(static_cast<std::size_t>(std::max(size, 0))),
+      rank_(parent_.size(), 0) {
+  std::iota(parent_.begin(), parent_.end(), 0);
+}
+
 void DisjointSet::Union(int left, int right) {
   left = Find(left);
   right = Find(right);
@@ -28,23 +36,28 @@ void DisjointSet::Union(int left, int right) {
   }
 }
 
-// Path halving algorithm from
-// https://en.wikipedia.org/wiki/Disjoint-set_data_structure
+// Full path compression, the second pass points the whole path to the root,
+// see https://en.wikipedia.org/wiki/Disjoint-set_data_structure
 int DisjointSet::Find(int element) {
   Resize(element);
-  while (element != parent_[element]) {
-    parent_[element] = parent_[parent_[element]];
-    element = parent_[element];
+  int root = element;
+  while (root != parent_[root]) {
+    root = parent_[root];
+  }
+  while (element != root) {
+    element = std::exchange(parent_[element], root);
   }
-  return element;
+  return root;
 }
 
+// Doubles the capacity, growing one element at a time is quadratic
 void DisjointSet::Resize(int element) {
   if (auto old_size = std::ssize(parent_); element >= old_size) {
-    parent_.resize(element + 1);
+    const auto new_size = std::max<std::ptrdiff_t>(element + 1, 2 * old_size);
+    parent_.resize(static_cast<std::size_t>(new_size));
     std::iota(parent_.begin() + old_size, parent_.end(),
               static_cast<int>(old_size));
-    rank_.resize(element + 1, 0);
+    rank_.resize(parent_.size(), 0);
   }
 }
 
@@ -1,12 +1,19 @@
 // SPDX-FileCopyrightText: 2023 Tomas Krupka
 // SPDX-License-Identifier: GPL-3.0-or-later
 
+#pragma once
+
+#include <cstdint>
 #include <vector>
 
 namespace xpano::utils {
 
+// Union-find over the elements [0, size), grows on demand for larger ones.
+// Passing the size up front avoids the regrowth for large graphs.
 class DisjointSet {
  public:
+  explicit DisjointSet(int size = 0);
+
   void Union(int left, int right);
   int Find(int element);
 
@@ -14,7 +21,8 @@ class DisjointSet {
   void Resize(int element);
 
   std::vector<int> parent_;
-  std::vector<int> rank_;
+  // Bounded by log2 of the size
+  std::vector<std::uint8_t> rank_;
 };
 
 }  // namespace xpano::utils
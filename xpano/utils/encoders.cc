@@ -0,0 +1,311 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/encoders.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <spdlog/spdlog.h>
+
+#ifdef XPANO_WITH_JXL
+#include <jxl/encode.h>
+#include <jxl/encode_cxx.h>
+#include <jxl/parallel_runner.h>
+#endif
+
+#ifdef XPANO_WITH_AVIF
+#include <avif/avif.h>
+#endif
+
+#ifdef XPANO_WITH_WEBP
+#include <webp/encode.h>
+#endif
+
+#include "xpano/constants.h"
+#include "xpano/utils/parallel_for.h"
+#include "xpano/utils/threadpool.h"
+
+namespace xpano::utils::encoders {
+
+namespace {
+
+int NumThreads(mt::Threadpool* pool) {
+  return pool != nullptr
+             ? std::max(1, static_cast<int>(pool->get_thread_count()))
+             : 1;
+}
+
+bool IsLossless(const Params& params) {
+  return params.quality >= kMaxEncoderQuality;
+}
+
+#ifdef XPANO_WITH_JXL
+constexpr std::size_t kInitialJxlOutputBytes = std::size_t{1} << 20;
+
+// JxlParallelRunner on the pool, the calling thread takes part in the loop
+JxlParallelRetCode RunOnPool(void* runner_opaque, void* jpegxl_opaque,
+                             JxlParallelRunInit init,
+                             JxlParallelRunFunction func,
+                             std::uint32_t start_range,
+                             std::uint32_t end_range) {
+  auto* pool = static_cast<mt::Threadpool*>(runner_opaque);
+  const int num_threads = NumThreads(pool);
+  if (init(jpegxl_opaque, static_cast<std::size_t>(num_threads)) != 0) {
+    return JXL_PARALLEL_RET_RUNNER_ERROR;
+  }
+  mt::ParallelFor(pool, static_cast<int>(end_range - start_range),
+                  pool != nullptr ? num_threads - 1 : 0,
+                  [&](int task, int thread_num) {
+                    func(jpegxl_opaque,
+                         start_range + static_cast<std::uint32_t>(task),
+                         static_cast<std::size_t>(thread_num));
+                  });
+  return JXL_PARALLEL_RET_SUCCESS;
+}
+
+std::optional<std::vector<unsigned char>> EncodeJxl(const cv::Mat& image,
+                                                    const Params& params,
+                                                    mt::Threadpool* pool) {
+  auto encoder = JxlEncoderMake(nullptr);
+  if (JxlEncoderSetParallelRunner(encoder.get(), RunOnPool, pool) !=
+      JXL_ENC_SUCCESS) {
+    return {};
+  }
+
+  const bool lossless = IsLossless(params);
+  JxlBasicInfo info;
+  JxlEncoderInitBasicInfo(&info);
+  info.xsize = static_cast<std::uint32_t>(image.cols);
+  info.ysize = static_cast<std::uint32_t>(image.rows);
+  info.bits_per_sample = 8;
+  info.num_color_channels = 3;
+  info.uses_original_profile = lossless ? JXL_TRUE : JXL_FALSE;
+  JxlColorEncoding color;
+  JxlColorEncodingSetToSRGB(&color, JXL_FALSE);
+  if (JxlEncoderSetBasicInfo(encoder.get(), &info) != JXL_ENC_SUCCESS ||
+      JxlEncoderSetColorEncoding(encoder.get(), &color) != JXL_ENC_SUCCESS) {
+    return {};
+  }
+
+  auto* settings = JxlEncoderFrameSettingsCreate(encoder.get(), nullptr);
+  JxlEncoderFrameSettingsSetOption(settings, JXL_ENC_FRAME_SETTING_EFFORT,
+                                   params.effort);
+  if (lossless) {
+    JxlEncoderSetFrameLossless(settings, JXL_TRUE);
+  } else {
+    JxlEncoderSetFrameDistance(settings,
+                               JxlEncoderDistanceFromQuality(
+                                   static_cast<float>(params.quality)));
+  }
+
+  // No BGR pixel format
+  cv::Mat rgb;
+  cv::cvtColor(image, rgb, cv::COLOR_BGR2RGB);
+  const JxlPixelFormat format = {3, JXL_TYPE_UINT8, JXL_NATIVE_ENDIAN, 0};
+  if (JxlEncoderAddImageFrame(settings, &format, rgb.data,
+                              rgb.total() * rgb.elemSize()) !=
+      JXL_ENC_SUCCESS) {
+    return {};
+  }
+  rgb.release();
+  JxlEncoderCloseInput(encoder.get());
+
+  std::vector<unsigned char> encoded(kInitialJxlOutputBytes);
+  std::size_t written = 0;
+  for (;;) {
+    unsigned char* next_out = encoded.data() + written;
+    std::size_t avail_out = encoded.size() - written;
+    const auto status =
+        JxlEncoderProcessOutput(encoder.get(), &next_out, &avail_out);
+    written = static_cast<std::size_t>(next_out - encoded.data());
+    if (status == JXL_ENC_NEED_MORE_OUTPUT) {
+      encoded.resize(encoded.size() * 2);
+      continue;
+    }
+    if (status != JXL_ENC_SUCCESS) {
+      return {};
+    }
+    break;
+  }
+  encoded.resize(written);
+  return encoded;
+}
+#endif
+
+#ifdef XPANO_WITH_AVIF
+constexpr int kMaxAvifSpeed = 10;
+
+std::optional<std::vector<unsigned char>> EncodeAvif(const cv::Mat& image,
+                                                     const Params& params,
+                                                     int num_threads) {
+  const bool lossless = IsLossless(params);
+  const std::unique_ptr<avifImage, decltype(&avifImageDestroy)> avif(
+      avifImageCreate(static_cast<std::uint32_t>(image.cols),
+                      static_cast<std::uint32_t>(image.rows), 8,
+                      lossless ? AVIF_PIXEL_FORMAT_YUV444
+                               : AVIF_PIXEL_FORMAT_YUV420),
+      avifImageDestroy);
+  if (!avif) {
+    return {};
+  }
+  if (lossless) {
+    avif->matrixCoefficients = AVIF_MATRIX_COEFFICIENTS_IDENTITY;
+  }
+
+  avifRGBImage rgb;
+  avifRGBImageSetDefaults(&rgb, avif.get());
+  rgb.format = AVIF_RGB_FORMAT_BGR;
+  rgb.depth = 8;
+  // Only read by the conversion
+  // NOLINTNEXTLINE(cppcoreguidelines-pro-type-const-cast)
+  rgb.pixels = const_cast<std::uint8_t*>(image.data);
+  rgb.rowBytes = static_cast<std::uint32_t>(image.step[0]);
+  if (avifImageRGBToYUV(avif.get(), &rgb) != AVIF_RESULT_OK) {
+    return {};
+  }
+
+  const std::unique_ptr<avifEncoder, decltype(&avifEncoderDestroy)> encoder(
+      avifEncoderCreate(), avifEncoderDestroy);
+  if (!encoder) {
+    return {};
+  }
+  encoder->maxThreads = num_threads;
+  // Effort 1 - 9 to speed 10 - 2, the slower speeds gain little
+  encoder->speed = kMaxAvifSpeed + kMinEncoderEffort - params.effort;
+  encoder->quality = params.quality;
+
+  avifRWData output = AVIF_DATA_EMPTY;
+  std::optional<std::vector<unsigned char>> encoded;
+  if (const auto result = avifEncoderWrite(encoder.get(), avif.get(), &output);
+      result == AVIF_RESULT_OK) {
+    encoded.emplace(output.data, output.data + output.size);
+  } else {
+    spdlog::error("AVIF encoding failed: {}", avifResultToString(result));
+  }
+  avifRWDataFree(&output);
+  return encoded;
+}
+#endif
+
+#ifdef XPANO_WITH_WEBP
+constexpr int kMaxWebpMethod = 6;
+
+std::optional<std::vector<unsigned char>> EncodeWebp(const cv::Mat& image,
+                                                     const Params& params) {
+  if (image.cols > WEBP_MAX_DIMENSION || image.rows > WEBP_MAX_DIMENSION) {
+    spdlog::error("WebP is limited to {0}x{0} px, the image is {1}x{2}",
+                  WEBP_MAX_DIMENSION, image.cols, image.rows);
+    return {};
+  }
+
+  WebPConfig config;
+  if (WebPConfigInit(&config) == 0) {
+    return {};
+  }
+  config.lossless = IsLossless(params) ? 1 : 0;
+  config.quality = static_cast<float>(params.quality);
+  config.method = (params.effort - kMinEncoderEffort) * kMaxWebpMethod /
+                  (kMaxEncoderEffort - kMinEncoderEffort);
+  config.thread_level = 1;
+  if (WebPValidateConfig(&config) == 0) {
+    return {};
+  }
+
+  WebPPicture picture;
+  if (WebPPictureInit(&picture) == 0) {
+    return {};
+  }
+  picture.use_argb = config.lossless;
+  picture.width = image.cols;
+  picture.height = image.rows;
+  WebPMemoryWriter writer;
+  WebPMemoryWriterInit(&writer);
+  picture.writer = WebPMemoryWrite;
+  picture.custom_ptr = &writer;
+
+  std::optional<std::vector<unsigned char>> encoded;
+  if (WebPPictureImportBGR(&picture, image.data,
+                           static_cast<int>(image.step[0])) != 0 &&
+      WebPEncode(&config, &picture) != 0) {
+    encoded.emplace(writer.mem, writer.mem + writer.size);
+  } else {
+    spdlog::error("WebP encoding failed: error {}",
+                  static_cast<int>(picture.error_code));
+  }
+  WebPPictureFree(&picture);
+  WebPMemoryWriterClear(&writer);
+  return encoded;
+}
+#endif
+
+}  // namespace
+
+const char* Label(Format format) {
+  switch (format) {
+    case Format::kJxl:
+      return "JPEG XL";
+    case Format::kAvif:
+      return "AVIF";
+    case Format::kWebp:
+      return "WebP";
+  }
+  return "Unknown";
+}
+
+std::optional<Format> FormatOf(const std::filesystem::path& path) {
+  auto extension = path.extension().string();
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 [](unsigned char letter) { return std::tolower(letter); });
+  if (extension == ".jxl") {
+    return Format::kJxl;
+  }
+  if (extension == ".avif") {
+    return Format::kAvif;
+  }
+  if (extension == ".webp") {
+    return Format::kWebp;
+  }
+  return {};
+}
+
+// NOLINTBEGIN(misc-unused-parameters): not every encoder is built
+std::optional<std::vector<unsigned char>> Encode(const cv::Mat& image,
+                                                 Format format,
+                                                 const Params& params,
+                                                 mt::Threadpool* pool) {
+  if (!Enabled(format)) {
+    spdlog::error("This version was not built with {} support",
+                  Label(format));
+    return {};
+  }
+  CV_Assert(image.type() == CV_8UC3);
+  switch (format) {
+#ifdef XPANO_WITH_JXL
+    case Format::kJxl:
+      return EncodeJxl(image, params, pool);
+#endif
+#ifdef XPANO_WITH_AVIF
+    case Format::kAvif:
+      return EncodeAvif(image, params, NumThreads(pool));
+#endif
+#ifdef XPANO_WITH_WEBP
+    case Format::kWebp:
+      return EncodeWebp(image, params);
+#endif
+    default:
+      return {};
+  }
+}
+// NOLINTEND(misc-unused-parameters)
+
+}  // namespace xpano::utils::encoders
@@ -0,0 +1,68 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/constants.h"
+#include "xpano/utils/threadpool.h"
+
+namespace xpano::utils::encoders {
+
+// Export only formats encoded by their reference libraries instead of
+// cv::imwrite, each one optional at build time
+enum class Format : std::uint8_t { kJxl, kAvif, kWebp };
+
+constexpr bool Enabled(Format format) {
+  switch (format) {
+    case Format::kJxl:
+#ifdef XPANO_WITH_JXL
+      return true;
+#else
+      return false;
+#endif
+    case Format::kAvif:
+#ifdef XPANO_WITH_AVIF
+      return true;
+#else
+      return false;
+#endif
+    case Format::kWebp:
+#ifdef XPANO_WITH_WEBP
+      return true;
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+const char* Label(Format format);
+
+// By the extension, see kModernExtensions
+std::optional<Format> FormatOf(const std::filesystem::path& path);
+
+struct Params {
+  // 0 - 100, 100 is lossless
+  int quality = kDefaultEncoderQuality;
+  // 1 - 9, smaller files for a slower encoding
+  int effort = kDefaultEncoderEffort;
+};
+
+// Encodes the 8-bit BGR image, empty if the format isn't enabled in this
+// build or the encoding fails:
+//  - JPEG XL runs its parallel stages on the pool, see mt::ParallelFor.
+//  - The AV1 encoder behind AVIF has its own threads, as many as the pool.
+//  - WebP is limited to 16383 px per side and to two threads.
+std::optional<std::vector<unsigned char>> Encode(const cv::Mat& image,
+                                                 Format format,
+                                                 const Params& params,
+                                                 mt::Threadpool* pool);
+
+}  // namespace xpano::utils::encoders
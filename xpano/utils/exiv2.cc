@@ -3,9 +3,17 @@
 
 #include "xpano/utils/exiv2.h"
 
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
 #include <filesystem>
 #include <optional>
+#include <span>
 #include <string>
+#include <vector>
 
 #ifdef XPANO_WITH_EXIV2
 #include <exiv2/exiv2.hpp>
@@ -52,6 +60,96 @@ void EraseThumbnail(Exiv2::ExifData& exif_data) {
   auto thumb = Exiv2::ExifThumb(exif_data);
   thumb.erase();
 }
+
+int ReadOrientation(const Exiv2::ExifData& exif_data) {
+  if (auto exif_datum =
+          exif_data.findKey(Exiv2::ExifKey("Exif.Image.Orientation"));
+      exif_datum != exif_data.end()) {
+    return static_cast<int>(exif_datum->toFloat());
+  }
+  return kExifDefaultOrientation;
+}
+
+// "YYYY:MM:DD HH:MM:SS"
+std::optional<std::int64_t> ReadCaptureTime(const Exiv2::ExifData& exif_data) {
+  auto exif_datum =
+      exif_data.findKey(Exiv2::ExifKey("Exif.Photo.DateTimeOriginal"));
+  if (exif_datum == exif_data.end()) {
+    return {};
+  }
+  int year = 0;
+  unsigned month = 0;
+  unsigned day = 0;
+  int hours = 0;
+  int minutes = 0;
+  int seconds = 0;
+  if (std::sscanf(exif_datum->toString().c_str(), "%d:%u:%u %d:%d:%d", &year,
+                  &month, &day, &hours, &minutes, &seconds) != 6) {
+    return {};
+  }
+  const std::chrono::year_month_day date{
+      std::chrono::year{year}, std::chrono::month{month},
+      std::chrono::day{day}};
+  if (!date.ok()) {
+    return {};
+  }
+  auto time = std::chrono::sys_days{date} + std::chrono::hours{hours} +
+              std::chrono::minutes{minutes} + std::chrono::seconds{seconds};
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             time.time_since_epoch())
+      .count();
+}
+
+// Degrees, minutes and seconds + the hemisphere reference
+std::optional<double> ReadGpsCoordinate(const Exiv2::ExifData& exif_data,
+                                        const std::string& key,
+                                        char negative_ref) {
+  auto exif_datum = exif_data.findKey(Exiv2::ExifKey(key));
+  auto ref_datum = exif_data.findKey(Exiv2::ExifKey(key + "Ref"));
+  if (exif_datum == exif_data.end() || ref_datum == exif_data.end() ||
+      exif_datum->count() != 3) {
+    return {};
+  }
+  const double coordinate = exif_datum->toFloat(0) +
+                            exif_datum->toFloat(1) / 60.0 +
+                            exif_datum->toFloat(2) / 3600.0;
+  auto ref = ref_datum->toString();
+  return (!ref.empty() && ref[0] == negative_ref) ? -coordinate : coordinate;
+}
+
+std::optional<GpsPosition> ReadGpsPosition(const Exiv2::ExifData& exif_data) {
+  auto latitude = ReadGpsCoordinate(exif_data, "Exif.GPSInfo.GPSLatitude", 'S');
+  auto longitude =
+      ReadGpsCoordinate(exif_data, "Exif.GPSInfo.GPSLongitude", 'W');
+  if (!latitude || !longitude) {
+    return {};
+  }
+  return GpsPosition{*latitude, *longitude};
+}
+
+// Metadata of the exported pano, throws Exiv2::Error
+Exiv2::ExifData ExportExifData(
+    const std::optional<std::filesystem::path>& from_path,
+    const Vec2i& image_size) {
+  Exiv2::ExifData exif_data;
+  if (from_path) {
+    auto read_img = Exiv2::ImageFactory::open(from_path->string());
+    read_img->readMetadata();
+    exif_data = read_img->exifData();
+
+    UpdateImageSize(exif_data, image_size);
+    UpdateOrientation(exif_data, kExifDefaultOrientation);
+    EraseThumbnail(exif_data);
+  }
+  AddSoftwareTag(exif_data);
+  return exif_data;
+}
+
+// JPEG APP1 segment: marker, length, Exif header, TIFF structure
+constexpr std::array<unsigned char, 2> kApp1Marker = {0xFF, 0xE1};
+constexpr std::array<unsigned char, 6> kExifHeader = {'E', 'x', 'i',
+                                                      'f', 0,   0};
+constexpr std::size_t kMaxSegmentSize = 0xFFFF;
 #endif
 }  // namespace
 
@@ -70,22 +168,7 @@ void CreateExif(const std::optional<std::filesystem::path>& from_path,
 
   try {
     auto write_img = Exiv2::ImageFactory::open(to_path.string());
-
-    if (from_path) {
-      auto read_img = Exiv2::ImageFactory::open(from_path->string());
-      read_img->readMetadata();
-      write_img->setExifData(read_img->exifData());
-
-      UpdateImageSize(write_img->exifData(), image_size);
-      UpdateOrientation(write_img->exifData(), kExifDefaultOrientation);
-      EraseThumbnail(write_img->exifData());
-      AddSoftwareTag(write_img->exifData());
-    } else {
-      Exiv2::ExifData data;
-      AddSoftwareTag(data);
-      write_img->setExifData(data);
-    }
-
+    write_img->setExifData(ExportExifData(from_path, image_size));
     write_img->writeMetadata();
   } catch (const Exiv2::Error&) {
     spdlog::warn("Could not write Exif data to {}", to_path.string());
@@ -95,4 +178,121 @@ void CreateExif(const std::optional<std::filesystem::path>& from_path,
 #endif
 }
 
+std::optional<std::vector<unsigned char>> CreateExifSegment(
+    const std::optional<std::filesystem::path>& from_path,
+    const Vec2i& image_size) {
+#ifdef XPANO_WITH_EXIV2
+  if (from_path && !path::IsMetadataExtensionSupported(*from_path)) {
+    return {};
+  }
+
+  Exiv2::Blob blob;
+  try {
+    Exiv2::ExifParser::encode(blob, Exiv2::littleEndian,
+                              ExportExifData(from_path, image_size));
+  } catch (const Exiv2::Error&) {
+    return {};
+  }
+  // The length counts itself, but not the marker
+  const std::size_t length = 2 + kExifHeader.size() + blob.size();
+  if (blob.empty() || length > kMaxSegmentSize) {
+    return {};
+  }
+
+  std::vector<unsigned char> segment;
+  segment.reserve(kApp1Marker.size() + length);
+  segment.insert(segment.end(), kApp1Marker.begin(), kApp1Marker.end());
+  segment.push_back(static_cast<unsigned char>(length >> 8));
+  segment.push_back(static_cast<unsigned char>(length & 0xFF));
+  segment.insert(segment.end(), kExifHeader.begin(), kExifHeader.end());
+  segment.insert(segment.end(), blob.begin(), blob.end());
+  return segment;
+#else
+  return {};
+#endif
+}
+
+CaptureInfo ReadCaptureInfo(const std::filesystem::path& path) {
+#ifdef XPANO_WITH_EXIV2
+  if (!path::IsMetadataExtensionSupported(path)) {
+    return {};
+  }
+  try {
+    auto image = Exiv2::ImageFactory::open(path.string());
+    image->readMetadata();
+    const auto& exif_data = image->exifData();
+    return {.time = ReadCaptureTime(exif_data),
+            .position = ReadGpsPosition(exif_data)};
+  } catch (const Exiv2::Error&) {
+    return {};
+  }
+#else
+  return {};
+#endif
+}
+
+std::string ReadCameraModel(const std::filesystem::path& path) {
+#ifdef XPANO_WITH_EXIV2
+  if (!path::IsMetadataExtensionSupported(path)) {
+    return {};
+  }
+  try {
+    auto image = Exiv2::ImageFactory::open(path.string());
+    image->readMetadata();
+    const auto& exif_data = image->exifData();
+    std::string model;
+    for (const auto* key :
+         {"Exif.Image.Make", "Exif.Image.Model", "Exif.Photo.LensModel"}) {
+      auto exif_datum = exif_data.findKey(Exiv2::ExifKey(key));
+      if (exif_datum == exif_data.end()) {
+        continue;
+      }
+      if (!model.empty()) {
+        model += ' ';
+      }
+      model += exif_datum->toString();
+    }
+    return model;
+  } catch (const Exiv2::Error&) {
+    return {};
+  }
+#else
+  return {};
+#endif
+}
+
+std::optional<EmbeddedPreview> ReadEmbeddedPreview(
+    std::span<const unsigned char> encoded, int min_longer_side) {
+#ifdef XPANO_WITH_EXIV2
+  try {
+    auto image = Exiv2::ImageFactory::open(encoded.data(), encoded.size());
+    image->readMetadata();
+
+    const Exiv2::PreviewManager manager(*image);
+    auto properties = manager.getPreviewProperties();
+    // Sorted by size, pick the smallest one that is large enough
+    auto large_enough = std::find_if(
+        properties.begin(), properties.end(), [min_longer_side](auto& prop) {
+          return static_cast<int>(std::max(prop.width_, prop.height_)) >=
+                 min_longer_side;
+        });
+    if (large_enough == properties.end()) {
+      return {};
+    }
+
+    auto preview = manager.getPreviewImage(*large_enough);
+    const auto* data = preview.pData();
+    return EmbeddedPreview{
+        .data = {data, data + preview.size()},
+        .size = {static_cast<int>(preview.width()),
+                 static_cast<int>(preview.height())},
+        .orientation = ReadOrientation(image->exifData())};
+  } catch (const Exiv2::Error&) {
+    return {};
+  }
+#else
+  return {};
+#endif
+}
+
 }  // namespace xpano::utils::exiv2
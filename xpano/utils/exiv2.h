@@ -3,9 +3,14 @@
 
 #pragma once
 
+#include <cstdint>
 #include <filesystem>
 #include <optional>
+#include <span>
+#include <string>
+#include <vector>
 
+#include "xpano/constants.h"
 #include "xpano/utils/vec.h"
 
 namespace xpano::utils::exiv2 {
@@ -21,4 +26,40 @@ constexpr bool Enabled() {
 void CreateExif(const std::optional<std::filesystem::path>& from_path,
                 const std::filesystem::path& to_path, const Vec2i& image_size);
 
+// Same metadata as CreateExif as a JPEG APP1 segment incl. the marker, to be
+// written with the encoded image. Empty if it doesn't fit in one segment or
+// can't be created, CreateExif rewrites the file then.
+std::optional<std::vector<unsigned char>> CreateExifSegment(
+    const std::optional<std::filesystem::path>& from_path,
+    const Vec2i& image_size);
+
+struct EmbeddedPreview {
+  std::vector<unsigned char> data;  // encoded, usually a JPEG
+  Vec2i size;
+  int orientation = kExifDefaultOrientation;  // of the main image
+};
+
+struct GpsPosition {
+  double latitude;   // degrees, north positive
+  double longitude;  // degrees, east positive
+};
+
+struct CaptureInfo {
+  // Exif DateTimeOriginal in seconds, the timezone is ignored
+  std::optional<std::int64_t> time;
+  std::optional<GpsPosition> position;
+};
+
+// Reads only the metadata, the fields are empty when the tags are missing
+CaptureInfo ReadCaptureInfo(const std::filesystem::path& path);
+
+// "<Make> <Model> <LensModel>" of the Exif data, the missing tags are left
+// out, e.g. to pick a LensProfile. Empty without any of them.
+std::string ReadCameraModel(const std::filesystem::path& path);
+
+// Returns the smallest preview image embedded in the Exif / MakerNote data
+// with its longer side >= min_longer_side, without decoding the main image.
+std::optional<EmbeddedPreview> ReadEmbeddedPreview(
+    std::span<const unsigned char> encoded, int min_longer_side);
+
 }  // namespace xpano::utils::exiv2
@@ -53,16 +53,19 @@ bool FontLoader::Init(const std::filesystem::path& executable_path) {
 }
 
 void FontLoader::Reload(float scale) {
+  scale_ = scale;
   ImGuiIO& imgui_io = ImGui::GetIO();
   imgui_io.Fonts->Clear();
   imgui_io.Fonts->AddFontFromFileTTF(alphabet_font_path_.c_str(),
                                      std::roundf(18.0f * scale), nullptr,
                                      alphabet_ranges_.Data);
-  ImFontConfig config;
-  config.MergeMode = true;
-  imgui_io.Fonts->AddFontFromFileTTF(symbols_font_path_.c_str(),
-                                     std::roundf(18.0f * scale), &config,
-                                     symbol_ranges_.Data);
+  if (!symbols_deferred_) {
+    ImFontConfig config;
+    config.MergeMode = true;
+    imgui_io.Fonts->AddFontFromFileTTF(symbols_font_path_.c_str(),
+                                       std::roundf(18.0f * scale), &config,
+                                       symbol_ranges_.Data);
+  }
 
   ImGui_ImplSDLRenderer2_DestroyDeviceObjects();
   ImGui_ImplSDLRenderer2_CreateDeviceObjects();
@@ -71,6 +74,14 @@ void FontLoader::Reload(float scale) {
   ImGui::GetStyle().ScaleAllSizes(scale);
 }
 
+void FontLoader::LoadDeferred() {
+  if (!symbols_deferred_) {
+    return;
+  }
+  symbols_deferred_ = false;
+  Reload(scale_);
+}
+
 void InfoMarker(const std::string& label, const std::string& desc) {
   ImGui::TextDisabled("%s", label.c_str());
   if (ImGui::IsItemHovered()) {
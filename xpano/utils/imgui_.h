@@ -14,11 +14,15 @@
 
 namespace xpano::utils::imgui {
 
+// The symbols font is left out of the first atlas, so that the first frame
+// doesn't wait for it, LoadDeferred merges it in afterwards
 class FontLoader {
  public:
   FontLoader(std::string alphabet_font_path, std::string symbols_font_path);
   bool Init(const std::filesystem::path& executable_path);
   void Reload(float scale);
+  // Call between frames, after the first one was shown
+  void LoadDeferred();
 
  private:
   void ComputeGlyphRanges();
@@ -27,6 +31,8 @@ class FontLoader {
   std::string symbols_font_path_;
   ImVector<ImWchar> alphabet_ranges_;
   ImVector<ImWchar> symbol_ranges_;
+  bool symbols_deferred_ = true;
+  float scale_ = 1.0f;
 };
 
 void InfoMarker(const std::string& label, const std::string& desc);
@@ -0,0 +1,608 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/jpeg.h"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+#include "xpano/constants.h"
+#include "xpano/utils/threadpool.h"
+#include "xpano/utils/vec.h"
+
+namespace xpano::utils::jpeg {
+
+namespace {
+
+constexpr std::uint8_t kMarkerPrefix = 0xFF;
+constexpr std::uint8_t kStartOfImage = 0xD8;
+constexpr std::uint8_t kStartOfScan = 0xDA;
+constexpr std::uint8_t kEndOfImage = 0xD9;
+constexpr std::uint8_t kTem = 0x01;
+constexpr std::uint8_t kRestart0 = 0xD0;
+constexpr std::uint8_t kRestart7 = 0xD7;
+constexpr std::uint8_t kBaseline = 0xC0;
+constexpr std::uint8_t kApplication0 = 0xE0;
+constexpr std::uint8_t kApplication1 = 0xE1;
+constexpr std::uint8_t kExtendedSequential = 0xC1;
+constexpr std::uint8_t kDefineRestartInterval = 0xDD;
+constexpr int kNumRestartMarkers = 8;
+constexpr int kMaxRestartInterval = 0xFFFF;
+constexpr int kBlockSize = 8;
+// Multiple of the tallest MCU, vertically subsampled chroma
+constexpr int kStripeAlignment = 16;
+constexpr int kMinStripeRows = 256;
+
+// Exif APP1 segment: identifier, then a TIFF header and the IFD0 entries
+constexpr std::array<unsigned char, 6> kExifIdentifier = {'E', 'x', 'i',
+                                                         'f', 0,   0};
+constexpr std::uint16_t kExifLittleEndian = 0x4949;  // "II"
+constexpr std::uint16_t kExifOrientationTag = 0x0112;
+constexpr std::size_t kExifEntrySize = 12;
+
+// SOF0 - SOF15, except DHT (C4), JPG (C8) and DAC (CC)
+bool IsStartOfFrame(std::uint8_t marker) {
+  return marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 &&
+         marker != 0xC8 && marker != 0xCC;
+}
+
+bool IsStandalone(std::uint8_t marker) {
+  return marker == kTem || (marker >= kRestart0 && marker <= kRestart7);
+}
+
+class Reader {
+ public:
+  explicit Reader(std::span<const unsigned char> data) : data_(data) {}
+
+  std::optional<std::uint8_t> ReadByte() {
+    if (pos_ >= data_.size()) {
+      return {};
+    }
+    return data_[pos_++];
+  }
+
+  std::optional<int> ReadUint16() {
+    auto high = ReadByte();
+    auto low = ReadByte();
+    if (!high || !low) {
+      return {};
+    }
+    return (*high << 8) | *low;  // NOLINT(readability-magic-numbers)
+  }
+
+  void Skip(std::size_t num_bytes) { pos_ += num_bytes; }
+
+  [[nodiscard]] bool Good() const { return pos_ < data_.size(); }
+  [[nodiscard]] std::size_t Pos() const { return pos_; }
+
+ private:
+  std::span<const unsigned char> data_;
+  std::size_t pos_ = 0;
+};
+
+// Reader over a file, reads only up to the requested bytes
+class StreamReader {
+ public:
+  explicit StreamReader(std::ifstream* stream) : stream_(stream) {}
+
+  std::optional<std::uint8_t> ReadByte() {
+    char byte = 0;
+    if (!stream_->get(byte)) {
+      return {};
+    }
+    return static_cast<std::uint8_t>(byte);
+  }
+
+  std::optional<int> ReadUint16() {
+    auto high = ReadByte();
+    auto low = ReadByte();
+    if (!high || !low) {
+      return {};
+    }
+    return (*high << 8) | *low;  // NOLINT(readability-magic-numbers)
+  }
+
+  void Skip(std::size_t num_bytes) {
+    stream_->seekg(static_cast<std::streamoff>(num_bytes), std::ios::cur);
+  }
+
+  [[nodiscard]] bool Good() const { return stream_->good(); }
+
+ private:
+  std::ifstream* stream_;
+};
+
+// Byte offsets in a single scan sequential JPEG
+struct Layout {
+  std::size_t frame_height;  // of the height field in the SOF segment
+  std::size_t scan_start;    // of the SOS marker
+  std::size_t data_start;    // first byte of the entropy-coded segment
+  std::size_t data_end;      // of the EOI marker
+  int width = 0;
+  int height = 0;
+  int max_h_sampling = 1;
+  int max_v_sampling = 1;
+  int num_components = 0;
+  int restart_interval = 0;  // MCUs, 0 without restart markers
+};
+
+std::optional<Layout> ReadLayout(std::span<const unsigned char> data) {
+  Reader reader(data);
+  if (reader.ReadByte() != kMarkerPrefix ||
+      reader.ReadByte() != kStartOfImage) {
+    return {};
+  }
+
+  Layout layout = {};
+  int num_components = 0;
+  while (reader.Good()) {
+    if (reader.ReadByte() != kMarkerPrefix) {
+      return {};
+    }
+    auto marker = reader.ReadByte();
+    if (!marker || IsStandalone(*marker) || *marker == kEndOfImage) {
+      return {};
+    }
+    const std::size_t marker_start = reader.Pos() - 2;
+    auto segment_length = reader.ReadUint16();
+    if (!segment_length || *segment_length < 2) {
+      return {};
+    }
+    const std::size_t segment_end = reader.Pos() + *segment_length - 2;
+
+    if (IsStartOfFrame(*marker)) {
+      if (*marker != kBaseline && *marker != kExtendedSequential) {
+        return {};
+      }
+      reader.Skip(1);  // precision
+      layout.frame_height = reader.Pos();
+      auto height = reader.ReadUint16();
+      auto width = reader.ReadUint16();
+      // A zero height is defined later by a DNL marker
+      if (!height || !width || *height == 0 || *width == 0) {
+        return {};
+      }
+      layout.height = *height;
+      layout.width = *width;
+      num_components = reader.ReadByte().value_or(0);
+      for (int i = 0; i < num_components; i++) {
+        reader.Skip(1);  // component id
+        auto sampling = reader.ReadByte();
+        if (!sampling) {
+          return {};
+        }
+        layout.max_h_sampling = std::max(layout.max_h_sampling, *sampling >> 4);
+        layout.max_v_sampling =
+            std::max(layout.max_v_sampling, *sampling & 0x0F);
+        reader.Skip(1);  // quantization table
+      }
+    }
+
+    if (*marker == kDefineRestartInterval) {
+      layout.restart_interval = reader.ReadUint16().value_or(0);
+    }
+
+    if (*marker == kStartOfScan) {
+      // All components interleaved in the only scan
+      if (num_components == 0 || reader.ReadByte() != num_components) {
+        return {};
+      }
+      layout.num_components = num_components;
+      layout.scan_start = marker_start;
+      layout.data_start = segment_end;
+      layout.data_end = data.size() - 2;
+      if (data.size() < segment_end + 2 ||
+          data[layout.data_end] != kMarkerPrefix ||
+          data[layout.data_end + 1] != kEndOfImage) {
+        return {};
+      }
+      return layout;
+    }
+
+    reader.Skip(segment_end - reader.Pos());
+  }
+  return {};
+}
+
+bool NeedsSinglePass(const std::vector<int>& params) {
+  for (std::size_t i = 0; i + 1 < params.size(); i += 2) {
+    if ((params[i] == cv::IMWRITE_JPEG_PROGRESSIVE ||
+         params[i] == cv::IMWRITE_JPEG_OPTIMIZE) &&
+        params[i + 1] != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void AppendUint16(int value, std::vector<unsigned char>* data) {
+  data->push_back(static_cast<unsigned char>(value >> 8));
+  data->push_back(static_cast<unsigned char>(value & 0xFF));
+}
+
+int ReadExifOrientation(std::span<const unsigned char> tiff) {
+  if (tiff.size() < 8) {
+    return kExifDefaultOrientation;
+  }
+  const bool little_endian = (tiff[0] << 8 | tiff[1]) == kExifLittleEndian;
+  auto read = [&tiff, little_endian](std::size_t pos, int num_bytes) {
+    std::uint32_t value = 0;
+    for (int i = 0; i < num_bytes; i++) {
+      const int shift = 8 * (little_endian ? i : num_bytes - 1 - i);
+      value |= static_cast<std::uint32_t>(tiff[pos + i]) << shift;
+    }
+    return value;
+  };
+  const std::size_t ifd = read(4, 4);
+  if (ifd > tiff.size() - 2) {
+    return kExifDefaultOrientation;
+  }
+  const std::size_t num_entries = read(ifd, 2);
+  for (std::size_t i = 0; i < num_entries; i++) {
+    const std::size_t entry = ifd + 2 + i * kExifEntrySize;
+    if (entry + kExifEntrySize > tiff.size()) {
+      break;
+    }
+    if (read(entry, 2) == kExifOrientationTag) {
+      return static_cast<int>(read(entry + 8, 2));
+    }
+  }
+  return kExifDefaultOrientation;
+}
+
+// A run of restart intervals starting and ending at a full MCU row
+struct Stripe {
+  int first_interval;
+  int end_interval;
+  int start_row;
+  int end_row;
+};
+
+// Walks the markers up to the first SOFn, the rest of the file is not read
+template <typename TReader>
+std::optional<Vec2i> ScanSize(TReader* reader) {
+  if (reader->ReadByte() != kMarkerPrefix ||
+      reader->ReadByte() != kStartOfImage) {
+    return {};
+  }
+
+  while (reader->Good()) {
+    auto prefix = reader->ReadByte();
+    if (prefix != kMarkerPrefix) {
+      return {};
+    }
+    auto marker = reader->ReadByte();
+    while (marker == kMarkerPrefix) {  // fill bytes
+      marker = reader->ReadByte();
+    }
+    if (!marker || *marker == kStartOfScan || *marker == kEndOfImage) {
+      return {};
+    }
+    if (IsStandalone(*marker)) {
+      continue;
+    }
+
+    auto segment_length = reader->ReadUint16();
+    if (!segment_length || *segment_length < 2) {
+      return {};
+    }
+
+    if (IsStartOfFrame(*marker)) {
+      auto precision = reader->ReadByte();
+      auto height = reader->ReadUint16();
+      auto width = reader->ReadUint16();
+      if (!precision || !height || !width || *height == 0 || *width == 0) {
+        return {};
+      }
+      return Vec2i{*width, *height};
+    }
+
+    reader->Skip(*segment_length - 2);
+  }
+  return {};
+}
+
+}  // namespace
+
+std::optional<Vec2i> ReadSize(std::span<const unsigned char> data) {
+  Reader reader(data);
+  return ScanSize(&reader);
+}
+
+std::optional<Vec2i> ReadSize(const std::filesystem::path& path) {
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream) {
+    return {};
+  }
+  StreamReader reader(&stream);
+  return ScanSize(&reader);
+}
+
+std::optional<std::size_t> MetadataPosition(
+    std::span<const unsigned char> data) {
+  Reader reader(data);
+  if (reader.ReadByte() != kMarkerPrefix ||
+      reader.ReadByte() != kStartOfImage) {
+    return {};
+  }
+  std::size_t position = reader.Pos();
+  while (reader.ReadByte() == kMarkerPrefix &&
+         reader.ReadByte() == kApplication0) {
+    auto segment_length = reader.ReadUint16();
+    if (!segment_length || *segment_length < 2) {
+      return {};
+    }
+    reader.Skip(*segment_length - 2);
+    position = reader.Pos();
+  }
+  if (position >= data.size()) {
+    return {};
+  }
+  return position;
+}
+
+int ReadOrientation(std::span<const unsigned char> data) {
+  Reader reader(data);
+  if (reader.ReadByte() != kMarkerPrefix ||
+      reader.ReadByte() != kStartOfImage) {
+    return kExifDefaultOrientation;
+  }
+  while (reader.Good()) {
+    if (reader.ReadByte() != kMarkerPrefix) {
+      break;
+    }
+    auto marker = reader.ReadByte();
+    if (!marker || *marker == kStartOfScan || *marker == kEndOfImage) {
+      break;
+    }
+    if (IsStandalone(*marker)) {
+      continue;
+    }
+    auto segment_length = reader.ReadUint16();
+    if (!segment_length || *segment_length < 2 ||
+        reader.Pos() + *segment_length - 2 > data.size()) {
+      break;
+    }
+    const auto segment = data.subspan(reader.Pos(), *segment_length - 2);
+    if (*marker == kApplication1 && segment.size() > kExifIdentifier.size() &&
+        std::equal(kExifIdentifier.begin(), kExifIdentifier.end(),
+                   segment.begin())) {
+      return ReadExifOrientation(segment.subspan(kExifIdentifier.size()));
+    }
+    reader.Skip(segment.size());
+  }
+  return kExifDefaultOrientation;
+}
+
+cv::Mat DecodeStriped(std::span<const unsigned char> data) {
+  auto layout = ReadLayout(data);
+  if (!layout || layout->restart_interval == 0) {
+    return {};
+  }
+  // A grayscale scan isn't interleaved, its MCU is a single block
+  const bool interleaved = layout->num_components > 1;
+  const int mcu_width = kBlockSize * (interleaved ? layout->max_h_sampling : 1);
+  const int mcu_height =
+      kBlockSize * (interleaved ? layout->max_v_sampling : 1);
+  const std::int64_t mcus_per_row = (layout->width + mcu_width - 1) / mcu_width;
+  const std::int64_t num_mcus =
+      mcus_per_row * ((layout->height + mcu_height - 1) / mcu_height);
+  const std::int64_t interval = layout->restart_interval;
+  const std::int64_t num_intervals = (num_mcus + interval - 1) / interval;
+
+  // The entropy-coded data of interval i starts at interval_starts[i], the
+  // preceding restart marker ends 2 bytes before
+  std::vector<std::size_t> interval_starts = {layout->data_start};
+  const auto* data_end = data.data() + layout->data_end;
+  const auto* byte = data.data() + layout->data_start;
+  while ((byte = std::find(byte, data_end, kMarkerPrefix)) < data_end - 1) {
+    if (byte[1] >= kRestart0 && byte[1] <= kRestart7) {
+      interval_starts.push_back(byte + 2 - data.data());
+    }
+    byte++;
+  }
+  if (static_cast<std::int64_t>(interval_starts.size()) != num_intervals) {
+    return {};
+  }
+  interval_starts.push_back(layout->data_end + 2);
+  auto interval_end = [&interval_starts](std::int64_t i) {
+    return interval_starts[i + 1] - 2;
+  };
+
+  const int num_threads = std::max(1, cv::getNumThreads());
+  const int target_rows =
+      std::max(kMinStripeRows, layout->height / num_threads);
+  std::vector<Stripe> stripes;
+  int first_interval = 0;
+  int start_row = 0;
+  for (std::int64_t i = 1; i <= num_intervals; i++) {
+    const std::int64_t mcu = std::min(i * interval, num_mcus);
+    if (mcu % mcus_per_row != 0) {
+      continue;
+    }
+    const int row = std::min(
+        layout->height, static_cast<int>(mcu / mcus_per_row) * mcu_height);
+    if (row - start_row >= target_rows || i == num_intervals) {
+      stripes.push_back({.first_interval = first_interval,
+                         .end_interval = static_cast<int>(i),
+                         .start_row = start_row,
+                         .end_row = row});
+      first_interval = static_cast<int>(i);
+      start_row = row;
+    }
+  }
+  if (stripes.size() < 2) {
+    return {};
+  }
+
+  // Each stripe is a standalone JPEG with the tables of the file
+  cv::Mat image(layout->height, layout->width, CV_8UC3);
+  std::atomic<bool> failed = false;
+  auto decode = [&](const cv::Range& range) {
+    for (int s = range.start; s < range.end; s++) {
+      const auto& stripe = stripes[s];
+      const int rows = stripe.end_row - stripe.start_row;
+      std::vector<unsigned char> encoded;
+      encoded.reserve(layout->data_start +
+                      interval_end(stripe.end_interval - 1) -
+                      interval_starts[stripe.first_interval] + 2);
+      encoded.insert(encoded.end(), data.begin(),
+                     data.begin() + layout->data_start);
+      encoded[layout->frame_height] = static_cast<unsigned char>(rows >> 8);
+      encoded[layout->frame_height + 1] =
+          static_cast<unsigned char>(rows & 0xFF);
+      // The restart markers count from 0 again
+      for (int i = stripe.first_interval; i < stripe.end_interval; i++) {
+        encoded.insert(encoded.end(), data.begin() + interval_starts[i],
+                       data.begin() + interval_end(i));
+        encoded.push_back(kMarkerPrefix);
+        encoded.push_back(
+            i + 1 < stripe.end_interval
+                ? kRestart0 + ((i - stripe.first_interval) % kNumRestartMarkers)
+                : kEndOfImage);
+      }
+      const cv::Mat decoded = cv::imdecode(
+          encoded, cv::IMREAD_COLOR | cv::IMREAD_IGNORE_ORIENTATION);
+      if (decoded.size() != cv::Size(layout->width, rows) ||
+          decoded.type() != CV_8UC3) {
+        failed = true;
+        return;
+      }
+      decoded.copyTo(image.rowRange(stripe.start_row, stripe.end_row));
+    }
+  };
+  cv::parallel_for_(cv::Range(0, static_cast<int>(stripes.size())), decode,
+                    static_cast<double>(stripes.size()));
+  if (failed) {
+    return {};
+  }
+  return image;
+}
+
+std::optional<std::vector<unsigned char>> EncodeStriped(
+    const cv::Mat& image, const std::vector<int>& params,
+    mt::Threadpool* threads) {
+  if (image.empty() || image.rows > kMaxRestartInterval ||
+      NeedsSinglePass(params)) {
+    return {};
+  }
+
+  // The restart interval is counted in MCUs, at least 8x8 pixels each
+  const int blocks_per_row = (image.cols + kBlockSize - 1) / kBlockSize;
+  const int max_stripe_rows =
+      kMaxRestartInterval / blocks_per_row / 2 * kStripeAlignment;
+  if (max_stripe_rows == 0) {
+    return {};
+  }
+  const int num_threads =
+      threads != nullptr ? static_cast<int>(threads->get_thread_count()) : 1;
+  int stripe_rows = std::max(kMinStripeRows, image.rows / num_threads);
+  stripe_rows = (stripe_rows + kStripeAlignment - 1) / kStripeAlignment *
+                kStripeAlignment;
+  stripe_rows = std::min(stripe_rows, max_stripe_rows);
+  const int num_stripes = (image.rows + stripe_rows - 1) / stripe_rows;
+
+  std::vector<std::vector<unsigned char>> stripes(num_stripes);
+  auto encode = [&](int stripe) {
+    const int start = stripe * stripe_rows;
+    const int end = std::min(image.rows, start + stripe_rows);
+    return cv::imencode(".jpg", image.rowRange(start, end), stripes[stripe],
+                        params);
+  };
+  bool encoded = true;
+  if (threads == nullptr || num_stripes == 1) {
+    for (int stripe = 0; stripe < num_stripes; stripe++) {
+      encoded &= encode(stripe);
+    }
+  } else {
+    mt::MultiFuture<bool> stripes_future;
+    for (int stripe = 0; stripe < num_stripes; stripe++) {
+      stripes_future.push_back(
+          threads->submit([&encode, stripe]() { return encode(stripe); }));
+    }
+    // The tasks reference the locals, wait for all of them first
+    stripes_future.wait();
+    for (const bool stripe_encoded : stripes_future.get()) {
+      encoded &= stripe_encoded;
+    }
+  }
+  if (!encoded) {
+    return {};
+  }
+  if (num_stripes == 1) {
+    return std::move(stripes[0]);
+  }
+
+  std::vector<Layout> layouts;
+  for (const auto& stripe : stripes) {
+    auto layout = ReadLayout(stripe);
+    if (!layout || layout->restart_interval != 0) {
+      return {};
+    }
+    layouts.push_back(*layout);
+  }
+
+  // The stripes share the tables, only the frame height differs
+  const auto& first = stripes[0];
+  const auto& header = layouts[0];
+  for (int i = 1; i < num_stripes; i++) {
+    const auto& stripe = stripes[i];
+    if (layouts[i].data_start != header.data_start ||
+        !std::equal(first.begin(), first.begin() + header.frame_height,
+                    stripe.begin()) ||
+        !std::equal(first.begin() + header.frame_height + 2,
+                    first.begin() + header.data_start,
+                    stripe.begin() + header.frame_height + 2)) {
+      return {};
+    }
+  }
+
+  const int mcus_per_row =
+      (image.cols + kBlockSize * header.max_h_sampling - 1) /
+      (kBlockSize * header.max_h_sampling);
+  const int restart_interval =
+      mcus_per_row * stripe_rows / (kBlockSize * header.max_v_sampling);
+
+  std::size_t total_size = header.data_start + 2 * num_stripes + 6;
+  for (int i = 0; i < num_stripes; i++) {
+    total_size += layouts[i].data_end - layouts[i].data_start;
+  }
+  std::vector<unsigned char> result;
+  result.reserve(total_size);
+  result.insert(result.end(), first.begin(), first.begin() + header.scan_start);
+  result[header.frame_height] = static_cast<unsigned char>(image.rows >> 8);
+  result[header.frame_height + 1] =
+      static_cast<unsigned char>(image.rows & 0xFF);
+  result.push_back(kMarkerPrefix);
+  result.push_back(kDefineRestartInterval);
+  AppendUint16(4, &result);
+  AppendUint16(restart_interval, &result);
+  result.insert(result.end(), first.begin() + header.scan_start,
+                first.begin() + header.data_start);
+
+  for (int i = 0; i < num_stripes; i++) {
+    const auto& stripe = stripes[i];
+    result.insert(result.end(), stripe.begin() + layouts[i].data_start,
+                  stripe.begin() + layouts[i].data_end);
+    if (i + 1 < num_stripes) {
+      result.push_back(kMarkerPrefix);
+      result.push_back(kRestart0 + (i % kNumRestartMarkers));
+    }
+  }
+  result.push_back(kMarkerPrefix);
+  result.push_back(kEndOfImage);
+  return result;
+}
+
+}  // namespace xpano::utils::jpeg
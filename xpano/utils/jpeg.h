@@ -0,0 +1,55 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+#include <span>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/utils/threadpool.h"
+#include "xpano/utils/vec.h"
+
+namespace xpano::utils::jpeg {
+
+// Returns the {width, height} stored in the SOF header of a JPEG file without
+// decoding it, or an empty optional if the data isn't a readable JPEG.
+// Note: the size is before applying the EXIF orientation.
+std::optional<Vec2i> ReadSize(std::span<const unsigned char> data);
+
+std::optional<Vec2i> ReadSize(const std::filesystem::path& path);
+
+// Offset after the SOI marker and the JFIF APP0 segment, where the Exif APP1
+// segment goes
+std::optional<std::size_t> MetadataPosition(
+    std::span<const unsigned char> data);
+
+// The Exif orientation of the main image, kExifDefaultOrientation without
+// one. Doesn't need exiv2, see DecodeStriped.
+int ReadOrientation(std::span<const unsigned char> data);
+
+// Decodes a sequential JPEG with restart markers in parallel horizontal
+// stripes, e.g. camera JPEGs or the output of EncodeStriped:
+//  - The stripes end at the restart markers on full MCU rows, each one is
+//    decoded as a standalone JPEG on the OpenCV threads.
+//  - Like cv::imdecode with IMREAD_COLOR | IMREAD_IGNORE_ORIENTATION, except
+//    for the subsampled chroma next to the stripe borders, which is upsampled
+//    without the rows of the neighboring stripe.
+//  - Empty without restart markers, for progressive JPEGs, images too small
+//    to split or when the decoding fails.
+cv::Mat DecodeStriped(std::span<const unsigned char> data);
+
+// Encodes the image as one baseline JPEG with cv::imencode params.
+//  - Horizontal stripes of the image are encoded in parallel, their
+//    entropy-coded segments are joined with restart markers.
+//  - Empty when the params need the whole image in one pass (progressive
+//    scans or optimized Huffman tables) or when the encoding fails.
+std::optional<std::vector<unsigned char>> EncodeStriped(
+    const cv::Mat& image, const std::vector<int>& params,
+    mt::Threadpool* threads);
+
+}  // namespace xpano::utils::jpeg
@@ -0,0 +1,81 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/mapped_file.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace xpano::utils {
+
+#ifdef _WIN32
+std::unique_ptr<MappedFile> MappedFile::Open(
+    const std::filesystem::path& path) {
+  HANDLE file = CreateFileW(path.c_str(), GENERIC_READ,
+                            FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (file == INVALID_HANDLE_VALUE) {
+    return nullptr;
+  }
+  LARGE_INTEGER size;
+  if (GetFileSizeEx(file, &size) == 0 || size.QuadPart == 0) {
+    CloseHandle(file);
+    return nullptr;
+  }
+  HANDLE mapping =
+      CreateFileMappingW(file, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+  CloseHandle(file);
+  if (mapping == nullptr) {
+    return nullptr;
+  }
+  // The view keeps the mapping alive
+  void* data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+  CloseHandle(mapping);
+  if (data == nullptr) {
+    return nullptr;
+  }
+  return std::unique_ptr<MappedFile>(
+      new MappedFile(static_cast<std::uint8_t*>(data),
+                     static_cast<std::size_t>(size.QuadPart)));
+}
+
+MappedFile::~MappedFile() { UnmapViewOfFile(data_); }
+#else
+std::unique_ptr<MappedFile> MappedFile::Open(
+    const std::filesystem::path& path) {
+  const int file = open(path.c_str(), O_RDONLY);  // NOLINT(*-vararg)
+  if (file < 0) {
+    return nullptr;
+  }
+  struct stat file_stat {};
+  if (fstat(file, &file_stat) != 0 || file_stat.st_size == 0) {
+    close(file);
+    return nullptr;
+  }
+  const auto size = static_cast<std::size_t>(file_stat.st_size);
+  // The mapping stays valid after the file is closed
+  void* data =
+      mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+  close(file);
+  if (data == MAP_FAILED) {
+    return nullptr;
+  }
+  return std::unique_ptr<MappedFile>(
+      new MappedFile(static_cast<std::uint8_t*>(data), size));
+}
+
+MappedFile::~MappedFile() { munmap(data_, size_); }
+#endif
+
+}  // namespace xpano::utils
@@ -0,0 +1,36 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+
+namespace xpano::utils {
+
+// Whole file mapped into memory, copy on write: the view can be modified
+// without changing the file. The OS pages the contents in and out.
+class MappedFile {
+ public:
+  // Nullptr if the file can't be mapped
+  [[nodiscard]] static std::unique_ptr<MappedFile> Open(
+      const std::filesystem::path& path);
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile();
+
+  [[nodiscard]] std::uint8_t* Data() const { return data_; }
+  [[nodiscard]] std::size_t Size() const { return size_; }
+
+ private:
+  MappedFile(std::uint8_t* data, std::size_t size)
+      : data_(data), size_(size) {}
+
+  std::uint8_t* data_;
+  std::size_t size_;
+};
+
+}  // namespace xpano::utils
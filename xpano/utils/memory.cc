@@ -0,0 +1,145 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/memory.h"
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/core/ocl.hpp>
+
+namespace xpano::utils::memory {
+
+namespace {
+
+struct Counter {
+  std::atomic<std::int64_t> bytes = 0;
+  std::atomic<std::int64_t> peak_bytes = 0;
+};
+
+std::array<Counter, kNumCategories>& Counters() {
+  static std::array<Counter, kNumCategories> counters;
+  return counters;
+}
+
+struct TransferCounter {
+  std::atomic<std::int64_t> count = 0;
+  std::atomic<std::int64_t> bytes = 0;
+};
+
+std::array<TransferCounter, 2>& TransferCounters() {
+  static std::array<TransferCounter, 2> counters;
+  return counters;
+}
+
+Counter& Get(Category category) {
+  return Counters()[static_cast<int>(category)];
+}
+
+void UpdatePeak(Counter* counter, std::int64_t bytes) {
+  auto peak = counter->peak_bytes.load();
+  while (bytes > peak && !counter->peak_bytes.compare_exchange_weak(peak,
+                                                                    bytes)) {
+  }
+}
+
+}  // namespace
+
+const char* Label(Category category) {
+  switch (category) {
+    case Category::kImages:
+      return "Images";
+    case Category::kFeatures:
+      return "Keypoints and descriptors";
+    case Category::kMatches:
+      return "Matches";
+    case Category::kFullResFrames:
+      return "Full resolution cache";
+    case Category::kDecodedPreviews:
+      return "Decoded previews";
+    case Category::kSeamMasks:
+      return "Seam masks";
+    case Category::kWarpedImages:
+      return "Warped images";
+    case Category::kBlender:
+      return "Blender";
+    case Category::kComposeBuffers:
+      return "Compose buffers";
+    case Category::kTextures:
+      return "Textures";
+  }
+  return "";
+}
+
+void Add(Category category, std::int64_t bytes) {
+  auto& counter = Get(category);
+  UpdatePeak(&counter, counter.bytes.fetch_add(bytes) + bytes);
+}
+
+void Set(Category category, std::int64_t bytes) {
+  auto& counter = Get(category);
+  counter.bytes = bytes;
+  UpdatePeak(&counter, bytes);
+}
+
+std::vector<Usage> Snapshot() {
+  std::vector<Usage> usage;
+  usage.reserve(kNumCategories);
+  for (int i = 0; i < kNumCategories; i++) {
+    const auto& counter = Counters()[i];
+    usage.push_back({.category = static_cast<Category>(i),
+                     .bytes = counter.bytes.load(),
+                     .peak_bytes = counter.peak_bytes.load()});
+  }
+  return usage;
+}
+
+std::optional<std::int64_t> OpenClReservedBytes() {
+  if (!cv::ocl::useOpenCL()) {
+    return {};
+  }
+  const auto* allocator = cv::ocl::getOpenCLAllocator();
+  if (allocator == nullptr) {
+    return {};
+  }
+  std::int64_t bytes = 0;
+  // The device buffers and the host mapped ones
+  for (const char* pool : {static_cast<const char*>(nullptr), "HOST_ALLOC"}) {
+    if (auto* controller = allocator->getBufferPoolController(pool)) {
+      bytes += static_cast<std::int64_t>(controller->getReservedSize());
+    }
+  }
+  return bytes;
+}
+
+void CountTransfer(Transfer direction, std::int64_t bytes) {
+  if (bytes <= 0 || !cv::ocl::useOpenCL()) {
+    return;
+  }
+  auto& counter = TransferCounters()[static_cast<int>(direction)];
+  counter.count++;
+  counter.bytes += bytes;
+}
+
+TransferStats Transfers() {
+  const auto& uploads = TransferCounters()[static_cast<int>(Transfer::kUpload)];
+  const auto& downloads =
+      TransferCounters()[static_cast<int>(Transfer::kDownload)];
+  return {.uploads = uploads.count.load(),
+          .upload_bytes = uploads.bytes.load(),
+          .downloads = downloads.count.load(),
+          .download_bytes = downloads.bytes.load()};
+}
+
+Scope::Scope(Category category, std::int64_t bytes)
+    : category_(category), bytes_(bytes) {
+  Add(category_, bytes_);
+}
+
+Scope::~Scope() { Add(category_, -bytes_); }
+
+}  // namespace xpano::utils::memory
@@ -0,0 +1,78 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace xpano::utils::memory {
+
+// Big buffers owned by the app, counted where they are created / released:
+//  - Steady: images, features and matches of the loaded StitcherData, the
+//    full resolution cache and the GUI textures.
+//  - Transient, during compositing: seam masks, warped images being fed,
+//    blender state (estimated from the pano size) and the compose buffers.
+enum class Category : std::uint8_t {
+  kImages,
+  kFeatures,
+  kMatches,
+  kFullResFrames,
+  kDecodedPreviews,
+  kSeamMasks,
+  kWarpedImages,
+  kBlender,
+  kComposeBuffers,
+  kTextures,
+};
+
+constexpr int kNumCategories = 10;
+
+const char* Label(Category category);
+
+// Negative bytes release, the peak is kept
+void Add(Category category, std::int64_t bytes);
+void Set(Category category, std::int64_t bytes);
+
+struct Usage {
+  Category category;
+  std::int64_t bytes;
+  std::int64_t peak_bytes;
+};
+
+[[nodiscard]] std::vector<Usage> Snapshot();
+
+// Reserved by the OpenCL buffer pools of OpenCV, empty without OpenCL
+[[nodiscard]] std::optional<std::int64_t> OpenClReservedBytes();
+
+// Explicit copies between the host and the OpenCL device, e.g. a UMat
+// mapped to a Mat, see utils::opencv::Download
+enum class Transfer : std::uint8_t { kUpload, kDownload };
+
+struct TransferStats {
+  std::int64_t uploads = 0;
+  std::int64_t upload_bytes = 0;
+  std::int64_t downloads = 0;
+  std::int64_t download_bytes = 0;
+};
+
+// Counted only while OpenCL is in use, the UMats are host memory otherwise
+void CountTransfer(Transfer direction, std::int64_t bytes);
+
+[[nodiscard]] TransferStats Transfers();
+
+// Counts the bytes for its lifetime
+class Scope {
+ public:
+  Scope(Category category, std::int64_t bytes);
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+  ~Scope();
+
+ private:
+  Category category_;
+  std::int64_t bytes_;
+};
+
+}  // namespace xpano::utils::memory
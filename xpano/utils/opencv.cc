@@ -4,13 +4,26 @@
 #include "xpano/utils/opencv.h"
 
 #include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
 #include <iterator>
+#include <system_error>
 #include <vector>
 
 #include <opencv2/stitching.hpp>
+#include <spdlog/spdlog.h>
+
+#include "xpano/utils/memory.h"
 
 namespace xpano::utils::opencv {
 
+namespace {
+
+constexpr const char *kOpenCLCacheDirEnv = "OPENCV_OPENCL_CACHE_DIR";
+
+}  // namespace
+
 std::vector<cv::detail::CameraParams> Scale(
     const std::vector<cv::detail::CameraParams> &cameras, double scale) {
   std::vector<cv::detail::CameraParams> scaled_cameras;
@@ -41,4 +54,30 @@ float MPx(const cv::Mat &image) {
   return MPx(cv::Rect(0, 0, image.cols, image.rows));
 }
 
+cv::Mat Download(const cv::UMat &image) {
+  memory::CountTransfer(memory::Transfer::kDownload,
+                        static_cast<std::int64_t>(image.total() *
+                                                  image.elemSize()));
+  cv::Mat host;
+  image.copyTo(host);
+  return host;
+}
+
+void UseOpenCLCache(const std::filesystem::path &dir) {
+  std::error_code error;
+  std::filesystem::create_directories(dir, error);
+  if (error) {
+    spdlog::warn("Couldn't create the OpenCL cache directory {}: {}",
+                 dir.string(), error.message());
+    return;
+  }
+  // Read by OpenCV once, when the first OpenCL program is built
+  const auto value = (dir / "").string();
+#ifdef _WIN32
+  _putenv_s(kOpenCLCacheDirEnv, value.c_str());
+#else
+  setenv(kOpenCLCacheDirEnv, value.c_str(), 1);
+#endif
+}
+
 }  // namespace xpano::utils::opencv
\ No newline at end of file
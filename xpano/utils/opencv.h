@@ -3,6 +3,7 @@
 
 #pragma once
 
+#include <filesystem>
 #include <vector>
 
 #include <opencv2/core/version.hpp>
@@ -29,4 +30,11 @@ float MPx(const cv::Rect &rect);
 
 float MPx(const cv::Mat &image);
 
+// Copies the image to the host, counted by utils::memory::Transfers
+cv::Mat Download(const cv::UMat &image);
+
+// Keeps the compiled OpenCL kernels in the directory across runs, has to be
+// called before the first OpenCL use
+void UseOpenCLCache(const std::filesystem::path &dir);
+
 }  // namespace xpano::utils::opencv
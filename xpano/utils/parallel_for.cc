@@ -0,0 +1,153 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/parallel_for.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include <spdlog/spdlog.h>
+
+#include "xpano/utils/threadpool.h"
+
+namespace xpano::utils::mt {
+
+namespace {
+
+struct Loop {
+  int num_tasks = 0;
+  const std::function<void(int, int)>* body = nullptr;
+
+  std::atomic_int next_task = 0;
+  std::mutex mutex;
+  std::condition_variable finished;
+  int num_finished = 0;
+};
+
+// The loop body is only touched for the tasks taken before the loop is done,
+// the late helpers only see the loop state
+void RunTasks(Loop* loop, int thread_num) {
+  int num_finished = 0;
+  for (int task = loop->next_task++; task < loop->num_tasks;
+       task = loop->next_task++) {
+    (*loop->body)(task, thread_num);
+    num_finished++;
+  }
+  if (num_finished == 0) {
+    return;
+  }
+  {
+    const std::lock_guard lock(loop->mutex);
+    loop->num_finished += num_finished;
+  }
+  loop->finished.notify_all();
+}
+
+}  // namespace
+
+void ParallelFor(Threadpool* pool, int num_tasks, int num_helpers,
+                 const std::function<void(int task, int thread_num)>& body) {
+  if (num_tasks <= 0) {
+    return;
+  }
+  auto loop = std::make_shared<Loop>();
+  loop->num_tasks = num_tasks;
+  loop->body = &body;
+
+  for (int helper = 0; helper < num_helpers; helper++) {
+    pool->push_task([loop, helper]() { RunTasks(loop.get(), helper + 1); });
+  }
+
+  RunTasks(loop.get(), 0);
+  std::unique_lock lock(loop->mutex);
+  loop->finished.wait(
+      lock, [&loop]() { return loop->num_finished == loop->num_tasks; });
+}
+
+#if XPANO_OPENCV_HAS_PARALLEL_BACKEND
+namespace {
+
+// Index of the thread within the current loop, 0 for the calling thread
+thread_local int loop_thread_num = 0;
+
+}  // namespace
+
+PoolParallelFor::PoolParallelFor(std::shared_ptr<Threadpool> pool)
+    : pool_(std::move(pool)),
+      num_threads_(static_cast<int>(pool_->get_thread_count())) {}
+
+void PoolParallelFor::parallel_for(int tasks,
+                                   FN_parallel_for_body_cb_t body_callback,
+                                   void* callback_data) {
+  const int idle_threads = static_cast<int>(pool_->get_thread_count()) -
+                           static_cast<int>(pool_->get_tasks_total());
+  const int num_helpers =
+      std::clamp(std::min(idle_threads, tasks - 1), 0, num_threads_ - 1);
+  ParallelFor(pool_.get(), tasks, num_helpers,
+              [body_callback, callback_data](int task, int thread_num) {
+                const int outer_thread_num =
+                    std::exchange(loop_thread_num, thread_num);
+                body_callback(task, task + 1, callback_data);
+                loop_thread_num = outer_thread_num;
+              });
+}
+
+int PoolParallelFor::getThreadNum() const { return loop_thread_num; }
+
+int PoolParallelFor::getNumThreads() const { return num_threads_; }
+
+int PoolParallelFor::setNumThreads(int num_threads) {
+  const int previous = num_threads_;
+  // Negative resets to the default, 0 disables the parallelism
+  num_threads_ = num_threads < 0
+                     ? static_cast<int>(pool_->get_thread_count())
+                     : std::max(1, num_threads);
+  return previous;
+}
+
+const char* PoolParallelFor::getName() const { return "xpano"; }
+#endif
+
+namespace {
+
+std::atomic_int shared_pool_threads = 0;
+
+}  // namespace
+
+void SetSharedPoolThreads(int num_threads) {
+  shared_pool_threads = num_threads;
+}
+
+int SharedPoolThreads() {
+  const int num_threads = shared_pool_threads;
+  return num_threads > 0
+             ? num_threads
+             : static_cast<int>(
+                   std::max(2U, std::thread::hardware_concurrency()));
+}
+
+std::shared_ptr<Threadpool> SharedPool() {
+  static auto pool = std::make_shared<Threadpool>(SharedPoolThreads());
+  return pool;
+}
+
+bool UsePoolForOpenCV(const std::shared_ptr<Threadpool>& pool) {
+#if XPANO_OPENCV_HAS_PARALLEL_BACKEND
+  cv::parallel::setParallelForBackend(std::make_shared<PoolParallelFor>(pool),
+                                      false);
+  spdlog::info("OpenCV parallel loops run on the shared pool, {} threads",
+               pool->get_thread_count());
+  return true;
+#else
+  spdlog::info("OpenCV {} has no custom parallel backends", CV_VERSION);
+  return false;
+#endif
+}
+
+}  // namespace xpano::utils::mt
@@ -0,0 +1,70 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <functional>
+#include <memory>
+
+#include <opencv2/core/version.hpp>
+
+#include "xpano/utils/threadpool.h"
+
+#define XPANO_OPENCV_HAS_PARALLEL_BACKEND                             \
+  (CV_VERSION_MAJOR > 4 ||                                            \
+   (CV_VERSION_MAJOR == 4 &&                                          \
+    (CV_VERSION_MINOR > 5 ||                                          \
+     (CV_VERSION_MINOR == 5 && CV_VERSION_REVISION >= 2))))
+
+#if XPANO_OPENCV_HAS_PARALLEL_BACKEND
+#include <opencv2/core/parallel/parallel_backend.hpp>
+#endif
+
+namespace xpano::utils::mt {
+
+// Runs body(task, thread_num) for each task in [0, num_tasks) on the calling
+// thread (thread_num 0) and on up to num_helpers helper tasks queued on the
+// pool. The calling thread only waits for the tasks the helpers already took,
+// so it never waits for a helper stuck in the queue. The body isn't touched
+// after the call returns.
+void ParallelFor(Threadpool* pool, int num_tasks, int num_helpers,
+                 const std::function<void(int task, int thread_num)>& body);
+
+#if XPANO_OPENCV_HAS_PARALLEL_BACKEND
+// Runs cv::parallel_for_ on a Threadpool instead of the OpenCV's own threads:
+//  - The calling thread takes part in the loop, see ParallelFor. Nested
+//    calls from the tasks of the pool itself can't deadlock and don't need
+//    any extra threads.
+//  - Helper tasks are queued only for the idle threads of the pool, a busy
+//    pool runs the loop on the calling thread alone.
+class PoolParallelFor : public cv::parallel::ParallelForAPI {
+ public:
+  explicit PoolParallelFor(std::shared_ptr<Threadpool> pool);
+
+  void parallel_for(int tasks, FN_parallel_for_body_cb_t body_callback,
+                    void* callback_data) override;
+  [[nodiscard]] int getThreadNum() const override;
+  [[nodiscard]] int getNumThreads() const override;
+  int setNumThreads(int num_threads) override;
+  [[nodiscard]] const char* getName() const override;
+
+ private:
+  std::shared_ptr<Threadpool> pool_;
+  int num_threads_;
+};
+#endif
+
+// Threads of the SharedPool, call before its first use, 0: one per core
+void SetSharedPoolThreads(int num_threads);
+
+// Threads of the SharedPool, also the budget of the other CPU bound work
+int SharedPoolThreads();
+
+// Process wide pool shared by the pipeline of the app and OpenCV
+std::shared_ptr<Threadpool> SharedPool();
+
+// Process wide, call once before any parallel OpenCV call. Returns false if
+// the OpenCV version doesn't support custom parallel backends.
+bool UsePoolForOpenCV(const std::shared_ptr<Threadpool>& pool);
+
+}  // namespace xpano::utils::mt
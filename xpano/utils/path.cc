@@ -7,14 +7,22 @@
 #include <cctype>
 #include <filesystem>
 #include <iterator>
+#include <optional>
 #include <string>
+#include <system_error>
+#include <utility>
 #include <vector>
 
+#include <spdlog/spdlog.h>
+
 #include "xpano/constants.h"
+#include "xpano/utils/fmt.h"
 
 namespace xpano::utils::path {
 
 namespace {
+constexpr int kMaxUniqueDirAttempts = 1000;
+
 std::string LowercaseExtension(const std::filesystem::path& path) {
   auto extension = path.extension().string().substr(1);
   std::transform(extension.begin(), extension.end(), extension.begin(),
@@ -40,13 +48,134 @@ bool IsMetadataExtensionSupported(const std::filesystem::path& path) {
   return ContainsExtensionIgnoreCase(kMetadataSupportedExtensions, path);
 }
 
+bool IsTiff(const std::filesystem::path& path) {
+  return ContainsExtensionIgnoreCase(kTiffExtensions, path);
+}
+
+bool IsJpeg(const std::filesystem::path& path) {
+  return ContainsExtensionIgnoreCase(kJpegExtensions, path);
+}
+
+bool IsDeepZoom(const std::filesystem::path& path) {
+  return ContainsExtensionIgnoreCase(kDeepZoomExtensions, path);
+}
+
+bool IsModernFormat(const std::filesystem::path& path) {
+  return ContainsExtensionIgnoreCase(kModernExtensions, path);
+}
+
+bool IsProject(const std::filesystem::path& path) {
+  return ContainsExtensionIgnoreCase(kProjectExtensions, path);
+}
+
+bool IsVideo(const std::filesystem::path& path) {
+  return ContainsExtensionIgnoreCase(kVideoExtensions, path);
+}
+
 std::vector<std::filesystem::path> KeepSupported(
     const std::vector<std::filesystem::path>& paths) {
   std::vector<std::filesystem::path> valid_paths;
   std::copy_if(paths.begin(), paths.end(), std::back_inserter(valid_paths),
-               IsExtensionSupported);
+               [](const std::filesystem::path& path) {
+                 return IsExtensionSupported(path) || IsVideo(path);
+               });
 
   return valid_paths;
 }
 
+bool NaturalLess(const std::filesystem::path& lhs,
+                 const std::filesystem::path& rhs) {
+  const auto& left = lhs.native();
+  const auto& right = rhs.native();
+  auto is_digit = [](auto letter) { return letter >= '0' && letter <= '9'; };
+  auto lower = [](auto letter) {
+    return letter >= 'A' && letter <= 'Z' ? letter - 'A' + 'a' : letter;
+  };
+  size_t i = 0;
+  size_t j = 0;
+  while (i < left.size() && j < right.size()) {
+    if (is_digit(left[i]) && is_digit(right[j])) {
+      // Without the leading zeros, a longer run is a larger number
+      auto run_end = [&is_digit](const auto& str, size_t start) {
+        while (start < str.size() && str[start] == '0') {
+          start++;
+        }
+        size_t end = start;
+        while (end < str.size() && is_digit(str[end])) {
+          end++;
+        }
+        return std::pair{start, end};
+      };
+      const auto [left_start, left_end] = run_end(left, i);
+      const auto [right_start, right_end] = run_end(right, j);
+      if (left_end - left_start != right_end - right_start) {
+        return left_end - left_start < right_end - right_start;
+      }
+      for (size_t k = 0; k < left_end - left_start; k++) {
+        if (left[left_start + k] != right[right_start + k]) {
+          return left[left_start + k] < right[right_start + k];
+        }
+      }
+      i = left_end;
+      j = right_end;
+      continue;
+    }
+    if (lower(left[i]) != lower(right[j])) {
+      return lower(left[i]) < lower(right[j]);
+    }
+    i++;
+    j++;
+  }
+  if (i < left.size() || j < right.size()) {
+    return j < right.size();
+  }
+  // Equal up to the case and the leading zeros
+  return left < right;
+}
+
+void SortNatural(std::vector<std::filesystem::path>* paths) {
+  std::sort(paths->begin(), paths->end(), NaturalLess);
+}
+
+std::vector<std::filesystem::path> ListSupported(
+    const std::filesystem::path& dir) {
+  std::vector<std::filesystem::path> result;
+  std::error_code error;
+  for (std::filesystem::directory_iterator entry(dir, error), end;
+       !error && entry != end; entry.increment(error)) {
+    // The extension first, the type usually comes with the listing but may
+    // need a stat on network shares
+    const auto& path = entry->path();
+    std::error_code type_error;
+    if ((IsExtensionSupported(path) || IsVideo(path)) &&
+        entry->is_regular_file(type_error)) {
+      result.push_back(path);
+    }
+  }
+  if (error) {
+    spdlog::warn("Failed to list {}: {}", dir.string(), error.message());
+  }
+  SortNatural(&result);
+  return result;
+}
+
+std::optional<std::filesystem::path> CreateUniqueDir(
+    const std::filesystem::path& parent, const std::string& prefix) {
+  std::error_code error;
+  std::filesystem::create_directories(parent, error);
+  if (error) {
+    return {};
+  }
+  for (int i = 0; i < kMaxUniqueDirAttempts; i++) {
+    auto path = parent / fmt::format("{}-{}", prefix, i);
+    if (std::filesystem::create_directory(path, error)) {
+      return path;
+    }
+    if (error) {
+      return {};
+    }
+  }
+  return {};
+}
+
 }  // namespace xpano::utils::path
@@ -4,6 +4,8 @@
 #pragma once
 
 #include <filesystem>
+#include <optional>
+#include <string>
 #include <vector>
 
 namespace xpano::utils::path {
@@ -12,7 +14,38 @@ bool IsExtensionSupported(const std::filesystem::path& path);
 
 bool IsMetadataExtensionSupported(const std::filesystem::path& path);
 
+bool IsTiff(const std::filesystem::path& path);
+
+bool IsJpeg(const std::filesystem::path& path);
+
+bool IsDeepZoom(const std::filesystem::path& path);
+
+// JPEG XL, AVIF or WebP, see utils::encoders
+bool IsModernFormat(const std::filesystem::path& path);
+
+bool IsProject(const std::filesystem::path& path);
+
+bool IsVideo(const std::filesystem::path& path);
+
+// Images and videos
 std::vector<std::filesystem::path> KeepSupported(
     const std::vector<std::filesystem::path>& paths);
 
+// "img2" before "img10": the runs of digits compare by their value, the
+// letters ignoring the case
+bool NaturalLess(const std::filesystem::path& lhs,
+                 const std::filesystem::path& rhs);
+
+void SortNatural(std::vector<std::filesystem::path>* paths);
+
+// The supported files directly in dir, naturally sorted. Filtered while
+// listing, the unreadable entries are skipped instead of failing the listing.
+std::vector<std::filesystem::path> ListSupported(
+    const std::filesystem::path& dir);
+
+// New "<prefix>-<n>" subdirectory of parent, which is created if missing.
+// Other processes may share the parent.
+std::optional<std::filesystem::path> CreateUniqueDir(
+    const std::filesystem::path& parent, const std::string& prefix);
+
 }  // namespace xpano::utils::path
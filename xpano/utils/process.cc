@@ -0,0 +1,166 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/process.h"
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+// After windows.h
+#include <psapi.h>
+#else
+#include <sched.h>
+#include <sys/resource.h>
+#include <time.h>  // NOLINT(modernize-deprecated-headers)
+#include <unistd.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#else
+#include <fstream>
+#endif
+#endif
+
+namespace xpano::utils::process {
+
+namespace {
+
+#ifdef _WIN32
+std::int64_t TotalUs(const FILETIME& kernel, const FILETIME& user) {
+  auto to_100ns = [](const FILETIME& time) {
+    return (static_cast<std::int64_t>(time.dwHighDateTime) << 32) |
+           time.dwLowDateTime;
+  };
+  return (to_100ns(kernel) + to_100ns(user)) / 10;
+}
+#else
+std::int64_t ClockUs(clockid_t clock) {
+  timespec time{};
+  if (clock_gettime(clock, &time) != 0) {
+    return 0;
+  }
+  return static_cast<std::int64_t>(time.tv_sec) * 1000000 +
+         time.tv_nsec / 1000;
+}
+#endif
+
+}  // namespace
+
+#ifdef _WIN32
+std::int64_t ThreadCpuUs() {
+  FILETIME creation, exit, kernel, user;
+  if (GetThreadTimes(GetCurrentThread(), &creation, &exit, &kernel, &user) ==
+      0) {
+    return 0;
+  }
+  return TotalUs(kernel, user);
+}
+
+std::int64_t ProcessCpuUs() {
+  FILETIME creation, exit, kernel, user;
+  if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel,
+                      &user) == 0) {
+    return 0;
+  }
+  return TotalUs(kernel, user);
+}
+
+bool SetCpuAffinity(const std::vector<int>& cpus) {
+  DWORD_PTR mask = 0;
+  for (const int cpu : cpus) {
+    if (cpu >= static_cast<int>(sizeof(DWORD_PTR) * 8)) {
+      return false;
+    }
+    mask |= DWORD_PTR{1} << cpu;
+  }
+  return SetProcessAffinityMask(GetCurrentProcess(), mask) != 0;
+}
+
+namespace {
+std::optional<PROCESS_MEMORY_COUNTERS> MemoryCounters() {
+  PROCESS_MEMORY_COUNTERS counters;
+  if (GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                           sizeof(counters)) == 0) {
+    return {};
+  }
+  return counters;
+}
+}  // namespace
+
+std::optional<std::int64_t> CurrentRssBytes() {
+  auto counters = MemoryCounters();
+  if (!counters) {
+    return {};
+  }
+  return static_cast<std::int64_t>(counters->WorkingSetSize);
+}
+
+std::optional<std::int64_t> PeakRssBytes() {
+  auto counters = MemoryCounters();
+  if (!counters) {
+    return {};
+  }
+  return static_cast<std::int64_t>(counters->PeakWorkingSetSize);
+}
+#else
+std::int64_t ThreadCpuUs() { return ClockUs(CLOCK_THREAD_CPUTIME_ID); }
+
+std::int64_t ProcessCpuUs() { return ClockUs(CLOCK_PROCESS_CPUTIME_ID); }
+
+#ifdef __APPLE__
+bool SetCpuAffinity(const std::vector<int>& /*cpus*/) { return false; }
+#else
+bool SetCpuAffinity(const std::vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (const int cpu : cpus) {
+    if (cpu >= CPU_SETSIZE) {
+      return false;
+    }
+    CPU_SET(cpu, &set);
+  }
+  // The calling thread, inherited by the threads it starts
+  return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+#endif
+
+#ifdef __APPLE__
+std::optional<std::int64_t> CurrentRssBytes() {
+  mach_task_basic_info info{};
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO,
+                reinterpret_cast<task_info_t>(&info), &count) != KERN_SUCCESS) {
+    return {};
+  }
+  return static_cast<std::int64_t>(info.resident_size);
+}
+#else
+std::optional<std::int64_t> CurrentRssBytes() {
+  // Total and resident pages
+  std::ifstream statm("/proc/self/statm");
+  std::int64_t total_pages = 0;
+  std::int64_t resident_pages = 0;
+  if (!(statm >> total_pages >> resident_pages)) {
+    return {};
+  }
+  return resident_pages * sysconf(_SC_PAGESIZE);
+}
+#endif
+
+std::optional<std::int64_t> PeakRssBytes() {
+  rusage usage{};
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return {};
+  }
+#ifdef __APPLE__
+  // Bytes on macOS, kilobytes elsewhere
+  return static_cast<std::int64_t>(usage.ru_maxrss);
+#else
+  return static_cast<std::int64_t>(usage.ru_maxrss) * 1024;
+#endif
+}
+#endif
+
+}  // namespace xpano::utils::process
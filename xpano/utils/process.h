@@ -0,0 +1,26 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace xpano::utils::process {
+
+// CPU time of the calling thread, user + system
+[[nodiscard]] std::int64_t ThreadCpuUs();
+
+// CPU time of all the threads of the process, user + system
+[[nodiscard]] std::int64_t ProcessCpuUs();
+
+// Resident set size / working set of the process
+[[nodiscard]] std::optional<std::int64_t> CurrentRssBytes();
+[[nodiscard]] std::optional<std::int64_t> PeakRssBytes();
+
+// Pins the process to the CPUs, the threads started afterwards inherit it,
+// call at startup. Returns false if not supported, e.g. on macOS.
+bool SetCpuAffinity(const std::vector<int>& cpus);
+
+}  // namespace xpano::utils::process
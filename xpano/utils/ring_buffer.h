@@ -0,0 +1,91 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <utility>
+
+namespace xpano::utils {
+
+// Bounded queue of many producers and a single consumer without a mutex.
+// Every slot carries a sequence number telling whether it is free for the
+// producer of the position or filled for the consumer, see
+// https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+// A full buffer rejects the value instead of waiting.
+template <typename TValue, std::size_t kCapacity>
+class RingBuffer {
+  static_assert(kCapacity > 1 && (kCapacity & (kCapacity - 1)) == 0,
+                "Capacity must be a power of two");
+
+ public:
+  RingBuffer() {
+    for (std::size_t i = 0; i < kCapacity; i++) {
+      slots_[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  RingBuffer(const RingBuffer&) = delete;
+  RingBuffer& operator=(const RingBuffer&) = delete;
+  RingBuffer(RingBuffer&&) = delete;
+  RingBuffer& operator=(RingBuffer&&) = delete;
+  ~RingBuffer() = default;
+
+  // Any thread
+  bool TryPush(TValue value) {
+    auto pos = head_.load(std::memory_order_relaxed);
+    while (true) {
+      auto& slot = slots_[pos & kMask];
+      const auto sequence = slot.sequence.load(std::memory_order_acquire);
+      const auto diff = static_cast<std::intptr_t>(sequence) -
+                        static_cast<std::intptr_t>(pos);
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                                        std::memory_order_relaxed)) {
+          slot.value = std::move(value);
+          slot.sequence.store(pos + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  // Only the consumer thread
+  std::optional<TValue> TryPop() {
+    auto& slot = slots_[tail_ & kMask];
+    if (slot.sequence.load(std::memory_order_acquire) != tail_ + 1) {
+      return {};
+    }
+    std::optional<TValue> value = std::move(slot.value);
+    slot.value = TValue{};
+    slot.sequence.store(tail_ + kCapacity, std::memory_order_release);
+    tail_++;
+    return value;
+  }
+
+  static constexpr std::size_t Capacity() { return kCapacity; }
+
+ private:
+  static constexpr std::size_t kMask = kCapacity - 1;
+  // Keeps the producer and consumer counters on separate cache lines
+  static constexpr std::size_t kCacheLine = 64;
+
+  struct Slot {
+    std::atomic<std::size_t> sequence;
+    TValue value;
+  };
+
+  std::array<Slot, kCapacity> slots_;
+  alignas(kCacheLine) std::atomic<std::size_t> head_ = 0;
+  alignas(kCacheLine) std::size_t tail_ = 0;
+};
+
+}  // namespace xpano::utils
@@ -4,6 +4,7 @@
 #include "xpano/utils/sdl_.h"
 
 #include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <filesystem>
 #include <memory>
@@ -18,6 +19,14 @@
 
 namespace xpano::utils::sdl {
 
+bool IsWaylandSession() {
+#if defined(_WIN32) || defined(__APPLE__)
+  return false;
+#else
+  return std::getenv("WAYLAND_DISPLAY") != nullptr;
+#endif
+}
+
 WindowManager DetermineWindowManager(bool wayland_supported) {
 #ifdef _WIN32
   spdlog::info("WM: Windows");
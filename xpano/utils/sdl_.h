@@ -22,6 +22,10 @@ enum class WindowManager : std::uint8_t {
 
 void PrintRenderDrivers();
 
+// Running under a Wayland compositor, checked without initializing a video
+// driver
+bool IsWaylandSession();
+
 WindowManager DetermineWindowManager(bool wayland_supported);
 
 class DpiHandler {
@@ -8,15 +8,12 @@
 #define ALPACA_EXCLUDE_SUPPORT_STD_DEQUE
 #define ALPACA_EXCLUDE_SUPPORT_STD_LIST
 #define ALPACA_EXCLUDE_SUPPORT_STD_MAP
-#define ALPACA_EXCLUDE_SUPPORT_STD_OPTIONAL
 #define ALPACA_EXCLUDE_SUPPORT_STD_SET
-#define ALPACA_EXCLUDE_SUPPORT_STD_STRING
 #define ALPACA_EXCLUDE_SUPPORT_STD_PAIR
 #define ALPACA_EXCLUDE_SUPPORT_STD_UNIQUE_PTR
 #define ALPACA_EXCLUDE_SUPPORT_STD_UNORDERED_MAP
 #define ALPACA_EXCLUDE_SUPPORT_STD_UNORDERED_SET
 #define ALPACA_EXCLUDE_SUPPORT_STD_VARIANT
-#define ALPACA_EXCLUDE_SUPPORT_STD_VECTOR
 
 #include <cstdint>
 #include <filesystem>
@@ -30,6 +27,13 @@
 
 namespace xpano::utils::serialize {
 
+template <typename TType>
+[[nodiscard]] std::vector<std::uint8_t> SerializeToBuffer(const TType& value) {
+  std::vector<std::uint8_t> buffer;
+  alpaca::serialize<alpaca::options::with_version>(value, buffer);
+  return buffer;
+}
+
 template <typename TType>
 [[nodiscard]] std::error_code SerializeWithVersion(
     const std::filesystem::path& path, const TType& value) {
@@ -39,11 +43,9 @@ template <typename TType>
     return std::make_error_code(std::errc::io_error);
   }
 
-  std::vector<std::uint8_t> buffer;
-  auto bytes_written =
-      alpaca::serialize<alpaca::options::with_version>(value, buffer);
-
-  if (!ostream.write(reinterpret_cast<char*>(buffer.data()), bytes_written)) {
+  auto buffer = SerializeToBuffer(value);
+  if (!ostream.write(reinterpret_cast<char*>(buffer.data()),
+                     std::ssize(buffer))) {
     spdlog::warn("Failed to write to {}", path.string());
     return std::make_error_code(std::errc::io_error);
   }
@@ -63,6 +65,23 @@ struct DeserializeResult {
   TType value;
 };
 
+// Embedded in a bigger file, status is never kNoSuchFile
+template <typename TType>
+DeserializeResult<TType> DeserializeFromBuffer(
+    const std::vector<std::uint8_t>& buffer) {
+  std::error_code error_code;
+  auto recovered = alpaca::deserialize<alpaca::options::with_version, TType>(
+      buffer, error_code);
+
+  if (!error_code) {
+    return {DeserializeStatus::kSuccess, recovered};
+  }
+  if (error_code == std::errc::invalid_argument) {
+    return {DeserializeStatus::kBreakingChange};
+  }
+  return {DeserializeStatus::kUnknownError};
+}
+
 template <typename TType>
 DeserializeResult<TType> DeserializeWithVersion(
     const std::filesystem::path& path) {
@@ -80,20 +99,11 @@ DeserializeResult<TType> DeserializeWithVersion(
     return {DeserializeStatus::kUnknownError};
   }
 
-  std::error_code error_code;
-  auto recovered = alpaca::deserialize<alpaca::options::with_version, TType>(
-      buffer, error_code);
-
-  if (!error_code) {
-    return {DeserializeStatus::kSuccess, recovered};
-  }
-
-  if (error_code == std::errc::invalid_argument) {
+  auto result = DeserializeFromBuffer<TType>(buffer);
+  if (result.status == DeserializeStatus::kBreakingChange) {
     spdlog::warn("Version mismatch in {}", path.string());
-    return {DeserializeStatus::kBreakingChange};
   }
-
-  return {DeserializeStatus::kUnknownError};
+  return result;
 }
 
 }  // namespace xpano::utils::serialize
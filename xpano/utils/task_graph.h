@@ -0,0 +1,225 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include "xpano/utils/threadpool.h"
+
+namespace xpano::utils::mt {
+
+namespace detail {
+
+class GraphState {
+ public:
+  explicit GraphState(std::function<bool()> is_cancelled)
+      : is_cancelled_(std::move(is_cancelled)) {}
+
+  [[nodiscard]] bool IsCancelled() const { return is_cancelled_(); }
+
+  // The first error wins
+  void Fail(std::exception_ptr error) {
+    const std::lock_guard lock(mutex_);
+    if (!error_) {
+      error_ = std::move(error);
+    }
+  }
+
+  [[nodiscard]] std::exception_ptr Error() const {
+    const std::lock_guard lock(mutex_);
+    return error_;
+  }
+
+ private:
+  std::function<bool()> is_cancelled_;
+  mutable std::mutex mutex_;
+  std::exception_ptr error_;
+};
+
+// Owned by the slots of a stage, the last one released runs the continuation
+template <typename TValue>
+class Join {
+ public:
+  Join(std::shared_ptr<GraphState> graph, int size,
+       std::function<void(std::vector<TValue>)> continuation)
+      : graph_(std::move(graph)),
+        values_(size),
+        continuation_(std::move(continuation)) {}
+  Join(const Join&) = delete;
+  Join& operator=(const Join&) = delete;
+  Join(Join&&) = delete;
+  Join& operator=(Join&&) = delete;
+
+  ~Join() {
+    if (graph_->Error() || graph_->IsCancelled() ||
+        std::any_of(values_.begin(), values_.end(),
+                    [](const auto& value) { return !value.has_value(); })) {
+      return;
+    }
+    std::vector<TValue> values;
+    values.reserve(values_.size());
+    for (auto& value : values_) {
+      values.push_back(*std::move(value));
+    }
+    try {
+      continuation_(std::move(values));
+    } catch (...) {
+      graph_->Fail(std::current_exception());
+    }
+  }
+
+  void Set(int index, TValue value) { values_[index] = std::move(value); }
+
+  [[nodiscard]] GraphState* Graph() const { return graph_.get(); }
+
+ private:
+  std::shared_ptr<GraphState> graph_;
+  std::vector<std::optional<TValue>> values_;
+  std::function<void(std::vector<TValue>)> continuation_;
+};
+
+}  // namespace detail
+
+// Result of one task of a stage, filled once. The slot can be handed over to
+// a follow-up task, also on another pool. A slot released without a value
+// (e.g. its task was skipped once cancelled) stops the graph.
+template <typename TValue>
+class Slot {
+ public:
+  Slot(std::shared_ptr<detail::Join<TValue>> join, int index)
+      : join_(std::move(join)), index_(index) {}
+
+  [[nodiscard]] bool IsCancelled() const {
+    return join_->Graph()->IsCancelled();
+  }
+
+  void Set(TValue value) {
+    join_->Set(index_, std::move(value));
+    join_.reset();
+  }
+
+  void Fail(std::exception_ptr error) {
+    join_->Graph()->Fail(std::move(error));
+    join_.reset();
+  }
+
+  void Drop() { join_.reset(); }
+
+ private:
+  std::shared_ptr<detail::Join<TValue>> join_;
+  int index_;
+};
+
+template <typename TValue>
+using SlotPtr = std::shared_ptr<Slot<TValue>>;
+
+// Stages of work on a Threadpool, chained by continuations instead of tasks
+// waiting for their subtasks:
+//  - A stage is a set of tasks, each filling a slot. The continuation of the
+//    stage gets all the values and runs on the thread which filled the last
+//    slot, within its task. It starts the next stage or sets the result.
+//  - The future is ready when the last task holding the graph is done. It
+//    gets the first error thrown by a task or a continuation, the result,
+//    or cancelled_result if the graph was cancelled or a slot was released
+//    without a value.
+//  - The tasks of a cancelled graph are skipped, no continuation runs.
+//  - on_done is called once the future is ready, from the last task.
+// Create with std::make_shared, the stages keep the graph alive.
+template <typename TResult>
+class TaskGraph : public detail::GraphState,
+                  public std::enable_shared_from_this<TaskGraph<TResult>> {
+ public:
+  TaskGraph(TResult cancelled_result, std::function<bool()> is_cancelled,
+            std::function<void()> on_done = {})
+      : GraphState(std::move(is_cancelled)),
+        cancelled_result_(std::move(cancelled_result)),
+        on_done_(std::move(on_done)) {}
+  TaskGraph(const TaskGraph&) = delete;
+  TaskGraph& operator=(const TaskGraph&) = delete;
+  TaskGraph(TaskGraph&&) = delete;
+  TaskGraph& operator=(TaskGraph&&) = delete;
+
+  ~TaskGraph() {
+    if (auto error = Error()) {
+      promise_.set_exception(error);
+    } else if (result_) {
+      promise_.set_value(*std::move(result_));
+    } else {
+      promise_.set_value(std::move(cancelled_result_));
+    }
+    if (on_done_) {
+      on_done_();
+    }
+  }
+
+  std::future<TResult> GetFuture() { return promise_.get_future(); }
+
+  // Called from the last stage, ignored if the graph was cancelled meanwhile
+  void SetResult(TResult result) {
+    if (!IsCancelled()) {
+      result_ = std::move(result);
+    }
+  }
+
+  // The slots have to be moved to the tasks filling them, see Slot. A stage
+  // of size 0 runs the continuation right away.
+  template <typename TValue>
+  std::vector<SlotPtr<TValue>> Stage(
+      int size, std::function<void(std::vector<TValue>)> continuation) {
+    auto join = std::make_shared<detail::Join<TValue>>(
+        this->shared_from_this(), size, std::move(continuation));
+    std::vector<SlotPtr<TValue>> slots;
+    slots.reserve(size);
+    for (int i = 0; i < size; i++) {
+      slots.push_back(std::make_shared<Slot<TValue>>(join, i));
+    }
+    return slots;
+  }
+
+  // task(i) -> TValue for each i in [0, size) on the pool
+  template <typename TValue, typename TTask>
+  void ForEach(Threadpool* pool, int size, TTask task,
+               std::function<void(std::vector<TValue>)> continuation) {
+    auto slots = Stage<TValue>(size, std::move(continuation));
+    for (int i = 0; i < size; i++) {
+      // Releases the slot within the task, wait_for_tasks() covers the
+      // continuation
+      pool->push_task([task, slot = std::move(slots[i]), i]() mutable {
+        if (!slot->IsCancelled()) {
+          try {
+            slot->Set(task(i));
+          } catch (...) {
+            slot->Fail(std::current_exception());
+          }
+        }
+        slot.reset();
+      });
+    }
+  }
+
+  // Single task stage, e.g. the first one
+  void Run(Threadpool* pool, std::function<void()> task) {
+    ForEach<bool>(
+        pool, 1, [](int /*index*/) { return true; },
+        [task = std::move(task)](const std::vector<bool>& /*values*/) {
+          task();
+        });
+  }
+
+ private:
+  TResult cancelled_result_;
+  std::function<void()> on_done_;
+  std::optional<TResult> result_;
+  std::promise<TResult> promise_;
+};
+
+}  // namespace xpano::utils::mt
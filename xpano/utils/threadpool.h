@@ -3,6 +3,9 @@
 
 #pragma once
 
+#include <memory>
+#include <utility>
+
 #include <BS_thread_pool.hpp>
 
 namespace xpano::utils::mt {
@@ -12,4 +15,24 @@ using MultiFuture = BS::multi_future<TResultType>;
 
 using Threadpool = BS::thread_pool;
 
+// Pool which may be shared with others, e.g. OpenCV, see UsePoolForOpenCV.
+// Waits for the queued tasks when destroyed, same as an owned pool.
+class SharedThreadpool {
+ public:
+  explicit SharedThreadpool(std::shared_ptr<Threadpool> pool)
+      : pool_(std::move(pool)) {}
+  ~SharedThreadpool() { pool_->wait_for_tasks(); }
+
+  SharedThreadpool(const SharedThreadpool&) = delete;
+  SharedThreadpool& operator=(const SharedThreadpool&) = delete;
+  SharedThreadpool(SharedThreadpool&&) = delete;
+  SharedThreadpool& operator=(SharedThreadpool&&) = delete;
+
+  [[nodiscard]] Threadpool* get() const { return pool_.get(); }
+  Threadpool* operator->() const { return pool_.get(); }
+
+ private:
+  std::shared_ptr<Threadpool> pool_;
+};
+
 }  // namespace xpano::utils::mt
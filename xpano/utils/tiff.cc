@@ -0,0 +1,611 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/tiff.h"
+
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cstdint>
+#include <filesystem>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "xpano/utils/mapped_file.h"
+
+namespace xpano::utils::tiff {
+
+namespace {
+
+constexpr int kTileAlignment = 16;
+constexpr int kChannels = 4;
+
+// BigTIFF header: byte order, version, offset size, reserved, IFD offset
+constexpr std::uint16_t kLittleEndian = 0x4949;  // "II"
+constexpr std::uint16_t kBigEndian = 0x4d4d;     // "MM"
+constexpr std::uint16_t kClassicVersion = 42;
+constexpr std::uint16_t kBigTiffVersion = 43;
+constexpr std::uint16_t kOffsetSize = 8;
+constexpr std::uint64_t kIfdOffsetPosition = 8;
+// Tag, type, count and the inline value
+constexpr std::uint64_t kEntrySize = 20;
+
+enum class Tag : std::uint16_t {
+  kNewSubfileType = 254,
+  kImageWidth = 256,
+  kImageLength = 257,
+  kBitsPerSample = 258,
+  kCompression = 259,
+  kPhotometric = 262,
+  kStripOffsets = 273,
+  kOrientation = 274,
+  kSamplesPerPixel = 277,
+  kRowsPerStrip = 278,
+  kStripByteCounts = 279,
+  kPlanarConfiguration = 284,
+  kTileWidth = 322,
+  kTileLength = 323,
+  kTileOffsets = 324,
+  kTileByteCounts = 325,
+  kExtraSamples = 338,
+  kSampleFormat = 339,
+};
+
+enum class Type : std::uint16_t {
+  kByte = 1,
+  kShort = 3,
+  kLong = 4,
+  kLong8 = 16,
+};
+
+constexpr int kReducedResolution = 1;
+constexpr int kTransparencyMask = 4;
+constexpr std::uint16_t kNoCompression = 1;
+constexpr std::uint16_t kPhotometricMinIsBlack = 1;
+constexpr std::uint16_t kPhotometricRgb = 2;
+constexpr std::uint16_t kPlanarContiguous = 1;
+constexpr std::uint16_t kUnassociatedAlpha = 2;
+constexpr std::uint16_t kTopLeft = 1;
+constexpr std::uint16_t kUnsignedInt = 1;
+
+// Bounds on malformed files: directory loops, absurd value counts
+constexpr int kMaxPages = 64;
+constexpr std::uint64_t kMaxEntries = 1024;
+constexpr std::uint64_t kMaxValues = 1 << 24;
+
+template <typename TValue>
+void Write(std::ofstream& stream, TValue value) {
+  stream.write(reinterpret_cast<const char*>(&value), sizeof(TValue));
+}
+
+// Values up to 8 bytes are stored inline in the 20-byte entry
+struct Entry {
+  Tag tag;
+  Type type;
+  std::uint64_t count;
+  std::array<std::uint16_t, 4> shorts = {};
+  std::uint64_t value = 0;
+};
+
+void WriteEntry(std::ofstream& stream, const Entry& entry) {
+  Write(stream, static_cast<std::uint16_t>(entry.tag));
+  Write(stream, static_cast<std::uint16_t>(entry.type));
+  Write(stream, entry.count);
+  if (entry.type == Type::kShort) {
+    for (auto value : entry.shorts) {
+      Write(stream, value);
+    }
+  } else {
+    Write(stream, entry.value);
+  }
+}
+
+Entry Short(Tag tag, std::uint16_t value) {
+  return {.tag = tag, .type = Type::kShort, .count = 1, .shorts = {value}};
+}
+
+Entry Long(Tag tag, int value) {
+  return {.tag = tag,
+          .type = Type::kLong,
+          .count = 1,
+          .value = static_cast<std::uint32_t>(value)};
+}
+
+// Reads the unsigned integers of the file in its byte order
+class ByteReader {
+ public:
+  ByteReader(const std::uint8_t* data, std::uint64_t size, bool big_endian)
+      : data_(data), size_(size), big_endian_(big_endian) {}
+
+  [[nodiscard]] std::optional<std::uint64_t> Read(std::uint64_t position,
+                                                  int num_bytes) const {
+    if (position > size_ || num_bytes > size_ - position) {
+      return {};
+    }
+    std::uint64_t value = 0;
+    for (int i = 0; i < num_bytes; i++) {
+      const int shift = 8 * (big_endian_ ? num_bytes - 1 - i : i);
+      value |= std::uint64_t{data_[position + i]} << shift;
+    }
+    return value;
+  }
+
+ private:
+  const std::uint8_t* data_;
+  std::uint64_t size_;
+  bool big_endian_;
+};
+
+int TypeSize(std::uint64_t type) {
+  switch (static_cast<Type>(type)) {
+    case Type::kByte:
+      return 1;
+    case Type::kShort:
+      return 2;
+    case Type::kLong:
+      return 4;
+    case Type::kLong8:
+      return 8;
+  }
+  return 0;
+}
+
+struct Directory {
+  std::map<Tag, std::vector<std::uint64_t>> values;
+  std::uint64_t next_position = 0;
+
+  [[nodiscard]] std::uint64_t Get(Tag tag, std::uint64_t default_value) const {
+    auto iter = values.find(tag);
+    return iter == values.end() || iter->second.empty() ? default_value
+                                                        : iter->second[0];
+  }
+};
+
+// Skips the entries of the types not needed by the reader, e.g. rationals
+std::optional<Directory> ReadDirectory(const ByteReader& reader,
+                                       std::uint64_t position, bool big_tiff) {
+  const int count_size = big_tiff ? 8 : 2;
+  const int offset_size = big_tiff ? 8 : 4;
+  const std::uint64_t entry_size = big_tiff ? kEntrySize : 12;
+  auto num_entries = reader.Read(position, count_size);
+  if (!num_entries || *num_entries > kMaxEntries) {
+    return {};
+  }
+
+  Directory directory;
+  for (std::uint64_t i = 0; i < *num_entries; i++) {
+    const auto entry = position + count_size + i * entry_size;
+    auto tag = reader.Read(entry, 2);
+    auto type = reader.Read(entry + 2, 2);
+    auto count = reader.Read(entry + 4, offset_size);
+    if (!tag || !type || !count) {
+      return {};
+    }
+    const int value_size = TypeSize(*type);
+    if (value_size == 0 || *count > kMaxValues) {
+      continue;
+    }
+    // The values are inline if they fit in the offset
+    auto values_position = entry + 4 + offset_size;
+    if (*count * value_size > offset_size) {
+      auto offset = reader.Read(values_position, offset_size);
+      if (!offset) {
+        return {};
+      }
+      values_position = *offset;
+    }
+    std::vector<std::uint64_t> values;
+    values.reserve(*count);
+    for (std::uint64_t j = 0; j < *count; j++) {
+      auto value = reader.Read(values_position + j * value_size, value_size);
+      if (!value) {
+        return {};
+      }
+      values.push_back(*value);
+    }
+    directory.values[static_cast<Tag>(*tag)] = std::move(values);
+  }
+  const auto next_position = position + count_size + *num_entries * entry_size;
+  directory.next_position = reader.Read(next_position, offset_size).value_or(0);
+  return directory;
+}
+
+std::optional<Page> ToPage(Directory directory) {
+  const auto width = directory.Get(Tag::kImageWidth, 0);
+  const auto height = directory.Get(Tag::kImageLength, 0);
+  if (width == 0 || height == 0 || width > INT_MAX || height > INT_MAX) {
+    return {};
+  }
+  const auto subfile_type = directory.Get(Tag::kNewSubfileType, 0);
+  if ((subfile_type & kTransparencyMask) != 0) {
+    return {};
+  }
+
+  Page page{.size = {static_cast<int>(width), static_cast<int>(height)},
+            .reduced_resolution = (subfile_type & kReducedResolution) != 0};
+  const auto channels = directory.Get(Tag::kSamplesPerPixel, 1);
+  const auto bits = directory.Get(Tag::kBitsPerSample, 1);
+  const auto& all_bits = directory.values[Tag::kBitsPerSample];
+  const bool same_bits =
+      std::all_of(all_bits.begin(), all_bits.end(),
+                  [bits](auto value) { return value == bits; });
+  const auto photometric = directory.Get(Tag::kPhotometric, kPhotometricRgb);
+  const bool color_supported =
+      (photometric == kPhotometricRgb && (channels == 3 || channels == 4)) ||
+      (photometric == kPhotometricMinIsBlack &&
+       (channels == 1 || channels == 2));
+  page.channels = static_cast<int>(channels);
+  page.bits_per_sample = static_cast<int>(bits);
+
+  const bool tiled = directory.values.contains(Tag::kTileOffsets);
+  const auto chunk_width =
+      tiled ? directory.Get(Tag::kTileWidth, 0) : width;
+  const auto chunk_height =
+      tiled ? directory.Get(Tag::kTileLength, 0)
+            : std::min(directory.Get(Tag::kRowsPerStrip, height), height);
+  if (chunk_width == 0 || chunk_height == 0 || chunk_width > INT_MAX ||
+      chunk_height > INT_MAX) {
+    return page;
+  }
+  page.chunk_size = {static_cast<int>(chunk_width),
+                     static_cast<int>(chunk_height)};
+  page.chunk_offsets = std::move(
+      directory.values[tiled ? Tag::kTileOffsets : Tag::kStripOffsets]);
+  page.chunk_byte_counts = std::move(
+      directory.values[tiled ? Tag::kTileByteCounts : Tag::kStripByteCounts]);
+  const auto num_chunks = ((width + chunk_width - 1) / chunk_width) *
+                          ((height + chunk_height - 1) / chunk_height);
+
+  page.supported =
+      directory.Get(Tag::kCompression, kNoCompression) == kNoCompression &&
+      directory.Get(Tag::kPlanarConfiguration, kPlanarContiguous) ==
+          kPlanarContiguous &&
+      directory.Get(Tag::kOrientation, kTopLeft) == kTopLeft &&
+      directory.Get(Tag::kSampleFormat, kUnsignedInt) == kUnsignedInt &&
+      (bits == 8 || bits == 16) && same_bits && color_supported &&
+      page.chunk_offsets.size() == num_chunks &&
+      page.chunk_byte_counts.size() == num_chunks;
+  return page;
+}
+
+void SwapBytes(cv::Mat* image) {
+  for (int row = 0; row < image->rows; row++) {
+    auto* values = image->ptr<std::uint16_t>(row);
+    for (int i = 0; i < image->cols * image->channels(); i++) {
+      values[i] = static_cast<std::uint16_t>((values[i] >> 8) |
+                                             (values[i] << 8));
+    }
+  }
+}
+
+cv::Mat ToBgr(const cv::Mat& image) {
+  cv::Mat bgr;
+  switch (image.channels()) {
+    case 1:
+      cv::cvtColor(image, bgr, cv::COLOR_GRAY2BGR);
+      break;
+    case 2: {
+      cv::Mat gray;
+      cv::extractChannel(image, gray, 0);
+      cv::cvtColor(gray, bgr, cv::COLOR_GRAY2BGR);
+      break;
+    }
+    case 3:
+      cv::cvtColor(image, bgr, cv::COLOR_RGB2BGR);
+      break;
+    default:
+      cv::cvtColor(image, bgr, cv::COLOR_RGBA2BGR);
+      break;
+  }
+  return bgr;
+}
+
+}  // namespace
+
+std::unique_ptr<Reader> Reader::Open(const std::filesystem::path& path) {
+  auto file = MappedFile::Open(path);
+  if (!file) {
+    return nullptr;
+  }
+  const ByteReader probe(file->Data(), file->Size(), false);
+  const auto byte_order = probe.Read(0, 2);
+  if (byte_order != kLittleEndian && byte_order != kBigEndian) {
+    return nullptr;
+  }
+  const bool big_endian = byte_order == kBigEndian;
+  const ByteReader reader(file->Data(), file->Size(), big_endian);
+  const auto version = reader.Read(2, 2);
+  if (version != kClassicVersion && version != kBigTiffVersion) {
+    return nullptr;
+  }
+  const bool big_tiff = version == kBigTiffVersion;
+
+  std::vector<Page> pages;
+  auto position = big_tiff ? reader.Read(kIfdOffsetPosition, kOffsetSize)
+                           : reader.Read(4, 4);
+  for (int i = 0; i < kMaxPages && position && *position != 0; i++) {
+    auto directory = ReadDirectory(reader, *position, big_tiff);
+    if (!directory) {
+      break;
+    }
+    position = directory->next_position;
+    if (auto page = ToPage(std::move(*directory))) {
+      pages.push_back(std::move(*page));
+    }
+  }
+  if (pages.empty()) {
+    return nullptr;
+  }
+  return std::unique_ptr<Reader>(
+      new Reader(std::move(file), big_endian, std::move(pages)));
+}
+
+cv::Mat Reader::ReadRegion(int page_id, cv::Rect roi) const {
+  const auto& page = pages_[page_id];
+  roi &= cv::Rect(cv::Point(), page.size);
+  if (!page.supported || roi.empty()) {
+    return {};
+  }
+
+  const int depth = page.bits_per_sample == 8 ? CV_8U : CV_16U;
+  cv::Mat region(roi.size(), CV_MAKETYPE(depth, page.channels));
+  const auto pixel_bytes = region.elemSize();
+  const auto row_bytes =
+      static_cast<std::uint64_t>(page.chunk_size.width) * pixel_bytes;
+  const int chunks_across =
+      (page.size.width + page.chunk_size.width - 1) / page.chunk_size.width;
+  const int first_col = roi.x / page.chunk_size.width;
+  const int last_col = (roi.br().x - 1) / page.chunk_size.width;
+  const int first_row = roi.y / page.chunk_size.height;
+  const int last_row = (roi.br().y - 1) / page.chunk_size.height;
+  for (int chunk_row = first_row; chunk_row <= last_row; chunk_row++) {
+    for (int chunk_col = first_col; chunk_col <= last_col; chunk_col++) {
+      const auto index =
+          static_cast<std::size_t>(chunk_row) * chunks_across + chunk_col;
+      const cv::Rect chunk(chunk_col * page.chunk_size.width,
+                           chunk_row * page.chunk_size.height,
+                           page.chunk_size.width, page.chunk_size.height);
+      const cv::Rect overlap = chunk & roi;
+      // Tiles are padded to the full tile size, the last strip may be shorter
+      const auto needed =
+          (overlap.br().y - chunk.y - 1) * row_bytes +
+          (overlap.br().x - chunk.x) * pixel_bytes;
+      const auto offset = page.chunk_offsets[index];
+      if (needed > page.chunk_byte_counts[index] || offset > file_->Size() ||
+          needed > file_->Size() - offset) {
+        return {};
+      }
+      for (int row = overlap.y; row < overlap.br().y; row++) {
+        const auto* source = file_->Data() + offset +
+                             (row - chunk.y) * row_bytes +
+                             (overlap.x - chunk.x) * pixel_bytes;
+        std::memcpy(region.ptr(row - roi.y) + (overlap.x - roi.x) * pixel_bytes,
+                    source, overlap.width * pixel_bytes);
+      }
+    }
+  }
+
+  if (depth == CV_16U && big_endian_) {
+    SwapBytes(&region);
+  }
+  return ToBgr(region);
+}
+
+cv::Mat Reader::Read(int page_id) const {
+  return ReadRegion(page_id, cv::Rect(cv::Point(), pages_[page_id].size));
+}
+
+int PickPage(const std::vector<Page>& pages, int min_longer_side) {
+  if (min_longer_side <= 0) {
+    return 0;
+  }
+  int best_id = 0;
+  int best_side = 0;
+  for (int i = 1; i < static_cast<int>(pages.size()); i++) {
+    const auto& page = pages[i];
+    const int side = std::max(page.size.width, page.size.height);
+    if (page.reduced_resolution && page.supported && side >= min_longer_side &&
+        (best_side == 0 || side < best_side)) {
+      best_id = i;
+      best_side = side;
+    }
+  }
+  return best_id;
+}
+
+TiledWriter::TiledWriter(const std::filesystem::path& path, cv::Size size,
+                         int tile_size, bool overviews)
+    : stream_(path, std::ios::binary | std::ios::trunc),
+      tile_size_(tile_size) {
+  CV_Assert(tile_size_ > 0 && tile_size_ % kTileAlignment == 0);
+  levels_.push_back({.size = size});
+  while (overviews && (size.width > tile_size_ || size.height > tile_size_)) {
+    size = {(size.width + 1) / 2, (size.height + 1) / 2};
+    levels_.push_back({.size = size});
+  }
+  for (int level = 0; level < levels_.size(); level++) {
+    levels_[level].tile_offsets.resize(static_cast<size_t>(TilesAcross(level)) *
+                                       TilesDown(level));
+  }
+  Write(stream_, kLittleEndian);
+  Write(stream_, kBigTiffVersion);
+  Write(stream_, kOffsetSize);
+  Write(stream_, std::uint16_t{0});
+  Write(stream_, std::uint64_t{0});  // IFD offset, patched by Close()
+}
+
+bool TiledWriter::IsOpen() const { return stream_.is_open() && !failed_; }
+
+int TiledWriter::TilesAcross(int level) const {
+  return (levels_[level].size.width + tile_size_ - 1) / tile_size_;
+}
+
+int TiledWriter::TilesDown(int level) const {
+  return (levels_[level].size.height + tile_size_ - 1) / tile_size_;
+}
+
+bool TiledWriter::WriteTile(cv::Point tile_tl, const cv::Mat& image,
+                            const cv::Mat& mask) {
+  CV_Assert(image.type() == CV_8UC3 && mask.type() == CV_8U &&
+            image.size() == mask.size());
+  CV_Assert(tile_tl.x % tile_size_ == 0 && tile_tl.y % tile_size_ == 0);
+  if (!IsOpen()) {
+    return false;
+  }
+
+  // Full tiles only, the pixels past the image border are transparent
+  cv::Mat tile = cv::Mat::zeros(tile_size_, tile_size_, CV_8UC4);
+  const cv::Rect valid(0, 0, std::min(image.cols, tile_size_),
+                       std::min(image.rows, tile_size_));
+  const std::array<cv::Mat, 2> sources = {image(valid), mask(valid)};
+  cv::Mat destination = tile(valid);
+  // BGR + mask -> RGBA
+  const std::array<int, 8> from_to = {0, 2, 1, 1, 2, 0, 3, 3};
+  cv::mixChannels(sources.data(), sources.size(), &destination, 1,
+                  from_to.data(), from_to.size() / 2);
+
+  return WriteLevelTile(0, tile_tl.y / tile_size_, tile_tl.x / tile_size_,
+                        tile);
+}
+
+bool TiledWriter::WriteLevelTile(int level, int tile_row, int tile_col,
+                                 const cv::Mat& tile) {
+  levels_[level].tile_offsets[tile_row * TilesAcross(level) + tile_col] =
+      static_cast<std::uint64_t>(stream_.tellp());
+  stream_.write(reinterpret_cast<const char*>(tile.data),
+                static_cast<std::streamsize>(tile.total() * tile.elemSize()));
+  failed_ = !stream_;
+  if (failed_) {
+    return false;
+  }
+  return AddToOverview(level, tile_row, tile_col, tile);
+}
+
+bool TiledWriter::AddToOverview(int level, int tile_row, int tile_col,
+                                const cv::Mat& tile) {
+  if (level + 1 >= levels_.size()) {
+    return true;
+  }
+  const int overview_row = tile_row / 2;
+  const int overview_col = tile_col / 2;
+  auto& pending =
+      levels_[level + 1]
+          .pending[overview_row * TilesAcross(level + 1) + overview_col];
+  if (pending.tile.empty()) {
+    pending.tile = cv::Mat::zeros(tile_size_, tile_size_, CV_8UC4);
+  }
+  const int half = tile_size_ / 2;
+  cv::Mat quadrant = pending.tile(
+      cv::Rect((tile_col % 2) * half, (tile_row % 2) * half, half, half));
+  cv::resize(tile, quadrant, quadrant.size(), 0.0, 0.0, cv::INTER_AREA);
+
+  // The tiles below the overview tile, fewer on the right / bottom border
+  const int num_children = std::min(2, TilesAcross(level) - 2 * overview_col) *
+                           std::min(2, TilesDown(level) - 2 * overview_row);
+  if (++pending.num_children < num_children) {
+    return true;
+  }
+  const cv::Mat overview = pending.tile;
+  levels_[level + 1].pending.erase(overview_row * TilesAcross(level + 1) +
+                                   overview_col);
+  return WriteLevelTile(level + 1, overview_row, overview_col, overview);
+}
+
+bool TiledWriter::Close() {
+  if (!IsOpen()) {
+    return false;
+  }
+
+  // Overview tiles above the tiles that were never written
+  for (int level = 1; level < levels_.size(); level++) {
+    auto& pending = levels_[level].pending;
+    while (!pending.empty()) {
+      auto node = pending.extract(pending.begin());
+      WriteLevelTile(level, node.key() / TilesAcross(level),
+                     node.key() % TilesAcross(level), node.mapped().tile);
+    }
+  }
+  if (!IsOpen()) {
+    return false;
+  }
+
+  const auto tile_bytes =
+      static_cast<std::uint64_t>(tile_size_) * tile_size_ * kChannels;
+  std::vector<std::vector<Entry>> directories;
+  for (int level = 0; level < levels_.size(); level++) {
+    const auto& tile_offsets = levels_[level].tile_offsets;
+    const auto num_tiles = static_cast<std::uint64_t>(tile_offsets.size());
+    // Out of line arrays, unless a single tile fits in the entry
+    const auto offsets_position = static_cast<std::uint64_t>(stream_.tellp());
+    for (auto offset : tile_offsets) {
+      Write(stream_, offset);
+    }
+    const auto byte_counts_position =
+        static_cast<std::uint64_t>(stream_.tellp());
+    for (std::uint64_t i = 0; i < num_tiles; i++) {
+      Write(stream_, tile_bytes);
+    }
+
+    std::vector<Entry> entries;
+    if (level > 0) {
+      entries.push_back(Long(Tag::kNewSubfileType, kReducedResolution));
+    }
+    const auto size = levels_[level].size;
+    const std::vector<Entry> image_entries = {
+        Long(Tag::kImageWidth, size.width),
+        Long(Tag::kImageLength, size.height),
+        {.tag = Tag::kBitsPerSample,
+         .type = Type::kShort,
+         .count = kChannels,
+         .shorts = {8, 8, 8, 8}},
+        Short(Tag::kCompression, kNoCompression),
+        Short(Tag::kPhotometric, kPhotometricRgb),
+        Short(Tag::kSamplesPerPixel, kChannels),
+        Short(Tag::kPlanarConfiguration, kPlanarContiguous),
+        Long(Tag::kTileWidth, tile_size_),
+        Long(Tag::kTileLength, tile_size_),
+        {.tag = Tag::kTileOffsets,
+         .type = Type::kLong8,
+         .count = num_tiles,
+         .value = num_tiles == 1 ? tile_offsets[0] : offsets_position},
+        {.tag = Tag::kTileByteCounts,
+         .type = Type::kLong8,
+         .count = num_tiles,
+         .value = num_tiles == 1 ? tile_bytes : byte_counts_position},
+        Short(Tag::kExtraSamples, kUnassociatedAlpha),
+    };
+    entries.insert(entries.end(), image_entries.begin(), image_entries.end());
+    directories.push_back(std::move(entries));
+  }
+
+  // The directories are chained, the main image first
+  const auto ifd_position = static_cast<std::uint64_t>(stream_.tellp());
+  auto next_position = ifd_position;
+  for (int i = 0; i < directories.size(); i++) {
+    const auto& entries = directories[i];
+    next_position += sizeof(std::uint64_t) + entries.size() * kEntrySize +
+                     sizeof(std::uint64_t);
+    Write(stream_, static_cast<std::uint64_t>(entries.size()));
+    for (const auto& entry : entries) {
+      WriteEntry(stream_, entry);
+    }
+    Write(stream_, i + 1 < directories.size() ? next_position
+                                              : std::uint64_t{0});
+  }
+
+  stream_.seekp(static_cast<std::streamoff>(kIfdOffsetPosition));
+  Write(stream_, ifd_position);
+  stream_.close();
+  failed_ = !stream_;
+  return !failed_;
+}
+
+}  // namespace xpano::utils::tiff
@@ -0,0 +1,121 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <opencv2/core.hpp>
+
+#include "xpano/utils/mapped_file.h"
+
+namespace xpano::utils::tiff {
+
+// Minimal streaming BigTIFF writer for images larger than the memory:
+//  - 8-bit RGBA, uncompressed square tiles, the alpha channel is the mask.
+//  - The tiles can be written in any order, only the tile offsets are kept
+//    in memory. The directory is written by Close().
+//  - Optional overviews, each level halves the previous one down to a single
+//    tile. An overview tile is written as soon as the tiles below it are,
+//    only the incomplete ones are kept in memory.
+class TiledWriter {
+ public:
+  // tile_size has to be a multiple of 16 (TIFF requirement)
+  TiledWriter(const std::filesystem::path& path, cv::Size size, int tile_size,
+              bool overviews = false);
+
+  [[nodiscard]] bool IsOpen() const;
+
+  // tile_tl is a multiple of tile_size, BGR image + 8-bit mask, the tiles on
+  // the right / bottom border can be smaller than tile_size
+  bool WriteTile(cv::Point tile_tl, const cv::Mat& image, const cv::Mat& mask);
+
+  // Returns false if any of the writes failed, the file is invalid then
+  bool Close();
+
+ private:
+  struct PendingTile {
+    cv::Mat tile;
+    int num_children = 0;
+  };
+
+  struct Level {
+    cv::Size size;
+    std::vector<std::uint64_t> tile_offsets;
+    // Overview tiles by index, waiting for the tiles of the level below
+    std::map<int, PendingTile> pending;
+  };
+
+  [[nodiscard]] int TilesAcross(int level) const;
+  [[nodiscard]] int TilesDown(int level) const;
+
+  // RGBA tile of tile_size x tile_size
+  bool WriteLevelTile(int level, int tile_row, int tile_col,
+                      const cv::Mat& tile);
+  bool AddToOverview(int level, int tile_row, int tile_col,
+                     const cv::Mat& tile);
+
+  std::ofstream stream_;
+  int tile_size_;
+  std::vector<Level> levels_;
+  bool failed_ = false;
+};
+
+struct Page {
+  cv::Size size;
+  // NewSubfileType: an overview of the main image
+  bool reduced_resolution = false;
+  // Readable by Reader::ReadRegion
+  bool supported = false;
+
+  // Tiles, or strips of full rows
+  cv::Size chunk_size;
+  int channels = 0;
+  int bits_per_sample = 0;
+  std::vector<std::uint64_t> chunk_offsets;
+  std::vector<std::uint64_t> chunk_byte_counts;
+};
+
+// Minimal TIFF / BigTIFF reader for images larger than the memory, e.g. from
+// scanning backs:
+//  - Only uncompressed 8 or 16-bit RGB(A) and grayscale pages in tiles or
+//    strips are supported, the callers fall back to cv::imread otherwise.
+//  - The file is mapped, reading a region touches only its tiles / strips.
+//  - The pages are the chained directories, usually the main image followed
+//    by its overviews, e.g. as written by TiledWriter.
+class Reader {
+ public:
+  // Nullptr if the file isn't a readable TIFF
+  [[nodiscard]] static std::unique_ptr<Reader> Open(
+      const std::filesystem::path& path);
+
+  [[nodiscard]] const std::vector<Page>& Pages() const { return pages_; }
+
+  // BGR, 8 or 16-bit as stored. Empty if the page isn't supported or the
+  // file is truncated.
+  [[nodiscard]] cv::Mat ReadRegion(int page_id, cv::Rect roi) const;
+  [[nodiscard]] cv::Mat Read(int page_id) const;
+
+ private:
+  Reader(std::unique_ptr<MappedFile> file, bool big_endian,
+         std::vector<Page> pages)
+      : file_(std::move(file)),
+        big_endian_(big_endian),
+        pages_(std::move(pages)) {}
+
+  std::unique_ptr<MappedFile> file_;
+  bool big_endian_;
+  std::vector<Page> pages_;
+};
+
+// The smallest supported overview with its longer side at least
+// min_longer_side, the main image (0) if there is none or min_longer_side is 0
+int PickPage(const std::vector<Page>& pages, int min_longer_side);
+
+}  // namespace xpano::utils::tiff
@@ -0,0 +1,182 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "xpano/utils/trace.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+#include <spdlog/fmt/fmt.h>
+#include <spdlog/spdlog.h>
+
+#include "xpano/constants.h"
+#include "xpano/utils/process.h"
+
+namespace xpano::utils::trace {
+
+namespace {
+
+struct Event {
+  const char* name;
+  std::int64_t start_us;
+  std::int64_t duration_us;
+  std::int64_t cpu_us;
+  std::int64_t rss_bytes;
+  int thread_id;
+};
+
+class Recorder {
+ public:
+  void Start() {
+    const std::lock_guard lock(mutex_);
+    events_.clear();
+    recording_ = true;
+  }
+
+  void Stop() { recording_ = false; }
+
+  [[nodiscard]] bool IsRecording() const {
+    return recording_.load(std::memory_order_relaxed);
+  }
+
+  void Add(const Event& event) {
+    const std::lock_guard lock(mutex_);
+    if (!recording_) {
+      return;
+    }
+    if (events_.size() >= kMaxTraceEvents) {
+      spdlog::warn("Trace is full, stopping the recording");
+      recording_ = false;
+      return;
+    }
+    events_.push_back(event);
+  }
+
+  [[nodiscard]] int Size() const {
+    const std::lock_guard lock(mutex_);
+    return static_cast<int>(events_.size());
+  }
+
+  [[nodiscard]] std::vector<Event> Events() const {
+    const std::lock_guard lock(mutex_);
+    return events_;
+  }
+
+ private:
+  std::atomic_bool recording_ = false;
+  mutable std::mutex mutex_;
+  std::vector<Event> events_;
+};
+
+Recorder& GetRecorder() {
+  static Recorder recorder;
+  return recorder;
+}
+
+// Small ids in the order the threads first record a span
+int ThreadId() {
+  static std::atomic_int next_id = 0;
+  thread_local const int kId = next_id++;
+  return kId;
+}
+
+}  // namespace
+
+void Start() { GetRecorder().Start(); }
+
+void Stop() { GetRecorder().Stop(); }
+
+bool IsRecording() { return GetRecorder().IsRecording(); }
+
+int NumEvents() { return GetRecorder().Size(); }
+
+std::int64_t NowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+bool Write(const std::filesystem::path& path) {
+  const auto events = GetRecorder().Events();
+  std::ofstream stream(path, std::ios::trunc);
+  stream << "{\"traceEvents\":[\n";
+  for (int i = 0; i < events.size(); i++) {
+    const auto& event = events[i];
+    stream << fmt::format(
+        "{{\"name\":\"{}\",\"cat\":\"xpano\",\"ph\":\"X\",\"ts\":{},"
+        "\"dur\":{},\"tdur\":{},\"pid\":1,\"tid\":{},"
+        "\"args\":{{\"rss_mb\":{:.1f}}}}}{}\n",
+        event.name, event.start_us, event.duration_us, event.cpu_us,
+        event.thread_id, static_cast<double>(event.rss_bytes) / kMegabyte,
+        i + 1 < events.size() ? "," : "");
+  }
+  stream << "],\"displayTimeUnit\":\"ms\"}\n";
+  stream.close();
+  if (!stream) {
+    spdlog::error("Failed to write the trace to {}", path.string());
+    return false;
+  }
+  spdlog::info("Written {} trace events to {}", events.size(), path.string());
+  return true;
+}
+
+std::vector<StageTotals> Totals(std::int64_t since_us) {
+  auto events = GetRecorder().Events();
+  std::erase_if(events, [since_us](const Event& event) {
+    return event.start_us < since_us;
+  });
+  std::sort(events.begin(), events.end(),
+            [](const Event& lhs, const Event& rhs) {
+              return lhs.start_us < rhs.start_us;
+            });
+
+  std::vector<StageTotals> totals;
+  // Index to the totals and the end of the last merged span
+  std::map<std::string_view, std::pair<int, std::int64_t>> stages;
+  for (const auto& event : events) {
+    const std::int64_t end_us = event.start_us + event.duration_us;
+    auto [stage, inserted] = stages.try_emplace(
+        event.name, static_cast<int>(totals.size()), event.start_us);
+    if (inserted) {
+      totals.push_back({.name = event.name});
+    }
+    auto& [index, merged_end_us] = stage->second;
+    auto& total = totals[index];
+    total.count++;
+    total.cpu_us += event.cpu_us;
+    total.peak_rss_bytes = std::max(total.peak_rss_bytes, event.rss_bytes);
+    total.wall_us += std::max<std::int64_t>(
+        0, end_us - std::max(event.start_us, merged_end_us));
+    merged_end_us = std::max(merged_end_us, end_us);
+  }
+  return totals;
+}
+
+Span::Span(const char* name) : name_(name) {
+  if (GetRecorder().IsRecording()) {
+    start_us_ = NowUs();
+    start_cpu_us_ = process::ThreadCpuUs();
+  }
+}
+
+Span::~Span() {
+  if (start_us_ < 0 || !GetRecorder().IsRecording()) {
+    return;
+  }
+  GetRecorder().Add({.name = name_,
+                     .start_us = start_us_,
+                     .duration_us = NowUs() - start_us_,
+                     .cpu_us = process::ThreadCpuUs() - start_cpu_us_,
+                     .rss_bytes = process::CurrentRssBytes().value_or(0),
+                     .thread_id = ThreadId()});
+}
+
+}  // namespace xpano::utils::trace
@@ -0,0 +1,57 @@
+// SPDX-FileCopyrightText: 2023 Tomas Krupka
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+namespace xpano::utils::trace {
+
+// Scoped spans of the pipeline stages, written out as a Chrome trace_event
+// JSON (chrome://tracing, Perfetto):
+//  - Off by default, a span then only checks a flag.
+//  - The spans of a thread nest by their timestamps.
+//  - Recording stops after kMaxTraceEvents spans.
+void Start();
+void Stop();
+[[nodiscard]] bool IsRecording();
+[[nodiscard]] int NumEvents();
+// Writes the spans finished so far, the recording goes on
+bool Write(const std::filesystem::path& path);
+
+struct StageTotals {
+  const char* name;
+  int count;
+  // Time covered by at least one span of the stage
+  std::int64_t wall_us;
+  // CPU time of the threads within the spans, summed
+  std::int64_t cpu_us;
+  // Highest resident set size of the process at the end of a span
+  std::int64_t peak_rss_bytes;
+};
+
+// Clock of the span timestamps
+[[nodiscard]] std::int64_t NowUs();
+
+// Spans finished so far grouped by name, in the order the stages started.
+// Only the spans started at since_us or later are counted.
+[[nodiscard]] std::vector<StageTotals> Totals(std::int64_t since_us = 0);
+
+class Span {
+ public:
+  // The name has to outlive the recording, e.g. a string literal
+  explicit Span(const char* name);
+  Span(const Span&) = delete;
+  Span& operator=(const Span&) = delete;
+  ~Span();
+
+ private:
+  const char* name_;
+  // Negative when not recording at the start
+  std::int64_t start_us_ = -1;
+  std::int64_t start_cpu_us_ = 0;
+};
+
+}  // namespace xpano::utils::trace